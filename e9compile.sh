@@ -66,6 +66,42 @@ CFLAGS="-fno-stack-protector -fno-builtin -fno-exceptions \
     -mno-mmx -mno-sse -mno-avx -mno-avx2 -mno-avx512f -msoft-float \
     -mstringop-strategy=loop -fno-tree-vectorize -fomit-frame-pointer \
     -I examples/"
+LDFLAGS="-pie -nostdlib \
+    -Wl,-z -Wl,max-page-size=4096 \
+    -Wl,-z -Wl,norelro \
+    -Wl,-z -Wl,stack-size=0 \
+    -Wl,--export-dynamic \
+    -Wl,--entry=0x0 \
+    -Wl,--strip-all"
+
+# Build cache: the key hashes the compiler version, all flags, and the
+# preprocessed source (i.e., including all headers).  The cache directory
+# is $E9COMPILE_CACHE (default ~/.cache/e9compile), or "off" to disable.
+CACHE="${E9COMPILE_CACHE:-${XDG_CACHE_HOME:-$HOME/.cache}/e9compile}"
+KEY=
+if [ "$CACHE" != "off" ] && command -v sha256sum > /dev/null 2>&1
+then
+    if [ "$EXTENSION" = "s" ]
+    then
+        PREPROCESS="cat \"$DIRNAME/$BASENAME.$EXTENSION\""
+    else
+        PREPROCESS="$CC $CFLAGS -E -P $@ \"$DIRNAME/$BASENAME.$EXTENSION\""
+    fi
+    if eval "$PREPROCESS" > /dev/null 2>&1
+    then
+        KEY=`( $CC --version; echo "$CFLAGS $LDFLAGS $*"; \
+            eval "$PREPROCESS" ) 2> /dev/null | sha256sum | cut -d' ' -f1`
+    fi
+fi
+if [ ! -z "$KEY" -a -f "$CACHE/$KEY" -a -f "$CACHE/$KEY.o" ]
+then
+    if cp "$CACHE/$KEY.o" "$BASENAME.o" && cp "$CACHE/$KEY" "$BASENAME"
+    then
+        echo "${GREEN}cached${OFF}: $BASENAME ($CACHE/$KEY)"
+        exit 0
+    fi
+fi
+
 COMPILE="$CC $CFLAGS -c -Wall $@ \"$DIRNAME/$BASENAME.$EXTENSION\""
 
 echo "$COMPILE" | xargs
@@ -77,14 +113,7 @@ then
     exit 1
 fi
 
-CFLAGS="-pie -nostdlib \
-    -Wl,-z -Wl,max-page-size=4096 \
-    -Wl,-z -Wl,norelro \
-    -Wl,-z -Wl,stack-size=0 \
-    -Wl,--export-dynamic \
-    -Wl,--entry=0x0 \
-    -Wl,--strip-all"
-COMPILE="$CC \"$BASENAME.o\" -o \"$BASENAME\" $CFLAGS"
+COMPILE="$CC \"$BASENAME.o\" -o \"$BASENAME\" $LDFLAGS"
 
 echo "$COMPILE" | xargs
 if ! eval "$COMPILE"
@@ -138,5 +167,14 @@ then
     fi
 fi
 
+if [ ! -z "$KEY" ] && mkdir -p "$CACHE" 2> /dev/null
+then
+    # Atomically add the files to the cache:
+    cp "$BASENAME.o" "$CACHE/$KEY.o.$$" && \
+        mv -f "$CACHE/$KEY.o.$$" "$CACHE/$KEY.o"
+    cp "$BASENAME" "$CACHE/$KEY.$$" && mv -f "$CACHE/$KEY.$$" "$CACHE/$KEY"
+    rm -f "$CACHE/$KEY.o.$$" "$CACHE/$KEY.$$"
+fi
+
 exit 0
 
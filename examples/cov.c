@@ -26,6 +26,10 @@
  * NOTES:
  *  The output file will NOT be generated if the program crashes or calls fast
  *  exit (e.g., _Exit()).
+ *
+ *  Edges are counted per-thread without locks (see e9_counters_add()), and
+ *  are merged when the program exits.  The rows of the output file are not
+ *  sorted.
  */
 
 #include "stdlib.c"
@@ -37,15 +41,12 @@ static bool option_tty = false;
 #define YELLOW      (option_tty? "\33[33m": "")
 #define OFF         (option_tty? "\33[0m" : "")
 
-typedef struct
-{
-    const uintptr_t from;
-    const uintptr_t to;
-    size_t count;
-} ENTRY;
+#define MAX_THREADS 4096                    // Max. number of threads.
 
-static void *COV = NULL;                    // Global state.
-static mutex_t mutex = MUTEX_INITIALIZER;   // Global mutex.
+static e9_counters_t *COV = NULL;           // Edge counters.
+static size_t capacity = 0;                 // Edge capacity (per thread).
+static bool dropped = false;                // Edges dropped?
+static mutex_t mutex = MUTEX_INITIALIZER;   // Global mutex (for fini).
 
 static char *output = NULL;                 // Output filename.
 static FILE *stream = NULL;                 // Output stream.
@@ -99,19 +100,6 @@ static uintptr_t bb_lookup(uintptr_t target)
     return BBs.data[lo];
 }
 
-/*
- * ENTRY compare.
- */
-static int compare(const void *n, const void *m)
-{
-    const ENTRY *a = (ENTRY *)n, *b = (ENTRY *)m;
-    if (a->from != b->from)
-        return (a->from < b->from? -1: 1);
-    if (a->to != b->to)
-        return (a->to < b->to? -1: 1);
-    return 0;
-}
-
 /*
  * Entry point.
  */
@@ -120,24 +108,9 @@ void entry(const void *bb, const void *next)
     uintptr_t to   = (uintptr_t)next;
     uintptr_t from = (uintptr_t)bb;
     to = bb_lookup(to);
-    ENTRY key = {from, to, 0};  
-
-    if (!LOCK())
-        return;
 
-    void *node   = tfind(&key, &COV, compare);
-    ENTRY *entry = (node != NULL? *(ENTRY **)node: NULL);
-    if (entry == NULL)
-    {
-        entry = (ENTRY *)malloc(sizeof(ENTRY));
-        if (entry == NULL)
-            error("failed to allocate memory: %s", strerror(errno));
-        memcpy(entry, &key, sizeof(ENTRY));
-        (void)tsearch(entry, &COV, compare);
-    }
-    entry->count++;
-
-    UNLOCK();
+    if (!e9_counters_add(COV, from, to, 1))
+        dropped = true;
 }
 
 /*
@@ -188,34 +161,40 @@ void init(int argc, char **argv, char **envp)
 
     if (asprintf(&output, "%s.COV.csv", progname) < 0)
         error("failed to create output filename: %s", strerror(errno));
+
+    capacity = 4 * BBs.size;
+    capacity = (capacity < 0x10000? 0x10000: capacity);
+    COV = e9_counters_create(MAX_THREADS, capacity);
+    if (COV == NULL)
+        error("failed to create edge counters: %s", strerror(errno));
 }
 
 /*
  * Fini.
  */
-void print(const void *node, const VISIT which, const int depth)
-{
-    ENTRY *entry = *(ENTRY **)node;
-    switch (which)
-    {
-        case postorder: case leaf:
-            fprintf(stream, "%p,%p,%zu\n",
-                (void *)entry->from, (void *)entry->to, entry->count);
-            break;
-        default:
-            break;
-    }
-}
 void fini(void)
 {
     LOCK();
+    e9_hmap_t *edges = e9_hmap_create(4 * capacity);
+    if (edges == NULL)
+        error("failed to create edge map: %s", strerror(errno));
+    if (!e9_counters_merge(COV, edges))
+        dropped = true;
     stream = fopen(output, "w");
     if (stream == NULL)
         error("failed to open file \"%s%s%s\" for writing: %s",
             YELLOW, output, OFF, strerror(errno));
     fputs("from,to,count\n", stream);
-    twalk(COV, print);
+    e9_hmap_entry_t *entry;
+    size_t i = 0;
+    while ((entry = e9_hmap_next(edges, &i)) != NULL)
+        fprintf(stream, "%p,%p,%zu\n",
+            (void *)entry->key[0], (void *)entry->key[1], entry->value);
     fclose(stream);
+    e9_hmap_destroy(edges);
+    if (dropped)
+        fprintf(stderr, "%sCOV%s: %swarning%s: some edges were dropped "
+            "(too many edges)\n", GREEN, OFF, YELLOW, OFF);
     fprintf(stderr, "%sCOV%s: saved edge coverage information to "
         "\"%s%s%s\"\n", GREEN, OFF, YELLOW, output, OFF);
     UNLOCK();
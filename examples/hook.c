@@ -0,0 +1,36 @@
+/*
+ * HOOK instrumentation.
+ */
+
+/*
+ * Function entry/exit tracing.  Prints each function entry and exit
+ * (indented by the call depth) to stderr.  The exit is instrumented by the
+ * `hook' trampoline, which only patches the function entry.
+ *
+ * EXAMPLE USAGE:
+ *  $ e9compile hook.c
+ *  $ e9tool -M F.entry -P 'enter(addr)@hook' -P 'hook leave@hook' xterm
+ *  $ ./a.out
+ */
+
+#include "stdlib.c"
+
+/*
+ * The call depth (not thread-safe).
+ */
+static int depth = 0;
+
+/*
+ * Entry Points.
+ */
+void enter(const void *addr)
+{
+    fprintf(stderr, "%*s-> %p\n", 2 * depth, "", addr);
+    depth++;
+}
+
+void leave(const void *addr, intptr_t rax)
+{
+    depth--;
+    fprintf(stderr, "%*s<- %p = 0x%lx\n", 2 * depth, "", addr, rax);
+}
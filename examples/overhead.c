@@ -0,0 +1,59 @@
+/*
+ * OVERHEAD instrumentation.
+ */
+
+/*
+ * Counts the number of patched-site executions, for measuring the runtime
+ * overhead of rewritten code (see overhead.sh).  The count is printed to
+ * stderr at exit.  There is one entry point for each call ABI:
+ *
+ *  - entry():        for the clean ABI.
+ *  - entry_naked():  for the naked ABI.  This saves %rflags itself, since
+ *                    the naked ABI does not.
+ *  - entry_state():  for the state argument.
+ *
+ * EXAMPLE USAGE:
+ *  $ e9compile overhead.c
+ *  $ e9tool -M jmp -P 'entry()@overhead' xterm
+ *  $ e9tool -M jmp -P 'entry_naked<naked>()@overhead' xterm
+ *  $ e9tool -M jmp -P 'entry_state(state)@overhead' xterm
+ *  $ ./a.out
+ */
+
+#include "stdlib.c"
+
+/*
+ * The counter.
+ */
+size_t counter = 0;
+
+/*
+ * Entry Points.
+ */
+void entry(void)
+{
+    counter++;
+}
+
+asm (
+    ".globl entry_naked\n"
+    ".type entry_naked, @function\n"
+    "entry_naked:\n"
+    "\tpushfq\n"
+    "\tincq counter(%rip)\n"
+    "\tpopfq\n"
+    "\tretq\n"
+);
+
+void entry_state(const void *state)
+{
+    counter++;
+}
+
+/*
+ * Fini.
+ */
+void fini(void)
+{
+    fprintf(stderr, "sites=%zu\n", counter);
+}
@@ -0,0 +1,127 @@
+#!/bin/bash
+#
+# Runtime overhead benchmark.  Rewrites the CPU-bound kernels from
+# overhead_kernels.c with:
+#
+#   (1) each tactic forced (B0=trap, B1, B2, T1, T2, T3),
+#   (2) each -O level (0, 1, 2, 3, s), and
+#   (3) each call ABI (clean, naked, state),
+#
+# and reports the cycles per patched-site execution, i.e.:
+#
+#   (cycles(rewritten) - cycles(original)) / #site-executions
+#
+# The other parameters are kept at the default (all tactics, -O2, naked),
+# so each table varies one dimension.  Run from the E9Patch root directory.
+#
+
+if [ -t 1 ]
+then
+    RED="\033[31m"
+    GREEN="\033[32m"
+    YELLOW="\033[33m"
+    BOLD="\033[1m"
+    OFF="\033[0m"
+else
+    RED=
+    GREEN=
+    YELLOW=
+    BOLD=
+    OFF=
+fi
+
+if [ $# -gt 1 ]
+then
+    echo "usage: $0 [ITERATIONS]" >&2
+    exit 1
+fi
+N=${1:-10000000}
+
+set -e
+mkdir -p tmp
+gcc -O2 -o tmp/overhead_kernels examples/overhead_kernels.c
+./e9compile.sh examples/overhead.c >/dev/null
+set +e
+
+KERNELS="loop indirect memory"
+TACTICS="B0 B1 B2 T1 T2 T3"
+MATCH='F.name == /kernel_.*/'
+NAKED='entry_naked<naked>()@overhead'
+
+# Get the cycles from a kernel run.
+cycles()
+{
+    "$@" 2>/dev/null | sed -n 's/^cycles=\([0-9]*\).*/\1/p'
+}
+
+# Run one configuration: KERNEL NAME PATCH [E9TOOL OPTIONS...]
+measure()
+{
+    local KERNEL=$1
+    local NAME=$2
+    local PATCH=$3
+    shift 3
+    if ! ./e9tool -M "$MATCH" -P "$PATCH" "$@" -o tmp/overhead.out \
+            tmp/overhead_kernels > tmp/overhead.log 2>&1
+    then
+        printf "%-10s %-10s ${RED}FAILED${OFF} (see tmp/overhead.log)\n" \
+            "$KERNEL" "$NAME"
+        return
+    fi
+    local PATCHED=`sed -n 's/^num_patched *= *\([0-9]* \/ [0-9]*\).*/\1/p' \
+        tmp/overhead.log`
+    tmp/overhead.out $KERNEL $N > tmp/overhead.stdout 2> tmp/overhead.stderr
+    local CYCLES=`sed -n 's/^cycles=\([0-9]*\).*/\1/p' tmp/overhead.stdout`
+    local SITES=`sed -n 's/^sites=\([0-9]*\).*/\1/p' tmp/overhead.stderr`
+    if [ "$CYCLES" = "" -o "$SITES" = "" -o "$SITES" = "0" ]
+    then
+        printf "%-10s %-10s ${RED}FAILED${OFF} (no site executions)\n" \
+            "$KERNEL" "$NAME"
+        return
+    fi
+    local COST=`awk "BEGIN {printf \"%.2f\", ($CYCLES - $BASE) / $SITES}"`
+    printf "%-10s %-10s %14s %14s %12s  %s\n" "$KERNEL" "$NAME" "$CYCLES" \
+        "$SITES" "$COST" "$PATCHED"
+}
+
+header()
+{
+    echo
+    echo -e "${BOLD}$1${OFF}"
+    printf "%-10s %-10s %14s %14s %12s  %s\n" KERNEL CONFIG CYCLES SITES \
+        CYCLES/SITE PATCHED
+}
+
+for KERNEL in $KERNELS
+do
+    BASE=`cycles tmp/overhead_kernels $KERNEL $N`
+    echo
+    echo -e "${YELLOW}$KERNEL${OFF}: baseline cycles=$BASE"
+
+    header "(1) tactics (-O2, naked)"
+    for TACTIC in $TACTICS
+    do
+        OPTIONS=
+        for T in $TACTICS
+        do
+            if [ $T = $TACTIC ]
+            then
+                OPTIONS="$OPTIONS --option --tactic-$T=true"
+            else
+                OPTIONS="$OPTIONS --option --tactic-$T=false"
+            fi
+        done
+        measure $KERNEL $TACTIC "$NAKED" $OPTIONS
+    done
+
+    header "(2) optimization levels (all tactics, naked)"
+    for LEVEL in 0 1 2 3 s
+    do
+        measure $KERNEL -O$LEVEL "$NAKED" -O$LEVEL
+    done
+
+    header "(3) call ABIs (all tactics, -O2)"
+    measure $KERNEL clean 'entry<clean>()@overhead'
+    measure $KERNEL naked "$NAKED"
+    measure $KERNEL state 'entry_state(state)@overhead'
+done
@@ -0,0 +1,111 @@
+/*
+ * CPU-bound kernels for measuring the runtime overhead of rewritten code
+ * (see overhead.sh).  Only the kernel_* functions are meant to be patched.
+ *
+ * Usage: overhead_kernels {loop,indirect,memory} [ITERATIONS]
+ *
+ * The kernel's cycle count (rdtsc) is printed to stdout.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <x86intrin.h>
+
+#define MEMORY_SIZE     (1 << 22)
+
+/*
+ * Arithmetic loop.
+ */
+__attribute__((__noinline__)) uint64_t kernel_loop(uint64_t n)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        x += i;
+    }
+    return x;
+}
+
+/*
+ * Indirect calls.
+ */
+__attribute__((__noinline__)) static uint64_t op_add(uint64_t x)
+{
+    return x + 7;
+}
+__attribute__((__noinline__)) static uint64_t op_mul(uint64_t x)
+{
+    return x * 3;
+}
+__attribute__((__noinline__)) static uint64_t op_xor(uint64_t x)
+{
+    return x ^ 0x55;
+}
+__attribute__((__noinline__)) static uint64_t op_rot(uint64_t x)
+{
+    return (x << 1) | (x >> 63);
+}
+static uint64_t (*volatile ops[])(uint64_t) = {op_add, op_mul, op_xor, op_rot};
+
+__attribute__((__noinline__)) uint64_t kernel_indirect(uint64_t n)
+{
+    uint64_t x = 1;
+    for (uint64_t i = 0; i < n; i++)
+        x = ops[(x ^ i) & 3](x);
+    return x;
+}
+
+/*
+ * Memory-heavy code (dependent loads & stores over a 32MB buffer).
+ */
+__attribute__((__noinline__)) uint64_t kernel_memory(uint64_t n,
+    uint64_t *buf)
+{
+    uint64_t x = 0;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint64_t j = (x + i * 0x9E3779B1) & (MEMORY_SIZE - 1);
+        x += buf[j];
+        buf[j] = x;
+    }
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s {loop,indirect,memory} [ITERATIONS]\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+    uint64_t n = (argc > 2? strtoull(argv[2], NULL, 0): 10000000);
+    uint64_t *buf = (uint64_t *)calloc(MEMORY_SIZE, sizeof(uint64_t));
+    if (buf == NULL)
+        return EXIT_FAILURE;
+    for (uint64_t i = 0; i < MEMORY_SIZE; i++)
+        buf[i] = i;
+
+    uint64_t r = 0, start = __rdtsc();
+    if (strcmp(argv[1], "loop") == 0)
+        r = kernel_loop(n);
+    else if (strcmp(argv[1], "indirect") == 0)
+        r = kernel_indirect(n);
+    else if (strcmp(argv[1], "memory") == 0)
+        r = kernel_memory(n, buf);
+    else
+    {
+        fprintf(stderr, "unknown kernel \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    uint64_t end = __rdtsc();
+    printf("cycles=%llu result=%llu\n", (unsigned long long)(end - start),
+        (unsigned long long)r);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * PERSISTENT MODE instrumentation.
+ */
+
+/*
+ * Loops a target function for AFL-style persistent mode fuzzing.  This is
+ * intended to be used together with the loader's fork-server (see the
+ * E9Patch `--loader-fork-server' option).
+ *
+ * EXAMPLE USAGE:
+ *  $ e9compile persistent.c
+ *  $ e9tool -M 'addr==0x1234' -P 'entry(state)@persistent' \
+ *        -M 'addr==0x1290' -P 'if loop(state)@persistent goto' \
+ *        --option --loader-fork-server prog
+ *  $ afl-fuzz -i in -o out -- ./a.out @@
+ *
+ * Here 0x1234 is the entry address of the target function, and 0x1290 is
+ * the function's return instruction (for functions with multiple return
+ * instructions, match all of them).
+ *
+ * NOTES:
+ *  On the first call, entry() saves the register state of the target
+ *  function.  When the function returns, loop() stops the process (SIGSTOP)
+ *  so that the fork-server reports the result and waits for the next input.
+ *  Once resumed (SIGCONT), the function is restarted with the saved register
+ *  state.  After PERSISTENT iterations (default 1000), the function returns
+ *  normally, and the fork-server will fork a fresh process for the next run.
+ *
+ *  The target function must read a fresh input on each call (e.g., by
+ *  re-opening the input file), and should not depend on any global state
+ *  that it modifies.
+ */
+
+#include "stdlib.c"
+
+/*
+ * AFL detects persistent mode by searching the binary for this signature.
+ */
+const char e9_afl_persistent_sig[] __attribute__((__used__)) =
+    "##SIG_AFL_PERSISTENT##";
+
+static struct STATE saved;                  // Saved register state
+static const void *start = NULL;            // Target function entry
+static size_t count = 0;                    // Iteration count
+static size_t max = 1000;                   // Max. iterations
+
+/*
+ * Function entry: save the register state on the first call.
+ */
+void entry(const struct STATE *state)
+{
+    if (start != NULL)
+        return;
+    memcpy(&saved, state, sizeof(saved));
+    start = (const void *)state->rip;
+}
+
+/*
+ * Function return: either restart the function, or return normally.
+ */
+const void *loop(struct STATE *state)
+{
+    if (start == NULL || ++count >= max)
+        return NULL;
+    raise(SIGSTOP);
+    int64_t rip = state->rip;
+    memcpy(state, &saved, sizeof(saved));
+    state->rip = rip;                       // %rip cannot be modified
+    return start;
+}
+
+/*
+ * Init.
+ */
+void init(int argc, char **argv, char **envp)
+{
+    environ = envp;
+    const char *val = getenv("PERSISTENT");
+    if (val != NULL)
+        max = (size_t)atoll(val);
+    max = (max == 0? 1: max);
+}
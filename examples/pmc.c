@@ -0,0 +1,72 @@
+/*
+ * PMC instrumentation.
+ */
+
+/*
+ * Function-level hardware performance counter profiling.  At each function
+ * entry, the cycles, instructions, and last-level cache misses since the
+ * previous function entry are attributed to the previous function.  The
+ * profile is printed (CSV) to stderr at exit.
+ *
+ * The counter deltas are read by the `pmc[i]' trampoline arguments, using
+ * user-space rdpmc where permitted.  Only the main thread is counted.
+ *
+ * EXAMPLE USAGE:
+ *  $ e9compile pmc.c
+ *  $ e9tool -M F.entry -P 'entry(addr,pmc[0],pmc[1],pmc[2])@pmc' xterm
+ *  $ ./a.out
+ */
+
+#include "stdlib.c"
+
+#define CAPACITY    0x10000
+
+static const char names[][16] = {"cycles", "instructions", "llc-misses"};
+
+static e9_hmap_t *profile = NULL;
+static const void *prev   = NULL;
+
+/*
+ * Entry Point.
+ */
+void entry(const void *addr, uint64_t cycles, uint64_t instrs,
+    uint64_t misses)
+{
+    if (prev != NULL)
+    {
+        size_t *count;
+        if ((count = e9_hmap_get(profile, (uintptr_t)prev, 0)) != NULL)
+            *count += cycles;
+        if ((count = e9_hmap_get(profile, (uintptr_t)prev, 1)) != NULL)
+            *count += instrs;
+        if ((count = e9_hmap_get(profile, (uintptr_t)prev, 2)) != NULL)
+            *count += misses;
+    }
+    prev = addr;
+}
+
+/*
+ * Init.
+ */
+void init(void)
+{
+    profile = e9_hmap_create(CAPACITY);
+    if (profile == NULL)
+        panic("failed to create profile map");
+    if (e9_pmc_init() == 0)
+        fprintf(stderr, "PMC: warning: failed to open any performance "
+            "counters: %s\n", strerror(errno));
+}
+
+/*
+ * Fini.
+ */
+void fini(void)
+{
+    fputs("function,counter,count\n", stderr);
+    e9_hmap_entry_t *entry;
+    size_t i = 0;
+    while ((entry = e9_hmap_next(profile, &i)) != NULL)
+        fprintf(stderr, "%p,%s,%zu\n", (void *)entry->key[0],
+            names[entry->key[1]], entry->value);
+}
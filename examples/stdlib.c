@@ -1598,6 +1598,523 @@ static pid_t fork(void)
     return child;
 }
 
+/****************************************************************************/
+/* TLS                                                                      */
+/****************************************************************************/
+
+/*
+ * These are not part of libc, but are essential functionality.
+ *
+ * If the patched binary reserves a per-thread instrumentation block (see
+ * the E9Tool `--tls' option), the E9Patch loader allocates one for the main
+ * thread and points %gs to it.  Instrumentation data starts at
+ * %gs:E9_TLS_DATA, so trampolines can access it with a single instruction.
+ *
+ * Threads inherit %gs from the parent thread, so e9_tls() lazily allocates
+ * a fresh block whenever the block's owner is not the current thread.  Code
+ * that accesses %gs directly must therefore call e9_tls() at least once per
+ * thread.  Blocks are never freed.
+ *
+ * WARNING: e9_tls() will crash if the binary has no per-thread block.
+ */
+
+#define E9_TLS_DATA                     0x20
+#define ARCH_SET_GS                     0x1001
+
+struct e9_tls_s
+{
+    struct e9_tls_s *self;
+    uintptr_t owner;
+    uint64_t size;
+    uint64_t __reserved;
+};
+
+static __attribute__((__noinline__)) void *e9_tls_alloc(uintptr_t self)
+{
+    uint64_t size;
+    asm volatile (
+        "mov %%gs:0x10,%0\n" : "=r"(size)
+    );
+    struct e9_tls_s *block = (struct e9_tls_s *)mmap(NULL,
+        E9_TLS_DATA + size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+        panic("mmap() failed");
+    block->self  = block;
+    block->owner = self;
+    block->size  = size;
+    if (syscall(SYS_arch_prctl, ARCH_SET_GS, block) < 0)
+        panic("arch_prctl() failed");
+    return (uint8_t *)block + E9_TLS_DATA;
+}
+
+static void *e9_tls(void)
+{
+    uintptr_t self, owner;
+    struct e9_tls_s *block;
+    asm volatile (
+        "mov %%fs:0x0,%0\n"
+        "mov %%gs:0x8,%1\n"
+        "mov %%gs:0x0,%2\n" : "=r"(self), "=r"(owner), "=r"(block)
+    );
+    if (owner != self)
+        return e9_tls_alloc(self);
+    return (uint8_t *)block + E9_TLS_DATA;
+}
+
+/****************************************************************************/
+/* HASH MAP                                                                 */
+/****************************************************************************/
+
+/*
+ * These are not part of libc, but are useful for instrumentation.
+ *
+ * A lock-free open-addressing (linear probing) hash map from two-word keys
+ * to size_t values.  Entries can be inserted and updated concurrently from
+ * any thread (or signal handler) without locks, since each key is claimed
+ * with a single 16-byte compare-and-swap (cmpxchg16b).  Entries are never
+ * removed.  The capacity is fixed when the map is created, and
+ * e9_hmap_get() returns NULL once the map is full.  The memory is reserved
+ * with MAP_NORESERVE, so a generous capacity only costs the pages touched.
+ *
+ * Key word key[0] must be non-zero.
+ *
+ * Counters shared by many threads still contend on the same cache line.
+ * The e9_counters_*() functions below avoid this by keeping one map per
+ * thread, which are merged on demand.
+ */
+
+struct e9_hmap_entry_s
+{
+    uintptr_t key[2];
+    size_t value;
+    size_t __reserved;                  // Keeps entries 16-byte aligned
+};
+typedef struct e9_hmap_entry_s e9_hmap_entry_t;
+
+struct e9_hmap_s
+{
+    size_t mask;                        // Capacity - 1
+    size_t __reserved;
+    e9_hmap_entry_t entries[];
+};
+typedef struct e9_hmap_s e9_hmap_t;
+
+static e9_hmap_t *e9_hmap_create(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    e9_hmap_t *map = (e9_hmap_t *)mmap(NULL,
+        sizeof(e9_hmap_t) + size * sizeof(e9_hmap_entry_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    map->mask = size - 1;
+    return map;
+}
+
+static void e9_hmap_destroy(e9_hmap_t *map)
+{
+    (void)munmap(map,
+        sizeof(e9_hmap_t) + (map->mask + 1) * sizeof(e9_hmap_entry_t));
+}
+
+static size_t e9_hmap_hash(uintptr_t k0, uintptr_t k1)
+{
+    uint64_t h = (uint64_t)k0 * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)k1 + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 29;
+    return (size_t)h;
+}
+
+static bool e9_hmap_cas(e9_hmap_entry_t *entry, uintptr_t *expected,
+    uintptr_t k0, uintptr_t k1)
+{
+    bool ok;
+    asm volatile (
+        "lock cmpxchg16b %1\n"
+        "sete %0\n"
+        : "=q"(ok), "+m"(entry->key), "+a"(expected[0]), "+d"(expected[1])
+        : "b"(k0), "c"(k1)
+        : "memory", "cc");
+    return ok;
+}
+
+static size_t *e9_hmap_lookup(e9_hmap_t *map, uintptr_t k0, uintptr_t k1,
+    bool insert)
+{
+    size_t i = e9_hmap_hash(k0, k1);
+    for (size_t n = 0; n <= map->mask; n++, i++)
+    {
+        e9_hmap_entry_t *entry = map->entries + (i & map->mask);
+        uintptr_t key[2];
+        key[0] = __atomic_load_n(&entry->key[0], __ATOMIC_ACQUIRE);
+        if (key[0] == 0)
+        {
+            if (!insert)
+                return NULL;
+            key[1] = 0;
+            if (e9_hmap_cas(entry, key, k0, k1))
+                return &entry->value;
+            // Lost the race; key[] is the winning key.
+        }
+        else
+            key[1] = entry->key[1];
+        if (key[0] == k0 && key[1] == k1)
+            return &entry->value;
+    }
+    return NULL;
+}
+
+/*
+ * Find the value for the key (k0, k1), or NULL if there is no such entry.
+ */
+static size_t *e9_hmap_find(e9_hmap_t *map, uintptr_t k0, uintptr_t k1)
+{
+    return e9_hmap_lookup(map, k0, k1, /*insert=*/false);
+}
+
+/*
+ * Find the value for the key (k0, k1), inserting a zero-valued entry if
+ * there is no such entry.  Returns NULL if the map is full.
+ */
+static size_t *e9_hmap_get(e9_hmap_t *map, uintptr_t k0, uintptr_t k1)
+{
+    return e9_hmap_lookup(map, k0, k1, /*insert=*/true);
+}
+
+/*
+ * Iterate over all entries, where *i is the iterator (initially 0).
+ * Returns NULL after the last entry.
+ */
+static e9_hmap_entry_t *e9_hmap_next(e9_hmap_t *map, size_t *i)
+{
+    while (*i <= map->mask)
+    {
+        e9_hmap_entry_t *entry = map->entries + (*i)++;
+        if (__atomic_load_n(&entry->key[0], __ATOMIC_ACQUIRE) != 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Per-thread counters.  Each thread adds to its own private map, so hot
+ * counters need neither atomic read-modify-write operations nor shared
+ * cache lines.  Thread maps are found using the thread pointer (%fs:0x0,
+ * as set by libc), and are created on first use.  Counts that do not fit
+ * in a thread map are added (atomically) to a shared map instead.
+ *
+ * e9_counters_merge() sums all counters into a single map, e.g., at exit.
+ * Counts added concurrently with the merge may or may not be included.
+ */
+
+struct e9_counters_s
+{
+    e9_hmap_t *threads;                 // Thread pointer -> thread map
+    e9_hmap_t *shared;                  // Shared (overflow) map
+    size_t capacity;                    // Thread map capacity
+};
+typedef struct e9_counters_s e9_counters_t;
+
+static e9_counters_t *e9_counters_create(size_t max_threads,
+    size_t capacity)
+{
+    e9_counters_t *ctrs = (e9_counters_t *)mmap(NULL, sizeof(e9_counters_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ctrs == MAP_FAILED)
+        return NULL;
+    ctrs->threads  = e9_hmap_create(2 * max_threads);
+    ctrs->shared   = e9_hmap_create(capacity);
+    ctrs->capacity = capacity;
+    if (ctrs->threads == NULL || ctrs->shared == NULL)
+        return NULL;
+    return ctrs;
+}
+
+static e9_hmap_t *e9_counters_thread(e9_counters_t *ctrs)
+{
+    uintptr_t self;
+    asm volatile (
+        "mov %%fs:0x0,%0\n" : "=r"(self)
+    );
+    size_t *slot = e9_hmap_get(ctrs->threads, self, 0);
+    if (slot == NULL)
+        return NULL;
+    size_t map = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (map != 0)
+        return (e9_hmap_t *)map;
+    e9_hmap_t *new_map = e9_hmap_create(ctrs->capacity);
+    if (new_map == NULL)
+        return NULL;
+    if (!__atomic_compare_exchange_n(slot, &map, (size_t)new_map, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        // Lost a race with a signal handler on this thread.
+        e9_hmap_destroy(new_map);
+        return (e9_hmap_t *)map;
+    }
+    return new_map;
+}
+
+/*
+ * Add n to the counter for the key (k0, k1).  Returns false if the count
+ * was dropped (all maps are full).
+ */
+static bool e9_counters_add(e9_counters_t *ctrs, uintptr_t k0, uintptr_t k1,
+    size_t n)
+{
+    e9_hmap_t *map = e9_counters_thread(ctrs);
+    size_t *count = (map != NULL? e9_hmap_get(map, k0, k1): NULL);
+    if (count != NULL)
+    {
+        // Only this thread writes, but the merge may read concurrently:
+        __atomic_store_n(count, *count + n, __ATOMIC_RELAXED);
+        return true;
+    }
+    count = e9_hmap_get(ctrs->shared, k0, k1);
+    if (count == NULL)
+        return false;
+    __atomic_fetch_add(count, n, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * Sum all counters into the map dst.  Returns false if dst is full.
+ */
+static bool e9_counters_merge(e9_counters_t *ctrs, e9_hmap_t *dst)
+{
+    e9_hmap_entry_t *entry, *thread;
+    size_t i = 0;
+    bool ok = true;
+    while ((thread = e9_hmap_next(ctrs->threads, &i)) != NULL)
+    {
+        e9_hmap_t *map = (e9_hmap_t *)__atomic_load_n(&thread->value,
+            __ATOMIC_ACQUIRE);
+        if (map == NULL)
+            continue;
+        size_t j = 0;
+        while ((entry = e9_hmap_next(map, &j)) != NULL)
+        {
+            size_t *count = e9_hmap_get(dst, entry->key[0], entry->key[1]);
+            if (count == NULL)
+                ok = false;
+            else
+                *count += __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+        }
+    }
+    i = 0;
+    while ((entry = e9_hmap_next(ctrs->shared, &i)) != NULL)
+    {
+        size_t *count = e9_hmap_get(dst, entry->key[0], entry->key[1]);
+        if (count == NULL)
+            ok = false;
+        else
+            *count += __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+/****************************************************************************/
+/* PERFORMANCE COUNTERS                                                     */
+/****************************************************************************/
+
+/*
+ * These are not part of libc, but are useful for instrumentation.
+ *
+ * Hardware performance counters via perf_event_open().  Each counter is
+ * opened into a slot [0..E9_PMC_MAX), and its perf mmap page is mapped so
+ * that the counter can be read from user space with a single rdpmc
+ * instruction (no system call).  If user-space rdpmc is not permitted
+ * (see /sys/bus/event_source/devices/cpu/rdpmc), e9_pmc_read() falls back
+ * to read().
+ *
+ * e9_pmc_init() opens the default slots (cycles, instructions, and
+ * last-level cache misses), and should be called from the init() function.
+ * Counters only count user-space events of the calling thread.
+ *
+ * The e9_pmc_delta_<i>() functions implement the E9Tool `pmc[i]' call
+ * trampoline argument.  These clobber %rax and %rflags only, so they can be
+ * called directly from the trampoline without saving any other registers.
+ * The delta is relative to the previous e9_pmc_delta_<i>() call (i.e., the
+ * previous `pmc[i]' argument from any instrumentation point).
+ */
+
+#define E9_PMC_MAX                      4
+
+#define E9_PMC_CYCLES                   0
+#define E9_PMC_INSTRUCTIONS             1
+#define E9_PMC_LLC_MISSES               2
+
+#define PERF_TYPE_HARDWARE              0
+#define PERF_TYPE_HW_CACHE              3
+#define PERF_COUNT_HW_CPU_CYCLES        0
+#define PERF_COUNT_HW_INSTRUCTIONS      1
+#define PERF_COUNT_HW_CACHE_MISSES      3
+
+#define PERF_ATTR_DISABLED              (1ull << 0)
+#define PERF_ATTR_PINNED                (1ull << 2)
+#define PERF_ATTR_EXCLUDE_KERNEL        (1ull << 5)
+#define PERF_ATTR_EXCLUDE_HV            (1ull << 6)
+#define PERF_ATTR_SIZE_VER0             64
+
+#define PERF_CAP_USER_RDPMC             (1ull << 2)
+#define PERF_FLAG_FD_CLOEXEC            (1ul << 3)
+
+struct perf_event_attr
+{
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;                     // PERF_ATTR_* bits
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+};
+
+struct perf_event_mmap_page
+{
+    uint32_t version;
+    uint32_t compat_version;
+    uint32_t lock;                      // Seqlock
+    uint32_t index;                     // rdpmc index + 1 (0=unavailable)
+    int64_t offset;                     // Added to the rdpmc value
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t capabilities;              // PERF_CAP_* bits
+    uint16_t pmc_width;                 // rdpmc value width (bits)
+};
+
+static int e9_pmc_fd[E9_PMC_MAX] = {-1, -1, -1, -1};
+static volatile struct perf_event_mmap_page *e9_pmc_page[E9_PMC_MAX];
+static uint64_t e9_pmc_last[E9_PMC_MAX];
+
+/*
+ * Open a counter into slot i.  Returns 0 on success, or -1 on error.
+ */
+static int e9_pmc_open(unsigned i, uint32_t type, uint64_t config)
+{
+    if (i >= E9_PMC_MAX || e9_pmc_fd[i] >= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct perf_event_attr attr = {0};
+    attr.type   = type;
+    attr.size   = PERF_ATTR_SIZE_VER0;
+    attr.config = config;
+    attr.flags  = PERF_ATTR_PINNED | PERF_ATTR_EXCLUDE_KERNEL |
+        PERF_ATTR_EXCLUDE_HV;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, /*pid=*/0,
+        /*cpu=*/-1, /*group_fd=*/-1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    void *page = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    e9_pmc_page[i] = (volatile struct perf_event_mmap_page *)page;
+    e9_pmc_fd[i]   = fd;
+    return 0;
+}
+
+static __attribute__((__always_inline__)) inline uint64_t
+    e9_pmc_read_inline(unsigned i)
+{
+    volatile struct perf_event_mmap_page *page = e9_pmc_page[i];
+    if (page == NULL)
+        return 0;
+    uint32_t seq, idx;
+    int64_t count;
+    do
+    {
+        seq = page->lock;
+        asm volatile ("" ::: "memory");
+        idx   = page->index;
+        count = page->offset;
+        if (idx != 0 && (page->capabilities & PERF_CAP_USER_RDPMC))
+        {
+            uint32_t lo, hi;
+            asm volatile (
+                "rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1)
+            );
+            unsigned shift = 64 - page->pmc_width;
+            int64_t pmc = (int64_t)(((uint64_t)hi << 32) | lo);
+            count += (pmc << shift) >> shift;
+        }
+        else
+        {
+            // Fallback to read():
+            register long rax asm("rax") = SYS_read;
+            register long rdi asm("rdi") = e9_pmc_fd[i];
+            register long rsi asm("rsi") = (long)&count;
+            register long rdx asm("rdx") = sizeof(count);
+            asm volatile (
+                "syscall" : "+r"(rax) : "r"(rdi), "r"(rsi), "r"(rdx) :
+                    "rcx", "r11", "memory"
+            );
+            if (rax != sizeof(count))
+                count = 0;
+            break;
+        }
+        asm volatile ("" ::: "memory");
+    }
+    while (page->lock != seq);
+    return (uint64_t)count;
+}
+
+/*
+ * Read the counter in slot i, or 0 if the slot is not open.
+ */
+static uint64_t e9_pmc_read(unsigned i)
+{
+    if (i >= E9_PMC_MAX)
+        return 0;
+    return e9_pmc_read_inline(i);
+}
+
+/*
+ * Open the default counters.  Returns the number of counters opened.
+ */
+static int e9_pmc_init(void)
+{
+    int n = 0;
+    n += (e9_pmc_open(E9_PMC_CYCLES, PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_CPU_CYCLES) == 0);
+    n += (e9_pmc_open(E9_PMC_INSTRUCTIONS, PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_INSTRUCTIONS) == 0);
+    n += (e9_pmc_open(E9_PMC_LLC_MISSES, PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_CACHE_MISSES) == 0);
+    for (unsigned i = 0; i < E9_PMC_MAX; i++)
+        e9_pmc_last[i] = e9_pmc_read(i);
+    return n;
+}
+
+#define E9_PMC_DELTA(i)                                                 \
+    __attribute__((__no_caller_saved_registers__, __noinline__))        \
+    uint64_t e9_pmc_delta_##i(void)                                     \
+    {                                                                   \
+        uint64_t count = e9_pmc_read_inline(i);                         \
+        uint64_t delta = count - e9_pmc_last[i];                        \
+        e9_pmc_last[i] = count;                                         \
+        return delta;                                                   \
+    }
+E9_PMC_DELTA(0)
+E9_PMC_DELTA(1)
+E9_PMC_DELTA(2)
+E9_PMC_DELTA(3)
+
 /****************************************************************************/
 /* CONFIGURATION                                                            */
 /****************************************************************************/
@@ -2367,12 +2884,202 @@ static void *realloc_impl(struct malloc_pool_s *pool, void *ptr, size_t size,
     return new_ptr;
 }
 
+/*
+ * Thread caching.  Small blocks (malloc(), calloc() and free() only) are
+ * served from per-thread, per-size-class free-lists, meaning that most
+ * calls do not touch the pool mutex.  Cached blocks remain allocated in
+ * the pool (marked with MA_CACHE_MAGIC_NUMBER), and are moved between the
+ * cache and the pool in batches of MA_CACHE_BATCH under a single lock.
+ * Caches are found using the thread pointer (%fs:0x0), see HASH MAP.
+ *
+ * A per-cache busy flag guards against signal handlers that reenter
+ * malloc() or free(), in which case the (locked) pool is used directly.
+ */
+#if !defined(MUTEX_SAFE) && !defined(MALLOC_NO_CACHE)
+
+#define MA_CACHE_MAGIC_NUMBER       0x1A3C5E7F
+#define MA_CACHE_UNITS              16      // Max cached size (in units)
+#define MA_CACHE_MAX                32      // Max cached blocks per class
+#define MA_CACHE_BATCH              16      // Blocks moved per lock
+#define MA_CACHE_THREADS            4096    // Max cached threads
+
+struct malloc_cache_s
+{
+    bool busy;                              // Cache in use?
+    uint32_t len[MA_CACHE_UNITS+1];         // Free-list lengths
+    uint8_t *head[MA_CACHE_UNITS+1];        // Free-lists (by size class)
+};
+
+static e9_hmap_t *malloc_caches = NULL;     // Thread pointer -> cache
+
+static struct malloc_cache_s *malloc_cache_get(void)
+{
+    e9_hmap_t *caches = __atomic_load_n(&malloc_caches, __ATOMIC_ACQUIRE);
+    if (caches == NULL)
+    {
+        e9_hmap_t *new_caches = e9_hmap_create(2 * MA_CACHE_THREADS);
+        if (new_caches == NULL)
+            return NULL;
+        if (__atomic_compare_exchange_n(&malloc_caches, &caches,
+                new_caches, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            caches = new_caches;
+        else
+            e9_hmap_destroy(new_caches);
+    }
+    uintptr_t self;
+    asm volatile (
+        "mov %%fs:0x0,%0\n" : "=r"(self)
+    );
+    size_t *slot = e9_hmap_get(caches, self, 0);
+    if (slot == NULL)
+        return NULL;
+    size_t cache = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (cache != 0)
+        return (struct malloc_cache_s *)cache;
+    void *new_cache = mmap(NULL, sizeof(struct malloc_cache_s),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (new_cache == MAP_FAILED)
+        return NULL;
+    if (!__atomic_compare_exchange_n(slot, &cache, (size_t)new_cache,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        // Lost a race with a signal handler on this thread.
+        (void)munmap(new_cache, sizeof(struct malloc_cache_s));
+        return (struct malloc_cache_s *)cache;
+    }
+    return (struct malloc_cache_s *)new_cache;
+}
+
+static void malloc_cache_fill(struct malloc_cache_s *cache, uint32_t size128)
+{
+    struct malloc_pool_s *pool = pool_init(NULL);
+    if (mutex_lock(&pool->mutex) < 0)
+        return;
+    size_t size = (size_t)size128 * MA_UNIT - sizeof(struct malloc_node_s);
+    for (unsigned k = 0; k < MA_CACHE_BATCH; k++)
+    {
+        uint8_t *ptr = (uint8_t *)malloc_impl(pool, size, /*lock=*/false);
+        if (ptr == NULL)
+            break;
+        uint32_t i = (uint32_t)((ptr - pool->base -
+            sizeof(struct malloc_node_s)) / MA_UNIT);
+        MA_MAGIC(pool, i) = MA_CACHE_MAGIC_NUMBER;
+        *(uint8_t **)ptr = cache->head[size128];
+        cache->head[size128] = ptr;
+        cache->len[size128]++;
+    }
+    mutex_unlock(&pool->mutex);
+}
+
+static void malloc_cache_flush(struct malloc_cache_s *cache,
+    uint32_t size128)
+{
+    struct malloc_pool_s *pool = &malloc_pool;
+    if (mutex_lock(&pool->mutex) < 0)
+        return;
+    for (unsigned k = 0; k < MA_CACHE_BATCH && cache->head[size128] != NULL;
+            k++)
+    {
+        uint8_t *ptr = cache->head[size128];
+        cache->head[size128] = *(uint8_t **)ptr;
+        cache->len[size128]--;
+        uint32_t i = (uint32_t)((ptr - pool->base -
+            sizeof(struct malloc_node_s)) / MA_UNIT);
+        MA_MAGIC(pool, i) = MA_MAGIC_NUMBER;
+        malloc_remove(pool, i);
+    }
+    mutex_unlock(&pool->mutex);
+}
+
+static void *malloc_cache_alloc(size_t size)
+{
+    if (size == 0 || size > MA_CACHE_UNITS * MA_UNIT)
+        return NULL;
+    size += sizeof(struct malloc_node_s);
+    uint32_t size128 = (uint32_t)(size / MA_UNIT + (size % MA_UNIT? 1: 0));
+    if (size128 > MA_CACHE_UNITS)
+        return NULL;
+    struct malloc_cache_s *cache = malloc_cache_get();
+    if (cache == NULL || cache->busy)
+        return NULL;
+    cache->busy = true;
+    asm volatile ("" ::: "memory");
+
+    if (cache->head[size128] == NULL)
+        malloc_cache_fill(cache, size128);
+    uint8_t *ptr = cache->head[size128];
+    if (ptr != NULL)
+    {
+        struct malloc_pool_s *pool = &malloc_pool;
+        cache->head[size128] = *(uint8_t **)ptr;
+        cache->len[size128]--;
+        uint32_t i = (uint32_t)((ptr - pool->base -
+            sizeof(struct malloc_node_s)) / MA_UNIT);
+        MA_MAGIC(pool, i) = MA_MAGIC_NUMBER;
+    }
+
+    asm volatile ("" ::: "memory");
+    cache->busy = false;
+    return (void *)ptr;
+}
+
+static bool malloc_cache_free(void *ptr)
+{
+    // Anything unusual is left to free_impl() (including error reporting):
+    struct malloc_pool_s *pool = &malloc_pool;
+    if (ptr == NULL || ptr == MA_ZERO || pool->base == NULL)
+        return false;
+    if ((uint8_t *)ptr < pool->base + sizeof(struct malloc_node_s) ||
+            (uintptr_t)ptr % MA_UNIT != 0)
+        return false;
+    size_t i = ((uint8_t *)ptr - pool->base - sizeof(struct malloc_node_s)) /
+        MA_UNIT;
+    if (i >= __atomic_load_n(&pool->mmap, __ATOMIC_RELAXED) ||
+            MA_MAGIC(pool, i) != MA_MAGIC_NUMBER)
+        return false;
+    uint32_t size128 = MA_SIZE(pool, i);
+    if (size128 > MA_CACHE_UNITS)
+        return false;
+    struct malloc_cache_s *cache = malloc_cache_get();
+    if (cache == NULL || cache->busy)
+        return false;
+    cache->busy = true;
+    asm volatile ("" ::: "memory");
+
+    MA_MAGIC(pool, i) = MA_CACHE_MAGIC_NUMBER;
+    *(uint8_t **)ptr = cache->head[size128];
+    cache->head[size128] = (uint8_t *)ptr;
+    cache->len[size128]++;
+    if (cache->len[size128] > MA_CACHE_MAX)
+        malloc_cache_flush(cache, size128);
+
+    asm volatile ("" ::: "memory");
+    cache->busy = false;
+    return true;
+}
+
+#else       /* MUTEX_SAFE || MALLOC_NO_CACHE */
+
+#define malloc_cache_alloc(size)    NULL
+#define malloc_cache_free(ptr)      false
+
+#endif      /* MUTEX_SAFE || MALLOC_NO_CACHE */
+
 static void *malloc(size_t size)
 {
+    void *ptr = malloc_cache_alloc(size);
+    if (ptr != NULL)
+        return ptr;
     return malloc_impl(NULL, size, /*lock=*/true);
 }
 static void *calloc(size_t nmemb, size_t size)
 {
+    void *ptr = malloc_cache_alloc(nmemb * size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, nmemb * size);
+        return ptr;
+    }
     return calloc_impl(NULL, nmemb, size, /*lock=*/true);
 }
 static void *realloc(void *ptr, size_t size)
@@ -2381,7 +3088,8 @@ static void *realloc(void *ptr, size_t size)
 }
 static void free(void *ptr)
 {
-    free_impl(NULL, ptr, /*lock=*/true);
+    if (!malloc_cache_free(ptr))
+        free_impl(NULL, ptr, /*lock=*/true);
 }
 
 static void *malloc_unlocked(size_t size)
@@ -2976,6 +3684,9 @@ static long long int atoll(const char *nptr)
 #define STDIO_FLAG_OWN_BUF          0x0040
 #define STDIO_FLAG_EOF              0x0080
 #define STDIO_FLAG_ERROR            0x0100
+#define STDIO_FLAG_ORDERED          0x0200
+
+#define E9_STDIO_ORDERED            0x1
 
 struct stdio_stream_s
 {
@@ -2990,6 +3701,9 @@ struct stdio_stream_s
     char *read_end;
     char *buf;
     size_t bufsiz;
+    e9_hmap_t *threads;
+    size_t tbufsiz;
+    uint64_t seq;
 };
 typedef struct stdio_stream_s FILE;
 
@@ -3148,10 +3862,202 @@ static int fflush_unlocked(FILE *stream)
     return 0;
 }
 
+/*
+ * Per-thread stream buffers (not part of libc).
+ *
+ * After e9_setvbuf_thread(stream, size, flags), the locking output
+ * functions (fputc(), fputs(), fwrite(), fprintf(), etc.) append to a
+ * private buffer of the calling thread, and the stream mutex is only taken
+ * when a full buffer is written out.  The output of each call stays
+ * contiguous if it fits in the buffer.  A thread's buffer is written by
+ * fflush() from that thread, or by fclose(), so threads should call
+ * fflush() before they exit.  The *_unlocked() functions use the shared
+ * stream buffer as before.
+ *
+ * With E9_STDIO_ORDERED, the output of each call is prefixed by a
+ * per-stream sequence number (16 hex digits and a space), so the global
+ * order can be recovered with sort(1).
+ *
+ * Signal handlers that interrupt a thread buffer operation fall back to
+ * the shared (locked) stream.
+ */
+#define STDIO_SEQ_SIZE              17
+#define STDIO_THREADS               4096
+
+struct stdio_tbuf_s
+{
+    bool busy;                          // Buffer in use?
+    char *ptr;
+    char *end;
+    char buf[];
+};
+
+static uintptr_t stdio_thread_self(void)
+{
+#ifndef MUTEX_SAFE
+    uintptr_t self;
+    asm volatile (
+        "mov %%fs:0x0,%0\n" : "=r"(self)
+    );
+    return self;
+#else
+    return (uintptr_t)gettid();
+#endif
+}
+
+static struct stdio_tbuf_s *stdio_tbuf_acquire(FILE *stream)
+{
+    e9_hmap_t *threads = __atomic_load_n(&stream->threads, __ATOMIC_ACQUIRE);
+    if (threads == NULL)
+        return NULL;
+    size_t *slot = e9_hmap_get(threads, stdio_thread_self(), 0);
+    if (slot == NULL)
+        return NULL;
+    struct stdio_tbuf_s *tbuf =
+        (struct stdio_tbuf_s *)__atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (tbuf == NULL)
+    {
+        size_t size = sizeof(struct stdio_tbuf_s) + stream->tbufsiz;
+        tbuf = (struct stdio_tbuf_s *)mmap(NULL, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tbuf == MAP_FAILED)
+            return NULL;
+        tbuf->ptr = tbuf->buf;
+        tbuf->end = tbuf->buf + stream->tbufsiz;
+        size_t zero = 0;
+        if (!__atomic_compare_exchange_n(slot, &zero, (size_t)tbuf,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            // Lost a race with a signal handler on this thread.
+            (void)munmap(tbuf, size);
+            tbuf = (struct stdio_tbuf_s *)zero;
+        }
+    }
+    if (tbuf->busy)
+        return NULL;
+    tbuf->busy = true;
+    asm volatile ("" ::: "memory");
+    return tbuf;
+}
+
+static void stdio_tbuf_release(struct stdio_tbuf_s *tbuf)
+{
+    asm volatile ("" ::: "memory");
+    tbuf->busy = false;
+}
+
+static int stdio_tbuf_flush(FILE *stream, struct stdio_tbuf_s *tbuf)
+{
+    if (tbuf->ptr == tbuf->buf)
+        return 0;
+    stdio_lock(stream, EOF);
+    int result = fflush_unlocked(stream);
+    if (result == 0)
+        result = stdio_stream_write_buf(stream, tbuf->buf, tbuf->ptr);
+    stdio_unlock(stream);
+    tbuf->ptr = tbuf->buf;
+    return result;
+}
+
+static int stdio_tbuf_flush_all(FILE *stream)
+{
+    if (stream->threads == NULL)
+        return 0;
+    int result = 0;
+    size_t i = 0;
+    e9_hmap_entry_t *entry;
+    while ((entry = e9_hmap_next(stream->threads, &i)) != NULL)
+    {
+        struct stdio_tbuf_s *tbuf = (struct stdio_tbuf_s *)entry->value;
+        if (tbuf != NULL && stdio_tbuf_flush(stream, tbuf) < 0)
+            result = EOF;
+    }
+    return result;
+}
+
+static char *stdio_tbuf_reserve(FILE *stream, struct stdio_tbuf_s *tbuf,
+    size_t len, bool *error)
+{
+    bool ordered = ((stream->flags & STDIO_FLAG_ORDERED) != 0);
+    len += (ordered? STDIO_SEQ_SIZE: 0);
+    if (len > (size_t)(tbuf->end - tbuf->ptr) &&
+            stdio_tbuf_flush(stream, tbuf) < 0)
+    {
+        *error = true;
+        return NULL;
+    }
+    if (len > (size_t)(tbuf->end - tbuf->ptr))
+        return NULL;
+    char *ptr = tbuf->ptr;
+    if (ordered)
+    {
+        uint64_t seq = __atomic_fetch_add(&stream->seq, 1, __ATOMIC_RELAXED);
+        for (int j = STDIO_SEQ_SIZE-2; j >= 0; j--, seq >>= 4)
+            ptr[j] = "0123456789abcdef"[seq & 0xF];
+        ptr[STDIO_SEQ_SIZE-1] = ' ';
+        ptr += STDIO_SEQ_SIZE;
+    }
+    return ptr;
+}
+
+/*
+ * Returns 1 if the data was written to the thread buffer, 0 if the caller
+ * should use the shared stream, or -1 on error.
+ */
+static int stdio_thread_write(FILE *stream, const void *data, size_t len)
+{
+    struct stdio_tbuf_s *tbuf = stdio_tbuf_acquire(stream);
+    if (tbuf == NULL)
+        return 0;
+    bool error = false;
+    char *ptr = stdio_tbuf_reserve(stream, tbuf, len, &error);
+    if (ptr != NULL)
+    {
+        memcpy(ptr, data, len);
+        tbuf->ptr = ptr + len;
+    }
+    stdio_tbuf_release(tbuf);
+    return (error? -1: (ptr != NULL? 1: 0));
+}
+
+static int e9_setvbuf_thread(FILE *stream, size_t size, int flags)
+{
+    if (size <= STDIO_SEQ_SIZE || (flags & ~E9_STDIO_ORDERED) != 0 ||
+            !(stream->flags & STDIO_FLAG_WRITE))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    e9_hmap_t *threads = e9_hmap_create(2 * STDIO_THREADS);
+    if (threads == NULL)
+        return -1;
+    stdio_lock(stream, -1);
+    if (stream->threads != NULL)
+    {
+        stdio_unlock(stream);
+        e9_hmap_destroy(threads);
+        errno = EBUSY;
+        return -1;
+    }
+    stream->tbufsiz = size;
+    stream->flags |= ((flags & E9_STDIO_ORDERED)? STDIO_FLAG_ORDERED: 0);
+    __atomic_store_n(&stream->threads, threads, __ATOMIC_RELEASE);
+    stdio_unlock(stream);
+    return 0;
+}
+
 static int fflush(FILE *stream)
 {
     if (stream == NULL)
         panic("fflush(NULL) not supported");
+    struct stdio_tbuf_s *tbuf = stdio_tbuf_acquire(stream);
+    if (tbuf != NULL)
+    {
+        int result = stdio_tbuf_flush(stream, tbuf);
+        stdio_tbuf_release(tbuf);
+        if (result < 0)
+            return EOF;
+    }
     stdio_lock(stream, EOF);
     int result = fflush_unlocked(stream);
     stdio_unlock(stream);
@@ -3201,6 +4107,18 @@ static int stdio_stream_write_init(FILE *stream)
 
 static void stdio_stream_free(FILE *stream)
 {
+    if (stream->threads != NULL)
+    {
+        size_t i = 0;
+        e9_hmap_entry_t *entry;
+        while ((entry = e9_hmap_next(stream->threads, &i)) != NULL)
+        {
+            if (entry->value != 0)
+                (void)munmap((void *)entry->value,
+                    sizeof(struct stdio_tbuf_s) + stream->tbufsiz);
+        }
+        e9_hmap_destroy(stream->threads);
+    }
     if (stream->buf != NULL && (stream->flags & STDIO_FLAG_OWN_BUF))
         free(stream->buf);
     free(stream);
@@ -3276,6 +4194,8 @@ static FILE *fopen(const char *path, const char *mode)
 static int fclose(FILE *stream)
 {
     int result1 = fflush(stream);
+    if (result1 == 0)
+        result1 = stdio_tbuf_flush_all(stream);
     int result2 = close(stream->fd);
     stdio_stream_free(stream);
     return (result1 == 0? result2: result1);
@@ -3454,8 +4374,12 @@ static int fputc_unlocked(int c, FILE *stream)
 
 static int fputc(int c, FILE *stream)
 {
+    char d = (char)c;
+    int result = stdio_thread_write(stream, &d, sizeof(d));
+    if (result != 0)
+        return (result < 0? EOF: (int)d);
     stdio_lock(stream, EOF);
-    int result = fputc_unlocked(c, stream);
+    result = fputc_unlocked(c, stream);
     stdio_unlock(stream);
     return result;
 }
@@ -3491,8 +4415,11 @@ static int fputs_unlocked(const char *s, FILE *stream)
 
 static int fputs(const char *s, FILE *stream)
 {
+    int result = stdio_thread_write(stream, s, strlen(s));
+    if (result != 0)
+        return (result < 0? EOF: 0);
     stdio_lock(stream, EOF);
-    int result = fputs_unlocked(s, stream);
+    result = fputs_unlocked(s, stream);
     stdio_unlock(stream);
     return result;
 }
@@ -3566,6 +4493,12 @@ static size_t fwrite_unlocked(const void *ptr, size_t size, size_t nmemb,
 
 static size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
+    if (size != 0 && nmemb != 0)
+    {
+        int status = stdio_thread_write(stream, ptr, size * nmemb);
+        if (status != 0)
+            return (status < 0? 0: nmemb);
+    }
     stdio_lock(stream, 0);
     size_t result = fwrite_unlocked(ptr, size, nmemb, stream);
     stdio_unlock(stream);
@@ -4131,6 +5064,27 @@ static int vfprintf(FILE *stream, const char *format, va_list ap)
     va_list aq;
     va_copy(aq, ap);
     int result = vsnprintf(NULL, SIZE_MAX, format, ap);
+    struct stdio_tbuf_s *tbuf =
+        (result >= 0? stdio_tbuf_acquire(stream): NULL);
+    if (tbuf != NULL)
+    {
+        // Format directly into the thread buffer (if it fits):
+        bool error = false;
+        char *ptr = stdio_tbuf_reserve(stream, tbuf, result+1, &error);
+        if (ptr != NULL)
+        {
+            result = vsnprintf(ptr, result+1, format, aq);
+            tbuf->ptr = ptr + (result >= 0? result: 0);
+        }
+        else if (error)
+            result = -1;
+        stdio_tbuf_release(tbuf);
+        if (ptr != NULL || error)
+        {
+            va_end(aq);
+            return result;
+        }
+    }
     if (result >= 0)
     {
         char buf[result+1];
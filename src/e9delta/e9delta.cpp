@@ -0,0 +1,252 @@
+/*
+ * e9delta.cpp
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Apply a "delta" or "delta.gz" file emitted by e9patch:
+ *
+ *      e9delta ORIGINAL DELTA OUTPUT
+ */
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef E9_ZLIB
+#include <zlib.h>
+#endif
+
+#include "e9delta.h"
+
+#define NO_RETURN               __attribute__((__noreturn__))
+
+static bool option_is_tty = false;
+
+/*
+ * Print an error message and exit.
+ */
+static void NO_RETURN error(const char *msg, ...)
+{
+    fprintf(stderr, "%serror%s: ",
+        (option_is_tty? "\33[31m": ""),
+        (option_is_tty? "\33[0m" : ""));
+
+    va_list ap;
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+
+    _Exit(EXIT_FAILURE);
+}
+
+/*
+ * Delta input stream.  If built with zlib, both compressed and
+ * uncompressed deltas are supported.
+ */
+struct DeltaInput
+{
+    const char *filename;
+#ifdef E9_ZLIB
+    gzFile in;
+#else
+    FILE *in;
+#endif
+
+    DeltaInput(const char *filename) : filename(filename)
+    {
+#ifdef E9_ZLIB
+        in = gzopen(filename, "rb");
+        if (in != nullptr)
+            gzbuffer(in, 1 << 20);
+#else
+        in = fopen(filename, "r");
+#endif
+        if (in == nullptr)
+            error("failed to open delta file \"%s\" for reading: %s",
+                filename, strerror(errno));
+    }
+
+    void read(void *buf, size_t len)
+    {
+        uint8_t *bytes = (uint8_t *)buf;
+        while (len > 0)
+        {
+            size_t count = std::min(len, (size_t)INT32_MAX);
+#ifdef E9_ZLIB
+            int r = gzread(in, bytes, (unsigned)count);
+            if (r <= 0)
+                error("failed to read delta file \"%s\"; unexpected "
+                    "end-of-file or read error", filename);
+            count = (size_t)r;
+#else
+            count = fread(bytes, sizeof(uint8_t), count, in);
+            if (count == 0)
+                error("failed to read delta file \"%s\"; unexpected "
+                    "end-of-file or read error", filename);
+#endif
+            bytes += count;
+            len   -= count;
+        }
+    }
+};
+
+/*
+ * Write to the output file.
+ */
+static void writeOutput(const char *filename, int fd, const void *buf,
+    size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)buf;
+    while (len > 0)
+    {
+        ssize_t r = write(fd, bytes, len);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error("failed to write output to file \"%s\": %s", filename,
+                strerror(errno));
+        }
+        bytes += r;
+        len   -= (size_t)r;
+    }
+}
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    option_is_tty = isatty(STDERR_FILENO);
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: %s ORIGINAL DELTA OUTPUT\n\n"
+            "Apply the DELTA (in the e9patch \"delta\" or \"delta.gz\" "
+            "format) to the\nORIGINAL binary and write the patched binary "
+            "to OUTPUT.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *orig_name = argv[1], *delta_name = argv[2],
+        *out_name = argv[3];
+
+    // Map the original binary:
+    int fd = open(orig_name, O_RDONLY);
+    if (fd < 0)
+        error("failed to open file \"%s\" for reading: %s", orig_name,
+            strerror(errno));
+    struct stat stat;
+    if (fstat(fd, &stat) != 0)
+        error("failed to get statistics for file \"%s\": %s", orig_name,
+            strerror(errno));
+    size_t orig_size = (size_t)stat.st_size;
+    const uint8_t *orig = nullptr;
+    if (orig_size > 0)
+    {
+        void *ptr = mmap(nullptr, orig_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+            error("failed to map file \"%s\": %s", orig_name,
+                strerror(errno));
+        orig = (const uint8_t *)ptr;
+    }
+    close(fd);
+
+    // Read and check the header:
+    DeltaInput in(delta_name);
+    e9_delta_hdr_s hdr;
+    in.read(&hdr, sizeof(hdr));
+    if (memcmp(hdr.magic, E9_DELTA_MAGIC, sizeof(E9_DELTA_MAGIC)) != 0)
+    {
+        if ((uint8_t)hdr.magic[0] == 0x1f && (uint8_t)hdr.magic[1] == 0x8b)
+            error("failed to parse delta file \"%s\"; file is compressed "
+                "but e9delta was built without zlib support", delta_name);
+        error("failed to parse delta file \"%s\"; invalid magic number",
+            delta_name);
+    }
+    if (hdr.version != E9_DELTA_VERSION)
+        error("failed to parse delta file \"%s\"; unsupported version (%u)",
+            delta_name, hdr.version);
+    if (hdr.orig_size != orig_size)
+        error("failed to apply delta file \"%s\"; size of file \"%s\" (%zu) "
+            "does not match the original file size (%zu)", delta_name,
+            orig_name, orig_size, (size_t)hdr.orig_size);
+
+    // Apply the records:
+    int out = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, stat.st_mode);
+    if (out < 0)
+        error("failed to open output file \"%s\" for writing: %s", out_name,
+            strerror(errno));
+    const size_t BUF_SIZE = 1 << 20;
+    uint8_t *buf = new uint8_t[BUF_SIZE];
+    size_t size = (size_t)hdr.size, pos = 0;
+    size_t copy_size = std::min(orig_size, size);
+    for (uint64_t i = 0; i < hdr.num_records; i++)
+    {
+        e9_delta_rec_s rec;
+        in.read(&rec, sizeof(rec));
+        if (rec.offset < pos || rec.offset > size ||
+                rec.size > size - rec.offset)
+            error("failed to parse delta file \"%s\"; invalid record #%zu "
+                "(offset=%zu, size=%zu)", delta_name, (size_t)i,
+                (size_t)rec.offset, (size_t)rec.size);
+        size_t offset = (size_t)rec.offset;
+        if (pos < offset)
+        {
+            if (offset > copy_size)
+                error("failed to parse delta file \"%s\"; record #%zu "
+                    "leaves a hole at offset %zu", delta_name, (size_t)i,
+                    pos);
+            writeOutput(out_name, out, orig + pos, offset - pos);
+        }
+        for (size_t j = 0; j < rec.size; j += BUF_SIZE)
+        {
+            size_t count = std::min(BUF_SIZE, (size_t)rec.size - j);
+            in.read(buf, count);
+            writeOutput(out_name, out, buf, count);
+        }
+        pos = offset + rec.size;
+    }
+    if (pos < copy_size)
+    {
+        writeOutput(out_name, out, orig + pos, copy_size - pos);
+        pos = copy_size;
+    }
+    if (pos != size)
+        error("failed to parse delta file \"%s\"; records do not cover the "
+            "patched file size (%zu)", delta_name, size);
+    if (fchmod(out, stat.st_mode) != 0)
+        error("failed to set permissions for output file \"%s\": %s",
+            out_name, strerror(errno));
+    if (close(out) != 0)
+        error("failed to close output file \"%s\": %s", out_name,
+            strerror(errno));
+    delete[] buf;
+
+    return EXIT_SUCCESS;
+}
@@ -16,22 +16,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <thread>
+
 #include <sys/mman.h>
 
+#include <immintrin.h>
+
 #include "e9CFR.h"
 #include "e9elf.h"
 #include "e9x86_64.h"
 
 /*
- * Setter/getter.
+ * Setter/getter.  The atomic setter is used by the parallel analysis.
  */
-static bool setTarget(uint8_t *targets, size_t size, intptr_t offset)
+static bool setTarget(uint8_t *targets, size_t size, intptr_t offset,
+    bool atomic = false)
 {
     if (offset < (intptr_t)sizeof(Elf64_Ehdr) || (size_t)offset >= size)
         return false;
     size_t i = (size_t)offset / 8;
     size_t j = (size_t)offset % 8;
-    targets[i] |= (1 << j);
+    if (atomic)
+        __atomic_fetch_or(targets + i, (uint8_t)(1 << j), __ATOMIC_RELAXED);
+    else
+        targets[i] |= (1 << j);
     return true;
 }
 static bool isTarget(const uint8_t *targets, size_t size, intptr_t offset)
@@ -90,6 +99,227 @@ static intptr_t addrToOffset(const Elf64_Phdr *phdrs, size_t phnum,
     return INTPTR_MIN;
 }
 
+/*
+ * Opcode classification tables.  A byte b is a candidate opcode for the
+ * code scan iff (LO[b & 0xF] & HI[b >> 4]) != 0.  Each bit corresponds to
+ * one high-nibble row: 0x0F, 0x48/0x4C, 0x68, 0x7X, 0xB8-0xBF, 0xC7,
+ * 0xE3/0xE8/0xE9/0xEB, and 0xF3/0xFF.
+ */
+alignas(16) static const uint8_t OPCODE_LO[16] =
+{
+    0x08, 0x08, 0x08, 0xC8, 0x08, 0x08, 0x08, 0x28,
+    0x5E, 0x58, 0x18, 0x58, 0x1A, 0x18, 0x18, 0x99
+};
+alignas(16) static const uint8_t OPCODE_HI[16] =
+{
+    0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x04, 0x08,
+    0x00, 0x00, 0x00, 0x10, 0x20, 0x00, 0x40, 0x80
+};
+
+/*
+ * Find the next candidate opcode in data[j..hi), or return hi if none.
+ */
+typedef off_t (*NextOpcodeFunc)(const uint8_t *data, off_t j, off_t hi);
+static off_t nextOpcode(const uint8_t *data, off_t j, off_t hi)
+{
+    for (; j < hi && (OPCODE_LO[data[j] & 0xF] & OPCODE_HI[data[j] >> 4]) == 0;
+            j++)
+        ;
+    return j;
+}
+__attribute__((__target__("avx2")))
+static off_t nextOpcodeAVX2(const uint8_t *data, off_t j, off_t hi)
+{
+    const __m256i lo_tab =
+        _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)OPCODE_LO));
+    const __m256i hi_tab =
+        _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)OPCODE_HI));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero   = _mm256_setzero_si256();
+    for (; hi - j >= 32; j += 32)
+    {
+        __m256i x  = _mm256_loadu_si256((const __m256i *)(data + j));
+        __m256i lo = _mm256_and_si256(x, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+        __m256i c  = _mm256_and_si256(_mm256_shuffle_epi8(lo_tab, lo),
+            _mm256_shuffle_epi8(hi_tab, hi));
+        uint32_t mask =
+            ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, zero));
+        if (mask != 0)
+            return j + __builtin_ctz(mask);
+    }
+    return nextOpcode(data, j, hi);
+}
+
+/*
+ * Skip words that cannot be code pointers, i.e., are outside of the range
+ * [lo..lo+span].  Returns a pointer to the first candidate, or end.
+ */
+typedef const intptr_t *(*SkipFunc)(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span);
+static const intptr_t *skipWords(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span)
+{
+    for (; p < end && (uintptr_t)*p - (uintptr_t)lo > span; p++)
+        ;
+    return p;
+}
+__attribute__((__target__("avx2")))
+static const intptr_t *skipWordsAVX2(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span)
+{
+    // AVX2 has no unsigned 64-bit compare, so bias both sides instead:
+    const __m256i bias  = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i vlo   = _mm256_set1_epi64x(lo);
+    const __m256i vspan = _mm256_set1_epi64x((intptr_t)span ^ INT64_MIN);
+    for (; end - p >= 4; p += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        x = _mm256_xor_si256(_mm256_sub_epi64(x, vlo), bias);
+        __m256i out = _mm256_cmpgt_epi64(x, vspan);
+        if (_mm256_movemask_pd(_mm256_castsi256_pd(out)) != 0xF)
+            break;
+    }
+    return skipWords(p, end, lo, span);
+}
+
+/*
+ * Scan the code bytes [lo..hi) of the given segment for direct jump targets.
+ * Note that instructions may extend beyond hi (up to the segment end).
+ * Code offsets whose address is (possibly) materialized by an instruction
+ * (lea/mov/push) are also added to `taken'.
+ *
+ * Note: This is a basic overapproximation that assumes *all* executable
+ *       byte patterns resembling direct calls/jumps *are* direct
+ *       calls/jumps.  This analysis does not assume the binary can be
+ *       disassembled, and safely handles data-in-code, etc.
+ */
+static void scanCode(const Binary *B, const Elf64_Phdr *phdrs, size_t phnum,
+    const Elf64_Phdr *phdr, off_t lo, off_t hi, bool cet, bool atomic,
+    uint8_t *targets, std::set<intptr_t> &tables, std::set<intptr_t> &taken)
+{
+    static const NextOpcodeFunc next_opcode =
+        (__builtin_cpu_supports("avx2")? nextOpcodeAVX2: nextOpcode);
+    const uint8_t *data = B->original.bytes;
+    bool pic = B->pic;
+    off_t offset  = (off_t)phdr->p_offset;
+    intptr_t addr = (intptr_t)phdr->p_vaddr;
+    size_t size   = (size_t)phdr->p_memsz;
+    off_t end     = (offset + size > B->size? B->size: offset + size);
+    for (off_t j = next_opcode(data, lo, hi); j < hi;
+            j = next_opcode(data, j+1, hi))
+    {
+        int8_t rel8;
+        int32_t rel32;
+        intptr_t target = INTPTR_MIN, next = INTPTR_MIN;
+        switch (data[j])
+        {
+            case 0x0F:                  // jcc rel32
+                if (j+1 >= end)
+                    continue;
+                switch (data[j+1])
+                {
+                    case 0x80: case 0x81: case 0x82: case 0x83:
+                    case 0x84: case 0x85: case 0x86: case 0x87:
+                    case 0x88: case 0x89: case 0x8A: case 0x8B:
+                    case 0x8C: case 0x8D: case 0x8E: case 0x8F:
+                        j++;
+                        next = j + 5;
+                        break;
+                    default:
+                        continue;
+                }
+                // Fallthrough:
+            case 0xE8: case 0xE9:       // callq/jumpq rel32
+                if (j + /*sizeof(callq/jmpq)=*/5 > end)
+                    continue;
+                memcpy(&rel32, data + j + 1, sizeof(rel32));
+                target = j + 5 + (intptr_t)rel32;
+                if (data[j] == 0xE8)
+                    next = j + 5;       // return target
+                break;
+            case 0xE3:                  // jrcxz rel8
+            case 0xEB:                  // jmp rel8
+            case 0x70: case 0x71: case 0x72: case 0x73: case 0x74:
+            case 0x75: case 0x76: case 0x77: case 0x78: case 0x79:
+            case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E:
+            case 0x7F:                  // jcc rel8
+                if (j + /*sizeof(jmp rel8)=*/2 > end)
+                    continue;
+                rel8 = data[j + 1];
+                target = j + 2 + (intptr_t)rel8;
+                next = j + 2;
+                break;
+            case 0xFF:                  // call *mem64
+            {
+                if (j+2 > end)
+                    continue;
+                ssize_t sz = getModRMSize(data+j+1, end-(j+1));
+                if (sz < 0)
+                    continue;
+                next = j + 1 + sz;
+                break;
+            }
+            case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+            case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            case 0x68:                  // mov $ptr,%reg; push $ptr
+                if (pic || j+5 > end)
+                    continue;
+                target = addrToOffset(phdrs, phnum,
+                    *(int32_t *)(data + j + 1));
+                if (target >= 0)
+                    taken.insert(target);
+                break;
+            case 0xC7:                  // mov $ptr,mem64
+            {
+                if (pic || j+2 > end)
+                    continue;
+                ssize_t sz = getModRMSize(data+j+1, end-(j+1));
+                if (sz < 0 || j+1+sz+(ssize_t)sizeof(int32_t) > end)
+                    continue;
+                int32_t imm32 = *(int32_t *)(data + j + 1 + sz);
+                target = addrToOffset(phdrs, phnum, imm32);
+                if (target >= 0)
+                    taken.insert(target);
+                break;
+            }
+            case 0x48: case 0x4C:       // lea ptr(%rip),%reg
+            {
+                if (j+7 > end)
+                    continue;
+                if (data[j+1] != 0x8d)
+                    continue;
+                uint8_t modRM = data[j+2];
+                uint8_t mod = (modRM & 0xc0) >> 6;
+                uint8_t rm  = modRM & 0x7;
+                if (mod != 0x00 && rm != 0x05)
+                    continue;
+                target = j + 7 + *(int32_t *)(data + j + 3);
+                if (target >= 0)
+                    taken.insert(target);
+                if (target >= 0 && target % sizeof(int32_t) == 0)
+                {
+                    intptr_t table = addr + (target - offset);
+                    tables.insert(table);
+                }
+                break;
+            }
+            case 0xF3:                  // endbr64
+                if (j+4 > end || !cet)
+                    continue;
+                if (data[j+1] != 0x0F || data[j+2] != 0x1E ||
+                        data[j+3] != 0xFA)
+                    continue;
+                target = j;     // endbr64
+                break;
+            default:
+                continue;
+        }
+        setTarget(targets, B->size, target, atomic);
+        setTarget(targets, B->size, next, atomic);
+    }
+}
+
 /*
  * Target analysis.  Find instructions that can be reached by a
  * control-flow-transfer, including returns.  This can be a "safe"
@@ -98,7 +328,13 @@ static intptr_t addrToOffset(const Elf64_Phdr *phdrs, size_t phnum,
 void targetAnalysis(Binary *B)
 {
     // Step (1): Basic checks
-    if (B->targets != nullptr || !option_OCFR)
+    //
+    // Note: The analysis result is cached, and is only recomputed if an
+    //       option that affects the result has changed.
+    //
+    bool hacks = (B->pic && option_OCFR_hacks);
+    if (!option_OCFR ||
+            (B->targets != nullptr && B->targets_hacks == hacks))
         return;
     switch (B->mode)
     {
@@ -135,136 +371,80 @@ void targetAnalysis(Binary *B)
     }
 
     // Step (2): Create the target map:
-    void *ptr = mmap(nullptr, (B->size + PAGE_SIZE) / 8,
-        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
-        -1, 0);
-    if (ptr == MAP_FAILED)
-        error("failed to allocate target map: %s", strerror(errno));
-    uint8_t *targets = (uint8_t *)ptr;
+    uint8_t *targets = (uint8_t *)B->targets;
+    size_t targets_size = (B->size + PAGE_SIZE) / 8;
+    if (targets != nullptr)
+        memset(targets, 0x0, targets_size);     // Stale
+    else
+    {
+        void *ptr = mmap(nullptr, targets_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED)
+            error("failed to allocate target map: %s", strerror(errno));
+        targets = (uint8_t *)ptr;
+    }
     B->targets = targets;
+    B->targets_hacks = hacks;
 
     // Step (3): Find all direct jump targets.
-    //
-    // Note: This is a basic overapproximation that assumes *all* executable
-    //       byte patterns resembling direct calls/jumps *are* direct
-    //       calls/jumps.  This analysis does not assume the binary can be
-    //       disassembled, and safely handles data-in-code, etc.
-    //
-    std::set<intptr_t> tables;
+    struct Chunk
+    {
+        const Elf64_Phdr *phdr;
+        off_t lo, hi;
+    };
+    std::vector<Chunk> chunks;
+    const off_t CHUNK_SIZE = 16 * PAGE_SIZE;
+    size_t num_threads = option_threads;
     for (unsigned i = 0; i < phnum; i++)
     {
         const Elf64_Phdr *phdr = phdrs + i;
         if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_X) == 0)
             continue;
         off_t offset  = (off_t)phdr->p_offset;
-        intptr_t addr = (intptr_t)phdr->p_vaddr;
         size_t size   = (size_t)phdr->p_memsz;
         off_t end     = (offset + size > B->size? B->size: offset + size);
-        for (off_t j = offset; j < end; j++)
+        if (num_threads <= 1)
         {
-            int8_t rel8;
-            int32_t rel32;
-            intptr_t target = INTPTR_MIN, next = INTPTR_MIN;
-            switch (data[j])
-            {
-                case 0x0F:                  // jcc rel32
-                    if (j+1 >= end)
-                        continue;
-                    switch (data[j+1])
-                    {
-                        case 0x80: case 0x81: case 0x82: case 0x83:
-                        case 0x84: case 0x85: case 0x86: case 0x87:
-                        case 0x88: case 0x89: case 0x8A: case 0x8B:
-                        case 0x8C: case 0x8D: case 0x8E: case 0x8F:
-                            j++;
-                            next = j + 5;
-                            break;
-                        default:
-                            continue;
-                    }
-                    // Fallthrough:
-                case 0xE8: case 0xE9:       // callq/jumpq rel32
-                    if (j + /*sizeof(callq/jmpq)=*/5 > end)
-                        continue;
-                    memcpy(&rel32, data + j + 1, sizeof(rel32));
-                    target = j + 5 + (intptr_t)rel32;
-                    if (data[j] == 0xE8)
-                        next = j + 5;       // return target
-                    break;
-                case 0xE3:                  // jrcxz rel8
-                case 0xEB:                  // jmp rel8
-                case 0x70: case 0x71: case 0x72: case 0x73: case 0x74:
-                case 0x75: case 0x76: case 0x77: case 0x78: case 0x79:
-                case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E:
-                case 0x7F:                  // jcc rel8
-                    if (j + /*sizeof(jmp rel8)=*/2 > end)
-                        continue;
-                    rel8 = data[j + 1];
-                    target = j + 2 + (intptr_t)rel8;
-                    next = j + 2;
-                    break;
-                case 0xFF:                  // call *mem64
-                {
-                    if (j+2 > end)
-                        continue;
-                    ssize_t sz = getModRMSize(data+j+1, end-(j+1));
-                    if (sz < 0)
-                        continue;
-                    next = j + 1 + sz;
-                    break;
-                }
-                case 0xB8: case 0xB9: case 0xBA: case 0xBB:
-                case 0xBC: case 0xBD: case 0xBE: case 0xBF:
-                case 0x68:                  // mov $ptr,%reg; push $ptr
-                    if (pic || j+5 > end)
-                        continue;
-                    target = addrToOffset(phdrs, phnum,
-                        *(int32_t *)(data + j + 1));
-                    break;
-                case 0xC7:                  // mov $ptr,mem64
-                {
-                    if (pic || j+2 > end)
-                        continue;
-                    ssize_t sz = getModRMSize(data+j+1, end-(j+1));
-                    if (sz < 0 || j+1+sz+(ssize_t)sizeof(int32_t) > end)
-                        continue;
-                    int32_t imm32 = *(int32_t *)(data + j + 1 + sz);
-                    target = addrToOffset(phdrs, phnum, imm32);
-                    break;
-                }
-                case 0x48: case 0x4C:       // lea ptr(%rip),%reg
-                {
-                    if (j+7 > end)
-                        continue;
-                    if (data[j+1] != 0x8d)
-                        continue;
-                    uint8_t modRM = data[j+2];
-                    uint8_t mod = (modRM & 0xc0) >> 6;
-                    uint8_t rm  = modRM & 0x7;
-                    if (mod != 0x00 && rm != 0x05)
-                        continue;
-                    target = j + 7 + *(int32_t *)(data + j + 3);
-                    if (target >= 0 && target % sizeof(int32_t) == 0)
-                    {
-                        intptr_t table = addr + (target - offset);
-                        tables.insert(table);
-                    }
-                    break;
-                }
-                case 0xF3:                  // endbr64
-                    if (j+4 > end || !cet)
-                        continue;
-                    if (data[j+1] != 0x0F || data[j+2] != 0x1E ||
-                            data[j+3] != 0xFA)
-                        continue;
-                    target = j;     // endbr64
-                    break;
-                default:
-                    continue;
-            }
-            setTarget(targets, B->size, target);
-            setTarget(targets, B->size, next);
+            chunks.push_back({phdr, offset, end});
+            continue;
+        }
+        for (off_t lo = offset; lo < end; lo += CHUNK_SIZE)
+            chunks.push_back({phdr, lo, std::min(lo + CHUNK_SIZE, end)});
+    }
+    std::set<intptr_t> tables, &taken = B->taken;
+    taken.clear();
+    if (num_threads <= 1 || chunks.size() <= 1)
+    {
+        for (const auto &chunk: chunks)
+            scanCode(B, phdrs, phnum, chunk.phdr, chunk.lo, chunk.hi, cet,
+                /*atomic=*/false, targets, tables, taken);
+    }
+    else
+    {
+        // Parallel scan: Chunks are claimed dynamically by each thread.
+        // The target map is updated atomically, and the thread-local
+        // jump tables (and taken addresses) are merged afterwards.
+        num_threads = std::min(num_threads, chunks.size());
+        std::vector<std::set<intptr_t>> local(num_threads),
+            local_taken(num_threads);
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; t++)
+        {
+            threads.emplace_back([&, t]() {
+                size_t i;
+                while ((i = next++) < chunks.size())
+                    scanCode(B, phdrs, phnum, chunks[i].phdr, chunks[i].lo,
+                        chunks[i].hi, cet, /*atomic=*/true, targets,
+                        local[t], local_taken[t]);
+            });
         }
+        for (auto &thread: threads)
+            thread.join();
+        for (const auto &ts: local)
+            tables.insert(ts.begin(), ts.end());
+        for (const auto &ts: local_taken)
+            taken.insert(ts.begin(), ts.end());
     }
 
     // Step (4): Find other indirect jump targets.
@@ -290,6 +470,8 @@ void targetAnalysis(Binary *B)
         size_t init_size = 0, fini_size = 0;
         const Elf64_Rela *rela = nullptr;
         size_t rela_size = 0;
+        const Elf64_Xword *relr = nullptr;
+        size_t relr_size = 0;
         const struct hshtab_s *hshtab = nullptr;
         const Elf64_Sym *symtab = nullptr;
         for (size_t i = 0; dynamic[i].d_tag != DT_NULL; i++)
@@ -334,6 +516,18 @@ void targetAnalysis(Binary *B)
                 case DT_RELASZ:
                     rela_size = dynamic[i].d_un.d_val / sizeof(Elf64_Rela);
                     break;
+                case DT_RELR:
+                {
+                    intptr_t offset = addrToOffset(phdrs, phnum,
+                        dynamic[i].d_un.d_ptr, /*x=*/false);
+                    if (offset < 0)
+                        break;
+                    relr = (const Elf64_Xword *)(data + offset);
+                    break;
+                }
+                case DT_RELRSZ:
+                    relr_size = dynamic[i].d_un.d_val / sizeof(Elf64_Xword);
+                    break;
                 case DT_SYMTAB:
                 {
                     intptr_t offset = addrToOffset(phdrs, phnum,
@@ -381,6 +575,37 @@ void targetAnalysis(Binary *B)
             intptr_t target = addrToOffset(phdrs, phnum, addr);
             setTarget(targets, B->size, target);
         }
+        intptr_t where = 0;
+        for (size_t i = 0; pic && relr != nullptr && i < relr_size; i++)
+        {
+            // Relr section: an address followed by bitmaps of subsequent
+            // words.  The addend is stored in the relocated word itself.
+            const unsigned W = sizeof(Elf64_Xword);
+            Elf64_Xword bits = 0x1;
+            intptr_t base = where;
+            if ((relr[i] & 0x1) == 0)
+            {
+                base  = (intptr_t)relr[i];
+                where = base + W;
+            }
+            else
+            {
+                bits  = relr[i] >> 1;
+                where = base + (8 * W - 1) * W;
+            }
+            for (unsigned j = 0; bits != 0; bits >>= 1, j++)
+            {
+                if ((bits & 0x1) == 0)
+                    continue;
+                intptr_t offset = addrToOffset(phdrs, phnum, base + j * W,
+                    /*x=*/false);
+                if (offset < 0 || (size_t)offset + W > B->size)
+                    continue;
+                intptr_t addr = *(const intptr_t *)(data + offset);
+                intptr_t target = addrToOffset(phdrs, phnum, addr);
+                setTarget(targets, B->size, target);
+            }
+        }
         if (hshtab != nullptr && symtab != nullptr)
         {
             // Symbols
@@ -406,8 +631,22 @@ void targetAnalysis(Binary *B)
     }
     if (!pic || option_OCFR_hacks)
     {
-        // Non-PIC code pointers & jump tables
+        // Non-PIC code pointers & jump tables.  Most words are not code
+        // pointers, so words outside of the executable range are skipped.
+        static const SkipFunc skip =
+            (__builtin_cpu_supports("avx2")? skipWordsAVX2: skipWords);
+        intptr_t lo = INTPTR_MAX, hi = INTPTR_MIN;
         for (unsigned i = 0; i < phnum; i++)
+        {
+            const Elf64_Phdr *phdr = phdrs + i;
+            if ((phdr->p_type != PT_LOAD && phdr->p_type != PT_GNU_RELRO) ||
+                    (phdr->p_flags & PF_X) == 0 || phdr->p_filesz == 0)
+                continue;
+            lo = std::min(lo, (intptr_t)phdr->p_vaddr);
+            hi = std::max(hi, (intptr_t)(phdr->p_vaddr + phdr->p_filesz - 1));
+        }
+        uintptr_t span = (uintptr_t)hi - (uintptr_t)lo;
+        for (unsigned i = 0; lo <= hi && i < phnum; i++)
         {
             const Elf64_Phdr *phdr = phdrs + i;
             if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_R) == 0)
@@ -416,7 +655,9 @@ void targetAnalysis(Binary *B)
             size_t size  = (size_t)phdr->p_memsz;
             off_t end    = (offset + size > B->size? B->size: offset + size);
             auto bounds = getBounds<intptr_t>(data + offset, data + end);
-            for (const intptr_t *p = bounds.first; p < bounds.second; p++)
+            for (const intptr_t *p = skip(bounds.first, bounds.second, lo,
+                    span); p < bounds.second;
+                    p = skip(p+1, bounds.second, lo, span))
             {
                 intptr_t target = addrToOffset(phdrs, phnum, *p);
                 setTarget(targets, B->size, target);
@@ -438,13 +679,16 @@ void targetAnalysis(Binary *B)
         off_t end     = (offset + size > B->size? B->size: offset + size);
         const uint8_t *base = data + offset;
         auto bounds = getBounds<int32_t>(base, data + end);
-        for (const int32_t *p = bounds.first; p < bounds.second; p++)
+        intptr_t lb = addr + ((intptr_t)bounds.first - (intptr_t)base);
+        intptr_t ub = addr + ((intptr_t)bounds.second - (intptr_t)base);
+        for (auto i = tables.lower_bound(lb); i != tables.end() && *i < ub;
+                ++i)
         {
-            intptr_t table = addr + ((intptr_t)p - (intptr_t)base);
-            auto i = tables.find(table);
-            if (i == tables.end())
+            intptr_t table = *i;
+            if ((table - lb) % sizeof(int32_t) != 0)
                 continue;
-            
+            const int32_t *p = bounds.first + (table - lb) / sizeof(int32_t);
+
             for (const int32_t *q = p; q < bounds.second; q++)
             {
                 intptr_t offset = (intptr_t)*q;
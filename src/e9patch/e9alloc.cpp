@@ -19,18 +19,26 @@
 #include <algorithm>
 
 #include <cassert>
+#include <cctype>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <map>
+#include <unordered_map>
+#include <vector>
+
 #include <sys/mman.h>
 
 #include "e9alloc.h"
 #include "e9patch.h"
 #include "e9trampoline.h"
 
+
+#ifndef E9ALLOC_BTREE
+
 /*
  * Interval tree node.
  */
@@ -47,6 +55,7 @@ struct Node
     uint64_t color:1;       // RB-tree node color
     intptr_t lb;            // tree lower bound
     intptr_t ub;            // tree upper bound
+    size_t time;            // Allocation time
 };
 
 /*
@@ -396,7 +405,66 @@ color:
     return old;
 }
 
+#define NODE_LINK(N)                RB_PARENT(N)
+
+#else
+
+/****************************************************************************/
+/* B+-TREES                                                                 */
+/****************************************************************************/
+
+/*
+ * The alternative (E9ALLOC_BTREE) allocator stores allocations in the leaves
+ * of a B+-tree.  Like the interval tree, each tree node is augmented with the
+ * extent of, and the largest free gap within, the corresponding sub-tree.
+ * However, the wide nodes mean far fewer (and mostly cache-resident) nodes
+ * are visited per allocation.  Allocations are also linked in address order
+ * for the iterators.
+ *
+ * Note that the placement policy does not depend on the tree shape: an
+ * allocation is placed at the lowest address that fits, preferring free
+ * gaps between existing allocations, then after the last allocation, then
+ * before the first allocation.  The resulting layout (and output binary)
+ * therefore differs from the interval tree allocator.
+ */
+#define BTREE_ORDER                 32
+
+/*
+ * Allocation node.
+ */
+struct Node
+{
+    Alloc alloc;            // Allocation
+    Node *prev;             // Previous allocation (address order)
+    Node *next;             // Next allocation (address order)
+    size_t time;            // Allocation time
+};
+
+/*
+ * B+-tree node.  The bounds and gaps of each child are stored inline, so
+ * searching a node does not touch the children themselves.
+ */
+struct BNode
+{
+    BNode *parent;              // Parent node
+    unsigned size;              // Number of children/allocations
+    bool leaf;                  // Is leaf node?
+    intptr_t lb[BTREE_ORDER];   // Child lower bounds
+    intptr_t ub[BTREE_ORDER];   // Child upper bounds
+    uint64_t gap[BTREE_ORDER];  // Child largest free gap (ub - lb)
+    union
+    {
+        BNode *child[BTREE_ORDER];  // Children (internal node)
+        Node *alloc[BTREE_ORDER];   // Allocations (leaf node)
+        void *slot[BTREE_ORDER];    // Either
+    };
+};
+
+#define NODE_LINK(N)                (N)->next
 
+#endif
+
+/****************************************************************************/
 
 /****************************************************************************/
 
@@ -408,26 +476,59 @@ color:
 #define flag_set(flags, flag, val)  \
     ((val)? (flags) | (flag): (flags) & ~(flag))
 
-static Node *insert(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags);
-
 /*
- * Allocate a node.
+ * Allocate a node.  Nodes are carved from large slabs, and deallocated nodes
+ * are recycled via a free-list, so that eviction rollbacks do not hit the
+ * general-purpose heap.
  */
-static Node *alloc()
+#define NODE_SLAB_SIZE              (16 * PAGE_SIZE)
+static Node *alloc(Allocator &allocator)
 {
-    Node *n        = new Node;
+    Node *n = allocator.free;
+    if (n != nullptr)
+        allocator.free = NODE_LINK(n);
+    else
+    {
+        if (allocator.slab_size == 0)
+        {
+            void *ptr = mmap(nullptr, NODE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (ptr == MAP_FAILED)
+                error("failed to allocate allocator node slab: %s",
+                    strerror(errno));
+            allocator.slab      = (Node *)ptr;
+            allocator.slab_size = NODE_SLAB_SIZE / sizeof(Node);
+        }
+        n = allocator.slab++;
+        allocator.slab_size--;
+    }
     n->alloc.T     = nullptr;
     n->alloc.I     = nullptr;
     n->alloc.entry = 0;
+    n->alloc.pad   = 0;
+    n->alloc.slack = 0;
     return n;
 }
 
+/*
+ * Free a node.
+ */
+static void release(Allocator &allocator, Node *n)
+{
+    NODE_LINK(n) = allocator.free;
+    allocator.free  = n;
+}
+
+#ifndef E9ALLOC_BTREE
+
+static Node *insert(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags);
+
 /*
  * Allocate and initialize a new interval tree node.
  */
-static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *node(Allocator &allocator, Node *parent, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     bool alloc_left = ((flags & FLAG_RIGHT) != 0? false:
         ((flags & FLAG_LB) != 0 || (flags & FLAG_UB) == 0));
@@ -460,7 +561,7 @@ static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
         }
     }
 
-    Node *n = alloc();
+    Node *n = alloc(allocator);
     n->alloc.lb     = LB;
     n->alloc.ub     = UB;
     n->lb           = LB;
@@ -476,8 +577,8 @@ static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
 /*
  * Insert left-child helper.
  */
-static Node *insertLeftChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *insertLeftChild(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     ub = std::min(ub, root->alloc.lb);
     if ((intptr_t)size > ub - lb)
@@ -486,17 +587,17 @@ static Node *insertLeftChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
         (root->alloc.lb - ub < (ssize_t)PAGE_SIZE));
     Node *n;
     if (root->entry.left == nullptr)
-        n = root->entry.left = node(root, lb, ub, size, flags);
+        n = root->entry.left = node(allocator, root, lb, ub, size, flags);
     else
-        n = insert(root->entry.left, lb, ub, size, flags);
+        n = insert(allocator, root->entry.left, lb, ub, size, flags);
     return n;
 }
 
 /*
  * Insert right-child helper.
  */
-static Node *insertRightChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *insertRightChild(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     lb = std::max(lb, root->alloc.ub);
     if ((intptr_t)size > ub - lb)
@@ -505,22 +606,22 @@ static Node *insertRightChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
         (lb - root->alloc.ub < (ssize_t)PAGE_SIZE));
     Node *n;
     if (root->entry.right == nullptr)
-        n = root->entry.right = node(root, lb, ub, size, flags);
+        n = root->entry.right = node(allocator, root, lb, ub, size, flags);
     else
-        n = insert(root->entry.right, lb, ub, size, flags);
+        n = insert(allocator, root->entry.right, lb, ub, size, flags);
     return n;
 }
 
 /*
  * Insert a new allocation or reservation into the interval tree node `root`.
  */
-static Node *insert(Node *root, intptr_t lb, intptr_t ub,
-    size_t size, uint32_t flags)
+static Node *insert(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     if ((intptr_t)size > ub - lb)
         return nullptr;
     if (root == nullptr)
-        return node(nullptr, lb, ub, size, flags);
+        return node(allocator, nullptr, lb, ub, size, flags);
 
     Node *n = nullptr;
     if (size <= root->gap)
@@ -528,18 +629,463 @@ static Node *insert(Node *root, intptr_t lb, intptr_t ub,
         intptr_t rlb = std::max(lb, root->lb);
         intptr_t rub = std::min(ub, root->ub);
         if (n == nullptr)
-            n = insertRightChild(root, rlb, rub, size, flags);
+            n = insertRightChild(allocator, root, rlb, rub, size, flags);
         if (n == nullptr)
-            n = insertLeftChild(root, rlb, rub, size, flags);
+            n = insertLeftChild(allocator, root, rlb, rub, size, flags);
     }
     if (n == nullptr && ub > root->ub)
-        n = insertRightChild(root, std::max(lb, root->ub), ub, size, flags);
+        n = insertRightChild(allocator, root, std::max(lb, root->ub), ub,
+            size, flags);
     if (n == nullptr && lb < root->lb)
-        n = insertLeftChild(root, lb, std::min(ub, root->lb), size, flags);
+        n = insertLeftChild(allocator, root, lb, std::min(ub, root->lb),
+            size, flags);
+
+    return n;
+}
+
+/*
+ * Insert a new allocation or reservation into the interval tree.
+ */
+static Node *insertNode(Allocator &allocator, intptr_t lb, intptr_t ub,
+    size_t size, uint32_t flags)
+{
+    Node *n = insert(allocator, allocator.tree.root, lb, ub, size, flags);
+    if (n == nullptr)
+        return nullptr;
+    if (allocator.tree.root == nullptr)
+        allocator.tree.root = n;
+    rebalanceInsert(&allocator.tree, n);
+    return n;
+}
+
+/*
+ * Remove an allocation from the interval tree.
+ */
+static void removeNode(Allocator &allocator, Node *n)
+{
+    remove(&allocator.tree, n);
+}
+
+/*
+ * Iterators.
+ */
+static Node *next(Node *n)
+{
+    if (n == nullptr)
+        return n;
+    if (n->entry.right != nullptr)
+    {
+        n = n->entry.right;
+        while (n->entry.left != nullptr)
+            n = n->entry.left;
+        return n;
+    }
+    else
+    {
+        while (true)
+        {
+            Node *parent = n->entry.parent;
+            if (parent == nullptr)
+                return nullptr;
+            if (parent->entry.left == n)
+                return parent;
+            n = parent;
+        }
+    }
+}
+void Allocator::iterator::operator++()
+{
+    node = next(node);
+}
+Allocator::iterator Allocator::begin() const
+{
+    Node *n = tree.root;
+    if (n == nullptr)
+        return end();
+    while (n->entry.left != nullptr)
+        n = n->entry.left;
+    Allocator::iterator i = {n};
+    return i;
+}
+Allocator::iterator Allocator::find(intptr_t addr) const
+{
+    Node *n = this->tree.root;
+    while (n != nullptr)
+    {
+        if (addr < n->alloc.lb)
+            n = n->entry.left;
+        else if (addr >= n->alloc.ub)
+            n = n->entry.right;
+        else
+            break;
+    }
+    Allocator::iterator i = {n};
+    return i;
+}
+
+#else
+
+/*
+ * Sub-tree summary.
+ */
+struct Summary
+{
+    intptr_t lb;            // Sub-tree lower bound
+    intptr_t ub;            // Sub-tree upper bound
+    uint64_t gap;           // Largest free gap in sub-tree (ub - lb)
+};
+static Summary summary(const BNode *n)
+{
+    Summary s = {n->lb[0], n->ub[n->size-1], n->gap[0]};
+    for (unsigned i = 1; i < n->size; i++)
+    {
+        s.gap = std::max(s.gap, n->gap[i]);
+        s.gap = std::max(s.gap, (uint64_t)(n->lb[i] - n->ub[i-1]));
+    }
+    return s;
+}
+
+/*
+ * Find the index of child `m` within node `n`.
+ */
+static unsigned slotIndex(const BNode *n, const void *m)
+{
+    unsigned i = 0;
+    while (n->slot[i] != m)
+        i++;
+    return i;
+}
+
+/*
+ * Restore B+-tree invariants after a node modification.
+ */
+static void fixPath(BNode *n)
+{
+    for (BNode *parent = n->parent; parent != nullptr;
+            n = parent, parent = n->parent)
+    {
+        Summary s = summary(n);
+        unsigned i = slotIndex(parent, n);
+        if (parent->lb[i] == s.lb && parent->ub[i] == s.ub &&
+                parent->gap[i] == s.gap)
+            return;
+        parent->lb[i]  = s.lb;
+        parent->ub[i]  = s.ub;
+        parent->gap[i] = s.gap;
+    }
+}
+
+/*
+ * Allocate a new B+-tree node.
+ */
+static BNode *bnode(bool leaf)
+{
+    BNode *n  = new BNode;
+    n->parent = nullptr;
+    n->size   = 0;
+    n->leaf   = leaf;
+    return n;
+}
+
+/*
+ * Find the index of the child that (may) contain `addr`.
+ */
+static unsigned childIndex(const BNode *n, intptr_t addr)
+{
+    unsigned lo = 1, hi = n->size;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (n->lb[mid] <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo-1;
+}
+
+/*
+ * Floor page number (also valid for negative addresses).
+ */
+static inline intptr_t pageOf(intptr_t addr)
+{
+    return (addr >= 0? addr / (intptr_t)PAGE_SIZE:
+        -((-addr - 1) / (intptr_t)PAGE_SIZE) - 1);
+}
+
+/*
+ * Place an allocation of `size` within the free gap [glb..gub) intersected
+ * with the range [lb..ub].  Returns the allocation lower bound, or
+ * INTPTR_MIN on failure.
+ */
+static intptr_t place(intptr_t glb, intptr_t gub, intptr_t lb, intptr_t ub,
+    size_t size, uint32_t flags, bool right)
+{
+    intptr_t LB = std::max(glb, lb), UB = std::min(gub, ub);
+    if (UB < LB || (uintptr_t)(UB - LB) < size)
+        return INTPTR_MIN;
+    intptr_t pos = (right? UB - (intptr_t)size: LB);
+    bool same_page   = ((flags & FLAG_SAME_PAGE) != 0);
+    bool spans_pages = (pageOf(pos) != pageOf(pos + size - 1));
+    if (same_page && spans_pages)
+    {
+        pos = (right?
+            pageOf(pos + size - 1) * (intptr_t)PAGE_SIZE - (intptr_t)size:
+            (pageOf(pos) + 1) * (intptr_t)PAGE_SIZE);
+        if (pos < LB || pos + (intptr_t)size > UB ||
+                pageOf(pos) != pageOf(pos + size - 1))
+        {
+            // Cannot fit into the current page == fail.
+            return INTPTR_MIN;
+        }
+    }
+    return pos;
+}
+
+/*
+ * Search for a free gap inside the sub-tree `n`.  The lowest (or highest if
+ * `right`) fitting gap is chosen.
+ */
+static intptr_t search(const BNode *n, intptr_t lb, intptr_t ub, size_t size,
+    uint32_t flags, bool right)
+{
+    // Only children/gaps that intersect [lb..ub] need be considered:
+    unsigned lo = childIndex(n, lb);
+    unsigned hi = std::min(childIndex(n, ub - (intptr_t)size) + 1,
+        n->size - 1);
+    intptr_t pos = INTPTR_MIN;
+    for (unsigned j = lo; j <= hi && pos == INTPTR_MIN; j++)
+    {
+        unsigned i = (right? lo + hi - j: j);
+        bool fits = (i > 0 && (uint64_t)(n->lb[i] - n->ub[i-1]) >= size);
+        if (!right && fits)
+            pos = place(n->ub[i-1], n->lb[i], lb, ub, size, flags, false);
+        if (pos == INTPTR_MIN && !n->leaf && n->gap[i] >= size &&
+                n->ub[i] - (intptr_t)size >= lb &&
+                n->lb[i] + (intptr_t)size <= ub)
+            pos = search(n->child[i], lb, ub, size, flags, right);
+        if (pos == INTPTR_MIN && right && fits)
+            pos = place(n->ub[i-1], n->lb[i], lb, ub, size, flags, true);
+    }
+    return pos;
+}
+
+/*
+ * Copy entries [i..j) from node `src` to node `dst` at index `k`.
+ */
+static void moveEntries(BNode *dst, unsigned k, const BNode *src, unsigned i,
+    unsigned j)
+{
+    memmove(dst->lb   + k, src->lb   + i, (j - i) * sizeof(intptr_t));
+    memmove(dst->ub   + k, src->ub   + i, (j - i) * sizeof(intptr_t));
+    memmove(dst->gap  + k, src->gap  + i, (j - i) * sizeof(uint64_t));
+    memmove(dst->slot + k, src->slot + i, (j - i) * sizeof(void *));
+}
+
+/*
+ * Insert entry `e` with summary `s` into node `n` at index `i`, splitting if
+ * necessary.
+ */
+static void insertEntry(Tree *t, BNode *n, unsigned i, void *e,
+    const Summary &s)
+{
+    BNode *m = n, *r = nullptr;
+    if (n->size >= BTREE_ORDER)
+    {
+        const unsigned half = BTREE_ORDER / 2;
+        r = bnode(n->leaf);
+        moveEntries(r, 0, n, half, BTREE_ORDER);
+        r->size = BTREE_ORDER - half;
+        n->size = half;
+        if (!r->leaf)
+        {
+            for (unsigned j = 0; j < r->size; j++)
+                r->child[j]->parent = r;
+        }
+        if (i > half)
+        {
+            m = r;
+            i -= half;
+        }
+    }
+    moveEntries(m, i+1, m, i, m->size);
+    m->lb[i]   = s.lb;
+    m->ub[i]   = s.ub;
+    m->gap[i]  = s.gap;
+    m->slot[i] = e;
+    m->size++;
+    if (!m->leaf)
+        ((BNode *)e)->parent = m;
+    if (r == nullptr)
+    {
+        fixPath(n);
+        return;
+    }
+
+    BNode *parent = n->parent;
+    if (parent == nullptr)
+    {
+        parent = bnode(false);
+        Summary t0 = summary(n);
+        parent->lb[0]    = t0.lb;
+        parent->ub[0]    = t0.ub;
+        parent->gap[0]   = t0.gap;
+        parent->child[0] = n;
+        parent->size     = 1;
+        n->parent = parent;
+        t->index  = parent;
+    }
+    else
+        fixPath(n);
+    insertEntry(t, parent, slotIndex(parent, n) + 1, r, summary(r));
+}
+
+/*
+ * Remove the entry at index `i` from node `n`.  Empty nodes are removed, but
+ * nodes are otherwise not merged.
+ */
+static void removeEntry(Tree *t, BNode *n, unsigned i)
+{
+    moveEntries(n, i, n, i+1, n->size);
+    n->size--;
+    if (n->size == 0)
+    {
+        BNode *parent = n->parent;
+        if (parent == nullptr)
+            t->index = nullptr;
+        else
+            removeEntry(t, parent, slotIndex(parent, n));
+        delete n;
+        return;
+    }
+    fixPath(n);
+    while (!t->index->leaf && t->index->size == 1)
+    {
+        BNode *root = t->index;
+        t->index = root->child[0];
+        t->index->parent = nullptr;
+        delete root;
+    }
+}
+
+/*
+ * Find the leaf containing (or that would contain) address `addr`.
+ */
+static BNode *leaf(const Tree *t, intptr_t addr)
+{
+    BNode *n = t->index;
+    while (!n->leaf)
+        n = n->child[childIndex(n, addr)];
+    return n;
+}
+
+/*
+ * Insert a new allocation or reservation into the B+-tree.
+ */
+static Node *insertNode(Allocator &allocator, intptr_t lb, intptr_t ub,
+    size_t size, uint32_t flags)
+{
+    Tree *t = &allocator.tree;
+    bool right = ((flags & FLAG_RIGHT) != 0);
+    intptr_t pos = INTPTR_MIN;
+    if (t->index == nullptr)
+        pos = place(INTPTR_MIN, INTPTR_MAX, lb, ub, size, flags, right);
+    else
+    {
+        Summary s = summary(t->index);
+        if (s.gap >= size)
+            pos = search(t->index, lb, ub, size, flags, right);
+        if (pos == INTPTR_MIN)
+            pos = place(s.ub, INTPTR_MAX, lb, ub, size, flags, right);
+        if (pos == INTPTR_MIN)
+            pos = place(INTPTR_MIN, s.lb, lb, ub, size, flags, true);
+    }
+    if (pos == INTPTR_MIN)
+        return nullptr;
+
+    Node *n = alloc(allocator);
+    n->alloc.lb = pos;
+    n->alloc.ub = pos + (intptr_t)size;
+    n->prev     = nullptr;
+    n->next     = nullptr;
+    Summary s   = {n->alloc.lb, n->alloc.ub, 0};
+    if (t->index == nullptr)
+    {
+        t->index = bnode(true);
+        t->head  = n;
+        insertEntry(t, t->index, 0, n, s);
+        return n;
+    }
 
+    BNode *m = leaf(t, pos);
+    unsigned i = childIndex(m, pos);
+    i += (m->lb[i] < pos? 1: 0);
+    if (i < m->size)
+    {
+        n->next = m->alloc[i];
+        n->prev = n->next->prev;
+    }
+    else
+    {
+        n->prev = m->alloc[i-1];
+        n->next = n->prev->next;
+    }
+    if (n->prev != nullptr)
+        n->prev->next = n;
+    else
+        t->head = n;
+    if (n->next != nullptr)
+        n->next->prev = n;
+    insertEntry(t, m, i, n, s);
     return n;
 }
 
+/*
+ * Remove an allocation from the B+-tree.
+ */
+static void removeNode(Allocator &allocator, Node *n)
+{
+    Tree *t = &allocator.tree;
+    BNode *m = leaf(t, n->alloc.lb);
+    if (n->prev != nullptr)
+        n->prev->next = n->next;
+    else
+        t->head = n->next;
+    if (n->next != nullptr)
+        n->next->prev = n->prev;
+    removeEntry(t, m, slotIndex(m, n));
+}
+
+/*
+ * Iterators.
+ */
+void Allocator::iterator::operator++()
+{
+    node = (node == nullptr? nullptr: node->next);
+}
+Allocator::iterator Allocator::begin() const
+{
+    Allocator::iterator i = {tree.head};
+    return i;
+}
+Allocator::iterator Allocator::find(intptr_t addr) const
+{
+    Node *n = nullptr;
+    if (tree.index != nullptr)
+    {
+        const BNode *m = leaf(&tree, addr);
+        unsigned i = childIndex(m, addr);
+        if (m->lb[i] <= addr && addr < m->ub[i])
+            n = m->alloc[i];
+    }
+    Allocator::iterator i = {n};
+    return i;
+}
+
+#endif
+
+/****************************************************************************/
+
 /*
  * Verify bounds.
  */
@@ -554,6 +1100,265 @@ static bool verify(intptr_t lb, intptr_t ub)
     return false;
 }
 
+#ifdef E9ALLOC_TRACE
+/*
+ * Allocation trace (for test/bench/allocbench).  Each line is one of:
+ *      I lb ub size flags node lb'
+ *      D node
+ */
+static FILE *trace(void)
+{
+    static FILE *stream = nullptr;
+    if (stream == nullptr)
+    {
+        const char *filename = getenv("E9ALLOC_TRACE");
+        filename = (filename == nullptr? "e9alloc.trace": filename);
+        stream = fopen(filename, "w");
+        if (stream == nullptr)
+            error("failed to open \"%s\" for writing: %s", filename,
+                strerror(errno));
+    }
+    return stream;
+}
+#endif
+
+/*
+ * Allocation failure memo.  Failed requests are recorded as a (range, flags)
+ * key plus the smallest failing size, so that repeated requests (e.g., T2/T3
+ * trying the same victim for nearby patch sites) are rejected without
+ * searching the tree.  A request only fails if no suitable free gap exists,
+ * so a failure remains valid until an allocation that existed at the time of
+ * the failure is removed.  Failures are logged in time order, meaning that a
+ * deallocation simply truncates the log back to when the node was created.
+ */
+struct FailKey
+{
+    intptr_t lb;            // Request lower bound
+    intptr_t ub;            // Request upper bound
+    uint32_t flags;         // Request flags
+
+    bool operator==(const FailKey &key) const
+    {
+        return (lb == key.lb && ub == key.ub && flags == key.flags);
+    }
+};
+struct FailHash
+{
+    size_t operator()(const FailKey &key) const
+    {
+        uint64_t h = (uint64_t)key.lb * 0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t)key.ub + 0x7F4A7C159E3779B9ull + (h << 6) + (h >> 2);
+        h ^= (uint64_t)key.flags;
+        return (size_t)h;
+    }
+};
+struct Failure
+{
+    FailKey key;            // Request
+    size_t size;            // Smallest failing size
+    size_t time;            // Failure time
+};
+#define FAIL_MEMO_MAX   (1 << 16)
+struct FailMemo
+{
+    size_t time = 0;                        // Current time
+    std::vector<Failure> log;               // Failures (in time order)
+    std::unordered_map<FailKey, size_t, FailHash> index;
+                                            // Request -> log index
+};
+
+/*
+ * Check if a request is known to fail.
+ */
+static bool isFailure(FailMemo &memo, const FailKey &key, size_t size)
+{
+    auto i = memo.index.find(key);
+    if (i == memo.index.end())
+        return false;
+    size_t idx = i->second;
+    if (idx >= memo.log.size() || !(memo.log[idx].key == key))
+    {
+        // Stale (truncated) entry:
+        memo.index.erase(i);
+        return false;
+    }
+    return (size >= memo.log[idx].size);
+}
+
+/*
+ * Insert (and trace) an allocation.
+ */
+static Node *allocNode(Allocator &allocator, intptr_t lb, intptr_t ub,
+    size_t size, uint32_t flags)
+{
+    if (allocator.memo == nullptr)
+        allocator.memo = new FailMemo;
+    FailMemo &memo = *allocator.memo;
+    FailKey key = {lb, ub, flags};
+    Node *n = nullptr;
+    if (!isFailure(memo, key, size))
+    {
+        n = insertNode(allocator, lb, ub, size, flags);
+        if (n != nullptr)
+            n->time = memo.time++;
+        else
+        {
+            // Patching proceeds in reverse address order, so old failures
+            // are rarely queried again.  Bound the memo by simply
+            // discarding it when full (it is only a cache):
+            if (memo.log.size() >= FAIL_MEMO_MAX)
+            {
+                memo.log.clear();
+                memo.index.clear();
+            }
+            Failure failure = {key, size, memo.time};
+            memo.log.push_back(failure);
+            memo.index[key] = memo.log.size()-1;
+        }
+    }
+#ifdef E9ALLOC_TRACE
+    fprintf(trace(), "I %zd %zd %zu %u %p %zd\n", (ssize_t)lb, (ssize_t)ub,
+        size, flags, (void *)n, (n == nullptr? (ssize_t)0:
+            (ssize_t)n->alloc.lb));
+#endif
+    return n;
+}
+
+/*
+ * Remove (and trace) an allocation.
+ */
+static void freeNode(Allocator &allocator, Node *n)
+{
+#ifdef E9ALLOC_TRACE
+    fprintf(trace(), "D %p\n", (void *)n);
+#endif
+    FailMemo &memo = *allocator.memo;
+    while (!memo.log.empty() && memo.log.back().time > n->time)
+        memo.log.pop_back();
+    removeNode(allocator, n);
+    release(allocator, n);
+}
+
+/*
+ * Allocate a trampoline node using the placement options.
+ */
+static Node *allocTrampolineNode(Allocator &allocator, const Instr *I,
+    intptr_t lb, intptr_t ub, size_t size, uint32_t flags)
+{
+    Node *n = nullptr;
+    const intptr_t target = 0x70C00000;
+    const intptr_t hot_target = 0x78000000;
+    if (option_Ohot_cold && lb < hot_target && ub > hot_target &&
+            I != nullptr && isProfileHot(I->addr))
+    {
+        // Pack hot trampolines downwards from hot_target, away from the
+        // (leftmost-allocated) cold trampolines:
+        n = allocNode(allocator, lb, hot_target, size, flags | FLAG_RIGHT);
+    }
+    if (n == nullptr && option_Oorder && ub > target)
+        n = allocNode(allocator, lb, target, size, flags | FLAG_RIGHT);
+    if (n == nullptr)
+        n = allocNode(allocator, lb, ub, size, flags);
+    return n;
+}
+
+/*
+ * Previous trampoline layout (--layout-in).  Maps each instruction address
+ * to the allocation(s) of its trampoline(s) in the previous session.
+ */
+struct LayoutEntry
+{
+    intptr_t lb;            // Allocation lower bound
+    size_t size;            // Allocation size (including slack)
+    unsigned entry;         // Entry offset
+};
+static std::multimap<intptr_t, LayoutEntry> layout;
+static intptr_t layout_ub = INTPTR_MIN;
+
+/*
+ * Load a previous trampoline layout, as written by saveLayout().
+ */
+void loadLayout(const char *filename)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        error("failed to open layout \"%s\" for reading: %s", filename,
+            strerror(errno));
+
+    char line[BUFSIZ];
+    for (size_t lineno = 1; fgets(line, sizeof(line), stream) != nullptr;
+            lineno++)
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        intptr_t addr, lb;
+        size_t size;
+        unsigned entry;
+        char c = '\n';
+        int r = sscanf(line, "%zi,%zi,%zu,%u%c", &addr, &lb, &size, &entry,
+            &c);
+        if (r < 4 || !isspace(c) || entry > size)
+            error("failed to parse layout \"%s\" at line %zu; expected "
+                "4 (address,lb,size,entry) columns", filename, lineno);
+        LayoutEntry L = {lb, size, entry};
+        layout.insert({addr, L});
+        layout_ub = std::max(layout_ub, lb + (intptr_t)size);
+    }
+    fclose(stream);
+}
+
+/*
+ * Save the trampoline layout.  This is one (address,lb,size,entry) line per
+ * trampoline allocation, where `address' is the patched instruction.
+ */
+void saveLayout(const Binary *B, const char *filename)
+{
+    FILE *stream = fopen(filename, "w");
+    if (stream == nullptr)
+        error("failed to open layout \"%s\" for writing: %s", filename,
+            strerror(errno));
+    fputs("# address,lb,size,entry\n", stream);
+    for (const auto *A: B->allocator)
+    {
+        if (A->I == nullptr)
+            continue;
+        fprintf(stream, "%#zx,%#zx,%zu,%u\n", (size_t)A->I->addr,
+            (size_t)A->lb, (size_t)(A->ub - A->lb), A->entry);
+    }
+    if (ferror(stream) || fclose(stream) != 0)
+        error("failed to write layout \"%s\": %s", filename,
+            strerror(errno));
+}
+
+/*
+ * Attempt to (re)allocate a trampoline node at its previous location.  The
+ * previous allocation must still fit the current bounds and size.
+ */
+static Node *allocLayoutNode(Allocator &allocator, const Instr *I,
+    intptr_t lb, intptr_t ub, intptr_t entry_ub, int presize, size_t size,
+    uint32_t flags, unsigned &pad)
+{
+    auto range = layout.equal_range(I->addr);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+        const LayoutEntry &L = i->second;
+        if (L.size < size || L.entry < (unsigned)presize ||
+                L.entry - (unsigned)presize > L.size - size)
+            continue;
+        intptr_t L_ub = L.lb + (intptr_t)L.size;
+        if (L.lb < lb || L_ub > ub + (intptr_t)(L.size - size) ||
+                L.lb + (intptr_t)L.entry > entry_ub)
+            continue;
+        Node *n = allocNode(allocator, L.lb, L_ub, L.size, flags);
+        if (n != nullptr)
+        {
+            pad = L.entry - (unsigned)presize;
+            return n;
+        }
+    }
+    return nullptr;
+}
+
 /*
  * Allocates a chunk of virtual address space of size `size` and within the
  * range [lb..ub].  Returns the allocation, or nullptr on failure.
@@ -568,26 +1373,71 @@ const Alloc *allocate(Binary *B, intptr_t lb, intptr_t ub,
     int tmpsize = getTrampolineSize(B, T, I);
     if (tmpsize < 0)
         return nullptr;
+    intptr_t entry_ub = ub;
     lb -= (intptr_t)presize;
     ub += (intptr_t)tmpsize;
     size_t size = (size_t)presize + (size_t)tmpsize;
     uint32_t flags = (same_page? FLAG_SAME_PAGE: 0);
     Node *n = nullptr;
-    const intptr_t target = 0x70C00000;
-    if (option_Oorder && ub > target)
-        n = insert(allocator.tree.root, lb, target, size, flags | FLAG_RIGHT);
+
+    unsigned pad = 0, slack = 0;
+
+    // Trampolines are kept at their previous location where possible
+    // (--layout-in).  Trampolines for new instructions are preferably
+    // allocated above the previous layout, so as not to displace others.
+    if (!layout.empty() && I != nullptr)
+    {
+        if (layout.find(I->addr) != layout.end())
+        {
+            n = allocLayoutNode(allocator, I, lb, ub, entry_ub, presize, size,
+                flags, pad);
+            if (n != nullptr)
+                slack = (unsigned)(n->alloc.ub - n->alloc.lb) - size;
+        }
+        else if (layout_ub < ub)
+            n = allocTrampolineNode(allocator, I, std::max(lb, layout_ub),
+                ub, size, flags);
+    }
+
+    // Entry alignment (--mem-align-entry) is only applied to trampolines
+    // that fit within one aligned block, and (with a --profile) to hot
+    // instructions.  The allocation is over-sized by (align-1) bytes, and
+    // the entry is shifted to the next aligned address.
+    const size_t align = option_mem_align_entry;
+    if (n == nullptr && align > 1 && I != nullptr &&
+            (size_t)tmpsize <= align &&
+            (!option_profile || isProfileHot(I->addr)))
+    {
+        slack = (unsigned)(align - 1);
+        n = allocTrampolineNode(allocator, I, lb, ub + slack, size + slack,
+            flags);
+        if (n != nullptr)
+        {
+            intptr_t entry = n->alloc.lb + presize;
+            pad = (unsigned)((align - (size_t)entry % align) % align);
+            if (entry + (intptr_t)pad > entry_ub)
+            {
+                // Aligned entry is out-of-range, so fall back:
+                freeNode(allocator, n);
+                n = nullptr;
+            }
+        }
+        if (n == nullptr)
+            pad = slack = 0;
+    }
     if (n == nullptr)
-        n = insert(allocator.tree.root, lb, ub, size, flags);
+        n = allocTrampolineNode(allocator, I, lb, ub, size, flags);
     if (n == nullptr)
         return nullptr;
-    if (allocator.tree.root == nullptr)
-        allocator.tree.root = n;
-    rebalanceInsert(&allocator.tree, n);
 
     Alloc *A = &n->alloc;
     A->T     = T;
     A->I     = I;
-    A->entry = (unsigned)presize;
+    A->entry = (unsigned)presize + pad;
+    A->pad   = (uint16_t)pad;
+    A->slack = (uint16_t)slack;
+    stat_num_aligned += (slack > 0? 1: 0);
+    stat_align_bytes += slack;
     return A;
 }
 
@@ -605,12 +1455,9 @@ bool reserve(Binary *B, intptr_t lb, intptr_t ub)
     if (ub - lb <= 0)
         return false;
     uint32_t flags = 0;
-    Node *n = insert(allocator.tree.root, lb, ub, (ub - lb), flags);
+    Node *n = allocNode(allocator, lb, ub, (ub - lb), flags);
     if (n == nullptr)
         return false;
-    if (allocator.tree.root == nullptr)
-        allocator.tree.root = n;
-    rebalanceInsert(&allocator.tree, n);
 
     Alloc *A = &n->alloc;
     A->T = nullptr;
@@ -628,8 +1475,9 @@ void deallocate(Binary *B, const Alloc *a)
         return;
     Node *n = (Node *)(a);
     assert(n->alloc.T != nullptr);
-    remove(&allocator.tree, n);
-    delete n;
+    stat_num_aligned -= (a->slack > 0? 1: 0);
+    stat_align_bytes -= a->slack;
+    freeNode(allocator, n);
 }
 
 /*
@@ -639,57 +1487,3 @@ Alloc *Allocator::iterator::operator*()
 {
     return &node->alloc;
 }
-static Node *next(Node *n)
-{
-    if (n == nullptr)
-        return n;
-    if (n->entry.right != nullptr)
-    {
-        n = n->entry.right;
-        while (n->entry.left != nullptr)
-            n = n->entry.left;
-        return n;
-    }
-    else
-    {
-        while (true)
-        {
-            Node *parent = n->entry.parent;
-            if (parent == nullptr)
-                return nullptr;
-            if (parent->entry.left == n)
-                return parent;
-            n = parent;
-        }
-    }
-}
-void Allocator::iterator::operator++()
-{
-    node = next(node);
-}
-Allocator::iterator Allocator::begin() const
-{
-    Node *n = tree.root;
-    if (n == nullptr)
-        return end();
-    while (n->entry.left != nullptr)
-        n = n->entry.left;
-    Allocator::iterator i = {n};
-    return i;
-}
-Allocator::iterator Allocator::find(intptr_t addr) const
-{
-    Node *n = this->tree.root;
-    while (n != nullptr)
-    {
-        if (addr < n->alloc.lb)
-            n = n->entry.left;
-        else if (addr >= n->alloc.ub)
-            n = n->entry.right;
-        else
-            break;
-    }
-    Allocator::iterator i = {n};
-    return i;
-}
-
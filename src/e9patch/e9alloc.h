@@ -27,5 +27,7 @@ const Alloc *allocate(Binary *B, intptr_t lb, intptr_t ub,
     const Trampoline *T, const Instr *I, bool same_page = false);
 bool reserve(Binary *B, intptr_t lb, intptr_t ub);
 void deallocate(Binary *B, const Alloc *a);
+void loadLayout(const char *filename);
+void saveLayout(const Binary *B, const char *filename);
 
 #endif
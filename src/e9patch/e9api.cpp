@@ -26,12 +26,14 @@
 #include <unistd.h>
 
 #include "e9CFR.h"
+#include "e9alloc.h"
 #include "e9elf.h"
 #include "e9emit.h"
 #include "e9optimize.h"
 #include "e9patch.h"
 #include "e9pe.h"
 #include "e9json.h"
+#include "e9loader.h"
 #include "e9tactics.h"
 #include "e9x86_64.h"
 
@@ -61,6 +63,13 @@ static void queueFlush(Binary *B, intptr_t cursor)
             "messages were not send in reverse order", cursor);
     B->cursor = cursor;
 
+    // Note: Patches are applied strictly serially, in reverse address
+    //       order.  Patches further apart than the window below do not
+    //       share instruction state, but they do share the allocator,
+    //       which packs trampolines first-fit from the lowest feasible
+    //       address, and each placement depends on all previous ones.
+    //       The -Opeephole state (B->Es) is also shared.  Applying
+    //       windows concurrently would therefore change the output.
     cursor += std::max(
         T0_LIMIT * /*max instruction size=*/15,
         /*max short jmp=*/ INT8_MAX + 2 + /*max instruction size=*/15) +
@@ -108,6 +117,25 @@ static void queueFlush(Binary *B, intptr_t cursor)
     }
 }
 
+/*
+ * Move all buffered patches at or above `bound' into the patching queue,
+ * in reverse address order.
+ */
+static void reorderFlush(Binary *B, intptr_t bound)
+{
+    while (!B->R.empty())
+    {
+        auto i = std::prev(B->R.end());
+        if (i->first < bound)
+            break;
+        B->Q.push_front(i->second);
+        intptr_t addr = i->first;
+        B->R.erase(i);
+        if (!option_batch)
+            queueFlush(B, addr);
+    }
+}
+
 /*
  * Queue an instruction for patching.
  */
@@ -120,9 +148,27 @@ static void queuePatch(Binary *B, Instr *I, const Trampoline *T)
     }
 
     PatchEntry entry(I, T);
-    B->Q.push_front(entry);
-    if (!option_batch)
-        queueFlush(B, I->addr);
+    if (option_reorder_window == 0)
+    {
+        B->Q.push_front(entry);
+        if (!option_batch)
+            queueFlush(B, I->addr);
+        return;
+    }
+
+    // Out-of-order patches are buffered until no later patch can be
+    // above them, i.e., until they are at least --reorder-window bytes
+    // above the lowest patch sent so far.
+    if (I->addr >= B->cursor ||
+            (!B->Q.empty() && !B->Q.front().options &&
+                I->addr >= B->Q.front().I->addr))
+        error("failed to patch instruction at address 0x%lx; \"patch\" "
+            "messages were not sent in reverse order (outside of the "
+            "reorder window)", I->addr);
+    B->R.insert({I->addr, entry});
+    intptr_t lb = B->R.begin()->first;
+    if (lb <= INTPTR_MAX - (intptr_t)option_reorder_window)
+        reorderFlush(B, lb + (intptr_t)option_reorder_window);
 }
 
 /*
@@ -222,6 +268,12 @@ mmap_failed:
                 warning("tactic B0 is not supported for Windows PE binaries");
                 option_tactic_B0 = false;
             }
+            if (option_mem_huge_pages)
+            {
+                warning("huge pages are not supported for Windows PE "
+                    "binaries");
+                option_mem_huge_pages = false;
+            }
             break;
     }
 
@@ -243,6 +295,7 @@ mmap_failed:
             filename, strerror(errno));
     B->patched.state = (uint8_t *)ptr;
     memset(B->patched.state + size, STATE_OVERFLOW, ext_size - size);
+    B->patched.paged = new uint8_t[ext_size / PAGE_SIZE + 2]();
 
     // CFR analysis:
     targetAnalysis(B);
@@ -250,6 +303,75 @@ mmap_failed:
     return B;
 }
 
+/*
+ * Mark an instruction byte (at address `addr') as STATE_INSTRUCTION.  It is
+ * an error if the byte has already been patched or allocated.
+ */
+static void markInstructionState(uint8_t &state, intptr_t addr)
+{
+    switch (state)
+    {
+        case STATE_UNKNOWN:
+            state = STATE_INSTRUCTION;
+            break;
+        case STATE_INSTRUCTION | STATE_LOCKED:
+        case STATE_PATCHED:
+        case STATE_PATCHED | STATE_LOCKED:
+        case STATE_QUEUED:
+        case STATE_FREE:
+            error("failed to insert instruction at address 0x%lx, the "
+                "corresponding virtual memory has already been patched",
+                addr);
+        default:
+            error("failed to insert instruction at address 0x%lx, the "
+                "corresponding virtual memory has already been allocated "
+                "with state (0x%.2X)", addr, state);
+    }
+}
+
+/*
+ * Construct an instruction into the (already allocated) slot `ptr'.
+ * Instructions are inserted in reverse order, so the next slot (if any) is
+ * the successor.  Overlap is checked eagerly against the successor, even
+ * if the state page has not been materialized yet.
+ */
+static void insertInstruction(Binary *B, void *ptr, intptr_t address,
+    off_t offset, size_t length)
+{
+    const Instr *J = (Instr *)ptr + 1;
+    if (J < B->Is.ub)
+    {
+        if (offset >= (off_t)J->offset || address >= J->addr)
+            error("failed to insert instruction at address 0x%lx, "
+                "\"instruction\" messages were not sent in reverse order",
+                address);
+        if (offset + (off_t)length > (off_t)J->offset ||
+                address + (ssize_t)length > J->addr)
+            error("failed to insert instruction at address 0x%lx, instruction "
+                "overlaps with another instruction at 0x%lx",
+                address, J->addr);
+    }
+    size_t pcrel32_idx = 0, pcrel8_idx = 0;
+    unsigned pcrel_idx = getInstrPCRelativeIndex(B->original.bytes + offset,
+        length);
+    if (pcrel_idx != 0)
+    {
+        if (length - pcrel_idx < sizeof(int32_t))
+            pcrel8_idx = pcrel_idx;     // Must be pcrel8
+        else
+            pcrel32_idx = pcrel_idx;    // Must be pcrel32
+    }
+    Instr *I = new (ptr) Instr(B, offset, address, length,
+        pcrel32_idx, pcrel8_idx, B->pic, isTarget(B, offset));
+    uint8_t *state = B->patched.state + I->offset;
+    for (unsigned i = 0; i < I->size; i++)
+    {
+        if (!B->patched.paged[(I->offset + i) / PAGE_SIZE])
+            continue;       // Checked & marked by materializeState()
+        markInstructionState(state[i], I->addr + i);
+    }
+}
+
 /*
  * Parse an instruction message.
  */
@@ -307,50 +429,103 @@ static void parseInstruction(Binary *B, const Message &msg)
         error("failed to parse \"instruction\" message (id=%u); duplicate "
             "parameters detected", msg.id);
 
-    size_t pcrel32_idx = 0, pcrel8_idx = 0;
-    unsigned pcrel_idx = getInstrPCRelativeIndex(B->original.bytes + offset,
-        length);
-    if (pcrel_idx != 0)
+    insertInstruction(B, B->Is.alloc(), address, offset, length);
+}
+
+/*
+ * Parse an instructions message.  This is a bulk version of the
+ * "instruction" message for a contiguous run of instructions, and is only
+ * sent by the binary RPC (see getRecord()).
+ */
+static void parseInstructions(Binary *B, const Message &msg)
+{
+    intptr_t address = 0;
+    size_t   count   = 0;
+    off_t    offset  = 0;
+    const uint8_t *sizes = nullptr;
+    for (unsigned i = 0; i < msg.num_params; i++)
     {
-        if (length - pcrel_idx < sizeof(int32_t))
-            pcrel8_idx = pcrel_idx;     // Must be pcrel8
-        else
-            pcrel32_idx = pcrel_idx;    // Must be pcrel32
+        switch (msg.params[i].name)
+        {
+            case PARAM_ADDRESS:
+                address = (intptr_t)msg.params[i].value.integer;
+                break;
+            case PARAM_LENGTH:
+                count = (size_t)msg.params[i].value.integer;
+                break;
+            case PARAM_OFFSET:
+                offset = (off_t)msg.params[i].value.integer;
+                break;
+            case PARAM_SIZES:
+                sizes = msg.params[i].value.sizes;
+                break;
+            default:
+                break;
+        }
     }
-    if (B->Is.size() > 0)
+    if (count == 0 || sizes == nullptr)
+        return;
+    if (offset < 0)
+        error("failed to parse \"instructions\" message (id=%u); the "
+            "instruction offset (%zd) is negative", msg.id, offset);
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        const Instr *J = B->Is.front();
-        if (offset >= (off_t)J->offset || address >= J->addr)
-            error("failed to insert instruction at address 0x%lx, "
-                "\"instruction\" messages were not sent in reverse order",
-                address);
-        if (offset + length > (off_t)J->offset ||
-                address + (ssize_t)length > J->addr)
-            error("failed to insert instruction at address 0x%lx, instruction "
-                "overlaps with another instruction at 0x%lx",
-                address, J->addr);
+        if (sizes[i] == 0 || sizes[i] > 15)
+            error("failed to parse \"instructions\" message (id=%u); "
+                "instruction #%zu size (%u) must be within the range 1..15",
+                msg.id, i, sizes[i]);
+        length += sizes[i];
     }
-    Instr *I = new (B->Is.alloc()) Instr(B, offset, address, length,
-        pcrel32_idx, pcrel8_idx, B->pic, isTarget(B, offset));
-    for (unsigned i = 0; i < I->size; i++)
+    if (offset + length > B->size)
+        error("failed to parse \"instructions\" message (id=%u); the "
+            "instruction offset+length (%zd+%zu) overflows "
+            "the end-of-file \"%s\" (with size %zu)", msg.id, offset, length,
+            B->filename, B->size);
+
+    // Reserve all slots at once, then fill them in descending order (so
+    // that each instruction is checked against its successor):
+    Instr *Is = (Instr *)B->Is.alloc(count);
+    address += (intptr_t)length;
+    offset  += (off_t)length;
+    for (size_t i = count; i-- > 0; )
+    {
+        address -= sizes[i];
+        offset  -= sizes[i];
+        insertInstruction(B, Is + i, address, offset, sizes[i]);
+    }
+}
+
+/*
+ * Materialize the state for the given page (and the next page).  Pages
+ * are materialized on first use, by marking the bytes of all instructions
+ * in the page as STATE_INSTRUCTION.  This is lazy validation only: the
+ * state is still one byte per file byte, and instruction overlap was
+ * already checked by insertInstruction().  The state of a page is only
+ * written after it is materialized, so the checks here cannot fail for
+ * well-formed input.  Instructions inserted after the page is
+ * materialized are marked by insertInstruction().
+ */
+void materializeState(const Binary *B, size_t page)
+{
+    for (size_t p = page; p <= page + 1; p++)
     {
-        switch (I->STATE[i])
+        if (B->patched.paged[p])
+            continue;
+        B->patched.paged[p] = true;
+        size_t lb = p * PAGE_SIZE, ub = lb + PAGE_SIZE;
+        if (lb >= B->size)
+            continue;
+        const Instr *I = B->Is.lower_bound(lb);
+        I = (I == nullptr? B->Is.back(): I->prev());
+        I = (I == nullptr? B->Is.front(): I);
+        for (; I != nullptr && I->offset < ub; I = I->next())
         {
-            case STATE_UNKNOWN:
-                I->STATE[i] = STATE_INSTRUCTION;
-                break;
-            case STATE_INSTRUCTION | STATE_LOCKED:
-            case STATE_PATCHED:
-            case STATE_PATCHED | STATE_LOCKED:
-            case STATE_QUEUED:
-            case STATE_FREE:
-                error("failed to insert instruction at address 0x%lx, the "
-                    "corresponding virtual memory has already been patched",
-                    I->addr + i);
-            default:
-                error("failed to insert instruction at address 0x%lx, the "
-                    "corresponding virtual memory has already been allocated "
-                    "with state (0x%.2X)", I->addr + i, I->STATE[i]);
+            size_t lo = std::max(I->offset, lb);
+            size_t hi = std::min(I->offset + I->size, ub);
+            for (size_t i = lo; i < hi; i++)
+                markInstructionState(B->patched.state[i],
+                    I->addr + (intptr_t)(i - I->offset));
         }
     }
 }
@@ -457,6 +632,7 @@ static void parseEmit(Binary *B, const Message &msg)
     buildEntrySet(B);
 
     // Flush the queue:
+    reorderFlush(B, INTPTR_MIN);
     queueFlush(B, INTPTR_MIN);
     log(COLOR_NONE, '\n');
 
@@ -467,21 +643,47 @@ static void parseEmit(Binary *B, const Message &msg)
                    B->mode == MODE_PE_DLL? WINDOWS_VIRTUAL_ALLOC_SIZE:
                     granularity);
     size_t mapping_size = std::max(granularity, option_mem_mapping_size);
+    if (option_mem_auto != OPTION_MEM_AUTO_NONE)
+    {
+        StatsTimer auto_timer(stats, "autoMappings");
+        autoMappings(B->allocator, granularity, mapping_size,
+            option_mem_granularity, mapping_size);
+        option_mem_mapping_size = mapping_size;
+        debug("mem-auto: selected granularity=%zu mapping-size=%zu",
+            option_mem_granularity, mapping_size);
+    }
+    StatsTimer mapping_timer(stats, "mapping");
     buildMappings(B->allocator, mapping_size, mappings);
+    stat_num_virtual_mappings += mappings.size();
+    mapping_timer.stop();
+    StatsTimer optimize_timer(stats, "optimizeMappings");
     switch (option_mem_granularity)
     {
         case 128:
-            optimizeMappings<Key128>(B->allocator, mapping_size, granularity,
-                mappings);
+            stat_pack_saved_bytes = optimizeMappings<Key128>(B->allocator,
+                mapping_size, granularity, mappings, option_threads,
+                option_mem_pack_budget, option_log);
             break;
         case 4096:
-            optimizeMappings<Key4096>(B->allocator, mapping_size, granularity,
-                mappings);
+            stat_pack_saved_bytes = optimizeMappings<Key4096>(B->allocator,
+                mapping_size, granularity, mappings, option_threads,
+                option_mem_pack_budget, option_log);
             break;
         default:
             error("unimplemented granularity (%zu)",
                 option_mem_granularity);
     }
+    stat_num_physical_mappings += mappings.size();
+    optimize_timer.stop();
+    StatsTimer emit_timer(stats, "emit");
+
+    // Save the trampoline layout (--layout-out):
+    if (option_layout_out != nullptr)
+        saveLayout(B, option_layout_out);
+
+    // Save the per-site report (--sites-out):
+    if (option_sites_out != nullptr)
+        saveSites(option_sites_out, mapping_size);
 
     // Post-processing & optimizations:
     flattenAllTrampolines(B);
@@ -502,7 +704,8 @@ static void parseEmit(Binary *B, const Message &msg)
     switch (format)
     {
         case FORMAT_BINARY:
-            emitBinary(filename, B->patched.bytes, B->patched.size);
+            emitBinary(filename, B->patched.bytes, B->patched.size,
+                B->original.fd, B->original.bytes, B->size);
             break;
         case FORMAT_PATCH:
             emitPatch(filename, /*compress=*/nullptr, B->original.fd,
@@ -520,6 +723,11 @@ static void parseEmit(Binary *B, const Message &msg)
             emitPatch(filename, "xz", B->original.fd, B->patched.bytes,
                 B->patched.size);
             break;
+        case FORMAT_DELTA: case FORMAT_DELTA_GZ:
+            emitDelta(filename, /*compress=*/(format == FORMAT_DELTA_GZ),
+                B->original.bytes, B->size, B->patched.bytes,
+                B->patched.size);
+            break;
         default:
             error("failed to parse \"emit\" message (id=%u); invalid "
                 "\"format\" code %u", msg.id, (unsigned)format);
@@ -532,16 +740,20 @@ static void parseEmit(Binary *B, const Message &msg)
 static void parseReserve(Binary *B, const Message &msg)
 {
     bool absolute     = false;
+    bool hot          = false;
+    bool zero         = false;
     intptr_t address  = 0;
     intptr_t init     = 0;
     intptr_t fini     = 0;
     intptr_t mmap     = 0;
     size_t length     = 0;
+    size_t tls        = 0;
     Trampoline *bytes = nullptr;
     int protection    = PROT_READ | PROT_EXEC;
     bool have_address = false, have_protection = false, have_init = false,
         have_fini = false, have_mmap = false, have_length = false,
-        have_absolute = false, dup = false;
+        have_absolute = false, have_hot = false, have_tls = false,
+        have_zero = false, dup = false;
     for (unsigned i = 0; i < msg.num_params; i++)
     {
         switch (msg.params[i].name)
@@ -560,6 +772,11 @@ static void parseReserve(Binary *B, const Message &msg)
                 dup = dup || (bytes != nullptr);
                 bytes = msg.params[i].value.trampoline;
                 break;
+            case PARAM_HOT:
+                dup = dup || have_hot;
+                hot = msg.params[i].value.boolean;
+                have_hot = true;
+                break;
             case PARAM_INIT:
                 dup = dup || have_init;
                 init = (intptr_t)msg.params[i].value.integer;
@@ -585,10 +802,38 @@ static void parseReserve(Binary *B, const Message &msg)
                 protection = (int)msg.params[i].value.integer;
                 have_protection = true;
                 break;
+            case PARAM_TLS:
+                dup = dup || have_tls;
+                tls = (size_t)msg.params[i].value.integer;
+                have_tls = true;
+                break;
+            case PARAM_ZERO:
+                dup = dup || have_zero;
+                zero = msg.params[i].value.boolean;
+                have_zero = true;
+                break;
             default:
                 break;
         }
     }
+    if (have_tls)
+    {
+        if (dup)
+            error("failed to parse \"reserve\" message (id=%u); duplicate "
+                "parameters detected", msg.id);
+        if (B->mode != MODE_ELF_EXE && B->mode != MODE_ELF_DSO)
+            error("failed to parse \"reserve\" message (id=%u); the "
+                "\"tls\" parameter is only supported for ELF binaries",
+                msg.id);
+        if (tls == 0 || tls > E9_TLS_MAX)
+            error("failed to parse \"reserve\" message (id=%u); \"tls\" "
+                "parameter value (%zu) must be within the range 1..%u",
+                msg.id, tls, E9_TLS_MAX);
+        B->tls = std::max(B->tls, tls);
+        debug("reserved per-thread block [size=%zu]", B->tls);
+        if (!have_address && bytes == nullptr && !have_length)
+            return;
+    }
     if (!have_address)
         error("failed to parse \"reserve\" message (id=%u); missing "
             "\"address\" parameter", msg.id);
@@ -599,6 +844,12 @@ static void parseReserve(Binary *B, const Message &msg)
         error("failed to parse \"reserve\" message (id=%u); only one of "
             "the \"bytes\" or \"length\" parameters can be specified",
             msg.id);
+    if (hot && bytes == nullptr)
+        error("failed to parse \"reserve\" message (id=%u); the \"hot\" "
+            "parameter requires the \"bytes\" parameter", msg.id);
+    if (zero && !have_length)
+        error("failed to parse \"reserve\" message (id=%u); the \"zero\" "
+            "parameter requires the \"length\" parameter", msg.id);
     if (absolute && B->pic)
         address = ABSOLUTE_ADDRESS(address);
     if (have_init)
@@ -646,6 +897,7 @@ static void parseReserve(Binary *B, const Message &msg)
     if (bytes != nullptr)
     {
         bytes->preload = true;
+        bytes->hot     = hot;
         length = getTrampolineSize(B, bytes, nullptr);
         size_t length_lo = address % PAGE_SIZE;
         size_t length_hi = PAGE_SIZE - (length_lo + length) % PAGE_SIZE;
@@ -680,6 +932,20 @@ static void parseReserve(Binary *B, const Message &msg)
         if (!reserve(B, address, address + length))
             error("failed to reserve address space at address "
                 ADDRESS_FORMAT, ADDRESS(address));
+        if (zero)
+        {
+            // Zero-filled mapping (e.g., shadow memory):
+            if (B->mode != MODE_ELF_EXE && B->mode != MODE_ELF_DSO)
+                error("failed to parse \"reserve\" message (id=%u); the "
+                    "\"zero\" parameter is only supported for ELF "
+                    "binaries", msg.id);
+            if (address % PAGE_SIZE != 0 || length % PAGE_SIZE != 0)
+                error("failed to parse \"reserve\" message (id=%u); "
+                    "zero-filled mapping " ADDRESS_FORMAT ".." ADDRESS_FORMAT
+                    " is not page aligned", msg.id, ADDRESS(address),
+                    ADDRESS(address + (intptr_t)length));
+            B->zeros.push_back({address, length, protection});
+        }
         debug("reserved address space [prot=%c%c%c, size=%zu, range="
             ADDRESS_FORMAT ".." ADDRESS_FORMAT "]",
             (protection & PROT_READ? 'r': '-'),
@@ -757,6 +1023,7 @@ static void parseOptions(Binary *B, const Message &msg)
     if (dup)
         error("failed to parse \"options\" message (id=%u); duplicate "
             "parameters detected", msg.id);
+    reorderFlush(B, INTPTR_MIN);
     if (B->cursor == INTPTR_MAX)
     {
         parseOptions(B, argv);
@@ -784,10 +1051,16 @@ Binary *parseMessage(Binary *B, Message &msg)
             if (B != nullptr)
                 error("failed to parse message stream; got duplicate "
                     "\"binary\" message (id=%u)", msg.id);
+        {
+            StatsTimer timer(stats, "binary");
             return parseBinary(msg);
+        }
         case METHOD_INSTRUCTION:
             parseInstruction(B, msg);
             return B;
+        case METHOD_INSTRUCTIONS:
+            parseInstructions(B, msg);
+            return B;
         case METHOD_PATCH:
             parsePatch(B, msg);
             return B;
@@ -0,0 +1,56 @@
+/*
+ * e9delta.h
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9DELTA_H
+#define __E9DELTA_H
+
+#include <stdint.h>
+
+/*
+ * Binary delta format (host/little-endian):
+ *
+ *      struct e9_delta_hdr_s hdr;
+ *      struct e9_delta_rec_s rec[0];   uint8_t data[rec[0].size];
+ *      ...
+ *      struct e9_delta_rec_s rec[N-1]; uint8_t data[rec[N-1].size];
+ *
+ * The patched file is the original file truncated/extended to hdr.size
+ * bytes, with each rec[i].size bytes at rec[i].offset replaced by data.
+ * Records are sorted by offset and do not overlap.  The "delta.gz" format
+ * is the gzip compressed "delta" format.
+ */
+#define E9_DELTA_MAGIC              "E9DELTA"
+#define E9_DELTA_VERSION            1
+
+struct e9_delta_hdr_s
+{
+    char magic[8];                      // E9_DELTA_MAGIC
+    uint32_t version;                   // E9_DELTA_VERSION
+    uint32_t reserved;                  // Reserved (zero)
+    uint64_t orig_size;                 // Original file size
+    uint64_t size;                      // Patched file size
+    uint64_t num_records;               // Number of records
+};
+
+struct e9_delta_rec_s
+{
+    uint64_t offset;                    // File offset
+    uint64_t size;                      // Data size
+};
+
+#endif
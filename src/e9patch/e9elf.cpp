@@ -29,12 +29,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <utility>
 
 #include "e9alloc.h"
 #include "e9elf.h"
 #include "e9loader.h"
 #include "e9mapping.h"
+#include "e9optimize.h"
 #include "e9patch.h"
 
 static const
@@ -330,7 +332,7 @@ static size_t emitRefactoredPatch(const uint8_t *original, uint8_t *data,
  * Emit a mapping.
  */
 size_t emitLoaderMap(uint8_t *data, intptr_t addr, size_t len, off_t offset,
-    bool r, bool w, bool x, uint32_t type, intptr_t *ub)
+    bool r, bool w, bool x, uint32_t type, intptr_t *ub, bool huge, bool hot)
 {
     bool abs = IS_ABSOLUTE(addr);
     if (ub != nullptr && !abs)
@@ -348,23 +350,166 @@ size_t emitLoaderMap(uint8_t *data, intptr_t addr, size_t len, off_t offset,
     if (addr < INT32_MIN || addr > INT32_MAX)
         error("mapping address (" ADDRESS_FORMAT ") %sflow detected",
             ADDRESS(addr), (addr < 0? "under": "over"));
-    if (len >= (1 << 21))
+    if (len >= (1 << 20))
         error("mapping size (%zu) overflow detected", len);
     if (offset > UINT32_MAX)
         error("mapping offset (%+zd) overflow detected", offset);
 
     map->addr   = (int32_t)addr;
     map->offset = (uint32_t)offset;
-    map->size   = (uint16_t)len;
+    map->size   = (uint32_t)len;
     map->type   = type;
     map->r      = (r? 1: 0);
     map->w      = (w? 1: 0);
     map->x      = (x? 1: 0);
     map->abs    = (abs? 1: 0);
+    map->huge   = (huge? 1: 0);
+    map->hot    = (hot? 1: 0);
 
     return size;
 }
 
+/*
+ * Split bounds into pieces that overlap (true) or do not overlap (false)
+ * the `writable' bounds.  Only the former are mapped writable, so the
+ * trampoline pages are never written, and remain shared (backed by the
+ * page cache) between all processes running the patched binary.
+ */
+static void splitBounds(const std::vector<Bounds> &bounds,
+    const std::vector<Bounds> &writable,
+    std::vector<std::pair<Bounds, bool>> &pieces)
+{
+    pieces.clear();
+    size_t j = 0;
+    for (const auto &b: bounds)
+    {
+        intptr_t lb = b.lb;
+        while (j < writable.size() && writable[j].ub <= lb)
+            j++;
+        for (size_t k = j; lb < b.ub && k < writable.size() &&
+                writable[k].lb < b.ub; k++)
+        {
+            if (lb < writable[k].lb)
+                pieces.push_back({{lb, writable[k].lb}, false});
+            lb = std::max(lb, writable[k].lb);
+            intptr_t ub = std::min(b.ub, writable[k].ub);
+            pieces.push_back({{lb, ub}, true});
+            lb = ub;
+        }
+        if (lb < b.ub)
+            pieces.push_back({{lb, b.ub}, false});
+    }
+}
+
+/*
+ * Coalesce a mapping into the previous mapping, if they are adjacent both
+ * virtually and in the file, and have the same attributes.  This saves an
+ * mmap() call in the loader.
+ */
+static bool coalesceLoaderMap(struct e9_map_s *map, intptr_t addr,
+    size_t len, off_t offset, bool r, bool w, bool x, uint32_t type,
+    intptr_t *ub, bool huge, bool hot)
+{
+    if (map == nullptr)
+        return false;
+    bool abs = IS_ABSOLUTE(addr);
+    intptr_t addr1 = BASE_ADDRESS(addr) / (intptr_t)PAGE_SIZE;
+    len    /= PAGE_SIZE;
+    offset /= PAGE_SIZE;
+    if (map->type != type || map->r != r || map->w != w || map->x != x ||
+            map->abs != abs || map->huge != huge || map->hot != hot)
+        return false;
+    if ((intptr_t)map->addr + (intptr_t)map->size != addr1 ||
+            (off_t)map->offset + (off_t)map->size != offset ||
+            map->size + len >= (1 << 20))
+        return false;
+    map->size += len;
+    if (ub != nullptr && !abs)
+        *ub = std::max(*ub, addr);
+    return true;
+}
+
+/*
+ * Visit the loader mappings for the trampoline mappings of one level, i.e.,
+ * after splitting writable pages, but before coalescing.  If `planned' is
+ * set, the mappings need not have (file) offsets yet, and the offsets are
+ * derived from the planned file layout instead.
+ */
+template <typename F>
+static void visitLoaderMaps(const MappingSet &mappings, bool preload,
+    bool planned, F visit)
+{
+    std::vector<Bounds> bounds;
+    std::vector<std::pair<Bounds, bool>> pieces;
+    off_t offset_0 = 0;
+    for (auto *mapping: mappings)
+    {
+        if (planned)
+        {
+            bool huge = false;
+            for (auto *merged = mapping; merged != nullptr;
+                    merged = merged->merged)
+                huge = huge || merged->huge;
+            if (huge && offset_0 % HUGE_PAGE_SIZE != 0)
+                offset_0 += HUGE_PAGE_SIZE - offset_0 % HUGE_PAGE_SIZE;
+        }
+        else
+            offset_0 = mapping->offset;
+        size_t size = mapping->size;
+        for (; mapping != nullptr; mapping = mapping->merged)
+        {
+            if (mapping->preload != preload)
+                continue;
+            bounds.clear();
+            if (mapping->huge)
+                bounds.push_back({0, (intptr_t)mapping->size});
+            else
+                getVirtualBounds(mapping, PAGE_SIZE, bounds);
+            bool r = ((mapping->prot & PROT_READ) != 0);
+            bool x = ((mapping->prot & PROT_EXEC) != 0);
+            splitBounds(bounds, mapping->writable, pieces);
+            for (const auto &piece: pieces)
+            {
+                const Bounds &b = piece.first;
+                bool w = piece.second;
+                intptr_t base = mapping->base + b.lb;
+                size_t len    = b.ub - b.lb;
+                off_t offset  = offset_0 + b.lb;
+                visit(mapping, base, len, offset, r, w, x);
+            }
+        }
+        offset_0 += size;
+    }
+}
+
+/*
+ * Count the loader mappings that emitElf() will emit for the trampoline
+ * mappings, i.e., after splitting writable pages and coalescing.  The
+ * mappings need not have (file) offsets yet.
+ */
+size_t countLoaderMaps(const MappingSet &mappings)
+{
+    size_t count = 0;
+    for (unsigned level = 0; level < 2; level++)
+    {
+        struct e9_map_s map, *last = nullptr;
+        uint32_t type = (level == 0? E9_TYPE_RESERVE: E9_TYPE_TRAMPOLINE);
+        visitLoaderMaps(mappings, /*preload=*/(level == 0), /*planned=*/true,
+            [&](const Mapping *mapping, intptr_t base, size_t len,
+                off_t offset, bool r, bool w, bool x)
+            {
+                if (coalesceLoaderMap(last, base, len, offset, r, w, x,
+                        type, nullptr, mapping->huge, mapping->hot))
+                    return;
+                last = &map;
+                emitLoaderMap((uint8_t *)last, base, len, offset, r, w, x,
+                    type, nullptr, mapping->huge, mapping->hot);
+                count++;
+            });
+    }
+    return count;
+}
+
 /*
  * Get the offset for an address.
  */
@@ -442,6 +587,235 @@ intptr_t replaceInitFini(Binary *B, Elf64_Dyn *dyn_fn,
     return INTPTR_MIN;
 }
 
+/*
+ * Redirect code pointers to trampolines (-Oredirect).  Code pointers that
+ * are subject to a relative relocation (R_X86_64_RELATIVE or DT_RELR), and
+ * that point to a patched instruction, are rewritten to point to the
+ * trampoline entry.  This saves a jump per indirect call/jump.  However, the
+ * rewritten pointer no longer equals the original address, so the following
+ * conservative conditions must hold:
+ *
+ *  - The binary is PIC and the -OCFR analysis is enabled.
+ *  - The target address is never materialized by an instruction (lea, mov
+ *    or push), i.e., pointers can only be compared with other (rewritten)
+ *    pointers.
+ *  - The target is not an exported (dynamic) symbol, i.e., the pointer
+ *    cannot be compared with the result of symbol resolution.
+ *  - The relocation is not part of the (pre)init/fini arrays, which may run
+ *    before the loader (or be replaced by the loader).
+ *  - The target is not patched using a trap (B0), and the trampoline entry
+ *    is not at an absolute address.
+ *  - No other pointer to the same target is skipped for any of the above
+ *    reasons, else the two pointers would compare unequal.
+ *
+ * Skipped pointers are counted per reason (--stats=FILE).
+ */
+static void redirectPointers(Binary *B)
+{
+    if (!option_Oredirect)
+        return;
+    if (!B->pic || !option_OCFR || B->targets == nullptr)
+    {
+        warning("code pointer redirection (see `-Oredirect') requires a PIC "
+            "binary and the `-OCFR' target analysis; ignoring");
+        return;
+    }
+
+    uint8_t *data = B->patched.bytes;
+    const Elf64_Phdr *phdr = B->elf.phdr_dynamic;
+    if (phdr == nullptr)
+        return;
+    const Elf64_Dyn *dynamic = (const Elf64_Dyn *)(data + phdr->p_offset);
+    size_t num_dynamic = phdr->p_memsz / sizeof(Elf64_Dyn);
+    intptr_t rela_ptr = INTPTR_MIN, relr_ptr = INTPTR_MIN;
+    size_t rela_size = 0, relr_size = 0;
+    std::vector<std::pair<intptr_t, size_t>> arrays(3, {INTPTR_MIN, 0});
+    for (size_t i = 0; i < num_dynamic && dynamic[i].d_tag != DT_NULL; i++)
+    {
+        intptr_t ptr = (intptr_t)dynamic[i].d_un.d_ptr;
+        size_t val   = (size_t)dynamic[i].d_un.d_val;
+        switch (dynamic[i].d_tag)
+        {
+            case DT_RELA:
+                rela_ptr = ptr; break;
+            case DT_RELASZ:
+                rela_size = val / sizeof(Elf64_Rela); break;
+            case DT_RELR:
+                relr_ptr = ptr; break;
+            case DT_RELRSZ:
+                relr_size = val / sizeof(Elf64_Xword); break;
+            case DT_PREINIT_ARRAY:
+                arrays[0].first = ptr; break;
+            case DT_PREINIT_ARRAYSZ:
+                arrays[0].second = val; break;
+            case DT_INIT_ARRAY:
+                arrays[1].first = ptr; break;
+            case DT_INIT_ARRAYSZ:
+                arrays[1].second = val; break;
+            case DT_FINI_ARRAY:
+                arrays[2].first = ptr; break;
+            case DT_FINI_ARRAYSZ:
+                arrays[2].second = val; break;
+            default:
+                break;
+        }
+    }
+
+    // Collect the relative relocations as (pointer, value) slots, where the
+    // value is the link-time target address:
+    struct Slot
+    {
+        intptr_t ptr;                       // Pointer address.
+        Elf64_Sxword *value;                // Pointer value (addend).
+    };
+    std::vector<Slot> slots;
+    if (rela_ptr != INTPTR_MIN && rela_size > 0)
+    {
+        off_t rela_offset = addrToOffset(B, rela_ptr,
+            rela_ptr + rela_size * sizeof(Elf64_Rela) - 1);
+        Elf64_Rela *rela = (rela_offset < 0? nullptr:
+            (Elf64_Rela *)(data + rela_offset));
+        for (size_t i = 0; rela != nullptr && i < rela_size; i++)
+        {
+            if (ELF64_R_TYPE(rela[i].r_info) == R_X86_64_RELATIVE)
+                slots.push_back({(intptr_t)rela[i].r_offset,
+                    &rela[i].r_addend});
+        }
+    }
+    if (relr_ptr != INTPTR_MIN && relr_size > 0)
+    {
+        // DT_RELR: the addend is stored in the pointer itself, and the
+        // pointer addresses are encoded as an address followed by bitmaps.
+        off_t relr_offset = addrToOffset(B, relr_ptr,
+            relr_ptr + relr_size * sizeof(Elf64_Xword) - 1);
+        const Elf64_Xword *relr = (relr_offset < 0? nullptr:
+            (const Elf64_Xword *)(data + relr_offset));
+        intptr_t where = 0;
+        for (size_t i = 0; relr != nullptr && i < relr_size; i++)
+        {
+            const unsigned W = sizeof(Elf64_Xword);
+            Elf64_Xword bits = 0x1;
+            intptr_t base = where;
+            if ((relr[i] & 0x1) == 0)
+            {
+                base  = (intptr_t)relr[i];
+                where = base + W;
+            }
+            else
+            {
+                bits  = relr[i] >> 1;
+                where = base + (8 * W - 1) * W;
+            }
+            for (unsigned j = 0; bits != 0; bits >>= 1, j++)
+            {
+                if ((bits & 0x1) == 0)
+                    continue;
+                intptr_t ptr = base + j * W;
+                off_t offset = addrToOffset(B, ptr, ptr + W - 1);
+                if (offset < 0)
+                {
+                    warning("failed to redirect DT_RELR pointer "
+                        ADDRESS_FORMAT "; pointer is not in the file",
+                        ADDRESS(ptr));
+                    continue;
+                }
+                slots.push_back({ptr, (Elf64_Sxword *)(data + offset)});
+            }
+        }
+    }
+    if (slots.empty())
+        return;
+
+    // Exported symbols (requires the section headers):
+    const Elf64_Ehdr *ehdr = B->elf.ehdr;
+    if (ehdr->e_shoff == 0 || ehdr->e_shnum == 0 ||
+            ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > B->size)
+    {
+        warning("code pointer redirection (see `-Oredirect') requires "
+            "section headers; ignoring");
+        return;
+    }
+    std::set<intptr_t> exported;
+    const Elf64_Shdr *shdrs =
+        (const Elf64_Shdr *)(B->original.bytes + ehdr->e_shoff);
+    for (unsigned i = 0; i < ehdr->e_shnum; i++)
+    {
+        const Elf64_Shdr *shdr = shdrs + i;
+        if (shdr->sh_type != SHT_DYNSYM ||
+                shdr->sh_offset + shdr->sh_size > B->size)
+            continue;
+        const Elf64_Sym *syms =
+            (const Elf64_Sym *)(B->original.bytes + shdr->sh_offset);
+        size_t num_syms = shdr->sh_size / sizeof(Elf64_Sym);
+        for (size_t j = 0; j < num_syms; j++)
+        {
+            if (syms[j].st_shndx != SHN_UNDEF)
+                exported.insert((intptr_t)syms[j].st_value);
+        }
+    }
+
+    // Pass (1): find the reason (if any) that each pointer is skipped.  Any
+    // skipped pointer also pins its target, since a redirected pointer to the
+    // same target would compare unequal.
+    std::vector<const char *> reasons(slots.size(), nullptr);
+    std::vector<intptr_t> entries(slots.size(), INTPTR_MIN);
+    std::set<intptr_t> pinned;
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        intptr_t ptr    = slots[i].ptr;
+        intptr_t target = (intptr_t)*slots[i].value;
+        const Instr *I = findInstr(B, target);
+        intptr_t entry = (I == nullptr || (!I->is_patched && !I->is_evicted)?
+            INTPTR_MIN: getTrampolineEntry(B->Es, I));
+        if (entry == INTPTR_MIN)
+            continue;
+        stat_num_pointers++;
+        const char *reason = nullptr;
+        for (const auto &array: arrays)
+        {
+            if (array.first != INTPTR_MIN && ptr >= array.first &&
+                    ptr < array.first + (intptr_t)array.second)
+                reason = "init/fini";
+        }
+        if (reason == nullptr &&
+                B->taken.find((intptr_t)I->offset) != B->taken.end())
+            reason = "taken";
+        if (reason == nullptr && exported.find(target) != exported.end())
+            reason = "exported";
+        if (reason == nullptr && I->PATCH[0] == /*int3=*/0xCC)
+            reason = "trap";
+        if (reason == nullptr && IS_ABSOLUTE(entry))
+            reason = "absolute";
+        reasons[i] = reason;
+        entries[i] = entry;
+        if (reason != nullptr)
+            pinned.insert(target);
+    }
+
+    // Pass (2): redirect the remaining pointers.
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (entries[i] == INTPTR_MIN)
+            continue;
+        intptr_t ptr    = slots[i].ptr;
+        intptr_t target = (intptr_t)*slots[i].value;
+        intptr_t entry  = entries[i];
+        const char *reason = reasons[i];
+        if (reason == nullptr && pinned.find(target) == pinned.end())
+        {
+            debug("redirecting pointer " ADDRESS_FORMAT " from 0x%lx to "
+                ADDRESS_FORMAT, ADDRESS(ptr), target, ADDRESS(entry));
+            *slots[i].value = (Elf64_Sxword)entry;
+            stat_num_redirected++;
+            continue;
+        }
+        reason = (reason == nullptr? "equality": reason);
+        debug("not redirecting pointer " ADDRESS_FORMAT " to 0x%lx (%s)",
+            ADDRESS(ptr), target, reason);
+        stats.count("redirect_skipped", reason);
+    }
+}
+
 /*
  * Emit the (modified) ELF binary.
  */
@@ -473,11 +847,16 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
     // Step (3): Emit all mappings:
     for (auto *mapping: mappings)
     {
-        uint8_t *base = data + size;
+        bool huge = false;
+        for (auto *merged = mapping; merged != nullptr;
+                merged = merged->merged)
+            huge = huge || merged->huge;
+        if (huge && size % HUGE_PAGE_SIZE != 0)   // Align (zero-fill)
+            size += HUGE_PAGE_SIZE - size % HUGE_PAGE_SIZE;
         mapping->offset = (off_t)size;
-        flattenMapping(B, base, mapping, /*int3=*/0xcc);
         size += mapping->size;
     }
+    flattenMappings(B, data, mappings, /*int3=*/0xcc);
 
     // Step (4): Emit the loader:
     size = (size % PAGE_SIZE == 0? size:
@@ -495,6 +874,7 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
         "VERSION string is too long");
     memcpy(config->version, version, sizeof(version));
     config->base = option_loader_base;
+    config_elf->tls = (uint32_t)B->tls;
     if (B->mmap != INTPTR_MIN)
     {
         config->mmap  = BASE_ADDRESS(B->mmap);
@@ -509,6 +889,19 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
         size += sizeof(addr);
         config->num_inits++;
     }
+    config_elf->zeros =
+        (B->zeros.size() > 0? (uint32_t)(size - config_offset): 0);
+    for (const auto &zero: B->zeros)
+    {
+        struct e9_zero_s *Z = (struct e9_zero_s *)(data + size);
+        Z->addr  = BASE_ADDRESS(zero.addr);
+        Z->addr |= (IS_ABSOLUTE(zero.addr)? E9_ABS_ADDR: 0);
+        Z->size  = (uint64_t)zero.size;
+        Z->prot  = (uint32_t)zero.prot;
+        Z->__reserved = 0;
+        size += sizeof(struct e9_zero_s);
+        config_elf->num_zeros++;
+    }
     config->finis = (B->finis.size() > 0? (uint32_t)(size - config_offset): 0);
     for (auto fini: B->finis)
     {
@@ -518,17 +911,31 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
         size += sizeof(addr);
         config->num_finis++;
     }
-    config->traps = (B->Traps.size() > 0? (uint32_t)(size - config_offset): 0);
-    for (auto i = B->Traps.rbegin(); i != B->Traps.rend(); ++i)
+    if (B->Traps.size() > 0)
     {
-        const Alloc *A = *i;
-        struct e9_trap_s trap = {A->I->addr, A->lb + A->entry};
-        memcpy(data + size, &trap, sizeof(trap));
-        size += sizeof(trap);
-        config->num_traps++;
+        // The trap table is a (cache-line aligned) hash table that is at
+        // most half full (see e9loader.h):
+        uint32_t bits = 1;
+        while (((size_t)E9_TRAP_BUCKET << bits) < 2 * B->Traps.size())
+            bits++;
+        size_t num_slots = (size_t)E9_TRAP_BUCKET << bits;
+        size = (size % 64 == 0? size: size + 64 - (size % 64));
+        struct e9_trap_s *traps = (struct e9_trap_s *)(data + size);
+        memset(traps, 0x0, num_slots * sizeof(struct e9_trap_s));
+        for (const Alloc *A: B->Traps)
+        {
+            size_t i = e9_trap_hash(A->I->addr, bits);
+            while (traps[i].rip != 0)
+                i = (i + 1) & (num_slots - 1);
+            traps[i].rip        = A->I->addr;
+            traps[i].trampoline = A->lb + A->entry;
+            config->num_traps++;
+        }
+        config->traps     = (uint32_t)(size - config_offset);
+        config->trap_bits = bits;
+        size += num_slots * sizeof(struct e9_trap_s);
     }
 
-    std::vector<Bounds> bounds;
     intptr_t ub = INTPTR_MIN;
     // level 0 == non-trampoline mappings (reserves, refactors), default mmap()
     // level 1 == trampoline mappings, user mmap() can be used.
@@ -536,42 +943,35 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
     {
         unsigned level = i;
         config->maps[level] = (uint32_t)(size - config_offset);
+        struct e9_map_s *last = nullptr;
         bool preload = (level == 0);
-        for (auto *mapping: mappings)
+        if (preload)
         {
-            if (preload)
+            for (auto *mapping: mappings)
                 stat_num_physical_bytes += mapping->size;
-            off_t offset_0 = mapping->offset;
-            for (; mapping != nullptr; mapping = mapping->merged)
-            {
-                if (mapping->preload != preload)
-                    continue;
-                bounds.clear();
-                getVirtualBounds(mapping, PAGE_SIZE, bounds);
-                bool r = ((mapping->prot & PROT_READ) != 0);
-                bool w = ((mapping->prot & PROT_WRITE) != 0);
-                bool x = ((mapping->prot & PROT_EXEC) != 0);
-                for (const auto b: bounds)
-                {
-                    intptr_t base = mapping->base + b.lb;
-                    size_t len    = b.ub - b.lb;
-                    off_t offset  = offset_0 + b.lb;
-
-                    const char *name = (level == 0? "reserve": "trampoline");
-                    debug("load %s: mmap(addr=" ADDRESS_FORMAT
-                        ",size=%zu,offset=+%zu,prot=%c%c%c)",
-                        name, ADDRESS(base), len, offset_0, (r? 'r': '-'),
-                        (w? 'w': '-'), (x? 'x': '-'));
-                    stat_num_virtual_bytes += len;
-
-                    size += emitLoaderMap(data + size, base, len, offset,
-                        r, w, x,
-                        (level == 0? E9_TYPE_RESERVE: E9_TYPE_TRAMPOLINE),
-                        &ub);
-                    config->num_maps[level]++;
-                }
-            }
         }
+        const char *name = (level == 0? "reserve": "trampoline");
+        uint32_t type = (level == 0? E9_TYPE_RESERVE: E9_TYPE_TRAMPOLINE);
+        visitLoaderMaps(mappings, preload, /*planned=*/false,
+            [&](const Mapping *mapping, intptr_t base, size_t len,
+                off_t offset, bool r, bool w, bool x)
+            {
+                debug("load %s: mmap(addr=" ADDRESS_FORMAT
+                    ",size=%zu,offset=+%zd,prot=%c%c%c%s%s)",
+                    name, ADDRESS(base), len, offset, (r? 'r': '-'),
+                    (w? 'w': '-'), (x? 'x': '-'),
+                    (mapping->huge? ",huge": ""),
+                    (mapping->hot? ",hot": ""));
+                stat_num_virtual_bytes += len;
+
+                if (coalesceLoaderMap(last, base, len, offset, r, w, x,
+                        type, &ub, mapping->huge, mapping->hot))
+                    return;
+                last = (struct e9_map_s *)(data + size);
+                size += emitLoaderMap(data + size, base, len, offset,
+                    r, w, x, type, &ub, mapping->huge, mapping->hot);
+                config->num_maps[level]++;
+            });
         if (level == 0)
         {
             // Emit refactorings at level 0.
@@ -581,6 +981,11 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
                     ",size=%zu,offset=+%zd,prot=r-x)",
                     ADDRESS(refactor.addr), refactor.size,
                     refactor.patched.offset);
+                if (coalesceLoaderMap(last, refactor.addr, refactor.size,
+                        refactor.patched.offset, /*r=*/true, /*w=*/false,
+                        /*x=*/true, E9_TYPE_REFACTOR, nullptr, false, false))
+                    continue;
+                last = (struct e9_map_s *)(data + size);
                 size += emitLoaderMap(data + size, refactor.addr,
                     refactor.size, refactor.patched.offset, /*r=*/true,
                     /*w=*/false, /*x=*/true, E9_TYPE_REFACTOR, nullptr);
@@ -588,6 +993,22 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
             }
         }
     }
+    if (option_loader_lazy && config->num_maps[1] > 0)
+    {
+        // Lazy loading: the loader's SIGSEGV handler searches the
+        // trampoline mappings, so sort by (abs, addr).
+        struct e9_map_s *maps =
+            (struct e9_map_s *)(data + config_offset + config->maps[1]);
+        std::sort(maps, maps + config->num_maps[1],
+            [](const e9_map_s &a, const e9_map_s &b)
+            {
+                if (a.abs != b.abs)
+                    return (a.abs < b.abs);
+                return (a.addr < b.addr);
+            });
+        config->flags |= E9_FLAG_LAZY;
+    }
+    stat_num_loader_mappings = config->num_maps[0] + config->num_maps[1];
     if (ub > option_loader_base)
     {
         // This error may occur if the front-end changes `--loader-base'
@@ -614,7 +1035,7 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
         fini_rel8_offset = size;
         data[size++] = 0x00;
     }
-    if (B->Traps.size() > 0)
+    if (B->Traps.size() > 0 || (config->flags & E9_FLAG_LAZY) != 0)
     {
         handler = config->handler = (uint32_t)(size - config_offset);
         // lea config(%rip), %rcx
@@ -724,6 +1145,7 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
             config->entry = (intptr_t)B->elf.ehdr->e_entry;
             ehdr->e_entry = (Elf64_Addr)entry;
             config->flags |= E9_FLAG_EXE;
+            config->flags |= (option_loader_fork_server? E9_FLAG_FORKSRV: 0);
             break;
         }
         case MODE_ELF_DSO:
@@ -732,6 +1154,9 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
             if (config->entry == INTPTR_MIN)
                 error("failed to replace entry point; no DT_INIT or "
                     "DT_INIT_ARRAY entry found");
+            if (option_loader_fork_server)
+                warning("the fork-server (see `--loader-fork-server') is "
+                    "only supported for executables; ignoring");
             break;
         default:
             error("invalid mode");
@@ -744,6 +1169,7 @@ size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size)
             error("failed to replace finalization point; no DT_FINI or "
                 "DT_FINI_ARRAY entry found");
     }
+    redirectPointers(B);
 
     // Step (6): Modify the PHDR to load the loader.
     // NOTE: Currently we use the well-known and easy-to-implement PT_NOTE
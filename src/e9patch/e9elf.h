@@ -35,8 +35,10 @@
 
 bool parseElf(Binary *B);
 size_t emitElf(Binary *B, const MappingSet &mappings, size_t mapping_size);
+size_t countLoaderMaps(const MappingSet &mappings);
 
 size_t emitLoaderMap(uint8_t *data, intptr_t addr, size_t len, off_t offset,
-    bool r, bool w, bool x, uint32_t type, intptr_t *ub);
+    bool r, bool w, bool x, uint32_t type, intptr_t *ub, bool huge = false,
+    bool hot = false);
 
 #endif
@@ -17,6 +17,7 @@
  */
 
 #include <algorithm>
+#include <vector>
 
 #include <cerrno>
 #include <cstdint>
@@ -25,27 +26,112 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef E9_ZLIB
+#include <zlib.h>
+#endif
+
+#include "e9delta.h"
 #include "e9emit.h"
 #include "e9patch.h"
 
 /*
- * Emit the complete patched executable binary file.
+ * Write data to the output file at the given offset.
+ */
+static void writeBinary(const char *filename, int fd, const uint8_t *bin,
+    size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t r = pwrite(fd, bin, len, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            error("failed to write output to file \"%s\": %s", filename,
+                strerror(errno));
+        bin    += r;
+        len    -= (size_t)r;
+        offset += r;
+    }
+}
+
+/*
+ * Clone the original binary into the output file, either by sharing
+ * extents (FICLONE, on CoW filesystems such as btrfs/XFS) or by an
+ * in-kernel copy (copy_file_range).  Returns false if neither is supported
+ * for this output file.
+ */
+static bool cloneBinary(int fd, int fd1, size_t len1)
+{
+    if (fd1 < 0)
+        return false;
+    if (ioctl(fd, FICLONE, fd1) == 0)
+        return true;
+    loff_t offset1 = 0, offset = 0;
+    while ((size_t)offset1 < len1)
+    {
+        ssize_t r = copy_file_range(fd1, &offset1, fd, &offset,
+            len1 - (size_t)offset1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Emit the complete patched executable binary file.  If possible, the
+ * original binary (bin1) is cloned, and only the modified pages and the
+ * appended data are written.
  */
-void emitBinary(const char *filename, const uint8_t *bin, size_t len)
+void emitBinary(const char *filename, const uint8_t *bin, size_t len,
+    int fd1, const uint8_t *bin1, size_t len1)
 {
     FILE *out = fopen(filename, "w");
     if (out == nullptr)
         error("failed to open output file \"%s\" for writing: %s", filename,
             strerror(errno));
-    if (fwrite(bin, sizeof(uint8_t), len, out) != len)
-        error("failed to write output to file \"%s\": %s", filename,
-            strerror(errno));
-    if (fchmod(fileno(out), S_IRUSR | S_IWUSR | S_IXUSR |
+    int fd = fileno(out);
+    if (!cloneBinary(fd, fd1, len1))
+        writeBinary(filename, fd, bin, len, 0);
+    else
+    {
+        size_t num_pages = 0;
+        size_t size = std::min(len, len1);
+        for (size_t offset = 0; offset < size; )
+        {
+            size_t end = std::min(offset + PAGE_SIZE, size);
+            if (memcmp(bin1 + offset, bin + offset, end - offset) == 0)
+            {
+                offset = end;
+                continue;
+            }
+            size_t start = offset;
+            for (offset = end; offset < size; offset = end)
+            {
+                end = std::min(offset + PAGE_SIZE, size);
+                if (memcmp(bin1 + offset, bin + offset, end - offset) == 0)
+                    break;
+            }
+            writeBinary(filename, fd, bin + start, offset - start, start);
+            num_pages += (offset - start + PAGE_SIZE - 1) / PAGE_SIZE;
+        }
+        if (len > len1)
+            writeBinary(filename, fd, bin + len1, len - len1, len1);
+        else if (len < len1 && ftruncate(fd, len) != 0)
+            error("failed to truncate output file \"%s\": %s", filename,
+                strerror(errno));
+        debug("cloned output file \"%s\" (modified pages=%zu, appended "
+            "bytes=%zu)", filename, num_pages, (len > len1? len - len1: 0));
+    }
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IXUSR |
                             S_IRGRP | S_IWGRP | S_IXGRP |
                             S_IROTH | S_IWOTH | S_IXOTH))
     {
@@ -271,3 +357,138 @@ pipe_error:
         error("failed to unlink named pipe: %s", strerror(errno));
 }
 
+
+/*
+ * Delta output stream (optionally compressed).
+ */
+struct DeltaOutput
+{
+    const char *filename;
+    FILE *out = nullptr;
+#ifdef E9_ZLIB
+    gzFile gz = nullptr;
+#endif
+
+    DeltaOutput(const char *filename, bool compress) : filename(filename)
+    {
+        bool stdio = (strcmp(filename, "-") == 0);
+        if (compress)
+        {
+#ifdef E9_ZLIB
+            gz = (stdio? gzdopen(dup(STDOUT_FILENO), "wb"):
+                         gzopen(filename, "wb"));
+            if (gz == nullptr)
+                error("failed to open output file \"%s\" for writing: %s",
+                    filename, strerror(errno));
+            return;
+#else
+            error("failed to emit delta file \"%s\"; e9patch was built "
+                "without zlib support (rebuild with `make ZLIB=1', or use "
+                "the uncompressed \"delta\" format)", filename);
+#endif
+        }
+        out = (stdio? stdout: fopen(filename, "w"));
+        if (out == nullptr)
+            error("failed to open output file \"%s\" for writing: %s",
+                filename, strerror(errno));
+    }
+
+    void write(const void *buf, size_t len)
+    {
+#ifdef E9_ZLIB
+        if (gz != nullptr)
+        {
+            const uint8_t *bytes = (const uint8_t *)buf;
+            while (len > 0)
+            {
+                unsigned count = (unsigned)std::min(len, (size_t)INT32_MAX);
+                if (gzwrite(gz, bytes, count) != (int)count)
+                    error("failed to write output to file \"%s\"",
+                        filename);
+                bytes += count;
+                len   -= count;
+            }
+            return;
+        }
+#endif
+        if (fwrite(buf, sizeof(uint8_t), len, out) != len)
+            error("failed to write output to file \"%s\": %s", filename,
+                strerror(errno));
+    }
+
+    void close()
+    {
+#ifdef E9_ZLIB
+        if (gz != nullptr)
+        {
+            if (gzclose(gz) != Z_OK)
+                error("failed to close output file \"%s\"", filename);
+            return;
+        }
+#endif
+        if (out == stdout? fflush(out) != 0: fclose(out) != 0)
+            error("failed to close output file \"%s\": %s", filename,
+                strerror(errno));
+    }
+};
+
+/*
+ * Emit a binary delta (see e9delta.h).  Only the changed ranges and the
+ * appended data (mappings, loader, etc.) are recorded.  Unchanged pages
+ * are skipped using a page-wise comparison, similar to the refactoring
+ * in emitElf().
+ */
+void emitDelta(const char *filename, bool compress, const uint8_t *bin1,
+    size_t len1, const uint8_t *bin2, size_t len2)
+{
+    // Find changed ranges:
+    std::vector<e9_delta_rec_s> recs;
+    const size_t GAP = sizeof(e9_delta_rec_s);
+    auto push = [&recs, GAP](size_t lb, size_t ub)
+    {
+        if (!recs.empty() && recs.back().offset + recs.back().size + GAP >= lb)
+            recs.back().size = ub - recs.back().offset;
+        else
+            recs.push_back({lb, ub - lb});
+    };
+    size_t len = std::min(len1, len2);
+    for (size_t offset = 0; offset < len; offset += PAGE_SIZE)
+    {
+        size_t end = std::min(offset + PAGE_SIZE, len);
+        if (memcmp(bin1 + offset, bin2 + offset, end - offset) == 0)
+            continue;
+        for (size_t i = offset; i < end; i++)
+        {
+            if (bin1[i] == bin2[i])
+                continue;
+            size_t j = i + 1;
+            while (j < end && bin1[j] != bin2[j])
+                j++;
+            push(i, j);
+            i = j;
+        }
+    }
+    if (len2 > len1)
+        push(len1, len2);
+
+    // Write the delta:
+    DeltaOutput out(filename, compress);
+    e9_delta_hdr_s hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, E9_DELTA_MAGIC, sizeof(E9_DELTA_MAGIC));
+    hdr.version     = E9_DELTA_VERSION;
+    hdr.orig_size   = len1;
+    hdr.size        = len2;
+    hdr.num_records = recs.size();
+    out.write(&hdr, sizeof(hdr));
+    size_t total = 0;
+    for (const auto &rec: recs)
+    {
+        out.write(&rec, sizeof(rec));
+        out.write(bin2 + rec.offset, rec.size);
+        total += rec.size;
+    }
+    out.close();
+    debug("emitted delta \"%s\" (records=%zu, bytes=%zu)", filename,
+        recs.size(), total);
+}
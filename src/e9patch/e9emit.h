@@ -22,8 +22,11 @@
 #include <cstdint>
 #include <cstdlib>
 
-void emitBinary(const char *filename, const uint8_t *bin, size_t len);
+void emitBinary(const char *filename, const uint8_t *bin, size_t len,
+    int fd1 = -1, const uint8_t *bin1 = nullptr, size_t len1 = 0);
 void emitPatch(const char *filename, const char *compress, int fd1,
     const uint8_t *bin2, size_t len2);
+void emitDelta(const char *filename, bool compress, const uint8_t *bin1,
+    size_t len1, const uint8_t *bin2, size_t len2);
 
 #endif
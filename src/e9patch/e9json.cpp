@@ -23,7 +23,9 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <set>
+#include <unordered_set>
 #include <vector>
 
 #include <sys/mman.h>
@@ -31,10 +33,47 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "e9json.h"
 #include "e9patch.h"
+#include "e9ring.h"
 #include "e9trampoline.h"
 
+/*
+ * FNV-1a hash.
+ */
+static size_t hashBytes(const uint8_t *bytes, size_t len)
+{
+    size_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/*
+ * String cache hashing.
+ */
+struct CStrHash
+{
+    size_t operator()(const char *s) const
+    {
+        return hashBytes((const uint8_t *)s, strlen(s));
+    }
+};
+struct CStrEq
+{
+    bool operator()(const char *a, const char *b) const
+    {
+        return (strcmp(a, b) == 0);
+    }
+};
+
 /*
  * Bytes cache entry.
  */
@@ -43,14 +82,18 @@ struct Bytes
     const uint8_t *bytes;
     size_t len;
 };
-struct BytesCmp
+struct BytesHash
+{
+    size_t operator()(const Bytes &b) const
+    {
+        return hashBytes(b.bytes, b.len);
+    }
+};
+struct BytesEq
 {
     bool operator()(const Bytes &a, const Bytes &b) const
     {
-        if (a.len != b.len)
-            return (a.len < b.len);
-        int cmp = memcmp(a.bytes, b.bytes, a.len);
-        return (cmp < 0);
+        return (a.len == b.len && memcmp(a.bytes, b.bytes, a.len) == 0);
     }
 };
 
@@ -62,6 +105,9 @@ struct BytesCmp
 #define STRING_MAX          1024
 #define NUMBER_MAX          12
 
+#define BUFFER_SIZE         (1 << 20)   // Input block size
+#define BUFFER_PAD          16          // Scan overrun padding
+
 #define TOKEN_NONE          '\0'
 #define TOKEN_NULL          '0'
 #define TOKEN_BOOL          'B'
@@ -74,29 +120,82 @@ struct BytesCmp
 #define parse_error(parser, msg, ...)                                   \
     error("line %zu: " msg, (parser).lineno, ##__VA_ARGS__)
 
+/*
+ * Input buffer.  The input is read in large blocks, and string tokens are
+ * returned as views into the buffer where possible (i.e., zero-copy).  The
+ * buffer persists between messages.
+ */
+struct Input
+{
+    FILE *stream = nullptr;             // Input stream
+    Ring *ring = nullptr;               // Input ring (--rpc-ring)
+    int fd = -1;                        // Input file descriptor
+    char *base = nullptr;               // Buffer base
+    char *ptr = nullptr;                // Current position
+    char *end = nullptr;                // End of the buffered input
+    size_t size = 0;                    // Buffer size
+    size_t pos = 0;                     // Input offset of the buffer base
+    bool eof = false;                   // End-of-file reached?
+    bool pipe = false;                  // Input is a pipe?
+
+    Input()
+    {
+        ;
+    }
+
+    Input(char *data, size_t len) :
+        base(data), ptr(data), end(data + len), size(len), eof(true)
+    {
+        ;
+    }
+
+    void open(FILE *stream)
+    {
+        this->stream = stream;
+        this->ring   = nullptr;
+        fd  = fileno(stream);
+        ptr = end = base;
+        eof = false;
+        struct stat buf;
+        pipe = (fstat(fd, &buf) == 0 && S_ISFIFO(buf.st_mode));
+    }
+
+    void open(Ring *ring)
+    {
+        this->stream = nullptr;
+        this->ring   = ring;
+        ptr = end = base;
+        eof = false;
+        pipe = true;
+    }
+};
+
 /*
  * JSON parser.
  */
 struct Parser
 {
-    FILE * const stream;                // Input stream
+    Input &in;                          // Input buffer
     size_t lineno;                      // Line number
     char peek = '\0';                   // Peek'ed token
     bool b;                             // Boolean value
-    bool pipe = false;                  // Input is a pipe?
+    const bool pipe;                    // Input is a pipe?
     int32_t i;                          // Integer value
-    char s[STRING_MAX];                 // String value
+    const char *s = buf;                // String value
+    char buf[STRING_MAX];               // String value (copy)
 
-    Parser(FILE *stream, size_t lineno) : stream(stream), lineno(lineno)
+    Parser(Input &in, size_t lineno) : in(in), lineno(lineno), pipe(in.pipe)
     {
-        struct stat buf;
-        if (fstat(fileno(stream), &buf) == 0 && S_ISFIFO(buf.st_mode))
-            pipe = true;
+        ;
     }
 
+    bool fill(size_t len);
+
     char getc()
     {
-        char c = ::getc(stream);
+        if (in.ptr >= in.end && !fill(1))
+            return EOF;
+        char c = *in.ptr++;
         if (c == '\n')
             lineno++;
         return c;
@@ -104,12 +203,104 @@ struct Parser
 
     void ungetc(char c)
     {
+        if (c == EOF)
+            return;
         if (c == '\n')
             lineno--;
-        ::ungetc(c, stream);
+        in.ptr--;
     }
 };
 
+/*
+ * Ensure at least `len' bytes are buffered at the current position.  Reads
+ * block only until enough input is available, so pipes work as expected.
+ * Returns `false' if the end-of-file is reached first.  Note that this may
+ * move the buffer contents.
+ */
+bool Parser::fill(size_t len)
+{
+    size_t avail = in.end - in.ptr;
+    if (avail >= len)
+        return true;
+    if (in.eof)
+        return false;
+    if (s != buf && s >= in.base && s < in.end)
+    {
+        // The string value is a view into the buffer, so copy it first:
+        size_t slen = strlen(s);
+        memcpy(buf, s, slen+1);
+        s = buf;
+    }
+    in.pos += in.ptr - in.base;
+    if (avail > 0 && in.ptr != in.base)
+        memmove(in.base, in.ptr, avail);
+    in.ptr = in.base;
+    in.end = in.base + avail;
+    if (in.size < std::max<size_t>(len, BUFFER_SIZE))
+    {
+        size_t size = std::max<size_t>(2 * in.size, BUFFER_SIZE);
+        size = std::max(size, len);
+        char *base = (char *)realloc(in.base, size + BUFFER_PAD);
+        if (base == nullptr)
+            error("failed to allocate %zu bytes for the input buffer: %s",
+                size, strerror(ENOMEM));
+        in.base = in.ptr = base;
+        in.end  = base + avail;
+        in.size = size;
+    }
+    while (avail < len)
+    {
+        ssize_t r = (in.ring != nullptr?
+            (ssize_t)ringRead(*in.ring, in.end, in.size - avail):
+            read(in.fd, in.end, in.size - avail));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error("failed to read input: %s", strerror(errno));
+        }
+        if (r == 0)
+        {
+            in.eof = true;
+            return false;
+        }
+        in.end += r;
+        avail  += r;
+    }
+    return true;
+}
+
+/*
+ * Find the first string terminator, escape or newline character within
+ * [ptr..end), else return `end'.  May read up to BUFFER_PAD bytes past
+ * `end'.
+ */
+static const char *scanString(const char *ptr, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i nl    = _mm_set1_epi8('\n');
+    for (; ptr < end; ptr += sizeof(__m128i))
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote),
+            _mm_or_si128(_mm_cmpeq_epi8(x, slash), _mm_cmpeq_epi8(x, nl)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+        {
+            ptr += __builtin_ctz(mask);
+            return (ptr < end? ptr: end);
+        }
+    }
+    return end;
+#else
+    while (ptr < end && *ptr != '\"' && *ptr != '\\' && *ptr != '\n')
+        ptr++;
+    return ptr;
+#endif
+}
+
 /*
  * Get the token name for error reporting.
  */
@@ -149,7 +340,7 @@ static const char *getTokenName(char token)
  */
 static const char *dupString(const char *str)
 {
-    static std::set<const char *, CStrCmp> cache;
+    static std::unordered_set<const char *, CStrHash, CStrEq> cache;
     auto i = cache.find(str);
     if (i != cache.end())
         return *i;
@@ -164,7 +355,7 @@ static const char *dupString(const char *str)
 /*
  * Duplicate bytes.
  */
-static std::set<Bytes, BytesCmp> bytes_cache;
+static std::unordered_set<Bytes, BytesHash, BytesEq> bytes_cache;
 static const uint8_t *dupBytes(const std::vector<uint8_t> &bytes)
 {
     size_t len = bytes.size();
@@ -203,7 +394,9 @@ static Trampoline *dupTrampoline(const std::vector<Entry> &entries)
     Trampoline *T  = (Trampoline *)ptr;
     T->prot        = PROT_READ | PROT_EXEC;
     T->preload     = false;
+    T->hot         = false;
     T->num_entries = num_entries;
+    T->shape       = nullptr;
     memcpy(T->entries, &entries[0], num_entries * sizeof(Entry));
 
     static std::set<Trampoline *, TrampolineCmp> cache;
@@ -252,7 +445,8 @@ static char peekToken(Parser &parser)
         case '5': case '6': case '7': case '8': case '9':
         {
             unsigned len = 0;
-            parser.s[len++] = c;
+            parser.s = parser.buf;
+            parser.buf[len++] = c;
             while (true)
             {
                 if (len >= NUMBER_MAX)
@@ -262,10 +456,10 @@ static char peekToken(Parser &parser)
                 if (!isdigit(c))
                 {
                     parser.ungetc(c);
-                    parser.s[len++] = '\0';
+                    parser.buf[len++] = '\0';
                     break;
                 }
-                parser.s[len++] = c;
+                parser.buf[len++] = c;
             }
             if (parser.s[0] == '-' && parser.s[1] == '\0')
             {
@@ -281,7 +475,40 @@ static char peekToken(Parser &parser)
         }
         case '\"':
         {
-            unsigned len = 0;
+            // Fast path: strings without escapes are returned in-place.
+            parser.s = parser.buf;
+            size_t len = 0;
+            while (true)
+            {
+                const char *str = parser.in.ptr;
+                const char *ptr = scanString(str + len, parser.in.end);
+                len = ptr - str;
+                if (len >= STRING_MAX)
+                    parse_error(parser, "failed to read JSON string, maximum "
+                        "length (%u) was exceeded", STRING_MAX);
+                if (ptr == parser.in.end)
+                {
+                    if (!parser.fill(len+1))
+                        break;
+                    continue;
+                }
+                if (*ptr == '\n')
+                {
+                    parser.lineno++;
+                    len++;
+                    continue;
+                }
+                if (*ptr == '\\')
+                    break;
+                parser.in.ptr[len] = '\0';
+                parser.s = parser.in.ptr;
+                parser.in.ptr += len+1;
+                return (parser.peek = TOKEN_STRING);
+            }
+
+            // Slow path: copy (and unescape) the string.
+            memcpy(parser.buf, parser.in.ptr, len);
+            parser.in.ptr += len;
             while (true)
             {
                 if (len >= STRING_MAX)
@@ -290,7 +517,7 @@ static char peekToken(Parser &parser)
                 c = parser.getc();
                 if (c == '\"')
                 {
-                    parser.s[len++] = '\0';
+                    parser.buf[len++] = '\0';
                     break;
                 }
                 switch (c)
@@ -313,36 +540,36 @@ bad_string_eof:
                                     "string, unicode escape sequences are not "
                                     "yet supported");
                             case 't':
-                                parser.s[len++] = '\t';
+                                parser.buf[len++] = '\t';
                                 break;
                             case 'n':
-                                parser.s[len++] = '\n';
+                                parser.buf[len++] = '\n';
                                 break;
                             case 'r':
-                                parser.s[len++] = '\r';
+                                parser.buf[len++] = '\r';
                                 break;
                             case 'b':
-                                parser.s[len++] = '\b';
+                                parser.buf[len++] = '\b';
                                 break;
                             case 'f':
-                                parser.s[len++] = '\f';
+                                parser.buf[len++] = '\f';
                                 break;
                             case '/':
-                                parser.s[len++] = '/';
+                                parser.buf[len++] = '/';
                                 break;
                             case '\\':
-                                parser.s[len++] = '\\';
+                                parser.buf[len++] = '\\';
                                 break;
                             case '\"':
-                                parser.s[len++] = '\"';
+                                parser.buf[len++] = '\"';
                                 break;
                             default:
-                                parser.s[len++] = c;
+                                parser.buf[len++] = c;
                                 break;
                         }
                         break;
                     default:
-                        parser.s[len++] = c;
+                        parser.buf[len++] = c;
                         break;
                 }
             }
@@ -546,10 +773,13 @@ static bool validateParam(Method method, ParamName paramName)
                 case PARAM_ADDRESS:
                 case PARAM_BYTES:
                 case PARAM_FINI:
+                case PARAM_HOT:
                 case PARAM_INIT:
                 case PARAM_LENGTH:
                 case PARAM_MMAP:
                 case PARAM_PROTECTION:
+                case PARAM_TLS:
+                case PARAM_ZERO:
                     return true;
                 default:
                     return false;
@@ -693,6 +923,8 @@ Trampoline *makePadding(size_t len)
     T->prot        = PROT_READ | PROT_EXEC;
     T->num_entries = num_entries;
     T->preload     = false;
+    T->hot         = false;
+    T->shape       = nullptr;
     T->entries[0]  = makeZeroesEntry(len);
 
     return T;
@@ -712,6 +944,31 @@ static uintptr_t convertInteger(const Parser &parser, intptr_t x,
     return x;
 }
 
+/*
+ * Parse a string of hexadecimal digit pairs into bytes.
+ */
+static bool parseHex(const char *s, std::vector<uint8_t> &bytes)
+{
+    auto digit = [](char c) -> int
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        else if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    };
+    for (; s[0] != '\0'; s += 2)
+    {
+        int hi = digit(s[0]), lo = (hi < 0? -1: digit(s[1]));
+        if (lo < 0)
+            return false;
+        bytes.push_back((uint8_t)((hi << 4) | lo));
+    }
+    return true;
+}
+
 /*
  * Create a data template entry.
  */
@@ -721,9 +978,19 @@ static Entry makeDataEntry(Parser &parser)
     Entry entry; 
     memset(&entry, 0x0, sizeof(entry));
     entry.kind   = ENTRY_LABEL;
+    bool hex     = false;
 
     switch (parser.s[0])
     {
+        case 'h':
+            if (strcmp(parser.s, "hex") == 0)
+            {
+                entry.kind = ENTRY_BYTES;
+                hex = true;
+            }
+            else
+                goto type_error;
+            break;
         case 'i':
             if (strcmp(parser.s, "int8") == 0)
                 entry.kind = ENTRY_INT8;
@@ -766,8 +1033,19 @@ type_error:
         case ENTRY_BYTES:
         {
             expectToken(parser, TOKEN_STRING);
-            entry.length = strlen(parser.s)+1;
-            entry.bytes  = dupBytes(parser.s);
+            if (!hex)
+            {
+                entry.length = strlen(parser.s)+1;
+                entry.bytes  = dupBytes(parser.s);
+                break;
+            }
+            std::vector<uint8_t> bytes;
+            if (!parseHex(parser.s, bytes))
+                parse_error(parser, "failed to parse hex data; expected an "
+                    "even number of hexadecimal digits, found \"%s\"",
+                    parser.s);
+            entry.length = (unsigned)bytes.size();
+            entry.bytes  = dupBytes(bytes);
             break;
         }
         case ENTRY_ZEROES:
@@ -954,6 +1232,8 @@ static Trampoline *parseBytes(Parser &parser)
     T->prot        = PROT_READ | PROT_EXEC;
     T->num_entries = num_entries;
     T->preload     = false;
+    T->hot         = false;
+    T->shape       = nullptr;
     T->entries[0]  = makeBytesEntry(bytes);
     
     return T;
@@ -1080,6 +1360,10 @@ static void parseParams(Parser &parser, Message &msg)
                 else if (strcmp(parser.s, "fini") == 0)
                     name = PARAM_FINI;
                 break;
+            case 'h':
+                if (strcmp(parser.s, "hot") == 0)
+                    name = PARAM_HOT;
+                break;
             case 'i':
                 if (strcmp(parser.s, "init") == 0)
                     name = PARAM_INIT;
@@ -1113,11 +1397,17 @@ static void parseParams(Parser &parser, Message &msg)
                     name = PARAM_TRAMPOLINE;
                 else if (strcmp(parser.s, "template") == 0)
                     name = PARAM_TEMPLATE;
+                else if (strcmp(parser.s, "tls") == 0)
+                    name = PARAM_TLS;
                 break;
             case 'v':
                 if (strcmp(parser.s, "version") == 0)
                     name = PARAM_VERSION;
                 break;
+            case 'z':
+                if (strcmp(parser.s, "zero") == 0)
+                    name = PARAM_ZERO;
+                break;
         }
         expectToken(parser, ':');
         if (!validateParam(msg.method, name))
@@ -1134,6 +1424,7 @@ static void parseParams(Parser &parser, Message &msg)
                 case PARAM_INIT:
                 case PARAM_FINI:
                 case PARAM_MMAP:
+                case PARAM_TLS:
                     token = expectToken2(parser, TOKEN_NUMBER, TOKEN_STRING);
                     if (token == TOKEN_NUMBER)
                         value.integer = (intptr_t)parser.i;
@@ -1141,6 +1432,8 @@ static void parseParams(Parser &parser, Message &msg)
                         value.integer = stringToNumber(parser);
                     break;
                 case PARAM_ABSOLUTE:
+                case PARAM_HOT:
+                case PARAM_ZERO:
                     expectToken(parser, TOKEN_BOOL);
                     value.boolean = parser.b;
                     break;
@@ -1191,10 +1484,15 @@ static void parseParams(Parser &parser, Message &msg)
                         value.integer = (intptr_t)FORMAT_PATCH_BZIP2;
                     else if (strcmp(parser.s, "patch.xz") == 0)
                         value.integer = (intptr_t)FORMAT_PATCH_XZ;
+                    else if (strcmp(parser.s, "delta") == 0)
+                        value.integer = (intptr_t)FORMAT_DELTA;
+                    else if (strcmp(parser.s, "delta.gz") == 0)
+                        value.integer = (intptr_t)FORMAT_DELTA_GZ;
                     else
                         parse_error(parser, "failed to parse format string "
                             "\"%s\"; expected one of {\"binary\", \"patch\", "
-                            "\"patch.gz\", \"patch.bz2\", \"patch.xz\"}",
+                            "\"patch.gz\", \"patch.bz2\", \"patch.xz\", "
+                            "\"delta\", \"delta.gz\"}",
                             parser.s);
                     break;
                 case PARAM_MODE:
@@ -1212,6 +1510,7 @@ static void parseParams(Parser &parser, Message &msg)
                             "\"%s\"; expected one of {\"elf.exe\", "
                             "\"elf.dso\", \"pe.exe\", \"pe.dll\"}", parser.s);
                     break;
+                case PARAM_SIZES:       // Binary RPC only
                 case PARAM_UNKNOWN:
                     parseAndDiscardObject(parser);
                     break;
@@ -1243,6 +1542,8 @@ const char *getMethodString(Method method)
             return "binary";
         case METHOD_INSTRUCTION:
             return "instruction";
+        case METHOD_INSTRUCTIONS:
+            return "instructions";
         case METHOD_PATCH:
             return "patch";
         case METHOD_TRAMPOLINE:
@@ -1255,11 +1556,203 @@ const char *getMethodString(Method method)
 }
 
 /*
- * Parse a message from the given stream.
+ * Read raw bytes from a binary record.  The bytes are returned in-place, and
+ * remain valid until the next message is read.
  */
-bool getMessage(FILE *stream, size_t lineno, Message &msg)
+static const uint8_t *readRecord(Parser &parser, size_t len)
+{
+    if (parser.fill(len))
+    {
+        const uint8_t *data = (const uint8_t *)parser.in.ptr;
+        parser.in.ptr += len;
+        return data;
+    }
+    if (parser.pipe)
+        exit(EXIT_FAILURE);
+    parse_error(parser, "failed to read binary record; reached end-of-file "
+        "before the end of the record");
+}
+
+/*
+ * Binary record cursor.
+ */
+struct Record
 {
-    Parser parser(stream, lineno);
+    const Parser &parser;               // Parser (for error reporting)
+    const uint8_t *ptr;                 // Current position
+    const uint8_t *end;                 // End of record
+
+    Record(const Parser &parser, const uint8_t *ptr, size_t len) :
+        parser(parser), ptr(ptr), end(ptr + len)
+    {
+        ;
+    }
+
+    const uint8_t *get(size_t len)
+    {
+        if (len > (size_t)(end - ptr))
+            parse_error(parser, "failed to parse binary record; record is "
+                "truncated");
+        const uint8_t *data = ptr;
+        ptr += len;
+        return data;
+    }
+
+    template <typename T>
+    T get()
+    {
+        T x;
+        memcpy(&x, get(sizeof(x)), sizeof(x));
+        return x;
+    }
+};
+
+/*
+ * Parse a binary record from the given stream.  The record magic byte has
+ * already been consumed.  See `--rpc=binary'.
+ *
+ * Record format (host/little-endian):
+ *      uint8_t  method;            // RECORD_* (see e9json.h)
+ *      uint32_t id;                // Message ID
+ *      uint32_t size;              // Payload size
+ *      uint8_t  payload[size];
+ *
+ * "instruction" payload:
+ *      uint64_t address; uint64_t offset; uint8_t length;
+ *
+ * "instructions" payload:
+ *      uint64_t address; uint64_t offset; uint32_t count;
+ *      uint8_t sizes[count];
+ *
+ * Here (address, offset) is for the first instruction, and the remaining
+ * instructions immediately follow one another.
+ *
+ * "patch" payload:
+ *      uint64_t offset; uint16_t len; char trampoline[len];
+ *      uint32_t len; char metadata[len];       // JSON object (or empty)
+ *
+ * If len == RECORD_METADATA_REF, then the metadata is instead a reference
+ * (uint32_t index) to the metadata of an earlier "patch" record, counting
+ * the non-empty metadata objects in order.  Identical metadata is therefore
+ * parsed & stored only once.  Only the last RECORD_METADATA_WINDOW metadata
+ * objects can be referenced, so the reference table has a fixed size.
+ */
+static bool getRecord(Parser &parser, Message &msg)
+{
+    uint8_t hdr[sizeof(uint8_t) + 2 * sizeof(uint32_t)];
+    memcpy(hdr, readRecord(parser, sizeof(hdr)), sizeof(hdr));
+    uint32_t id, size;
+    memcpy(&id, hdr + 1, sizeof(id));
+    memcpy(&size, hdr + 1 + sizeof(id), sizeof(size));
+
+    static Metadata *metas[RECORD_METADATA_WINDOW];
+    static uint32_t num_metas = 0;
+    Record record(parser, readRecord(parser, size), size);
+
+    msg.lineno     = parser.lineno;
+    msg.id         = id;
+    msg.num_params = 0;
+    ParamValue value;
+    switch (hdr[0])
+    {
+        case RECORD_INSTRUCTION:
+        {
+            msg.method = METHOD_INSTRUCTION;
+            value.integer = (intptr_t)record.get<uint64_t>();
+            msg.params[0] = {PARAM_ADDRESS, value};
+            value.integer = (intptr_t)record.get<uint64_t>();
+            msg.params[1] = {PARAM_OFFSET, value};
+            value.integer = (intptr_t)record.get<uint8_t>();
+            msg.params[2] = {PARAM_LENGTH, value};
+            msg.num_params = 3;
+            break;
+        }
+        case RECORD_INSTRUCTIONS:
+        {
+            msg.method = METHOD_INSTRUCTIONS;
+            value.integer = (intptr_t)record.get<uint64_t>();
+            msg.params[0] = {PARAM_ADDRESS, value};
+            value.integer = (intptr_t)record.get<uint64_t>();
+            msg.params[1] = {PARAM_OFFSET, value};
+            size_t count = record.get<uint32_t>();
+            value.integer = (intptr_t)count;
+            msg.params[2] = {PARAM_LENGTH, value};
+            value.sizes = record.get(count);
+            msg.params[3] = {PARAM_SIZES, value};
+            msg.num_params = 4;
+            break;
+        }
+        case RECORD_PATCH:
+        {
+            msg.method = METHOD_PATCH;
+            value.integer = (intptr_t)record.get<uint64_t>();
+            msg.params[0] = {PARAM_OFFSET, value};
+            size_t len = record.get<uint16_t>();
+            if (len == 0 || len >= STRING_MAX)
+                parse_error(parser, "failed to parse binary record; invalid "
+                    "trampoline name length (%zu)", len);
+            char name[STRING_MAX];
+            memcpy(name, record.get(len), len);
+            name[len] = '\0';
+            if (name[0] != '$')
+                parse_error(parser, "failed to parse binary record; "
+                    "trampoline name must begin with a `$', found \"%s\"",
+                    name);
+            std::vector<Entry> entries;
+            entries.push_back(makeDebugEntry());
+            entries.push_back(makeMacroEntry(name));
+            value.trampoline = dupTrampoline(entries);
+            msg.params[1] = {PARAM_TRAMPOLINE, value};
+            msg.num_params = 2;
+            len = record.get<uint32_t>();
+            if (len == 0)
+                break;
+            if (len == RECORD_METADATA_REF)
+            {
+                uint32_t ref = record.get<uint32_t>();
+                if (ref >= num_metas ||
+                        num_metas - ref > RECORD_METADATA_WINDOW)
+                    parse_error(parser, "failed to parse binary record; "
+                        "invalid metadata reference (%u)", ref);
+                value.metadata = metas[ref % RECORD_METADATA_WINDOW];
+                msg.params[2] = {PARAM_METADATA, value};
+                msg.num_params = 3;
+                break;
+            }
+            // Note: the record is within the (writable) input buffer.
+            const uint8_t *meta = record.get(len);
+            Input minput((char *)meta, len);
+            Parser mparser(minput, parser.lineno);
+            value.metadata = parseMetadata(mparser);
+            metas[num_metas++ % RECORD_METADATA_WINDOW] = value.metadata;
+            msg.params[2] = {PARAM_METADATA, value};
+            msg.num_params = 3;
+            break;
+        }
+        default:
+            parse_error(parser, "failed to parse binary record; unknown "
+                "record type (0x%.2X)", hdr[0]);
+    }
+    if (record.ptr != record.end)
+        parse_error(parser, "failed to parse binary record; %zu trailing "
+            "byte(s)", (size_t)(record.end - record.ptr));
+    return true;
+}
+
+/*
+ * Parse a message from the given input.
+ */
+static bool getMessage(Parser &parser, Message &msg)
+{
+    if (option_rpc_binary)
+    {
+        char c;
+        while (isspace(c = parser.getc()))
+            ;
+        if (c == (char)RECORD_MAGIC)
+            return getRecord(parser, msg);
+        parser.ungetc(c);
+    }
 
     char token = expectToken2(parser, '{', EOF);
     if (token == EOF)
@@ -1317,3 +1810,49 @@ bool getMessage(FILE *stream, size_t lineno, Message &msg)
     return true;
 }
 
+/*
+ * Parse a message (with --stats accounting).
+ */
+static bool getMessage(Input &input, size_t lineno, Message &msg)
+{
+    size_t pos = input.pos + (input.ptr - input.base);
+    Parser parser(input, lineno);
+    bool ok = getMessage(parser, msg);
+    if (ok)
+        stats.size("message_size",
+            input.pos + (input.ptr - input.base) - pos);
+    return ok;
+}
+
+/*
+ * Parse a message from the given stream.
+ */
+static Input stream_input;
+bool getMessage(FILE *stream, size_t lineno, Message &msg)
+{
+    if (stream_input.stream != stream)
+        stream_input.open(stream);
+    return getMessage(stream_input, lineno, msg);
+}
+
+/*
+ * Parse a message from the given ring.
+ */
+bool getMessage(Ring *ring, size_t lineno, Message &msg)
+{
+    if (stream_input.ring != ring)
+        stream_input.open(ring);
+    return getMessage(stream_input, lineno, msg);
+}
+
+/*
+ * Parse a message from the given string.
+ */
+bool getMessage(const char *str, size_t len, size_t lineno, Message &msg)
+{
+    std::vector<char> buf(len + BUFFER_PAD);
+    memcpy(buf.data(), str, len);
+    Input input(buf.data(), len);
+    return getMessage(input, lineno, msg);
+}
+
@@ -33,6 +33,7 @@ enum Method
     METHOD_BINARY,
     METHOD_EMIT,
     METHOD_INSTRUCTION,
+    METHOD_INSTRUCTIONS,
     METHOD_OPTIONS,
     METHOD_PATCH,
     METHOD_RESERVE,
@@ -52,6 +53,7 @@ enum ParamName
     PARAM_FILENAME,
     PARAM_FINI,
     PARAM_FORMAT,
+    PARAM_HOT,
     PARAM_INIT,
     PARAM_LENGTH,
     PARAM_METADATA,
@@ -60,9 +62,12 @@ enum ParamName
     PARAM_NAME,
     PARAM_OFFSET,
     PARAM_PROTECTION,
+    PARAM_SIZES,
     PARAM_TEMPLATE,
+    PARAM_TLS,
     PARAM_TRAMPOLINE,
     PARAM_VERSION,
+    PARAM_ZERO,
 };
 
 /*
@@ -74,9 +79,21 @@ enum Format
     FORMAT_PATCH,
     FORMAT_PATCH_GZ,
     FORMAT_PATCH_BZIP2,
-    FORMAT_PATCH_XZ
+    FORMAT_PATCH_XZ,
+    FORMAT_DELTA,
+    FORMAT_DELTA_GZ
 };
 
+/*
+ * Binary record encoding (see `--rpc=binary').
+ */
+#define RECORD_MAGIC        0xE9
+#define RECORD_INSTRUCTION  'I'
+#define RECORD_INSTRUCTIONS 'R'
+#define RECORD_PATCH        'P'
+#define RECORD_METADATA_REF UINT32_MAX
+#define RECORD_METADATA_WINDOW 4096
+
 /*
  * Parameter values.
 */
@@ -88,6 +105,7 @@ union ParamValue
     char * const *strings;              // Strings
     Trampoline *trampoline;             // Trampoline template
     Metadata *metadata;                 // Instruction metadata
+    const uint8_t *sizes;               // Instruction sizes
 };
 
 /*
@@ -112,7 +130,11 @@ struct Message
     Param params[PARAM_MAX];            // Message params
 };
 
+struct Ring;
+
 bool getMessage(FILE *stream, size_t lineno, Message &msg);
+bool getMessage(Ring *ring, size_t lineno, Message &msg);
+bool getMessage(const char *str, size_t len, size_t lineno, Message &msg);
 const char *getMethodString(Method method);
 Trampoline *makePadding(size_t size);
 
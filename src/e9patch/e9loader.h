@@ -28,6 +28,10 @@
  */
 
 #define E9_FLAG_EXE                 0x1
+#define E9_FLAG_LAZY                0x2
+#define E9_FLAG_FORKSRV             0x4
+
+#define E9_FORKSRV_FD               198         // AFL fork-server control fd
 
 #define E9_TYPE_TRAMPOLINE          0x0
 #define E9_TYPE_RESERVE             0x1
@@ -35,25 +39,45 @@
 
 #define E9_ABS_ADDR                 0x4000000000000000ll
 
+#define E9_TLS_DATA                 0x20        // %gs offset of TLS data
+#define E9_TLS_MAX                  0x100000    // Max TLS data size
+
 struct e9_map_s
 {
     int32_t  addr;                              // Address (/ PAGE_SIZE)
     uint32_t offset;                            // Offset  (/ PAGE_SIZE)
     uint32_t size:20;                           // Size    (/ PAGE_SIZE)
     uint32_t type:2;                            // Type
-    uint32_t __reserved:6;                      // Reserved
+    uint32_t huge:1;                            // Huge pages?
+    uint32_t hot:1;                             // Hot (prefault)?
+    uint32_t __reserved:4;                      // Reserved
     uint32_t r:1;                               // Read?
     uint32_t w:1;                               // Write?
     uint32_t x:1;                               // Execute?
     uint32_t abs:1;                             // Absolute?
 };
 
+/*
+ * Trap table.  This is an open-addressed hash table of 2^trap_bits buckets,
+ * where each bucket is E9_TRAP_BUCKET (cache-line aligned) entries.  A trap
+ * hashes to a bucket, and the entries are probed linearly (wrapping around)
+ * until a match or an empty (rip == 0) entry.  The table is at most half
+ * full, so most lookups only touch one cache line.
+ */
+#define E9_TRAP_BUCKET              4           // Entries per bucket
+#define E9_TRAP_HASH                0x9E3779B97F4A7C15ull
+
 struct e9_trap_s
 {
     intptr_t rip;                               // Trap location
     intptr_t trampoline;                        // Trampoline location
 };
 
+static inline uint64_t e9_trap_hash(intptr_t rip, uint32_t bits)
+{
+    return E9_TRAP_BUCKET * (((uint64_t)rip * E9_TRAP_HASH) >> (64 - bits));
+}
+
 struct e9_config_s
 {
     char     magic[8];                          // "E9PATCH\0"
@@ -71,7 +95,8 @@ struct e9_config_s
     uint32_t num_finis;                         // # Fini functions
     uint32_t finis;                             // Fini functions offset
     uint32_t num_traps;                         // # Trap functions
-    uint32_t traps;                             // Trap functions offset
+    uint32_t traps;                             // Trap table offset
+    uint32_t trap_bits;                         // log2(# Trap buckets)
     uint32_t handler;                           // Trap handler function
 };
 
@@ -81,6 +106,34 @@ struct e9_config_s
 struct e9_config_elf_s
 {
     intptr_t dynamic;                           // DYNAMIC, or 0x0
+    uint32_t tls;                               // Per-thread block size
+    uint32_t num_zeros;                         // # Zero-filled mappings
+    uint32_t zeros;                             // Zero-filled mappings offset
+};
+
+/*
+ * Linux/ELF-specific zero-filled (anonymous) mapping.  These are mapped
+ * without reserving swap, so pages are only allocated on first write.
+ */
+struct e9_zero_s
+{
+    intptr_t addr;                              // Address
+    uint64_t size;                              // Size
+    uint32_t prot;                              // Protection
+    uint32_t __reserved;                        // Reserved
+};
+
+/*
+ * Linux/ELF-specific per-thread instrumentation block (at %gs:0x0).
+ * Threads inherit %gs from the parent thread, so the block is only valid
+ * if the owner matches the current thread pointer (%fs:0x0).
+ */
+struct e9_tls_s
+{
+    struct e9_tls_s *self;                      // Self pointer
+    uintptr_t owner;                            // Owner thread pointer
+    uint64_t size;                              // Data size
+    uint64_t __reserved;                        // Reserved
 };
 
 /*
@@ -33,6 +33,8 @@
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <asm/prctl.h>
 #include <sys/prctl.h>
 #include <syscall.h>
@@ -48,12 +50,19 @@ struct ksigaction
     sigset_t sa_mask;
 };
 #define SA_RESTORER 0x04000000
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 #define E9_BACKDOOR 0xe9e9e9e9
 
 typedef void (*e9handler_t)(int, siginfo_t *, void *);
 struct e9scratch_s
 {
-    e9handler_t next;
+    e9handler_t next;                   // Next SIGILL handler
+    e9handler_t next_segv;              // Next SIGSEGV handler (lazy)
+    int fd;                             // Binary file descriptor (lazy)
+    dev_t dev;                          // Binary device (lazy)
+    ino_t ino;                          // Binary inode (lazy)
     uint8_t tls[PAGE_SIZE / 2];
 };
 
@@ -65,6 +74,8 @@ extern "C"
     void e9handler(int sig, siginfo_t *info, ucontext_t *ctx,
         const e9_config_s *config);
     intptr_t e9syscall(long number, ...);
+    // Hidden, since the loader is not relocated (no GOT):
+    void e9restorer(void) __attribute__((__visibility__("hidden")));
 }
 
 /*
@@ -107,6 +118,14 @@ asm (
     "\tretq\n"
 );
 
+asm (
+    ".globl e9restorer\n"
+    ".type e9restorer,@function\n"
+    "e9restorer:\n"
+    "\tmov $15, %eax\n"                  // SYS_rt_sigreturn
+    "\tsyscall\n"
+);
+
 /*
  * Something went wrong, print an error and abort.
  */
@@ -175,6 +194,56 @@ typedef intptr_t (*mmap_t)(void *, size_t, int, int, int, off_t);
 typedef void (*init_t)(int, char **, char **, const void *, const void *);
 typedef void (*fini_t)(const void *);
 
+/*
+ * Get an address.
+ */
+static NO_INLINE const void *e9addr(intptr_t addr, const uint8_t *elf_base)
+{
+    if ((addr & E9_ABS_ADDR) != 0x0)
+        return (const void *)(addr & ~E9_ABS_ADDR);
+    else
+        return (const void *)(elf_base + addr);
+}
+
+/*
+ * Load a map.
+ */
+static NO_INLINE void e9load_map(const e9_map_s *map, const uint8_t *elf_base,
+    int fd, mmap_t mmap)
+{
+    const uint8_t *addr = (map->abs? (const uint8_t *)NULL: elf_base);
+    addr += (intptr_t)map->addr * PAGE_SIZE;
+    size_t len = (size_t)map->size * PAGE_SIZE;
+    off_t offset = (off_t)map->offset * PAGE_SIZE;
+    int prot = (map->r? PROT_READ: 0x0) |
+               (map->w? PROT_WRITE: 0x0) |
+               (map->x? PROT_EXEC: 0x0);
+    // Note: MAP_POPULATE is not used for writable maps, since the kernel
+    //       would break COW for every page, making the pages private.
+    int flags = MAP_FIXED | MAP_PRIVATE |
+        (map->hot && !map->w? MAP_POPULATE: 0x0);
+#if 0
+    e9debug("mmap(addr=%p,size=%U,offset=+%U,prot=%c%c%c)",
+        addr, len, offset,
+        (map->r? 'r': '-'), (map->w? 'w': '-'),
+        (map->x? 'x': '-'));
+#endif
+    intptr_t result = mmap((void *)addr, len, prot, flags, fd, offset);
+    if (result < 0)
+        e9panic("mmap(addr=%p,size=%U,offset=+%U,prot=%c%c%c) failed "
+            "(errno=%u)%s", addr, len, offset,
+            (map->r? 'r': '-'), (map->w? 'w': '-'),
+            (map->x? 'x': '-'), -(int)result,
+            (-(int)result == ENOMEM?
+                "\nhint: see the e9patch manpage for more information.":
+                ""));
+    if (map->huge)
+    {
+        // Best effort: the kernel may ignore the hint.
+        (void)e9syscall(SYS_madvise, addr, len, MADV_HUGEPAGE);
+    }
+}
+
 /*
  * Load a set of maps.
  */
@@ -182,31 +251,196 @@ static NO_INLINE void e9load_maps(const e9_map_s *maps, uint32_t num_maps,
     const uint8_t *elf_base, int fd, mmap_t mmap)
 {
     for (uint32_t i = 0; i < num_maps; i++)
+        e9load_map(maps + i, elf_base, fd, mmap);
+}
+
+/*
+ * Map a set of zero-filled regions.  The regions are not allowed to clobber
+ * existing mappings.
+ */
+static NO_INLINE void e9load_zeros(const e9_zero_s *zeros, uint32_t num_zeros,
+    const uint8_t *elf_base)
+{
+    for (uint32_t i = 0; i < num_zeros; i++)
+    {
+        const void *addr = e9addr(zeros[i].addr, elf_base);
+        intptr_t result = e9mmap((void *)addr, zeros[i].size, zeros[i].prot,
+            MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1, 0);
+        result = (result >= 0 && result != (intptr_t)addr? -EEXIST: result);
+        if (result < 0)
+            e9panic("mmap(addr=%p,size=%U,prot=%c%c%c) zero-filled mapping "
+                "failed (errno=%u)", addr, zeros[i].size,
+                (zeros[i].prot & PROT_READ?  'r': '-'),
+                (zeros[i].prot & PROT_WRITE? 'w': '-'),
+                (zeros[i].prot & PROT_EXEC?  'x': '-'), -(int)result);
+    }
+}
+
+/*
+ * Reserve a set of maps for lazy loading.  Read-only maps are reserved
+ * (PROT_NONE) and loaded by e9lazy() on first access.  Adjacent maps are
+ * reserved using a single mmap() call.  Writable and hot maps are always
+ * loaded eagerly, since reloading a writable map would discard any writes.
+ */
+static NO_INLINE void e9reserve_maps(const e9_map_s *maps, uint32_t num_maps,
+    const uint8_t *elf_base, int fd, mmap_t mmap)
+{
+    for (uint32_t i = 0; i < num_maps; )
     {
+        if (maps[i].w || maps[i].hot)
+        {
+            e9load_map(maps + i, elf_base, fd, mmap);
+            i++;
+            continue;
+        }
         const uint8_t *addr = (maps[i].abs? (const uint8_t *)NULL: elf_base);
         addr += (intptr_t)maps[i].addr * PAGE_SIZE;
-        size_t len = (size_t)maps[i].size * PAGE_SIZE;
-        off_t offset = (off_t)maps[i].offset * PAGE_SIZE;
-        int prot = (maps[i].r? PROT_READ: 0x0) |
-                   (maps[i].w? PROT_WRITE: 0x0) |
-                   (maps[i].x? PROT_EXEC: 0x0);
-        int flags = MAP_FIXED | MAP_PRIVATE;
-#if 0
-        e9debug("mmap(addr=%p,size=%U,offset=+%U,prot=%c%c%c)",
-            addr, len, offset,
-            (maps[i].r? 'r': '-'), (maps[i].w? 'w': '-'),
-            (maps[i].x? 'x': '-'));
-#endif
-        intptr_t result = mmap((void *)addr, len, prot, flags, fd, offset);
+        intptr_t end = (intptr_t)maps[i].addr + (intptr_t)maps[i].size;
+        uint32_t j = i + 1;
+        for (; j < num_maps && !maps[j].w && !maps[j].hot &&
+                maps[j].abs == maps[i].abs &&
+                (intptr_t)maps[j].addr == end; j++)
+            end += (intptr_t)maps[j].size;
+        size_t len = (size_t)(end - (intptr_t)maps[i].addr) * PAGE_SIZE;
+        intptr_t result = e9mmap((void *)addr, len, PROT_NONE,
+            MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
         if (result < 0)
-            e9panic("mmap(addr=%p,size=%U,offset=+%U,prot=%c%c%c) failed "
-                "(errno=%u)%s", addr, len, offset,
-                (maps[i].r? 'r': '-'), (maps[i].w? 'w': '-'),
-                (maps[i].x? 'x': '-'), -(int)result,
-                (-(int)result == ENOMEM?
-                    "\nhint: see the e9patch manpage for more information.":
-                    ""));
+            e9panic("mmap(addr=%p,size=%U,prot=---) failed (errno=%u)",
+                addr, len, -(int)result);
+        i = j;
+    }
+}
+
+/*
+ * Find the map containing `ptr', or NULL.  The maps are sorted by
+ * (abs, addr).
+ */
+static NO_INLINE const e9_map_s *e9lookup_map(const e9_map_s *maps,
+    uint32_t num_maps, bool abs, const uint8_t *base, const uint8_t *ptr)
+{
+    int64_t lo = 0, hi = (int64_t)num_maps - 1, idx = -1;
+    while (lo <= hi)
+    {
+        int64_t mid = (lo + hi) / 2;
+        const uint8_t *addr = base + (intptr_t)maps[mid].addr * PAGE_SIZE;
+        if ((bool)maps[mid].abs < abs ||
+                ((bool)maps[mid].abs == abs && addr <= ptr))
+        {
+            idx = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    if (idx < 0 || (bool)maps[idx].abs != abs)
+        return NULL;
+    const uint8_t *addr = base + (intptr_t)maps[idx].addr * PAGE_SIZE;
+    size_t len = (size_t)maps[idx].size * PAGE_SIZE;
+    return (ptr < addr + len? maps + idx: NULL);
+}
+
+/*
+ * Open the binary.
+ */
+static NO_INLINE int e9open(const e9_config_s *config, int flags)
+{
+    const uint8_t *loader_base = (const uint8_t *)config;
+    const uint8_t *loader_end  = loader_base + config->size;
+    char buf[BUFSIZ];
+    const char *path = "/proc/self/exe";
+    if ((config->flags & E9_FLAG_EXE) == 0)
+    {
+        // This is a shared object, so use the /proc/self/map_files/
+        // method to find the binary.
+        char *str = buf;
+        str = e9write_format(str, "/proc/self/map_files/%X-%X", loader_base,
+            loader_end);
+        str = e9write_char(str, '\0');
+        path = buf;
     }
+    ssize_t len = (ssize_t)e9syscall(SYS_readlink, path, buf, sizeof(buf));
+    if (len < 0)
+        e9panic("readlink(path=\"%s\") failed (errno=%u)", buf, -len);
+    buf[len] = '\0';
+    int fd = (int)e9syscall(SYS_open, buf, flags, 0);
+    if (fd < 0)
+        e9panic("open(path=\"%s\") failed (errno=%u)", buf, -fd);
+    return fd;
+}
+
+/*
+ * Get the binary file descriptor for lazy loading.  The program may have
+ * since closed (or reused) the original descriptor, in which case the
+ * binary is reopened.
+ */
+static NO_INLINE int e9lazy_fd(const e9_config_s *config,
+    struct e9scratch_s *scratch)
+{
+    struct stat buf;
+    intptr_t r = e9syscall(SYS_fstat, scratch->fd, &buf);
+    if (r >= 0 && buf.st_dev == scratch->dev && buf.st_ino == scratch->ino)
+        return scratch->fd;
+    int fd = e9open(config, O_RDONLY | O_CLOEXEC);
+    r = e9syscall(SYS_fstat, fd, &buf);
+    if (r < 0)
+        e9panic("fstat() failed (errno=%u)", -r);
+    if (buf.st_dev != scratch->dev || buf.st_ino != scratch->ino)
+        e9panic("failed to reopen binary; the binary has been replaced");
+    scratch->fd = fd;
+    return fd;
+}
+
+/*
+ * Lazy SIGSEGV handler: load the trampoline map on first access.
+ */
+static NO_INLINE void e9lazy(int sig, siginfo_t *info, ucontext_t *ctx,
+    const e9_config_s *config)
+{
+    const uint8_t *loader_base = (const uint8_t *)config;
+    const uint8_t *elf_base    = loader_base - config->base;
+    const struct e9_map_s *maps =
+        (const struct e9_map_s *)(loader_base + config->maps[1]);
+    uint32_t num_maps = config->num_maps[1];
+    const uint8_t *ptr = (const uint8_t *)info->si_addr;
+    struct e9scratch_s *scratch = e9scratch(config, /*alloc=*/false);
+    const struct e9_map_s *map = NULL;
+    if (info->si_code == SEGV_ACCERR)
+    {
+        map = e9lookup_map(maps, num_maps, /*abs=*/false, elf_base, ptr);
+        if (map == NULL)
+            map = e9lookup_map(maps, num_maps, /*abs=*/true, NULL, ptr);
+    }
+    if (map != NULL)
+    {
+        // Only handle accesses that the map permits, else a genuine fault
+        // (e.g., a write to a trampoline) would be retried forever.
+        greg_t err = ctx->uc_mcontext.gregs[REG_ERR];
+        bool ok = ((err & 0x10) != 0?  map->x:         // Fetch
+                   (err & 0x02) != 0?  false:          // Write
+                                       map->r);        // Read
+        map = (ok && !map->w && !map->hot? map: NULL);
+    }
+    if (map != NULL)
+    {
+        mmap_t mmap = e9mmap;
+        if (config->mmap != 0x0)
+            mmap = (mmap_t)e9addr(config->mmap, elf_base);
+        e9load_map(map, elf_base, e9lazy_fd(config, scratch), mmap);
+        return;                                 // Retry the access
+    }
+
+    // Not a lazy map:
+    if ((uintptr_t)scratch->next_segv > (uintptr_t)SIG_IGN)
+    {
+        scratch->next_segv(sig, info, ctx);     // Try the next binary
+        return;
+    }
+    struct ksigaction action =
+    {
+        (void *)SIG_DFL, SA_NODEFER | SA_RESTORER, NULL, 0
+    };
+    e9syscall(SYS_rt_sigaction, SIGSEGV, &action, NULL, 8, E9_BACKDOOR);
 }
 
 /*
@@ -215,6 +449,11 @@ static NO_INLINE void e9load_maps(const e9_map_s *maps, uint32_t num_maps,
 void e9handler(int sig, siginfo_t *info, ucontext_t *ctx,
     const e9_config_s *config)
 {
+    if (sig == SIGSEGV)
+    {
+        e9lazy(sig, info, ctx, config);
+        return;
+    }
     mcontext_t *mctx = &ctx->uc_mcontext;
     const uint8_t *loader_base = (const uint8_t *)config;
     const uint8_t *elf_base    = loader_base - config->base;
@@ -222,25 +461,22 @@ void e9handler(int sig, siginfo_t *info, ucontext_t *ctx,
         (const struct e9_trap_s *)(loader_base + config->traps);
     const uint8_t *rip = (const uint8_t *)mctx->gregs[REG_RIP];
     int64_t idx = -1;
-    if (rip >= elf_base && rip <= loader_base)
+    if (rip >= elf_base && rip <= loader_base && config->num_traps > 0)
     {
-        int64_t lo = 0, hi = config->num_traps;
         intptr_t key = rip - elf_base;
-        while (lo <= hi)
+        uint64_t mask = ((uint64_t)E9_TRAP_BUCKET << config->trap_bits) - 1;
+        for (uint64_t i = e9_trap_hash(key, config->trap_bits);
+                traps[i].rip != 0; i = (i + 1) & mask)
         {
-            int64_t mid = (lo + hi) / 2;
-            if (key < traps[mid].rip)
-                hi = mid - 1;
-            else if (key > traps[mid].rip)
-                lo = mid + 1;
-            else
+            if (traps[i].rip == key)
             {
-                idx = mid;
+                idx = (int64_t)i;
                 break;
             }
         }
     }
-    const uint8_t *trampoline = elf_base + traps[idx].trampoline;
+    const uint8_t *trampoline =
+        (idx >= 0? elf_base + traps[idx].trampoline: NULL);
     if (idx < 0)
     {
         // No trampoline found:
@@ -285,27 +521,32 @@ void e9handler(int sig, siginfo_t *info, ucontext_t *ctx,
 }
 
 /*
- * Prevent future SIGILL handlers.
+ * Prevent future SIGILL handlers, and future SIGSEGV handlers in lazy mode.
+ * Such handlers would replace the loader's own handler, so the call fails
+ * with ENOSYS and the loader keeps forwarding to the handler (if any) that
+ * was installed before it (scratch->next/next_segv).
  */
 #include <linux/prctl.h>
 #include <linux/seccomp.h>
 #include <linux/filter.h>
-static void e9filter(struct e9scratch_s *scratch)
+static void e9filter(struct e9scratch_s *scratch, bool ill, bool segv)
 {
     intptr_t r = e9syscall(SYS_prctl, PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
     if (r < 0)
         e9panic("prctl() failed (errno=%u)", -r);
+    const uint32_t NONE = 0xFFFFFFFF;           // Never a signal number
     struct sock_filter filter[] =
     {
         BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_rt_sigaction, 0, 5),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_rt_sigaction, 0, 6),
         BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
             offsetof(struct seccomp_data, args[4])),
         // Backdoor: TODO: think of a better solution
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, E9_BACKDOOR, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, E9_BACKDOOR, 4, 0),
         BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
             offsetof(struct seccomp_data, args[0])),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SIGILL, 0, 1),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (ill? SIGILL: NONE), 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (segv? SIGSEGV: NONE), 0, 1),
         BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
         BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
     }; 
@@ -321,14 +562,88 @@ static void e9filter(struct e9scratch_s *scratch)
 }
 
 /*
- * Get an address.
+ * Setup the per-thread instrumentation block for the main thread.
  */
-static NO_INLINE const void *e9addr(intptr_t addr, const uint8_t *elf_base)
+static void e9tls(size_t size, uintptr_t owner)
 {
-    if ((addr & E9_ABS_ADDR) != 0x0)
-        return (const void *)(addr & ~E9_ABS_ADDR);
-    else
-        return (const void *)(elf_base + addr);
+    uintptr_t gs = 0x0;
+    intptr_t r = e9syscall(SYS_arch_prctl, ARCH_GET_GS, &gs);
+    if (r < 0)
+        e9panic("arch_prctl() failed (errno=%u)", -r);
+    if (gs != 0x0)
+        e9panic("failed to setup per-thread block; GS is already in use");
+    size_t len = E9_TLS_DATA + size;
+    len = (len % PAGE_SIZE == 0? len: len + PAGE_SIZE - len % PAGE_SIZE);
+    r = e9mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r < 0)
+        e9panic("mmap() per-thread block failed (errno=%u)", (unsigned)-r);
+    struct e9_tls_s *block = (struct e9_tls_s *)r;
+    block->self  = block;
+    block->owner = owner;
+    block->size  = size;
+    r = e9syscall(SYS_arch_prctl, ARCH_SET_GS, block);
+    if (r < 0)
+        e9panic("arch_prctl() failed (errno=%u)", -r);
+#if 0
+    e9debug("tls(addr=%p,size=%U)", block, size);
+#endif
+}
+
+/*
+ * AFL-style fork-server.  If the fuzzer's control pipe is open, then the
+ * fully initialized process forks one child per control message, so each
+ * run skips exec(), the dynamic linker and the loading of trampolines.
+ * Children that stop themselves (SIGSTOP) are resumed rather than re-forked,
+ * which implements persistent mode (see examples/persistent.c).  Returns in
+ * the child, or immediately if there is no fuzzer.
+ */
+static void e9forkserver(void)
+{
+    const int ctl = E9_FORKSRV_FD, st = E9_FORKSRV_FD + 1;
+    int32_t msg = 0;
+    if (e9syscall(SYS_write, st, &msg, sizeof(msg)) != sizeof(msg))
+        return;                                 // No fuzzer
+    int32_t pid = -1;
+    bool stopped = false;
+    while (true)
+    {
+        if (e9syscall(SYS_read, ctl, &msg, sizeof(msg)) != sizeof(msg))
+            e9syscall(SYS_exit_group, 0);
+        int status = 0;
+        if (stopped && msg != 0)
+        {
+            // The fuzzer killed the stopped child (e.g., timeout):
+            stopped = false;
+            if (e9syscall(SYS_wait4, pid, &status, 0, NULL) < 0)
+                e9syscall(SYS_exit_group, 1);
+        }
+        if (!stopped)
+        {
+            pid = (int32_t)e9syscall(SYS_fork);
+            if (pid < 0)
+                e9syscall(SYS_exit_group, 1);
+            if (pid == 0)
+            {
+                e9syscall(SYS_close, ctl);
+                e9syscall(SYS_close, st);
+                return;
+            }
+        }
+        else
+        {
+            e9syscall(SYS_kill, pid, SIGCONT);
+            stopped = false;
+        }
+        if (e9syscall(SYS_write, st, &pid, sizeof(pid)) != sizeof(pid))
+            e9syscall(SYS_exit_group, 1);
+        if (e9syscall(SYS_wait4, pid, &status, WUNTRACED, NULL) < 0)
+            e9syscall(SYS_exit_group, 1);
+        stopped = WIFSTOPPED(status);
+        if (e9syscall(SYS_write, st, &status, sizeof(status)) !=
+                sizeof(status))
+            e9syscall(SYS_exit_group, 1);
+    }
 }
 
 /*
@@ -343,29 +658,11 @@ void *e9init(int argc, char **argv, char **envp, const e9_config_s *config)
             config->magic[6] != 'H' || config->magic[7] != '\0')
         e9panic("missing \"E9PATCH\" magic number");
     const uint8_t *loader_base = (const uint8_t *)config;
-    const uint8_t *loader_end  = loader_base + config->size;
     const uint8_t *elf_base    = loader_base - config->base;
+    bool lazy = ((config->flags & E9_FLAG_LAZY) != 0);
 
     // Step (1): Find & open the binary:
-    char buf[BUFSIZ];
-    const char *path = "/proc/self/exe";
-    if ((config->flags & E9_FLAG_EXE) == 0)
-    {
-        // This is a shared object, so use the /proc/self/map_files/
-        // method to find the binary.
-        char *str = buf;
-        str = e9write_format(str, "/proc/self/map_files/%X-%X", loader_base,
-            loader_end);
-        str = e9write_char(str, '\0');
-        path = buf;
-    }
-    ssize_t len = (ssize_t)e9syscall(SYS_readlink, path, buf, sizeof(buf));
-    if (len < 0)
-        e9panic("readlink(path=\"%s\") failed (errno=%u)", buf, -len);
-    buf[len] = '\0';
-    int fd = (int)e9syscall(SYS_open, buf, O_RDONLY, 0);
-    if (fd < 0)
-        e9panic("open(path=\"%s\") failed (errno=%u)", buf, -fd);
+    int fd = e9open(config, O_RDONLY | (lazy? O_CLOEXEC: 0x0));
 
     // Step (2): Setup dummy TLS (if necessary):
     struct e9scratch_s *scratch = NULL;
@@ -389,15 +686,50 @@ void *e9init(int argc, char **argv, char **envp, const e9_config_s *config)
     const struct e9_map_s *maps =
         (const struct e9_map_s *)(loader_base + config->maps[0]);
     e9load_maps(maps, config->num_maps[0], elf_base, fd, mmap);
+    const struct e9_config_elf_s *config_elf =
+        (const struct e9_config_elf_s *)(config + 1);
+    if (config_elf->num_zeros > 0)
+        e9load_zeros((const struct e9_zero_s *)(loader_base +
+            config_elf->zeros), config_elf->num_zeros, elf_base);
     if (config->mmap != 0x0)
         mmap = (mmap_t)e9addr(config->mmap, elf_base);
     maps = (const struct e9_map_s *)(loader_base + config->maps[1]);
-    e9load_maps(maps, config->num_maps[1], elf_base, fd, mmap);
-    e9syscall(SYS_close, fd);
+    if (!lazy)
+    {
+        e9load_maps(maps, config->num_maps[1], elf_base, fd, mmap);
+        e9syscall(SYS_close, fd);
+    }
+    else
+    {
+        // Lazy loading: reserve the maps and setup the SIGSEGV handler.
+        e9reserve_maps(maps, config->num_maps[1], elf_base, fd, mmap);
+        scratch =
+            (scratch == NULL? e9scratch(config, /*alloc=*/true): scratch);
+        struct stat buf;
+        r = e9syscall(SYS_fstat, fd, &buf);
+        if (r < 0)
+            e9panic("fstat() failed (errno=%u)", -r);
+        scratch->fd  = fd;
+        scratch->dev = buf.st_dev;
+        scratch->ino = buf.st_ino;
+        const uint8_t *handler = loader_base + config->handler;
+        struct ksigaction old, action =
+        {
+            (void *)handler, SA_NODEFER | SA_SIGINFO | SA_RESTORER,
+            e9restorer, 0x0
+        };
+        r = e9syscall(SYS_rt_sigaction, SIGSEGV, &action, &old, 8,
+            E9_BACKDOOR);
+        if (r < 0)
+            e9panic("sigaction() failed (errno=%u)", -r);
+        scratch->next_segv = (e9handler_t)old.sa_handler_2;
+    }
 
-    // Step (4): Call the initialization routines:
-    const struct e9_config_elf_s *config_elf =
-        (const struct e9_config_elf_s *)(config + 1);
+    // Step (4): Setup the per-thread block (if necessary):
+    if (config_elf->tls != 0)
+        e9tls(config_elf->tls, tls);
+
+    // Step (5): Call the initialization routines:
     const void *dynamic = NULL;
     if (config_elf->dynamic != 0x0)
         dynamic = (const void *)(elf_base + config_elf->dynamic);
@@ -408,7 +740,7 @@ void *e9init(int argc, char **argv, char **envp, const e9_config_s *config)
         init(argc, argv, envp, dynamic, config);
     }
 
-    // Step (5): Setup SIGILL handler (if necessary):
+    // Step (6): Setup SIGILL handler (if necessary):
     if (config->num_traps > 0)
     {
         const uint8_t *handler = loader_base + config->handler;
@@ -424,10 +756,15 @@ void *e9init(int argc, char **argv, char **envp, const e9_config_s *config)
         scratch =
             (scratch == NULL? e9scratch(config, /*alloc=*/true): scratch);
         scratch->next = (e9handler_t)old.sa_handler_2;
-        e9filter(scratch);
     }
+    if (config->num_traps > 0 || lazy)
+        e9filter(scratch, config->num_traps > 0, lazy);
+
+    // Step (7): Start the fork-server (if necessary):
+    if ((config->flags & E9_FLAG_FORKSRV) != 0)
+        e9forkserver();
 
-    // Step (6): Return the entry point:
+    // Step (8): Return the entry point:
     void *entry = (void *)e9addr(config->entry, elf_base);
     return entry;
 }
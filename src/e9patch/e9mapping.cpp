@@ -30,9 +30,15 @@
 #include <cstring>
 #include <ctime>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+
 #include <sys/mman.h>
 
 #include "e9alloc.h"
+#include "e9elf.h"
 #include "e9mapping.h"
 #include "e9patch.h"
 #include "e9trampoline.h"
@@ -54,6 +60,21 @@ size_t size<Key128>(Key128 key)
     return 8 * sizeof(key);
 }
 
+/*
+ * Population count.
+ */
+template <typename Key>
+static size_t popcount(Key key)
+{
+    return key.count();
+}
+template <>
+size_t popcount<Key128>(Key128 key)
+{
+    return __builtin_popcountll((uint64_t)key) +
+           __builtin_popcountll((uint64_t)(key >> 64));
+}
+
 /*
  * Trailing zero count.
  */
@@ -242,6 +263,66 @@ static bool calculatePreload(const Mapping *mapping)
     return false;
 }
 
+/*
+ * Calculate the HOT flag of a mapping.  A mapping is hot if it contains a
+ * trampoline for a hot instruction (see --profile-hot) or hot reserved
+ * memory.
+ */
+static bool calculateHot(const Mapping *mapping)
+{
+    const intptr_t END = mapping->base + (intptr_t)mapping->size;
+    auto iend = Allocator::end();
+    for (auto i = mapping->i; i != iend; ++i)
+    {
+        const Alloc *a = *i;
+        if (a->lb >= END)
+            break;
+        if (a->T == nullptr)
+            continue;
+        if (a->T->hot || (a->I != nullptr && isProfileHot(a->I->addr)))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Calculate the (page-granularity) bounds of the writable parts of a
+ * mapping.  Only these parts are mapped writable, so that the remaining
+ * (trampoline) pages are never written, and remain shared between all
+ * processes that run the patched binary.
+ */
+static void calculateWritable(const Mapping *mapping,
+    std::vector<Bounds> &bounds)
+{
+    const size_t   SIZE = mapping->size;
+    const intptr_t BASE = mapping->base;
+    const intptr_t END  = BASE + SIZE;
+    if (mapping->huge)
+    {
+        // Huge pages must not be split.
+        bounds.push_back({0, (intptr_t)SIZE});
+        return;
+    }
+    auto iend = Allocator::end();
+    for (auto i = mapping->i; i != iend; ++i)
+    {
+        const Alloc *a = *i;
+        if (a->lb >= END)
+            break;
+        if (a->T == nullptr || (a->T->prot & PROT_WRITE) == 0)
+            continue;
+        intptr_t lb = (a->lb < BASE? 0: a->lb - BASE);
+        intptr_t ub = (a->ub > END ? END - BASE: a->ub - BASE);
+        lb = lb - lb % PAGE_SIZE;
+        if (ub % PAGE_SIZE != 0)
+            ub = (ub + PAGE_SIZE) - (ub % PAGE_SIZE);
+        if (!bounds.empty() && bounds.back().ub >= lb)
+            bounds.back().ub = std::max(bounds.back().ub, ub);
+        else
+            bounds.push_back({lb, ub});
+    }
+}
+
 /*
  * Allocate a new mapping.
  */
@@ -255,6 +336,8 @@ static Mapping *allocMapping(Allocator::iterator i, size_t size, intptr_t base)
     mapping->offset  = -1;
     mapping->prot    = PROT_NONE;
     mapping->preload = false;
+    mapping->huge    = false;
+    mapping->hot     = false;
     mapping->i       = i;
     mapping->next    = nullptr;
     mapping->merged  = nullptr;
@@ -269,10 +352,41 @@ static void insertMapping(Mapping *mapping, MappingSet &mappings)
     mappings.push_back(mapping);
 }
 
+/*
+ * Calculate if a mapping can be backed by huge pages.  This requires the
+ * mapping to span whole (aligned) huge pages, and not to overlap any
+ * reserved memory, since the whole mapping will be mapped.  Furthermore,
+ * a huge page mapping is never grouped with other mappings, and always
+ * costs the whole mapping in the output file, so the mapping must also be
+ * dense enough (more than half used).  Sparse mappings are left as normal
+ * mappings.
+ */
+static bool calculateHuge(const Mapping *mapping, intptr_t reserved_ub)
+{
+    if (!option_mem_huge_pages || mapping->size % HUGE_PAGE_SIZE != 0 ||
+            mapping->base % (intptr_t)HUGE_PAGE_SIZE != 0 ||
+            reserved_ub > mapping->base)
+        return false;
+    const intptr_t BASE = mapping->base;
+    const intptr_t END  = BASE + mapping->size;
+    size_t used = 0;
+    for (auto i = mapping->i, iend = Allocator::end(); i != iend; ++i)
+    {
+        const Alloc *a = *i;
+        if (a->lb >= END)
+            break;
+        if (a->T == nullptr || a->bytes == nullptr)
+            return false;
+        used += (size_t)(std::min(a->ub, END) - std::max(a->lb, BASE));
+    }
+    return (used > mapping->size / 2);
+}
+
 /*
  * Save a mapping into the set.
  */
-static void saveMapping(Mapping *mapping, MappingSet &mappings)
+static void saveMapping(Mapping *mapping, MappingSet &mappings,
+    intptr_t reserved_ub)
 {
     if (mapping == nullptr)
         return;
@@ -281,40 +395,91 @@ static void saveMapping(Mapping *mapping, MappingSet &mappings)
     mapping->ub = b.ub;
     mapping->prot = calculateProtections(mapping);
     mapping->preload = calculatePreload(mapping);
+    mapping->huge = calculateHuge(mapping, reserved_ub);
+    mapping->hot = calculateHot(mapping);
+    if ((mapping->prot & PROT_WRITE) != 0)
+        calculateWritable(mapping, mapping->writable);
     insertMapping(mapping, mappings);
-    stat_num_virtual_mappings++;
 }
 
 /*
- * Build the initial set of (unmerged) mappings from the virtual address
- * layout described by `allocator`.
+ * Build mappings of size `MAPPING_SIZE` for all trampolines within the
+ * [LB..UB) range, starting from allocation `i`.
  */
-void buildMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
-    MappingSet &mappings)
+static void buildMappings(Allocator::iterator i, intptr_t LB, intptr_t UB,
+    const size_t MAPPING_SIZE, MappingSet &mappings)
 {
     intptr_t base    = INTPTR_MIN;
     Mapping *mapping = nullptr;
 
-    mappings.clear();
-    for (auto i = allocator.begin(), iend = allocator.end(); i != iend; ++i)
+    // The upper bound of reserved (non-trampoline) memory so far, which
+    // prevents huge page mappings (see calculateHuge()).
+    intptr_t reserved_ub = INTPTR_MIN;
+    intptr_t mapping_reserved_ub = INTPTR_MIN;
+
+    for (auto iend = Allocator::end(); i != iend; ++i)
     {
         const Alloc *a = *i;
+        if (a->lb >= UB)
+            break;
         if (a->T == nullptr)
+        {
+            reserved_ub = std::max(reserved_ub, a->ub);
             continue;
+        }
         if (a->lb >= base + (intptr_t)MAPPING_SIZE)
         {
             base = a->lb - a->lb % MAPPING_SIZE;
-            saveMapping(mapping, mappings);
+            base = std::max(base, LB);
+            saveMapping(mapping, mappings, mapping_reserved_ub);
             mapping = allocMapping(i, MAPPING_SIZE, base);
+            mapping_reserved_ub = reserved_ub;
         }
-        while (base + (ssize_t)MAPPING_SIZE < a->ub)
+        intptr_t ub = std::min(a->ub, UB);
+        while (base + (ssize_t)MAPPING_SIZE < ub)
         {
             base += MAPPING_SIZE;
-            saveMapping(mapping, mappings);
+            saveMapping(mapping, mappings, mapping_reserved_ub);
             mapping = allocMapping(i, MAPPING_SIZE, base);
+            mapping_reserved_ub = reserved_ub;
         }
     }
-    saveMapping(mapping, mappings);
+    saveMapping(mapping, mappings, mapping_reserved_ub);
+}
+
+/*
+ * Build the initial set of (unmerged) mappings from the virtual address
+ * layout described by `allocator`.
+ */
+void buildMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
+    MappingSet &mappings)
+{
+    mappings.clear();
+    if (!option_mem_huge_pages || MAPPING_SIZE >= HUGE_PAGE_SIZE ||
+            HUGE_PAGE_SIZE % MAPPING_SIZE != 0)
+    {
+        buildMappings(allocator.begin(), INTPTR_MIN, INTPTR_MAX, MAPPING_SIZE,
+            mappings);
+        return;
+    }
+
+    // For huge pages, first build huge page sized mappings.  Only the
+    // (dense) mappings that pass calculateHuge() are kept, and the rest
+    // are rebuilt using the normal MAPPING_SIZE.
+    MappingSet huge_mappings;
+    buildMappings(allocator.begin(), INTPTR_MIN, INTPTR_MAX, HUGE_PAGE_SIZE,
+        huge_mappings);
+    for (auto *mapping: huge_mappings)
+    {
+        if (mapping->huge)
+        {
+            mappings.push_back(mapping);
+            continue;
+        }
+        buildMappings(mapping->i, mapping->base,
+            mapping->base + (intptr_t)mapping->size, MAPPING_SIZE, mappings);
+        delete mapping;
+    }
 }
 
 /**************************************************************************/
@@ -439,6 +604,39 @@ static Radix::Node<Key> *findAnyComplement(Radix::Node<Key> *node, Key key)
     return nullptr;
 }
 
+/*
+ * Find the best leaf node matching (key & leaf->key) == 0, i.e., the leaf
+ * that results in the most occupied merged key (best fit).
+ */
+template <typename Key>
+static void findBestComplement(Radix::Node<Key> *node, Key key,
+    Radix::Node<Key> *&best, size_t &best_count)
+{
+    if (node == nullptr)
+        return;
+    if (!node->inner)
+    {
+        if ((node->key & key) != 0)
+            return;
+        size_t count = popcount<Key>(node->key);
+        if (best == nullptr || count > best_count)
+        {
+            best       = node;
+            best_count = count;
+        }
+        return;
+    }
+    for (unsigned i = 0; i < BRANCH_MAX; i++)
+    {
+        Radix::Node<Key> *child = node->child[i];
+        if (child == nullptr)
+            continue;
+        if ((key & child->key) != 0)
+            continue;
+        findBestComplement(child, key, best, best_count);
+    }
+}
+
 /*
  * Insert a new mapping into the tree.
  */
@@ -539,7 +737,7 @@ static Radix::Node<Key> *remove(Radix::Node<Key> *node, Key key)
  */
 template <typename Key>
 static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
-    Mapping *mapping)
+    Mapping *mapping, bool verbose, bool best = false)
 {
     Radix::Node<Key> *node = find(tree, key);
     if (node != nullptr)
@@ -547,11 +745,19 @@ static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
         // Add to existing node for key:
         mapping->next = node->leaf.mappings;
         node->leaf.mappings = mapping;
-        log(COLOR_NONE, '+');
+        if (verbose)
+            log(COLOR_NONE, '+');
         return tree;
     }
 
-    node = findAnyComplement(tree, key);
+    if (best)
+    {
+        size_t count = 0;
+        node = nullptr;
+        findBestComplement(tree, key, node, count);
+    }
+    else
+        node = findAnyComplement(tree, key);
     if (node != nullptr)
     {
         // Merge with negated node:
@@ -565,9 +771,10 @@ static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
             // Leaf node is now empty, so remove it.
             tree = remove(tree, node->key);
         }
-        log(COLOR_GREEN, 'M');
+        if (verbose)
+            log(COLOR_GREEN, 'M');
     }
-    else
+    else if (verbose)
         log(COLOR_NONE, '+');
 
     // Insert a new node:
@@ -576,10 +783,16 @@ static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
 }
 
 /*
- * Collect all (optimized) mappings and free the tree.
+ * A physical mapping group (the head of a merged mapping list) and its key.
+ */
+template <typename Key>
+using Groups = std::vector<std::pair<Key, Mapping *>>;
+
+/*
+ * Collect all (optimized) mapping groups and free the tree.
  */
 template <typename Key>
-static void collectMappings(Radix::Node<Key> *node, MappingSet &mappings)
+static void collectMappings(Radix::Node<Key> *node, Groups<Key> &groups)
 {
     if (node == nullptr)
         return;
@@ -587,24 +800,118 @@ static void collectMappings(Radix::Node<Key> *node, MappingSet &mappings)
     {
         for (auto mapping = node->leaf.mappings; mapping != nullptr;
             mapping = mapping->next)
-        {
-            std::string str;
-            bitstring(node->key, str);
-            log(COLOR_NONE, '[');
-            log(COLOR_YELLOW, str.c_str());
-            log(COLOR_NONE, ']');
-            insertMapping(mapping, mappings);
-            stat_num_physical_mappings++;
-        }
+            groups.push_back({node->key, mapping});
     }
     else
     {
         for (unsigned i = 0; i < BRANCH_MAX; i++)
-            collectMappings(node->child[i], mappings);
+            collectMappings(node->child[i], groups);
     }
     delete node;
 }
 
+/*
+ * Calculate the occupancy keys of all mappings.  The mappings are
+ * independent, so this is parallelized using up to `max_threads' threads.
+ */
+template <typename Key>
+static void calculateKeys(const Allocator &allocator,
+    const size_t MAPPING_SIZE, const MappingSet &mappings,
+    std::vector<Key> &keys, unsigned max_threads)
+{
+    keys.resize(mappings.size());
+    size_t num_threads = std::min((size_t)max_threads, mappings.size() / 64);
+    if (num_threads <= 1)
+    {
+        for (size_t i = 0; i < mappings.size(); i++)
+            keys[i] = calculateKey<Key>(allocator, MAPPING_SIZE, mappings[i]);
+        return;
+    }
+    const size_t CHUNK_SIZE = 64;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&]() {
+            size_t lo;
+            while ((lo = CHUNK_SIZE * next++) < mappings.size())
+            {
+                size_t hi = std::min(lo + CHUNK_SIZE, mappings.size());
+                for (size_t i = lo; i < hi; i++)
+                    keys[i] = calculateKey<Key>(allocator, MAPPING_SIZE,
+                        mappings[i]);
+            }
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+}
+
+/*
+ * Calculate the (file) size of a mapping group after shrinkMapping().
+ */
+static size_t groupSize(const Mapping *mapping0, size_t granularity)
+{
+    intptr_t lb = INTPTR_MAX, ub = INTPTR_MIN;
+    for (auto mapping = mapping0; mapping != nullptr;
+        mapping = mapping->merged)
+    {
+        if (mapping->huge)
+            return mapping0->size;
+        lb = std::min(lb, mapping->lb);
+        ub = std::max(ub, mapping->ub);
+    }
+    lb = lb - lb % granularity;
+    if (ub % granularity != 0)
+    {
+        ub += granularity;
+        ub = ub - ub % granularity;
+    }
+    return std::min((size_t)(ub - lb), mapping0->size);
+}
+template <typename Key>
+static size_t groupsSize(const Groups<Key> &groups, size_t granularity)
+{
+    size_t size = 0;
+    for (const auto &group: groups)
+        size += groupSize(group.second, granularity);
+    return size;
+}
+
+/*
+ * Higher-quality packing (--mem-pack-budget): mappings are merged in
+ * decreasing order of occupancy (first-fit decreasing), each with the
+ * best-fitting complement, until the time budget (in milliseconds)
+ * expires.  The remaining mappings are merged greedily.
+ */
+template <typename Key>
+static void packMappings(const MappingSet &mappings,
+    const std::vector<Key> &keys, size_t pack_budget, Groups<Key> &groups)
+{
+    std::vector<size_t> order(mappings.size());
+    std::vector<size_t> counts(mappings.size());
+    for (size_t i = 0; i < mappings.size(); i++)
+    {
+        order[i]  = i;
+        counts[i] = popcount<Key>(keys[i]);
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t i, size_t j) { return counts[i] > counts[j]; });
+
+    const clock_t budget = (clock_t)pack_budget * CLOCKS_PER_SEC / 1000;
+    const clock_t start = clock();
+    bool best = true;
+    Radix::Node<Key> *tree = nullptr;
+    for (size_t n = 0; n < order.size(); n++)
+    {
+        if (best && n % 64 == 0 && clock() - start > budget)
+            best = false;
+        size_t i = order[n];
+        tree = merge(tree, keys[i], mappings[i], /*verbose=*/false, best);
+    }
+    collectMappings(tree, groups);
+}
+
 /*
  * Shrink a mapping (if possible).
  */
@@ -617,6 +924,8 @@ static void shrinkMapping(Mapping *mapping0, size_t granularity)
     for (auto mapping = mapping0; mapping != nullptr;
         mapping = mapping->merged)
     {
+        if (mapping->huge)
+            return;                 // Huge pages must not be shrunk
         lb = std::min(lb, mapping->lb);
         ub = std::max(ub, mapping->ub);
     }
@@ -638,37 +947,304 @@ static void shrinkMapping(Mapping *mapping0, size_t granularity)
         mapping->size  = size;
         mapping->lb   -= lb;
         mapping->ub   -= lb;
+        for (auto &b: mapping->writable)
+        {
+            b.lb -= lb;
+            b.ub -= lb;
+        }
+    }
+}
+
+/*
+ * Check if the virtual address range [lb, ub) is unused, starting the
+ * search from allocation i.
+ */
+static bool isUnused(Allocator::iterator i, intptr_t lb, intptr_t ub)
+{
+    for (auto iend = Allocator::end(); i != iend; ++i)
+    {
+        const Alloc *a = *i;
+        if (a->lb >= ub)
+            break;
+        if (a->ub > lb)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Coalesce runs of virtual mappings that are separated by less than
+ * `--mem-coalesce' unused pages into a single mapping (filling the gaps).
+ * Runs are not merged with other mappings, so this trades file size for
+ * fewer loader mmap() calls.  The (sorted) mappings are split into the
+ * runs and the remaining mappings.
+ */
+static void coalesceMappings(MappingSet &mappings, MappingSet &runs)
+{
+    const size_t RUN_MAX = (1ull << 28);
+    MappingSet rest;
+    for (size_t i = 0; i < mappings.size(); )
+    {
+        Mapping *run = mappings[i++];
+        Allocator::iterator last = run->i;
+        size_t size = run->size;
+        intptr_t ub = run->ub;
+        for (; !run->huge && i < mappings.size(); i++)
+        {
+            const Mapping *mapping = mappings[i];
+            intptr_t end = run->base + (intptr_t)size;
+            if (mapping->huge || mapping->prot != run->prot ||
+                    mapping->preload != run->preload ||
+                    mapping->hot != run->hot ||
+                    mapping->base < end ||
+                    mapping->base - end >=
+                        (intptr_t)(option_mem_coalesce * PAGE_SIZE) ||
+                    (size_t)(mapping->base - run->base) + mapping->size >
+                        RUN_MAX ||
+                    !isUnused(last, end, mapping->base))
+                break;
+            size = (size_t)(mapping->base - run->base) + mapping->size;
+            ub   = (mapping->base - run->base) + mapping->ub;
+            last = mapping->i;
+            delete mapping;
+        }
+        if (size == run->size)
+        {
+            rest.push_back(run);
+            continue;
+        }
+        run->size = size;
+        run->ub   = ub;
+        runs.push_back(run);
     }
+    mappings.swap(rest);
 }
 
 /*
- * Optimize the given set of mappings.
+ * Optimize the given set of mappings.  Here, `threads' and `pack_budget'
+ * are the --threads and --mem-pack-budget settings to use, and `verbose'
+ * enables logging.  Returns the number of bytes saved by the packing.
  */
 template <typename Key>
-void optimizeMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
-    size_t granularity, MappingSet &mappings)
+size_t optimizeMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
+    size_t granularity, MappingSet &mappings, unsigned threads,
+    size_t pack_budget, bool verbose)
 {
-    Radix::Node<Key> *tree = nullptr;
+    MappingSet runs;
+    if (option_mem_coalesce > 0)
+        coalesceMappings(mappings, runs);
+
+    // Huge page mappings are never merged (see buildMappings()):
+    MappingSet huge, rest;
     for (auto mapping: mappings)
+        (mapping->huge? huge: rest).push_back(mapping);
+    mappings.swap(rest);
+
+    std::vector<Key> keys;
+    calculateKeys<Key>(allocator, MAPPING_SIZE, mappings, keys, threads);
+
+    Radix::Node<Key> *tree = nullptr;
+    for (size_t i = 0; i < mappings.size(); i++)
+        tree = merge(tree, keys[i], mappings[i], verbose);
+    if (verbose)
+        log(COLOR_NONE, '\n');
+
+    Groups<Key> groups;
+    collectMappings(tree, groups);
+    size_t pack_saved = 0;
+    if (pack_budget > 0)
     {
-        Key key = calculateKey<Key>(allocator, MAPPING_SIZE, mapping);
-        tree = merge(tree, key, mapping);
+        // Try to improve on the greedy packing, and keep the best:
+        std::vector<std::pair<Mapping *, Mapping *>> saved;
+        saved.reserve(mappings.size());
+        for (auto mapping: mappings)
+        {
+            saved.push_back({mapping->next, mapping->merged});
+            mapping->next = mapping->merged = nullptr;
+        }
+        Groups<Key> packed;
+        packMappings(mappings, keys, pack_budget, packed);
+        size_t size0 = groupsSize(groups, granularity);
+        size_t size1 = groupsSize(packed, granularity);
+        if (size1 < size0)
+        {
+            groups.swap(packed);
+            pack_saved = size0 - size1;
+        }
+        else for (size_t i = 0; i < mappings.size(); i++)
+        {
+            mappings[i]->next   = saved[i].first;
+            mappings[i]->merged = saved[i].second;
+        }
     }
-    log(COLOR_NONE, '\n');
 
     mappings.clear();
-    collectMappings(tree, mappings);
-    log(COLOR_NONE, '\n');
+    for (const auto &group: groups)
+    {
+        if (verbose)
+        {
+            std::string str;
+            bitstring(group.first, str);
+            log(COLOR_NONE, '[');
+            log(COLOR_YELLOW, str.c_str());
+            log(COLOR_NONE, ']');
+        }
+        insertMapping(group.second, mappings);
+    }
+    if (verbose)
+        log(COLOR_NONE, '\n');
+    for (auto run: runs)
+        insertMapping(run, mappings);
+    for (auto mapping: huge)
+        insertMapping(mapping, mappings);
 
     for (auto mapping: mappings)
         shrinkMapping(mapping, granularity);
+    return pack_saved;
 }
 template
-void optimizeMappings<Key128>(const Allocator &allocator,
-    const size_t MAPPING_SIZE, size_t granularity, MappingSet &mappings);
+size_t optimizeMappings<Key128>(const Allocator &allocator,
+    const size_t MAPPING_SIZE, size_t granularity, MappingSet &mappings,
+    unsigned threads, size_t pack_budget, bool verbose);
 template
-void optimizeMappings<Key4096>(const Allocator &allocator,
-    const size_t MAPPING_SIZE, size_t granularity, MappingSet &mappings);
+size_t optimizeMappings<Key4096>(const Allocator &allocator,
+    const size_t MAPPING_SIZE, size_t granularity, MappingSet &mappings,
+    unsigned threads, size_t pack_budget, bool verbose);
+
+/*
+ * A candidate (key granularity, mapping size) pair for --mem-auto.
+ */
+struct Candidate
+{
+    size_t key;                 // Key granularity (--mem-granularity).
+    size_t size;                // Mapping size (--mem-mapping-size).
+    size_t bytes;               // Physical (file) bytes.
+    size_t maps;                // Loader mappings.
+};
+
+/*
+ * For the "maps" objective, candidates with a file size more than this
+ * factor larger than the smallest candidate are not considered.
+ */
+#define MEM_AUTO_MAPS_SIZE_BOUND    4
+
+/*
+ * Evaluate a candidate by building & optimizing a throw-away set of
+ * mappings.  The trials use a single thread each, the greedy packing (no
+ * --mem-pack-budget), and no logging.
+ */
+static void trialMappings(const Allocator &allocator, size_t granularity,
+    Candidate &C)
+{
+    MappingSet mappings;
+    buildMappings(allocator, C.size, mappings);
+    if (C.key == 128)
+        optimizeMappings<Key128>(allocator, C.size, granularity, mappings,
+            /*threads=*/1, /*pack_budget=*/0, /*verbose=*/false);
+    else
+        optimizeMappings<Key4096>(allocator, C.size, granularity, mappings,
+            /*threads=*/1, /*pack_budget=*/0, /*verbose=*/false);
+    C.bytes = 0;
+    C.maps  = countLoaderMaps(mappings);
+    for (auto mapping: mappings)
+    {
+        C.bytes += mapping->size;
+        while (mapping != nullptr)
+        {
+            Mapping *next = mapping->merged;
+            delete mapping;
+            mapping = next;
+        }
+    }
+}
+
+/*
+ * The candidate cost according to the --mem-auto objective.  For "mix",
+ * each loader mapping is weighted as one page of file size.
+ */
+static size_t candidateCost(const Candidate &C)
+{
+    switch (option_mem_auto)
+    {
+        case OPTION_MEM_AUTO_SIZE:
+            return C.bytes;
+        case OPTION_MEM_AUTO_MAPS:
+            return C.maps;
+        default:
+            return C.bytes + C.maps * PAGE_SIZE;
+    }
+}
+
+/*
+ * Select the (key granularity, mapping size) pair that minimizes the
+ * --mem-auto objective.  Each candidate pair is evaluated in full, and the
+ * candidates are independent, so this is parallelized according to
+ * --threads.  Mapping sizes below `min_size' are not considered.  For the
+ * "maps" objective, the file size is bounded by MEM_AUTO_MAPS_SIZE_BOUND,
+ * and ties are broken by file size.
+ */
+void autoMappings(const Allocator &allocator, size_t granularity,
+    size_t min_size, size_t &key, size_t &mapping_size)
+{
+    static const size_t sizes[] =
+    {
+        PAGE_SIZE, 4 * PAGE_SIZE, 16 * PAGE_SIZE, 64 * PAGE_SIZE,
+        256 * PAGE_SIZE, HUGE_PAGE_SIZE
+    };
+    std::vector<Candidate> candidates;
+    for (size_t size: sizes)
+    {
+        if (size < min_size)
+            continue;
+        candidates.push_back({128, size, 0, 0});
+        candidates.push_back({4096, size, 0, 0});
+    }
+    if (candidates.size() == 0)
+    {
+        candidates.push_back({128, min_size, 0, 0});
+        candidates.push_back({4096, min_size, 0, 0});
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    size_t num_threads = std::min(std::max((size_t)option_threads, (size_t)1),
+        candidates.size());
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&]() {
+            size_t i;
+            while ((i = next++) < candidates.size())
+                trialMappings(allocator, granularity, candidates[i]);
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+
+    size_t min_bytes = SIZE_MAX;
+    for (const auto &C: candidates)
+        min_bytes = std::min(min_bytes, C.bytes);
+    const Candidate *best = nullptr;
+    for (const auto &C: candidates)
+    {
+        debug("mem-auto: granularity=%zu mapping-size=%zu bytes=%zu "
+            "maps=%zu", C.key, C.size, C.bytes, C.maps);
+        if (option_mem_auto == OPTION_MEM_AUTO_MAPS &&
+                C.bytes > MEM_AUTO_MAPS_SIZE_BOUND * min_bytes)
+            continue;
+        if (best == nullptr)
+        {
+            best = &C;
+            continue;
+        }
+        size_t cost = candidateCost(C), best_cost = candidateCost(*best);
+        if (cost < best_cost ||
+                (cost == best_cost && (C.bytes < best->bytes ||
+                    (C.bytes == best->bytes && C.maps < best->maps))))
+            best = &C;      // Ties are broken by size, then mappings
+    }
+    key          = best->key;
+    mapping_size = best->size;
+}
 
 /**************************************************************************/
 /* FLATTEN MAPPINGS                                                       */
@@ -707,6 +1283,42 @@ void flattenMapping(const Binary *B, uint8_t *buf, const Mapping *mapping,
     }
 }
 
+/*
+ * Flatten all mappings into the output file data (at mapping->offset).
+ * The mappings are disjoint in the file, so this is parallelized according
+ * to --threads.
+ */
+void flattenMappings(const Binary *B, uint8_t *data,
+    const MappingSet &mappings, uint8_t fill)
+{
+    size_t num_threads = std::min((size_t)option_threads,
+        mappings.size() / 16);
+    if (num_threads <= 1)
+    {
+        for (auto mapping: mappings)
+            flattenMapping(B, data + mapping->offset, mapping, fill);
+        return;
+    }
+    const size_t CHUNK_SIZE = 16;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&]() {
+            size_t lo;
+            while ((lo = CHUNK_SIZE * next++) < mappings.size())
+            {
+                size_t hi = std::min(lo + CHUNK_SIZE, mappings.size());
+                for (size_t i = lo; i < hi; i++)
+                    flattenMapping(B, data + mappings[i]->offset,
+                        mappings[i], fill);
+            }
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+}
+
 /*
  * Get the virtual bounds of a mapping.
  */
@@ -38,6 +38,9 @@ struct Mapping
     Allocator::iterator i;      // Virtual memory contents.
     int prot;                   // Protections.
     bool preload;               // Preload mapping?
+    bool huge;                  // Huge page mapping?
+    bool hot;                   // Hot (prefaulted) mapping?
+    std::vector<Bounds> writable;   // Writable pages (if prot has WRITE).
 
     // Physical memory:
     off_t offset;               // Physical file offet.
@@ -53,11 +56,16 @@ void buildMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
     MappingSet &mappings);
 void flattenMapping(const Binary *B, uint8_t *buf, const Mapping *mapping,
     uint8_t fill);
+void flattenMappings(const Binary *B, uint8_t *data,
+    const MappingSet &mappings, uint8_t fill);
 void getVirtualBounds(const Mapping *mapping, size_t granularity,
     std::vector<Bounds> &bounds);
 
 template <typename Key>
-void optimizeMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
-    size_t granularity, MappingSet &mappings);
+size_t optimizeMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
+    size_t granularity, MappingSet &mappings, unsigned threads,
+    size_t pack_budget, bool verbose);
+void autoMappings(const Allocator &allocator, size_t granularity,
+    size_t min_size, size_t &key, size_t &mapping_size);
 
 #endif
@@ -72,15 +72,15 @@ InstrSet::InstrSet()
 }
 
 /*
- * Instruction set allocate.
+ * Instruction set allocate (n consecutive slots).
  */
-void *InstrSet::alloc()
+void *InstrSet::alloc(size_t n)
 {
-    lb--;
+    lb -= n;
     Instr *I = lb;
     Instr *S = I - 1;
 
-    if ((void *)S < limit)
+    while ((void *)S < limit)
     {
         intptr_t base = (uintptr_t)limit;
         extend = (extend >= 256? 256: 2 * extend);
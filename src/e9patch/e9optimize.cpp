@@ -16,9 +16,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <unordered_map>
+
 #include "e9patch.h"
 #include "e9x86_64.h"
 
+#define JUMP_THREAD_MAX     16          // Max jump threading hops
+
+/*
+ * Index of observed (trampoline) jumps by address.
+ */
+typedef std::unordered_map<intptr_t, const JumpInfo *> JumpIndex;
+
 /*
  * Build the initial trampoline entry set.
  */
@@ -32,20 +41,24 @@ void buildEntrySet(Binary *B)
     const Instr *I = B->Is.back(), *J = nullptr;
     if (I == nullptr)
         return;
-    unsigned num = 0, size = 0;
+    unsigned num = 0, size = 0, max_num = 0, max_size = 0;
     while (I != nullptr)
     {
         if (I->patch)
         {
+            // Hot instructions (according to the --profile) get twice the
+            // prologue space:
+            unsigned scale = (isProfileHot(I->addr)? 2: 1);
             J = I;
             num = size = 0;
+            max_num  = scale * option_Oprologue;
+            max_size = scale * option_Oprologue_size;
         }
         else if (isCFT(I->ORIG, I->size, CFT_CALL | CFT_RET | CFT_JMP))
             J = nullptr;
-        if (J != nullptr && num <= option_Oprologue &&
-                size <= option_Oprologue_size)
+        if (J != nullptr && num <= max_num && size <= max_size)
         {
-            EntryPoint E = {J, INTPTR_MIN, false, false};
+            EntryPoint E = {J, INTPTR_MIN, false, false, false};
             B->Es.insert({I->addr, E});
         }
         num  += 1;
@@ -140,7 +153,7 @@ const Instr *getTrampolinePrologueStart(const EntrySet &Es, const Instr *I)
     if (i == Es.end())
         return nullptr;
     const EntryPoint &E = i->second;
-    if (E.I != I)
+    if (E.I != I || E.minimal)
         return nullptr;
 
     auto j = Es.begin();
@@ -179,7 +192,7 @@ void setTrampolineEntry(EntrySet &Es, const Instr *I, intptr_t entry)
     {
         if (entry != INTPTR_MIN)
         {
-            EntryPoint E = {I, entry, false, false};
+            EntryPoint E = {I, entry, false, false, false};
             Es.insert({I->addr, E});
         }
         return;
@@ -188,6 +201,17 @@ void setTrampolineEntry(EntrySet &Es, const Instr *I, intptr_t entry)
     E.entry       = entry;
 }
 
+/*
+ * Set whether the trampoline for `I' uses a minimal window, i.e., no
+ * prologue (-Oadaptive).  The epilogue is controlled by I->no_optimize.
+ */
+void setTrampolineMinimal(EntrySet &Es, const Instr *I, bool minimal)
+{
+    auto i = Es.find(I->addr);
+    if (i != Es.end() && i->second.I == I)
+        i->second.minimal = minimal;
+}
+
 /*
  * Find the instruction at the given address.
  */
@@ -211,16 +235,95 @@ Instr *findInstr(const Binary *B, intptr_t addr)
     return nullptr;
 }
 
+/*
+ * Test if an instruction has not been overwritten by any patch.
+ */
+static bool isUnmodifiedInstr(const Instr *I)
+{
+    for (size_t i = 0; i < I->size; i++)
+    {
+        if (I->peekState(i) != STATE_INSTRUCTION)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Get the next hop of a jump to `target', i.e., the address that control
+ * is (unconditionally) transferred to next, else INTPTR_MIN.
+ */
+static intptr_t getJumpHop(const Binary *B, const JumpIndex &Ji,
+    intptr_t target)
+{
+    const Instr *J = findInstr(B, target);
+    if (J != nullptr)
+    {
+        // Patched instruction --> trampoline entry, else original jump:
+        intptr_t next = getTrampolineEntry(B->Es, J);
+        if (next == INTPTR_MIN)
+            next = getCFTTarget(J->addr, J->PATCH, J->size, CFT_JMP);
+        return next;
+    }
+
+    // Else the target may be a jump within a trampoline, e.g., a $BREAK
+    // jump back to the main code (or a jump cloned into an epilogue):
+    auto i = Ji.find(target);
+    if (i == Ji.end())
+        return INTPTR_MIN;
+    const JumpInfo *K = i->second;
+    return getCFTTarget(K->addr, K->bytes, K->size, CFT_JMP);
+}
+
+/*
+ * Thread a jump to `target' through any chain of unconditional jumps, and
+ * return the final destination, else INTPTR_MIN.
+ */
+static intptr_t threadJump(const Binary *B, const JumpIndex &Ji,
+    intptr_t target)
+{
+    intptr_t dest = INTPTR_MIN;
+    for (unsigned i = 0; i < JUMP_THREAD_MAX; i++)
+    {
+        target = getJumpHop(B, Ji, target);
+        if (target == INTPTR_MIN)
+            break;
+        dest = target;
+    }
+    return dest;
+}
+
+/*
+ * Test if `target' is an unpatched return instruction.
+ */
+static bool isReturn(const Binary *B, intptr_t target)
+{
+    const Instr *J = findInstr(B, target);
+    if (J == nullptr || J->is_patched ||
+            getTrampolineEntry(B->Es, J) != INTPTR_MIN ||
+            !isUnmodifiedInstr(J))
+        return false;
+    const uint8_t *bytes = J->PATCH;
+    switch (J->size)
+    {
+        case /*sizeof(ret)=*/1:
+            return (bytes[0] == 0xC3);
+        case /*sizeof(repz ret)=*/2:
+            return (bytes[0] == 0xF3 && bytes[1] == 0xC3);
+        default:
+            return false;
+    }
+}
+
 /*
  * Optimize a jump (or call) instruction.
  */
-static void optimizeJump(const Binary *B, intptr_t addr, uint8_t *bytes,
-    size_t size)
+static void optimizeJump(const Binary *B, const JumpIndex &Ji, intptr_t addr,
+    uint8_t *bytes, size_t size)
 {
     if (!option_Opeephole || size == 0)
         return;
 
-    bool jcc = false, jmp = false;
+    bool jcc = false, jmp = false, call = false;
     switch (bytes[0])
     {
         case 0xE9:
@@ -229,6 +332,7 @@ static void optimizeJump(const Binary *B, intptr_t addr, uint8_t *bytes,
         case 0xE8:
             if (size != /*sizeof(jmpq/call rel32)=*/5)
                 return;
+            call = !jmp;
             break;
         case 0x0F:
             if (size != /*sizeof(jcc rel32)=*/6)
@@ -251,14 +355,18 @@ static void optimizeJump(const Binary *B, intptr_t addr, uint8_t *bytes,
 
     int32_t rel32 = *(int32_t *)(bytes + (jcc? 2: 1));
     intptr_t target = addr + (intptr_t)size + (intptr_t)rel32;
-    const Instr *J = findInstr(B, target);
-    if (J == nullptr)
+    intptr_t dest = threadJump(B, Ji, target);
+    if (call && isReturn(B, (dest != INTPTR_MIN? dest: target)))
+    {
+        // A call to a (plain) return is a no-op, so replace the CALL with
+        // a 5-byte NOP.  Only original (unpatched) returns are considered.
+        bytes[0] = 0x0F; bytes[1] = 0x1F; bytes[2] = 0x44;
+        bytes[3] = 0x00; bytes[4] = 0x00;
         return;
-    target = getTrampolineEntry(B->Es, J);
-    if (target == INTPTR_MIN)
-        target = getCFTTarget(J->addr, J->PATCH, J->size, CFT_JMP);
-    if (target == INTPTR_MIN)
+    }
+    if (dest == INTPTR_MIN)
         return;
+    target = dest;
 
     intptr_t diff = target - (addr + (intptr_t)size);
     if (jmp && diff == 0)
@@ -274,28 +382,28 @@ static void optimizeJump(const Binary *B, intptr_t addr, uint8_t *bytes,
 }
 
 /*
- * Optimize all jumps in the binary.
+ * Optimize all jumps in the binary.  Chains of unconditional jumps (e.g.,
+ * jump --> trampoline --> $BREAK --> original jump --> trampoline) are
+ * threaded so that each jump transfers control to the final destination.
  */
 void optimizeAllJumps(Binary *B)
 {
     if (!option_Opeephole)
         return;
 
+    JumpIndex Ji;
+    Ji.reserve(B->Js.size());
     for (const auto &J: B->Js)
-        optimizeJump(B, J.addr, J.bytes, J.size);
-    B->Js.clear();
+        Ji.insert({J.addr, &J});
+
+    for (const auto &J: B->Js)
+        optimizeJump(B, Ji, J.addr, J.bytes, J.size);
 
     for (Instr *I = B->Is.front(); I != nullptr; I = I->next())
     {
-        if (I->is_patched)
-            continue;
-        bool ok = true;
-        for (size_t i = 0; ok && i < I->size; i++)
-            ok = (I->STATE[i] == STATE_INSTRUCTION);
-        if (!ok)
+        if (I->is_patched || !isUnmodifiedInstr(I))
             continue;
-
-        optimizeJump(B, I->addr, I->PATCH, I->size);
+        optimizeJump(B, Ji, I->addr, I->PATCH, I->size);
     }
+    B->Js.clear();
 }
-
@@ -25,6 +25,7 @@ void buildEntrySet(Binary *B);
 const Instr *getTrampolinePrologueStart(const EntrySet &Es, const Instr *I);
 intptr_t getTrampolineEntry(const EntrySet &Es, const Instr *I);
 void setTrampolineEntry(EntrySet &Es, const Instr *I, intptr_t addr);
+void setTrampolineMinimal(EntrySet &Es, const Instr *I, bool minimal);
 void optimizeJump(const Binary *B, intptr_t addr, uint8_t *bytes, size_t size);
 void optimizeAllJumps(Binary *B);
 
@@ -18,6 +18,7 @@
 
 #include <string>
 
+#include <cctype>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -30,9 +31,12 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 
+#include "e9alloc.h"
 #include "e9api.h"
 #include "e9json.h"
 #include "e9patch.h"
+#include "e9ring.h"
+#include "e9server.h"
 
 /*
  * Global options.
@@ -50,33 +54,54 @@ bool option_tactic_T3          = true;
 bool option_tactic_backward_T3 = true;
 bool option_OCFR               = false;
 bool option_OCFR_hacks         = false;
+bool option_Oadaptive          = false;
 unsigned option_Oepilogue      = 0;
 unsigned option_Oepilogue_size = 64;
+bool option_Ohot_cold          = false;
 bool option_Oorder             = false;
 bool option_Opeephole          = true;
+bool option_Oredirect          = false;
 unsigned option_Oprologue      = 0;
 unsigned option_Oprologue_size = 64;
 bool option_Oscratch_stack     = false;
 intptr_t option_loader_base    = 0x20e9e9000;
 int option_loader_phdr         = -1;
+bool option_loader_fork_server = false;
+bool option_loader_lazy        = false;
 bool option_loader_static      = false;
 size_t option_mem_granularity  = 128;
 intptr_t option_mem_lb         = RELATIVE_ADDRESS_MIN;
 intptr_t option_mem_ub         = RELATIVE_ADDRESS_MAX;
 size_t option_mem_mapping_size = PAGE_SIZE;
 bool option_mem_multi_page     = true;
+bool option_mem_huge_pages     = false;
+size_t option_mem_align_entry  = 1;
+int option_mem_auto            = OPTION_MEM_AUTO_NONE;
+size_t option_mem_coalesce     = 0;
+size_t option_mem_pack_budget  = 0;
 intptr_t option_mem_rebase     = 0x0;
+bool option_pe_sections        = false;
+bool option_profile            = false;
+size_t option_profile_hot      = 1000;
+size_t option_reorder_window   = 0;
 std::set<intptr_t> option_trap;
+const char *option_layout_out  = nullptr;
+const char *option_sites_out   = nullptr;
 bool option_trap_all           = false;
 bool option_trap_entry         = false;
 static std::string option_input("-");
 static std::string option_output("-");
+static std::string option_server;
+static int option_rpc_ring     = -1;
 bool option_loader_base_set    = false;
 bool option_loader_phdr_set    = false;
 bool option_loader_static_set  = false;
 bool option_mem_rebase_set     = false;
+unsigned option_threads        = 1;
 bool option_log                = true;
 int option_log_color           = COLOR_NONE;
+bool option_rpc_binary         = false;
+const char *option_stats       = nullptr;
 
 /*
  * Global statistics.
@@ -90,12 +115,23 @@ size_t stat_num_T0 = 0;
 size_t stat_num_T1 = 0;
 size_t stat_num_T2 = 0;
 size_t stat_num_T3 = 0;
+size_t stat_num_hot           = 0;
+size_t stat_num_hot_untrapped = 0;
+size_t stat_num_minimal = 0;
+size_t stat_num_pointers = 0;
+size_t stat_num_redirected = 0;
+size_t stat_trap_cost         = 0;
+size_t stat_num_aligned       = 0;
+size_t stat_align_bytes       = 0;
+size_t stat_pack_saved_bytes  = 0;
 size_t stat_num_virtual_mappings  = 0;
 size_t stat_num_physical_mappings = 0;
+size_t stat_num_loader_mappings   = 0;
 size_t stat_num_virtual_bytes  = 0;
 size_t stat_num_physical_bytes = 0;
 size_t stat_input_file_size  = 0;
 size_t stat_output_file_size = 0;
+Stats stats;
 
 /*
  * Report an error and exit.
@@ -226,6 +262,83 @@ static bool parseBoolOptArg(const char *option, const char *optarg)
         "expected a Boolean [true, false]", option, optarg);
 }
 
+/*
+ * Execution frequency profile (--profile).  Maps the start address of each
+ * profiled block to its execution count.
+ */
+static std::map<intptr_t, size_t> profile;
+
+/*
+ * Load an execution frequency profile.  The profile is a CSV file with
+ * either two columns (address,count) or three columns (from,to,count), the
+ * latter being the format written by examples/cov.c.  For the three column
+ * format, the count is attributed to the "to" address.  A non-numeric
+ * header line is skipped.
+ */
+static void loadProfile(const char *filename)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        error("failed to open profile \"%s\" for reading: %s", filename,
+            strerror(errno));
+
+    char line[BUFSIZ];
+    for (size_t lineno = 1; fgets(line, sizeof(line), stream) != nullptr;
+            lineno++)
+    {
+        const char *fields[4];
+        unsigned num_fields = 0;
+        char *save = nullptr;
+        for (char *field = strtok_r(line, ",\r\n", &save); field != nullptr &&
+                num_fields < 4; field = strtok_r(nullptr, ",\r\n", &save))
+            fields[num_fields++] = field;
+        if (num_fields == 0 || fields[0][0] == '#')
+            continue;
+        if (lineno == 1 && !isdigit(fields[0][0]) && fields[0][0] != '(')
+            continue;       // Header
+        if (num_fields != 2 && num_fields != 3)
+            error("failed to parse profile \"%s\" at line %zu; expected "
+                "2 (address,count) or 3 (from,to,count) columns, found %u",
+                filename, lineno, num_fields);
+
+        const char *addr_str  = fields[num_fields - 2];
+        const char *count_str = fields[num_fields - 1];
+        char *end = nullptr;
+        errno = 0;
+        intptr_t addr = (intptr_t)strtoull(addr_str, &end, 0);
+        bool ok = (errno == 0 && end != addr_str && *end == '\0');
+        size_t count = (size_t)strtoull(count_str, &end, 10);
+        ok = ok && (errno == 0 && end != count_str && *end == '\0');
+        if (!ok)
+            error("failed to parse profile \"%s\" at line %zu; expected "
+                "an address and a count", filename, lineno);
+        profile[addr] += count;
+    }
+    fclose(stream);
+    option_profile = true;
+}
+
+/*
+ * Get the profiled execution count of the given address.  This is the count
+ * of the nearest profiled address at or before the given address.
+ */
+size_t getProfileCount(intptr_t addr)
+{
+    auto i = profile.upper_bound(addr);
+    if (i == profile.begin())
+        return 0;
+    i--;
+    return i->second;
+}
+
+/*
+ * Return true if the given address is hot according to the profile.
+ */
+bool isProfileHot(intptr_t addr)
+{
+    return (option_profile && getProfileCount(addr) >= option_profile_hot);
+}
+
 /*
  * Usage.
  */
@@ -234,6 +347,16 @@ static void usage(FILE *stream, const char *progname)
     fprintf(stream, "usage: %s [OPTIONS]\n\n"
         "OPTIONS:\n"
         "\n"
+        "\t-Oadaptive[=false]\n"
+        "\t\tEnables [disables] per-site trampoline prologue/epilogue\n"
+        "\t\tselection.  Sites are first patched with the full -Oprologue\n"
+        "\t\tand -Oepilogue windows, which are only used if they eliminate\n"
+        "\t\ta jump.  If tactics B1/B2/T1 fail, the site is retried with\n"
+        "\t\ta minimal window (smaller trampoline) before falling back to\n"
+        "\t\tthe more expensive tactics.  Tactic B0 always uses the minimal\n"
+        "\t\twindow, since the trap cost dominates.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t-OCFR[=false]\n"
         "\t\tEnables [disables] heuristic-based \"Control-Flow Recovery\"\n"
         "\t\t(CRF) analysis and related optimizations.  This usually makes\n"
@@ -255,6 +378,13 @@ static void usage(FILE *stream, const char *progname)
         "\t\tAdditionally limits -Oepilogue to N instruction bytes.\n"
         "\t\tDefault: 64\n"
         "\n"
+        "\t-Ohot-cold[=false]\n"
+        "\t\tEnables [disables] the clustering of trampolines for hot\n"
+        "\t\tinstructions into a small number of contiguous pages, separate\n"
+        "\t\tfrom the trampolines for cold instructions.  This may reduce\n"
+        "\t\tiTLB and i-cache pressure.  Requires --profile.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t-Oorder[=false]\n"
         "\t\tEnables [disables] the ordering of trampolines with respect\n"
         "\t\tto the original instruction ordering (as much as is possible).\n"
@@ -274,6 +404,17 @@ static void usage(FILE *stream, const char *progname)
         "\t\tAdditionally limits -Oprologue to N instruction bytes.\n"
         "\t\tDefault: 64\n"
         "\n"
+        "\t-Oredirect[=false]\n"
+        "\t\tEnables [disables] the redirection of code pointers (i.e.,\n"
+        "\t\tR_X86_64_RELATIVE or DT_RELR relocations) that point to\n"
+        "\t\tpatched instructions so that they point directly to the\n"
+        "\t\ttrampoline, saving a jump per indirect call/jump.  Pointers\n"
+        "\t\tare only redirected if the target address is never\n"
+        "\t\tmaterialized by code, is not an exported symbol, and no\n"
+        "\t\tpointer to the same target is skipped (e.g., as part of the\n"
+        "\t\t(pre)init/fini arrays).  Requires a PIC binary and -OCFR.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t-Oscratch-stack[=false]\n"
         "\t\tAllow the stack to be used as scratch space.  This allows\n"
         "\t\tfaster code to be emitted, but may break transparency.\n"
@@ -296,11 +437,78 @@ static void usage(FILE *stream, const char *progname)
         "\t--output FILE, -o FILE\n"
         "\t\tWrite output to FILE instead of stdout.\n"
         "\n"
+        "\t--rpc=MODE\n"
+        "\t\tSet the RPC input encoding to MODE, which is one of {json,\n"
+        "\t\tbinary}.  The \"binary\" mode additionally accepts compact\n"
+        "\t\tlength-prefixed \"instruction\" and \"patch\" records\n"
+        "\t\tinterleaved with JSON-RPC messages.  This is intended for\n"
+        "\t\tE9Tool and other frontends that negotiate it explicitly.\n"
+        "\t\tDefault: json\n"
+        "\n"
+        "\t--rpc-ring=FD\n"
+        "\t\tRead the input from the shared-memory ring stored in the\n"
+        "\t\t(inherited) memfd FD rather than from stdin.  The ring is a\n"
+        "\t\tsingle-producer/single-consumer byte stream, so works with\n"
+        "\t\tboth RPC encodings, and avoids most of the system calls and\n"
+        "\t\tcontext switches of the pipe transport.  Here stdin is only\n"
+        "\t\tused to detect if the frontend has died.  This is intended\n"
+        "\t\tfor E9Tool (see E9Tool's `--rpc-transport' option).\n"
+        "\n"
+        "\t--server=SOCKET\n"
+        "\t\tRun as a server that accepts sessions over the UNIX domain\n"
+        "\t\tsocket SOCKET.  Each session is a message stream that starts\n"
+        "\t\twith a \"binary\" message, and the session output is written\n"
+        "\t\tback over the connection.  The parsed binary is cached\n"
+        "\t\tbetween sessions with the same \"binary\" message, meaning\n"
+        "\t\tthat the parsing cost is only paid once.  Each session runs\n"
+        "\t\tin a forked process, so patch state and \"options\"\n"
+        "\t\tmessages do not persist between sessions.  File names are\n"
+        "\t\trelative to the server's working directory.\n"
+        "\n"
+        "\t--layout-in=FILE\n"
+        "\t\tReuse the trampoline layout of a previous session, as\n"
+        "\t\twritten by --layout-out.  Trampolines are kept at their\n"
+        "\t\tprevious location where possible, and trampolines for new\n"
+        "\t\tinstructions are allocated above the previous layout.  This\n"
+        "\t\tkeeps the rewritten binary stable when the set of patched\n"
+        "\t\tinstructions changes by only a few sites.\n"
+        "\n"
+        "\t--layout-out=FILE\n"
+        "\t\tWrite the trampoline layout to FILE for use with a later\n"
+        "\t\t--layout-in.\n"
+        "\n"
         "\t--loader-base=ADDR\n"
         "\t\tSet ADDR to be the base address of the program loader.\n"
         "\t\tOnly relevant for ELF binaries.\n"
         "\t\tDefault: 0x20e9e9000\n"
         "\n"
+        "\t--loader-fork-server[=false]\n"
+        "\t\tEnable [disable] an AFL-style fork-server in the loader.  If\n"
+        "\t\tthe fuzzer's control pipe (fd 198/199) is open, the loader\n"
+        "\t\tforks the fully initialized program (mappings loaded and init\n"
+        "\t\tfunctions called) once per run, avoiding the cost of exec()\n"
+        "\t\tand program loading.  Stopped (SIGSTOP) children are resumed\n"
+        "\t\tinstead, which implements persistent mode (see\n"
+        "\t\texamples/persistent.c).  Without a fuzzer, the program runs\n"
+        "\t\tnormally.\n"
+        "\t\tOnly relevant for ELF executables.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
+        "\t--loader-lazy[=false]\n"
+        "\t\tEnable [disable] the lazy loading of trampoline pages.  By\n"
+        "\t\tdefault, all trampoline pages are mapped during program\n"
+        "\t\tinitialization.  Lazy loading instead reserves the pages\n"
+        "\t\t(PROT_NONE), and maps each trampoline mapping on first\n"
+        "\t\taccess from a SIGSEGV handler.  This can reduce the start-up\n"
+        "\t\ttime of short-lived programs that execute few trampolines.\n"
+        "\t\tLazy loading is unsuitable for programs that install their\n"
+        "\t\town SIGSEGV handler (e.g., Go or Java runtimes), or pass\n"
+        "\t\ttrampoline memory to system calls.  To keep the lazy\n"
+        "\t\thandler in place, the patched program's attempts to install\n"
+        "\t\ta SIGSEGV handler fail with ENOSYS.\n"
+        "\t\tOnly relevant for ELF binaries.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t--loader-phdr=PHDR\n"
         "\t\tOverwrite the corresponding PHDR to load the loader.  Valid\n"
         "\t\tvalues are \"note\", \"relro\", and \"stack\" for PT_NOTE, "
@@ -324,6 +532,39 @@ static void usage(FILE *stream, const char *progname)
         "\t\tEnable [disable] log output.\n"
         "\t\tDefault: true (enabled)\n"
         "\n"
+        "\t--mem-align-entry=N\n"
+        "\t\tAlign trampoline entries to N bytes, where N is a power-of-two\n"
+        "\t\tof at most 64.  This avoids trampolines straddling decoded\n"
+        "\t\ticache (uop cache) block boundaries.  Alignment is only applied\n"
+        "\t\tto trampolines of at most N bytes and, if a --profile is\n"
+        "\t\tgiven, to hot instructions.  The (virtual) memory cost is\n"
+        "\t\treported in the statistics.\n"
+        "\t\tDefault: 1 (disabled)\n"
+        "\n"
+        "\t--mem-auto=OBJECTIVE\n"
+        "\t\tAutomatically select the --mem-granularity and\n"
+        "\t\t--mem-mapping-size that minimize OBJECTIVE, which must be\n"
+        "\t\tone of {size,maps,mix,none}.  Here, \"size\" is the output\n"
+        "\t\tbinary file size, \"maps\" is the number of loader mappings\n"
+        "\t\t(considering only candidates at most 4 times larger than the\n"
+        "\t\tsmallest, and breaking ties by size), and \"mix\" weights\n"
+        "\t\teach mapping as one page of file size.\n"
+        "\t\tEach candidate pair is evaluated (in parallel, see\n"
+        "\t\t--threads) after patching, and only the best is emitted.\n"
+        "\t\tThe --mem-mapping-size is treated as a lower bound.\n"
+        "\t\tDefault: none (disabled)\n"
+        "\n"
+        "\t--mem-coalesce=N\n"
+        "\t\tCoalesce runs of trampoline mappings separated by less than\n"
+        "\t\tN unused pages into a single mapping, which is loaded using\n"
+        "\t\ta single mmap() call.  Coalesced mappings are not grouped\n"
+        "\t\twith other mappings (see --mem-granularity), and the gaps\n"
+        "\t\tare filled, meaning that this trades output binary file size\n"
+        "\t\tfor fewer loader mappings (num_loader_mappings).  The file\n"
+        "\t\tsize cost can be significant for densely patched binaries.\n"
+        "\t\tA value of 0 disables coalescing.\n"
+        "\t\tDefault: 0 (disabled)\n"
+        "\n"
         "\t--mem-granularity=SIZE\n"
         "\t\tSet SIZE to be the granularity used for the physical page\n"
         "\t\tgrouping memory optimization.  Higher values result in\n"
@@ -332,6 +573,16 @@ static void usage(FILE *stream, const char *progname)
         "\t\tmust be one of {128,4096}.\n"
         "\t\tDefault: 128\n"
         "\n"
+        "\t--mem-huge-pages[=false]\n"
+        "\t\tEnable [disable] huge page backed trampoline mappings.  This\n"
+        "\t\tgroups densely used (more than half occupied) 2MB regions of\n"
+        "\t\ttrampolines into single mappings, which the loader maps with\n"
+        "\t\ta transparent huge page hint (MADV_HUGEPAGE).  Other regions\n"
+        "\t\tuse normal mappings.  This can reduce iTLB misses, but also\n"
+        "\t\tincreases the output binary file size.\n"
+        "\t\tOnly relevant for ELF binaries.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t--mem-lb=LB\n"
         "\t\tSet LB to be the minimum allowable trampoline address.\n"
         "\n"
@@ -349,6 +600,14 @@ static void usage(FILE *stream, const char *progname)
         "\t\tEnable [disable] trampolines that cross page boundaries.\n"
         "\t\tDefault: true (enabled)\n"
         "\n"
+        "\t--mem-pack-budget=MS\n"
+        "\t\tSpend up to MS milliseconds (CPU time) searching for a\n"
+        "\t\tbetter packing of virtual mappings into physical mappings.\n"
+        "\t\tThe better packing is only used if it results in a smaller\n"
+        "\t\toutput binary, otherwise the default greedy packing is used.\n"
+        "\t\tA value of 0 disables the search.\n"
+        "\t\tDefault: 0 (disabled)\n"
+        "\n"
         "\t--mem-rebase[=ADDR]\n"
         "\t\tRebase the binary to the absolute address ADDR.  Only\n"
         "\t\trelevant for Windows PE binaries.  The special values \"auto\"\n"
@@ -357,6 +616,57 @@ static void usage(FILE *stream, const char *progname)
         "\t\toriginal base intact.\n"
         "\t\tDefault: none (disabled)\n"
         "\n"
+        "\t--pe-sections[=false]\n"
+        "\t\tEnable [disable] the emission of trampolines as PE sections.\n"
+        "\t\tTrampolines directly above the image are emitted as PE\n"
+        "\t\tsections, which are mapped by the Windows image loader\n"
+        "\t\tinstead of the E9Patch loader.  The number of sections is\n"
+        "\t\tlimited by the free space in the PE headers.  The remaining\n"
+        "\t\ttrampolines are mapped by the E9Patch loader as usual.\n"
+        "\t\tOnly relevant for Windows PE binaries.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
+        "\t--profile=FILE\n"
+        "\t\tRead a per-address execution frequency profile from FILE.\n"
+        "\t\tFILE is a CSV file with either (address,count) or\n"
+        "\t\t(from,to,count) columns, such as the output of examples/cov.c.\n"
+        "\t\tHot instructions (see --profile-hot) receive twice the\n"
+        "\t\t-Oprologue space, and are never patched using tactic B0.\n"
+        "\t\tFor ELF binaries, the loader prefaults (MAP_POPULATE) the\n"
+        "\t\ttrampoline mappings of hot instructions.\n"
+        "\t\tThe expected trap cost (trap_cost) is also reported.\n"
+        "\n"
+        "\t--profile-hot=N\n"
+        "\t\tTreat instructions with an execution count of at least N\n"
+        "\t\tas hot.\n"
+        "\t\tDefault: 1000\n"
+        "\n"
+        "\t--reorder-window=N\n"
+        "\t\tAccept \"patch\" messages out-of-order, provided that each\n"
+        "\t\tpatch is less than N bytes above the lowest patch address\n"
+        "\t\tsent so far.  Patches are buffered and reordered, and are\n"
+        "\t\tstill applied in reverse address order.  This allows for\n"
+        "\t\tstreaming (e.g., multi-threaded) frontends.  A value of 0\n"
+        "\t\trequires strict reverse order.\n"
+        "\t\tDefault: 0 (disabled)\n"
+        "\n"
+        "\t--sites-out=FILE\n"
+        "\t\tWrite a per-site report to FILE.  This is a CSV file with one\n"
+        "\t\t(address,tactic,attempts,#victims,victims,size,page,mapping,\n"
+        "\t\ttrap) record per patched instruction, i.e., the tactic used\n"
+        "\t\t(or \"failed\"), the number of tactics tried, the\n"
+        "\t\tinstructions evicted by T2/T3, the trampoline size, the page\n"
+        "\t\tand mapping of the trampoline entry, and whether a B0 trap\n"
+        "\t\twas used.  The report can be used as E9Tool CSV match data.\n"
+        "\n"
+        "\t--stats=FILE\n"
+        "\t\tWrite per-phase timing & memory statistics to FILE in JSON\n"
+        "\t\tformat.  This includes the wall time, CPU time, and peak RSS\n"
+        "\t\tof each phase (parsing, tactics, mapping construction,\n"
+        "\t\tmapping optimization, and emission), and histograms of the\n"
+        "\t\ttactic attempts and received message sizes.\n"
+        "\t\tDefault: none (disabled)\n"
+        "\n"
         "\t--tactic-B0[=false]\n"
         "\t--tactic-B1[=false]\n"
         "\t--tactic-B2[=false]\n"
@@ -371,6 +681,13 @@ static void usage(FILE *stream, const char *progname)
         "\t\tEnable [disables] backward jumps for tactic T3.\n"
         "\t\tDefault: true (enabled)\n"
         "\n"
+        "\t--threads=N\n"
+        "\t\tUse N threads for the -OCFR target analysis, the mapping\n"
+        "\t\toccupancy calculation, the --mem-auto candidate evaluation,\n"
+        "\t\tand the mapping emission.  The result is identical to the\n"
+        "\t\tserial version.\n"
+        "\t\tDefault: 1\n"
+        "\n"
         "\t--trap=ADDR\n"
         "\t\tInsert a trap (int3) instruction at the trampoline entry for\n"
         "\t\tthe instruction at address ADDR.  This can be used to debug\n"
@@ -400,26 +717,47 @@ enum Option
     OPTION_DEBUG,
     OPTION_HELP,
     OPTION_INPUT,
+    OPTION_LAYOUT_IN,
+    OPTION_LAYOUT_OUT,
     OPTION_LOADER_BASE,
+    OPTION_LOADER_FORK_SERVER,
+    OPTION_LOADER_LAZY,
     OPTION_LOADER_PHDR,
     OPTION_LOADER_STATIC,
     OPTION_LOG,
+    OPTION_MEM_ALIGN_ENTRY,
+    OPTION_MEM_AUTO,
+    OPTION_MEM_COALESCE,
     OPTION_MEM_GRANULARITY,
+    OPTION_MEM_HUGE_PAGES,
     OPTION_MEM_LB,
     OPTION_MEM_MAPPING_SIZE,
     OPTION_MEM_MULTI_PAGE,
+    OPTION_MEM_PACK_BUDGET,
     OPTION_MEM_REBASE,
     OPTION_MEM_UB,
+    OPTION_OADAPTIVE,
     OPTION_OCFR,
     OPTION_OCFR_HACKS,
     OPTION_OEPILOGUE,
     OPTION_OEPILOGUE_SIZE,
+    OPTION_OHOT_COLD,
     OPTION_OORDER,
     OPTION_OPEEPHOLE,
     OPTION_OPROLOGUE,
     OPTION_OPROLOGUE_SIZE,
+    OPTION_OREDIRECT,
     OPTION_OSCRATCH_STACK,
     OPTION_OUTPUT,
+    OPTION_PE_SECTIONS,
+    OPTION_PROFILE,
+    OPTION_PROFILE_HOT,
+    OPTION_REORDER_WINDOW,
+    OPTION_RPC,
+    OPTION_RPC_RING,
+    OPTION_SERVER,
+    OPTION_SITES_OUT,
+    OPTION_STATS,
     OPTION_TACTIC_B0,
     OPTION_TACTIC_B1,
     OPTION_TACTIC_B2,
@@ -428,6 +766,7 @@ enum Option
     OPTION_TACTIC_T2,
     OPTION_TACTIC_T3,
     OPTION_TACTIC_BACKWARD_T3,
+    OPTION_THREADS,
     OPTION_TRAP,
     OPTION_TRAP_ALL,
     OPTION_TRAP_ENTRY,
@@ -446,30 +785,51 @@ void parseOptions(char * const argv[], bool api)
               no_arg  = no_argument;
     static const struct option long_options[] =
     {
+        {"Oadaptive",          opt_arg, nullptr, OPTION_OADAPTIVE},
         {"OCFR",               opt_arg, nullptr, OPTION_OCFR},
         {"OCFR-hacks",         opt_arg, nullptr, OPTION_OCFR_HACKS},
         {"Oepilogue",          req_arg, nullptr, OPTION_OEPILOGUE},
         {"Oepilogue-size",     req_arg, nullptr, OPTION_OEPILOGUE_SIZE},
+        {"Ohot-cold",          opt_arg, nullptr, OPTION_OHOT_COLD},
         {"Oorder",             opt_arg, nullptr, OPTION_OORDER},
         {"Opeephole",          opt_arg, nullptr, OPTION_OPEEPHOLE},
         {"Oprologue",          req_arg, nullptr, OPTION_OPROLOGUE},
         {"Oprologue-size",     req_arg, nullptr, OPTION_OPROLOGUE_SIZE},
+        {"Oredirect",          opt_arg, nullptr, OPTION_OREDIRECT},
         {"Oscratch-stack",     opt_arg, nullptr, OPTION_OSCRATCH_STACK},
         {"batch",              opt_arg, nullptr, OPTION_BATCH},
         {"debug",              opt_arg, nullptr, OPTION_DEBUG},
         {"help",               no_arg,  nullptr, OPTION_HELP},
         {"input",              req_arg, nullptr, OPTION_INPUT},
+        {"layout-in",          req_arg, nullptr, OPTION_LAYOUT_IN},
+        {"layout-out",         req_arg, nullptr, OPTION_LAYOUT_OUT},
         {"loader-base",        req_arg, nullptr, OPTION_LOADER_BASE},
+        {"loader-fork-server", opt_arg, nullptr, OPTION_LOADER_FORK_SERVER},
+        {"loader-lazy",        opt_arg, nullptr, OPTION_LOADER_LAZY},
         {"loader-phdr",        req_arg, nullptr, OPTION_LOADER_PHDR},
         {"loader-static",      opt_arg, nullptr, OPTION_LOADER_STATIC},
         {"log",                opt_arg, nullptr, OPTION_LOG},
+        {"mem-align-entry",    req_arg, nullptr, OPTION_MEM_ALIGN_ENTRY},
+        {"mem-auto",           req_arg, nullptr, OPTION_MEM_AUTO},
+        {"mem-coalesce",       req_arg, nullptr, OPTION_MEM_COALESCE},
         {"mem-granularity",    req_arg, nullptr, OPTION_MEM_GRANULARITY},
+        {"mem-huge-pages",     opt_arg, nullptr, OPTION_MEM_HUGE_PAGES},
         {"mem-lb",             req_arg, nullptr, OPTION_MEM_LB},
         {"mem-mapping-size",   req_arg, nullptr, OPTION_MEM_MAPPING_SIZE},
         {"mem-multi-page",     opt_arg, nullptr, OPTION_MEM_MULTI_PAGE},
+        {"mem-pack-budget",    req_arg, nullptr, OPTION_MEM_PACK_BUDGET},
         {"mem-rebase",         req_arg, nullptr, OPTION_MEM_REBASE},
         {"mem-ub",             req_arg, nullptr, OPTION_MEM_UB},
         {"output",             req_arg, nullptr, OPTION_OUTPUT},
+        {"pe-sections",        opt_arg, nullptr, OPTION_PE_SECTIONS},
+        {"profile",            req_arg, nullptr, OPTION_PROFILE},
+        {"profile-hot",        req_arg, nullptr, OPTION_PROFILE_HOT},
+        {"reorder-window",     req_arg, nullptr, OPTION_REORDER_WINDOW},
+        {"rpc",                req_arg, nullptr, OPTION_RPC},
+        {"rpc-ring",           req_arg, nullptr, OPTION_RPC_RING},
+        {"server",             req_arg, nullptr, OPTION_SERVER},
+        {"sites-out",          req_arg, nullptr, OPTION_SITES_OUT},
+        {"stats",              req_arg, nullptr, OPTION_STATS},
         {"tactic-B0",          opt_arg, nullptr, OPTION_TACTIC_B0},
         {"tactic-B1",          opt_arg, nullptr, OPTION_TACTIC_B1},
         {"tactic-B2",          opt_arg, nullptr, OPTION_TACTIC_B2},
@@ -478,6 +838,7 @@ void parseOptions(char * const argv[], bool api)
         {"tactic-T2",          opt_arg, nullptr, OPTION_TACTIC_T2},
         {"tactic-T3",          opt_arg, nullptr, OPTION_TACTIC_T3},
         {"tactic-backward-T3", opt_arg, nullptr, OPTION_TACTIC_BACKWARD_T3},
+        {"threads",            req_arg, nullptr, OPTION_THREADS},
         {"trap",               req_arg, nullptr, OPTION_TRAP},
         {"trap-all",           opt_arg, nullptr, OPTION_TRAP_ALL},
         {"trap-entry",         opt_arg, nullptr, OPTION_TRAP_ENTRY},
@@ -495,7 +856,8 @@ void parseOptions(char * const argv[], bool api)
         switch (opt)
         {
             case OPTION_HELP: case OPTION_INPUT: case OPTION_OUTPUT:
-            case 'h': case 'i': case 'o':
+            case OPTION_RPC: case OPTION_RPC_RING: case OPTION_SERVER:
+            case OPTION_STATS: case 'h': case 'i': case 'o':
                 if (api)
                     error("option `%s' cannot be invoked via the JSON-RPC API",
                         argv[optind-1]);
@@ -519,6 +881,15 @@ void parseOptions(char * const argv[], bool api)
             case OPTION_INPUT:
                 option_input = optarg;
                 break;
+            case OPTION_LAYOUT_IN:
+                loadLayout(optarg);
+                break;
+            case OPTION_LAYOUT_OUT:
+                option_layout_out = optarg;
+                break;
+            case OPTION_OADAPTIVE:
+                option_Oadaptive = parseBoolOptArg("-Oadaptive", optarg);
+                break;
             case OPTION_OCFR:
                 option_OCFR = parseBoolOptArg("-OCFR", optarg);
                 break;
@@ -534,6 +905,9 @@ void parseOptions(char * const argv[], bool api)
                     (unsigned)parseIntOptArg("-Oepilogue-size", optarg, 0,
                         512);
                 break;
+            case OPTION_OHOT_COLD:
+                option_Ohot_cold = parseBoolOptArg("-Ohot-cold", optarg);
+                break;
             case OPTION_OORDER:
                 option_Oorder = parseBoolOptArg("-Oorder", optarg);
                 break;
@@ -549,6 +923,9 @@ void parseOptions(char * const argv[], bool api)
                     (unsigned)parseIntOptArg("-Oprologue-size", optarg, 0,
                         512);
                 break;
+            case OPTION_OREDIRECT:
+                option_Oredirect = parseBoolOptArg("-Oredirect", optarg);
+                break;
             case OPTION_OSCRATCH_STACK:
                 option_Oscratch_stack =
                     parseBoolOptArg("-Oscratch-stack", optarg);
@@ -557,6 +934,45 @@ void parseOptions(char * const argv[], bool api)
             case OPTION_OUTPUT:
                 option_output = optarg;
                 break;
+            case OPTION_PE_SECTIONS:
+                option_pe_sections =
+                    parseBoolOptArg("--pe-sections", optarg);
+                break;
+            case OPTION_PROFILE:
+                loadProfile(optarg);
+                break;
+            case OPTION_PROFILE_HOT:
+                option_profile_hot = (size_t)parseIntOptArg("--profile-hot",
+                    optarg, 1, INTPTR_MAX);
+                break;
+            case OPTION_REORDER_WINDOW:
+                option_reorder_window = (size_t)parseIntOptArg(
+                    "--reorder-window", optarg, 0, INTPTR_MAX);
+                break;
+            case OPTION_RPC:
+                if (strcmp(optarg, "json") == 0)
+                    option_rpc_binary = false;
+                else if (strcmp(optarg, "binary") == 0)
+                    option_rpc_binary = true;
+                else
+                    error("failed to parse argument \"%s\" for the "
+                        "`--rpc' option; argument must be one of "
+                        "{json,binary}", optarg);
+                break;
+            case OPTION_RPC_RING:
+                option_rpc_ring = (int)parseIntOptArg("--rpc-ring", optarg,
+                    0, INT32_MAX);
+                break;
+            case OPTION_SERVER:
+                option_server = optarg;
+                break;
+            case OPTION_SITES_OUT:
+                option_sites_out = optarg;
+                break;
+            case OPTION_STATS:
+                option_stats = optarg;
+                stats.enable();
+                break;
             case OPTION_TACTIC_B0:
                 option_tactic_B0 =
                     parseBoolOptArg("--tactic-B0", optarg);
@@ -589,6 +1005,10 @@ void parseOptions(char * const argv[], bool api)
                 option_tactic_backward_T3 =
                     parseBoolOptArg("--tactic-backward-T3", optarg);
                 break;
+            case OPTION_THREADS:
+                option_threads = (unsigned)parseIntOptArg("--threads",
+                    optarg, 1, 1024);
+                break;
             case OPTION_TRAP:
                 option_trap.insert(parseIntOptArg("--trap", optarg, 0,
                     INTPTR_MAX, /*hex=*/true));
@@ -609,6 +1029,14 @@ void parseOptions(char * const argv[], bool api)
                         "must be a multiple of the page size (%d)", optarg,
                         PAGE_SIZE);
                 break;
+            case OPTION_LOADER_FORK_SERVER:
+                option_loader_fork_server =
+                    parseBoolOptArg("--loader-fork-server", optarg);
+                break;
+            case OPTION_LOADER_LAZY:
+                option_loader_lazy =
+                    parseBoolOptArg("--loader-lazy", optarg);
+                break;
             case OPTION_LOADER_PHDR:
                 option_loader_phdr_set = true;
                 if (strcmp(optarg, "any") == 0)
@@ -632,6 +1060,33 @@ void parseOptions(char * const argv[], bool api)
             case OPTION_LOG:
                 option_log = parseBoolOptArg("--log", optarg);
                 break;
+            case OPTION_MEM_ALIGN_ENTRY:
+                option_mem_align_entry = parseIntOptArg("--mem-align-entry",
+                    optarg, 1, 64);
+                if ((option_mem_align_entry & (option_mem_align_entry - 1))
+                        != 0)
+                    error("failed to parse argument \"%s\" for the "
+                        "`--mem-align-entry' option; alignment must be a "
+                        "power-of-two", optarg);
+                break;
+            case OPTION_MEM_AUTO:
+                if (strcmp(optarg, "size") == 0)
+                    option_mem_auto = OPTION_MEM_AUTO_SIZE;
+                else if (strcmp(optarg, "maps") == 0)
+                    option_mem_auto = OPTION_MEM_AUTO_MAPS;
+                else if (strcmp(optarg, "mix") == 0)
+                    option_mem_auto = OPTION_MEM_AUTO_MIX;
+                else if (strcmp(optarg, "none") == 0)
+                    option_mem_auto = OPTION_MEM_AUTO_NONE;
+                else
+                    error("failed to parse argument \"%s\" for the "
+                        "`--mem-auto' option; argument must be one of "
+                        "{size,maps,mix,none}", optarg);
+                break;
+            case OPTION_MEM_COALESCE:
+                option_mem_coalesce = parseIntOptArg("--mem-coalesce",
+                    optarg, 0, 1024);
+                break;
             case OPTION_MEM_GRANULARITY:
                 option_mem_granularity = parseIntOptArg("--mem-granularity",
                     optarg, INTPTR_MIN, INTPTR_MAX);
@@ -645,6 +1100,10 @@ void parseOptions(char * const argv[], bool api)
                             "must be one of {128,4096}", optarg);
                 }
                 break;
+            case OPTION_MEM_HUGE_PAGES:
+                option_mem_huge_pages =
+                    parseBoolOptArg("--mem-huge-pages", optarg);
+                break;
             case OPTION_MEM_LB:
                 option_mem_lb = parseIntOptArg("--mem-lb", optarg,
                     RELATIVE_ADDRESS_MIN, RELATIVE_ADDRESS_MAX, /*hex=*/true);
@@ -671,6 +1130,10 @@ void parseOptions(char * const argv[], bool api)
                 option_mem_multi_page =
                     parseBoolOptArg("--mem-multi-page", optarg);
                 break;
+            case OPTION_MEM_PACK_BUDGET:
+                option_mem_pack_budget = parseIntOptArg("--mem-pack-budget",
+                    optarg, 0, 3600000);
+                break;
             case OPTION_MEM_REBASE:
                 option_mem_rebase_set = true;
                 if (strcmp(optarg, "auto") == 0)
@@ -709,6 +1172,16 @@ int realMain(int argc, char **argv)
     option_is_tty = (isatty(STDERR_FILENO) != 0);
     parseOptions(argv);
 
+    if (option_rpc_ring >= 0 && (option_server != "" || option_input != "-"))
+        error("failed to parse command-line options; the `--rpc-ring' "
+            "option cannot be combined with `--server' or `--input'");
+    if (option_server != "")
+    {
+        if (option_input != "-" || option_output != "-")
+            error("failed to parse command-line options; the `--server' "
+                "option cannot be combined with `--input' or `--output'");
+        serverMain(option_server.c_str());
+    }
     if (option_input != "-")
     {
         FILE *input = freopen(option_input.c_str(), "r", stdin);
@@ -723,18 +1196,45 @@ int realMain(int argc, char **argv)
             error("failed to open file \"%s\" for writing: %s",
                 option_output.c_str(), strerror(errno));
     }
+    if (option_rpc_ring >= 0)
+    {
+        static Ring ring;
+        if (!ringOpen(ring, option_rpc_ring))
+            error("failed to open RPC ring (fd=%d): %s", option_rpc_ring,
+                strerror(errno));
+        ring.peer = STDIN_FILENO;
+        sessionMain(nullptr, stdin, 1, &ring);
+    }
     if (isatty(STDIN_FILENO))
         warning("reading JSON-RPC from a terminal (this is probably not "
             "what you want, please use E9Tool instead!)");
     
-    Binary *B = nullptr;
+    sessionMain(nullptr, stdin, 1);
+}
+
+/*
+ * Parse the message stream (`input' or `ring') for binary `B' (or nullptr),
+ * then print the statistics and exit.
+ */
+void NO_RETURN sessionMain(Binary *B, FILE *input, size_t lineno,
+    Ring *ring)
+{
     Message msg;
-    size_t lineno = 1;
-    while (getMessage(stdin, lineno, msg))
+    while (true)
     {
+        StatsTimer parse_timer(stats, "parse");
+        if (!(ring != nullptr? getMessage(ring, lineno, msg):
+                getMessage(input, lineno, msg)))
+            break;
+        parse_timer.stop();
+        StatsTimer process_timer(stats, "process");
         B = parseMessage(B, msg);
         lineno = msg.lineno;
     }
+    if (option_stats != nullptr &&
+            !stats.dump(option_stats, "e9patch"))
+        warning("failed to write statistics to \"%s\": %s", option_stats,
+            strerror(errno));
     if (B == nullptr)
         exit(EXIT_SUCCESS);
 
@@ -812,6 +1312,23 @@ int realMain(int argc, char **argv)
     printf("num_patched_T3        = %zu / %zu (%.2f%%)\n",
         stat_num_T3, stat_num_total,
         (double)stat_num_T3 / (double)stat_num_total * 100.0);
+    if (option_Oredirect && stat_num_pointers > 0)
+        printf("num_redirected        = %zu / %zu (%.2f%%)\n",
+            stat_num_redirected, stat_num_pointers,
+            (double)stat_num_redirected / (double)stat_num_pointers * 100.0);
+    if (option_Oadaptive)
+        printf("num_minimal_window    = %zu / %zu (%.2f%%)\n",
+            stat_num_minimal, stat_num_total,
+            (double)stat_num_minimal / (double)stat_num_total * 100.0);
+    if (option_profile)
+    {
+        printf("num_hot               = %zu / %zu (%.2f%%)\n",
+            stat_num_hot, stat_num_total,
+            (double)stat_num_hot / (double)stat_num_total * 100.0);
+        if (option_tactic_B0)
+            printf("num_hot_untrapped     = %zu\n", stat_num_hot_untrapped);
+        printf("trap_cost             = %zu\n", stat_trap_cost);
+    }
     printf("num_virtual_mappings  = %s%zu%s\n",
         (option_is_tty &&
             (ssize_t)stat_num_virtual_mappings >=
@@ -826,10 +1343,24 @@ int realMain(int argc, char **argv)
         stat_num_physical_mappings,
         (double)stat_num_physical_mappings /
             (double)stat_num_virtual_mappings * 100.0);
+    if (stat_num_loader_mappings > 0)
+        printf("num_loader_mappings   = %zu\n", stat_num_loader_mappings);
     printf("num_virtual_bytes     = %zu\n", stat_num_virtual_bytes);
     printf("num_physical_bytes    = %zu (%.2f%%)\n", stat_num_physical_bytes,
         (double)stat_num_physical_bytes /
             (double)stat_num_virtual_bytes * 100.0);
+    if (option_mem_align_entry > 1)
+    {
+        printf("num_aligned_entries   = %zu\n", stat_num_aligned);
+        printf("align_virtual_bytes   = %zu (%.2f%%)\n", stat_align_bytes,
+            (double)stat_align_bytes / (double)stat_num_virtual_bytes * 100.0);
+        printf("align_physical_bytes  = ~%zu\n",
+            (size_t)((double)stat_align_bytes *
+                (double)stat_num_physical_bytes /
+                (double)stat_num_virtual_bytes));
+    }
+    if (option_mem_pack_budget > 0)
+        printf("pack_saved_bytes      = %zu\n", stat_pack_saved_bytes);
     printf("input_file_size       = %zu\n", stat_input_file_size);
     printf("output_file_size      = %zu (%.2f%%)\n",
         stat_output_file_size,
@@ -850,7 +1381,15 @@ int realMain(int argc, char **argv)
                     "exceeds": "may exceed"),
                 MAX_MAPPINGS, stat_num_virtual_mappings + 1000,
                 option_mem_mapping_size);
-    if (stat_num_B0 > 0)
+    if (stat_num_hot_untrapped > 0)
+        warning("%zu hot instruction(s) were not patched since tactic B0 "
+            "was avoided; see the `--profile-hot' option",
+            stat_num_hot_untrapped);
+    if (stat_num_B0 > 0 && option_profile)
+        warning("tactic B0 was used; the output binary (%s) is expected to "
+            "execute %zu trap(s) according to the profile", B->output,
+            stat_trap_cost);
+    else if (stat_num_B0 > 0)
         warning("tactic B0 was used; the output binary (%s) may be very slow!",
             B->output);
 
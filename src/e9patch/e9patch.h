@@ -33,10 +33,13 @@
 #include <set>
 #include <vector>
 
+#include "e9stats.h"
+
 #define NO_RETURN               __attribute__((__noreturn__))
 #define NO_INLINE               __attribute__((__noinline__))
 
 #define PAGE_SIZE               ((size_t)4096)
+#define HUGE_PAGE_SIZE          ((size_t)0x200000)
 
 #define STRING(s)               STRING_2(s)
 #define STRING_2(s)             #s
@@ -214,11 +217,14 @@ struct Entry
 /*
  * A trampoline template.
  */
+struct TrampolineShape;
 struct Trampoline
 {
-    int prot:31;                        // Protections.
+    int prot:30;                        // Protections.
     int preload:1;                      // Pre-load trampoline?
+    int hot:1;                          // Hot trampoline?
     unsigned num_entries;               // Number of entries.
+    mutable TrampolineShape *shape;     // Memoized size info (or nullptr).
     Entry entries[];                    // Entries.
 };
 
@@ -312,6 +318,7 @@ struct Instr
     const uint8_t *getOrig() const;
     uint8_t *getPatch() const;
     uint8_t *getState() const;
+    uint8_t peekState(size_t i) const;
 };
 
 /*
@@ -328,15 +335,21 @@ struct Alloc
         uint8_t *bytes;         // Flattened bytes.
     };
     unsigned entry;             // Entry offset.
+    uint16_t pad;               // Entry alignment padding.
+    uint16_t slack;             // Entry alignment slack (>= pad).
 };
 
 /*
- * Interval tree.
+ * Interval tree (or B+-tree if built with E9ALLOC_BTREE).
  */
 struct Node;
+struct BNode;
+struct FailMemo;
 struct Tree
 {
     Node *root;                 // Interval tree root
+    BNode *index;               // B+-tree root
+    Node *head;                 // B+-tree first allocation
 };
 
 /*
@@ -345,6 +358,10 @@ struct Tree
 struct Allocator
 {
     Tree tree;                  // Interval tree
+    Node *free = nullptr;       // Free-list of recycled nodes
+    Node *slab = nullptr;       // Current node slab
+    size_t slab_size = 0;       // Unused nodes in the current slab
+    FailMemo *memo = nullptr;   // Allocation failure memo
 
     /*
      * Iterators.
@@ -389,7 +406,9 @@ struct Allocator
 
     Allocator()
     {
-        tree.root = nullptr;
+        tree.root  = nullptr;
+        tree.index = nullptr;
+        tree.head  = nullptr;
     }
 };
 
@@ -473,6 +492,7 @@ struct EntryPoint
     intptr_t entry;                     // Trampoline entry address.
     bool target8;                       // Is 8bit relative jump target?
     bool target32;                      // Is 32bit relative jump target?
+    bool minimal;                       // No prologue (-Oadaptive)?
 };
 typedef std::map<intptr_t, EntryPoint> EntrySet;
 
@@ -511,7 +531,7 @@ struct InstrSet
     }
     Instr *find(off_t offset) const;
     Instr *lower_bound(off_t offset) const;
-    void *alloc();
+    void *alloc(size_t n = 1);
     size_t size() const
     {
         return (lb - ub);
@@ -526,6 +546,13 @@ typedef std::map<const char *, Trampoline *, CStrCmp> TrampolineSet;
 typedef std::vector<intptr_t> FuncSet;
 typedef std::vector<JumpInfo> JumpSet;
 typedef std::vector<const Alloc *> TrapSet;
+struct ZeroInfo
+{
+    intptr_t addr;                      // Address.
+    size_t size;                        // Size.
+    int prot;                           // Protection.
+};
+typedef std::vector<ZeroInfo> ZeroSet;
 struct Binary
 {
     const char *filename;               // The binary's path.
@@ -549,11 +576,13 @@ struct Binary
     {
         uint8_t *bytes;                 // The patched binary bytes.
         uint8_t *state;                 // The patched binary state.
+        uint8_t *paged;                 // State page materialized?
         size_t size;                    // The patched binary size.
     } patched;
 
     intptr_t cursor;                    // Patching cursor.
     PatchQueue Q;                       // Instructions queued for patching.
+    std::map<intptr_t, PatchEntry> R;   // Patches awaiting reordering.
 
     InstrSet Is;                        // All (known) instructions.
     TrampolineSet Ts;                   // All current trampoline templates.
@@ -562,10 +591,14 @@ struct Binary
     TrapSet Traps;                      // All traps.
     Allocator allocator;                // Virtual address allocation.
     const uint8_t *targets = nullptr;   // All targets [optional].
+    bool targets_hacks = false;         // targets used -OCFR-hacks?
+    std::set<intptr_t> taken;           // Address-taken code offsets.
 
     FuncSet inits;                      // Initialization functions.
     FuncSet finis;                      // Finalization functions.
     intptr_t mmap = INTPTR_MIN;         // Mmap function.
+    size_t tls = 0;                     // Per-thread block size (or 0).
+    ZeroSet zeros;                      // Zero-filled mappings.
 };
 
 /*
@@ -580,10 +613,25 @@ inline uint8_t *Instr::getPatch() const
 {
     return B->patched.bytes + offset;
 }
+extern void materializeState(const Binary *B, size_t page);
 inline uint8_t *Instr::getState() const
 {
+    // The state is materialized lazily (per page) on first use, since
+    // most instructions are never touched by patching.  The next page is
+    // also materialized for accesses past the end of the instruction.
+    size_t page = offset / PAGE_SIZE;
+    if (!B->patched.paged[page] || !B->patched.paged[page+1])
+        materializeState(B, page);
     return B->patched.state + offset;
 }
+inline uint8_t Instr::peekState(size_t i) const
+{
+    // Like STATE[i] (for i < size), but without materializing the page:
+    assert(i < size);
+    size_t page = (offset + i) / PAGE_SIZE;
+    return (B->patched.paged[page]? B->patched.state[offset + i]:
+        STATE_INSTRUCTION);
+}
 #define ORIG        getOrig()
 #define PATCH       getPatch()
 #define STATE       getState()
@@ -598,6 +646,9 @@ extern bool option_OCFR;
 extern bool option_OCFR_hacks;
 extern unsigned option_Oepilogue;
 extern unsigned option_Oepilogue_size;
+extern bool option_Ohot_cold;
+extern bool option_Oadaptive;
+extern bool option_Oredirect;
 extern bool option_Oorder;
 extern bool option_Opeephole;
 extern unsigned option_Oprologue;
@@ -613,14 +664,27 @@ extern bool option_tactic_T3;
 extern bool option_tactic_backward_T3;
 extern intptr_t option_loader_base;
 extern int option_loader_phdr;
+extern bool option_loader_fork_server;
+extern bool option_loader_lazy;
 extern bool option_loader_static;
 extern std::set<intptr_t> option_trap;
+extern const char *option_layout_out;
+extern const char *option_sites_out;
 extern bool option_trap_all;
 extern bool option_trap_entry;
 extern size_t option_mem_granularity;
 extern size_t option_mem_mapping_size;
 extern bool option_mem_multi_page;
+extern bool option_mem_huge_pages;
+extern size_t option_mem_align_entry;
+extern int option_mem_auto;
+extern size_t option_mem_coalesce;
+extern size_t option_mem_pack_budget;
 extern intptr_t option_mem_rebase;
+extern bool option_pe_sections;
+extern bool option_profile;
+extern size_t option_profile_hot;
+extern size_t option_reorder_window;
 extern intptr_t option_mem_lb;
 extern intptr_t option_mem_ub;
 extern bool option_loader_base_set;
@@ -629,6 +693,17 @@ extern bool option_loader_static_set;
 extern bool option_mem_rebase_set;
 extern bool option_log;
 extern int option_log_color;
+extern bool option_rpc_binary;
+extern const char *option_stats;
+extern unsigned option_threads;
+
+/*
+ * Objectives for option_mem_auto.
+ */
+#define OPTION_MEM_AUTO_NONE    0
+#define OPTION_MEM_AUTO_SIZE    1
+#define OPTION_MEM_AUTO_MAPS    2
+#define OPTION_MEM_AUTO_MIX     3
 
 /*
  * Special values for option_mem_rebase.
@@ -660,14 +735,27 @@ extern size_t stat_num_T0;
 extern size_t stat_num_T1;
 extern size_t stat_num_T2;
 extern size_t stat_num_T3;
+extern size_t stat_num_hot;
+extern size_t stat_num_hot_untrapped;
+extern size_t stat_num_minimal;
+extern size_t stat_num_pointers;
+extern size_t stat_num_redirected;
+extern size_t stat_trap_cost;
+extern size_t stat_num_aligned;
+extern size_t stat_align_bytes;
+extern size_t stat_pack_saved_bytes;
 extern size_t stat_num_virtual_mappings;
 extern size_t stat_num_physical_mappings;
+extern size_t stat_num_loader_mappings;
 extern size_t stat_num_virtual_bytes;
 extern size_t stat_num_physical_bytes;
 extern size_t stat_input_file_size;
 extern size_t stat_output_file_size;
+extern Stats stats;
 
 extern void parseOptions(char * const argv[], bool api = false);
+extern size_t getProfileCount(intptr_t addr);
+extern bool isProfileHot(intptr_t addr);
 extern void NO_RETURN error(const char *msg, ...);
 extern void warning(const char *msg, ...);
 extern void debugImpl(const char *msg, ...);
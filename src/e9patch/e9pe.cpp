@@ -18,6 +18,10 @@
 
 #include <cstdint>
 
+#include <algorithm>
+#include <set>
+#include <vector>
+
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
@@ -120,6 +124,7 @@ typedef struct _IMAGE_BASE_RELOCATION
     uint16_t TypeOffset[];
 } IMAGE_BASE_RELOCATION, *PIMAGE_BASE_RELOCATION;
 
+#define IMAGE_SCN_CNT_CODE      0x00000020
 #define IMAGE_SCN_MEM_EXECUTE   0x20000000
 #define IMAGE_SCN_MEM_READ      0x40000000
 #define IMAGE_SCN_MEM_WRITE     0x80000000
@@ -277,6 +282,139 @@ static uint8_t *findPEData(const Binary *B, uint32_t addr)
     return nullptr;
 }
 
+/*
+ * A trampoline section (see --pe-sections).
+ */
+struct PESection
+{
+    intptr_t lb;                            // Section base (RVA).
+    intptr_t ub;                            // Section data end (RVA).
+    std::vector<std::pair<const Mapping *, const Mapping *>> members;
+                                            // (Virtual, physical) mappings.
+};
+
+/*
+ * Lay out the trampoline mappings directly above the image (and loader) as
+ * PE sections, so that they are mapped by the Windows image loader rather
+ * than by the E9Patch loader.  Sections must be contiguous, so the gap
+ * between sections is covered by the previous section's (zero-filled)
+ * VirtualSize, and the gaps within a section are filled.  The window is
+ * grown while the filled bytes do not exceed the trampoline bytes, and it
+ * must not contain reserved memory.  At most `max_sections' are used,
+ * splitting at the largest gaps.
+ */
+static void layoutPESections(const Binary *B, const MappingSet &mappings,
+    intptr_t lb, unsigned max_sections, std::vector<PESection> &sections,
+    std::set<const Mapping *> &sectioned)
+{
+    if (max_sections == 0)
+        return;
+    std::vector<std::pair<const Mapping *, const Mapping *>> candidates;
+    for (const auto *head: mappings)
+    {
+        for (const auto *mapping = head; mapping != nullptr;
+                mapping = mapping->merged)
+        {
+            if (!IS_ABSOLUTE(mapping->base) && mapping->base >= lb)
+                candidates.push_back({mapping, head});
+        }
+    }
+    if (candidates.size() == 0)
+        return;
+    std::sort(candidates.begin(), candidates.end(),
+        [](const std::pair<const Mapping *, const Mapping *> &a,
+           const std::pair<const Mapping *, const Mapping *> &b)
+        {
+            return (a.first->base < b.first->base);
+        });
+
+    // The window ends at the first reserved memory:
+    intptr_t reserved_lb = INTPTR_MAX;
+    for (auto i = B->allocator.begin(), iend = B->allocator.end();
+            i != iend; ++i)
+    {
+        const Alloc *a = *i;
+        if (a->ub <= lb || IS_ABSOLUTE(a->lb))
+            continue;
+        if (a->T == nullptr || a->bytes == nullptr)
+        {
+            reserved_lb = a->lb;
+            break;
+        }
+    }
+
+    // Grow the window:
+    int prot = candidates[0].first->prot;
+    std::multiset<size_t> gaps;
+    size_t used = 0, gaps_size = 0, n = 0;
+    for (; n < candidates.size(); n++)
+    {
+        const Mapping *mapping = candidates[n].first;
+        if (mapping->prot != prot ||
+                mapping->base + (intptr_t)mapping->size > reserved_lb)
+            break;
+        size_t gap = 0;
+        if (n > 0)
+        {
+            const Mapping *prev = candidates[n-1].first;
+            gap = (size_t)(mapping->base - (prev->base + prev->size));
+        }
+        gaps.insert(gap);
+        size_t breaks_size = 0;
+        auto j = gaps.rbegin();
+        for (unsigned k = 0; k + 1 < max_sections && j != gaps.rend();
+                k++, ++j)
+            breaks_size += *j;
+        size_t fill = gaps_size + gap - breaks_size;
+        if (fill > used + mapping->size)
+        {
+            gaps.erase(gaps.find(gap));
+            break;
+        }
+        used      += mapping->size;
+        gaps_size += gap;
+    }
+    if (n == 0)
+        return;
+
+    // Split at the largest gaps:
+    size_t min_break = SIZE_MAX;
+    unsigned num_breaks = 0;
+    {
+        auto j = gaps.rbegin();
+        for (unsigned k = 0; k + 1 < max_sections && j != gaps.rend();
+                k++, ++j)
+        {
+            if (*j == 0)
+                break;
+            min_break = *j;
+            num_breaks++;
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        const Mapping *mapping = candidates[i].first;
+        size_t gap = 0;
+        if (i > 0)
+        {
+            const Mapping *prev = candidates[i-1].first;
+            gap = (size_t)(mapping->base - (prev->base + prev->size));
+        }
+        if (i == 0 || (num_breaks > 0 && gap > 0 && gap >= min_break))
+        {
+            if (i > 0)
+                num_breaks--;
+            PESection section;
+            section.lb = mapping->base;
+            sections.push_back(section);
+        }
+        PESection &section = sections.back();
+        section.ub = mapping->base + (intptr_t)mapping->size;
+        section.members.push_back(candidates[i]);
+        sectioned.insert(mapping);
+    }
+}
+
 /*
  * Emit the (modified) PE executable.
  */
@@ -288,20 +426,50 @@ size_t emitPE(Binary *B, const MappingSet &mappings, size_t mapping_size)
     stat_input_file_size = size;
     size = ALIGN(size, mapping_align);
      
-    // Emit all mappings:
+    // Lay out trampoline sections (if enabled):
     PIMAGE_OPTIONAL_HEADER64 opt_hdr = B->pe.opt_hdr;
     uint32_t size_of_image = opt_hdr->SizeOfImage;
+    uint32_t section_align = opt_hdr->SectionAlignment;
+    uint32_t file_align = B->pe.opt_hdr->FileAlignment;
+    intptr_t sections_lb = (intptr_t)size_of_image +
+        16 * WINDOWS_VIRTUAL_ALLOC_SIZE;    // See parsePE()
+    sections_lb = ALIGN(sections_lb, WINDOWS_VIRTUAL_ALLOC_SIZE);
+    std::vector<PESection> sections;
+    std::set<const Mapping *> sectioned;
+    if (option_pe_sections && section_align <= WINDOWS_VIRTUAL_ALLOC_SIZE)
+    {
+        PIMAGE_FILE_HEADER file_hdr = B->pe.file_hdr;
+        PIMAGE_SECTION_HEADER shdr  = B->pe.shdr;
+        size_t hdr_end = opt_hdr->SizeOfHeaders;
+        for (uint16_t i = 0; i < file_hdr->NumberOfSections; i++)
+            if (shdr[i].SizeOfRawData > 0)
+                hdr_end = std::min(hdr_end, (size_t)shdr[i].PointerToRawData);
+        size_t free_offset = (uint8_t *)B->pe.free_shdr - data;
+        size_t num_free = (hdr_end > free_offset?
+            (hdr_end - free_offset) / sizeof(IMAGE_SECTION_HEADER): 0);
+        // One header for the loader, and one spare:
+        unsigned max_sections = (num_free > 2? (unsigned)num_free - 2: 0);
+        layoutPESections(B, mappings, sections_lb, max_sections, sections,
+            sectioned);
+    }
+
+    // Emit all mappings:
+    MappingSet loaded;
     for (auto mapping: mappings)
     {
-        uint8_t *base = data + size;
+        bool load = false;
+        for (auto *merged = mapping; !load && merged != nullptr;
+                merged = merged->merged)
+            load = (sectioned.find(merged) == sectioned.end());
+        if (!load)
+            continue;
         mapping->offset = (off_t)size;
-        flattenMapping(B, base, mapping, /*int3=*/0xcc);
         size += mapping->size;
+        loaded.push_back(mapping);
     }
+    flattenMappings(B, data, loaded, /*int3=*/0xcc);
 
     // Emit the loader:
-    uint32_t section_align = opt_hdr->SectionAlignment;
-    uint32_t file_align = B->pe.opt_hdr->FileAlignment;
     size = ALIGN(size, file_align);
     off_t loader_offset = (off_t)size;
     struct e9_config_s *config = (struct e9_config_s *)(data + size);
@@ -315,12 +483,14 @@ size_t emitPE(Binary *B, const MappingSet &mappings, size_t mapping_size)
 
     std::vector<Bounds> bounds;
     config->maps[1] = (uint32_t)(size - config_offset);
-    for (auto mapping: mappings)
+    for (auto mapping: loaded)
     {
         stat_num_physical_bytes += mapping->size;
         off_t offset_0 = mapping->offset;
         for (; mapping != nullptr; mapping = mapping->merged)
         {
+            if (sectioned.find(mapping) != sectioned.end())
+                continue;
             bounds.clear();
             getVirtualBounds(mapping, WINDOWS_VIRTUAL_ALLOC_SIZE, bounds);
             bool r = ((mapping->prot & PROT_READ) != 0);
@@ -391,6 +561,44 @@ size_t emitPE(Binary *B, const MappingSet &mappings, size_t mapping_size)
     uint32_t loader_disk_size = (uint32_t)(size - config_offset);
     size_t config_size = (size_t)loader_disk_size;
     config->size = (uint32_t)ALIGN(config_size, PAGE_SIZE);
+    if (sections.size() > 0)
+    {
+        if (size_of_image + loader_virtual_size > (size_t)sections[0].lb)
+            error("failed to emit trampoline sections; loader size (%u) "
+                "exceeds the reserved space (%zu)", loader_virtual_size,
+                (size_t)sections[0].lb - size_of_image);
+        // The loader section covers the gap to the first section:
+        loader_virtual_size = (uint32_t)(sections[0].lb - size_of_image);
+    }
+
+    // Emit the trampoline section data:
+    std::vector<off_t> section_offsets;
+    std::vector<uint8_t> buf;
+    for (const auto &section: sections)
+    {
+        section_offsets.push_back((off_t)size);
+        size_t section_size = (size_t)(section.ub - section.lb);
+        memset(data + size, /*int3=*/0xcc, section_size);
+        for (const auto &member: section.members)
+        {
+            const Mapping *mapping = member.first, *head = member.second;
+            buf.resize(head->size);
+            flattenMapping(B, buf.data(), head, /*int3=*/0xcc);
+            memcpy(data + size + (mapping->base - section.lb), buf.data(),
+                mapping->size);
+            stat_num_virtual_bytes += mapping->size;
+        }
+        stat_num_physical_bytes += section_size;
+        debug("load trampoline: section(addr=" ADDRESS_FORMAT
+            ",size=%zu,offset=+%zu,prot=%c%c%c,mappings=%zu)",
+            ADDRESS(section.lb), section_size, size,
+            (section.members[0].first->prot & PROT_READ? 'r': '-'),
+            (section.members[0].first->prot & PROT_WRITE? 'w': '-'),
+            (section.members[0].first->prot & PROT_EXEC? 'x': '-'),
+            section.members.size());
+        size += section_size;
+        size = ALIGN(size, file_align);
+    }
 
     // Step (6): Update the PE headers:
     PIMAGE_SECTION_HEADER shdr = B->pe.free_shdr;
@@ -410,12 +618,42 @@ size_t emitPE(Binary *B, const MappingSet &mappings, size_t mapping_size)
 
     uint32_t virtual_size = ALIGN(loader_virtual_size, section_align);
     size_of_image += virtual_size;
-    opt_hdr->SizeOfImage = size_of_image;
-    opt_hdr->CheckSum    = 0;
 
     PIMAGE_FILE_HEADER file_hdr = B->pe.file_hdr;
     file_hdr->NumberOfSections++;
 
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        const PESection &section = sections[i];
+        int prot = section.members[0].first->prot;
+        size_t section_size = (size_t)(section.ub - section.lb);
+        intptr_t section_end = (i + 1 < sections.size()?
+            sections[i+1].lb: section.ub);
+        if (section.lb != (intptr_t)size_of_image ||
+                section_end > UINT32_MAX ||
+                section_offsets[i] > UINT32_MAX)
+            error("failed to emit trampoline section at address "
+                ADDRESS_FORMAT "; section is out-of-bounds",
+                ADDRESS(section.lb));
+        shdr++;
+        memset(shdr, 0x0, sizeof(IMAGE_SECTION_HEADER));
+        const char tramp_name[8] = {'.', 'e', '9', 't', 'r', 'a', 'm', 'p'};
+        memcpy(shdr->Name, tramp_name, sizeof(tramp_name));
+        shdr->VirtualAddress   = (uint32_t)section.lb;
+        shdr->VirtualSize      = (uint32_t)(section_end - section.lb);
+        shdr->SizeOfRawData    = (uint32_t)ALIGN(section_size, file_align);
+        shdr->PointerToRawData = (uint32_t)section_offsets[i];
+        shdr->Characteristics  =
+            ((prot & PROT_READ) != 0? IMAGE_SCN_MEM_READ: 0x0) |
+            ((prot & PROT_WRITE) != 0? IMAGE_SCN_MEM_WRITE: 0x0) |
+            ((prot & PROT_EXEC) != 0?
+                IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_CNT_CODE: 0x0);
+        size_of_image = (uint32_t)ALIGN(section_end, section_align);
+        file_hdr->NumberOfSections++;
+    }
+    opt_hdr->SizeOfImage = size_of_image;
+    opt_hdr->CheckSum    = 0;
+
     /*
      * Disable ASLR.
      *
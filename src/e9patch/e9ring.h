@@ -0,0 +1,287 @@
+/*
+ * e9ring.h
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9RING_H
+#define __E9RING_H
+
+/*
+ * Shared-memory ring transport (`--rpc-ring=FD').  This header is shared by
+ * E9Tool and E9Patch.
+ *
+ * The ring is a single-producer/single-consumer byte stream in a memfd
+ * mapping, i.e., a drop-in replacement for the RPC pipe that works with
+ * both the JSON and binary encodings.  Writes and reads are plain memory
+ * copies, and a futex wakeup is only issued if the other side is actually
+ * sleeping.  The original pipe is kept open for liveness only: a sleeping
+ * side periodically polls the pipe to detect if the other side has died.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_MAGIC          0x474E495239450001ull   // "\x01\x00E9RING"
+#define RING_HEADER_SIZE    4096
+#define RING_SIZE_DEFAULT   (1 << 22)               // 4MB
+#define RING_POLL_NS        50000000                // 50ms
+
+/*
+ * The shared ring header.  The positions are (unwrapped) byte counts.
+ */
+struct RingHeader
+{
+    uint64_t magic;                     // RING_MAGIC
+    uint64_t size;                      // Data size (power-of-two)
+
+    alignas(64) std::atomic<uint64_t> head;
+                                        // Bytes written
+    std::atomic<uint32_t> head_seq;     // Futex: bumped on write/close
+    std::atomic<uint32_t> reader_waiting;
+                                        // Reader is sleeping?
+    std::atomic<uint32_t> closed;       // Writer has closed the ring?
+
+    alignas(64) std::atomic<uint64_t> tail;
+                                        // Bytes read
+    std::atomic<uint32_t> tail_seq;     // Futex: bumped on read
+    std::atomic<uint32_t> writer_waiting;
+                                        // Writer is sleeping?
+};
+
+/*
+ * A (process-local) ring handle.
+ */
+struct Ring
+{
+    RingHeader *hdr = nullptr;          // Shared header
+    uint8_t *data = nullptr;            // Shared data
+    size_t size = 0;                    // Data size
+    int fd = -1;                        // memfd
+    int peer = -1;                      // Liveness pipe
+    bool dead = false;                  // Other side has died?
+};
+
+static inline void ringFutexWait(std::atomic<uint32_t> *addr, uint32_t val)
+{
+    struct timespec timeout = {0, RING_POLL_NS};
+    (void)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, &timeout,
+        nullptr, 0);
+}
+
+static inline void ringFutexWake(std::atomic<uint32_t> *addr)
+{
+    (void)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, 1, nullptr,
+        nullptr, 0);
+}
+
+/*
+ * Check if the other side of the liveness pipe is still alive.
+ */
+static inline bool ringPeerAlive(const Ring &R)
+{
+    if (R.peer < 0)
+        return true;
+    struct pollfd pfd = {R.peer, 0, 0};
+    if (poll(&pfd, 1, 0) < 0)
+        return (errno == EINTR);
+    return ((pfd.revents & (POLLERR | POLLHUP)) == 0);
+}
+
+/*
+ * Map the ring stored in memfd `fd'.  Returns `false' on failure.
+ */
+static inline bool ringMap(Ring &R, int fd)
+{
+    struct stat buf;
+    if (fstat(fd, &buf) < 0)
+        return false;
+    size_t len = (size_t)buf.st_size;
+    if (len <= RING_HEADER_SIZE)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    void *ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+        0);
+    if (ptr == MAP_FAILED)
+        return false;
+    R.hdr  = (RingHeader *)ptr;
+    R.data = (uint8_t *)ptr + RING_HEADER_SIZE;
+    R.size = len - RING_HEADER_SIZE;
+    R.fd   = fd;
+    return true;
+}
+
+/*
+ * Create a new ring with a data size of `size' (a power-of-two).  The memfd
+ * is inherited by child processes.  Returns `false' on failure.
+ */
+static inline bool ringCreate(Ring &R, size_t size)
+{
+    int fd = (int)syscall(SYS_memfd_create, "e9ring", 0);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, RING_HEADER_SIZE + size) < 0 || !ringMap(R, fd))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    new (R.hdr) RingHeader();
+    R.hdr->magic = RING_MAGIC;
+    R.hdr->size  = size;
+    return true;
+}
+
+/*
+ * Open an existing ring from memfd `fd'.  Returns `false' on failure.
+ */
+static inline bool ringOpen(Ring &R, int fd)
+{
+    if (!ringMap(R, fd))
+        return false;
+    if (R.hdr->magic != RING_MAGIC || R.hdr->size != R.size ||
+            (R.size & (R.size - 1)) != 0)
+    {
+        munmap(R.hdr, RING_HEADER_SIZE + R.size);
+        R.hdr = nullptr;
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Write `len' bytes into the ring, blocking while the ring is full.
+ * Returns `false' if the reader has died.
+ */
+static inline bool ringWrite(Ring &R, const void *buf, size_t len)
+{
+    RingHeader *H = R.hdr;
+    if (R.dead)
+        return false;
+    const uint8_t *src = (const uint8_t *)buf;
+    uint64_t head = H->head.load(std::memory_order_relaxed);
+    while (len > 0)
+    {
+        uint32_t seq  = H->tail_seq.load(std::memory_order_acquire);
+        uint64_t tail = H->tail.load(std::memory_order_acquire);
+        size_t space  = R.size - (size_t)(head - tail);
+        if (space == 0)
+        {
+            H->writer_waiting.store(1);
+            if (H->tail.load() == tail)
+                ringFutexWait(&H->tail_seq, seq);
+            H->writer_waiting.store(0);
+            if (H->tail.load() == tail && !ringPeerAlive(R))
+            {
+                R.dead = true;
+                return false;
+            }
+            continue;
+        }
+        size_t n   = std::min(len, space);
+        size_t off = (size_t)head & (R.size - 1);
+        size_t m   = std::min(n, R.size - off);
+        memcpy(R.data + off, src, m);
+        memcpy(R.data, src + m, n - m);
+        head += n;
+        src  += n;
+        len  -= n;
+        H->head.store(head);
+        H->head_seq.fetch_add(1);
+        if (H->reader_waiting.load())
+            ringFutexWake(&H->head_seq);
+    }
+    return true;
+}
+
+/*
+ * Read up to `len' bytes from the ring, blocking while the ring is empty.
+ * Returns the number of bytes read, or 0 if the writer has closed the ring
+ * (or died).
+ */
+static inline size_t ringRead(Ring &R, void *buf, size_t len)
+{
+    RingHeader *H = R.hdr;
+    if (R.dead)
+        return 0;
+    uint64_t tail = H->tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint32_t seq  = H->head_seq.load(std::memory_order_acquire);
+        uint64_t head = H->head.load(std::memory_order_acquire);
+        if (head != tail)
+        {
+            size_t n   = std::min(len, (size_t)(head - tail));
+            size_t off = (size_t)tail & (R.size - 1);
+            size_t m   = std::min(n, R.size - off);
+            memcpy(buf, R.data + off, m);
+            memcpy((uint8_t *)buf + m, R.data, n - m);
+            H->tail.store(tail + n);
+            H->tail_seq.fetch_add(1);
+            if (H->writer_waiting.load())
+                ringFutexWake(&H->tail_seq);
+            return n;
+        }
+        if (H->closed.load())
+            return 0;
+        H->reader_waiting.store(1);
+        if (H->head.load() == tail && !H->closed.load())
+            ringFutexWait(&H->head_seq, seq);
+        H->reader_waiting.store(0);
+        if (H->head.load() == tail && !H->closed.load() && !ringPeerAlive(R))
+        {
+            R.dead = true;
+            return 0;
+        }
+    }
+}
+
+/*
+ * Close the writer side of the ring, and unmap it.
+ */
+static inline void ringClose(Ring &R, bool writer)
+{
+    if (R.hdr == nullptr)
+        return;
+    if (writer)
+    {
+        R.hdr->closed.store(1);
+        R.hdr->head_seq.fetch_add(1);
+        ringFutexWake(&R.hdr->head_seq);
+    }
+    munmap(R.hdr, RING_HEADER_SIZE + R.size);
+    close(R.fd);
+    R.hdr = nullptr;
+    R.fd  = -1;
+}
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * e9server.cpp
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * E9Patch server mode.
+ *
+ * The server accepts sessions over a UNIX domain socket.  Each session is
+ * an ordinary JSON-RPC message stream that starts with a "binary" message,
+ * and the session's output (log, statistics, warnings and errors) is
+ * written back over the same connection.
+ *
+ * Parsing the binary (mapping the file, parsing the ELF/PE structures and
+ * the CFR analysis) is paid once per distinct "binary" message.  For this,
+ * the server forks a "cache process" that parses the binary, and then forks
+ * a fresh "session process" for each session.  The session processes
+ * inherit the parsed binary copy-on-write, so the patch state is trivially
+ * reset between sessions.  The server process itself never parses any
+ * client data, meaning that a bad session can never bring it down.
+ */
+
+#include <map>
+#include <string>
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "e9api.h"
+#include "e9json.h"
+#include "e9patch.h"
+#include "e9server.h"
+
+#define SERVER_MESSAGE_MAX      (1 << 16)   // Max "binary" message size
+
+/*
+ * File identity, used to detect changes to a cached binary.
+ */
+struct Identity
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/*
+ * Get the identity of a file.
+ */
+static bool getIdentity(const char *filename, Identity &id)
+{
+    struct stat buf;
+    if (stat(filename, &buf) < 0)
+        return false;
+    id.dev   = buf.st_dev;
+    id.ino   = buf.st_ino;
+    id.size  = buf.st_size;
+    id.mtime = buf.st_mtim;
+    return true;
+}
+
+/*
+ * Compare file identities.
+ */
+static bool isSameIdentity(const Identity &id1, const Identity &id2)
+{
+    return (id1.dev == id2.dev && id1.ino == id2.ino &&
+        id1.size == id2.size && id1.mtime.tv_sec == id2.mtime.tv_sec &&
+        id1.mtime.tv_nsec == id2.mtime.tv_nsec);
+}
+
+/*
+ * Send a file descriptor over a socket.
+ */
+static bool sendFd(int sock, int fd)
+{
+    char data = 'S';
+    struct iovec iov = {&data, sizeof(data)};
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&ctl, 0x0, sizeof(ctl));
+    struct msghdr msg;
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t r;
+    while ((r = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return (r == sizeof(data));
+}
+
+/*
+ * Receive a file descriptor over a socket, else -1 if the socket was closed.
+ */
+static int recvFd(int sock)
+{
+    char data;
+    struct iovec iov = {&data, sizeof(data)};
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ssize_t r;
+    while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (r != sizeof(data))
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/*
+ * Read the first (i.e., "binary") message of a session.  The message is read
+ * one byte at a time, so that the rest of the stream is left untouched for
+ * the session process.  Also returns the line number of the next message.
+ */
+static bool readFirstMessage(int fd, std::string &text, size_t &lineno)
+{
+    lineno = 1;
+    bool blank = true;
+    while (text.size() < SERVER_MESSAGE_MAX)
+    {
+        char c;
+        ssize_t r = read(fd, &c, sizeof(c));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        if (c == '\n')
+        {
+            lineno++;
+            if (!blank)
+                return true;
+            continue;
+        }
+        blank = blank && isspace(c);
+        if (!blank)
+            text += c;
+    }
+    return false;
+}
+
+/*
+ * Parse the "binary" message of a session.  Errors are reported to the
+ * given connection.
+ */
+static Binary *parseFirstMessage(const std::string &text, int conn)
+{
+    int err = dup(STDERR_FILENO);
+    if (err < 0 || dup2(conn, STDERR_FILENO) < 0)
+        error("failed to duplicate file descriptor: %s", strerror(errno));
+
+    Message msg;
+    if (!getMessage(text.c_str(), text.size(), 1, msg))
+        error("failed to parse message stream; missing \"binary\" message");
+    if (msg.method != METHOD_BINARY)
+        error("failed to parse message stream; expected \"binary\" message "
+            "for session, got \"%s\" message (id=%u)",
+            getMethodString(msg.method), msg.id);
+    Binary *B = parseMessage(nullptr, msg);
+
+    if (dup2(err, STDERR_FILENO) < 0)
+        error("failed to duplicate file descriptor: %s", strerror(errno));
+    close(err);
+    return B;
+}
+
+/*
+ * Start a session process for connection `conn'.  If `B' is nullptr, the
+ * session parses the binary itself (i.e., the cached binary is stale).
+ */
+static void startSession(Binary *B, const std::string &text, int conn,
+    int sock, size_t lineno)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        warning("failed to fork session process: %s", strerror(errno));
+        return;
+    }
+    if (pid != 0)
+        return;
+
+    close(sock);
+    signal(SIGCHLD, SIG_DFL);
+    if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0 ||
+            dup2(conn, STDERR_FILENO) < 0)
+        error("failed to duplicate file descriptor: %s", strerror(errno));
+    close(conn);
+    option_is_tty = false;
+    if (B == nullptr)
+        B = parseFirstMessage(text, STDERR_FILENO);
+    sessionMain(B, stdin, lineno);
+}
+
+/*
+ * The cache process main loop.  Parses the binary once, then starts a
+ * session process for each connection received over `sock'.
+ */
+static void NO_RETURN cacheMain(const std::string &text, int conn, int sock,
+    size_t lineno)
+{
+    Binary *B = parseFirstMessage(text, conn);
+    Identity id;
+    if (!getIdentity(B->filename, id))
+        error("failed to get the status of file \"%s\": %s", B->filename,
+            strerror(errno));
+    debug("cached binary \"%s\"", B->filename);
+
+    while (true)
+    {
+        startSession(B, text, conn, sock, lineno);
+        close(conn);
+
+        conn = recvFd(sock);
+        if (conn < 0)
+            exit(EXIT_SUCCESS);
+        Identity id2;
+        if (getIdentity(B->filename, id2) && isSameIdentity(id, id2))
+            continue;
+
+        // The binary has changed, so this cache is stale.  Refuse further
+        // connections (the server will start a new cache process), and
+        // handle any already queued connections without the cache.
+        debug("cached binary \"%s\" is stale", B->filename);
+        shutdown(sock, SHUT_RD);
+        do
+        {
+            startSession(nullptr, text, conn, sock, lineno);
+            close(conn);
+        }
+        while ((conn = recvFd(sock)) >= 0);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+/*
+ * The server main loop.
+ */
+void NO_RETURN serverMain(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        error("failed to create server socket \"%s\"; path is too long",
+            path);
+    strcpy(addr.sun_path, path);
+
+    // Cache and session processes are reaped automatically:
+    signal(SIGCHLD, SIG_IGN);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0)
+        error("failed to create server socket \"%s\": %s", path,
+            strerror(errno));
+    struct stat buf;
+    if (stat(path, &buf) == 0 && S_ISSOCK(buf.st_mode))
+        unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("failed to bind server socket \"%s\": %s", path,
+            strerror(errno));
+    if (listen(lfd, SOMAXCONN) < 0)
+        error("failed to listen on server socket \"%s\": %s", path,
+            strerror(errno));
+    debug("listening on \"%s\"", path);
+
+    std::map<std::string, int> caches;
+    while (true)
+    {
+        int conn = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error("failed to accept connection on server socket \"%s\": %s",
+                path, strerror(errno));
+        }
+        std::string text;
+        size_t lineno;
+        if (!readFirstMessage(conn, text, lineno))
+        {
+            close(conn);
+            continue;
+        }
+
+        auto i = caches.find(text);
+        if (i != caches.end())
+        {
+            if (sendFd(i->second, conn))
+            {
+                close(conn);
+                continue;
+            }
+            // The cache process has exited:
+            close(i->second);
+            caches.erase(i);
+        }
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+            error("failed to create socket pair: %s", strerror(errno));
+        pid_t pid = fork();
+        if (pid < 0)
+            error("failed to fork cache process: %s", strerror(errno));
+        if (pid == 0)
+        {
+            close(lfd);
+            close(fds[0]);
+            for (const auto &entry: caches)
+                close(entry.second);
+            cacheMain(text, conn, fds[1], lineno);
+        }
+        close(fds[1]);
+        close(conn);
+        caches.insert({text, fds[0]});
+    }
+}
+
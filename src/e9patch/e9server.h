@@ -0,0 +1,32 @@
+/*
+ * e9server.h
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9SERVER_H
+#define __E9SERVER_H
+
+#include <cstdio>
+
+#include "e9patch.h"
+
+struct Ring;
+
+void NO_RETURN serverMain(const char *path);
+void NO_RETURN sessionMain(Binary *B, FILE *input, size_t lineno,
+    Ring *ring = nullptr);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * e9stats.h
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9STATS_H
+#define __E9STATS_H
+
+/*
+ * Per-phase timing & memory statistics (`--stats=FILE').  This header is
+ * shared by E9Tool and E9Patch.
+ *
+ * Phases are timed by (nestable) StatsTimers.  Phase times are exclusive,
+ * i.e., the time spent in a nested phase is not counted by the enclosing
+ * phase.  All operations are no-ops unless the statistics are enabled.
+ */
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <sys/resource.h>
+
+struct StatsCmp
+{
+    bool operator()(const char *a, const char *b) const
+    {
+        return (strcmp(a, b) < 0);
+    }
+};
+
+/*
+ * A phase.
+ */
+struct StatsPhase
+{
+    const char *name;                   // Phase name
+    double wall = 0.0;                  // Wall time (seconds)
+    double cpu  = 0.0;                  // CPU time (seconds)
+    size_t rss  = 0;                    // Peak RSS at phase end (KB)
+    size_t count = 0;                   // Number of times entered
+};
+
+/*
+ * A time sample.
+ */
+struct StatsSample
+{
+    double wall;                        // Wall time (seconds)
+    double cpu;                         // CPU time (seconds)
+};
+
+static inline StatsSample getStatsSample(void)
+{
+    struct timespec ts;
+    StatsSample S;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    S.wall = (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    S.cpu  = (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+    return S;
+}
+
+static inline size_t getStatsRSS(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+    return (size_t)usage.ru_maxrss;
+}
+
+struct StatsTimer;
+
+/*
+ * Statistics.
+ */
+struct Stats
+{
+    bool enabled = false;               // Statistics enabled?
+    StatsSample start;                  // Start time
+    std::vector<StatsPhase> phases;     // Phases (in first-entered order)
+    std::map<const char *, size_t, StatsCmp> index;
+                                        // Phase name -> phases[] index
+    std::vector<StatsTimer *> active;   // Active (nested) timers
+    std::map<const char *, std::map<const char *, size_t, StatsCmp>,
+        StatsCmp> counts;               // Named histograms
+    std::map<const char *, std::map<size_t, size_t>, StatsCmp> sizes;
+                                        // Size (power-of-two) histograms
+
+    void enable(void)
+    {
+        enabled = true;
+        start = getStatsSample();
+    }
+
+    size_t getPhase(const char *name)
+    {
+        auto i = index.find(name);
+        if (i != index.end())
+            return i->second;
+        size_t idx = phases.size();
+        phases.emplace_back();
+        phases.back().name = name;
+        index.insert({name, idx});
+        return idx;
+    }
+
+    /*
+     * Increment the `key' bucket of the `hist' histogram.
+     */
+    void count(const char *hist, const char *key)
+    {
+        if (enabled)
+            counts[hist][key]++;
+    }
+
+    /*
+     * Add `size' to the `hist' histogram.  Buckets are powers-of-two, and
+     * each bucket counts the sizes up to (and including) the bucket.
+     */
+    void size(const char *hist, size_t size)
+    {
+        if (!enabled)
+            return;
+        size_t bucket = 1;
+        while (bucket < size)
+            bucket <<= 1;
+        sizes[hist][bucket]++;
+    }
+
+    /*
+     * Write the statistics (JSON) to `filename'.
+     */
+    bool dump(const char *filename, const char *tool) const
+    {
+        FILE *stream = fopen(filename, "w");
+        if (stream == nullptr)
+            return false;
+        StatsSample end = getStatsSample();
+        fprintf(stream, "{\n  \"tool\": \"%s\",\n", tool);
+        fprintf(stream, "  \"wall\": %.6f,\n  \"cpu\": %.6f,\n"
+            "  \"rss\": %zu,\n", end.wall - start.wall, end.cpu,
+            getStatsRSS());
+        fputs("  \"phases\": [", stream);
+        for (size_t i = 0; i < phases.size(); i++)
+        {
+            const StatsPhase &P = phases[i];
+            fprintf(stream, "%s\n    {\"name\": \"%s\", \"wall\": %.6f, "
+                "\"cpu\": %.6f, \"rss\": %zu, \"count\": %zu}",
+                (i == 0? "": ","), P.name, P.wall, P.cpu, P.rss, P.count);
+        }
+        fputs("\n  ],\n  \"histograms\": {", stream);
+        bool first = true;
+        for (const auto &hist: counts)
+        {
+            fprintf(stream, "%s\n    \"%s\": {", (first? "": ","),
+                hist.first);
+            first = false;
+            bool prev = false;
+            for (const auto &entry: hist.second)
+            {
+                fprintf(stream, "%s\"%s\": %zu", (prev? ", ": ""),
+                    entry.first, entry.second);
+                prev = true;
+            }
+            fputc('}', stream);
+        }
+        for (const auto &hist: sizes)
+        {
+            fprintf(stream, "%s\n    \"%s\": {", (first? "": ","),
+                hist.first);
+            first = false;
+            bool prev = false;
+            for (const auto &entry: hist.second)
+            {
+                fprintf(stream, "%s\"%zu\": %zu", (prev? ", ": ""),
+                    entry.first, entry.second);
+                prev = true;
+            }
+            fputc('}', stream);
+        }
+        fputs("\n  }\n}\n", stream);
+        return (fclose(stream) == 0);
+    }
+};
+
+/*
+ * Phase timer.  The phase ends when the timer is stopped or destroyed.
+ */
+struct StatsTimer
+{
+    Stats &stats;                       // Statistics
+    size_t phase;                       // Phase index
+    StatsSample start;                  // (Re)start time
+    bool running = false;               // Timer is running?
+
+    StatsTimer(Stats &stats, const char *name) : stats(stats)
+    {
+        if (!stats.enabled)
+            return;
+        phase = stats.getPhase(name);
+        start = getStatsSample();
+        if (stats.active.size() > 0)
+            stats.active.back()->pause(start);
+        stats.active.push_back(this);
+        running = true;
+    }
+
+    ~StatsTimer()
+    {
+        stop();
+    }
+
+    void pause(const StatsSample &now)
+    {
+        StatsPhase &P = stats.phases[phase];
+        P.wall += now.wall - start.wall;
+        P.cpu  += now.cpu  - start.cpu;
+    }
+
+    void stop(void)
+    {
+        if (!running)
+            return;
+        running = false;
+        StatsSample now = getStatsSample();
+        pause(now);
+        StatsPhase &P = stats.phases[phase];
+        P.count++;
+        P.rss = std::max(P.rss, getStatsRSS());
+        auto i = std::find(stats.active.begin(), stats.active.end(), this);
+        if (i != stats.active.end())
+            stats.active.erase(i);
+        if (stats.active.size() > 0)
+            stats.active.back()->start = now;
+    }
+};
+
+#endif
@@ -17,11 +17,16 @@
  */
 
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 
+#include <map>
+#include <new>
+#include <vector>
+
 #include <sys/mman.h>
 
 #include "e9alloc.h"
@@ -92,6 +97,46 @@ struct Patch
     }
 };
 
+/*
+ * Patch arena.  A Patch never outlives the call to patch() that created it,
+ * since it is either committed or undone before patch() returns.  Patches
+ * are therefore bump-allocated from chunks that are reset in bulk, rather
+ * than being individually freed.
+ */
+#define PATCH_CHUNK_SIZE    256
+static struct
+{
+    std::vector<Patch *> chunks;        // Allocated chunks.
+    size_t chunk = 0;                   // Current chunk.
+    size_t used  = 0;                   // Used patches in current chunk.
+} arena;
+
+/*
+ * Allocate and construct a patch.
+ */
+static Patch *newPatch(Instr *I, Tactic t, const Alloc *A = nullptr)
+{
+    if (arena.used >= PATCH_CHUNK_SIZE)
+    {
+        arena.chunk++;
+        arena.used = 0;
+    }
+    if (arena.chunk >= arena.chunks.size())
+        arena.chunks.push_back(
+            (Patch *)new uint8_t[PATCH_CHUNK_SIZE * sizeof(Patch)]);
+    void *ptr = arena.chunks[arena.chunk] + arena.used++;
+    return new (ptr) Patch(I, t, A);
+}
+
+/*
+ * Release all patches.
+ */
+static void resetPatches(void)
+{
+    arena.chunk = 0;
+    arena.used  = 0;
+}
+
 /*
  * Convert a tactic to a string.
  */
@@ -110,6 +155,75 @@ static const char *getTacticName(Tactic tactic)
     }
 }
 
+/*
+ * Per-site records (--sites-out).
+ */
+struct Site
+{
+    const char *tactic;                 // Tactic name (or "failed")
+    unsigned attempts;                  // Number of (enabled) tactics tried
+    std::vector<intptr_t> victims;      // Evicted instructions (T2/T3)
+    size_t size;                        // Trampoline allocation size
+    intptr_t entry;                     // Trampoline entry address
+};
+static std::map<intptr_t, Site> sites;
+
+/*
+ * Record a site.
+ */
+static void recordSite(const Instr *I, const Patch *P, unsigned attempts)
+{
+    Site &site = sites[I->addr];
+    site.tactic   = (P == nullptr? "failed": getTacticName(P->tactic));
+    site.attempts = attempts;
+    site.victims.clear();
+    site.size     = 0;
+    site.entry    = 0;
+    if (P == nullptr)
+        return;
+    if (P->A != nullptr)
+    {
+        site.size  = (size_t)(P->A->ub - P->A->lb);
+        site.entry = P->A->lb + P->A->entry;
+    }
+    for (const Patch *Q = P->next; Q != nullptr; Q = Q->next)
+    {
+        if (Q->I != I && Q->A != nullptr && Q->A->T == evicteeTrampoline)
+            site.victims.push_back(Q->I->addr);
+    }
+}
+
+/*
+ * Save the per-site records.  This is one line per patched instruction:
+ *
+ *      address,tactic,attempts,#victims,"victims",size,page,mapping,trap
+ *
+ * which is readable as E9Tool CSV match data (NAME[i]).
+ */
+void saveSites(const char *filename, size_t mapping_size)
+{
+    FILE *stream = fopen(filename, "w");
+    if (stream == nullptr)
+        error("failed to open sites file \"%s\" for writing: %s", filename,
+            strerror(errno));
+    for (const auto &entry: sites)
+    {
+        const Site &site = entry.second;
+        fprintf(stream, "%#zx,\"%s\",%u,%zu,\"", (size_t)entry.first,
+            site.tactic, site.attempts, site.victims.size());
+        for (size_t i = 0; i < site.victims.size(); i++)
+            fprintf(stream, "%s%#zx", (i == 0? "": " "),
+                (size_t)site.victims[i]);
+        size_t page = (size_t)site.entry & ~(PAGE_SIZE - 1);
+        size_t mapping = (size_t)site.entry & ~(mapping_size - 1);
+        fprintf(stream, "\",%zu,%#zx,%#zx,%d\n", site.size, page, mapping,
+            (strcmp(site.tactic, "B0") == 0? 1: 0));
+    }
+    if (ferror(stream) || fclose(stream) != 0)
+        error("failed to write sites file \"%s\": %s", filename,
+            strerror(errno));
+}
+
 /*
  * Commit a patch.
  */
@@ -148,10 +262,7 @@ static void commit(Binary &B, Patch *P)
         if (P->A != nullptr)
             setTrampolineEntry(B.Es, P->I, P->A->lb + P->A->entry);
 
-        // Delete the P (we do not need it anymore)
-        Patch *Q = P;
         P = P->next;
-        delete Q;
     }
 }
 
@@ -170,9 +281,7 @@ static void undo(Binary &B, Patch *P)
             P->I->PATCH[i] = P->original.bytes[i];
         }
         deallocate(&B, P->A);
-        Patch *Q = P;
         P = P->next;
-        delete Q;
     }
 }
 
@@ -440,7 +549,7 @@ static Patch *tactic_B0(Binary &B, Instr *I, const Trampoline *T)
     const Alloc *A = allocateTrap(B, I, T);
     if (A == nullptr)
         return nullptr;
-    Patch *P = new Patch(I, TACTIC_B0, A);
+    Patch *P = newPatch(I, TACTIC_B0, A);
     patchTrap(P);
     patchUnused(P, /*offset=sizeof(illegal)=*/1);
     return P;
@@ -457,7 +566,7 @@ static Patch *tactic_B1(Binary &B, Instr *I, const Trampoline *T,
     const Alloc *A = allocateJump(B, I, T);
     if (A == nullptr)
         return nullptr;
-    Patch *P = new Patch(I, tactic, A);
+    Patch *P = newPatch(I, tactic, A);
     patchJump(P, /*offset=*/0);
     patchUnused(P, /*offset=sizeof(jmpq)=*/5);
     return P;
@@ -474,7 +583,7 @@ static Patch *tactic_B2(Binary &B, Instr *I, const Trampoline *T,
     const Alloc *A = allocatePunnedJump(B, I, /*offset=*/0, I, T);
     if (A == nullptr)
         return nullptr;
-    Patch *P = new Patch(I, tactic, A);
+    Patch *P = newPatch(I, tactic, A);
     patchJump(P, /*offset=*/0);
     return P;
 }
@@ -507,7 +616,7 @@ static Patch *tactic_T1(Binary &B, Instr *I, const Trampoline *T,
         const Alloc *A = allocatePunnedJump(B, I, prefix, I, T);
         if (A != nullptr)
         {
-            Patch *P = new Patch(I, tactic, A);
+            Patch *P = newPatch(I, tactic, A);
             patchJumpPrefix(P, prefix);
             patchJump(P, prefix);
             return P;
@@ -607,7 +716,7 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
                 J->no_optimize = save;
                 return nullptr;
             }
-            P = new Patch(J, TACTIC_T3, A);
+            P = newPatch(J, TACTIC_T3, A);
             patchJump(P, i);
             if (state == STATE_FREE)
             {
@@ -639,7 +748,7 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
     }
 
     assert(A != nullptr);
-    Patch *Q = new Patch(I, TACTIC_T3, A);
+    Patch *Q = newPatch(I, TACTIC_T3, A);
     assert(I->STATE[0] == STATE_INSTRUCTION);
     I->STATE[0] = STATE_PATCHED;
     I->PATCH[0] = /*short jmp opcode=*/0xEB;
@@ -750,7 +859,7 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
                         continue;
                     }
                     addr = J->addr + i;
-                    P = new Patch(J, TACTIC_T3, A);
+                    P = newPatch(J, TACTIC_T3, A);
                     patchJump(P, i);
                     if (state == STATE_FREE)
                     {
@@ -788,7 +897,7 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
 
     // Step (3): Insert a short jump to the trampoline jump:
     assert(A != nullptr);
-    Patch *Q = new Patch(I, TACTIC_T3, A);
+    Patch *Q = newPatch(I, TACTIC_T3, A);
     patchShortJump(Q, addr);
     patchUnused(Q, /*sizeof(short jmp)=*/2);
     Q->next = P;
@@ -839,7 +948,7 @@ static Patch *tactic_T0(Binary &B, Instr *I, const Trampoline *T,
     Patch *P = nullptr;
     for (Instr *K = L; K != nullptr && K->addr >= J->addr; K = K->pred())
     {
-        Patch *Q = new Patch(K, TACTIC_T0, nullptr);
+        Patch *Q = newPatch(K, TACTIC_T0, nullptr);
         patchUnused(Q, /*offset=*/0);
         Q->next = P;
         P = Q;
@@ -855,6 +964,8 @@ static Patch *tactic_T0(Binary &B, Instr *I, const Trampoline *T,
         U->prot              = PROT_READ | PROT_EXEC;
         U->num_entries       = num_entries;
         U->preload           = false;
+        U->hot               = false;
+        U->shape             = nullptr;
         U->entries[0].kind   = ENTRY_BATCH;
         U->entries[0].length = 0;
         U->entries[0].uint64 = L->addr;
@@ -877,8 +988,34 @@ static Patch *tactic_T0(Binary &B, Instr *I, const Trampoline *T,
 }
 
 /*
- * Patch the instruction at the given offset.
+ * Select the minimal (or full) trampoline prologue/epilogue window for `I'
+ * (-Oadaptive).  Returns `minimal'.
+ */
+static bool setWindow(Binary &B, Instr *I, bool minimal, bool no_optimize)
+{
+    setTrampolineMinimal(B.Es, I, minimal);
+    I->no_optimize = (minimal || no_optimize);
+    return minimal;
+}
+
+/*
+ * Try a tactic (with --stats accounting).  Disabled tactics are not counted.
  */
+template <typename F>
+static Patch *attempt(const char *phase, const char *name, bool enabled,
+    unsigned &attempts, F tactic)
+{
+    attempts += (enabled? 1: 0);
+    if (!stats.enabled || !enabled)
+        return tactic();
+    StatsTimer timer(stats, phase);
+    stats.count("tactic_attempts", name);
+    Patch *P = tactic();
+    if (P != nullptr)
+        stats.count("tactic_successes", name);
+    return P;
+}
+
 bool patch(Binary &B, Instr *I, const Trampoline *T)
 {
     switch (I->STATE[0])
@@ -891,25 +1028,65 @@ bool patch(Binary &B, Instr *I, const Trampoline *T)
                 "in reverse order?)", I->addr, I->size, I->STATE[0]);
     }
 
+    // Hot instructions (according to the --profile) are never patched using
+    // (slow) tactic B0:
+    size_t count = (option_profile? getProfileCount(I->addr): 0);
+    bool hot = (option_profile && count >= option_profile_hot);
+    stat_num_hot += (hot? 1: 0);
+
     // Try all patching tactics in order T0/B1/B2/T1/T2/T3:
     Patch *P = nullptr;
+    unsigned attempts = 0;
+    bool adaptive = (option_Oadaptive && option_Opeephole &&
+        (option_Oprologue > 0 || option_Oepilogue > 0));
+    bool no_optimize = (bool)I->no_optimize, minimal = false;
+    for (unsigned pass = 0; P == nullptr && pass < (adaptive? 2: 1); pass++)
+    {
+        // -Oadaptive: The first pass uses the full prologue/epilogue
+        // window.  If the cheap tactics fail, the second pass retries with
+        // a minimal window (i.e., a smaller trampoline).
+        if (pass > 0)
+            minimal = setWindow(B, I, true, no_optimize);
+        if (P == nullptr)
+            P = attempt("tactic_T0", "T0", option_tactic_T0 && option_OCFR,
+                attempts, [&]() { return tactic_T0(B, I, T); });
+        if (P == nullptr)
+            P = attempt("tactic_B1", "B1", option_tactic_B1,
+                attempts, [&]() { return tactic_B1(B, I, T); });
+        if (P == nullptr)
+            P = attempt("tactic_B2", "B2", option_tactic_B2,
+                attempts, [&]() { return tactic_B2(B, I, T); });
+        if (P == nullptr)
+            P = attempt("tactic_T1", "T1", option_tactic_T1,
+                attempts, [&]() { return tactic_T1(B, I, T); });
+    }
+    if (P == nullptr && minimal)
+        minimal = setWindow(B, I, false, no_optimize);
     if (P == nullptr)
-        P = tactic_T0(B, I, T);
-    if (P == nullptr)
-        P = tactic_B1(B, I, T);
-    if (P == nullptr)
-        P = tactic_B2(B, I, T);
-    if (P == nullptr)
-        P = tactic_T1(B, I, T);
-    if (P == nullptr)
-        P = tactic_T2(B, I, T);
-    if (P == nullptr)
-        P = tactic_T3(B, I, T);
+        P = attempt("tactic_T2", "T2", option_tactic_T2,
+            attempts, [&]() { return tactic_T2(B, I, T); });
     if (P == nullptr)
-        P = tactic_B0(B, I, T);
+        P = attempt("tactic_T3", "T3", option_tactic_T3,
+            attempts, [&]() { return tactic_T3(B, I, T); });
+    if (P == nullptr && hot)
+        stat_num_hot_untrapped += (option_tactic_B0? 1: 0);
+    else if (P == nullptr)
+    {
+        // -Oadaptive: B0 is dominated by the trap cost, so the window is
+        // not worth the trampoline space.
+        minimal = (adaptive? setWindow(B, I, true, no_optimize): false);
+        P = attempt("tactic_B0", "B0", option_tactic_B0,
+            attempts, [&]() { return tactic_B0(B, I, T); });
+    }
+
+    if (option_sites_out != nullptr)
+        recordSite(I, P, attempts);
 
     if (P == nullptr)
     {
+        if (minimal)
+            setWindow(B, I, false, no_optimize);
+        resetPatches();
         debug("failed to patch instruction at address 0x%lx (%zu)", I->addr,
             I->size);
         log(COLOR_RED, 'X');
@@ -917,8 +1094,11 @@ bool patch(Binary &B, Instr *I, const Trampoline *T)
     }
 
     bool uses_B0 = (P->tactic == TACTIC_B0);
+    stat_num_minimal += (minimal? 1: 0);
+    stat_trap_cost += (uses_B0? count: 0);
     const char *name = getTacticName(P->tactic);
     commit(B, P);
+    resetPatches();
     if (option_debug)
     {
         intptr_t entry = getTrampolineEntry(B.Es, I);
@@ -22,5 +22,6 @@
 #include "e9patch.h"
 
 bool patch(Binary &B, Instr *I, const Trampoline *T);
+void saveSites(const char *filename, size_t mapping_size);
 
 #endif
@@ -21,6 +21,7 @@
 #include <cstring>
 
 #include <map>
+#include <vector>
 
 #include <sys/mman.h>
 
@@ -74,6 +75,7 @@ void __attribute__((__constructor__(8000))) evicteeTrampolineInit(void)
     T->prot                = PROT_READ | PROT_EXEC;
     T->num_entries         = num_entries;
     T->preload             = false;
+    T->shape               = nullptr;
     T->entries[0].kind     = ENTRY_INSTR;
     T->entries[0].length   = 0;
     T->entries[0].bytes    = nullptr;
@@ -190,7 +192,7 @@ static int buildBreak(const Binary *B, const Instr *I, intptr_t addr,
     buf->push((const uint8_t *)&rel32, sizeof(rel32));
 
     const Instr *J = I->succ();
-    if (option_Opeephole && J != nullptr && buf->bytes() != nullptr)
+    if (option_Opeephole && J != nullptr && buf->size() <= buf->max)
         saveJump(B, addr, bytes, /*sizeof(jmpq)=*/5);
  
     return /*sizeof(jmpq)=*/5;
@@ -339,42 +341,215 @@ static int buildPrologue(const Binary *B, const Instr *I,
 }
 
 /*
- * Calculate trampoline size.
- * Returns (-1) if the trampoline cannot be constructed.
+ * Compiled trampoline template.  Each template is compiled once (on first
+ * use) into:
+ *
+ *  - A byte blob of all constant entries (bytes, zeroes, and integers that do
+ *    not reference labels), with adjacent constants merged.
+ *  - A "code" list of chunks, each being either a range of the blob (emitted
+ *    with a single memcpy), or the index of an entry that must be evaluated
+ *    per instruction (labels, label references, rel8/rel32 fixups, $instr,
+ *    $break, macros, etc.).
+ *  - A size summary: the size of most entries depends only on the template
+ *    and the instruction shape.  The remaining "dynamic" entries (macros,
+ *    $break, batches) depend on the metadata or the current patching state,
+ *    and are recalculated on every call.
+ *
+ * Since the compiled form is stored in the template itself, and macros are
+ * always re-expanded, a new "trampoline" message cannot invalidate it.
  */
-static int getTrampolineSize(const Binary *B, const Trampoline *T,
-    const Instr *I, bool last, unsigned depth)
+#define CHUNK_BLOB                  UINT32_MAX
+struct Chunk
 {
-    if (depth > MACRO_DEPTH_MAX)
-        error("failed to get trampoline size; maximum macro expansion depth "
-            "(%u) exceeded", MACRO_DEPTH_MAX);
-    unsigned size = 0;
+    unsigned entry;                 // Entry index (or CHUNK_BLOB)
+    unsigned offset;                // Blob offset
+    unsigned length;                // Blob length
+};
+struct TrampolineShape
+{
+    unsigned fixed = 0;             // Size of the fixed-size entries
+    unsigned num_debug = 0;         // Number of $debug entries
+    unsigned num_instr = 0;         // Number of $instr entries
+    unsigned num_instr_bytes = 0;   // Number of $bytes entries
+    std::vector<unsigned> dynamic;  // Indices of dynamic entries
+    std::vector<uint8_t> blob;      // Constant bytes
+    std::vector<Chunk> code;        // Compiled template
+};
+
+/*
+ * Compile a constant entry into the blob, else return `false'.
+ */
+static bool compileConstant(const Entry &entry, TrampolineShape *shape)
+{
+    size_t len = 0;
+    switch (entry.kind)
+    {
+        case ENTRY_BYTES:
+            shape->blob.insert(shape->blob.end(), entry.bytes,
+                entry.bytes + entry.length);
+            len = entry.length;
+            break;
+        case ENTRY_ZEROES:
+            shape->blob.insert(shape->blob.end(), entry.length, 0x0);
+            len = entry.length;
+            break;
+        case ENTRY_INT8: case ENTRY_INT16: case ENTRY_INT32:
+        case ENTRY_INT64:
+        {
+            if (entry.use)
+                return false;
+            len = (entry.kind == ENTRY_INT8?  sizeof(uint8_t):
+                   entry.kind == ENTRY_INT16? sizeof(uint16_t):
+                   entry.kind == ENTRY_INT32? sizeof(uint32_t):
+                                              sizeof(uint64_t));
+            const uint8_t *val = (const uint8_t *)&entry.uint64;
+            shape->blob.insert(shape->blob.end(), val, val + len);
+            break;
+        }
+        default:
+            return false;
+    }
+    if (len == 0)
+        return true;
+    if (!shape->code.empty() && shape->code.back().entry == CHUNK_BLOB)
+        shape->code.back().length += len;
+    else
+    {
+        Chunk chunk = {CHUNK_BLOB, (unsigned)(shape->blob.size() - len),
+            (unsigned)len};
+        shape->code.push_back(chunk);
+    }
+    return true;
+}
+
+/*
+ * Get (or build) the trampoline size information.  Batch templates are
+ * temporary, so their information is built into `tmp' instead.
+ */
+static const TrampolineShape *getTrampolineShape(const Trampoline *T,
+    TrampolineShape &tmp)
+{
+    if (T->shape != nullptr)
+        return T->shape;
+    bool batch = false;
+    for (unsigned i = 0; !batch && i < T->num_entries; i++)
+        batch = (T->entries[i].kind == ENTRY_BATCH);
+    TrampolineShape *shape = (batch? &tmp: new TrampolineShape);
     for (unsigned i = 0; i < T->num_entries; i++)
     {
         const Entry &entry = T->entries[i];
+        if (!compileConstant(entry, shape))
+        {
+            Chunk chunk = {i, 0, 0};
+            shape->code.push_back(chunk);
+        }
         switch (entry.kind)
         {
             case ENTRY_DEBUG:
-                size += (I != nullptr && I->debug? /*sizeof(int3)=*/1: 0);
+                shape->num_debug++;
                 continue;
             case ENTRY_BYTES:
             case ENTRY_ZEROES:
-                size += entry.length;
+                shape->fixed += entry.length;
                 continue;
             case ENTRY_INT8:
-                size += sizeof(uint8_t);
+                shape->fixed += sizeof(uint8_t);
                 continue;
             case ENTRY_INT16:
-                size += sizeof(uint16_t);
+                shape->fixed += sizeof(uint16_t);
                 continue;
             case ENTRY_INT32:
-                size += sizeof(uint32_t);
+                shape->fixed += sizeof(uint32_t);
                 continue;
             case ENTRY_INT64:
-                size += sizeof(uint64_t);
+                shape->fixed += sizeof(uint64_t);
                 continue;
             case ENTRY_LABEL:
                 continue;
+            case ENTRY_REL8:
+                shape->fixed += sizeof(int8_t);
+                continue;
+            case ENTRY_REL32:
+                shape->fixed += sizeof(int32_t);
+                continue;
+            case ENTRY_INSTR:
+                shape->num_instr++;
+                continue;
+            case ENTRY_INSTR_BYTES:
+                shape->num_instr_bytes++;
+                continue;
+            case ENTRY_TAKE:
+                shape->fixed += /*sizeof(jmpq)=*/5;
+                continue;
+            case ENTRY_MACRO: case ENTRY_BREAK: case ENTRY_BATCH:
+                shape->dynamic.push_back(i);
+                continue;
+        }
+    }
+    if (!batch)
+        T->shape = shape;
+    return shape;
+}
+
+/*
+ * Calculate the relocated size of an instruction.  The result depends only
+ * on the instruction itself, so a small direct-mapped cache is used.
+ */
+#define RELOC_CACHE_SIZE            1024
+static int getRelocatedSize(const Instr *I)
+{
+    struct RelocEntry
+    {
+        intptr_t addr;
+        size_t offset;
+        int size;
+    };
+    static RelocEntry cache[RELOC_CACHE_SIZE] = {{INTPTR_MIN, 0, 0}};
+    static bool cache_scratch_stack = option_Oscratch_stack;
+    if (cache_scratch_stack != option_Oscratch_stack)
+    {
+        for (unsigned i = 0; i < RELOC_CACHE_SIZE; i++)
+            cache[i].addr = INTPTR_MIN;
+        cache_scratch_stack = option_Oscratch_stack;
+    }
+    RelocEntry &entry = cache[(size_t)I->addr % RELOC_CACHE_SIZE];
+    if (entry.addr == I->addr && entry.offset == I->offset)
+        return entry.size;
+    entry.addr   = I->addr;
+    entry.offset = I->offset;
+    entry.size   = relocateInstr(I, INTPTR_MIN);
+    return entry.size;
+}
+
+/*
+ * Calculate trampoline size.
+ * Returns (-1) if the trampoline cannot be constructed.
+ */
+static int getTrampolineSize(const Binary *B, const Trampoline *T,
+    const Instr *I, bool last, unsigned depth)
+{
+    if (depth > MACRO_DEPTH_MAX)
+        error("failed to get trampoline size; maximum macro expansion depth "
+            "(%u) exceeded", MACRO_DEPTH_MAX);
+    TrampolineShape tmp;
+    const TrampolineShape *shape = getTrampolineShape(T, tmp);
+    unsigned size = shape->fixed;
+    if (shape->num_debug > 0 && I != nullptr && I->debug)
+        size += shape->num_debug * /*sizeof(int3)=*/1;
+    if (shape->num_instr > 0)
+    {
+        int r = getRelocatedSize(I);
+        if (r < 0)
+            return -1;
+        size += shape->num_instr * (unsigned)r;
+    }
+    if (shape->num_instr_bytes > 0)
+        size += shape->num_instr_bytes * I->size;
+    for (unsigned i: shape->dynamic)
+    {
+        const Entry &entry = T->entries[i];
+        switch (entry.kind)
+        {
             case ENTRY_MACRO:
             {
                 const Trampoline *U = expandMacro(B, I->metadata,
@@ -388,23 +563,6 @@ static int getTrampolineSize(const Binary *B, const Trampoline *T,
                 size += r;
                 continue;
             }
-            case ENTRY_REL8:
-                size += sizeof(int8_t);
-                continue;
-            case ENTRY_REL32:
-                size += sizeof(int32_t);
-                continue;
-            case ENTRY_INSTR:
-            {
-                int r = relocateInstr(I, INTPTR_MIN);
-                if (r < 0)
-                    return -1;
-                size += r;
-                continue;
-            }
-            case ENTRY_INSTR_BYTES:
-                size += I->size;
-                continue;
             case ENTRY_BREAK:
             {
                 bool fallthrough = !last && (i+1 >= T->num_entries);
@@ -413,9 +571,6 @@ static int getTrampolineSize(const Binary *B, const Trampoline *T,
                     BUILD_SIZE);
                 continue;
             }
-            case ENTRY_TAKE:
-                size += /*sizeof(jmpq)=*/5;
-                continue;
             case ENTRY_BATCH:
             {
                 const Instr *J = nullptr;
@@ -436,6 +591,8 @@ static int getTrampolineSize(const Binary *B, const Trampoline *T,
                         BUILD_SIZE);
                 continue;
             }
+            default:
+                continue;
         }
     }
     return size;
@@ -509,8 +666,16 @@ static size_t getTrampolineBounds(const Binary *B, const Trampoline *T,
     if (depth > MACRO_DEPTH_MAX)
         error("failed to get trampoline bounds; maximum macro expansion "
             "depth (%u) exceeded", MACRO_DEPTH_MAX);
-    for (unsigned i = 0; i < T->num_entries; i++)
+    TrampolineShape tmp;
+    const TrampolineShape *shape = getTrampolineShape(T, tmp);
+    for (const auto &chunk: shape->code)
     {
+        if (chunk.entry == CHUNK_BLOB)
+        {
+            size += chunk.length;
+            continue;
+        }
+        unsigned i = chunk.entry;
         const Entry &entry = T->entries[i];
         switch (entry.kind)
         {
@@ -627,8 +792,16 @@ static intptr_t buildLabelSet(const Binary *B, const Trampoline *T,
     const Instr *I, intptr_t addr, bool last, BreakInfo &breaks,
     LabelSet &labels)
 {
-    for (unsigned i = 0; i < T->num_entries; i++)
+    TrampolineShape tmp;
+    const TrampolineShape *shape = getTrampolineShape(T, tmp);
+    for (const auto &chunk: shape->code)
     {
+        if (chunk.entry == CHUNK_BLOB)
+        {
+            addr += chunk.length;
+            continue;
+        }
+        unsigned i = chunk.entry;
         const Entry &entry = T->entries[i];
         switch (entry.kind)
         {
@@ -747,8 +920,16 @@ static void buildBytes(const Binary *B, const Trampoline *T, const Instr *I,
     intptr_t addr, bool last, const BreakInfo &breaks, const LabelSet &labels,
     Buffer &buf)
 {
-    for (unsigned i = 0; i < T->num_entries; i++)
+    TrampolineShape tmp;
+    const TrampolineShape *shape = getTrampolineShape(T, tmp);
+    for (const auto &chunk: shape->code)
     {
+        if (chunk.entry == CHUNK_BLOB)
+        {
+            buf.push(shape->blob.data() + chunk.offset, chunk.length);
+            continue;
+        }
+        unsigned i = chunk.entry;
         const Entry &entry = T->entries[i];
         switch (entry.kind)
         {
@@ -964,13 +1145,15 @@ void flattenAllTrampolines(Binary *B)
         }
         size_t size = A->ub - A->lb;
         uint8_t *bytes = new uint8_t[size];
+        memset(bytes, /*int3=*/0xcc, A->pad);   // Entry alignment padding
 
         const Instr *I = A->I;
         int32_t offset32 = (int32_t)(I == nullptr? 0: A->lb - I->addr);
         int32_t entry32  = offset32 + A->entry;
         intptr_t addr    = (I == nullptr? A->lb: I->addr + entry32);
-        flattenTrampoline(B, bytes, size, /*fill=int3=*/0xcc, addr, offset32,
-            entry32, A->T, I);
+        offset32 += A->pad;
+        flattenTrampoline(B, bytes + A->pad, size - A->pad,
+            /*fill=int3=*/0xcc, addr, offset32, entry32, A->T, I);
         A->bytes = bytes;
     }
 }
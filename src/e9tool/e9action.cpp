@@ -27,6 +27,7 @@
 #include <string>
 
 #include "e9action.h"
+#include "e9codegen.h"
 #include "e9csv.h"
 #include "e9elf.h"
 #include "e9metadata.h"
@@ -475,6 +476,9 @@ static const MatchArg parseMatchArg(Parser &parser, bool val = false)
             match = MATCH_OFFSET; break;
         case TOKEN_OP:
             match = MATCH_OP; break;
+        case TOKEN_PLT:
+            option_plt = true;
+            match = MATCH_PLT; break;
         case TOKEN_PLUGIN:
             if (seen_I) parser.unexpectedToken();
             match = MATCH_PLUGIN; break;
@@ -498,7 +502,14 @@ static const MatchArg parseMatchArg(Parser &parser, bool val = false)
         case TOKEN_SRC:
             match = MATCH_SRC; break;
         case TOKEN_TARGET:
-            match = MATCH_TARGET; break;
+            match = MATCH_TARGET;
+            if (parser.peekToken() == '.')
+            {
+                parser.getToken();
+                parser.expectToken(TOKEN_NAME_2);
+                match = MATCH_TARGET_NAME;
+            }
+            break;
         case TOKEN_TRUE:
             if (seen_I) parser.unexpectedToken();
             match = MATCH_TRUE; break;
@@ -604,10 +615,11 @@ static const MatchArg parseMatchArg(Parser &parser, bool val = false)
             parser.expectToken('(');
             parser.expectToken(')');
             plugin = openPlugin(filename.c_str());
-            if (plugin->matchFunc == nullptr)
+            if (plugin->matchFunc == nullptr &&
+                    plugin->matchBatchFunc == nullptr)
                 error("failed to parse matching; plugin \"%s\" does not "
-                    "export the \"e9_plugin_match\" function",
-                    plugin->filename);
+                    "export the \"e9_plugin_match\" or "
+                    "\"e9_plugin_match_batch\" functions", plugin->filename);
             break;
         }
 
@@ -995,6 +1007,8 @@ static const Argument parsePatchArg(Parser &parser)
             arg = ARGUMENT_OFFSET; break;
         case TOKEN_OP:
             arg = ARGUMENT_OP; break;
+        case TOKEN_PMC:
+            arg = ARGUMENT_PMC; break;
         case TOKEN_RANDOM:
             arg = ARGUMENT_RANDOM; break;
         case TOKEN_REG:
@@ -1139,6 +1153,9 @@ static const Argument parsePatchArg(Parser &parser)
             if ((Register)value == REGISTER_RIP)
                 goto not_a_ptr;
             break;
+        case ARGUMENT_PMC:
+            value = parseIndex(parser, 0, 3);   // See E9_PMC_MAX (stdlib.c)
+            goto not_a_ptr;
         case ARGUMENT_CSV:
             value = parseIndex(parser, INTPTR_MIN, INTPTR_MAX);
             // Fallthrough:
@@ -1168,6 +1185,113 @@ static const Argument parsePatchArg(Parser &parser)
         value, memop, name};
 }
 
+/*
+ * Parse a guard (or log) argument.
+ */
+static const Argument parseGuardArg(Parser &parser, const char *what)
+{
+    Argument arg = parsePatchArg(parser);
+    switch (arg.kind)
+    {
+        case ARGUMENT_INTEGER: case ARGUMENT_MEMOP:
+            break;
+        case ARGUMENT_REGISTER:
+            switch ((Register)arg.value)
+            {
+                case REGISTER_RIP: case REGISTER_EFLAGS:
+                    goto bad_arg;
+                default:
+                    break;
+            }
+            if (getRegIdx((Register)arg.value) >= 0)
+                break;
+            // Fallthrough:
+        default:
+        bad_arg:
+            error("failed to parse %s; expected a general purpose "
+                "register, integer or memory operand argument", what);
+    }
+    if (arg.ptr || arg.cast != TYPE_NONE)
+        error("failed to parse %s; arguments cannot be cast or passed "
+            "by pointer", what);
+    return arg;
+}
+
+/*
+ * Parse a guard operand, i.e., a guard argument or shadow(ARG).
+ */
+static const Argument parseGuardOperand(Parser &parser, bool &shadow)
+{
+    shadow = false;
+    if (parser.peekToken() != TOKEN_SHADOW)
+        return parseGuardArg(parser, "guard");
+    parser.getToken();
+    parser.expectToken('(');
+    Argument arg = parsePatchArg(parser);
+    parser.expectToken(')');
+    shadow = true;
+    switch (arg.kind)
+    {
+        case ARGUMENT_REGISTER:
+            if (arg.ptr ||
+                    getRegSize((Register)arg.value) != sizeof(int64_t) ||
+                    getRegIdx((Register)arg.value) < 0)
+                goto bad_arg;
+            break;
+        case ARGUMENT_MEMOP:
+            if (!arg.ptr)
+                goto bad_arg;
+            break;
+        case ARGUMENT_OP: case ARGUMENT_SRC: case ARGUMENT_DST:
+        case ARGUMENT_MEM:
+            if (!arg.ptr || arg.field != FIELD_NONE)
+                goto bad_arg;
+            break;
+        default:
+        bad_arg:
+            error("failed to parse shadow guard; expected a 64-bit general "
+                "purpose register or memory operand address (e.g., &mem[0]) "
+                "argument");
+    }
+    if (arg.cast != TYPE_NONE)
+        error("failed to parse shadow guard; arguments cannot be cast");
+    return arg;
+}
+
+/*
+ * Parse a call guard.
+ */
+static void parseGuard(Parser &parser, std::vector<Guard> &guard)
+{
+    while (true)
+    {
+        Guard test;
+        test.lhs = parseGuardOperand(parser, test.lhs_shadow);
+        switch (parser.getToken())
+        {
+            case '=':
+                test.cmp = GUARD_EQ; break;
+            case TOKEN_NEQ:
+                test.cmp = GUARD_NEQ; break;
+            case '<':
+                test.cmp = GUARD_LT; break;
+            case TOKEN_LEQ:
+                test.cmp = GUARD_LEQ; break;
+            case '>':
+                test.cmp = GUARD_GT; break;
+            case TOKEN_GEQ:
+                test.cmp = GUARD_GEQ; break;
+            default:
+                parser.unexpectedToken();
+        }
+        test.rhs = parseGuardOperand(parser, test.rhs_shadow);
+        guard.push_back(test);
+        if (parser.peekToken() != TOKEN_AND)
+            break;
+        parser.getToken();
+    }
+}
+
 /*
  * Parse a patch.
  */
@@ -1189,16 +1313,37 @@ const Patch *parsePatch(const ELF &elf, const char *str)
             break;
     }
 
+    unsigned sample = 0;
+    if (parser.peekToken() == TOKEN_SAMPLE)
+    {
+        parser.getToken();
+        parser.expectToken('(');
+        parser.expectToken(TOKEN_INTEGER);
+        if (parser.i <= 0 || parser.i > INT32_MAX)
+            error("failed to parse sample modifier; the sample period "
+                "must be an integer within the range 1..%d", INT32_MAX);
+        sample = (unsigned)parser.i;
+        parser.expectToken(')');
+    }
+
     bool conditional = false;
     const char *symbol = nullptr;
     switch (parser.getToken())
     {
         case TOKEN_BREAK:
             kind = PATCH_BREAK; break;
+        case TOKEN_COUNT:
+            kind = PATCH_COUNT; break;
+        case TOKEN_COV:
+            kind = PATCH_COV; break;
         case TOKEN_EMPTY:
             kind = PATCH_EMPTY; break;
         case TOKEN_EXIT:
             kind = PATCH_EXIT; break;
+        case TOKEN_HOOK:
+            kind = PATCH_HOOK; break;
+        case TOKEN_LOG:
+            kind = PATCH_LOG; break;
         case TOKEN_SIGNAL:
             kind = PATCH_SIGNAL; break;
         case TOKEN_PRINT:
@@ -1221,7 +1366,10 @@ const Patch *parsePatch(const ELF &elf, const char *str)
     Plugin *plugin = nullptr;
     CallABI abi = ABI_CLEAN;
     CallJump jmp = JUMP_NONE;
+    bool flags = false, inl = false, lea = false, tsc = false;
+    unsigned entries = 1024;
     std::vector<Argument> args;
+    std::vector<Guard> guard;
     int status = 0, signal = 0;
     int t = 0;
     switch (kind)
@@ -1257,15 +1405,131 @@ const Patch *parsePatch(const ELF &elf, const char *str)
             parser.expectToken(')');
             plugin = openPlugin(filename);
             break;
+
+        case PATCH_COUNT: case PATCH_COV:
+            if (parser.peekToken() != '<')
+                break;
+            parser.getToken();
+            do
+            {
+                switch (parser.getToken())
+                {
+                    case TOKEN_FLAGS:
+                        flags = true; break;
+                    case TOKEN_LEA:
+                        lea = true; break;
+                    default:
+                        parser.unexpectedToken();
+                }
+                t = parser.expectToken2(',', '>');
+            }
+            while (t == ',');
+            break;
+
+        case PATCH_LOG:
+            t = parser.expectToken2('(', '<');
+            if (t == '<')
+            {
+                do
+                {
+                    switch (parser.getToken())
+                    {
+                        case TOKEN_TSC:
+                            tsc = true; break;
+                        case TOKEN_SIZE:
+                            parser.expectToken('=');
+                            parser.expectToken(TOKEN_INTEGER);
+                            if (parser.i <= 0 || parser.i > 65536 ||
+                                    (parser.i & (parser.i - 1)) != 0)
+                                error("failed to parse log trampoline; the "
+                                    "size must be a power of two within the "
+                                    "range 1..65536");
+                            entries = (unsigned)parser.i;
+                            break;
+                        default:
+                            parser.unexpectedToken();
+                    }
+                    t = parser.expectToken2(',', '>');
+                }
+                while (t == ',');
+                parser.expectToken('(');
+            }
+            while (true)
+            {
+                t = parser.peekToken();
+                if (t == ')' && args.size() == 0)
+                {
+                    parser.getToken();
+                    break;
+                }
+                args.push_back(parseGuardArg(parser, "log trampoline"));
+                t = parser.getToken();
+                if (t == ')')
+                    break;
+                if (t != ',')
+                    parser.unexpectedToken();
+            }
+            if (parser.peekToken() != TOKEN_EOF)
+            {
+                parser.getToken();
+                symbol = parseFunctionName(parser);
+                parser.expectToken('@');
+                parser.getBlob();
+                filename = strDup(parser.s);
+            }
+            break;
         
+        case PATCH_HOOK:
+            if (pos != POS_BEFORE)
+                error("failed to parse hook trampoline; the trampoline "
+                    "must be placed before the function entry");
+            if (parser.peekToken() == '<')
+            {
+                parser.getToken();
+                parser.expectToken(TOKEN_SIZE);
+                parser.expectToken('=');
+                parser.expectToken(TOKEN_INTEGER);
+                if (parser.i <= 0 || parser.i > 65536)
+                    error("failed to parse hook trampoline; the size must "
+                        "be an integer within the range 1..65536");
+                entries = (unsigned)parser.i;
+                parser.expectToken('>');
+            }
+            parser.getToken();
+            symbol = parseFunctionName(parser);
+            parser.expectToken('@');
+            parser.getBlob();
+            filename = strDup(parser.s);
+            option_targets = option_bbs = option_fs = true;
+            break;
+
         case PATCH_CALL:
         {
             t = parser.expectToken2('(', '<');
             if (t == '<')
             {
-                t = parser.expectToken2(TOKEN_CLEAN, TOKEN_NAKED);
-                abi = (t == TOKEN_CLEAN? ABI_CLEAN: ABI_NAKED);
-                parser.expectToken('>');
+                do
+                {
+                    switch (parser.getToken())
+                    {
+                        case TOKEN_CLEAN:
+                            abi = ABI_CLEAN; break;
+                        case TOKEN_NAKED:
+                            abi = ABI_NAKED; break;
+                        case TOKEN_FLAGS:
+                            flags = true; break;
+                        case TOKEN_INLINE:
+                            inl = true; break;
+                        default:
+                            parser.unexpectedToken();
+                    }
+                    t = parser.expectToken2(',', '>');
+                }
+                while (t == ',');
+                if (abi != ABI_CLEAN && (flags || inl))
+                    error("failed to parse call trampoline; the \"%s\" "
+                        "option requires the \"clean\" ABI",
+                        (flags? "flags": "inline"));
                 parser.expectToken('(');
             }
             while (true)
@@ -1296,6 +1560,11 @@ const Patch *parsePatch(const ELF &elf, const char *str)
             parser.expectToken('@');
             parser.getBlob();
             filename = strDup(parser.s);
+            if (parser.peekToken() == TOKEN_WHEN)
+            {
+                parser.getToken();
+                parseGuard(parser, guard);
+            }
             if (conditional)
             {
                 switch (parser.expectToken2(TOKEN_BREAK, TOKEN_GOTO))
@@ -1316,36 +1585,78 @@ const Patch *parsePatch(const ELF &elf, const char *str)
     // Build the patch:
     std::string name;
     static size_t id = 1;
+    Patch *patch = nullptr;
     switch (kind)
     {
         case PATCH_PRINT:
-            return new Patch("$print", PATCH_PRINT, pos);
+            patch = new Patch("$print", PATCH_PRINT, pos);
+            break;
         case PATCH_EMPTY:
-            return new Patch("$empty", PATCH_EMPTY, pos);
+            patch = new Patch("$empty", PATCH_EMPTY, pos);
+            break;
         case PATCH_BREAK:
-            return new Patch("$BREAK", PATCH_BREAK, pos);
+            patch = new Patch("$BREAK", PATCH_BREAK, pos);
+            break;
         case PATCH_TRAP:
-            return new Patch("$trap", PATCH_TRAP, pos);
+            patch = new Patch("$trap", PATCH_TRAP, pos);
+            break;
         case PATCH_CALL:
             name += "$call_";
             name += std::to_string(id++);
-            return new Patch(strDup(name.c_str()), PATCH_CALL, pos, filename,
-                symbol, abi, jmp, std::move(args));
+            patch = new Patch(strDup(name.c_str()), PATCH_CALL, pos, filename,
+                symbol, abi, jmp, flags, inl, std::move(args),
+                std::move(guard));
+            break;
+        case PATCH_COUNT: case PATCH_COV:
+            name += (kind == PATCH_COUNT? "$count_": "$cov_");
+            name += std::to_string(id++);
+            patch = new Patch(strDup(name.c_str()), kind, pos, flags, lea);
+            break;
+        case PATCH_LOG:
+            name += "$log_";
+            name += std::to_string(id++);
+            patch = new Patch(strDup(name.c_str()), PATCH_LOG, pos, filename,
+                symbol, tsc, entries, std::move(args));
+            break;
+        case PATCH_HOOK:
+            name += "$hook_";
+            name += std::to_string(id++);
+            patch = new Patch(strDup(name.c_str()), PATCH_HOOK, pos, filename,
+                symbol, false, entries, {});
+            break;
         case PATCH_EXIT:
             name += "$exit_";
             name += std::to_string(status);
-            return new Patch(strDup(name.c_str()), PATCH_EXIT, pos, status);
+            patch = new Patch(strDup(name.c_str()), PATCH_EXIT, pos, status);
+            break;
         case PATCH_SIGNAL:
             name += "$signal_";
             name += std::to_string(signal);
-            return new Patch(strDup(name.c_str()), PATCH_SIGNAL, pos, signal);
+            patch = new Patch(strDup(name.c_str()), PATCH_SIGNAL, pos, signal);
+            break;
         case PATCH_PLUGIN:
             name += "$plugin_";
             name += std::to_string(id++);
-            return new Patch(strDup(name.c_str()), PATCH_PLUGIN, pos, plugin);
+            patch = new Patch(strDup(name.c_str()), PATCH_PLUGIN, pos, plugin);
+            break;
         default:
             return nullptr;
     }
+    if (sample > 0)
+    {
+        if (kind == PATCH_BREAK)
+            error("failed to parse patch; the \"break\" trampoline cannot "
+                "be sampled");
+        if (pos == POS_REPLACE)
+            error("failed to parse patch; \"replace\" trampolines cannot "
+                "be sampled");
+        name.clear();
+        name += "$sample_";
+        name += std::to_string(id++);
+        patch->sample  = sample;
+        patch->sampler = strDup(name.c_str());
+    }
+    return patch;
 }
 
 /*
@@ -1642,6 +1953,8 @@ static void dumpExpr(const MatchExpr &expr, std::string &str, bool hex = false)
             str += "modrm"; break;
         case MATCH_OFFSET:
             str += "offset"; break;
+        case MATCH_PLT:
+            str += "plt"; break;
         case MATCH_RANDOM:
             str += "random"; break;
         case MATCH_RETURN:
@@ -1656,6 +1969,8 @@ static void dumpExpr(const MatchExpr &expr, std::string &str, bool hex = false)
             str += "size"; break;
         case MATCH_TARGET:
             str += "target"; break;
+        case MATCH_TARGET_NAME:
+            str += "target.name"; break;
         case MATCH_X87:
             str += "x87"; break;
         case MATCH_SSE:
@@ -1933,6 +2248,7 @@ static MatchVal makeMatchValue(const MatchVar *var, const ELF *elf,
     const F *f   = nullptr;
     InstrInfo info;
     uint8_t j = 0;
+    size_t idx0 = idx;
 
     if (var->i != 0 || var->set != MATCH_Is)
     {
@@ -2147,7 +2463,12 @@ static MatchVal makeMatchValue(const MatchVar *var, const ELF *elf,
         case MATCH_OFFSET:
             result.i = (intptr_t)I->offset; return result;
         case MATCH_PLUGIN:
-            result.i = var->plugin->result; return result;
+        {
+            const Plugin *plugin = var->plugin;
+            result.i = (plugin->results.size() == 0? plugin->result:
+                plugin->results[idx0 - plugin->base]);
+            return result;
+        }
         case MATCH_RANDOM:
             result.i = (intptr_t)rand(); return result;
         case MATCH_RETURN:
@@ -2160,7 +2481,7 @@ static MatchVal makeMatchValue(const MatchVar *var, const ELF *elf,
             result.i = I->data[I->encoding.offset.sib]; return result;
         case MATCH_SIZE:
             result.i = (intptr_t)I->size; return result;
-        case MATCH_TARGET:
+        case MATCH_TARGET: case MATCH_TARGET_NAME:
             if ((I->category & CATEGORY_CALL) != 0 ||
                 (I->category & CATEGORY_JUMP) != 0)
             {
@@ -2168,9 +2489,35 @@ static MatchVal makeMatchValue(const MatchVar *var, const ELF *elf,
                     goto undefined;
                 result.i = (intptr_t)I->op[0].imm + (intptr_t)I->address +
                     (intptr_t)I->size;
+                if (match == MATCH_TARGET)
+                    return result;
+                result.str = getELFFuncName(elf, result.i);
+                if (result.str == nullptr)
+                    goto undefined;
+                result.type = MATCH_TYPE_STRING;
+                return result;
+            }
+            goto undefined;
+        case MATCH_PLT:
+        {
+            // The `jmp *GOT(%rip)' of a PLT stub (optionally preceded by
+            // an endbr64):
+            if ((I->category & CATEGORY_JUMP) == 0 || I->count.op != 1 ||
+                    I->op[0].type != OPTYPE_MEM ||
+                    I->op[0].mem.base != REGISTER_RIP)
+                goto undefined;
+            for (intptr_t entry: {(intptr_t)I->address,
+                    (intptr_t)I->address - /*sizeof(endbr64)=*/4})
+            {
+                const char *name = getELFFuncName(elf, entry);
+                if (name == nullptr || getELFPLTEntry(elf, name) != entry)
+                    continue;
+                result.type = MATCH_TYPE_STRING;
+                result.str  = name;
                 return result;
             }
             goto undefined;
+        }
         case MATCH_AVX:
             result.i = ((I->category & CATEGORY_AVX) != 0); return result;
         case MATCH_AVX2:
@@ -2299,6 +2646,123 @@ static MatchVal matchCastToBool(MatchVal val)
     }
 }
 
+/*
+ * Evaluate a comparison.
+ */
+static bool matchCompare(MatchOp op, const MatchVal &lhs, const MatchVal &rhs)
+{
+    if (lhs.type == MATCH_TYPE_UNDEFINED || rhs.type == MATCH_TYPE_UNDEFINED)
+        return false;
+    switch (op)
+    {
+        case MATCH_OP_EQ:
+            return (lhs == rhs);
+        case MATCH_OP_NEQ:
+            return (lhs != rhs);
+        case MATCH_OP_LT:
+            return (lhs < rhs);
+        case MATCH_OP_LEQ:
+            return (lhs <= rhs);
+        case MATCH_OP_GT:
+            return (lhs > rhs);
+        case MATCH_OP_GEQ:
+            return (lhs >= rhs);
+        case MATCH_OP_IN:
+            if (rhs.type != MATCH_TYPE_SET)
+                return false;
+            else if (lhs.type != MATCH_TYPE_SET)
+                return isMember(&lhs, &rhs);
+            else
+                return isSubset(&lhs, &rhs);
+        default:
+            return false;
+    }
+}
+
+/*
+ * Evaluate an arithmetic operation.
+ */
+static MatchVal matchArith(MatchOp op, const MatchVal &lhs,
+    const MatchVal &rhs)
+{
+    MatchVal res;
+    if (lhs.type != MATCH_TYPE_INTEGER || rhs.type != MATCH_TYPE_INTEGER)
+        return res;
+    res.type = MATCH_TYPE_INTEGER;
+    res.i    = 0;
+    typedef __int128 int128_t;
+    int128_t i128 = 0;
+    switch (op)
+    {
+        case MATCH_OP_ADD:
+            i128 = (int128_t)lhs.i + (int128_t)rhs.i;
+            goto check128;
+        case MATCH_OP_SUB:
+            i128 = (int128_t)lhs.i - (int128_t)rhs.i;
+            goto check128;
+        case MATCH_OP_MUL:
+            i128 = (int128_t)lhs.i * (int128_t)rhs.i;
+            goto check128;
+        case MATCH_OP_DIV:
+            if (rhs.i == 0) goto undefined;
+            i128 = (int128_t)lhs.i / (int128_t)rhs.i;
+            goto check128;
+        case MATCH_OP_MOD:
+            if (rhs.i == 0) goto undefined;
+            i128 = (int128_t)lhs.i % (int128_t)rhs.i;
+            goto check128;
+        case MATCH_OP_BIT_AND:
+            res.i = (intptr_t)((uint64_t)lhs.i & (uint64_t)rhs.i);
+            break;
+        case MATCH_OP_BIT_OR:
+            res.i = (intptr_t)((uint64_t)lhs.i | (uint64_t)rhs.i);
+            break;
+        case MATCH_OP_BIT_XOR:
+            res.i = (intptr_t)((uint64_t)lhs.i ^ (uint64_t)rhs.i);
+            break;
+        case MATCH_OP_LSHIFT:
+            res.i = (intptr_t)
+                (rhs.i <= 0? lhs.i:
+                 rhs.i >= 64? 0x0: (uint64_t)lhs.i << (unsigned)rhs.i);
+            break;
+        case MATCH_OP_RSHIFT:
+            res.i = (intptr_t)
+                (rhs.i <= 0? lhs.i:
+                 rhs.i >= 64? 0x0: (int64_t)lhs.i >> (unsigned)rhs.i);
+            break;
+        check128:
+            if (i128 < INTPTR_MIN || i128 > INTPTR_MAX) goto undefined;
+            res.i = (intptr_t)i128; break;
+        default:
+        undefined:
+            res.type = MATCH_TYPE_UNDEFINED;
+            break;
+    }
+    return res;
+}
+
+/*
+ * Evaluate a unary arithmetic operation.
+ */
+static MatchVal matchUnary(MatchOp op, const MatchVal &lhs)
+{
+    MatchVal res;
+    if (lhs.type != MATCH_TYPE_INTEGER)
+        return res;
+    res.type = MATCH_TYPE_INTEGER;
+    res.i    = 0;
+    switch (op)
+    {
+        case MATCH_OP_NEG:
+            res.i = -lhs.i; break;
+        case MATCH_OP_BIT_NOT:
+            res.i = (intptr_t)~(uint64_t)lhs.i; break;
+        default:
+            break;
+    }
+    return res;
+}
+
 /*
  * Evaluate a matching.
  */
@@ -2370,120 +2834,24 @@ static MatchVal matchDoEval(const MatchExpr *expr, const ELF &elf,
                 break;
             MatchVal rbuf[64];
             rhs = matchDoEval(expr->rhs, elf, Is, idx, I, rbuf);
-            if (rhs.type == MATCH_TYPE_UNDEFINED)
-                break;
-            switch (expr->op)
-            {
-                case MATCH_OP_EQ:
-                    res.i = (lhs == rhs); break;
-                case MATCH_OP_NEQ:
-                    res.i = (lhs != rhs); break;
-                case MATCH_OP_LT:
-                    res.i = (lhs < rhs); break;
-                case MATCH_OP_LEQ:
-                    res.i = (lhs <= rhs); break;
-                case MATCH_OP_GT:
-                    res.i = (lhs > rhs); break;
-                case MATCH_OP_GEQ:
-                    res.i = (lhs >= rhs); break;
-                case MATCH_OP_IN:
-                {
-                    if (rhs.type != MATCH_TYPE_SET)
-                        res.i = false;
-                    else if (lhs.type != MATCH_TYPE_SET)
-                        res.i = isMember(&lhs, &rhs);
-                    else
-                        res.i = isSubset(&lhs, &rhs);
-                    break;
-                }
-                default:
-                    break;
-            }
+            res.i = matchCompare(expr->op, lhs, rhs);
             break;
         }
         case MATCH_OP_ADD: case MATCH_OP_SUB:
         case MATCH_OP_MUL: case MATCH_OP_DIV: case MATCH_OP_MOD:
         case MATCH_OP_BIT_AND: case MATCH_OP_BIT_OR: case MATCH_OP_BIT_XOR:
         case MATCH_OP_LSHIFT: case MATCH_OP_RSHIFT:
-        {
             res.type = MATCH_TYPE_UNDEFINED;
             lhs = matchDoEval(expr->lhs, elf, Is, idx, I, buf);
             if (lhs.type != MATCH_TYPE_INTEGER)
                 break;
             rhs = matchDoEval(expr->rhs, elf, Is, idx, I, buf);
-            if (lhs.type != MATCH_TYPE_INTEGER)
-                break;
-            res.type = MATCH_TYPE_INTEGER;
-            res.i    = 0;
-            typedef __int128 int128_t;
-            int128_t i128 = 0;
-            switch (expr->op)
-            {
-                case MATCH_OP_ADD:
-                    i128 = (int128_t)lhs.i + (int128_t)rhs.i;
-                    goto check128;
-                case MATCH_OP_SUB:
-                    i128 = (int128_t)lhs.i - (int128_t)rhs.i;
-                    goto check128;
-                case MATCH_OP_MUL:
-                    i128 = (int128_t)lhs.i * (int128_t)rhs.i;
-                    goto check128;
-                case MATCH_OP_DIV:
-                    if (rhs.i == 0) goto undefined;
-                    i128 = (int128_t)lhs.i / (int128_t)rhs.i;
-                    goto check128;
-                case MATCH_OP_MOD:
-                    if (rhs.i == 0) goto undefined;
-                    i128 = (int128_t)lhs.i % (int128_t)rhs.i;
-                    goto check128;
-                case MATCH_OP_BIT_AND:
-                    res.i = (intptr_t)((uint64_t)lhs.i & (uint64_t)rhs.i);
-                    break;
-                case MATCH_OP_BIT_OR:
-                    res.i = (intptr_t)((uint64_t)lhs.i | (uint64_t)rhs.i);
-                    break;
-                case MATCH_OP_BIT_XOR:
-                    res.i = (intptr_t)((uint64_t)lhs.i ^ (uint64_t)rhs.i);
-                    break;
-                case MATCH_OP_LSHIFT:
-                    res.i = (intptr_t)
-                        (rhs.i <= 0? lhs.i:
-                         rhs.i >= 64? 0x0: (uint64_t)lhs.i << (unsigned)rhs.i);
-                    break;
-                case MATCH_OP_RSHIFT:
-                    res.i = (intptr_t)
-                        (rhs.i <= 0? lhs.i:
-                         rhs.i >= 64? 0x0: (int64_t)lhs.i >> (unsigned)rhs.i);
-                    break;
-                check128:
-                    if (i128 < INTPTR_MIN || i128 > INTPTR_MAX) goto undefined;
-                    res.i = (intptr_t)i128; break;
-                default:
-                undefined:
-                    res.type = MATCH_TYPE_UNDEFINED;
-                    break;
-            }
+            res = matchArith(expr->op, lhs, rhs);
             break;
-        }
         case MATCH_OP_NEG: case MATCH_OP_BIT_NOT:
-        {
-            res.type = MATCH_TYPE_UNDEFINED;
             lhs = matchDoEval(expr->lhs, elf, Is, idx, I, buf);
-            if (lhs.type != MATCH_TYPE_INTEGER)
-                break;
-            res.type = MATCH_TYPE_INTEGER;
-            res.i    = 0;
-            switch (expr->op)
-            {
-                case MATCH_OP_NEG:
-                    res.i = -lhs.i; break;
-                case MATCH_OP_BIT_NOT:
-                    res.i = (intptr_t)~(uint64_t)res.i; break;
-                default:
-                    break;
-            }
+            res = matchUnary(expr->op, lhs);
             break;
-        }
         default:
             error("unknown match op (%d)", expr->op);
     }
@@ -2492,27 +2860,485 @@ static MatchVal matchDoEval(const MatchExpr *expr, const ELF &elf,
 }
 
 /*
- * Evaluate a matching.
+ * Match bytecode opcodes.
  */
-bool matchEval(const MatchExpr *expr, const ELF &elf,
-    const std::vector<Instr> &Is, size_t idx, const InstrInfo *I)
+enum MatchOpcode : uint8_t
 {
-    if (option_debug)
+    MATCH_BC_RET,                       // return r[a]
+    MATCH_BC_CONST,                     // r[dst] = val
+    MATCH_BC_VAR,                       // r[dst] = var
+    MATCH_BC_ADDRESS,                   // r[dst] = I->address
+    MATCH_BC_OFFSET,                    // r[dst] = I->offset
+    MATCH_BC_SIZE,                      // r[dst] = I->size
+    MATCH_BC_MNEMONIC,                  // r[dst] = I->string.mnemonic
+    MATCH_BC_CATEGORY,                  // r[dst] = (I->category & mask)
+    MATCH_BC_CMP_FIELD,                 // r[dst] = (field op val)
+    MATCH_BC_CMP_MNEMONIC,              // r[dst] = (I->mnemonic op val)
+    MATCH_BC_BOOL,                      // r[dst] = (bool)r[a]
+    MATCH_BC_NOT,                       // r[dst] = !r[a]
+    MATCH_BC_DEFINED,                   // r[dst] = defined(r[a])
+    MATCH_BC_CMP,                       // r[dst] = (r[a] op r[b])
+    MATCH_BC_ARITH,                     // r[dst] = (r[a] op r[b])
+    MATCH_BC_UNARY,                     // r[dst] = op r[a]
+    MATCH_BC_JUMP_IF_FALSE,             // if (!r[a]) goto target
+    MATCH_BC_JUMP_IF_TRUE,              // if (r[a]) goto target
+    MATCH_BC_JUMP_IF_UNDEFINED,         // if (!defined(r[a])) goto target
+    MATCH_BC_JUMP_IF_NOT_INTEGER,       // if (!integer(r[a])) goto target
+};
+
+/*
+ * Match bytecode instruction.
+ */
+struct MatchInstr
+{
+    MatchOpcode opcode;                 // Opcode
+    MatchOp op;                         // Operation (CMP/ARITH/UNARY)
+    MatchKind kind;                     // Field (CMP_FIELD)
+    uint16_t dst;                       // Destination register
+    uint16_t a;                         // Operand register
+    uint16_t b;                         // Operand register
+    uint16_t buf;                       // Set buffer (VAR)
+    uint16_t mask;                      // Category mask (CATEGORY)
+    uint32_t target;                    // Jump target
+    const MatchVar *var;                // Variable (VAR)
+    MatchVal val;                       // Constant
+
+    MatchInstr(MatchOpcode opcode, unsigned dst, unsigned a = 0,
+            unsigned b = 0) :
+        opcode(opcode), op(MATCH_OP_ARG), kind(MATCH_INVALID), dst(dst),
+        a(a), b(b), buf(0), mask(0), target(0), var(nullptr)
     {
-        debug("%s0x%lx%s:\tinstr %s%s%s",
-            (option_is_tty? "\33[31m": ""), I->address,
-            (option_is_tty? "\33[0m": ""), (option_is_tty? "\33[32m": ""),
-            I->string.instr, (option_is_tty? "\33[0m": ""));
+        ;
     }
-    MatchVal buf[64];
-    MatchVal result = matchCastToBool(matchDoEval(expr, elf, Is, idx, I, buf));
-    bool pass = (result.i != 0);
-    if (option_debug)
-    {
-        std::string str_expr, str_val;
-        dumpExpr(*expr, str_expr);
-        dumpVal(result, str_val);
-        debug("%s0x%lx%s: expr %s = %s%s%s",
+};
+
+/*
+ * A compiled match expression.
+ */
+struct MatchCode
+{
+    std::vector<MatchInstr> code;       // Bytecode
+    unsigned nregs = 1;                 // Number of registers
+    unsigned nbufs = 0;                 // Number of set buffers
+};
+
+/*
+ * Test if a variable refers to the current instruction.
+ */
+static bool matchIsLocal(const MatchVar *var)
+{
+    return (var->i == 0 && var->set == MATCH_Is);
+}
+
+/*
+ * Constant fold a match expression (if possible).
+ */
+static bool matchFold(const MatchExpr *expr, MatchVal &res)
+{
+    MatchVal lhs, rhs;
+    switch (expr->op)
+    {
+        case MATCH_OP_ARG:
+            switch (expr->arg.inst)
+            {
+                case MATCH_INST_VAL:
+                    res = *expr->arg.val;
+                    return true;
+                case MATCH_INST_VAR:
+                    if (!matchIsLocal(expr->arg.var))
+                        return false;
+                    switch (expr->arg.var->match)
+                    {
+                        case MATCH_TRUE:
+                            res = MatchVal((intptr_t)true);
+                            return true;
+                        case MATCH_FALSE:
+                            res = MatchVal((intptr_t)false);
+                            return true;
+                        default:
+                            return false;
+                    }
+                default:
+                    return false;
+            }
+        case MATCH_OP_NOT: case MATCH_OP_AND: case MATCH_OP_OR:
+            // Type errors are reported at evaluation time, so do not fold
+            // non-Boolean operands.
+            if (!matchFold(expr->lhs, lhs) ||
+                    (lhs.type != MATCH_TYPE_INTEGER &&
+                     lhs.type != MATCH_TYPE_UNDEFINED))
+                return false;
+            lhs = matchCastToBool(lhs);
+            if (expr->op == MATCH_OP_NOT)
+            {
+                res = MatchVal((intptr_t)(lhs.i == 0));
+                return true;
+            }
+            if ((expr->op == MATCH_OP_AND && !lhs.i) ||
+                (expr->op == MATCH_OP_OR && lhs.i))
+            {
+                res = lhs;
+                return true;
+            }
+            if (!matchFold(expr->rhs, rhs) ||
+                    (rhs.type != MATCH_TYPE_INTEGER &&
+                     rhs.type != MATCH_TYPE_UNDEFINED))
+                return false;
+            res = matchCastToBool(rhs);
+            return true;
+        case MATCH_OP_DEFINED:
+            if (!matchFold(expr->lhs, lhs))
+                return false;
+            res = MatchVal((intptr_t)(lhs.type != MATCH_TYPE_UNDEFINED));
+            return true;
+        case MATCH_OP_EQ: case MATCH_OP_NEQ:
+        case MATCH_OP_LT: case MATCH_OP_LEQ:
+        case MATCH_OP_GT: case MATCH_OP_GEQ:
+        case MATCH_OP_IN:
+            if (!matchFold(expr->lhs, lhs) || !matchFold(expr->rhs, rhs))
+                return false;
+            res = MatchVal((intptr_t)matchCompare(expr->op, lhs, rhs));
+            return true;
+        case MATCH_OP_NEG: case MATCH_OP_BIT_NOT:
+            if (!matchFold(expr->lhs, lhs))
+                return false;
+            res = matchUnary(expr->op, lhs);
+            return true;
+        default:
+            if (!matchFold(expr->lhs, lhs) || !matchFold(expr->rhs, rhs))
+                return false;
+            res = matchArith(expr->op, lhs, rhs);
+            return true;
+    }
+}
+
+/*
+ * Compile a variable load.
+ */
+static void matchCompileVar(MatchCode *code, const MatchVar *var,
+    unsigned dst)
+{
+    if (matchIsLocal(var))
+    {
+        uint16_t mask = 0x0;
+        switch (var->match)
+        {
+            case MATCH_ADDRESS:
+                code->code.emplace_back(MATCH_BC_ADDRESS, dst); return;
+            case MATCH_OFFSET:
+                code->code.emplace_back(MATCH_BC_OFFSET, dst); return;
+            case MATCH_SIZE:
+                code->code.emplace_back(MATCH_BC_SIZE, dst); return;
+            case MATCH_MNEMONIC:
+                code->code.emplace_back(MATCH_BC_MNEMONIC, dst); return;
+            case MATCH_CALL:
+                mask = CATEGORY_CALL; break;
+            case MATCH_JUMP:
+                mask = CATEGORY_JUMP; break;
+            case MATCH_CONDJUMP:
+                mask = CATEGORY_JUMP | CATEGORY_CONDITIONAL; break;
+            case MATCH_RETURN:
+                mask = CATEGORY_RETURN; break;
+            case MATCH_X87:
+                mask = CATEGORY_X87; break;
+            case MATCH_MMX:
+                mask = CATEGORY_MMX; break;
+            case MATCH_SSE:
+                mask = CATEGORY_SSE; break;
+            case MATCH_AVX:
+                mask = CATEGORY_AVX; break;
+            case MATCH_AVX2:
+                mask = CATEGORY_AVX2; break;
+            case MATCH_AVX512:
+                mask = CATEGORY_AVX512; break;
+            default:
+                break;
+        }
+        if (mask != 0x0)
+        {
+            code->code.emplace_back(MATCH_BC_CATEGORY, dst);
+            code->code.back().mask = mask;
+            return;
+        }
+    }
+    code->code.emplace_back(MATCH_BC_VAR, dst);
+    code->code.back().var = var;
+    switch (var->match)
+    {
+        case MATCH_REGS: case MATCH_READS: case MATCH_WRITES:
+            code->code.back().buf = (uint16_t)code->nbufs++;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Compile a comparison into a single fused instruction (if possible).
+ */
+static bool matchCompileFused(MatchCode *code, const MatchExpr *expr,
+    unsigned dst)
+{
+    const MatchExpr *lhs = expr->lhs;
+    MatchVal val;
+    if (expr->op == MATCH_OP_IN || lhs->op != MATCH_OP_ARG ||
+            lhs->arg.inst != MATCH_INST_VAR || !matchIsLocal(lhs->arg.var) ||
+            !matchFold(expr->rhs, val))
+        return false;
+    switch (lhs->arg.var->match)
+    {
+        case MATCH_ADDRESS: case MATCH_OFFSET: case MATCH_SIZE:
+            if (val.type != MATCH_TYPE_INTEGER)
+                return false;
+            code->code.emplace_back(MATCH_BC_CMP_FIELD, dst);
+            break;
+        case MATCH_MNEMONIC:
+            if (val.type != MATCH_TYPE_STRING ||
+                    (expr->op != MATCH_OP_EQ && expr->op != MATCH_OP_NEQ))
+                return false;
+            code->code.emplace_back(MATCH_BC_CMP_MNEMONIC, dst);
+            break;
+        default:
+            return false;
+    }
+    code->code.back().op   = expr->op;
+    code->code.back().kind = lhs->arg.var->match;
+    code->code.back().val  = val;
+    return true;
+}
+
+/*
+ * Compile a match expression into register `dst'.
+ */
+static void matchCompileExpr(MatchCode *code, const MatchExpr *expr,
+    unsigned dst)
+{
+    if (dst + 2 > UINT16_MAX)
+        error("failed to compile matching; expression is too deep");
+    code->nregs = std::max(code->nregs, dst + 1);
+    MatchVal val;
+    if (matchFold(expr, val))
+    {
+        code->code.emplace_back(MATCH_BC_CONST, dst);
+        code->code.back().val = val;
+        return;
+    }
+    size_t jmp;
+    switch (expr->op)
+    {
+        case MATCH_OP_ARG:
+            matchCompileVar(code, expr->arg.var, dst);
+            return;
+        case MATCH_OP_NOT:
+            matchCompileExpr(code, expr->lhs, dst);
+            code->code.emplace_back(MATCH_BC_NOT, dst, dst);
+            return;
+        case MATCH_OP_AND: case MATCH_OP_OR:
+            matchCompileExpr(code, expr->lhs, dst);
+            code->code.emplace_back(MATCH_BC_BOOL, dst, dst);
+            jmp = code->code.size();
+            code->code.emplace_back((expr->op == MATCH_OP_AND?
+                MATCH_BC_JUMP_IF_FALSE: MATCH_BC_JUMP_IF_TRUE), dst, dst);
+            matchCompileExpr(code, expr->rhs, dst);
+            code->code.emplace_back(MATCH_BC_BOOL, dst, dst);
+            code->code[jmp].target = (uint32_t)code->code.size();
+            return;
+        case MATCH_OP_DEFINED:
+            matchCompileExpr(code, expr->lhs, dst);
+            code->code.emplace_back(MATCH_BC_DEFINED, dst, dst);
+            return;
+        case MATCH_OP_EQ: case MATCH_OP_NEQ:
+        case MATCH_OP_LT: case MATCH_OP_LEQ:
+        case MATCH_OP_GT: case MATCH_OP_GEQ:
+        case MATCH_OP_IN:
+            if (matchCompileFused(code, expr, dst))
+                return;
+            matchCompileExpr(code, expr->lhs, dst);
+            jmp = code->code.size();
+            code->code.emplace_back(MATCH_BC_JUMP_IF_UNDEFINED, dst, dst);
+            matchCompileExpr(code, expr->rhs, dst+1);
+            code->code[jmp].target = (uint32_t)code->code.size();
+            code->code.emplace_back(MATCH_BC_CMP, dst, dst, dst+1);
+            code->code.back().op = expr->op;
+            return;
+        case MATCH_OP_NEG: case MATCH_OP_BIT_NOT:
+            matchCompileExpr(code, expr->lhs, dst);
+            code->code.emplace_back(MATCH_BC_UNARY, dst, dst);
+            code->code.back().op = expr->op;
+            return;
+        default:
+            matchCompileExpr(code, expr->lhs, dst);
+            jmp = code->code.size();
+            code->code.emplace_back(MATCH_BC_JUMP_IF_NOT_INTEGER, dst, dst);
+            matchCompileExpr(code, expr->rhs, dst+1);
+            code->code[jmp].target = (uint32_t)code->code.size();
+            code->code.emplace_back(MATCH_BC_ARITH, dst, dst, dst+1);
+            code->code.back().op = expr->op;
+            return;
+    }
+}
+
+/*
+ * Compile a matching.
+ */
+const MatchCode *matchCompile(const MatchExpr *expr)
+{
+    MatchCode *code = new MatchCode;
+    matchCompileExpr(code, expr, 0);
+    code->code.emplace_back(MATCH_BC_BOOL, 0, 0);
+    code->code.emplace_back(MATCH_BC_RET, 0, 0);
+    return code;
+}
+
+/*
+ * Get an integer field for MATCH_BC_CMP_FIELD.
+ */
+static intptr_t matchGetField(MatchKind kind, const InstrInfo *I)
+{
+    switch (kind)
+    {
+        case MATCH_ADDRESS:
+            return (intptr_t)I->address;
+        case MATCH_OFFSET:
+            return (intptr_t)I->offset;
+        default:
+            return (intptr_t)I->size;
+    }
+}
+
+/*
+ * Evaluate a compiled matching.
+ */
+bool matchEval(const MatchCode *code, const ELF &elf,
+    const std::vector<Instr> &Is, size_t idx, const InstrInfo *I)
+{
+    MatchVal r[code->nregs];
+    MatchVal buf[64 * code->nbufs + 1];
+    const MatchInstr *pc = code->code.data();
+    while (true)
+    {
+        MatchVal &dst = r[pc->dst];
+        switch (pc->opcode)
+        {
+            case MATCH_BC_RET:
+                return (r[pc->a].i != 0);
+            case MATCH_BC_CONST:
+                dst = pc->val; break;
+            case MATCH_BC_VAR:
+                dst = makeMatchValue(pc->var, &elf, Is, idx, I,
+                    buf + 64 * pc->buf);
+                break;
+            case MATCH_BC_ADDRESS:
+                dst = MatchVal((intptr_t)I->address); break;
+            case MATCH_BC_OFFSET:
+                dst = MatchVal((intptr_t)I->offset); break;
+            case MATCH_BC_SIZE:
+                dst = MatchVal((intptr_t)I->size); break;
+            case MATCH_BC_MNEMONIC:
+                dst = MatchVal(I->string.mnemonic); break;
+            case MATCH_BC_CATEGORY:
+                dst = MatchVal((intptr_t)((I->category & pc->mask) ==
+                    pc->mask));
+                break;
+            case MATCH_BC_CMP_FIELD:
+            {
+                intptr_t x = matchGetField(pc->kind, I), y = pc->val.i;
+                bool res = false;
+                switch (pc->op)
+                {
+                    case MATCH_OP_EQ:  res = (x == y); break;
+                    case MATCH_OP_NEQ: res = (x != y); break;
+                    case MATCH_OP_LT:  res = (x <  y); break;
+                    case MATCH_OP_LEQ: res = (x <= y); break;
+                    case MATCH_OP_GT:  res = (x >  y); break;
+                    case MATCH_OP_GEQ: res = (x >= y); break;
+                    default: break;
+                }
+                dst = MatchVal((intptr_t)res);
+                break;
+            }
+            case MATCH_BC_CMP_MNEMONIC:
+            {
+                bool eq = (strcmp(I->string.mnemonic, pc->val.str) == 0);
+                dst = MatchVal((intptr_t)(pc->op == MATCH_OP_EQ? eq: !eq));
+                break;
+            }
+            case MATCH_BC_BOOL:
+                dst = matchCastToBool(r[pc->a]); break;
+            case MATCH_BC_NOT:
+                dst = MatchVal((intptr_t)(matchCastToBool(r[pc->a]).i == 0));
+                break;
+            case MATCH_BC_DEFINED:
+                dst = MatchVal((intptr_t)(r[pc->a].type !=
+                    MATCH_TYPE_UNDEFINED));
+                break;
+            case MATCH_BC_CMP:
+                // Note: r[b] is stale if r[a] is undefined (see compiler)
+                dst = MatchVal((intptr_t)(r[pc->a].type !=
+                    MATCH_TYPE_UNDEFINED &&
+                    matchCompare(pc->op, r[pc->a], r[pc->b])));
+                break;
+            case MATCH_BC_ARITH:
+                dst = (r[pc->a].type != MATCH_TYPE_INTEGER? MatchVal():
+                    matchArith(pc->op, r[pc->a], r[pc->b]));
+                break;
+            case MATCH_BC_UNARY:
+                dst = matchUnary(pc->op, r[pc->a]); break;
+            case MATCH_BC_JUMP_IF_FALSE:
+                if (r[pc->a].i == 0)
+                {
+                    pc = code->code.data() + pc->target;
+                    continue;
+                }
+                break;
+            case MATCH_BC_JUMP_IF_TRUE:
+                if (r[pc->a].i != 0)
+                {
+                    pc = code->code.data() + pc->target;
+                    continue;
+                }
+                break;
+            case MATCH_BC_JUMP_IF_UNDEFINED:
+                if (r[pc->a].type == MATCH_TYPE_UNDEFINED)
+                {
+                    pc = code->code.data() + pc->target;
+                    continue;
+                }
+                break;
+            case MATCH_BC_JUMP_IF_NOT_INTEGER:
+                if (r[pc->a].type != MATCH_TYPE_INTEGER)
+                {
+                    pc = code->code.data() + pc->target;
+                    continue;
+                }
+                break;
+        }
+        pc++;
+    }
+}
+
+/*
+ * Evaluate a matching.
+ */
+bool matchEval(const MatchExpr *expr, const ELF &elf,
+    const std::vector<Instr> &Is, size_t idx, const InstrInfo *I)
+{
+    if (option_debug)
+    {
+        debug("%s0x%lx%s:\tinstr %s%s%s",
+            (option_is_tty? "\33[31m": ""), I->address,
+            (option_is_tty? "\33[0m": ""), (option_is_tty? "\33[32m": ""),
+            I->string.instr, (option_is_tty? "\33[0m": ""));
+    }
+    MatchVal buf[64];
+    MatchVal result = matchCastToBool(matchDoEval(expr, elf, Is, idx, I, buf));
+    bool pass = (result.i != 0);
+    if (option_debug)
+    {
+        std::string str_expr, str_val;
+        dumpExpr(*expr, str_expr);
+        dumpVal(result, str_val);
+        debug("%s0x%lx%s: expr %s = %s%s%s",
             (option_is_tty? "\33[31m": ""), I->address,
             (option_is_tty? "\33[0m": ""), str_expr.c_str(),
             (option_is_tty? (pass? "\33[32m": "\33[31m"): ""),
@@ -2523,3 +3349,265 @@ bool matchEval(const MatchExpr *expr, const ELF &elf,
     return pass;
 }
 
+/*
+ * Test if a matching can be evaluated concurrently (see `--threads').
+ */
+bool matchIsThreadSafe(const MatchExpr *expr)
+{
+    switch (expr->op)
+    {
+        case MATCH_OP_ARG:
+            if (expr->arg.inst != MATCH_INST_VAR)
+                return true;
+            switch (expr->arg.var->match)
+            {
+                case MATCH_RANDOM:
+                    return false;       // rand() is stateful
+                default:
+                    return true;
+            }
+        case MATCH_OP_DEFINED: case MATCH_OP_NOT: case MATCH_OP_NEG:
+        case MATCH_OP_BIT_NOT:
+            return matchIsThreadSafe(expr->lhs);
+        default:
+            return matchIsThreadSafe(expr->lhs) &&
+                   matchIsThreadSafe(expr->rhs);
+    }
+}
+
+/*
+ * Derive the necessary conditions for a comparison `var op val'.
+ */
+static bool matchFilterCompare(MatchOp op, const MatchExpr *var,
+    const MatchExpr *val, MatchFilter &filter)
+{
+    MatchVal k;
+    if (var->op != MATCH_OP_ARG || var->arg.inst != MATCH_INST_VAR ||
+            !matchIsLocal(var->arg.var) || !matchFold(val, k))
+        return false;
+    switch (var->arg.var->match)
+    {
+        case MATCH_MNEMONIC:
+            switch (op)
+            {
+                case MATCH_OP_EQ:
+                    if (k.type != MATCH_TYPE_STRING)
+                        return false;
+                    filter.any = false;
+                    filter.mnemonics.insert(k.str);
+                    return true;
+                case MATCH_OP_IN:
+                {
+                    if (k.type != MATCH_TYPE_SET)
+                        return false;
+                    std::set<std::string> mnemonics;
+                    for (const MatchVal *v = k.vals;
+                            v->type != MATCH_TYPE_UNDEFINED; v++)
+                    {
+                        // Note: non-string members can never match, but a
+                        //       regex may match any mnemonic.
+                        if (v->type == MATCH_TYPE_REGEX)
+                            return false;
+                        if (v->type == MATCH_TYPE_STRING)
+                            mnemonics.insert(v->str);
+                    }
+                    filter.any = false;
+                    filter.mnemonics = std::move(mnemonics);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        case MATCH_SIZE: case MATCH_ADDRESS:
+        {
+            if (k.type != MATCH_TYPE_INTEGER)
+                return false;
+            intptr_t lo = INTPTR_MIN, hi = INTPTR_MAX;
+            switch (op)
+            {
+                case MATCH_OP_EQ:
+                    lo = hi = k.i; break;
+                case MATCH_OP_LT:
+                    if (k.i == INTPTR_MIN)
+                        lo = INTPTR_MAX;            // Empty
+                    else
+                        hi = k.i - 1;
+                    break;
+                case MATCH_OP_LEQ:
+                    hi = k.i; break;
+                case MATCH_OP_GT:
+                    if (k.i == INTPTR_MAX)
+                        hi = INTPTR_MIN;            // Empty
+                    else
+                        lo = k.i + 1;
+                    break;
+                case MATCH_OP_GEQ:
+                    lo = k.i; break;
+                default:
+                    return false;
+            }
+            if (var->arg.var->match == MATCH_SIZE)
+            {
+                filter.size_lo = lo;
+                filter.size_hi = hi;
+            }
+            else
+            {
+                filter.addr_lo = lo;
+                filter.addr_hi = hi;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+ * Derive the necessary conditions for a match expression to pass.
+ */
+static MatchFilter matchDoFilter(const MatchExpr *expr)
+{
+    MatchFilter filter;
+    switch (expr->op)
+    {
+        case MATCH_OP_ARG:
+        {
+            if (expr->arg.inst != MATCH_INST_VAR ||
+                    !matchIsLocal(expr->arg.var))
+                return filter;
+            switch (expr->arg.var->match)
+            {
+                case MATCH_CALL:
+                    filter.category = CATEGORY_CALL; break;
+                case MATCH_JUMP:
+                    filter.category = CATEGORY_JUMP; break;
+                case MATCH_CONDJUMP:
+                    filter.category = CATEGORY_JUMP | CATEGORY_CONDITIONAL;
+                    break;
+                case MATCH_RETURN:
+                    filter.category = CATEGORY_RETURN; break;
+                case MATCH_X87:
+                    filter.category = CATEGORY_X87; break;
+                case MATCH_MMX:
+                    filter.category = CATEGORY_MMX; break;
+                case MATCH_SSE:
+                    filter.category = CATEGORY_SSE; break;
+                case MATCH_AVX:
+                    filter.category = CATEGORY_AVX; break;
+                case MATCH_AVX2:
+                    filter.category = CATEGORY_AVX2; break;
+                case MATCH_AVX512:
+                    filter.category = CATEGORY_AVX512; break;
+                default:
+                    break;
+            }
+            return filter;
+        }
+        case MATCH_OP_AND:
+        {
+            MatchFilter lhs = matchDoFilter(expr->lhs);
+            MatchFilter rhs = matchDoFilter(expr->rhs);
+            filter.any = (lhs.any && rhs.any);
+            if (lhs.any)
+                filter.mnemonics = std::move(rhs.mnemonics);
+            else if (rhs.any)
+                filter.mnemonics = std::move(lhs.mnemonics);
+            else
+            {
+                for (const auto &mnemonic: lhs.mnemonics)
+                    if (rhs.mnemonics.find(mnemonic) != rhs.mnemonics.end())
+                        filter.mnemonics.insert(mnemonic);
+            }
+            filter.category = (lhs.category | rhs.category);
+            filter.size_lo  = std::max(lhs.size_lo, rhs.size_lo);
+            filter.size_hi  = std::min(lhs.size_hi, rhs.size_hi);
+            filter.addr_lo  = std::max(lhs.addr_lo, rhs.addr_lo);
+            filter.addr_hi  = std::min(lhs.addr_hi, rhs.addr_hi);
+            return filter;
+        }
+        case MATCH_OP_OR:
+        {
+            MatchFilter lhs = matchDoFilter(expr->lhs);
+            MatchFilter rhs = matchDoFilter(expr->rhs);
+            filter.any = (lhs.any || rhs.any);
+            if (!filter.any)
+            {
+                filter.mnemonics = std::move(lhs.mnemonics);
+                filter.mnemonics.insert(rhs.mnemonics.begin(),
+                    rhs.mnemonics.end());
+            }
+            filter.category = (lhs.category & rhs.category);
+            filter.size_lo  = std::min(lhs.size_lo, rhs.size_lo);
+            filter.size_hi  = std::max(lhs.size_hi, rhs.size_hi);
+            filter.addr_lo  = std::min(lhs.addr_lo, rhs.addr_lo);
+            filter.addr_hi  = std::max(lhs.addr_hi, rhs.addr_hi);
+            return filter;
+        }
+        case MATCH_OP_EQ: case MATCH_OP_LT: case MATCH_OP_LEQ:
+        case MATCH_OP_GT: case MATCH_OP_GEQ: case MATCH_OP_IN:
+        {
+            if (matchFilterCompare(expr->op, expr->lhs, expr->rhs, filter))
+                return filter;
+            MatchOp op = expr->op;
+            switch (op)
+            {
+                case MATCH_OP_LT:  op = MATCH_OP_GT;  break;
+                case MATCH_OP_LEQ: op = MATCH_OP_GEQ; break;
+                case MATCH_OP_GT:  op = MATCH_OP_LT;  break;
+                case MATCH_OP_GEQ: op = MATCH_OP_LEQ; break;
+                case MATCH_OP_IN:  return filter;
+                default: break;
+            }
+            filter = MatchFilter();
+            matchFilterCompare(op, expr->rhs, expr->lhs, filter);
+            return filter;
+        }
+        default:
+            return filter;
+    }
+}
+
+/*
+ * Derive the necessary conditions for a match expression to pass.  These
+ * are used to prefilter the actions evaluated for each instruction.
+ */
+MatchFilter matchFilter(const MatchExpr *expr)
+{
+    // Skipping an evaluation is only safe if it has no side effects:
+    if (!matchIsThreadSafe(expr))
+        return MatchFilter();
+    return matchDoFilter(expr);
+}
+
+/*
+ * Get the InstrInfo tier needed to evaluate a match expression.
+ */
+unsigned matchTier(const MatchExpr *expr)
+{
+    switch (expr->op)
+    {
+        case MATCH_OP_ARG:
+            if (expr->arg.inst != MATCH_INST_VAR)
+                return INFO_BASIC;
+            if (expr->arg.var->i != 0)      // Uses a separate InstrInfo
+                return INFO_BASIC;
+            switch (expr->arg.var->match)
+            {
+                case MATCH_ASSEMBLY:
+                    return INFO_ALL;
+                case MATCH_TARGET: case MATCH_TARGET_NAME: case MATCH_PLT:
+                case MATCH_OP: case MATCH_SRC: case MATCH_DST:
+                case MATCH_IMM: case MATCH_REG: case MATCH_MEM:
+                case MATCH_REGS: case MATCH_READS: case MATCH_WRITES:
+                    return INFO_OPERANDS;
+                default:
+                    return INFO_BASIC;
+            }
+        case MATCH_OP_DEFINED: case MATCH_OP_NOT: case MATCH_OP_NEG:
+        case MATCH_OP_BIT_NOT:
+            return matchTier(expr->lhs);
+        default:
+            return std::max(matchTier(expr->lhs), matchTier(expr->rhs));
+    }
+}
@@ -37,10 +37,16 @@ struct Plugin
     std::vector<char *> argv;
     void *handle;
     void *context;
+    unsigned flags;
     intptr_t result;
+    size_t base;
+    std::vector<intptr_t> results;
+    std::vector<void *> contexts;
     PluginInit initFunc;
+    PluginInitThread initThreadFunc;
     PluginEvent eventFunc;
     PluginMatch matchFunc;
+    PluginMatchBatch matchBatchFunc;
     PluginCode codeFunc;
     PluginData dataFunc;
     PluginPatch patchFunc;
@@ -189,6 +195,7 @@ enum MatchKind
     MATCH_MNEMONIC,
     MATCH_MODRM,
     MATCH_OFFSET,
+    MATCH_PLT,
     MATCH_RANDOM,
     MATCH_RETURN,
     MATCH_REX,
@@ -196,6 +203,7 @@ enum MatchKind
     MATCH_SIB,
     MATCH_SIZE,
     MATCH_TARGET,
+    MATCH_TARGET_NAME,
     MATCH_X87,
     MATCH_SSE,
     MATCH_AVX,
@@ -379,6 +387,32 @@ struct MatchExpr
     }
 };
 
+/*
+ * Necessary conditions for a match expression to pass (see matchFilter()).
+ */
+struct MatchFilter
+{
+    bool any = true;                    // Any mnemonic?
+    std::set<std::string> mnemonics;    // Allowed mnemonics (if !any)
+    uint16_t category = 0x0;            // Required category bits
+    intptr_t size_lo = INTPTR_MIN;      // Size range
+    intptr_t size_hi = INTPTR_MAX;
+    intptr_t addr_lo = INTPTR_MIN;      // Address range
+    intptr_t addr_hi = INTPTR_MAX;
+
+    bool pass(const e9tool::InstrInfo *I) const
+    {
+        return ((I->category & category) == category &&
+                (intptr_t)I->size >= size_lo && (intptr_t)I->size <= size_hi &&
+                I->address >= addr_lo && I->address <= addr_hi);
+    }
+};
+
+/*
+ * A compiled match expression (see matchCompile()).
+ */
+struct MatchCode;
+
 /*
  * Patch kind.
  */
@@ -391,6 +425,10 @@ enum PatchKind
     PATCH_EXIT,
     PATCH_SIGNAL,
     PATCH_CALL,
+    PATCH_COUNT,
+    PATCH_COV,
+    PATCH_LOG,
+    PATCH_HOOK,
     PATCH_PLUGIN,
 };
 
@@ -412,10 +450,25 @@ struct Patch
     const char * const entry = nullptr;
     const e9tool::CallABI abi = e9tool::ABI_CLEAN;
     const e9tool::CallJump jmp = e9tool::JUMP_NONE;
+    const bool flags = false;
+    const bool inl = false;
+    const bool lea = false;
+    const bool tsc = false;
+    const unsigned entries = 0;
     const std::vector<e9tool::Argument> args;
+    const std::vector<e9tool::Guard> guard;
     mutable const e9tool::Call *call = nullptr;
+    mutable intptr_t map = 0x0;
+    mutable size_t sites = 0;
+    mutable intptr_t buf = 0x0;
+    mutable intptr_t func = 0x0;
     Plugin * const plugin = nullptr;
 
+    // Sampling (set by parsePatch() after construction):
+    unsigned sample = 0;
+    const char *sampler = nullptr;
+    mutable intptr_t sample_map = 0x0;
+
     Patch(const char *name, PatchKind kind, e9tool::PatchPos pos) :
         name(name), kind(kind), pos(pos)
     {
@@ -431,14 +484,32 @@ struct Patch
 
     Patch(const char *name, PatchKind kind, e9tool::PatchPos pos,
             const char *filename, const char *entry,
-            e9tool::CallABI abi, e9tool::CallJump jmp,
-            const std::vector<e9tool::Argument> &args) :
+            e9tool::CallABI abi, e9tool::CallJump jmp, bool flags, bool inl,
+            const std::vector<e9tool::Argument> &args,
+            const std::vector<e9tool::Guard> &guard) :
         name(name), kind(kind), pos(pos),
-        filename(filename), entry(entry), abi(abi), jmp(jmp), args(args)
+        filename(filename), entry(entry), abi(abi), jmp(jmp), flags(flags),
+        inl(inl), args(args), guard(guard)
     {
         assert(kind == PATCH_CALL);
     }
 
+    Patch(const char *name, PatchKind kind, e9tool::PatchPos pos, bool flags,
+            bool lea) :
+        name(name), kind(kind), pos(pos), flags(flags), lea(lea)
+    {
+        assert(kind == PATCH_COUNT || kind == PATCH_COV);
+    }
+
+    Patch(const char *name, PatchKind kind, e9tool::PatchPos pos,
+            const char *filename, const char *entry, bool tsc,
+            unsigned entries, const std::vector<e9tool::Argument> &args) :
+        name(name), kind(kind), pos(pos), filename(filename), entry(entry),
+        tsc(tsc), entries(entries), args(args)
+    {
+        assert(kind == PATCH_LOG || kind == PATCH_HOOK);
+    }
+
     Patch(const char *name, PatchKind kind, e9tool::PatchPos pos,
             Plugin *plugin) :
         name(name), kind(kind), pos(pos), plugin(plugin)
@@ -453,10 +524,15 @@ struct Patch
 struct Action
 {
     const MatchExpr * const match;
+    const MatchCode * const code;
+    const MatchFilter filter;
+    const unsigned tier;
     const std::vector<const Patch *> patch;
 
-    Action(const MatchExpr * match, std::vector<const Patch *> &&patch) :
-        match(match), patch(patch)
+    Action(const MatchExpr * match, const MatchCode *code,
+            MatchFilter &&filter, unsigned tier,
+            std::vector<const Patch *> &&patch) :
+        match(match), code(code), filter(filter), tier(tier), patch(patch)
     {
         ;
     }
@@ -467,8 +543,15 @@ struct Action
  */
 extern MatchExpr *parseMatch(const e9tool::ELF &elf, const char *str);
 extern const Patch *parsePatch(const e9tool::ELF &elf, const char *str);
+extern const MatchCode *matchCompile(const MatchExpr *expr);
 extern bool matchEval(const MatchExpr *expr, const e9tool::ELF &elf,
     const std::vector<e9tool::Instr> &Is, size_t idx,
     const e9tool::InstrInfo *I);
+extern bool matchEval(const MatchCode *code, const e9tool::ELF &elf,
+    const std::vector<e9tool::Instr> &Is, size_t idx,
+    const e9tool::InstrInfo *I);
+extern bool matchIsThreadSafe(const MatchExpr *expr);
+extern MatchFilter matchFilter(const MatchExpr *expr);
+extern unsigned matchTier(const MatchExpr *expr);
 
 #endif
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * PERSISTENT ANALYSIS CACHE.
+ *
+ * The disassembly (Is + desyncs) and CFG analysis (targets, BBs, Fs) are
+ * saved into a single flat file under the `--cache-dir' directory.  The
+ * file is named after a key that hashes the input binary and all options
+ * that affect the analysis, and can be mmap()'ed directly by later runs.
+ *
+ * File layout:
+ *
+ *      CacheHeader
+ *      Instr       Is[header.nIs]
+ *      CacheDesync desyncs[header.nDesyncs]
+ *      CacheTarget targets[header.nTargets]
+ *      CacheBB     bbs[header.nBBs]
+ *      CacheF      fs[header.nFs]
+ *      char        strs[header.nStrs]
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "e9cache.h"
+#include "e9misc.h"
+
+using namespace e9tool;
+
+#define CACHE_MAGIC         "E9CACHE"
+#define CACHE_VERSION       1
+
+/*
+ * Cache file structures.
+ */
+struct CacheHeader
+{
+    char magic[8];                  // CACHE_MAGIC
+    uint32_t version;               // CACHE_VERSION
+    uint32_t flags;                 // CACHE_* flags
+    uint64_t key;                   // Cache key
+    uint64_t nIs;                   // Number of instructions
+    uint64_t nDesyncs;              // Number of desyncs
+    uint64_t nTargets;              // Number of targets
+    uint64_t nBBs;                  // Number of BBs
+    uint64_t nFs;                   // Number of Fs
+    uint64_t nStrs;                 // String table size
+};
+struct CacheDesync
+{
+    int64_t lo;
+    int64_t hi;
+    int64_t addr;
+    uint32_t section;               // Offset into elf.strs
+    uint32_t byte;
+};
+struct CacheTarget
+{
+    int64_t addr;
+    uint64_t kind;
+};
+struct CacheBB
+{
+    uint32_t lb;
+    uint32_t ub;
+    uint32_t best;
+};
+struct CacheF
+{
+    uint64_t name;                  // Offset+1 into strs, or 0 for no name
+    uint32_t lb;
+    uint32_t ub;
+    uint32_t best;
+    uint32_t pad;
+};
+
+/*
+ * Hash data (64-bit FNV-1a).
+ */
+uint64_t hashData(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*
+ * Get the cache file name.
+ */
+static std::string getCacheFilename(const char *dir, uint64_t key)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.16lx", key);
+    std::string filename(dir);
+    filename += '/';
+    filename += buf;
+    filename += ".e9cache";
+    return filename;
+}
+
+/*
+ * Load the analysis cache (if it exists).  Note that the cache file remains
+ * mapped since the F names point into it.
+ */
+bool loadCache(const char *dir, uint64_t key, ELF &elf,
+    std::vector<Instr> &Is, std::vector<Desync> &desyncs, unsigned &flags)
+{
+    std::string filename = getCacheFilename(dir, key);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            warning("failed to open cache file \"%s\": %s", filename.c_str(),
+                strerror(errno));
+        return false;
+    }
+    struct stat buf;
+    if (fstat(fd, &buf) != 0)
+    {
+        warning("failed to stat cache file \"%s\": %s", filename.c_str(),
+            strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)buf.st_size;
+    if (size < sizeof(CacheHeader))
+    {
+        close(fd);
+        goto invalid;
+    }
+    {
+        const uint8_t *data = (const uint8_t *)mmap(nullptr, size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            warning("failed to map cache file \"%s\": %s", filename.c_str(),
+                strerror(errno));
+            return false;
+        }
+        const CacheHeader *header = (const CacheHeader *)data;
+        if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+                header->version != CACHE_VERSION || header->key != key ||
+                sizeof(CacheHeader) + header->nIs * sizeof(Instr) +
+                    header->nDesyncs * sizeof(CacheDesync) +
+                    header->nTargets * sizeof(CacheTarget) +
+                    header->nBBs * sizeof(CacheBB) +
+                    header->nFs * sizeof(CacheF) + header->nStrs != size)
+        {
+            munmap((void *)data, size);
+            goto invalid;
+        }
+
+        const uint8_t *ptr = data + sizeof(CacheHeader);
+        const Instr *is = (const Instr *)ptr;
+        Is.assign(is, is + header->nIs);
+        ptr += header->nIs * sizeof(Instr);
+
+        const CacheDesync *ds = (const CacheDesync *)ptr;
+        for (size_t i = 0; i < header->nDesyncs; i++)
+            desyncs.push_back({(intptr_t)ds[i].lo, (intptr_t)ds[i].hi,
+                (intptr_t)ds[i].addr, elf.strs + ds[i].section,
+                (uint8_t)ds[i].byte});
+        ptr += header->nDesyncs * sizeof(CacheDesync);
+
+        const CacheTarget *ts = (const CacheTarget *)ptr;
+        elf.targets.entries.reserve(header->nTargets);
+        for (size_t i = 0; i < header->nTargets; i++)
+            elf.targets.push((intptr_t)ts[i].addr, (TargetKind)ts[i].kind);
+        elf.targets.sort();
+        ptr += header->nTargets * sizeof(CacheTarget);
+
+        const CacheBB *bs = (const CacheBB *)ptr;
+        elf.bbs.reserve(header->nBBs);
+        for (size_t i = 0; i < header->nBBs; i++)
+            elf.bbs.emplace_back(bs[i].lb, bs[i].ub, bs[i].best);
+        ptr += header->nBBs * sizeof(CacheBB);
+
+        const CacheF *fs = (const CacheF *)ptr;
+        const char *strs =
+            (const char *)(ptr + header->nFs * sizeof(CacheF));
+        elf.fs.reserve(header->nFs);
+        for (size_t i = 0; i < header->nFs; i++)
+            elf.fs.emplace_back((fs[i].name == 0? nullptr:
+                strs + fs[i].name - 1), fs[i].lb, fs[i].ub, fs[i].best);
+
+        flags = header->flags;
+        debug("loaded analysis cache \"%s\" (%zu instructions)",
+            filename.c_str(), Is.size());
+        return true;
+    }
+
+invalid:
+    warning("ignoring invalid cache file \"%s\"", filename.c_str());
+    return false;
+}
+
+/*
+ * Write data to the cache file.
+ */
+static void writeCache(FILE *stream, const std::string &filename,
+    const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, size, 1, stream) != 1)
+        error("failed to write cache file \"%s\": %s", filename.c_str(),
+            strerror(errno));
+}
+
+/*
+ * Save the analysis cache.  The file is written to a temporary and then
+ * renamed, so concurrent runs never observe a partial file.
+ */
+void saveCache(const char *dir, uint64_t key, const ELF &elf,
+    const std::vector<Instr> &Is, const std::vector<Desync> &desyncs,
+    unsigned flags)
+{
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    {
+        warning("failed to create cache directory \"%s\": %s", dir,
+            strerror(errno));
+        return;
+    }
+    std::string filename = getCacheFilename(dir, key);
+    std::string tmpname(filename);
+    tmpname += ".XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if (fd < 0)
+    {
+        warning("failed to create cache file \"%s\": %s", tmpname.c_str(),
+            strerror(errno));
+        return;
+    }
+    FILE *stream = fdopen(fd, "w");
+    if (stream == nullptr)
+        error("failed to open cache file \"%s\": %s", tmpname.c_str(),
+            strerror(errno));
+
+    std::string strs;
+    std::vector<CacheF> fs;
+    if ((flags & CACHE_FS) != 0)
+    {
+        for (const auto &f: elf.fs)
+        {
+            uint64_t name = 0;
+            if (f.name != nullptr)
+            {
+                name = strs.size() + 1;
+                strs += f.name;
+                strs += '\0';
+            }
+            fs.push_back({name, f.lb, f.ub, f.best, 0});
+        }
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version  = CACHE_VERSION;
+    header.flags    = flags;
+    header.key      = key;
+    header.nIs      = Is.size();
+    header.nDesyncs = desyncs.size();
+    header.nTargets = ((flags & CACHE_TARGETS) != 0? elf.targets.size(): 0);
+    header.nBBs     = ((flags & CACHE_BBS) != 0? elf.bbs.size(): 0);
+    header.nFs      = fs.size();
+    header.nStrs    = strs.size();
+    writeCache(stream, tmpname, &header, sizeof(header));
+
+    writeCache(stream, tmpname, Is.data(), Is.size() * sizeof(Instr));
+    for (const auto &desync: desyncs)
+    {
+        CacheDesync entry = {desync.lo, desync.hi, desync.addr,
+            (uint32_t)(desync.section - elf.strs), desync.byte};
+        writeCache(stream, tmpname, &entry, sizeof(entry));
+    }
+    if ((flags & CACHE_TARGETS) != 0)
+    {
+        for (const auto &entry: elf.targets)
+        {
+            CacheTarget target = {entry.first, entry.second};
+            writeCache(stream, tmpname, &target, sizeof(target));
+        }
+    }
+    if ((flags & CACHE_BBS) != 0)
+    {
+        for (const auto &bb: elf.bbs)
+        {
+            CacheBB entry = {bb.lb, bb.ub, bb.best};
+            writeCache(stream, tmpname, &entry, sizeof(entry));
+        }
+    }
+    writeCache(stream, tmpname, fs.data(), fs.size() * sizeof(CacheF));
+    writeCache(stream, tmpname, strs.data(), strs.size());
+
+    if (fclose(stream) != 0)
+        error("failed to close cache file \"%s\": %s", tmpname.c_str(),
+            strerror(errno));
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+    {
+        warning("failed to rename cache file \"%s\" to \"%s\": %s",
+            tmpname.c_str(), filename.c_str(), strerror(errno));
+        unlink(tmpname.c_str());
+        return;
+    }
+    debug("saved analysis cache \"%s\"", filename.c_str());
+}
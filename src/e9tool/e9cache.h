@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __E9CACHE_H
+#define __E9CACHE_H
+
+#include <cstdint>
+
+#include <vector>
+
+#include "e9elf.h"
+#include "e9tool.h"
+
+/*
+ * Disassembler desync information.
+ */
+struct Desync
+{
+    intptr_t lo;
+    intptr_t hi;
+    intptr_t addr;
+    const char *section;
+    uint8_t byte;
+};
+
+/*
+ * Cached analysis information.
+ */
+#define CACHE_TARGETS       0x1
+#define CACHE_BBS           0x2
+#define CACHE_FS            0x4
+
+#define CACHE_HASH_INIT     0xcbf29ce484222325ull
+
+extern uint64_t hashData(uint64_t hash, const void *data, size_t size);
+extern bool loadCache(const char *dir, uint64_t key, e9tool::ELF &elf,
+    std::vector<e9tool::Instr> &Is, std::vector<Desync> &desyncs,
+    unsigned &flags);
+extern void saveCache(const char *dir, uint64_t key, const e9tool::ELF &elf,
+    const std::vector<e9tool::Instr> &Is, const std::vector<Desync> &desyncs,
+    unsigned flags);
+
+#endif
@@ -31,10 +31,18 @@
 
 #include <cstdint>
 
+#include <algorithm>
+#include <atomic>
 #include <set>
+#include <thread>
+#include <vector>
 
+#include <immintrin.h>
+
+#include "e9codegen.h"
 #include "e9elf.h"
 #include "e9tool.h"
+#include "e9x86_64.h"
 
 #define TARGET_ENTRY 0x08
 #define TARGET_ENDBR 0x10
@@ -42,6 +50,7 @@
 using namespace e9tool;
 
 extern bool option_debug;
+extern unsigned option_threads;
 #define DEBUG(targets, target, msg, ...)                                \
     do                                                                  \
     {                                                                   \
@@ -51,16 +60,44 @@ extern bool option_debug;
     while (false)
 
 /*
- * Insert target information.
+ * Sort the targets and merge any duplicates.
+ */
+void e9tool::Targets::sort(void)
+{
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const Entry &a, const Entry &b) {
+            return (a.first < b.first);
+        });
+    size_t j = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (j > 0 && entries[j-1].first == entries[i].first)
+            entries[j-1].second |= entries[i].second;
+        else
+            entries[j++] = entries[i];
+    }
+    entries.resize(j);
+}
+
+/*
+ * Insert target information.  The targets must be sorted once all targets
+ * have been added.
  */
 static void addTarget(intptr_t target, TargetKind kind, Targets &targets)
 {
-    auto r = targets.insert({target, kind});
-    if (!r.second)
+    if (!option_debug)
     {
-        // Existing entry found:
-        r.first->second |= kind;
-    }  
+        targets.push(target, kind);
+        return;
+    }
+
+    // Debug mode keeps the targets sorted so that DEBUG() works:
+    auto i = std::lower_bound(targets.begin(), targets.end(),
+        Targets::Entry(target, 0));
+    if (i != targets.end() && i->first == target)
+        i->second |= kind;          // Existing entry found
+    else
+        targets.entries.insert(i, {target, kind});
 }
 
 /*
@@ -245,6 +282,68 @@ static void CFGCodeAnalysis(const ELF *elf, bool pic, const Instr *Is,
     }
 }
 
+/*
+ * Skip data words that cannot be code pointers, i.e., are outside of the
+ * range [lo..lo+span].  Returns a pointer to the first candidate word, or
+ * `end' if there is none.
+ */
+typedef const intptr_t *(*SkipFunc)(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span);
+static const intptr_t *skipWords(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span)
+{
+    for (; p < end && (uintptr_t)*p - (uintptr_t)lo > span; p++)
+        ;
+    return p;
+}
+__attribute__((__target__("avx2")))
+static const intptr_t *skipWordsAVX2(const intptr_t *p, const intptr_t *end,
+    intptr_t lo, uintptr_t span)
+{
+    // AVX2 has no unsigned 64-bit compare, so bias both sides instead:
+    const __m256i bias  = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i vlo   = _mm256_set1_epi64x(lo);
+    const __m256i vspan = _mm256_set1_epi64x((intptr_t)span ^ INT64_MIN);
+    for (; end - p >= 4; p += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        x = _mm256_xor_si256(_mm256_sub_epi64(x, vlo), bias);
+        __m256i out = _mm256_cmpgt_epi64(x, vspan);
+        if (_mm256_movemask_pd(_mm256_castsi256_pd(out)) != 0xF)
+            break;
+    }
+    return skipWords(p, end, lo, span);
+}
+__attribute__((__target__("avx512f")))
+static const intptr_t *skipWordsAVX512(const intptr_t *p,
+    const intptr_t *end, intptr_t lo, uintptr_t span)
+{
+    const __m512i vlo   = _mm512_set1_epi64(lo);
+    const __m512i vspan = _mm512_set1_epi64((intptr_t)span);
+    for (; end - p >= 8; p += 8)
+    {
+        __m512i x = _mm512_loadu_si512((const void *)p);
+        x = _mm512_sub_epi64(x, vlo);
+        __mmask8 in = _mm512_cmple_epu64_mask(x, vspan);
+        if (in != 0)
+            return p + __builtin_ctz((unsigned)in);
+    }
+    return skipWords(p, end, lo, span);
+}
+
+/*
+ * Select the best skipWords() implementation for this CPU.
+ */
+static SkipFunc getSkipFunc(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return skipWordsAVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return skipWordsAVX2;
+    return skipWords;
+}
+
 /*
  * Section analysis pass: find potential code pointers in data.
  */
@@ -252,7 +351,8 @@ static void CFGSectionAnalysis(const ELF *elf, bool pic, const char *name,
     const Elf64_Shdr *shdr, const Instr *Is, size_t size,
     const std::set<intptr_t> &tables, Targets &targets)
 {
-    if ((shdr->sh_flags & SHF_EXECINSTR) != 0 || shdr->sh_addr == 0x0)
+    if ((shdr->sh_flags & SHF_EXECINSTR) != 0 || shdr->sh_addr == 0x0 ||
+            size == 0)
         return;
     
     const uint8_t *sh_data = getELFData(elf) + shdr->sh_offset;
@@ -268,11 +368,23 @@ static void CFGSectionAnalysis(const ELF *elf, bool pic, const char *name,
                 return;
         }
 
-        // Scan the data for absolute addresses.
+        // Scan the data for absolute addresses.  Most words are not code
+        // pointers, so runs of out-of-range words are skipped first.
+        static const SkipFunc skip = getSkipFunc();
+        intptr_t lo = (intptr_t)Is[0].address;
+        uintptr_t span = (uintptr_t)(Is[size-1].address - Is[0].address);
         auto bounds = getBounds<intptr_t>(sh_data, sh_data + sh_size);
         bool call = true;
         for (const intptr_t *p = bounds.first; p < bounds.second; p++)
         {
+            const intptr_t *q = skip(p, bounds.second, lo, span);
+            if (q != p)
+            {
+                call = true;
+                p = q;
+                if (p >= bounds.second)
+                    break;
+            }
             intptr_t table = (intptr_t)shdr->sh_addr +
                 ((intptr_t)p - (intptr_t)sh_data);
             if (tables.find(table) != tables.end())
@@ -298,13 +410,17 @@ static void CFGSectionAnalysis(const ELF *elf, bool pic, const char *name,
         //       because it is possible that a non-PIC binary was compiled
         //       with -fPIC.
         auto bounds = getBounds<int32_t>(sh_data, sh_data + sh_size);
-        for (const int32_t *p = bounds.first; p < bounds.second; p++)
+        intptr_t lb = (intptr_t)shdr->sh_addr +
+            ((intptr_t)bounds.first - (intptr_t)sh_data);
+        intptr_t ub = (intptr_t)shdr->sh_addr +
+            ((intptr_t)bounds.second - (intptr_t)sh_data);
+        for (auto i = tables.lower_bound(lb); i != tables.end() && *i < ub;
+                ++i)
         {
-            intptr_t table = (intptr_t)shdr->sh_addr +
-                ((intptr_t)p - (intptr_t)sh_data);
-            auto i = tables.find(table);
-            if (i == tables.end())
+            intptr_t table = *i;
+            if ((table - lb) % sizeof(int32_t) != 0)
                 continue;
+            const int32_t *p = bounds.first + (table - lb) / sizeof(int32_t);
 
             // This is "probably" a PIC-style jump table.
             for (const int32_t *q = p; q < bounds.second; q++)
@@ -351,9 +467,38 @@ static void CFGDataAnalysis(const ELF *elf, bool pic, const Instr *Is,
     }
 
     // Analyze each data section:
-    for (const auto &entry: sections)
-        CFGSectionAnalysis(elf, pic, entry.first, entry.second, Is, size,
-            tables, targets);
+    size_t num_threads = option_threads;
+    if (num_threads <= 1 || option_debug || sections.size() <= 1)
+    {
+        for (const auto &entry: sections)
+            CFGSectionAnalysis(elf, pic, entry.first, entry.second, Is, size,
+                tables, targets);
+        return;
+    }
+
+    // Parallel analysis: Sections are claimed dynamically by each thread,
+    // and the thread-local targets are merged afterwards.  The merge order
+    // does not matter, since the targets are sorted (and merged) later.
+    std::vector<std::pair<const char *, const Elf64_Shdr *>> work(
+        sections.begin(), sections.end());
+    num_threads = std::min(num_threads, work.size());
+    std::vector<Targets> local(num_threads);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&, t]() {
+            size_t i;
+            while ((i = next++) < work.size())
+                CFGSectionAnalysis(elf, pic, work[i].first, work[i].second,
+                    Is, size, tables, local[t]);
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+    for (const auto &ts: local)
+        for (const auto &entry: ts)
+            targets.push(entry.first, entry.second);
 }
 
 /*
@@ -378,6 +523,7 @@ void e9tool::buildTargets(const ELF *elf, const Instr *Is, size_t size,
     
     // Pass #2: Find all data targets.
     CFGDataAnalysis(elf, pic, Is, size, tables, targets);
+    targets.sort();
 
     // Pass #3: "Clean up" the targets.
     Targets new_targets;
@@ -415,8 +561,9 @@ void e9tool::buildTargets(const ELF *elf, const Instr *Is, size_t size,
             continue;   // No target found.
         
         // Add target:
-        addTarget((intptr_t)Is[i].address, kind, new_targets);
+        new_targets.push((intptr_t)Is[i].address, kind);
     }
+    new_targets.sort();
 
     // Pass #4: Normalize the target kinds.
     for (auto &entry: targets)
@@ -438,13 +585,21 @@ void e9tool::buildTargets(const ELF *elf, const Instr *Is, size_t size,
 void e9tool::buildBBs(const ELF *elf, const Instr *Is, size_t size,
     const Targets &targets, BBs &bbs)
 {
-    std::map<uint32_t, BB> tmp;
-    for (const auto &entry: targets)
+    // Note: the targets are sorted, so the BBs are built in sorted order.
+    std::vector<bool> entry(size);
+    std::vector<uint32_t> lbs;
+    lbs.reserve(targets.size());
+    for (const auto &target: targets)
     {
-        intptr_t target = entry.first;
-        size_t i = findInstr(Is, size, target);
-        if (i >= size)
+        ssize_t i = findInstr(Is, size, target.first);
+        if (i < 0)
             continue;
+        entry[i] = true;
+        lbs.push_back((uint32_t)i);
+    }
+    bbs.reserve(lbs.size());
+    for (size_t i: lbs)
+    {
         uint32_t lb = i, ub = i, best = i;
         const Instr *I = Is + i;
 
@@ -479,7 +634,7 @@ void e9tool::buildBBs(const ELF *elf, const Instr *Is, size_t size,
             const Instr *J = I+1;
             if (I->address + I->size != J->address)
                 break;
-            if (targets.find(J->address) != targets.end())
+            if (entry[i])
                 break;
             ub++;
             if (Is[best].size < /*sizeof(jmpq)=*/5 &&
@@ -490,13 +645,8 @@ void e9tool::buildBBs(const ELF *elf, const Instr *Is, size_t size,
         debug("basic block 0x%lx..0x%lx [%zui,%zuB]", Is[lb].address,
             Is[ub].address, ub - lb + 1, 
             Is[ub].address - Is[lb].address + Is[ub].size);
-        BB bb(lb, ub, best);
-        tmp.insert({lb, bb});
+        bbs.emplace_back(lb, ub, best);
     }
-
-    bbs.reserve(tmp.size());
-    for (const auto &entry: tmp)
-        bbs.push_back(entry.second);
 }
 
 /*
@@ -540,15 +690,22 @@ void e9tool::buildFs(const ELF *elf, const Instr *Is, size_t size,
             names.insert({target, name});
         }
     }
-    std::map<uint32_t, F> tmp;
-    for (const auto &entry: targets)
+    // Note: the targets are sorted, so the Fs are built in sorted order.
+    std::vector<bool> entry(size);
+    std::vector<uint32_t> lbs;
+    for (const auto &target: targets)
     {
-        if ((entry.second & TARGET_FUNCTION) == 0)
+        if ((target.second & TARGET_FUNCTION) == 0)
             continue;
-        intptr_t target = entry.first;
-        size_t i = findInstr(Is, size, target);
-        if (i >= size)
+        ssize_t i = findInstr(Is, size, target.first);
+        if (i < 0)
             continue;
+        entry[i] = true;
+        lbs.push_back((uint32_t)i);
+    }
+    fs.reserve(lbs.size());
+    for (size_t i: lbs)
+    {
         uint32_t lb = i, ub = i, best = i;
         bool found = false;
         const Instr *I = Is + i;
@@ -584,8 +741,7 @@ void e9tool::buildFs(const ELF *elf, const Instr *Is, size_t size,
             const Instr *J = I+1;
             if (I->address + I->size != J->address)
                 break;
-            auto j = targets.find(J->address);
-            if (j != targets.end() && (j->second & TARGET_FUNCTION) != 0)
+            if (entry[i])
                 break;
             ub++;
             if (!found && Is[best].size < /*sizeof(jmpq)=*/5 &&
@@ -599,13 +755,8 @@ void e9tool::buildFs(const ELF *elf, const Instr *Is, size_t size,
             Is[ub].address, ub - lb + 1, 
             Is[ub].address - Is[lb].address + Is[ub].size,
             (name == nullptr? "": ",name="), (name == nullptr? "": name));
-        F f(name, lb, ub, best);
-        tmp.insert({lb, f});
+        fs.emplace_back(name, lb, ub, best);
     }
-
-    fs.reserve(tmp.size());
-    for (const auto &entry: tmp)
-        fs.push_back(entry.second);
 }
 
 /*
@@ -627,6 +778,202 @@ const F *e9tool::findF(const Fs &fs, size_t idx)
     return nullptr;
 }
 
+/*
+ * Get the registers used (read before written) and defined (overwritten)
+ * by an instruction.
+ */
+static void getUseDef(const InstrInfo *I, RegSet &use, RegSet &def)
+{
+    use = def = 0x0;
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_CALL: case MNEMONIC_RET: case MNEMONIC_IRETQ:
+        case MNEMONIC_SYSCALL: case MNEMONIC_SYSENTER: case MNEMONIC_SYSRET:
+        case MNEMONIC_JCXZ: case MNEMONIC_JECXZ: case MNEMONIC_JRCXZ:
+        case MNEMONIC_LOOP: case MNEMONIC_LOOPE: case MNEMONIC_LOOPNE:
+        case MNEMONIC_INT: case MNEMONIC_INT1: case MNEMONIC_INT3:
+        case MNEMONIC_INTO: case MNEMONIC_XBEGIN: case MNEMONIC_XABORT:
+        case MNEMONIC_UD0: case MNEMONIC_UD1: case MNEMONIC_UD2:
+        case MNEMONIC_HLT:
+            // Control-flow leaves the function, or the register usage is
+            // not fully described by the operands (e.g., syscall
+            // arguments).  Assume every register is used.
+            use = REGSET_ALL;
+            return;
+        default:
+            break;
+    }
+    for (unsigned i = 0; I->regs.read[i] != REGISTER_INVALID; i++)
+    {
+        int regno = getRegIdx(I->regs.read[i]);
+        use |= (regno < 0? 0x0: (RegSet)1 << regno);
+    }
+    for (unsigned i = 0; I->regs.condread[i] != REGISTER_INVALID; i++)
+    {
+        int regno = getRegIdx(I->regs.condread[i]);
+        use |= (regno < 0? 0x0: (RegSet)1 << regno);
+    }
+    for (unsigned i = 0; I->regs.write[i] != REGISTER_INVALID; i++)
+    {
+        // Only 32-bit and 64-bit writes overwrite the whole register.
+        // Conditional writes never do.
+        Register reg = I->regs.write[i];
+        int regno = getRegIdx(reg);
+        if (regno >= 0 && getRegSize(reg) >= (int32_t)sizeof(int32_t))
+            def |= (RegSet)1 << regno;
+    }
+
+    // The flags are tracked as a single register.  The flags are only
+    // killed if every flag saved by the trampoline (OSZAPC) is written.
+    // Shifts/rotates are excluded, since a zero count leaves the flags
+    // unchanged.
+    const RegSet rflags = (RegSet)1 << RFLAGS_IDX;
+    use |= (I->flags.read != 0x0? rflags: 0x0);
+    def &= ~rflags;
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_SHL: case MNEMONIC_SHR: case MNEMONIC_SAR:
+        case MNEMONIC_SHLD: case MNEMONIC_SHRD: case MNEMONIC_ROL:
+        case MNEMONIC_ROR: case MNEMONIC_RCL: case MNEMONIC_RCR:
+            break;
+        default:
+            if ((I->flags.write & FLAG_ALL) == FLAG_ALL)
+                def |= rflags;
+            break;
+    }
+}
+
+/*
+ * Find the index of the basic block with entry instruction `idx' that
+ * belongs to function `f', else -1.
+ */
+static ssize_t findSucc(const BBs &bbs, const Fs &fs, const F *f, ssize_t idx)
+{
+    if (idx < 0)
+        return -1;
+    const BB *bb = findBB(bbs, (size_t)idx);
+    if (bb == nullptr || bb->lb != (size_t)idx || findF(fs, idx) != f)
+        return -1;
+    return bb - bbs.data();
+}
+
+/*
+ * Build the register liveness information.  The analysis is
+ * intra-procedural and conservative: all registers are assumed live at
+ * calls, returns, indirect jumps, and at any edge that leaves the function
+ * or is unknown (i.e., the CFG is incomplete).  Instructions outside of
+ * any basic block or function also have all registers live.
+ */
+void e9tool::buildLiveness(const ELF *elf, const Instr *Is, size_t size,
+    const BBs &bbs, const Fs &fs, Liveness &live)
+{
+    live.assign(size, {REGSET_ALL, REGSET_ALL});
+    size_t num_bbs = bbs.size();
+    std::vector<RegSet> iuse(size), idef(size);
+    std::vector<RegSet> use(num_bbs), def(num_bbs), in(num_bbs, 0x0);
+    std::vector<ssize_t> succ(2 * num_bbs);
+    std::vector<bool> unknown(num_bbs);
+    for (size_t b = 0; b < num_bbs; b++)
+    {
+        const BB &bb = bbs[b];
+        const F *f = findF(fs, bb.lb);
+        RegSet u = 0x0, d = 0x0;
+        InstrInfo info0, *info = &info0;
+        for (ssize_t i = bb.ub; i >= (ssize_t)bb.lb; i--)
+        {
+            decodeInstrInfo(elf, Is + i, info, nullptr, INFO_OPERANDS);
+            getUseDef(info, iuse[i], idef[i]);
+            u  = iuse[i] | (u & ~idef[i]);
+            d |= idef[i];
+            if (i != (ssize_t)bb.ub)
+                continue;
+
+            // Successors:
+            ssize_t target = -1, next = -1;
+            bool fallthrough = true, jump = false;
+            switch (info->mnemonic)
+            {
+                case MNEMONIC_JMP:
+                    fallthrough = false;
+                    // Fallthrough
+                case MNEMONIC_JO: case MNEMONIC_JNO: case MNEMONIC_JB:
+                case MNEMONIC_JAE: case MNEMONIC_JE: case MNEMONIC_JNE:
+                case MNEMONIC_JBE: case MNEMONIC_JA: case MNEMONIC_JS:
+                case MNEMONIC_JNS: case MNEMONIC_JP: case MNEMONIC_JNP:
+                case MNEMONIC_JL: case MNEMONIC_JGE: case MNEMONIC_JLE:
+                case MNEMONIC_JG:
+                    jump = true;
+                    if (info->op[0].type == OPTYPE_IMM)
+                        target = findInstr(Is, size, (intptr_t)info->address +
+                            (intptr_t)info->size + (intptr_t)info->op[0].imm);
+                    break;
+                case MNEMONIC_RET: case MNEMONIC_INT: case MNEMONIC_INT1:
+                case MNEMONIC_INT3: case MNEMONIC_INTO: case MNEMONIC_UD0:
+                case MNEMONIC_UD1: case MNEMONIC_UD2: case MNEMONIC_HLT:
+                    fallthrough = false;
+                    break;
+                default:
+                    break;
+            }
+            if (fallthrough && (size_t)i + 1 < size &&
+                    Is[i].address + Is[i].size == Is[i+1].address)
+                next = (ssize_t)i + 1;
+            ssize_t s0 = (jump? findSucc(bbs, fs, f, target): -2);
+            ssize_t s1 = (fallthrough? findSucc(bbs, fs, f, next): -2);
+            unknown[b] = (f == nullptr || s0 == -1 || s1 == -1);
+            succ[2 * b]     = s0;
+            succ[2 * b + 1] = s1;
+        }
+        use[b] = u;
+        def[b] = d;
+    }
+
+    // Iterate to a fixed point.  The BBs are sorted, so visiting them in
+    // reverse order usually converges quickly.
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (ssize_t b = (ssize_t)num_bbs - 1; b >= 0; b--)
+        {
+            RegSet out = (unknown[b]? REGSET_ALL: 0x0);
+            for (unsigned k = 0; !unknown[b] && k < 2; k++)
+            {
+                ssize_t s = succ[2 * b + k];
+                out |= (s < 0? 0x0: in[s]);
+            }
+            RegSet in_b = use[b] | (out & ~def[b]);
+            if (in_b != in[b])
+            {
+                in[b] = in_b;
+                changed = true;
+            }
+        }
+    }
+
+    // Propagate to each instruction:
+    size_t num_dead = 0;
+    for (size_t b = 0; b < num_bbs; b++)
+    {
+        const BB &bb = bbs[b];
+        RegSet x = (unknown[b]? REGSET_ALL: 0x0);
+        for (unsigned k = 0; !unknown[b] && k < 2; k++)
+        {
+            ssize_t s = succ[2 * b + k];
+            x |= (s < 0? 0x0: in[s]);
+        }
+        for (ssize_t i = bb.ub; i >= (ssize_t)bb.lb; i--)
+        {
+            live[i].out = x;
+            x = iuse[i] | (x & ~idef[i]);
+            live[i].in = x;
+            num_dead += (x != REGSET_ALL);
+        }
+    }
+    debug("liveness: %zu/%zu instructions with dead registers", num_dead,
+        size);
+}
+
 /*
  * Dump all analysis info to CSV files.
  */
@@ -22,10 +22,12 @@
  */
 
 #include <cassert>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 
 #include "e9codegen.h"
+#include "e9elf.h"
 #include "e9tool.h"
 #include "e9types.h"
 
@@ -789,7 +791,8 @@ const int *getCallerSaveRegs(bool sysv, bool clean, bool state,
 /*
  * Move a register to stack.
  */
-static bool sendMovBetweenRegAndStack(FILE *out, Register reg, bool to_stack)
+static bool sendMovBetweenRegAndStack(CodeBuffer &out, Register reg,
+    bool to_stack)
 {
     uint8_t opcode = (to_stack? 0x7f: 0x6f);
     uint8_t modrm = 0;
@@ -861,94 +864,84 @@ static bool sendMovBetweenRegAndStack(FILE *out, Register reg, bool to_stack)
         case REGISTER_XMM3: case REGISTER_XMM4: case REGISTER_XMM5:
         case REGISTER_XMM6: case REGISTER_XMM7:
             // movdqu %xmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,", 0xf3, 0x0f, opcode, modrm, 0x24);
+            out.emit(0xf3, 0x0f, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_YMM0: case REGISTER_YMM1: case REGISTER_YMM2:
         case REGISTER_YMM3: case REGISTER_YMM4: case REGISTER_YMM5:
         case REGISTER_YMM6: case REGISTER_YMM7:
             // vmovdqu %ymm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,", 0xc5, 0xfe, opcode, modrm, 0x24);
+            out.emit(0xc5, 0xfe, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_ZMM0: case REGISTER_ZMM1: case REGISTER_ZMM2:
         case REGISTER_ZMM3: case REGISTER_ZMM4: case REGISTER_ZMM5:
         case REGISTER_ZMM6: case REGISTER_ZMM7:
             // vmovdqu64 %zmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,", 0x62, 0xf1, 0xfe, 0x48,
-                opcode, modrm, 0x24);
+            out.emit(0x62, 0xf1, 0xfe, 0x48, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_XMM8: case REGISTER_XMM9: case REGISTER_XMM10:
         case REGISTER_XMM11: case REGISTER_XMM12: case REGISTER_XMM13:
         case REGISTER_XMM14: case REGISTER_XMM15:
             // movdqu %xmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,",
-                0xf3, 0x44, 0x0f, opcode, modrm, 0x24);
+            out.emit(0xf3, 0x44, 0x0f, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_YMM8: case REGISTER_YMM9: case REGISTER_YMM10:
         case REGISTER_YMM11: case REGISTER_YMM12: case REGISTER_YMM13:
         case REGISTER_YMM14: case REGISTER_YMM15:
             // vmovdqu %ymm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,",
-                0xc5, 0x7e, opcode, modrm, 0x24);
+            out.emit(0xc5, 0x7e, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_ZMM8: case REGISTER_ZMM9: case REGISTER_ZMM10:
         case REGISTER_ZMM11: case REGISTER_ZMM12: case REGISTER_ZMM13:
         case REGISTER_ZMM14: case REGISTER_ZMM15:
             // vmovdqu64 %zmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,", 0x62, 0x71, 0xfe, 0x48,
-                opcode, modrm, 0x24);
+            out.emit(0x62, 0x71, 0xfe, 0x48, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_XMM16: case REGISTER_XMM17: case REGISTER_XMM18:
         case REGISTER_XMM19: case REGISTER_XMM20: case REGISTER_XMM21:
         case REGISTER_XMM22: case REGISTER_XMM23:
             // vmovdqu64 %xmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,",
-                0x62, 0xe1, 0xfe, 0x08, opcode, modrm, 0x24);
+            out.emit(0x62, 0xe1, 0xfe, 0x08, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_YMM16: case REGISTER_YMM17: case REGISTER_YMM18:
         case REGISTER_YMM19: case REGISTER_YMM20: case REGISTER_YMM21:
         case REGISTER_YMM22: case REGISTER_YMM23:
             // vmovdqu64 %ymm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,",
-                0x62, 0xe1, 0xfe, 0x28, opcode, modrm, 0x24);
+            out.emit(0x62, 0xe1, 0xfe, 0x28, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_ZMM16: case REGISTER_ZMM17: case REGISTER_ZMM18:
         case REGISTER_ZMM19: case REGISTER_ZMM20: case REGISTER_ZMM21:
         case REGISTER_ZMM22: case REGISTER_ZMM23:
             // vmovdqu64 %zmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,", 0x62, 0xe1, 0xfe, 0x48,
-                opcode, modrm, 0x24);
+            out.emit(0x62, 0xe1, 0xfe, 0x48, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_XMM24: case REGISTER_XMM25: case REGISTER_XMM26:
         case REGISTER_XMM27: case REGISTER_XMM28: case REGISTER_XMM29:
         case REGISTER_XMM30: case REGISTER_XMM31:
             // vmovdqu64 %xmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,",
-                0x62, 0x61, 0xfe, 0x08, opcode, modrm, 0x24);
+            out.emit(0x62, 0x61, 0xfe, 0x08, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_YMM24: case REGISTER_YMM25: case REGISTER_YMM26:
         case REGISTER_YMM27: case REGISTER_YMM28: case REGISTER_YMM29:
         case REGISTER_YMM30: case REGISTER_YMM31:
             // vmovdqu64 %xmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,",
-                0x62, 0x61, 0xfe, 0x28, opcode, modrm, 0x24);
+            out.emit(0x62, 0x61, 0xfe, 0x28, opcode, modrm, 0x24);
             return true;
 
         case REGISTER_ZMM24: case REGISTER_ZMM25: case REGISTER_ZMM26:
         case REGISTER_ZMM27: case REGISTER_ZMM28: case REGISTER_ZMM29:
         case REGISTER_ZMM30: case REGISTER_ZMM31:
             // vmovdqu64 %zmm,(%rsp)
-            fprintf(out, "%u,%u,%u,%u,%u,%u,%u,", 0x62, 0x61, 0xfe, 0x48,
-                opcode, modrm, 0x24);
+            out.emit(0x62, 0x61, 0xfe, 0x48, opcode, modrm, 0x24);
             return true;
 
         default:
@@ -956,10 +949,117 @@ static bool sendMovBetweenRegAndStack(FILE *out, Register reg, bool to_stack)
     }
 }
 
+/*
+ * For inlined calls, only save the caller-save registers `rsave' that are
+ * clobbered by the inlined body, as well as %rax, the argument registers,
+ * %rflags (if forced), and the first register for conditional calls.
+ */
+const int *getInlineCallerSaveRegs(bool sysv, const Call &call,
+    const int *rsave, int *buf)
+{
+    if (call.inl == nullptr)
+        return rsave;
+    RegSet regs = call.inl->clobbers;
+    regs |= (1 << RAX_IDX) | (1 << RSP_IDX) | (1 << RIP_IDX);
+    regs |= (call.flags? (1 << RFLAGS_IDX): 0x0);
+    for (size_t argno = 0; argno < call.args.size(); argno++)
+    {
+        int regno = getArgRegIdx(sysv, (int)argno);
+        regs |= (regno < 0? 0x0: (RegSet)1 << regno);
+    }
+    bool conditional = (call.jmp != JUMP_NONE);
+    int j = 0;
+    for (int i = 0; rsave[i] >= 0; i++)
+    {
+        if ((i == 0 && conditional) || (regs & ((RegSet)1 << rsave[i])) != 0)
+            buf[j++] = rsave[i];
+    }
+    buf[j] = -1;
+    return buf;
+}
+
+/*
+ * Emit a symbolic template entry.
+ */
+void CodeBuffer::emitEntry(const char *format, ...)
+{
+    char buf[BUFSIZ];
+    va_list ap;
+    va_start(ap, format);
+    int r = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (r < 0 || r >= (int)sizeof(buf))
+        error("failed to emit template entry; entry is too long");
+    symbols += buf;
+    fixups.push_back({bytes.size(), symbols.size()});
+}
+
+/*
+ * Send the bytes [i..j) of a code buffer as {"hex":...} entries.
+ */
+static void sendHexEntries(FILE *out, const CodeBuffer &code, size_t i,
+    size_t j)
+{
+    static const char XDIGIT[] = "0123456789abcdef";
+    char buf[sizeof("{\"hex\":\"\"},") + 2 * CODE_HEX_MAX];
+    while (i < j)
+    {
+        size_t n = (j - i > CODE_HEX_MAX? CODE_HEX_MAX: j - i);
+        size_t k = 0;
+        memcpy(buf + k, "{\"hex\":\"", 8); k += 8;
+        for (size_t l = 0; l < n; l++)
+        {
+            uint8_t b = code.bytes[i + l];
+            buf[k++] = XDIGIT[b >> 4];
+            buf[k++] = XDIGIT[b & 0xF];
+        }
+        memcpy(buf + k, "\"},", 3); k += 3;
+        fwrite(buf, sizeof(char), k, out);
+        i += n;
+    }
+}
+
+/*
+ * Send (and clear) a code buffer as a sequence of template entries.
+ */
+void sendCodeBuffer(FILE *out, CodeBuffer &code)
+{
+    size_t i = 0, s = 0;
+    for (const auto &fixup: code.fixups)
+    {
+        sendHexEntries(out, code, i, fixup.offset);
+        fwrite(code.symbols.c_str() + s, sizeof(char), fixup.end - s, out);
+        putc(',', out);
+        i = fixup.offset;
+        s = fixup.end;
+    }
+    sendHexEntries(out, code, i, code.bytes.size());
+    code.clear();
+}
+
+/*
+ * Send an inlined call body in place of the call instruction.
+ */
+void sendInlineCode(CodeBuffer &out, const Inline &inl)
+{
+    size_t k = 0;
+    for (size_t i = 0; i < inl.code.size(); i++)
+    {
+        if (k < inl.relocs.size() && inl.relocs[k].first == i)
+        {
+            out.emitEntry("{\"rel32\":%d}", (int32_t)inl.relocs[k].second);
+            i += sizeof(int32_t) - 1;
+            k++;
+            continue;
+        }
+        out.emit(inl.code[i]);
+    }
+}
+
 /*
  * Send (or emulate) a push instruction.
  */
-std::pair<bool, bool> sendPush(FILE *out, int32_t offset, bool before,
+std::pair<bool, bool> sendPush(CodeBuffer &out, int32_t offset, bool before,
     Register reg, Register rscratch)
 {
     // Special cases:
@@ -1015,8 +1115,8 @@ std::pair<bool, bool> sendPush(FILE *out, int32_t offset, bool before,
             // seto %al
             // lahf
             assert(scratch == RAX_IDX);
-            fprintf(out, "%u,%u,%u,", 0x0f, 0x90, 0xc0);
-            fprintf(out, "%u,", 0x9f);
+            out.emit(0x0f, 0x90, 0xc0);
+            out.emit(0x9f);
             sendPush(out, offset + sizeof(int64_t), before, REGISTER_RAX);
             break;
 
@@ -1051,16 +1151,16 @@ std::pair<bool, bool> sendPush(FILE *out, int32_t offset, bool before,
              0x50, 0x52, 0x53, 0x53, 0x55, 0x54, 0x55, 0x56, 0x57, 0x54};
         
         if (REX[regno] != 0x00)
-            fprintf(out, "%u,", REX[regno]);
-        fprintf(out, "%u,", OPCODE[regno]);
+            out.emit(REX[regno]);
+        out.emit(OPCODE[regno]);
         return {true, false};
     }
     else if (size > 0)
     {
         // lea -size(%rsp),%rsp
         // mov %reg,(%rsp)
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            0x48, 0x8d, 0x64, 0x24, -size);
+        out.emit(0x48, 0x8d, 0x64, 0x24);
+        out.emitInt8(-size);
         sendMovBetweenRegAndStack(out, reg, /*to_stack=*/true);
         return {true, false};
     }
@@ -1071,7 +1171,8 @@ std::pair<bool, bool> sendPush(FILE *out, int32_t offset, bool before,
 /*
  * Send (or emulate) a pop instruction.
  */
-bool sendPop(FILE *out, bool preserve_rax, Register reg, Register rscratch)
+bool sendPop(CodeBuffer &out, bool preserve_rax, Register reg,
+    Register rscratch)
 {
     // Special cases:
     switch (reg)
@@ -1092,8 +1193,8 @@ bool sendPop(FILE *out, bool preserve_rax, Register reg, Register rscratch)
             sendPop(out, false, REGISTER_RAX);
             // add $0x7f,%al
             // sahf
-            fprintf(out, "%u,%u,", 0x04, 0x7f);
-            fprintf(out, "%u,", 0x9e);
+            out.emit(0x04, 0x7f);
+            out.emit(0x9e);
 
             if (preserve_rax)
             {
@@ -1131,16 +1232,16 @@ bool sendPop(FILE *out, bool preserve_rax, Register reg, Register rscratch)
              0x58, 0x5a, 0x5b, 0x5b, 0x5d, 0x5c, 0x5d, 0x5e, 0x5f, 0x5c};
         
         if (REX[regno] != 0x00)
-            fprintf(out, "%u,", REX[regno]);
-        fprintf(out, "%u,", OPCODE[regno]);
+            out.emit(REX[regno]);
+        out.emit(OPCODE[regno]);
     }
     else if (size > 0)
     {
         // mov (%rsp),%reg
         // lea size(%rsp),%rsp
         sendMovBetweenRegAndStack(out, reg, /*to_stack=*/false);
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            0x48, 0x8d, 0x64, 0x24, size);
+        out.emit(0x48, 0x8d, 0x64, 0x24);
+        out.emitInt8(size);
     }
     else
         ;   // NOP
@@ -1148,10 +1249,119 @@ bool sendPop(FILE *out, bool preserve_rax, Register reg, Register rscratch)
     return false;
 }
 
+/*
+ * Send the pushes of a call trampoline's caller-save registers `rsave'.
+ */
+void sendPushCallerSaveRegs(CodeBuffer &out, const int *rsave, bool before,
+    Register rscratch)
+{
+    int32_t offset = 0x4000;
+    for (int i = 0; rsave[i] >= 0; i++)
+    {
+        sendPush(out, offset, before, getReg(rsave[i]), rscratch);
+        if (rsave[i] != RSP_IDX && rsave[i] != RIP_IDX)
+            offset += sizeof(int64_t);
+    }
+}
+
+/*
+ * Send the pops of a call trampoline's caller-save registers `rsave'.  For
+ * conditional calls, the first register is popped by the caller.
+ */
+void sendPopCallerSaveRegs(CodeBuffer &out, const int *rsave, bool conditional,
+    bool preserve_rax)
+{
+    int num_rsave = 0;
+    for (; rsave[num_rsave] >= 0; num_rsave++)
+        ;
+    int rmin = (conditional? 1: 0);
+    for (int i = num_rsave-1; i >= rmin; i--)
+    {
+        if (rsave[i] == RSP_IDX || rsave[i] == RIP_IDX)
+            continue;
+        sendPop(out, preserve_rax, getReg(rsave[i]));
+    }
+}
+
+/*
+ * Send the moves between the vector registers `vec' and the stack at
+ * (offset - VEC_SLOT)(%rsp).  All moves use a 32-bit displacement, and do
+ * not modify any general purpose register or %rflags.
+ */
+static void sendMovBetweenVectorRegsAndStack(CodeBuffer &out, CallVector vec,
+    int32_t offset, bool to_stack)
+{
+    int32_t disp = offset - VEC_SLOT;
+    switch (vec)
+    {
+        case VECTOR_XMM:
+            for (int i = 0; i < 16; i++)
+            {
+                // movdqu %xmmN,disp(%rsp)  (or reverse)
+                out.emit(0xf3);
+                if (i >= 8)
+                    out.emit(0x44);
+                out.emit(0x0f, (to_stack? 0x7f: 0x6f), 0x84 | ((i & 0x7) << 3),
+                    0x24);
+                out.emitInt32(disp + 16 * i);
+            }
+            break;
+        case VECTOR_YMM:
+            for (int i = 0; i < 16; i++)
+            {
+                // vmovdqu %ymmN,disp(%rsp)  (or reverse)
+                out.emit(0xc5, (i >= 8? 0x7e: 0xfe), (to_stack? 0x7f: 0x6f),
+                    0x84 | ((i & 0x7) << 3), 0x24);
+                out.emitInt32(disp + 32 * i);
+            }
+            break;
+        case VECTOR_ZMM:
+            for (int i = 0; i < 32; i++)
+            {
+                // vmovdqu64 %zmmN,disp(%rsp)  (or reverse)
+                uint8_t p0 = 0x61 | ((i & 0x08) == 0? 0x80: 0x00) |
+                    ((i & 0x10) == 0? 0x10: 0x00);
+                out.emit(0x62, p0, 0xfe, 0x48, (to_stack? 0x7f: 0x6f),
+                    0x84 | ((i & 0x7) << 3), 0x24);
+                out.emitInt32(disp + 64 * i);
+            }
+            for (int i = 0; i < 8; i++)
+            {
+                // kmovq %kN,disp(%rsp)  (or reverse)
+                out.emit(0xc4, 0xe1, 0xf8, (to_stack? 0x91: 0x90),
+                    0x84 | (i << 3), 0x24);
+                out.emitInt32(disp + 64 * 32 + 8 * i);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Send the saves of a clean call trampoline's vector registers `vec'.  The
+ * registers are saved to the stack at VEC_SLOT, which lies inside the
+ * 0x4000 byte region skipped by the trampoline, so the pushes and the
+ * argument offsets are unaffected.  Here `offset' is the offset from %rsp
+ * to the original stack pointer.
+ */
+void sendSaveVectorRegs(CodeBuffer &out, CallVector vec, int32_t offset)
+{
+    sendMovBetweenVectorRegsAndStack(out, vec, offset, /*to_stack=*/true);
+}
+
+/*
+ * Send the restores of a clean call trampoline's vector registers `vec'.
+ */
+void sendRestoreVectorRegs(CodeBuffer &out, CallVector vec, int32_t offset)
+{
+    sendMovBetweenVectorRegsAndStack(out, vec, offset, /*to_stack=*/false);
+}
+
 /*
  * Send a `mov %r64,%r64' instruction.
  */
-bool sendMovFromR64ToR64(FILE *out, int srcno, int dstno)
+bool sendMovFromR64ToR64(CodeBuffer &out, int srcno, int dstno)
 {
     if (srcno == dstno)
         return false;
@@ -1165,14 +1375,14 @@ bool sendMovFromR64ToR64(FILE *out, int srcno, int dstno)
     
     uint8_t rex = REX[(REX_MASK[dstno] << 1) | REX_MASK[srcno]];
     uint8_t modrm = (0x03 << 6) | (REG[srcno] << 3) | REG[dstno];
-    fprintf(out, "%u,%u,%u,", rex, 0x89, modrm);
+    out.emit(rex, 0x89, modrm);
     return true;
 }
 
 /*
  * Send a `movslq %r32,%r64' instruction.
  */
-void sendMovFromR32ToR64(FILE *out, int srcno, int dstno)
+void sendMovFromR32ToR64(CodeBuffer &out, int srcno, int dstno)
 {
     const uint8_t REX_MASK[] =
         {0, 0, 0, 0, 1, 1, 0,
@@ -1184,13 +1394,13 @@ void sendMovFromR32ToR64(FILE *out, int srcno, int dstno)
     
     uint8_t rex = REX[(REX_MASK[srcno] << 1) | REX_MASK[dstno]];
     uint8_t modrm = (0x03 << 6) | (REG[dstno] << 3) | REG[srcno];
-    fprintf(out, "%u,%u,%u,", rex, 0x63, modrm);
+    out.emit(rex, 0x63, modrm);
 }
 
 /*
  * Send a `movswl %r16,%r64' instruction.
  */
-void sendMovFromR16ToR64(FILE *out, int srcno, int dstno)
+void sendMovFromR16ToR64(CodeBuffer &out, int srcno, int dstno)
 {
     const uint8_t REX_MASK[] =
         {0, 0, 0, 0, 1, 1, 0,
@@ -1202,13 +1412,13 @@ void sendMovFromR16ToR64(FILE *out, int srcno, int dstno)
  
     uint8_t rex = REX[(REX_MASK[srcno] << 1) | REX_MASK[dstno]];
     uint8_t modrm = (0x03 << 6) | (REG[dstno] << 3) | REG[srcno];
-    fprintf(out, "%u,%u,%u,%u,", rex, 0x0f, 0xbf, modrm);
+    out.emit(rex, 0x0f, 0xbf, modrm);
 }
 
 /*
  * Send a `movsbl %r8,%r32' instruction.
  */
-void sendMovFromR8ToR64(FILE *out, int srcno, bool srchi, int dstno)
+void sendMovFromR8ToR64(CodeBuffer &out, int srcno, bool srchi, int dstno)
 {
     const uint8_t REX_MASK[] =
         {0, 0, 0, 0, 1, 1, 0,
@@ -1242,30 +1452,30 @@ void sendMovFromR8ToR64(FILE *out, int srcno, bool srchi, int dstno)
         switch (srcno)
         {
             case RAX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xe0); break;
+                out.emit(0x86, 0xe0); break;
             case RBX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xfb); break;
+                out.emit(0x86, 0xfb); break;
             case RCX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xe9); break;
+                out.emit(0x86, 0xe9); break;
             case RDX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xf2); break;
+                out.emit(0x86, 0xf2); break;
         }
     }
     uint8_t modrm = (0x03 << 6) | (REG[dstno] << 3) | srcreg;
-    fprintf(out, "%u,%u,%u,%u,", rex, 0x0f, 0xbe, modrm);
+    out.emit(rex, 0x0f, 0xbe, modrm);
     if (xchg)
     {
         // xchgb %rh,%rl
         switch (srcno)
         {
             case RAX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xe0); break;
+                out.emit(0x86, 0xe0); break;
             case RBX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xfb); break;
+                out.emit(0x86, 0xfb); break;
             case RCX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xe9); break;
+                out.emit(0x86, 0xe9); break;
             case RDX_IDX:
-                fprintf(out, "%u,%u,", 0x86, 0xf2); break;
+                out.emit(0x86, 0xf2); break;
         }
     }
 }
@@ -1273,7 +1483,7 @@ void sendMovFromR8ToR64(FILE *out, int srcno, bool srchi, int dstno)
 /*
  * Send a `mov offset(%rsp),%r64' instruction.
  */
-void sendMovFromStackToR64(FILE *out, int32_t offset, int regno)
+void sendMovFromStackToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1289,20 +1499,23 @@ void sendMovFromStackToR64(FILE *out, int32_t offset, int regno)
          0x84, 0x94, 0x9c, 0x9c, 0xac, 0xa4, 0xac, 0xb4, 0xbc, 0xa4};
 
     if (offset == 0)
-        fprintf(out, "%u,%u,%u,%u,",
-            REX[regno], 0x8b, MODRM_0[regno], 0x24);
+        out.emit(REX[regno], 0x8b, MODRM_0[regno], 0x24);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x8b, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x8b, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x8b, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x8b, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
 /*
  * Send a `movslq offset(%rsp),%r64' instruction.
  */
-void sendMovFromStack32ToR64(FILE *out, int32_t offset, int regno)
+void sendMovFromStack32ToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1318,20 +1531,23 @@ void sendMovFromStack32ToR64(FILE *out, int32_t offset, int regno)
          0x84, 0x94, 0x9c, 0x9c, 0xac, 0xa4, 0xac, 0xb4, 0xbc, 0xa4};
 
     if (offset == 0)
-        fprintf(out, "%u,%u,%u,%u,",
-            REX[regno], 0x63, MODRM_0[regno], 0x24);
+        out.emit(REX[regno], 0x63, MODRM_0[regno], 0x24);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x63, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x63, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x63, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x63, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
 /*
  * Send a `movswl offset(%rsp),%r64' instruction.
  */
-void sendMovFromStack16ToR64(FILE *out, int32_t offset, int regno)
+void sendMovFromStack16ToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1347,20 +1563,23 @@ void sendMovFromStack16ToR64(FILE *out, int32_t offset, int regno)
          0x84, 0x94, 0x9c, 0x9c, 0xac, 0xa4, 0xac, 0xb4, 0xbc, 0xa4};
 
     if (offset == 0)
-        fprintf(out, "%u,%u,%u,%u,%u,",
-            REX[regno], 0x0f, 0xbf, MODRM_0[regno], 0x24);
+        out.emit(REX[regno], 0x0f, 0xbf, MODRM_0[regno], 0x24);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x0f, 0xbf, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x0f, 0xbf, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x0f, 0xbf, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x0f, 0xbf, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
 /*
  * Send a `movzbl offset(%rsp),%r64' instruction.
  */
-void sendMovFromStack8ToR64(FILE *out, int32_t offset, int regno)
+void sendMovFromStack8ToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1376,20 +1595,23 @@ void sendMovFromStack8ToR64(FILE *out, int32_t offset, int regno)
          0x84, 0x94, 0x9c, 0x9c, 0xac, 0xa4, 0xac, 0xb4, 0xbc, 0xa4};
 
     if (offset == 0)
-        fprintf(out, "%u,%u,%u,%u,%u,",
-            REX[regno], 0x0f, 0xbe, MODRM_0[regno], 0x24);
+        out.emit(REX[regno], 0x0f, 0xbe, MODRM_0[regno], 0x24);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x0f, 0xbe, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x0f, 0xbe, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x0f, 0xbe, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x0f, 0xbe, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
 /*
  * Send a `mov %r64,offset(%rsp)' instruction.
  */
-void sendMovFromR64ToStack(FILE *out, int regno, int32_t offset)
+void sendMovFromR64ToStack(CodeBuffer &out, int regno, int32_t offset)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1405,20 +1627,23 @@ void sendMovFromR64ToStack(FILE *out, int regno, int32_t offset)
          0x84, 0x94, 0x9c, 0x9c, 0xac, 0xa4, 0xac, 0xb4, 0xbc, 0xa4};
 
     if (offset == 0)
-        fprintf(out, "%u,%u,%u,%u,",
-            REX[regno], 0x89, MODRM_0[regno], 0x24);
+        out.emit(REX[regno], 0x89, MODRM_0[regno], 0x24);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x89, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x89, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x89, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x89, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
 /*
  * Send a `movzwl %ax,%r32' instruction.
  */
-void sendMovFromRAX16ToR64(FILE *out, int regno)
+void sendMovFromRAX16ToR64(CodeBuffer &out, int regno)
 {
     const uint8_t REX[] =
         {0x00, 0x00, 0x00, 0x00, 0x44, 0x44, 0x00,
@@ -1427,14 +1652,14 @@ void sendMovFromRAX16ToR64(FILE *out, int regno)
         {0xf8, 0xf0, 0xd0, 0xc8, 0xc0, 0xc8, 0x00,
          0xc0, 0xd0, 0xd8, 0xd8, 0xe8, 0xe0, 0xe8, 0xf0, 0xf8, 0xe0};
     if (REX[regno] != 0x00)
-        fprintf(out, "%u,", REX[regno]);
-    fprintf(out, "%u,%u,%u,", 0x0f, 0xb7, MODRM[regno]);
+        out.emit(REX[regno]);
+    out.emit(0x0f, 0xb7, MODRM[regno]);
 }
 
 /*
  * Send a `mov $value,%r32' instruction.
  */
-void sendSExtFromI32ToR64(FILE *out, const char *value, int regno)
+void sendSExtFromI32ToR64(CodeBuffer &out, const char *value, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x49, 0x49, 0x00,
@@ -1442,14 +1667,14 @@ void sendSExtFromI32ToR64(FILE *out, const char *value, int regno)
     const uint8_t MODRM[] =
         {0xc7, 0xc6, 0xc2, 0xc1, 0xc0, 0xc1, 0x00,  
          0xc0, 0xc2, 0xc3, 0xc3, 0xc5, 0xc4, 0xc5, 0xc6, 0xc7, 0xc4};
-    fprintf(out, "%u,%u,%u,%s,",
-        REX[regno], 0xc7, MODRM[regno], value);
+    out.emit(REX[regno], 0xc7, MODRM[regno]);
+    out.emitEntry("%s", value);
 }
 
 /*
  * Send a `mov $value,%r32' instruction.
  */
-void sendSExtFromI32ToR64(FILE *out, int32_t value, int regno)
+void sendSExtFromI32ToR64(CodeBuffer &out, int32_t value, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x49, 0x49, 0x00,
@@ -1457,14 +1682,14 @@ void sendSExtFromI32ToR64(FILE *out, int32_t value, int regno)
     const uint8_t MODRM[] =
         {0xc7, 0xc6, 0xc2, 0xc1, 0xc0, 0xc1, 0x00,  
          0xc0, 0xc2, 0xc3, 0xc3, 0xc5, 0xc4, 0xc5, 0xc6, 0xc7, 0xc4};
-    fprintf(out, "%u,%u,%u,{\"int32\":%d},",
-        REX[regno], 0xc7, MODRM[regno], value);
+    out.emit(REX[regno], 0xc7, MODRM[regno]);
+    out.emitInt32(value);
 }
 
 /*
  * Send a `mov $value,%r64' instruction.
  */
-void sendZExtFromI32ToR64(FILE *out, const char *value, int regno)
+void sendZExtFromI32ToR64(CodeBuffer &out, const char *value, int regno)
 {
     const uint8_t REX[] =
         {0x00, 0x00, 0x00, 0x00, 0x41, 0x41, 0x00,
@@ -1473,14 +1698,15 @@ void sendZExtFromI32ToR64(FILE *out, const char *value, int regno)
         {0xbf, 0xbe, 0xba, 0xb9, 0xb8, 0xb9, 0x00,
          0xb8, 0xba, 0xbb, 0xbb, 0xbd, 0xbc, 0xbd, 0xbe, 0xbf, 0xbc};
     if (REX[regno] != 0x00)
-        fprintf(out, "%u,", REX[regno]);
-    fprintf(out, "%u,%s,", OPCODE[regno], value);
+        out.emit(REX[regno]);
+    out.emit(OPCODE[regno]);
+    out.emitEntry("%s", value);
 }
 
 /*
  * Send a `mov $value,%r64' instruction.
  */
-void sendZExtFromI32ToR64(FILE *out, int32_t value, int regno)
+void sendZExtFromI32ToR64(CodeBuffer &out, int32_t value, int regno)
 {
     const uint8_t REX[] =
         {0x00, 0x00, 0x00, 0x00, 0x41, 0x41, 0x00,
@@ -1489,14 +1715,15 @@ void sendZExtFromI32ToR64(FILE *out, int32_t value, int regno)
         {0xbf, 0xbe, 0xba, 0xb9, 0xb8, 0xb9, 0x00,
          0xb8, 0xba, 0xbb, 0xbb, 0xbd, 0xbc, 0xbd, 0xbe, 0xbf, 0xbc};
     if (REX[regno] != 0x00)
-        fprintf(out, "%u,", REX[regno]);
-    fprintf(out, "%u,{\"int32\":%d},", OPCODE[regno], value);
+        out.emit(REX[regno]);
+    out.emit(OPCODE[regno]);
+    out.emitInt32(value);
 }
 
 /*
  * Send a `movabs $i64,%r64' instruction.
  */
-void sendMovFromI64ToR64(FILE *out, intptr_t value, int regno)
+void sendMovFromI64ToR64(CodeBuffer &out, intptr_t value, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x49, 0x49, 0x00,
@@ -1504,15 +1731,14 @@ void sendMovFromI64ToR64(FILE *out, intptr_t value, int regno)
     const uint8_t OPCODE[] =
         {0xbf, 0xbe, 0xba, 0xb9, 0xb8, 0xb9, 0x00,
          0xb8, 0xba, 0xbb, 0xbb, 0xbd, 0xbc, 0xbd, 0xbe, 0xbf, 0xbc};
-    fprintf(out, "%u,%u,{\"int64\":", REX[regno], OPCODE[regno]);
-    sendInteger(out, value);
-    fputs("},", out);
+    out.emit(REX[regno], OPCODE[regno]);
+    out.emitInt64(value);
 }
 
 /*
  * Send a `movabs $i64,%r64' instruction.
  */
-void sendMovFromI64ToR64(FILE *out, const char *value, int regno)
+void sendMovFromI64ToR64(CodeBuffer &out, const char *value, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x49, 0x49, 0x00,
@@ -1520,13 +1746,14 @@ void sendMovFromI64ToR64(FILE *out, const char *value, int regno)
     const uint8_t OPCODE[] =
         {0xbf, 0xbe, 0xba, 0xb9, 0xb8, 0xb9, 0x00,
          0xb8, 0xba, 0xbb, 0xbb, 0xbd, 0xbc, 0xbd, 0xbe, 0xbf, 0xbc};
-    fprintf(out, "%u,%u,%s,", REX[regno], OPCODE[regno], value);
+    out.emit(REX[regno], OPCODE[regno]);
+    out.emitEntry("%s", value);
 }
 
 /*
  * Send a `lea offset(%rip),%r64' instruction.
  */
-void sendLeaFromPCRelToR64(FILE *out, const char *offset, int regno)
+void sendLeaFromPCRelToR64(CodeBuffer &out, const char *offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1534,14 +1761,14 @@ void sendLeaFromPCRelToR64(FILE *out, const char *offset, int regno)
     const uint8_t MODRM[] =
         {0x3d, 0x35, 0x15, 0x0d, 0x05, 0x0d, 0x00, 
          0x05, 0x15, 0x1d, 0x1d, 0x2d, 0x25, 0x2d, 0x35, 0x3d, 0x25};
-    fprintf(out, "%u,%u,%u,%s,",
-        REX[regno], 0x8d, MODRM[regno], offset);
+    out.emit(REX[regno], 0x8d, MODRM[regno]);
+    out.emitEntry("%s", offset);
 }
 
 /*
  * Send a `lea offset(%rip),%r64' instruction.
  */
-void sendLeaFromPCRelToR64(FILE *out, int32_t offset, int regno)
+void sendLeaFromPCRelToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1549,14 +1776,14 @@ void sendLeaFromPCRelToR64(FILE *out, int32_t offset, int regno)
     const uint8_t MODRM[] =
         {0x3d, 0x35, 0x15, 0x0d, 0x05, 0x0d, 0x00, 
          0x05, 0x15, 0x1d, 0x1d, 0x2d, 0x25, 0x2d, 0x35, 0x3d, 0x25};
-    fprintf(out, "%u,%u,%u,{\"rel32\":%d},",
-        REX[regno], 0x8d, MODRM[regno], offset);
+    out.emit(REX[regno], 0x8d, MODRM[regno]);
+    out.emitEntry("{\"rel32\":%d}", offset);
 }
 
 /*
  * Send a `mov offset(%rip),%r64' instruction.
  */
-void sendMovFromPCRelToR64(FILE *out, int32_t offset, int regno)
+void sendMovFromPCRelToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1564,14 +1791,14 @@ void sendMovFromPCRelToR64(FILE *out, int32_t offset, int regno)
     const uint8_t MODRM[] =
         {0x3d, 0x35, 0x15, 0x0d, 0x05, 0x0d, 0x00, 
          0x05, 0x15, 0x1d, 0x1d, 0x2d, 0x25, 0x2d, 0x35, 0x3d, 0x25};
-    fprintf(out, "%u,%u,%u,{\"rel32\":%d},",
-        REX[regno], 0x8b, MODRM[regno], offset);
+    out.emit(REX[regno], 0x8b, MODRM[regno]);
+    out.emitEntry("{\"rel32\":%d}", offset);
 }
 
 /*
  * Send a `lea offset(%rsp),%r64' instruction.
  */
-void sendLeaFromStackToR64(FILE *out, int32_t offset, int regno)
+void sendLeaFromStackToR64(CodeBuffer &out, int32_t offset, int regno)
 {
     const uint8_t REX[] =
         {0x48, 0x48, 0x48, 0x48, 0x4c, 0x4c, 0x00,
@@ -1586,10 +1813,14 @@ void sendLeaFromStackToR64(FILE *out, int32_t offset, int regno)
     if (offset == 0)
         sendMovFromR64ToR64(out, RSP_IDX, regno);
     else if (offset >= INT8_MIN && offset <= INT8_MAX)
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            REX[regno], 0x8d, MODRM_8[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x8d, MODRM_8[regno], 0x24);
+        out.emitInt8(offset);
+    }
     else
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            REX[regno], 0x8d, MODRM_32[regno], 0x24, offset);
+    {
+        out.emit(REX[regno], 0x8d, MODRM_32[regno], 0x24);
+        out.emitInt32(offset);
+    }
 }
 
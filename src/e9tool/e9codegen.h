@@ -19,10 +19,19 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <vector>
 
 #include "e9tool.h"
 #include "e9types.h"
 
+namespace e9tool
+{
+    struct Inline;
+};
+
 /*
  * GPR register indexes.
  */
@@ -52,6 +61,73 @@
  */
 #define RSP_SLOT    0x4000
 #define RIP_SLOT    (0x4000 - sizeof(int64_t))
+#define VEC_SLOT    (0x4000 - 0x40)
+
+/*
+ * Maximum number of bytes per serialized {"hex":...} entry (E9Patch limits
+ * the string length).
+ */
+#define CODE_HEX_MAX    256
+
+/*
+ * Machine code buffer.  Instructions and data are encoded directly into
+ * bytes, and symbolic entries (labels, macros, and values that can only be
+ * resolved by E9Patch) are recorded as fixups at the corresponding offset.
+ * The buffer is serialized by sendCodeBuffer().
+ */
+struct CodeBuffer
+{
+    struct Fixup
+    {
+        size_t offset;                  // Fixup offset into bytes
+        size_t end;                     // End of fixup entry in symbols
+    };
+
+    std::vector<uint8_t> bytes;         // Encoded bytes
+    std::vector<Fixup> fixups;          // Symbolic entries
+    std::string symbols;                // Symbolic entry (JSON) text
+
+    /*
+     * Emit bytes.
+     */
+    template <typename... Ts>
+    void emit(Ts... bs)
+    {
+        const uint8_t buf[] = {(uint8_t)bs...};
+        bytes.insert(bytes.end(), buf, buf + sizeof(buf));
+    }
+    void emitBytes(const void *data, size_t len)
+    {
+        const uint8_t *buf = (const uint8_t *)data;
+        bytes.insert(bytes.end(), buf, buf + len);
+    }
+
+    /*
+     * Emit little-endian integers.
+     */
+    void emitInt8(int8_t x)             { emitBytes(&x, sizeof(x)); }
+    void emitInt16(int16_t x)           { emitBytes(&x, sizeof(x)); }
+    void emitInt32(int32_t x)           { emitBytes(&x, sizeof(x)); }
+    void emitInt64(int64_t x)           { emitBytes(&x, sizeof(x)); }
+
+    /*
+     * Emit a (NUL-terminated) string.
+     */
+    void emitString(const char *str)    { emitBytes(str, strlen(str)+1); }
+
+    /*
+     * Emit a symbolic template entry (JSON text), e.g., "\".Lnext\"".
+     */
+    void emitEntry(const char *format, ...)
+        __attribute__((__format__(__printf__, 2, 3)));
+
+    void clear()
+    {
+        bytes.clear();
+        fixups.clear();
+        symbols.clear();
+    }
+};
 
 /*
  * Prototypes.
@@ -65,30 +141,42 @@ extern e9tool::Register getCanonicalReg(e9tool::Register reg);
 extern bool isHighReg(e9tool::Register reg);
 extern const int *getCallerSaveRegs(bool sysv, bool clean, bool state,
     bool conditional, size_t num_args);
-extern std::pair<bool, bool> sendPush(FILE *out, int32_t offset, bool before,
+extern const int *getInlineCallerSaveRegs(bool sysv, const e9tool::Call &call,
+    const int *rsave, int *buf);
+extern void sendCodeBuffer(FILE *out, CodeBuffer &code);
+extern void sendInlineCode(CodeBuffer &out, const e9tool::Inline &inl);
+extern std::pair<bool, bool> sendPush(CodeBuffer &out, int32_t offset, bool before,
     e9tool::Register reg,
     e9tool::Register rscratch = e9tool::REGISTER_INVALID);
-extern bool sendPop(FILE *out, bool conditional, e9tool::Register reg,
+extern bool sendPop(CodeBuffer &out, bool conditional, e9tool::Register reg,
     e9tool::Register rscratch = e9tool::REGISTER_INVALID);
-extern bool sendMovFromR64ToR64(FILE *out, int srcno, int dstno);
-extern void sendMovFromR32ToR64(FILE *out, int srcno, int dstno);
-extern void sendMovFromR16ToR64(FILE *out, int srcno, int dstno);
-extern void sendMovFromR8ToR64(FILE *out, int srcno, bool srchi, int dstno);
-extern void sendMovFromStackToR64(FILE *out, int32_t offset, int regno);
-extern void sendMovFromStack32ToR64(FILE *out, int32_t offset, int regno);
-extern void sendMovFromStack16ToR64(FILE *out, int32_t offset, int regno);
-extern void sendMovFromStack8ToR64(FILE *out, int32_t offset, int regno);
-extern void sendMovFromR64ToStack(FILE *out, int regno, int32_t offset);
-extern void sendMovFromRAX16ToR64(FILE *out, int regno);
-extern void sendSExtFromI32ToR64(FILE *out, const char *value, int regno);
-extern void sendSExtFromI32ToR64(FILE *out, int32_t value, int regno);
-extern void sendZExtFromI32ToR64(FILE *out, const char *value, int regno);
-extern void sendZExtFromI32ToR64(FILE *out, int32_t value, int regno);
-extern void sendMovFromI64ToR64(FILE *out, intptr_t value, int regno);
-extern void sendMovFromI64ToR64(FILE *out, const char *value, int regno);
-extern void sendMovFromPCRelToR64(FILE *out, int32_t offset, int regno);
-extern void sendLeaFromPCRelToR64(FILE *out, const char *offset, int regno);
-extern void sendLeaFromPCRelToR64(FILE *out, int32_t offset, int regno);
-extern void sendLeaFromStackToR64(FILE *out, int32_t offset, int regno);
+extern void sendPushCallerSaveRegs(CodeBuffer &out, const int *rsave,
+    bool before, e9tool::Register rscratch);
+extern void sendPopCallerSaveRegs(CodeBuffer &out, const int *rsave,
+    bool conditional, bool preserve_rax);
+extern void sendSaveVectorRegs(CodeBuffer &out, e9tool::CallVector vec,
+    int32_t offset);
+extern void sendRestoreVectorRegs(CodeBuffer &out, e9tool::CallVector vec,
+    int32_t offset);
+extern bool sendMovFromR64ToR64(CodeBuffer &out, int srcno, int dstno);
+extern void sendMovFromR32ToR64(CodeBuffer &out, int srcno, int dstno);
+extern void sendMovFromR16ToR64(CodeBuffer &out, int srcno, int dstno);
+extern void sendMovFromR8ToR64(CodeBuffer &out, int srcno, bool srchi, int dstno);
+extern void sendMovFromStackToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendMovFromStack32ToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendMovFromStack16ToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendMovFromStack8ToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendMovFromR64ToStack(CodeBuffer &out, int regno, int32_t offset);
+extern void sendMovFromRAX16ToR64(CodeBuffer &out, int regno);
+extern void sendSExtFromI32ToR64(CodeBuffer &out, const char *value, int regno);
+extern void sendSExtFromI32ToR64(CodeBuffer &out, int32_t value, int regno);
+extern void sendZExtFromI32ToR64(CodeBuffer &out, const char *value, int regno);
+extern void sendZExtFromI32ToR64(CodeBuffer &out, int32_t value, int regno);
+extern void sendMovFromI64ToR64(CodeBuffer &out, intptr_t value, int regno);
+extern void sendMovFromI64ToR64(CodeBuffer &out, const char *value, int regno);
+extern void sendMovFromPCRelToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendLeaFromPCRelToR64(CodeBuffer &out, const char *offset, int regno);
+extern void sendLeaFromPCRelToR64(CodeBuffer &out, int32_t offset, int regno);
+extern void sendLeaFromStackToR64(CodeBuffer &out, int32_t offset, int regno);
 
 #endif
@@ -21,10 +21,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
 #include <map>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "e9action.h"
 #include "e9csv.h"
@@ -51,9 +61,69 @@ typedef std::vector<MatchVal> Record;
 typedef std::map<intptr_t, Record> Data;
 
 /*
- * CSV data cache.
+ * BINARY CSV FILES.
+ *
+ * A `NAME.csv' file can be precompiled (see `--compile-csv') into a
+ * `NAME.csv.bin' file, which is mmap()'ed directly rather than parsed.
+ * The rows are stored in columnar form: a sorted address column (searched
+ * using binary search), followed by one typed column per remaining CSV
+ * column.  Integer and string columns store one 64-bit value per row
+ * (for strings, an offset into the string table).  Columns with mixed or
+ * missing entries additionally store a per-row MATCH_TYPE_* byte.
+ *
+ * File layout:
+ *
+ *      CSVHeader
+ *      int64_t   addrs[header.nRows]
+ *      CSVColumn cols[header.nCols-1]
+ *      (column data...)
+ *      char      strs[header.nStrs]
+ */
+#define CSV_MAGIC               "E9CSV"
+#define CSV_VERSION             1
+
+#define CSV_COLUMN_INTEGER      MATCH_TYPE_INTEGER
+#define CSV_COLUMN_STRING       MATCH_TYPE_STRING
+#define CSV_COLUMN_MIXED        0
+
+struct CSVHeader
+{
+    char magic[8];                  // CSV_MAGIC
+    uint32_t version;               // CSV_VERSION
+    uint32_t nCols;                 // Number of columns (incl. address)
+    uint64_t nRows;                 // Number of rows
+    uint64_t strs;                  // String table offset
+    uint64_t nStrs;                 // String table size
+};
+struct CSVColumn
+{
+    uint32_t type;                  // CSV_COLUMN_*
+    uint32_t pad;
+    uint64_t vals;                  // Offset of int64_t vals[nRows]
+    uint64_t types;                 // Offset of uint8_t types[nRows] (MIXED)
+};
+
+/*
+ * Mapped binary CSV representation.
+ */
+struct BinaryCSV
+{
+    const uint8_t *data = nullptr;  // File data
+    const CSVHeader *header = nullptr;
+    const int64_t *addrs = nullptr; // Sorted address column
+    const CSVColumn *cols = nullptr;
+    const char *strs = nullptr;     // String table
+};
+
+/*
+ * CSV data cache (one of text or binary).
  */
-typedef std::map<const char *, Data, CStrCmp> Cache;
+struct Table
+{
+    Data data;                      // Parsed text CSV
+    BinaryCSV bin;                  // Mapped binary CSV
+};
+typedef std::map<const char *, Table, CStrCmp> Cache;
 
 /*
  * Convert an entry into an integer.
@@ -259,21 +329,275 @@ static void parseCSV(const char *filename, Data &data)
     fclose(stream);
 }
 
+/*
+ * Map and validate a binary CSV file.  The file remains mapped.
+ */
+static void mapBinaryCSV(const char *filename, int fd, BinaryCSV &bin)
+{
+    struct stat buf;
+    if (fstat(fd, &buf) != 0)
+        error("failed to stat binary CSV file \"%s\": %s", filename,
+            strerror(errno));
+    size_t size = (size_t)buf.st_size;
+    if (size < sizeof(CSVHeader))
+        goto invalid;
+    {
+        const uint8_t *data = (const uint8_t *)mmap(nullptr, size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            error("failed to map binary CSV file \"%s\": %s", filename,
+                strerror(errno));
+        const CSVHeader *header = (const CSVHeader *)data;
+        size_t nCols = header->nCols;
+        size_t nRows = header->nRows;
+        if (memcmp(header->magic, CSV_MAGIC, sizeof(CSV_MAGIC)) != 0 ||
+                header->version != CSV_VERSION || nCols < 1 ||
+                nRows > size / sizeof(int64_t) ||
+                sizeof(CSVHeader) + nRows * sizeof(int64_t) +
+                    (nCols-1) * sizeof(CSVColumn) > size ||
+                header->strs > size || header->nStrs > size - header->strs ||
+                (header->nStrs > 0 &&
+                    data[header->strs + header->nStrs - 1] != '\0'))
+            goto invalid;
+        const int64_t *addrs = (const int64_t *)(data + sizeof(CSVHeader));
+        const CSVColumn *cols = (const CSVColumn *)(addrs + nRows);
+        for (size_t i = 0; i < nCols-1; i++)
+        {
+            if (cols[i].vals > size ||
+                    nRows * sizeof(int64_t) > size - cols[i].vals)
+                goto invalid;
+            if (cols[i].type == CSV_COLUMN_MIXED &&
+                    (cols[i].types > size || nRows > size - cols[i].types))
+                goto invalid;
+            if (cols[i].type != CSV_COLUMN_MIXED &&
+                    cols[i].type != CSV_COLUMN_INTEGER &&
+                    cols[i].type != CSV_COLUMN_STRING)
+                goto invalid;
+        }
+        for (size_t i = 1; i < nRows; i++)
+            if (addrs[i-1] >= addrs[i])
+                goto invalid;
+        bin.data   = data;
+        bin.header = header;
+        bin.addrs  = addrs;
+        bin.cols   = cols;
+        bin.strs   = (const char *)(data + header->strs);
+        debug("loaded binary CSV file \"%s\" (%zu rows)", filename, nRows);
+        return;
+    }
+
+invalid:
+    error("failed to load binary CSV file \"%s\"; invalid file format",
+        filename);
+}
+
+/*
+ * Map a binary CSV file (if it exists and is not older than the text CSV
+ * file).
+ */
+static bool loadBinaryCSV(const char *basename, BinaryCSV &bin)
+{
+    std::string filename(basename);
+    filename += ".csv.bin";
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            error("failed to open binary CSV file \"%s\" for reading: %s",
+                filename.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat buf, text;
+    std::string textname(basename);
+    textname += ".csv";
+    if (fstat(fd, &buf) == 0 && stat(textname.c_str(), &text) == 0 &&
+            text.st_mtime > buf.st_mtime)
+    {
+        warning("ignoring binary CSV file \"%s\" that is older than "
+            "\"%s\"", filename.c_str(), textname.c_str());
+        close(fd);
+        return false;
+    }
+    mapBinaryCSV(filename.c_str(), fd, bin);
+    close(fd);
+    return true;
+}
+
+/*
+ * Lookup a value from a binary CSV file.
+ */
+static MatchVal getBinaryCSVValue(const BinaryCSV &bin, intptr_t addr,
+    uint16_t idx)
+{
+    const int64_t *end = bin.addrs + bin.header->nRows;
+    const int64_t *i = std::lower_bound(bin.addrs, end, (int64_t)addr);
+    if (i == end || *i != addr || idx >= bin.header->nCols)
+        return MatchVal();
+    if (idx == 0)
+        return MatchVal(addr);
+    size_t row = i - bin.addrs;
+    const CSVColumn &col = bin.cols[idx-1];
+    MatchType type = col.type;
+    if (type == CSV_COLUMN_MIXED)
+        type = bin.data[col.types + row];
+    int64_t val = ((const int64_t *)(bin.data + col.vals))[row];
+    switch (type)
+    {
+        case MATCH_TYPE_INTEGER:
+            return MatchVal((intptr_t)val);
+        case MATCH_TYPE_STRING:
+            if ((uint64_t)val >= bin.header->nStrs)
+                return MatchVal();
+            return MatchVal(bin.strs + val);
+        default:
+            return MatchVal();
+    }
+}
+
+/*
+ * Write data to a binary CSV file.
+ */
+static void writeBinaryCSV(FILE *stream, const std::string &filename,
+    const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, size, 1, stream) != 1)
+        error("failed to write binary CSV file \"%s\": %s",
+            filename.c_str(), strerror(errno));
+}
+
+/*
+ * Compile a CSV file into a binary CSV file (FILENAME.bin).
+ */
+void compileCSV(const char *filename)
+{
+    Data data;
+    parseCSV(filename, data);
+    size_t nRows = data.size();
+    size_t nCols = (nRows > 0? data.begin()->second.size(): 1);
+
+    std::string strs;
+    std::map<std::string, uint64_t> offsets;
+    std::vector<CSVColumn> cols(nCols-1);
+    std::vector<std::vector<int64_t>> vals(nCols-1);
+    std::vector<std::vector<uint8_t>> types(nCols-1);
+    for (size_t j = 1; j < nCols; j++)
+    {
+        MatchType type = (nRows > 0? data.begin()->second[j].type:
+            MATCH_TYPE_UNDEFINED);
+        for (const auto &entry: data)
+        {
+            const MatchVal &val = entry.second[j];
+            if (val.type != type)
+                type = CSV_COLUMN_MIXED;
+            int64_t x = 0;
+            switch (val.type)
+            {
+                case MATCH_TYPE_INTEGER:
+                    x = (int64_t)val.i;
+                    break;
+                case MATCH_TYPE_STRING:
+                {
+                    auto r = offsets.emplace(val.str, strs.size());
+                    if (r.second)
+                    {
+                        strs += val.str;
+                        strs += '\0';
+                    }
+                    x = (int64_t)r.first->second;
+                    break;
+                }
+                default:
+                    break;
+            }
+            vals[j-1].push_back(x);
+            types[j-1].push_back((uint8_t)val.type);
+        }
+        if (type != CSV_COLUMN_INTEGER && type != CSV_COLUMN_STRING)
+            type = CSV_COLUMN_MIXED;
+        cols[j-1].type = type;
+        if (type != CSV_COLUMN_MIXED)
+            types[j-1].clear();
+        types[j-1].resize((types[j-1].size() + 7) & ~(size_t)7);
+    }
+
+    size_t offset = sizeof(CSVHeader) + nRows * sizeof(int64_t) +
+        cols.size() * sizeof(CSVColumn);
+    for (size_t j = 0; j < cols.size(); j++)
+    {
+        cols[j].vals  = offset;
+        offset       += vals[j].size() * sizeof(int64_t);
+        cols[j].types = offset;
+        offset       += types[j].size();
+    }
+
+    CSVHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CSV_MAGIC, sizeof(CSV_MAGIC));
+    header.version = CSV_VERSION;
+    header.nCols   = (uint32_t)nCols;
+    header.nRows   = nRows;
+    header.strs    = offset;
+    header.nStrs   = strs.size();
+
+    std::string outname(filename);
+    outname += ".bin";
+    std::string tmpname(outname);
+    tmpname += ".XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if (fd < 0)
+        error("failed to create binary CSV file \"%s\": %s",
+            tmpname.c_str(), strerror(errno));
+    FILE *stream = fdopen(fd, "w");
+    if (stream == nullptr)
+        error("failed to open binary CSV file \"%s\": %s",
+            tmpname.c_str(), strerror(errno));
+    writeBinaryCSV(stream, tmpname, &header, sizeof(header));
+    for (const auto &entry: data)
+    {
+        int64_t addr = (int64_t)entry.first;
+        writeBinaryCSV(stream, tmpname, &addr, sizeof(addr));
+    }
+    writeBinaryCSV(stream, tmpname, cols.data(),
+        cols.size() * sizeof(CSVColumn));
+    for (size_t j = 0; j < cols.size(); j++)
+    {
+        writeBinaryCSV(stream, tmpname, vals[j].data(),
+            vals[j].size() * sizeof(int64_t));
+        writeBinaryCSV(stream, tmpname, types[j].data(), types[j].size());
+    }
+    writeBinaryCSV(stream, tmpname, strs.data(), strs.size());
+    if (fclose(stream) != 0)
+        error("failed to close binary CSV file \"%s\": %s",
+            tmpname.c_str(), strerror(errno));
+    (void)chmod(tmpname.c_str(), 0644);
+    if (rename(tmpname.c_str(), outname.c_str()) != 0)
+        error("failed to rename binary CSV file \"%s\" to \"%s\": %s",
+            tmpname.c_str(), outname.c_str(), strerror(errno));
+    debug("compiled CSV file \"%s\" into \"%s\" (%zu rows)", filename,
+        outname.c_str(), nRows);
+}
+
 /*
  * Lookup a value from a CSV file.
  */
 MatchVal getCSVValue(intptr_t addr, const char *basename, uint16_t idx)
 {
     static Cache cache;
+    static std::mutex mutex;            // For parallel matching
+    std::unique_lock<std::mutex> lock(mutex);
     auto r = cache.emplace(std::piecewise_construct,
         std::make_tuple(basename), std::make_tuple());
-    Data &data = r.first->second;
-    if (r.second)
+    Table &table = r.first->second;
+    if (r.second && !loadBinaryCSV(basename, table.bin))
     {
         std::string filename(basename);
         filename += ".csv";
-        parseCSV(filename.c_str(), data);
+        parseCSV(filename.c_str(), table.data);
     }
+    lock.unlock();
+    if (table.bin.data != nullptr)
+        return getBinaryCSVValue(table.bin, addr, idx);
+    const Data &data = table.data;
     auto i = data.find(addr);
     if (i == data.end())
         return MatchVal();
@@ -284,12 +608,29 @@ MatchVal getCSVValue(intptr_t addr, const char *basename, uint16_t idx)
 }
 
 /*
- * Specialized parser for lists of addresses.
+ * Specialized parser for lists of addresses.  Binary CSV files (see
+ * compileCSV()) are mapped and their (sorted) address column is used
+ * directly.
  */
-void parseAddrs(const char *filename, std::vector<intptr_t> &As)
+void parseAddrs(const char *filename, Addrs &As)
 {
-    FILE *stream = fopen(filename, "r");
-    if (stream == nullptr)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error("failed to open CSV file \"%s\" for reading: %s",
+            filename, strerror(errno));
+    char magic[sizeof(CSV_MAGIC)];
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+            memcmp(magic, CSV_MAGIC, sizeof(magic)) == 0)
+    {
+        BinaryCSV bin;
+        mapBinaryCSV(filename, fd, bin);
+        close(fd);
+        As.data = (const intptr_t *)bin.addrs;
+        As.size = bin.header->nRows;
+        return;
+    }
+    FILE *stream = fdopen(fd, "r");
+    if (stream == nullptr || fseek(stream, 0, SEEK_SET) != 0)
         error("failed to open CSV file \"%s\" for reading: %s",
             filename, strerror(errno));
 
@@ -311,14 +652,18 @@ void parseAddrs(const char *filename, std::vector<intptr_t> &As)
             error("failed to parse CSV file \"%s\" at line %u; first record "
                 "entry must be an address", csv.filename, csv.lineno);
         }
-        As.push_back(addr.i);
+        As.storage.push_back(addr.i);
         record.clear();
     }
 
     fclose(stream);
-    std::sort(As.begin(), As.end());
-    std::unique(As.begin(), As.end());
-    As.shrink_to_fit();
+    std::vector<intptr_t> &storage = As.storage;
+    std::sort(storage.begin(), storage.end());
+    storage.erase(std::unique(storage.begin(), storage.end()),
+        storage.end());
+    storage.shrink_to_fit();
+    As.data = storage.data();
+    As.size = storage.size();
 }
 
 /*
@@ -333,6 +678,7 @@ void parseTargets(const char *filename, const Instr *Is, size_t size,
             filename, strerror(errno));
 
     Record record;
+    std::vector<unsigned> linenos;
     CSV csv = {stream, filename, -1, 0};
     for (size_t i = 0; ; i++)
     {
@@ -369,12 +715,27 @@ void parseTargets(const char *filename, const Instr *Is, size_t size,
         record.clear();
         if (kind == 0 || findInstr(Is, size, addr.i) < 0)
             continue;
-        auto r = targets.insert({addr.i, kind});
-        if (!r.second)
+        targets.push(addr.i, kind);
+        linenos.push_back(csv.lineno);
+    }
+    fclose(stream);
+
+    // Check for duplicates (in file order):
+    std::vector<size_t> idxs(linenos.size());
+    for (size_t i = 0; i < idxs.size(); i++)
+        idxs[i] = i;
+    std::stable_sort(idxs.begin(), idxs.end(),
+        [&targets](size_t i, size_t j) {
+            return (targets.entries[i].first < targets.entries[j].first);
+        });
+    for (size_t i = 1; i < idxs.size(); i++)
+    {
+        intptr_t addr = targets.entries[idxs[i]].first;
+        if (addr == targets.entries[idxs[i-1]].first)
             error("failed to parse CSV file \"%s\" at line %u; duplicate "
-                "record with address 0x%lx", csv.filename, csv.lineno,
+                "record with address 0x%lx", filename, linenos[idxs[i]],
                 addr);
     }
-    fclose(stream);
+    targets.sort();
 }
 
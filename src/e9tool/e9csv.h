@@ -20,7 +20,18 @@
 #include "e9action.h"
 
 extern MatchVal getCSVValue(intptr_t addr, const char *basename, uint16_t idx);
-void parseAddrs(const char *filename, std::vector<intptr_t> &As);
+void compileCSV(const char *filename);
+/*
+ * A sorted list of unique addresses.
+ */
+struct Addrs
+{
+    const intptr_t *data = nullptr; // Addresses (possibly mmap()'ed)
+    size_t size = 0;                // Number of addresses
+    std::vector<intptr_t> storage;  // Backing storage (text files only)
+};
+
+void parseAddrs(const char *filename, Addrs &As);
 void parseTargets(const char *filename, const e9tool::Instr *Is, size_t size,
     e9tool::Targets &targets);
 void dumpInfo(const std::string basename, const e9tool::Instr *Is,
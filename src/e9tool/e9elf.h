@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <cstdint>
+#include <cstring>
 
 #include <elf.h>
 
@@ -74,6 +75,107 @@ struct Symbol
  */
 typedef std::map<Symbol, intptr_t> Symbols;
 
+/*
+ * Flat (open addressing, linear probing) hash index.  The ordered *Info
+ * maps are kept for iteration, and these indexes are used for lookups.
+ * The index is built once (see buildIndexes()) and never grows.  The
+ * first insertion of a key wins.
+ */
+template <typename K, typename V, class Hash, class Eq>
+class FlatIndex
+{
+    struct Entry
+    {
+        K key;
+        V val;
+        size_t hash;
+        bool used;
+    };
+    std::vector<Entry> entries;
+    size_t mask = 0;
+
+public:
+    void reserve(size_t n)
+    {
+        size_t size = 8;
+        while (size < 2 * n)
+            size <<= 1;
+        entries.assign(size, Entry());
+        mask = size - 1;
+    }
+
+    void insert(K key, V val)
+    {
+        size_t hash = Hash()(key);
+        for (size_t i = hash; ; i++)
+        {
+            Entry &entry = entries[i & mask];
+            if (!entry.used)
+            {
+                entry = {key, val, hash, true};
+                return;
+            }
+            if (entry.hash == hash && Eq()(entry.key, key))
+                return;
+        }
+    }
+
+    const V *find(K key) const
+    {
+        if (entries.size() == 0)
+            return nullptr;
+        size_t hash = Hash()(key);
+        for (size_t i = hash; ; i++)
+        {
+            const Entry &entry = entries[i & mask];
+            if (!entry.used)
+                return nullptr;
+            if (entry.hash == hash && Eq()(entry.key, key))
+                return &entry.val;
+        }
+    }
+};
+
+struct CStrHash
+{
+    size_t operator()(const char *s) const
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;      // FNV-1a
+        for (; *s != '\0'; s++)
+        {
+            hash ^= (uint8_t)*s;
+            hash *= 0x100000001b3ull;
+        }
+        return (size_t)hash;
+    }
+};
+struct CStrEq
+{
+    bool operator()(const char *a, const char *b) const
+    {
+        return (strcmp(a, b) == 0);
+    }
+};
+struct AddrHash
+{
+    size_t operator()(intptr_t addr) const
+    {
+        uint64_t hash = (uint64_t)addr * 0x9E3779B97F4A7C15ull;
+        return (size_t)(hash ^ (hash >> 32));
+    }
+};
+struct AddrEq
+{
+    bool operator()(intptr_t a, intptr_t b) const
+    {
+        return (a == b);
+    }
+};
+
+template <typename V>
+using NameIndex = FlatIndex<const char *, V, CStrHash, CStrEq>;
+typedef FlatIndex<intptr_t, const char *, AddrHash, AddrEq> AddrIndex;
+
 /*
  * ELF file.
  */
@@ -123,8 +225,17 @@ namespace e9tool
         Targets targets;                // Jump/Call targets [optional]
         BBs bbs;                        // Basic blocks [optional]
         Fs fs;                          // Functions [optional]
+        Liveness live;                  // Register liveness [optional]
 
         mutable Symbols symbols;        // Symbol cache.
+
+        // Lookup indexes (see buildIndexes())
+        NameIndex<const Elf64_Shdr *> section_index;
+        NameIndex<const Elf64_Sym *> dynsym_index;
+        NameIndex<const Elf64_Sym *> sym_index;
+        NameIndex<intptr_t> got_index;
+        NameIndex<intptr_t> plt_index;
+        AddrIndex func_index;           // Address -> function name
         std::list<Elf64_Shdr> sec_cache;// Extra allocated sections (PE).
         std::list<Elf64_Sym> sym_cache; // Extra allocated symbols (PE).
         std::string str_cache;          // Extra allocated strings (PE).
@@ -133,6 +244,20 @@ namespace e9tool
     };
 };
 
+/*
+ * Inlined call body.
+ */
+namespace e9tool
+{
+    struct Inline
+    {
+        std::vector<uint8_t> code;      // Function body (without `ret')
+        std::vector<std::pair<size_t, intptr_t>> relocs;
+                                        // (offset, target) rel32 relocs
+        RegSet clobbers = 0x0;          // Registers written by the body
+    };
+};
+
 /*
  * Call trampoline object.
  */
@@ -144,14 +269,20 @@ namespace e9tool
         const CallJump jmp;
         const PatchPos pos;
         const bool state;
+        const bool flags;
+        const bool guard;               // Has an inline guard?
+        const CallVector vec;
+        const Inline * const inl;       // Inlined body, or nullptr
         const ELF * const target;
         const char *const entry;
         const std::vector<ArgumentKind> args;
 
         Call(CallABI abi, CallJump jmp, PatchPos pos, bool state,
+                bool flags, bool guard, CallVector vec, const Inline *inl,
                 const ELF *target, const char *entry,
                 const std::vector<ArgumentKind> &args) :
-            abi(abi), jmp(jmp), pos(pos), state(state), target(target),
+            abi(abi), jmp(jmp), pos(pos), state(state), flags(flags),
+            guard(guard), vec(vec), inl(inl), target(target),
             entry(entry),
             args(args)      // copy
         {
@@ -21,6 +21,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
 #include <cerrno>
 #include <cstdarg>
 #include <cstddef>
@@ -43,11 +45,13 @@
 #include <dlfcn.h>
 #include <elf.h>
 
+#include "e9cache.h"
 #include "e9codegen.h"
 #include "e9elf.h"
 #include "e9tool.h"
 #include "e9misc.h"
 #include "e9types.h"
+#include "e9x86_64.h"
 #include "../e9patch/e9loader.h"
 
 using namespace e9tool;
@@ -136,12 +140,16 @@ void e9tool::sendMessageHeader(FILE *out, const char *method)
         method);
 }
 
+/*
+ * Next message ID (shared by JSON messages and binary records).
+ */
+static unsigned next_id = 0;
+
 /*
  * Send message footer.
  */
 unsigned e9tool::sendMessageFooter(FILE *out, bool sync)
 {
-    static unsigned next_id = 0;
     unsigned id = next_id;
     next_id++;
     fprintf(out, "},\"id\":%u}\n", id);
@@ -330,6 +338,114 @@ unsigned e9tool::sendInstructionMessage(FILE *out, intptr_t addr, size_t size,
     return sendMessageFooter(out);
 }
 
+/*
+ * Send a binary record header (see e9patch `--rpc=binary').
+ */
+static unsigned sendRecordHeader(FILE *out, uint8_t method, size_t size)
+{
+    unsigned id = next_id;
+    next_id++;
+    uint8_t hdr[2 + 2 * sizeof(uint32_t)];
+    uint32_t id32 = id, size32 = (uint32_t)size;
+    hdr[0] = RECORD_MAGIC;
+    hdr[1] = method;
+    memcpy(hdr + 2, &id32, sizeof(id32));
+    memcpy(hdr + 2 + sizeof(id32), &size32, sizeof(size32));
+    fwrite(hdr, sizeof(hdr), 1, out);
+    return id;
+}
+
+/*
+ * Send an "instruction" binary record.
+ */
+unsigned e9tool::sendInstructionRecord(FILE *out, intptr_t addr, size_t size,
+    off_t offset)
+{
+    uint8_t payload[2 * sizeof(uint64_t) + sizeof(uint8_t)];
+    uint64_t addr64 = (uint64_t)addr, offset64 = (uint64_t)offset;
+    memcpy(payload, &addr64, sizeof(addr64));
+    memcpy(payload + sizeof(addr64), &offset64, sizeof(offset64));
+    payload[2 * sizeof(uint64_t)] = (uint8_t)size;
+    unsigned id = sendRecordHeader(out, RECORD_INSTRUCTION, sizeof(payload));
+    fwrite(payload, sizeof(payload), 1, out);
+    return id;
+}
+
+/*
+ * Send an "instructions" binary record for `count' contiguous instructions
+ * starting from (addr, offset).
+ */
+unsigned e9tool::sendInstructionsRecord(FILE *out, intptr_t addr,
+    off_t offset, const uint8_t *sizes, size_t count)
+{
+    if (count > UINT32_MAX - 2 * sizeof(uint64_t) - sizeof(uint32_t))
+        error("failed to send \"instructions\" record; record is too big");
+    uint8_t payload[2 * sizeof(uint64_t) + sizeof(uint32_t)];
+    uint64_t addr64 = (uint64_t)addr, offset64 = (uint64_t)offset;
+    uint32_t count32 = (uint32_t)count;
+    memcpy(payload, &addr64, sizeof(addr64));
+    memcpy(payload + sizeof(addr64), &offset64, sizeof(offset64));
+    memcpy(payload + 2 * sizeof(uint64_t), &count32, sizeof(count32));
+    unsigned id = sendRecordHeader(out, RECORD_INSTRUCTIONS,
+        sizeof(payload) + count);
+    fwrite(payload, sizeof(payload), 1, out);
+    fwrite(sizes, sizeof(uint8_t), count, out);
+    return id;
+}
+
+/*
+ * Send a "patch" binary record.  Here `metadata' is the (possibly empty)
+ * JSON metadata object.
+ */
+unsigned e9tool::sendPatchRecord(FILE *out, const char *trampoline,
+    off_t offset, const char *metadata, size_t len, bool sync)
+{
+    size_t tlen = strlen(trampoline);
+    if (tlen > UINT16_MAX || len >= RECORD_METADATA_REF)
+        error("failed to send \"patch\" record; record is too big");
+    uint64_t offset64 = (uint64_t)offset;
+    uint16_t tlen16   = (uint16_t)tlen;
+    uint32_t len32    = (uint32_t)len;
+    size_t size = sizeof(offset64) + sizeof(tlen16) + tlen + sizeof(len32) +
+        len;
+    unsigned id = sendRecordHeader(out, RECORD_PATCH, size);
+    fwrite(&offset64, sizeof(offset64), 1, out);
+    fwrite(&tlen16, sizeof(tlen16), 1, out);
+    fwrite(trampoline, sizeof(char), tlen, out);
+    fwrite(&len32, sizeof(len32), 1, out);
+    fwrite(metadata, sizeof(char), len, out);
+    if (sync)
+        fflush(out);
+    return id;
+}
+
+/*
+ * Send a "patch" binary record that reuses the metadata of an earlier
+ * record.  Here `ref' is the index of the metadata, counting the non-empty
+ * metadata objects sent by sendPatchRecord() in order.
+ */
+unsigned e9tool::sendPatchRefRecord(FILE *out, const char *trampoline,
+    off_t offset, uint32_t ref, bool sync)
+{
+    size_t tlen = strlen(trampoline);
+    if (tlen > UINT16_MAX)
+        error("failed to send \"patch\" record; record is too big");
+    uint64_t offset64 = (uint64_t)offset;
+    uint16_t tlen16   = (uint16_t)tlen;
+    uint32_t len32    = RECORD_METADATA_REF;
+    size_t size = sizeof(offset64) + sizeof(tlen16) + tlen + sizeof(len32) +
+        sizeof(ref);
+    unsigned id = sendRecordHeader(out, RECORD_PATCH, size);
+    fwrite(&offset64, sizeof(offset64), 1, out);
+    fwrite(&tlen16, sizeof(tlen16), 1, out);
+    fwrite(trampoline, sizeof(char), tlen, out);
+    fwrite(&len32, sizeof(len32), 1, out);
+    fwrite(&ref, sizeof(ref), 1, out);
+    if (sync)
+        fflush(out);
+    return id;
+}
+
 /*
  * Send an "emit" message.
  */
@@ -369,7 +485,51 @@ unsigned e9tool::sendReserveMessage(FILE *out, intptr_t addr, size_t len,
 }
 
 /*
- * Send a "reserve" message.
+ * Send a "reserve" message for a zero-filled mapping.  The pages are only
+ * allocated on first write, so the mapping can be very large.
+ */
+unsigned e9tool::sendReserveZeroMessage(FILE *out, intptr_t addr, size_t len,
+    int prot, bool absolute)
+{
+    sendMessageHeader(out, "reserve");
+    sendParamHeader(out, "address");
+    sendInteger(out, addr);
+    sendSeparator(out);
+    if (absolute)
+    {
+        sendParamHeader(out, "absolute");
+        fprintf(out, "true");
+        sendSeparator(out);
+    }
+    sendParamHeader(out, "protection");
+    fprintf(out, "\"%c%c%c\"",
+        (prot & PROT_READ?  'r': '-'),
+        (prot & PROT_WRITE? 'w': '-'),
+        (prot & PROT_EXEC?  'x': '-'));
+    sendSeparator(out);
+    sendParamHeader(out, "zero");
+    fprintf(out, "true");
+    sendSeparator(out);
+    sendParamHeader(out, "length");
+    sendInteger(out, (intptr_t)len);
+    sendSeparator(out, /*last=*/true);
+    return sendMessageFooter(out);
+}
+
+/*
+ * Send a "reserve" message for a per-thread instrumentation block.
+ */
+unsigned e9tool::sendReserveTLSMessage(FILE *out, size_t size)
+{
+    sendMessageHeader(out, "reserve");
+    sendParamHeader(out, "tls");
+    sendInteger(out, (intptr_t)size);
+    sendSeparator(out, /*last=*/true);
+    return sendMessageFooter(out);
+}
+
+/*
+ * Send a "reserve" message.  If `data' is NULL, the memory is zeroed.
  */
 unsigned e9tool::sendReserveMessage(FILE *out, intptr_t addr,
     const uint8_t *data, size_t len, int prot, intptr_t init, intptr_t fini,
@@ -412,9 +572,9 @@ unsigned e9tool::sendReserveMessage(FILE *out, intptr_t addr,
     sendParamHeader(out, "bytes");
     fputc('[', out);
     for (size_t i = 0; i+1 < len; i++)
-        fprintf(out, "%u,", data[i]);
+        fprintf(out, "%u,", (data == nullptr? 0x0: data[i]));
     if (len != 0)
-        fprintf(out, "%u", data[len-1]);
+        fprintf(out, "%u", (data == nullptr? 0x0: data[len-1]));
     fputc(']', out);
     sendSeparator(out, /*last=*/true);
     return sendMessageFooter(out, /*sync=*/true);
@@ -735,6 +895,194 @@ unsigned e9tool::sendExitTrampolineMessage(FILE *out, BinaryType type,
     return sendMessageFooter(out, /*sync=*/true);
 }
 
+/*
+ * Send a "count" or "cov" "trampoline" message.
+ */
+unsigned e9tool::sendCounterTrampolineMessage(FILE *out, const char *name,
+    bool cov, bool lea)
+{
+    sendMessageHeader(out, "trampoline");
+    sendParamHeader(out, "name");
+    sendString(out, name);
+    sendSeparator(out);
+    sendParamHeader(out, "template");
+    putc('[', out);
+
+    /*
+     * Counter instrumentation updates the site's counter in place without
+     * calling any function.  The counter address, and any state that must
+     * be saved at the patch site, is passed via macros defined by the
+     * "patch" message.
+     */
+    name++;
+    fprintf(out, "\"$SAVE@%s\",", name);
+    if (!lea && !cov)
+    {
+        // lock incq map(%rip)
+        fprintf(out, "%u,%u,%u,%u,\"$MAP@%s\",", 0xf0, 0x48, 0xff, 0x05,
+            name);
+    }
+    else if (!lea)
+    {
+        // incb map(%rip)
+        fprintf(out, "%u,%u,\"$MAP@%s\",", 0xfe, 0x05, name);
+    }
+    else if (!cov)
+    {
+        // mov map(%rip),%rax
+        // lea 0x1(%rax),%rax
+        // mov %rax,map(%rip)
+        fprintf(out, "%u,%u,%u,\"$MAP@%s\",", 0x48, 0x8b, 0x05, name);
+        fprintf(out, "%u,%u,%u,%u,", 0x48, 0x8d, 0x40, 0x01);
+        fprintf(out, "%u,%u,%u,\"$MAP@%s\",", 0x48, 0x89, 0x05, name);
+    }
+    else
+    {
+        // mov map(%rip),%al
+        // lea 0x1(%rax),%eax
+        // mov %al,map(%rip)
+        fprintf(out, "%u,%u,\"$MAP@%s\",", 0x8a, 0x05, name);
+        fprintf(out, "%u,%u,%u,", 0x8d, 0x40, 0x01);
+        fprintf(out, "%u,%u,\"$MAP@%s\",", 0x88, 0x05, name);
+    }
+    fprintf(out, "\"$RSTOR@%s\"", name);
+    putc(']', out);
+
+    sendSeparator(out, /*last=*/true);
+    return sendMessageFooter(out, /*sync=*/true);
+}
+
+/*
+ * Send a "log" "trampoline" message.
+ */
+unsigned e9tool::sendLogTrampolineMessage(FILE *out, const char *name)
+{
+    sendMessageHeader(out, "trampoline");
+    sendParamHeader(out, "name");
+    sendString(out, name);
+    sendSeparator(out);
+    sendParamHeader(out, "template");
+
+    /*
+     * The record layout depends on the patch site (the address, operands
+     * and live registers), so the entire sequence is passed via a macro
+     * defined by the "patch" message (see sendLogMetadata()).
+     */
+    fprintf(out, "[\"$LOG@%s\"]", name+1);
+
+    sendSeparator(out, /*last=*/true);
+    return sendMessageFooter(out, /*sync=*/true);
+}
+
+/*
+ * Send a "hook" trampoline message, and the shared return trampoline
+ * (`stub') that the hooked functions return to.  The return trampoline
+ * pops the shadow stack frame for the current stack pointer (discarding
+ * frames skipped by longjmp()), calls func(function, %rax), and returns to
+ * the original return address.  The return registers (%rax, %rdx, %xmm0,
+ * %xmm1) are preserved, and the other caller-saved registers are assumed to
+ * be dead (as per the SysV ABI).
+ */
+unsigned e9tool::sendHookTrampolineMessage(FILE *out, const char *name,
+    intptr_t stub, intptr_t buf, intptr_t func)
+{
+    CodeBuffer code;
+    const int32_t depth = E9_TLS_DATA + (int32_t)buf;
+    const int32_t data  = depth + (int32_t)sizeof(uint64_t);
+
+    // push %rax                        # return address slot
+    // push %rax
+    // push %rdx
+    // lea 0x10(%rsp),%rdi              # the slot
+    // mov %gs:depth,%rcx
+    code.emit(0x50, 0x50, 0x52);
+    code.emit(0x48, 0x8d, 0x7c, 0x24, 0x10);
+    code.emit(0x65, 0x48, 0x8b, 0x0c, 0x25);
+    code.emitInt32(depth);
+
+    // .Lpop:
+    // test %rcx,%rcx
+    // jz .Lfail
+    // dec %rcx
+    // lea (%rcx,%rcx,2),%rsi
+    // shl $3,%rsi
+    // cmp %gs:data+8(%rsi),%rdi
+    // ja .Lpop                         # frame skipped by longjmp()
+    // jne .Lfail
+    size_t pop = code.bytes.size();
+    code.emit(0x48, 0x85, 0xc9);
+    code.emit(0x74, 0x00);
+    size_t fail1 = code.bytes.size();
+    code.emit(0x48, 0xff, 0xc9);
+    code.emit(0x48, 0x8d, 0x34, 0x49);
+    code.emit(0x48, 0xc1, 0xe6, 0x03);
+    code.emit(0x65, 0x48, 0x3b, 0xbe);
+    code.emitInt32(data + (int32_t)sizeof(uint64_t));
+    code.emit(0x77, (uint8_t)(pop - (code.bytes.size() + 2)));
+    code.emit(0x75, 0x00);
+    size_t fail2 = code.bytes.size();
+
+    // mov %rcx,%gs:depth
+    // mov %gs:data(%rsi),%rax
+    // mov %rax,0x10(%rsp)              # return address
+    // mov %gs:data+16(%rsi),%rdi       # function address
+    // mov 0x8(%rsp),%rsi               # return value
+    code.emit(0x65, 0x48, 0x89, 0x0c, 0x25);
+    code.emitInt32(depth);
+    code.emit(0x65, 0x48, 0x8b, 0x86);
+    code.emitInt32(data);
+    code.emit(0x48, 0x89, 0x44, 0x24, 0x10);
+    code.emit(0x65, 0x48, 0x8b, 0xbe);
+    code.emitInt32(data + 2 * (int32_t)sizeof(uint64_t));
+    code.emit(0x48, 0x8b, 0x74, 0x24, 0x08);
+
+    // push %rbp
+    // mov %rsp,%rbp
+    // and $-16,%rsp
+    // sub $0x20,%rsp
+    // movdqu %xmm0,(%rsp)
+    // movdqu %xmm1,0x10(%rsp)
+    // callq func
+    // movdqu (%rsp),%xmm0
+    // movdqu 0x10(%rsp),%xmm1
+    // mov %rbp,%rsp
+    // pop %rbp
+    code.emit(0x55, 0x48, 0x89, 0xe5);
+    code.emit(0x48, 0x83, 0xe4, 0xf0);
+    code.emit(0x48, 0x83, 0xec, 0x20);
+    code.emit(0xf3, 0x0f, 0x7f, 0x04, 0x24);
+    code.emit(0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10);
+    code.emit(0xe8);
+    code.emitInt32((int32_t)(func - (stub + (intptr_t)code.bytes.size() +
+        (intptr_t)sizeof(int32_t))));
+    code.emit(0xf3, 0x0f, 0x6f, 0x04, 0x24);
+    code.emit(0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10);
+    code.emit(0x48, 0x89, 0xec, 0x5d);
+
+    // pop %rdx
+    // pop %rax
+    // retq                             # to the original return address
+    code.emit(0x5a, 0x58, 0xc3);
+
+    // .Lfail:                          # corrupted shadow stack
+    // ud2
+    code.bytes[fail1 - 1] = (uint8_t)(code.bytes.size() - fail1);
+    code.bytes[fail2 - 1] = (uint8_t)(code.bytes.size() - fail2);
+    code.emit(0x0f, 0x0b);
+
+    sendReserveMessage(out, stub, code.bytes.data(), code.bytes.size(),
+        PROT_READ | PROT_EXEC);
+
+    sendMessageHeader(out, "trampoline");
+    sendParamHeader(out, "name");
+    sendString(out, name);
+    sendSeparator(out);
+    sendParamHeader(out, "template");
+    fprintf(out, "[\"$HOOK@%s\"]", name+1);
+    sendSeparator(out, /*last=*/true);
+    return sendMessageFooter(out, /*sync=*/true);
+}
+
 /*
  * Parse a name.
  */
@@ -851,6 +1199,42 @@ static void parseSymbols(const uint8_t *data, const Elf64_Shdr *shdr_syms,
     }
 }
 
+/*
+ * Build the lookup indexes for a parsed ELF file.
+ */
+template <typename V, typename Info>
+static void buildIndex(NameIndex<V> &index, const Info &info)
+{
+    index.reserve(info.size());
+    for (const auto &entry: info)
+        index.insert(entry.first, entry.second);
+}
+static void buildIndexes(ELF *elf)
+{
+    buildIndex(elf->section_index, elf->sections);
+    buildIndex(elf->dynsym_index, elf->dynsyms);
+    buildIndex(elf->sym_index, elf->syms);
+    buildIndex(elf->got_index, elf->got);
+    buildIndex(elf->plt_index, elf->plt);
+
+    // Function symbols take precedence over PLT entries:
+    elf->func_index.reserve(elf->dynsyms.size() + elf->syms.size() +
+        elf->plt.size());
+    for (const SymbolInfo *syms: {&elf->dynsyms, &elf->syms})
+    {
+        for (const auto &entry: *syms)
+        {
+            const Elf64_Sym *sym = entry.second;
+            if (sym->st_shndx == SHN_UNDEF ||
+                    ELF64_ST_TYPE(sym->st_info) != STT_FUNC)
+                continue;
+            elf->func_index.insert((intptr_t)sym->st_value, entry.first);
+        }
+    }
+    for (const auto &entry: elf->plt)
+        elf->func_index.insert(entry.second, entry.first);
+}
+
 /*
  * Parse an ELF file.
  */
@@ -1193,6 +1577,7 @@ ELF *e9tool::parseELF(const char *filename, intptr_t base)
     elf->exes.reserve(exes.size());
     for (const auto &entry: exes)
         elf->exes.push_back(entry.second);
+    buildIndexes(elf);
     return elf;
 }
 
@@ -1514,6 +1899,7 @@ ELF *e9tool::parsePE(const char *filename)
     elf->sec_cache.swap(sec_cache);
     elf->sym_cache.swap(sym_cache);
     elf->str_cache.swap(strs);
+    buildIndexes(elf);
 
     return elf;
 }
@@ -1581,38 +1967,33 @@ intptr_t e9tool::getELFEndAddr(const ELF *elf)
 }
 const Elf64_Shdr *e9tool::getELFSection(const ELF *elf, const char *name)
 {
-    auto i = elf->sections.find(name);
-    if (i == elf->sections.end())
-        return nullptr;
-    return i->second;
+    auto i = elf->section_index.find(name);
+    return (i == nullptr? nullptr: *i);
 }
 const Elf64_Sym *e9tool::getELFDynSym(const ELF *elf, const char *name)
 {
-    auto i = elf->dynsyms.find(name);
-    if (i == elf->dynsyms.end())
-        return nullptr;
-    return i->second;
+    auto i = elf->dynsym_index.find(name);
+    return (i == nullptr? nullptr: *i);
 }
 const Elf64_Sym *e9tool::getELFSym(const ELF *elf, const char *name)
 {
-    auto i = elf->syms.find(name);
-    if (i == elf->syms.end())
-        return nullptr;
-    return i->second;
+    auto i = elf->sym_index.find(name);
+    return (i == nullptr? nullptr: *i);
 }
 intptr_t e9tool::getELFPLTEntry(const ELF *elf, const char *name)
 {
-    auto i = elf->plt.find(name);
-    if (i == elf->plt.end())
-        return INTPTR_MIN;
-    return i->second;
+    auto i = elf->plt_index.find(name);
+    return (i == nullptr? INTPTR_MIN: *i);
 }
 intptr_t e9tool::getELFGOTEntry(const ELF *elf, const char *name)
 {
-    auto i = elf->got.find(name);
-    if (i == elf->got.end())
-        return INTPTR_MIN;
-    return i->second;
+    auto i = elf->got_index.find(name);
+    return (i == nullptr? INTPTR_MIN: *i);
+}
+const char *e9tool::getELFFuncName(const ELF *elf, intptr_t addr)
+{
+    auto i = elf->func_index.find(addr);
+    return (i == nullptr? nullptr: *i);
 }
 const char *e9tool::getELFStrTab(const ELF *elf)
 {
@@ -1816,10 +2197,18 @@ unsigned e9tool::sendCallTrampolineMessage(FILE *out, const char *name,
     sendSeparator(out);
     sendParamHeader(out, "template");
     putc('[', out);
+    CodeBuffer code;
 
     // Adjust the stack:
-    fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",     // lea -0x4000(%rsp),%rsp
-        0x48, 0x8d, 0xa4, 0x24, -0x4000);
+    code.emit(0x48, 0x8d, 0xa4, 0x24);          // lea -0x4000(%rsp),%rsp
+    code.emitInt32(-0x4000);
+
+    // Test the guard (if any), see sendCallMetadata():
+    if (call.guard)
+        code.emitEntry("\"$GUARD@%s\"", patch);
+
+    // Save the vector registers (if clobbered by the target):
+    sendSaveVectorRegs(code, call.vec, 0x4000);
 
     // Push all caller-save registers:
     bool conditional = (call.jmp != JUMP_NONE);
@@ -1827,37 +2216,44 @@ unsigned e9tool::sendCallTrampolineMessage(FILE *out, const char *name,
     bool state = call.state;
     const int *rsave = getCallerSaveRegs(sysv, clean, state, conditional,
         call.args.size());
-    int num_rsave = 0;
+    int rsave_inline[RMAX_IDX+2];
+    rsave = getInlineCallerSaveRegs(sysv, call, rsave, rsave_inline);
     Register rscratch = (clean || state? REGISTER_RAX: REGISTER_INVALID);
-    int32_t offset = 0x4000;
-    for (int i = 0; rsave[i] >= 0; i++, num_rsave++)
+    if (option_liveness)
     {
-        sendPush(out, offset, (call.pos != POS_AFTER), getReg(rsave[i]),
-            rscratch);
-        if (rsave[i] != RSP_IDX && rsave[i] != RIP_IDX)
-            offset += sizeof(int64_t);
+        // The saved registers depend on the liveness at each patch site,
+        // so are sent as metadata (see sendCallMetadata()).
+        code.emitEntry("\"$PUSH@%s\"", patch);
     }
+    else
+        sendPushCallerSaveRegs(code, rsave, (call.pos != POS_AFTER), rscratch);
 
     // Load the arguments:
-    fprintf(out, "\"$ARGS@%s\",", patch);
+    code.emitEntry("\"$ARGS@%s\"", patch);
     if (!sysv)
     {
         // lea -0x20(%rsp),%rsp         # MS ABI red-zone
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            0x48, 0x8d, 0x64, 0x24, -0x20);
+        code.emit(0x48, 0x8d, 0x64, 0x24);
+        code.emitInt8(-0x20);
     }
 
-    // Call the function:
-    fprintf(out, "%u,\"$FUNC@%s\",", 0xe8, patch);      // callq function
+    // Call (or inline) the function:
+    if (call.inl != nullptr)
+        sendInlineCode(code, *call.inl);
+    else
+    {
+        code.emit(0xe8);                        // callq function
+        code.emitEntry("\"$FUNC@%s\"", patch);
+    }
 
     // Restore the state:
     if (!sysv)
     {
         // lea 0x20(%rsp),%rsp          # MS ABI red-zone
-        fprintf(out, "%u,%u,%u,%u,{\"int8\":%d},",
-            0x48, 0x8d, 0x64, 0x24, 0x20);
+        code.emit(0x48, 0x8d, 0x64, 0x24);
+        code.emitInt8(0x20);
     }
-    fprintf(out, "\"$RSTOR@%s\",", patch);
+    code.emitEntry("\"$RSTOR@%s\"", patch);
     
     // If clean & conditional & !state, store result in %rcx, else in %rax
     bool preserve_rax = (conditional || !clean);
@@ -1865,19 +2261,21 @@ unsigned e9tool::sendCallTrampolineMessage(FILE *out, const char *name,
     if (conditional && clean && !state)
     {
         // mov %rax,%rcx
-        fprintf(out, "%u,%u,%u,", 0x48, 0x89, 0xc1);
+        code.emit(0x48, 0x89, 0xc1);
         preserve_rax = false;
         result_rax   = false;
     }
 
     // Pop all callee-save registers:
-    int rmin = (conditional? 1: 0);
-    for (int i = num_rsave-1; i >= rmin; i--)
-    {
-        if (rsave[i] == RSP_IDX || rsave[i] == RIP_IDX)
-            continue;
-        sendPop(out, preserve_rax, getReg(rsave[i]));
-    }
+    if (option_liveness)
+        code.emitEntry("\"$POP@%s\"", patch);
+    else
+        sendPopCallerSaveRegs(code, rsave, conditional, preserve_rax);
+
+    // Restore the vector registers (for conditional calls, the first
+    // register is still on the stack):
+    sendRestoreVectorRegs(code, call.vec,
+        0x4000 + (conditional? (int32_t)sizeof(int64_t): 0));
 
     // If conditional, jump to $instruction if %rax is zero:
     if (conditional)
@@ -1888,14 +2286,16 @@ unsigned e9tool::sendCallTrampolineMessage(FILE *out, const char *name,
             // jrcxz .Lskip
             // xchg %rax,%rcx
             //
-            fprintf(out, "%u,%u,", 0x48, 0x91);
-            fprintf(out, "%u,{\"rel8\":\".Lskip@%s\"},", 0xe3, patch);
-            fprintf(out, "%u,%u,", 0x48, 0x91);
+            code.emit(0x48, 0x91);
+            code.emit(0xe3);
+            code.emitEntry("{\"rel8\":\".Lskip@%s\"}", patch);
+            code.emit(0x48, 0x91);
         }
         else
         {
             // jrcxz .Lskip
-            fprintf(out, "%u,{\"rel8\":\".Lskip@%s\"},", 0xe3, patch);
+            code.emit(0xe3);
+            code.emitEntry("{\"rel8\":\".Lskip@%s\"}", patch);
         }
 
         // The result is non-zero
@@ -1905,35 +2305,55 @@ unsigned e9tool::sendCallTrampolineMessage(FILE *out, const char *name,
             // pop %rax/rcx
             //
             int tls_offset = 0x40; 
-            fprintf(out, "%u,%u,%u,%u,%u,{\"int32\":%d},",
-                0x64, 0x48, 0x89, (result_rax? 0x04: 0x0c), 0x25, tls_offset);
-            fprintf(out, "%u,", (result_rax? 0x58: 0x59));
-            fprintf(out, "\"$RSTOR_RSP@%s\",", patch);
+            code.emit(0x64, 0x48, 0x89, (result_rax? 0x04: 0x0c), 0x25);
+            code.emitInt32(tls_offset);
+            code.emit(result_rax? 0x58: 0x59);
+            code.emitEntry("\"$RSTOR_RSP@%s\"", patch);
 
             // jmpq *%fs:0x40
-            fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-                0x64, 0xff, 0x24, 0x25, tls_offset);
+            code.emit(0x64, 0xff, 0x24, 0x25);
+            code.emitInt32(tls_offset);
         }
         else
         {
-            fprintf(out, "%u,", (result_rax? 0x58: 0x59));
-            fprintf(out, "\"$RSTOR_RSP@%s\",", patch);
-            fputs("\"$break\",", out);
+            code.emit(result_rax? 0x58: 0x59);
+            code.emitEntry("\"$RSTOR_RSP@%s\"", patch);
+            code.emitEntry("\"$break\"");
         }
  
         // The result is zero...
-        fprintf(out, "\".Lskip@%s\",", patch);
+        code.emitEntry("\".Lskip@%s\"", patch);
         if (result_rax)
         {
             // xchg %rax,%rcx
-            fprintf(out, "%u,%u,", 0x48, 0x91);
+            code.emit(0x48, 0x91);
         }
-        fprintf(out, "%u,", (result_rax? 0x58: 0x59));
+        code.emit(result_rax? 0x58: 0x59);
     }
 
     // Restore the stack pointer.
-    fprintf(out, "\"$RSTOR_RSP@%s\"]", patch);
-    
+    if (!call.guard)
+        code.emitEntry("\"$RSTOR_RSP@%s\"", patch);
+    else
+    {
+        // The guard is false: skip the call entirely.
+        //
+        // jmp .Ldone
+        // .Lguard:
+        // lea 0x4000(%rsp),%rsp
+        // .Ldone:
+        code.emitEntry("\"$RSTOR_RSP@%s\"", patch);
+        code.emit(0xe9);
+        code.emitEntry("{\"rel32\":\".Ldone@%s\"}", patch);
+        code.emitEntry("\".Lguard@%s\"", patch);
+        code.emitEntry("\"$UNGUARD@%s\"", patch);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(0x4000);
+        code.emitEntry("\".Ldone@%s\"", patch);
+    }
+    sendCodeBuffer(out, code);
+    putc(']', out);
+
     sendSeparator(out, /*last=*/true);
     return sendMessageFooter(out, /*sync=*/true);
 }
@@ -1986,35 +2406,226 @@ static void checkCompatible(const ELF &elf, const ELF &target)
 }
 
 /*
- * Make a call trampoline object.
+ * Extract the body of function `entry' from `target' for inlining, else
+ * return nullptr.
  */
-const Call &e9tool::makeCall(const ELF *elf, const char *filename,
-    const char *entry, CallABI abi, CallJump jmp, PatchPos pos,
-    const std::vector<ArgumentKind> &args)
+static const Inline *makeInline(const ELF *target, const char *entry,
+    bool state, const std::vector<ArgumentKind> &args)
+{
+    bool sysv = true;
+    switch (target->type)
+    {
+        case BINARY_TYPE_PE_EXE: case BINARY_TYPE_PE_DLL:
+            sysv = false;
+            break;
+        default:
+            break;
+    }
+    const char *reason = nullptr;
+    const Elf64_Sym *sym = nullptr;
+    std::string e9entry("e9_");
+    e9entry += entry;
+    for (const char *name: {entry, e9entry.c_str()})
+    {
+        auto i = target->dynsyms.find(name);
+        if (i != target->dynsyms.end() &&
+                ELF64_ST_TYPE(i->second->st_info) == STT_FUNC)
+        {
+            sym = i->second;
+            break;
+        }
+    }
+    if (state)
+        reason = "the \"state\" argument requires a call";
+    for (size_t argno = 0; reason == nullptr && argno < args.size(); argno++)
+    {
+        switch (getArgRegIdx(sysv, (int)argno))
+        {
+            case R10_IDX: case R11_IDX: case -1:
+                reason = "arguments are passed on the stack";
+                break;
+        }
+    }
+    if (reason == nullptr && sym == nullptr)
+        reason = "the function is not a C function symbol";
+    const Elf64_Shdr *shdr = nullptr;
+    for (size_t i = 0; reason == nullptr && i < target->exes.size(); i++)
+    {
+        const Elf64_Shdr *exe = target->exes[i];
+        if (sym->st_value >= exe->sh_addr &&
+                sym->st_value + sym->st_size <= exe->sh_addr + exe->sh_size)
+            shdr = exe;
+    }
+    if (reason == nullptr && shdr == nullptr)
+        reason = "the function is not within an executable section";
+    if (reason == nullptr)
+    {
+        Inline *inl = new Inline;
+        const uint8_t *code = target->data + shdr->sh_offset +
+            (sym->st_value - shdr->sh_addr);
+        intptr_t addr = target->base + (intptr_t)sym->st_value;
+        if (getInline(code, sym->st_size, addr, *inl, &reason))
+        {
+            debug("inlined function \"%s\" from binary \"%s\" (%zu bytes)",
+                entry, target->filename, inl->code.size());
+            return inl;
+        }
+        delete inl;
+    }
+    warning("failed to inline function \"%s\" from binary \"%s\"; %s "
+        "(a call will be used instead)", entry, target->filename, reason);
+    return nullptr;
+}
+
+/*
+ * Next free address for call targets and counter maps.
+ */
+static intptr_t file_addr = 0x70000000;
+
+/*
+ * Allocate a page-aligned address range for reserved memory.
+ */
+intptr_t e9tool::allocAddress(size_t len)
 {
-    static std::map<const char *, ELF *, CStrCmp> files;
-    static intptr_t file_addr = 0x70000000;
+    intptr_t addr = file_addr;
+    file_addr += (intptr_t)len + 2 * PAGE_SIZE;
+    file_addr -= file_addr % PAGE_SIZE;
+    return addr;
+}
 
+/*
+ * Get the size of a "log" record: the instruction address, the arguments,
+ * and the (optional) timestamp.
+ */
+size_t e9tool::getLogRecordSize(size_t num_args, bool tsc)
+{
+    return sizeof(uint64_t) * (1 + num_args + (tsc? 1: 0));
+}
+
+/*
+ * Get the size of a "hook" shadow stack: the depth, and the frames.
+ */
+size_t e9tool::getHookStackSize(unsigned entries)
+{
+    return sizeof(uint64_t) + entries * HOOK_FRAME_SIZE;
+}
+
+/*
+ * Call targets (i.e., parsed instrumentation binaries).
+ */
+struct CallTarget
+{
+    ELF *elf;                       // The parsed binary
+    CallVector vec;                 // Vector register usage
+    bool checked;                   // Compatibility checked?
+};
+static std::map<const char *, CallTarget *, CStrCmp> targets;
+static std::multimap<uint64_t, CallTarget *> target_hashes;
+
+/*
+ * Find an already parsed call target with identical contents to the file
+ * `filename', else return nullptr.
+ */
+static CallTarget *findCallTarget(const char *filename, uint64_t &hash)
+{
+    hash = CACHE_HASH_INIT;
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd < 0)
+        return nullptr;
+    struct stat stat;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &stat) == 0 && stat.st_size > 0)
+        ptr = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+    size_t size = (size_t)stat.st_size;
+    hash = hashData(hash, ptr, size);
+    CallTarget *T = nullptr;
+    auto r = target_hashes.equal_range(hash);
+    for (auto i = r.first; T == nullptr && i != r.second; ++i)
+    {
+        const ELF *elf = i->second->elf;
+        if (elf->size == size && memcmp(elf->data, ptr, size) == 0)
+            T = i->second;
+    }
+    munmap(ptr, size);
+    return T;
+}
+
+/*
+ * Get (or parse) a call target.  Targets are cached by path and by
+ * contents, so identical instrumentation binaries (e.g., from the
+ * e9compile.sh build cache) are only parsed and embedded once.
+ */
+static CallTarget &getCallTarget(const char *filename)
+{
     char *pathname = realpath(filename, nullptr);
     if (pathname == nullptr)
         error("failed to get path for file \"%s\": %s", filename,
             strerror(errno));
-
-    ELF *target = nullptr;
-    auto i = files.find(pathname);
-    if (i == files.end())
+    auto i = targets.find(pathname);
+    if (i != targets.end())
     {
-        target = parseELF(filename, file_addr);
-        checkCompatible(*elf, *target);
-        files.insert({pathname, target});
-        file_addr  = target->end + 2 * PAGE_SIZE;
-        file_addr -= file_addr % PAGE_SIZE;
+        free((void *)pathname);
+        return *i->second;
     }
-    else
+    uint64_t hash;
+    CallTarget *T = findCallTarget(pathname, hash);
+    if (T != nullptr)
     {
-        free((void *)pathname);
-        target = i->second;
+        debug("call target \"%s\" is identical to \"%s\"", filename,
+            T->elf->filename);
+        targets.insert({pathname, T});
+        return *T;
+    }
+
+    ELF *target = parseELF(filename, file_addr);
+    file_addr  = target->end + 2 * PAGE_SIZE;
+    file_addr -= file_addr % PAGE_SIZE;
+
+    // Detect if the target may clobber the vector registers:
+    CallVector vec = VECTOR_NONE;
+    for (const auto *exe: target->exes)
+        vec = std::max(vec, getVectorUsage(target->data + exe->sh_offset,
+            exe->sh_size));
+    if (vec != VECTOR_NONE)
+        debug("call target \"%s\" uses vector registers; clean calls "
+            "will save/restore the %s registers", filename,
+            (vec == VECTOR_XMM? "%xmm": vec == VECTOR_YMM? "%ymm":
+                "%zmm/%k"));
+    T = new CallTarget;
+    T->elf     = target;
+    T->vec     = vec;
+    T->checked = false;
+    targets.insert({pathname, T});
+    target_hashes.insert({hash, T});
+    return *T;
+}
+
+/*
+ * Load a call target ahead of time, so that it can be shared (e.g., by the
+ * batch mode worker processes).
+ */
+void e9tool::loadCallTarget(const char *filename)
+{
+    (void)getCallTarget(filename);
+}
+
+/*
+ * Make a call trampoline object.
+ */
+const Call &e9tool::makeCall(const ELF *elf, const char *filename,
+    const char *entry, CallABI abi, CallJump jmp, PatchPos pos,
+    const std::vector<ArgumentKind> &args, bool flags, bool inl, bool guard)
+{
+    CallTarget &T = getCallTarget(filename);
+    if (!T.checked)
+    {
+        checkCompatible(*elf, *T.elf);
+        T.checked = true;
     }
+    ELF *target = T.elf;
 
     bool state = false;
     for (auto arg: args)
@@ -2024,7 +2635,11 @@ const Call &e9tool::makeCall(const ELF *elf, const char *filename,
         if (state)
             break;
     }
-    Call *call = new Call(abi, jmp, pos, state, target, strDup(entry), args);
+    const Inline *body = (inl? makeInline(target, entry, state, args): nullptr);
+    CallVector vec = (abi == ABI_CLEAN && body == nullptr? T.vec:
+        VECTOR_NONE);
+    Call *call = new Call(abi, jmp, pos, state, flags, guard, vec, body,
+        target, strDup(entry), args);
     return *call;
 }
 
@@ -22,6 +22,9 @@
  */
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <asm/prctl.h>
 
 #include "e9action.h"
 #include "e9csv.h"
@@ -32,6 +35,8 @@
 #include "e9tool.h"
 #include "e9x86_64.h"
 
+#include "../e9patch/e9loader.h"
+
 using namespace e9tool;
 
 /*
@@ -337,10 +342,9 @@ struct CallInfo
     /*
      * Constructor.
      */
-    CallInfo(bool sysv, bool clean, bool state,  bool conditional,
-            size_t num_args, bool before, bool pic) :
-        rsave(getCallerSaveRegs(sysv, clean, state, conditional, num_args)),
-        before(before), pic(pic)
+    CallInfo(const int *rsave, bool clean, bool state, bool before,
+            bool pic) :
+        rsave(rsave), before(before), pic(pic)
     {
         for (unsigned i = 0; rsave[i] >= 0; i++)
             push(getReg(rsave[i]), /*caller_save=*/true);
@@ -439,7 +443,7 @@ static Type getOperandType(const InstrInfo *I, const OpInfo *op, bool ptr,
  * Emits an instruction to load the given value into the corresponding
  * argno register.
  */
-static void sendLoadValueMetadata(FILE *out, intptr_t value, int regno)
+static void sendLoadValueMetadata(CodeBuffer &out, intptr_t value, int regno)
 {
     if (value >= INT32_MIN && value <= INT32_MAX)
         sendSExtFromI32ToR64(out, value, regno);
@@ -453,7 +457,7 @@ static void sendLoadValueMetadata(FILE *out, intptr_t value, int regno)
  * Emits an instruction to load a pointer into the corresponding argno
  * register.
  */
-static void sendLoadPointerMetadata(FILE *out, CallInfo &info,
+static void sendLoadPointerMetadata(CodeBuffer &out, CallInfo &info,
     bool _static, intptr_t static_ptr, const char *dynamic_ptr, int regno)
 {
     if (_static || !info.pic)
@@ -461,8 +465,8 @@ static void sendLoadPointerMetadata(FILE *out, CallInfo &info,
     else
         sendLeaFromPCRelToR64(out, dynamic_ptr, regno);
 }
-static void sendLoadPointerMetadata(FILE *out, CallInfo &info, bool _static,
-    intptr_t ptr, int regno)
+static void sendLoadPointerMetadata(CodeBuffer &out, CallInfo &info,
+    bool _static, intptr_t ptr, int regno)
 {
     if (_static || !info.pic)
         sendLoadValueMetadata(out, ptr, regno);
@@ -475,7 +479,7 @@ static void sendLoadPointerMetadata(FILE *out, CallInfo &info, bool _static,
  * Returns scratch storage indicating where the current value is moved to:
  * (<0)=stack, (<RMAX)=register, else no need to save register.
  */
-static int sendTemporaryMovReg(FILE *out, CallInfo &info, Register reg,
+static int sendTemporaryMovReg(CodeBuffer &out, CallInfo &info, Register reg,
     const Register *exclude, int *slot)
 {
     int regno = getRegIdx(reg);
@@ -502,7 +506,7 @@ static int sendTemporaryMovReg(FILE *out, CallInfo &info, Register reg,
 /*
  * Temporarily save a register, allowing it to be used for another purpose.
  */
-static int sendTemporarySaveReg(FILE *out, CallInfo &info, Register reg,
+static int sendTemporarySaveReg(CodeBuffer &out, CallInfo &info, Register reg,
     const Register *exclude, int *slot)
 {
     if (info.isClobbered(reg))
@@ -513,8 +517,8 @@ static int sendTemporarySaveReg(FILE *out, CallInfo &info, Register reg,
 /*
  * Temporarily restore a register to its original value.
  */
-static int sendTemporaryRestoreReg(FILE *out, CallInfo &info, Register reg,
-    const Register *exclude, int *slot)
+static int sendTemporaryRestoreReg(CodeBuffer &out, CallInfo &info,
+    Register reg, const Register *exclude, int *slot)
 {
     if (!info.isClobbered(reg))
         return INT32_MAX;
@@ -534,7 +538,7 @@ static int sendTemporaryRestoreReg(FILE *out, CallInfo &info, Register reg,
 /*
  * Undo sendTemporaryMovReg().
  */
-static void sendUndoTemporaryMovReg(FILE *out, Register reg, int scratch)
+static void sendUndoTemporaryMovReg(CodeBuffer &out, Register reg, int scratch)
 {
     if (scratch > RMAX_IDX)
         return;     // Was not saved.
@@ -563,7 +567,7 @@ static Register getScratchRegister(int slot)
 /*
  * Send instructions that ensure the given register is saved.
  */
-static bool sendSaveRegToStack(FILE *out, CallInfo &info, Register reg)
+static bool sendSaveRegToStack(CodeBuffer &out, CallInfo &info, Register reg)
 {
     if (info.isSaved(reg))
         return true;
@@ -583,7 +587,7 @@ static bool sendSaveRegToStack(FILE *out, CallInfo &info, Register reg)
 /*
  * Send a load (mov/lea) from a memory operand to a register.
  */
-static bool sendLoadFromMemOpToR64(FILE *out, const InstrInfo *I,
+static bool sendLoadFromMemOpToR64(CodeBuffer &out, const InstrInfo *I,
     CallInfo &info, uint8_t size, Register seg_reg, int32_t disp,
     Register base_reg, Register index_reg, uint8_t scale, bool lea, int regno,
     bool asis = false)
@@ -786,22 +790,22 @@ static bool sendLoadFromMemOpToR64(FILE *out, const InstrInfo *I,
     }
 
     if (seg_prefix != 0)
-        fprintf(out, "%u,", seg_prefix);
+        out.emit(seg_prefix);
     if (size_prefix != 0)
-        fprintf(out, "%u,", size_prefix);
-    fprintf(out, "%u,", rex);
+        out.emit(size_prefix);
+    out.emit(rex);
     if (lea)
-        fprintf(out, "%u,", /*lea=*/0x8d);
+        out.emit(/*lea=*/0x8d);
     else switch (size)
     {
         case sizeof(int64_t):
-            fprintf(out, "%u,", /*mov=*/0x8b); break;
+            out.emit(/*mov=*/0x8b); break;
         case sizeof(int32_t):
-            fprintf(out, "%u,", /*movslq=*/0x63); break;
+            out.emit(/*movslq=*/0x63); break;
         case sizeof(int16_t):
-            fprintf(out, "%u,%u,", 0x0f, /*movswq=*/0xbf); break;
+            out.emit(0x0f, /*movswq=*/0xbf); break;
         case sizeof(int8_t):
-            fprintf(out, "%u,%u,", 0x0f, /*movsbq=*/0xbe); break;
+            out.emit(0x0f, /*movsbq=*/0xbe); break;
         default:
             warning(CONTEXT_FORMAT "failed to load memory "
                 "operand contents into register %s; operand "
@@ -810,18 +814,18 @@ static bool sendLoadFromMemOpToR64(FILE *out, const InstrInfo *I,
             sendSExtFromI32ToR64(out, 0, regno);
             return false;
     }
-    fprintf(out, "%u,", modrm);
+    out.emit(modrm);
     if (have_sib)
-        fprintf(out, "%u,", sib);
+        out.emit(sib);
     if (have_rel32)
-        fprintf(out, "{\"rel32\":%d},", (int32_t)disp);
+        out.emitEntry("{\"rel32\":%d}", (int32_t)disp);
     else switch (disp_size)
     {
         case sizeof(int8_t):
-            fprintf(out, "{\"int8\":%d},", (int32_t)disp);
+            out.emitInt8((int32_t)disp);
             break;
         case sizeof(int32_t):
-            fprintf(out, "{\"int32\":%d},", (int32_t)disp);
+            out.emitInt32((int32_t)disp);
             break;
     }
 
@@ -836,7 +840,8 @@ static bool sendLoadFromMemOpToR64(FILE *out, const InstrInfo *I,
 /*
  * Load a register to an arg register.
  */
-static void sendLoadRegToArg(FILE *out, Register reg, CallInfo &info, int regno)
+static void sendLoadRegToArg(CodeBuffer &out, Register reg, CallInfo &info,
+    int regno)
 {
     size_t size = getRegSize(reg);
     if (info.isClobbered(reg))
@@ -884,7 +889,7 @@ static void sendLoadRegToArg(FILE *out, Register reg, CallInfo &info, int regno)
 /*
  * Emits instructions to load a register by value or reference.
  */
-static bool sendLoadRegToArg(FILE *out, const InstrInfo *I, Register reg,
+static bool sendLoadRegToArg(CodeBuffer &out, const InstrInfo *I, Register reg,
     bool ptr, CallInfo &info, int regno)
 {
     if (ptr)
@@ -932,7 +937,7 @@ static bool sendLoadRegToArg(FILE *out, const InstrInfo *I, Register reg,
  * Emits instructions to load an operand into the corresponding
  * regno register.  If the operand does not exist, load 0.
  */
-static bool sendLoadOperandMetadata(FILE *out, const char *name,
+static bool sendLoadOperandMetadata(CodeBuffer &out, const char *name,
     const InstrInfo *I, const OpInfo *op, bool ptr, FieldKind field,
     CallInfo &info, int regno)
 {
@@ -1074,7 +1079,7 @@ static bool sendLoadOperandMetadata(FILE *out, const char *name,
 /*
  * Emits operand data.
  */
-static void sendOperandDataMetadata(FILE *out, const char *name,
+static void sendOperandDataMetadata(CodeBuffer &out, const char *name,
     const InstrInfo *I, const OpInfo *op, int regno)
 {
     if (op == nullptr)
@@ -1083,22 +1088,20 @@ static void sendOperandDataMetadata(FILE *out, const char *name,
     switch (op->type)
     {
         case OPTYPE_IMM:
-            fprintf(out, "\".Limm%d@%s\",", regno, name);
+            out.emitEntry("\".Limm%d@%s\"", regno, name);
             switch (op->size)
             {
                 case 1:
-                    fprintf(out, "{\"int8\":%d},", (int32_t)op->imm);
+                    out.emitInt8((int32_t)op->imm);
                     break;
                 case 2:
-                    fprintf(out, "{\"int16\":%d},", (uint32_t)op->imm);
+                    out.emitInt16((uint32_t)op->imm);
                     break;
                 case 4:
-                    fprintf(out, "{\"int32\":%d},", (uint32_t)op->imm);
+                    out.emitInt32((uint32_t)op->imm);
                     break;
                 default:
-                    fputs("{\"int64\":", out),
-                    sendInteger(out, op->imm);
-                    fputs("},", out);
+                    out.emitInt64(op->imm);
                     break;
             }
             break;
@@ -1111,8 +1114,8 @@ static void sendOperandDataMetadata(FILE *out, const char *name,
 /*
  * Emits instructions to translate to/from static and dynamic addresses.
  */
-static void sendTranslateAddress(FILE *out, const InstrInfo *I, CallInfo &info,
-    bool neg, int regno)
+static void sendTranslateAddress(CodeBuffer &out, const InstrInfo *I,
+    CallInfo &info, bool neg, int regno)
 {
     Register exclude[] = {getReg(regno), REGISTER_INVALID};
     Register rscratch = info.getScratch(exclude);
@@ -1121,7 +1124,7 @@ static void sendTranslateAddress(FILE *out, const InstrInfo *I, CallInfo &info,
     {
         rscratch = REGISTER_RAX;
         save_rax = true;
-        fprintf(out, "%u,", 0x50);      // push %rax
+        out.emit(0x50);      // push %rax
     }
     int regno_1 = getRegIdx(rscratch);
     sendLeaFromPCRelToR64(out, "{\"rel32\":0}", regno_1);
@@ -1137,7 +1140,7 @@ static void sendTranslateAddress(FILE *out, const InstrInfo *I, CallInfo &info,
         const uint8_t MODRM[] =
             {0xd7, 0xd6, 0xd2, 0xd1, 0xd0, 0xd1, 0x00,
              0xd0, 0xd2, 0xd3, 0xd3, 0xd5, 0xd4, 0xd5, 0xd6, 0xd7, 0xd4};
-        fprintf(out, "%u,%u,%u,", REX[regno_1], 0xf7, MODRM[regno_1]);
+        out.emit(REX[regno_1], 0xf7, MODRM[regno_1]);
         disp = 0x1;
     }
 
@@ -1147,18 +1150,18 @@ static void sendTranslateAddress(FILE *out, const InstrInfo *I, CallInfo &info,
         /*scale=*/1, /*lea=*/true, regno, /*asis=*/true);
 
     if (save_rax)
-        fprintf(out, "%u,", 0x58);      // pop %rax
+        out.emit(0x58);      // pop %rax
     else
         info.clobber(rscratch);
 }
-static void sendTranslateToStaticAddress(FILE *out, const InstrInfo *I,
+static void sendTranslateToStaticAddress(CodeBuffer &out, const InstrInfo *I,
     CallInfo &info, bool _static, int regno)
 {
     if (!_static || !info.pic)
         return;
     sendTranslateAddress(out, I, info, /*neg=*/true, regno);
 }
-static void sendTranslateToDynamicAddress(FILE *out, const InstrInfo *I,
+static void sendTranslateToDynamicAddress(CodeBuffer &out, const InstrInfo *I,
     CallInfo &info, bool _static, int regno)
 {
     if (_static || !info.pic)
@@ -1171,7 +1174,7 @@ static void sendTranslateToDynamicAddress(FILE *out, const InstrInfo *I,
  * corresponding argno register.  Else, if I is not a jump/call/return
  * instruction, load 0.
  */
-static void sendLoadTargetMetadata(FILE *out, const InstrInfo *I,
+static void sendLoadTargetMetadata(CodeBuffer &out, const InstrInfo *I,
     CallInfo &info, bool _static, int regno)
 {
     const OpInfo *op = &I->op[0];
@@ -1240,7 +1243,7 @@ static void sendLoadTargetMetadata(FILE *out, const InstrInfo *I,
  * Emits instructions to load the address of the next instruction to be
  * executed by the CPU.
  */
-static void sendLoadNextMetadata(FILE *out, const char *name,
+static void sendLoadNextMetadata(CodeBuffer &out, const char *name,
     const InstrInfo *I, CallInfo &info, bool _static, int regno)
 {
     const char *regname = getRegName(getReg(regno))+1;
@@ -1309,16 +1312,16 @@ static void sendLoadNextMetadata(FILE *out, const char *name,
             int scratch = sendTemporaryRestoreReg(out, info, REGISTER_RCX,
                 exclude, &slot);
             if (I->mnemonic == MNEMONIC_JECXZ)
-                fprintf(out, "%u,", 0x67);
-            fprintf(out, "%u,{\"rel8\":\".Ltake%s@%s\"},", 0xe3, regname,
-                name);
+                out.emit(0x67);
+            out.emit(0xe3);
+            out.emitEntry("{\"rel8\":\".Ltake%s@%s\"}", regname, name);
             sendLoadPointerMetadata(out, info, _static, I->address + I->size,
                 "{\"rel32\":\".Lbreak\"}", regno);
-            fprintf(out, "%u,{\"rel8\":\".Lnext%s@%s\"},", 0xeb, regname,
-                name);
-            fprintf(out, "\".Ltake%s@%s\",", regname, name);
+            out.emit(0xeb);
+            out.emitEntry("{\"rel8\":\".Lnext%s@%s\"}", regname, name);
+            out.emitEntry("\".Ltake%s@%s\"", regname, name);
             sendLoadTargetMetadata(out, I, info, _static, regno);
-            fprintf(out, "\".Lnext%s@%s\",", regname, name);
+            out.emitEntry("\".Lnext%s@%s\"", regname, name);
             sendUndoTemporaryMovReg(out, REGISTER_RCX, scratch);
             return;
         }
@@ -1329,97 +1332,72 @@ static void sendLoadNextMetadata(FILE *out, const char *name,
     }
 
     // jcc .Ltaken
-    fprintf(out, "%u,{\"rel8\":\".Ltake%s@%s\"},", opcode, regname, name);
+    out.emit(opcode);
+    out.emitEntry("{\"rel8\":\".Ltake%s@%s\"}", regname, name);
 
     // .LnotTaken:
     // leaq .Lbreak(%rip),%rarg
     // jmp .Lnext;
     sendLoadPointerMetadata(out, info, _static, I->address + I->size,
         "{\"rel32\":\".Lbreak\"}", regno);
-    fprintf(out, "%u,{\"rel8\":\".Lnext%s@%s\"},", 0xeb, regname, name);
+    out.emit(0xeb);
+    out.emitEntry("{\"rel8\":\".Lnext%s@%s\"}", regname, name);
 
     // .Ltaken:
     // ... load target into %rarg
-    fprintf(out, "\".Ltake%s@%s\",", regname, name);
+    out.emitEntry("\".Ltake%s@%s\"", regname, name);
     sendLoadTargetMetadata(out, I, info, _static, regno);
     
     // .Lnext:
-    fprintf(out, "\".Lnext%s@%s\",", regname, name);
-}
-
-/*
- * Send string character data.
- */
-static void sendStringCharData(FILE *out, char c)
-{
-    switch (c)
-    {
-        case '\\':
-            fputs("\\\\", out);
-            break;
-        case '\"':
-            fputs("\\\"", out);
-            break;
-        case '\n':
-            fputs("\\n", out);
-            break;
-        case '\t':
-            fputs("\\t", out);
-            break;
-        case '\r':
-            fputs("\\r", out);
-            break;
-        case '\b':
-            fputs("\\b", out);
-            break;
-        case '\f':
-            fputs("\\f", out);
-            break;
-        default:
-            putc(c, out);
-            break;
-    }
+    out.emitEntry("\".Lnext%s@%s\"", regname, name);
 }
 
 /*
  * String asm string data.
  */
-static void sendAsmStrData(FILE *out, const InstrInfo *I,
+static void sendAsmStrData(CodeBuffer &out, const InstrInfo *I,
     bool newline = false)
 {
-    fputs("{\"string\":\"", out);
-    for (unsigned i = 0; I->string.instr[i] != '\0'; i++)
-        sendStringCharData(out, I->string.instr[i]);
+    size_t len = strlen(I->string.instr);
+    out.emitBytes(I->string.instr, len);
     if (newline)
-        sendStringCharData(out, '\n');
-    fputs("\"}", out);
+        out.emit('\n');
+    out.emit('\0');
 }
 
 /*
  * Send integer data.
  */
-static void sendIntegerData(FILE *out, unsigned size, intptr_t i)
+static void sendIntegerData(CodeBuffer &out, unsigned size, intptr_t i)
 {
-    assert(size == 8 || size == 16 || size == 32 || size == 64);
-    fprintf(out, "{\"int%u\":", size);
-    sendInteger(out, i);
-    fputc('}', out);
+    switch (size)
+    {
+        case 8:
+            out.emitInt8((int8_t)i); break;
+        case 16:
+            out.emitInt16((int16_t)i); break;
+        case 32:
+            out.emitInt32((int32_t)i); break;
+        case 64:
+            out.emitInt64((int64_t)i); break;
+        default:
+            assert(false);
+    }
 }
 
 /*
  * Send bytes data.
  */
-static void sendBytesData(FILE *out, const uint8_t *bytes, size_t len)
+static void sendBytesData(CodeBuffer &out, const uint8_t *bytes, size_t len)
 {
-    for (size_t i = 0; i < len; i++)
-        fprintf(out, "%u%s", bytes[i], (i+1 < len? ",": ""));
+    out.emitBytes(bytes, len);
 }
 
 /*
  * Send instructions to load an argument into a register.
  */
-static Type sendLoadArgumentMetadata(FILE *out, CallInfo &info,
-    const ELF *elf, const char *name, PatchPos pos,
+static Type sendLoadArgumentMetadata(CodeBuffer &out, CallInfo &info,
+    const ELF *elf, const ELF *target, const char *name, PatchPos pos,
     const std::vector<Instr> &Is, size_t i, const InstrInfo *I, intptr_t id,
     const Argument &arg, int argno, int regno)
 {
@@ -1571,6 +1549,44 @@ static Type sendLoadArgumentMetadata(FILE *out, CallInfo &info,
         case ARGUMENT_RANDOM:
             sendLoadValueMetadata(out, rand(), regno);
             break;
+        case ARGUMENT_PMC:
+        {
+            std::string entry("e9_pmc_delta_");
+            entry += std::to_string(arg.value);
+            intptr_t addr = getSymbol(target, entry.c_str());
+            if (addr < 0 || addr > INT32_MAX)
+            {
+                warning(CONTEXT_FORMAT "failed to load performance counter "
+                    "delta into register %s; symbol \"%s\" is undefined in "
+                    "binary \"%s\" (missing stdlib.c?)", CONTEXT(I),
+                    getRegName(getReg(regno)), entry.c_str(),
+                    target->filename);
+                sendSExtFromI32ToR64(out, 0, regno);
+                break;
+            }
+
+            // e9_pmc_delta_<i>() only clobbers %rax and %rflags:
+            sendSaveRegToStack(out, info, REGISTER_EFLAGS);
+            Register exclude[] = {REGISTER_RAX, getReg(regno),
+                REGISTER_INVALID};
+            int slot = 0;
+            int scratch = INT32_MAX;
+            if (regno != RAX_IDX)
+                scratch = sendTemporarySaveReg(out, info, REGISTER_RAX,
+                    exclude, &slot);
+            // lea -0x80(%rsp),%rsp         # Skip the redzone
+            // call e9_pmc_delta_<i>
+            // lea 0x80(%rsp),%rsp
+            out.emit(0x48, 0x8d, 0x64, 0x24, 0x80);
+            out.emit(0xe8);
+            out.emitEntry("{\"rel32\":%d}", (int32_t)addr);
+            out.emit(0x48, 0x8d, 0xa4, 0x24);
+            out.emitInt32(0x80);
+            if (regno != RAX_IDX)
+                sendMovFromR64ToR64(out, RAX_IDX, regno);
+            sendUndoTemporaryMovReg(out, REGISTER_RAX, scratch);
+            break;
+        }
         case ARGUMENT_REGISTER:
             if (arg.ptr)
                 goto ARGUMENT_REG_PTR;
@@ -1621,8 +1637,8 @@ static Type sendLoadArgumentMetadata(FILE *out, CallInfo &info,
                             REGISTER_RAX, exclude, &slot);
                         // seto %al
                         // lahf
-                        fprintf(out, "%u,%u,%u,", 0x0f, 0x90, 0xc0);
-                        fprintf(out, "%u,", 0x9f);
+                        out.emit(0x0f, 0x90, 0xc0);
+                        out.emit(0x9f);
                         sendMovFromRAX16ToR64(out, regno);
                         sendUndoTemporaryMovReg(out, REGISTER_RAX, scratch);
                     }
@@ -1967,7 +1983,7 @@ static Type sendLoadArgumentMetadata(FILE *out, CallInfo &info,
 /*
  * Send argument data metadata.
  */
-static void sendArgumentDataMetadata(FILE *out, const char *name,
+static void sendArgumentDataMetadata(CodeBuffer &out, const char *name,
     const ELF *elf, const Argument &arg, size_t i, const InstrInfo *I,
     int regno)
 {
@@ -1978,30 +1994,26 @@ static void sendArgumentDataMetadata(FILE *out, const char *name,
             MatchVal val = getCSVValue(I->address, arg.name, arg.value);
             if (val.type == MATCH_TYPE_STRING)
             {
-                fprintf(out, "\".Lstr%d@%s\",{\"string\":", regno, name);
-                sendString(out, val.str);
-                fputs("},", out);
+                out.emitEntry("\".Lstr%d@%s\"", regno, name);
+                out.emitString(val.str);
             }
             break;
         }
         case ARGUMENT_STRING:
-            fprintf(out, "\".Lstr%d@%s\",{\"string\":", regno, name);
-            sendString(out, arg.name);
-            fputs("},", out);
+            out.emitEntry("\".Lstr%d@%s\"", regno, name);
+            out.emitString(arg.name);
             break;
         case ARGUMENT_ASM:
             if (arg.duplicate)
                 return;
-            fprintf(out, "\".Lasm@%s\",", name);
+            out.emitEntry("\".Lasm@%s\"", name);
             sendAsmStrData(out, I, /*newline=*/false);
-            putc(',', out);
             break;
         case ARGUMENT_BYTES:
             if (arg.duplicate)
                 return;
-            fprintf(out, "\".Lbytes@%s\",", name);
+            out.emitEntry("\".Lbytes@%s\"", name);
             sendBytesData(out, I->data, I->size);
-            fputc(',', out);
             break;
         case ARGUMENT_OP: case ARGUMENT_SRC: case ARGUMENT_DST:
         case ARGUMENT_IMM: case ARGUMENT_REG: case ARGUMENT_MEM:
@@ -2025,9 +2037,8 @@ static void sendArgumentDataMetadata(FILE *out, const char *name,
             const F *f = findF(elf->fs, i);
             if (f == nullptr || f->name == nullptr)
                 return;
-            fprintf(out, "\".Lfn%d@%s\",{\"string\":", regno, name);
-            sendString(out, f->name);
-            fputs("},", out);
+            out.emitEntry("\".Lfn%d@%s\"", regno, name);
+            out.emitString(f->name);
             break;
         }
         default:
@@ -2040,15 +2051,888 @@ static void sendArgumentDataMetadata(FILE *out, const char *name,
  */
 void e9tool::sendPrintMetadata(FILE *out, const InstrInfo *I)
 {
+    CodeBuffer code;
     const char *name = "print";
     sendDefinitionHeader(out, name, "DATA");
-    fprintf(out, "\".Lasm@print\",");
-    sendAsmStrData(out, I, /*newline=*/true);
+    code.emitEntry("\".Lasm@print\"");
+    sendAsmStrData(code, I, /*newline=*/true);
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
 
     sendDefinitionHeader(out, name, "ASM_LEN");
     intptr_t len = strlen(I->string.instr) + 1;
-    sendIntegerData(out, 32, len);
+    sendIntegerData(code, 32, len);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+}
+
+/*
+ * Get the registers that are live at the patch site.  If there is no
+ * liveness information, then all registers are assumed live.
+ */
+static RegSet getLiveRegs(const ELF *elf, PatchPos pos, size_t idx)
+{
+    if (idx >= elf->live.size())
+        return REGSET_ALL;
+    const Live &live = elf->live[idx];
+    switch (pos)
+    {
+        case POS_BEFORE:
+            return live.in;
+        case POS_AFTER:
+            return live.out;
+        default:
+            return live.in | live.out;
+    }
+}
+
+/*
+ * Send a "count" or "cov" trampoline metadata.  The inc-based counters
+ * clobber %rflags, which is saved via %rax (see sendPush()), and the
+ * lea-based counters clobber %rax.  Either is only saved if live at the
+ * patch site (or forced by the "flags" option), and if there is no liveness
+ * information, then everything is assumed live.
+ */
+void e9tool::sendCounterMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, bool flags, bool lea, intptr_t addr, size_t idx)
+{
+    CodeBuffer code;
+    name++;
+    RegSet regs = getLiveRegs(elf, pos, idx);
+    regs |= (flags? (1 << RFLAGS_IDX): 0x0);
+    bool save_flags = !lea && (regs & (1 << RFLAGS_IDX)) != 0;
+    bool save_rax = (lea || save_flags) && (regs & (1 << RAX_IDX)) != 0;
+
+    sendDefinitionHeader(out, name, "SAVE");
+    if (save_rax)
+    {
+        // lea -0x4000(%rsp),%rsp
+        // push %rax
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(-0x4000);
+        code.emit(0x50);
+    }
+    if (save_flags)
+    {
+        // seto %al
+        // lahf
+        code.emit(0x0f, 0x90, 0xc0);
+        code.emit(0x9f);
+    }
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "MAP");
+    code.emitEntry("{\"rel32\":%zd}", addr);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "RSTOR");
+    if (save_flags)
+    {
+        // add $0x7f,%al
+        // sahf
+        code.emit(0x04, 0x7f);
+        code.emit(0x9e);
+    }
+    if (save_rax)
+    {
+        // pop %rax
+        // lea 0x4000(%rsp),%rsp
+        code.emit(0x58);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(0x4000);
+    }
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "DATA");
+    sendDefinitionFooter(out);
+}
+
+/*
+ * Send a "sample" metadata.  Each site has a 32-bit countdown in the sample
+ * map that is reset to (period-1) whenever it reaches zero, in which case
+ * the sampled patch is executed, else the patch is skipped.  The zeroed map
+ * means that the first execution is always sampled.  The countdown is
+ * flag-free (mov/lea/jrcxz), so only %rcx is clobbered, which is saved if
+ * live.  The countdown is not atomic, so multi-threaded programs may lose
+ * updates, which only affects the sampling precision.
+ */
+void e9tool::sendSampleMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, unsigned period, intptr_t addr, size_t idx)
+{
+    CodeBuffer code;
+    name++;
+    RegSet regs = getLiveRegs(elf, pos, idx);
+    bool save_rcx = ((regs & (1 << RCX_IDX)) != 0);
+
+    sendDefinitionHeader(out, name, "SAMPLE");
+    if (save_rcx)
+    {
+        // lea -0x4000(%rsp),%rsp
+        // push %rcx
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(-0x4000);
+        code.emit(0x51);
+    }
+    // mov addr(%rip),%ecx
+    // jrcxz .Lsample
+    // lea -0x1(%rcx),%ecx
+    // mov %ecx,addr(%rip)
+    code.emit(0x8b, 0x0d);
+    code.emitEntry("{\"rel32\":%zd}", addr);
+    code.emit(0xe3);
+    code.emitEntry("{\"rel8\":\".Lsample@%s\"}", name);
+    code.emit(0x8d, 0x49, 0xff);
+    code.emit(0x89, 0x0d);
+    code.emitEntry("{\"rel32\":%zd}", addr);
+    if (save_rcx)
+    {
+        // pop %rcx
+        // lea 0x4000(%rsp),%rsp
+        code.emit(0x59);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(0x4000);
+    }
+    // jmpq .Lskip
+    code.emit(0xe9);
+    code.emitEntry("{\"rel32\":\".Lskip@%s\"}", name);
+
+    // .Lsample:
+    // mov $(period-1),%ecx
+    // mov %ecx,addr(%rip)
+    code.emitEntry("\".Lsample@%s\"", name);
+    code.emit(0xb9);
+    code.emitInt32((int32_t)(period - 1));
+    code.emit(0x89, 0x0d);
+    code.emitEntry("{\"rel32\":%zd}", addr);
+    if (save_rcx)
+    {
+        // pop %rcx
+        // lea 0x4000(%rsp),%rsp
+        code.emit(0x59);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(0x4000);
+    }
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+}
+
+/*
+ * Remove the registers that are dead at the patch site from the
+ * caller-save registers `rsave'.  Registers that the call trampoline itself
+ * depends on (%rax, %rsp, %rip, the argument registers, and the first
+ * register for conditional calls) are always saved.  The %rflags register is
+ * saved if live, if passed as an argument, or if forced by the "flags" ABI
+ * option.  If there is no liveness information, then all registers are
+ * assumed live.
+ */
+static const int *getLiveCallerSaveRegs(const ELF *elf, const Call &call,
+    const std::vector<Argument> &args, bool sysv, size_t idx,
+    const int *rsave, int *buf)
+{
+    if (call.state || idx >= elf->live.size())
+        return rsave;
+    RegSet regs = getLiveRegs(elf, call.pos, idx);
+    regs |= (1 << RAX_IDX) | (1 << RSP_IDX) | (1 << RIP_IDX);
+    regs |= (call.flags? (1 << RFLAGS_IDX): 0x0);
+    for (const auto &arg: args)
+    {
+        if (arg.kind == ARGUMENT_REGISTER && arg.value == REGISTER_EFLAGS)
+            regs |= (1 << RFLAGS_IDX);
+    }
+    for (size_t argno = 0; argno < call.args.size(); argno++)
+    {
+        int regno = getArgRegIdx(sysv, (int)argno);
+        regs |= (regno < 0? 0x0: (RegSet)1 << regno);
+    }
+    bool conditional = (call.jmp != JUMP_NONE);
+    int j = 0;
+    for (int i = 0; rsave[i] >= 0; i++)
+    {
+        if ((i == 0 && conditional) || (regs & ((RegSet)1 << rsave[i])) != 0)
+            buf[j++] = rsave[i];
+    }
+    buf[j] = -1;
+    return buf;
+}
+
+/*
+ * Register encodings (REX bit and ModRM bits) indexed by the register index.
+ */
+static const uint8_t REG_REX_MASK[] =
+    {0, 0, 0, 0, 1, 1, 0,
+     0, 1, 1, 0, 0, 1, 1, 1, 1, 0};
+static const uint8_t REG_MODRM[] =
+    {0x07, 0x06, 0x02, 0x01, 0x00, 0x01, 0x00,
+     0x00, 0x02, 0x03, 0x03, 0x05, 0x04, 0x05, 0x06, 0x07, 0x04};
+
+/*
+ * Get the registers referenced by a guard (or log) argument.
+ */
+static RegSet getGuardRegs(const Argument &arg)
+{
+    Register regs[2] = {REGISTER_NONE, REGISTER_NONE};
+    switch (arg.kind)
+    {
+        case ARGUMENT_REGISTER:
+            regs[0] = (Register)arg.value; break;
+        case ARGUMENT_MEMOP:
+            regs[0] = arg.memop.base;
+            regs[1] = arg.memop.index;
+            break;
+        default:
+            break;
+    }
+    RegSet used = 0x0;
+    for (auto reg: regs)
+    {
+        int regno = (reg == REGISTER_NONE? -1: getRegIdx(reg));
+        used |= (regno < 0? 0x0: (RegSet)1 << regno);
+    }
+    return used;
+}
+
+/*
+ * Send a guard (or log) argument load into register `regno'.
+ */
+static void sendLoadGuardArg(CodeBuffer &out, const InstrInfo *I,
+    CallInfo &info, const Argument &arg, int regno)
+{
+    switch (arg.kind)
+    {
+        case ARGUMENT_INTEGER:
+            if (arg.value >= INT32_MIN && arg.value <= INT32_MAX)
+                sendSExtFromI32ToR64(out, (int32_t)arg.value, regno);
+            else
+                sendMovFromI64ToR64(out, arg.value, regno);
+            return;
+        case ARGUMENT_MEMOP:
+            (void)sendLoadFromMemOpToR64(out, I, info, arg.memop.size,
+                arg.memop.seg, arg.memop.disp, arg.memop.base,
+                arg.memop.index, arg.memop.scale, /*lea=*/arg.ptr, regno,
+                /*asis=*/true);
+            return;
+        default:
+            break;
+    }
+    Register reg = (Register)arg.value;
+    int srcno = getRegIdx(reg);
+    if (srcno == RSP_IDX)
+    {
+        sendLeaFromStackToR64(out, info.rsp_offset, regno);
+        srcno = regno;
+        if (getRegSize(reg) == sizeof(int64_t))
+            return;
+    }
+    switch (getRegSize(reg))
+    {
+        case sizeof(int64_t):
+            sendMovFromR64ToR64(out, srcno, regno); break;
+        case sizeof(int32_t):
+            sendMovFromR32ToR64(out, srcno, regno); break;
+        case sizeof(int16_t):
+            sendMovFromR16ToR64(out, srcno, regno); break;
+        default:
+            sendMovFromR8ToR64(out, srcno, isHighReg(reg), regno); break;
+    }
+}
+
+/*
+ * Resolve a shadow guard argument &op[i] (etc.) into the equivalent memory
+ * operand address &memN<...> argument.
+ */
+static Argument getShadowArg(const InstrInfo *I, const Argument &arg)
+{
+    switch (arg.kind)
+    {
+        case ARGUMENT_OP: case ARGUMENT_SRC: case ARGUMENT_DST:
+        case ARGUMENT_MEM:
+            break;
+        default:
+            return arg;
+    }
+    Access access = (arg.kind == ARGUMENT_SRC? ACCESS_READ:
+                    (arg.kind == ARGUMENT_DST? ACCESS_WRITE: 0));
+    OpType type = (arg.kind == ARGUMENT_MEM? OPTYPE_MEM: OPTYPE_INVALID);
+    const OpInfo *op = getOperand(I, (int)arg.value, type, access);
+    Argument result = arg;
+    if (op == nullptr || op->type != OPTYPE_MEM)
+    {
+        warning(CONTEXT_FORMAT "failed to load shadow memory for operand "
+            "%d; operand is not a memory operand", CONTEXT(I),
+            (int)arg.value);
+        result.kind  = ARGUMENT_INTEGER;
+        result.value = 0x0;
+        result.ptr   = false;
+        return result;
+    }
+    result.kind = ARGUMENT_MEMOP;
+    result.memop.disp  = op->mem.disp;
+    result.memop.seg   = op->mem.seg;
+    result.memop.base  = op->mem.base;
+    result.memop.index = op->mem.index;
+    result.memop.scale = op->mem.scale;
+    result.memop.size  = op->size;
+    return result;
+}
+
+/*
+ * Send a shadow memory load for the address in register `regno':
+ *   shr $SHADOW_SCALE,%r
+ *   movsbq SHADOW_BASE(,%r,1),%r
+ */
+static void sendLoadShadow(CodeBuffer &out, int regno)
+{
+    uint8_t rex = 0x48 | REG_REX_MASK[regno];
+    out.emit(rex, 0xc1, (0x03 << 6) | (0x05 << 3) | REG_MODRM[regno],
+        (uint8_t)SHADOW_SCALE);
+    rex = 0x48 | (REG_REX_MASK[regno] << 2) | (REG_REX_MASK[regno] << 1);
+    out.emit(rex, 0x0f, 0xbe, (REG_MODRM[regno] << 3) | 0x04,
+        (REG_MODRM[regno] << 3) | 0x05);
+    out.emitInt32((int32_t)SHADOW_BASE);
+}
+
+/*
+ * Send a "call" trampoline guard metadata.  The guard is tested before any
+ * state is saved, so the operands are loaded directly into two scratch
+ * registers that are not referenced by the guard.  Since %rax may be a
+ * guard operand, %rflags is saved using pushfq/popfq rather than lahf.
+ * The scratch registers and %rflags are only saved if live.
+ */
+static void sendGuardMetadata(FILE *out, const char *name, const ELF *elf,
+    const Call &call, const std::vector<Guard> &guard, size_t i,
+    const InstrInfo *I)
+{
+    CodeBuffer code;
+    RegSet used = 0x0;
+    std::vector<Guard> tests;
+    for (const auto &test: guard)
+    {
+        tests.push_back(test);
+        tests.back().lhs = getShadowArg(I, test.lhs);
+        tests.back().rhs = getShadowArg(I, test.rhs);
+        used |= getGuardRegs(tests.back().lhs) |
+            getGuardRegs(tests.back().rhs);
+    }
+    const int scratch[] =
+        {RAX_IDX, RCX_IDX, RDX_IDX, RSI_IDX, RDI_IDX, R8_IDX, R9_IDX,
+         R10_IDX, R11_IDX, RBX_IDX, RBP_IDX, R12_IDX, R13_IDX, R14_IDX,
+         R15_IDX};
+    int rscratch[2], j = 0;
+    for (unsigned k = 0; j < 2 && k < sizeof(scratch) / sizeof(scratch[0]);
+            k++)
+    {
+        if ((used & ((RegSet)1 << scratch[k])) == 0)
+            rscratch[j++] = scratch[k];
+    }
+    assert(j == 2);
+
+    RegSet live = getLiveRegs(elf, call.pos, i);
+    live |= (call.flags? (1 << RFLAGS_IDX): 0x0);
+    bool save_flags = ((live & (1 << RFLAGS_IDX)) != 0);
+    bool save[2];
+    for (j = 0; j < 2; j++)
+        save[j] = ((live & ((RegSet)1 << rscratch[j])) != 0);
+
+    static const int rnone[] = {-1};
+    bool before = (call.pos == POS_BEFORE);
+    bool pic = (getELFType(elf) != BINARY_TYPE_ELF_EXE);
+    CallInfo info(rnone, /*clean=*/false, /*state=*/false, before, pic);
+
+    sendDefinitionHeader(out, name, "GUARD");
+    if (save_flags)
+    {
+        code.emit(/*pushfq=*/0x9c);
+        info.rsp_offset += sizeof(int64_t);
+    }
+    for (j = 0; j < 2; j++)
+    {
+        if (!save[j])
+            continue;
+        sendPush(code, info.rsp_offset, before, getReg(rscratch[j]));
+        info.rsp_offset += sizeof(int64_t);
+    }
+    for (const auto &test: tests)
+    {
+        sendLoadGuardArg(code, I, info, test.lhs, rscratch[0]);
+        if (test.lhs_shadow)
+            sendLoadShadow(code, rscratch[0]);
+        sendLoadGuardArg(code, I, info, test.rhs, rscratch[1]);
+        if (test.rhs_shadow)
+            sendLoadShadow(code, rscratch[1]);
+
+        // cmp %r1,%r0
+        const uint8_t REX[] = {0x48, 0x49, 0x4c, 0x4d};
+        uint8_t rex = REX[(REG_REX_MASK[rscratch[1]] << 1) |
+            REG_REX_MASK[rscratch[0]]];
+        uint8_t modrm = (0x03 << 6) | (REG_MODRM[rscratch[1]] << 3) |
+            REG_MODRM[rscratch[0]];
+        code.emit(rex, 0x39, modrm);
+
+        // j!CMP .Lguard
+        uint8_t jcc = 0x00;
+        switch (test.cmp)
+        {
+            case GUARD_EQ:
+                jcc = /*jne=*/0x85; break;
+            case GUARD_NEQ:
+                jcc = /*je=*/0x84; break;
+            case GUARD_LT:
+                jcc = /*jge=*/0x8d; break;
+            case GUARD_LEQ:
+                jcc = /*jg=*/0x8f; break;
+            case GUARD_GT:
+                jcc = /*jle=*/0x8e; break;
+            case GUARD_GEQ:
+                jcc = /*jl=*/0x8c; break;
+        }
+        code.emit(0x0f, jcc);
+        code.emitEntry("{\"rel32\":\".Lguard@%s\"}", name);
+    }
+    code.emitEntry("\"$UNGUARD@%s\"", name);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "UNGUARD");
+    for (j = 1; j >= 0; j--)
+    {
+        if (save[j])
+            sendPop(code, false, getReg(rscratch[j]));
+    }
+    if (save_flags)
+        code.emit(/*popfq=*/0x9d);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+}
+
+/*
+ * Send a 64-bit instruction `opcode' with register operand `regno' and
+ * memory operand %seg:disp(%baseno), or %seg:disp if `baseno' is negative.
+ */
+static void sendSegMemOp(CodeBuffer &out, uint8_t seg, uint8_t opcode,
+    int regno, int baseno, int32_t disp)
+{
+    uint8_t rex = 0x48 | (REG_REX_MASK[regno] << 2) |
+        (baseno < 0? 0x0: REG_REX_MASK[baseno]);
+    out.emit(seg, rex, opcode);
+    if (baseno < 0)
+        out.emit((REG_MODRM[regno] << 3) | 0x04, 0x25);
+    else
+    {
+        out.emit((0x02 << 6) | (REG_MODRM[regno] << 3) | REG_MODRM[baseno]);
+        if (REG_MODRM[baseno] == 0x04)
+            out.emit(0x24);      // SIB for %rsp/%r12
+    }
+    out.emitInt32(disp);
+}
+
+/*
+ * Save/restore the syscall/call clobbered registers:
+ *   push %rax,%rcx,%rdx,%rsi,%rdi,%r8,%r9,%r10,%r11
+ *   pop  %r11,%r10,%r9,%r8,%rdi,%rsi,%rdx,%rcx,%rax
+ */
+static const uint8_t save_push[] =
+    {0x50, 0x51, 0x52, 0x56, 0x57, 0x41, 0x50, 0x41, 0x51, 0x41, 0x52,
+     0x41, 0x53};
+static const uint8_t save_pop[] =
+    {0x41, 0x5b, 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58, 0x5f, 0x5e, 0x5a,
+     0x59, 0x58};
+
+/*
+ * Send the code that allocates a fresh per-thread block (.Lalloc), for
+ * threads that inherited %gs.  On success, the code jumps to .Lretry, else
+ * to .Lend (via .Lfail).
+ */
+static void sendTLSAlloc(CodeBuffer &code, const char *name)
+{
+    // .Lalloc:
+    // mov %gs:0x10,%rsi
+    // add $0x20,%rsi
+    // xor %edi,%edi
+    // mov $PROT_READ|PROT_WRITE,%edx
+    // mov $MAP_PRIVATE|MAP_ANONYMOUS,%r10d
+    // mov $-1,%r8
+    // xor %r9d,%r9d
+    // mov $SYS_mmap,%eax
+    // syscall
+    code.emitEntry("\".Lalloc@%s\"", name);
+    code.emitBytes(save_push, sizeof(save_push));
+    sendSegMemOp(code, 0x65, 0x8b, RSI_IDX, -1, 2 * sizeof(uint64_t));
+    code.emit(0x48, 0x83, 0xc6, E9_TLS_DATA);
+    code.emit(0x31, 0xff);
+    code.emit(0xba);
+    code.emitInt32(PROT_READ | PROT_WRITE);
+    code.emit(0x41, 0xba);
+    code.emitInt32(MAP_PRIVATE | MAP_ANONYMOUS);
+    code.emit(0x49, 0xc7, 0xc0);
+    code.emitInt32(-1);
+    code.emit(0x45, 0x31, 0xc9);
+    code.emit(0xb8);
+    code.emitInt32(SYS_mmap);
+    code.emit(0x0f, 0x05);
+
+    // cmp $-4095,%rax
+    // jae .Lfail
+    code.emit(0x48, 0x3d);
+    code.emitInt32(-4095);
+    code.emit(0x0f, 0x83);
+    code.emitEntry("{\"rel32\":\".Lfail@%s\"}", name);
+
+    // mov %rax,(%rax)                  # self
+    // mov %fs:0x0,%rcx
+    // mov %rcx,0x8(%rax)               # owner
+    // lea -0x20(%rsi),%rcx
+    // mov %rcx,0x10(%rax)              # size
+    code.emit(0x48, 0x89, 0x00);
+    sendSegMemOp(code, 0x64, 0x8b, RCX_IDX, -1, 0x0);
+    code.emit(0x48, 0x89, 0x48, 0x08);
+    code.emit(0x48, 0x8d, 0x4e, -E9_TLS_DATA & 0xff);
+    code.emit(0x48, 0x89, 0x48, 0x10);
+
+    // mov %rax,%rsi
+    // mov $ARCH_SET_GS,%edi
+    // mov $SYS_arch_prctl,%eax
+    // syscall
+    // test %rax,%rax
+    // jnz .Lfail
+    code.emit(0x48, 0x89, 0xc6);
+    code.emit(0xbf);
+    code.emitInt32(ARCH_SET_GS);
+    code.emit(0xb8);
+    code.emitInt32(SYS_arch_prctl);
+    code.emit(0x0f, 0x05);
+    code.emit(0x48, 0x85, 0xc0);
+    code.emit(0x0f, 0x85);
+    code.emitEntry("{\"rel32\":\".Lfail@%s\"}", name);
+    code.emitBytes(save_pop, sizeof(save_pop));
+    code.emit(0xe9);
+    code.emitEntry("{\"rel32\":\".Lretry@%s\"}", name);
+
+    // .Lfail:
+    code.emitEntry("\".Lfail@%s\"", name);
+    code.emitBytes(save_pop, sizeof(save_pop));
+    code.emit(0xe9);
+    code.emitEntry("{\"rel32\":\".Lend@%s\"}", name);
+}
+
+/*
+ * Send a "log" trampoline metadata.  Each site appends a record to a ring
+ * buffer in the per-thread block (%gs), where the buffer is a 64-bit count
+ * followed by `entries' records.  Two scratch registers not referenced by
+ * the arguments hold the record offset and the current value, and these,
+ * %rflags, and (for `tsc') %rax/%rdx are only saved if live.
+ *
+ * The fast path only checks that the block belongs to the current thread
+ * (threads inherit %gs), else a fresh block is allocated using raw
+ * mmap()/arch_prctl() syscalls (see e9_tls() in examples/stdlib.c).  If a
+ * function is given, it is called with the records and count once the
+ * buffer is full, else the buffer wraps and the oldest records are
+ * overwritten.
+ */
+void e9tool::sendLogMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, const std::vector<Argument> &args, bool tsc,
+    unsigned entries, intptr_t buf, intptr_t func, size_t i,
+    const InstrInfo *I)
+{
+    CodeBuffer code;
+    name++;
+    RegSet used = 0x0;
+    for (const auto &arg: args)
+        used |= getGuardRegs(arg);
+    if (tsc)
+        used |= (1 << RAX_IDX) | (1 << RDX_IDX);
+    const int scratch[] =
+        {RAX_IDX, RCX_IDX, RDX_IDX, RSI_IDX, RDI_IDX, R8_IDX, R9_IDX,
+         R10_IDX, R11_IDX, RBX_IDX, RBP_IDX, R12_IDX, R13_IDX, R14_IDX,
+         R15_IDX};
+    int rsave[4], j = 0;
+    for (unsigned k = 0; j < 2 && k < sizeof(scratch) / sizeof(scratch[0]);
+            k++)
+    {
+        if ((used & ((RegSet)1 << scratch[k])) == 0)
+            rsave[j++] = scratch[k];
+    }
+    assert(j == 2);
+    int ri = rsave[0], rv = rsave[1];
+    if (tsc)
+    {
+        rsave[j++] = RAX_IDX;
+        rsave[j++] = RDX_IDX;
+    }
+    int nsave = j;
+
+    RegSet live = getLiveRegs(elf, pos, i);
+    bool save_flags = ((live & (1 << RFLAGS_IDX)) != 0);
+    bool save[4];
+    for (j = 0; j < nsave; j++)
+        save[j] = ((live & ((RegSet)1 << rsave[j])) != 0);
+
+    static const int rnone[] = {-1};
+    bool before = (pos == POS_BEFORE);
+    bool pic = (getELFType(elf) != BINARY_TYPE_ELF_EXE);
+    CallInfo info(rnone, /*clean=*/false, /*state=*/false, before, pic);
+    const int32_t count = E9_TLS_DATA + (int32_t)buf;
+    const int32_t data  = count + (int32_t)sizeof(uint64_t);
+    const int32_t size  = (int32_t)getLogRecordSize(args.size(), tsc);
+
+    sendDefinitionHeader(out, name, "LOG");
+    // lea -0x4000(%rsp),%rsp
+    code.emit(0x48, 0x8d, 0xa4, 0x24);
+    code.emitInt32(-0x4000);
+    if (save_flags)
+    {
+        code.emit(/*pushfq=*/0x9c);
+        info.rsp_offset += sizeof(int64_t);
+    }
+    for (j = 0; j < nsave; j++)
+    {
+        if (!save[j])
+            continue;
+        sendPush(code, info.rsp_offset, before, getReg(rsave[j]));
+        info.rsp_offset += sizeof(int64_t);
+    }
+
+    // .Lretry:
+    // mov %fs:0x0,%rv
+    // cmp %gs:0x8,%rv
+    // jne .Lalloc
+    code.emitEntry("\".Lretry@%s\"", name);
+    sendSegMemOp(code, 0x64, 0x8b, rv, -1, 0x0);
+    sendSegMemOp(code, 0x65, 0x3b, rv, -1, (int32_t)sizeof(uint64_t));
+    code.emit(0x0f, 0x85);
+    code.emitEntry("{\"rel32\":\".Lalloc@%s\"}", name);
+
+    // mov %gs:count,%ri
+    // cmp $entries,%ri; jae .Lflush    (if func)
+    // and $(entries-1),%ri             (otherwise)
+    // imul $size,%ri,%ri
+    sendSegMemOp(code, 0x65, 0x8b, ri, -1, count);
+    uint8_t rex = 0x48 | REG_REX_MASK[ri];
+    if (func != 0x0)
+    {
+        code.emit(rex, 0x81, 0xc0 | (0x07 << 3) | REG_MODRM[ri]);
+        code.emitInt32((int32_t)entries);
+        code.emit(0x0f, 0x83);
+        code.emitEntry("{\"rel32\":\".Lflush@%s\"}", name);
+    }
+    else
+    {
+        code.emit(rex, 0x81, 0xc0 | (0x04 << 3) | REG_MODRM[ri]);
+        code.emitInt32((int32_t)entries - 1);
+    }
+    rex = 0x48 | (REG_REX_MASK[ri] << 2) | REG_REX_MASK[ri];
+    code.emit(rex, 0x69, 0xc0 | (REG_MODRM[ri] << 3) | REG_MODRM[ri]);
+    code.emitInt32(size);
+
+    // Store the record:
+    int32_t offset = data;
+    if (I->address >= INT32_MIN && I->address <= INT32_MAX)
+        sendSExtFromI32ToR64(code, (int32_t)I->address, rv);
+    else
+        sendMovFromI64ToR64(code, I->address, rv);
+    sendSegMemOp(code, 0x65, 0x89, rv, ri, offset);
+    for (const auto &arg: args)
+    {
+        offset += sizeof(uint64_t);
+        sendLoadGuardArg(code, I, info, arg, rv);
+        sendSegMemOp(code, 0x65, 0x89, rv, ri, offset);
+    }
+    if (tsc)
+    {
+        // rdtsc
+        // shl $32,%rdx
+        // or %rdx,%rax
+        offset += sizeof(uint64_t);
+        code.emit(0x0f, 0x31);
+        code.emit(0x48, 0xc1, 0xe2, 0x20);
+        code.emit(0x48, 0x09, 0xd0);
+        sendSegMemOp(code, 0x65, 0x89, RAX_IDX, ri, offset);
+    }
+
+    // incq %gs:count
+    sendSegMemOp(code, 0x65, 0xff, /*incq=*/RAX_IDX, -1, count);
+
+    // .Lend:
+    code.emitEntry("\".Lend@%s\"", name);
+    for (j = nsave-1; j >= 0; j--)
+    {
+        if (save[j])
+            sendPop(code, false, getReg(rsave[j]));
+    }
+    if (save_flags)
+        code.emit(/*popfq=*/0x9d);
+    // lea 0x4000(%rsp),%rsp
+    // jmp .Ldone
+    code.emit(0x48, 0x8d, 0xa4, 0x24);
+    code.emitInt32(0x4000);
+    code.emit(0xe9);
+    code.emitEntry("{\"rel32\":\".Ldone@%s\"}", name);
+
+    sendTLSAlloc(code, name);
+
+    if (func != 0x0)
+    {
+        // .Lflush:
+        // push %rbp
+        // mov %rsp,%rbp
+        // and $-16,%rsp
+        // mov %gs:0x0,%rdi
+        // add $data,%rdi
+        // mov %gs:count,%rsi
+        // callq func
+        // mov %rbp,%rsp
+        // pop %rbp
+        // movq $0x0,%gs:count
+        // jmp .Lretry
+        code.emitEntry("\".Lflush@%s\"", name);
+        code.emitBytes(save_push, sizeof(save_push));
+        code.emit(0x55, 0x48, 0x89, 0xe5);
+        code.emit(0x48, 0x83, 0xe4, 0xf0);
+        sendSegMemOp(code, 0x65, 0x8b, RDI_IDX, -1, 0x0);
+        code.emit(0x48, 0x81, 0xc7);
+        code.emitInt32(data);
+        sendSegMemOp(code, 0x65, 0x8b, RSI_IDX, -1, count);
+        code.emit(0xe8);
+        code.emitEntry("{\"rel32\":%zd}", func);
+        code.emit(0x48, 0x89, 0xec, 0x5d);
+        code.emitBytes(save_pop, sizeof(save_pop));
+        sendSegMemOp(code, 0x65, 0xc7, /*movq=*/RAX_IDX, -1, count);
+        code.emitInt32(0);
+        code.emit(0xe9);
+        code.emitEntry("{\"rel32\":\".Lretry@%s\"}", name);
+    }
+
+    // .Ldone:
+    code.emitEntry("\".Ldone@%s\"", name);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "DATA");
+    sendDefinitionFooter(out);
+}
+
+/*
+ * Send a "hook" trampoline metadata.  At the function entry, the return
+ * address is pushed onto a shadow stack in the per-thread block (%gs),
+ * together with the stack pointer and the function address, and is then
+ * replaced by the address of the return trampoline (`stub', see
+ * sendHookTrampolineMessage()).  The shadow stack is a 64-bit depth
+ * followed by `entries' frames.  If the shadow stack is full, the function
+ * is not hooked.  %rax, %rcx and %rflags are only saved if live.
+ */
+void e9tool::sendHookMetadata(FILE *out, const char *name, const ELF *elf,
+    unsigned entries, intptr_t buf, intptr_t stub, size_t i,
+    const InstrInfo *I)
+{
+    CodeBuffer code;
+    name++;
+    sendDefinitionHeader(out, name, "HOOK");
+    const F *f = findF(elf->fs, i);
+    if (f == nullptr || f->lb != i)
+    {
+        // The return address is only known at the function entry:
+        warning(CONTEXT_FORMAT "failed to hook instruction; the "
+            "instruction is not a function entry", CONTEXT(I));
+        code.emitEntry("\".Ldone@%s\"", name);
+        sendCodeBuffer(out, code);
+        sendDefinitionFooter(out);
+        sendDefinitionHeader(out, name, "DATA");
+        sendDefinitionFooter(out);
+        return;
+    }
+
+    RegSet live = getLiveRegs(elf, POS_BEFORE, i);
+    bool save_flags = ((live & (1 << RFLAGS_IDX)) != 0);
+    bool save_rax   = ((live & (1 << RAX_IDX)) != 0);
+    bool save_rcx   = ((live & (1 << RCX_IDX)) != 0);
+    const int32_t depth = E9_TLS_DATA + (int32_t)buf;
+    const int32_t data  = depth + (int32_t)sizeof(uint64_t);
+    const int32_t ret   = 0x4000 + (int32_t)sizeof(int64_t) *
+        ((save_flags? 1: 0) + (save_rax? 1: 0) + (save_rcx? 1: 0));
+
+    // lea -0x4000(%rsp),%rsp
+    code.emit(0x48, 0x8d, 0xa4, 0x24);
+    code.emitInt32(-0x4000);
+    if (save_flags)
+        code.emit(/*pushfq=*/0x9c);
+    if (save_rax)
+        code.emit(/*push %rax=*/0x50);
+    if (save_rcx)
+        code.emit(/*push %rcx=*/0x51);
+
+    // .Lretry:
+    // mov %fs:0x0,%rcx
+    // cmp %gs:0x8,%rcx
+    // jne .Lalloc
+    code.emitEntry("\".Lretry@%s\"", name);
+    sendSegMemOp(code, 0x64, 0x8b, RCX_IDX, -1, 0x0);
+    sendSegMemOp(code, 0x65, 0x3b, RCX_IDX, -1, (int32_t)sizeof(uint64_t));
+    code.emit(0x0f, 0x85);
+    code.emitEntry("{\"rel32\":\".Lalloc@%s\"}", name);
+
+    // mov %gs:depth,%rax
+    // cmp $entries,%rax
+    // jae .Lend
+    // imul $frame,%rax,%rax
+    sendSegMemOp(code, 0x65, 0x8b, RAX_IDX, -1, depth);
+    code.emit(0x48, 0x3d);
+    code.emitInt32((int32_t)entries);
+    code.emit(0x0f, 0x83);
+    code.emitEntry("{\"rel32\":\".Lend@%s\"}", name);
+    code.emit(0x48, 0x6b, 0xc0, (uint8_t)HOOK_FRAME_SIZE);
+
+    // mov ret(%rsp),%rcx
+    // mov %rcx,%gs:data(%rax)          # return address
+    // lea ret(%rsp),%rcx
+    // mov %rcx,%gs:data+8(%rax)        # stack pointer
+    // lea .Linstr(%rip),%rcx
+    // mov %rcx,%gs:data+16(%rax)       # function address
+    code.emit(0x48, 0x8b, 0x8c, 0x24);
+    code.emitInt32(ret);
+    sendSegMemOp(code, 0x65, 0x89, RCX_IDX, RAX_IDX, data);
+    code.emit(0x48, 0x8d, 0x8c, 0x24);
+    code.emitInt32(ret);
+    sendSegMemOp(code, 0x65, 0x89, RCX_IDX, RAX_IDX,
+        data + (int32_t)sizeof(uint64_t));
+    code.emit(0x48, 0x8d, 0x0d);
+    code.emitEntry("{\"rel32\":\".Linstr\"}");
+    sendSegMemOp(code, 0x65, 0x89, RCX_IDX, RAX_IDX,
+        data + 2 * (int32_t)sizeof(uint64_t));
+
+    // lea stub(%rip),%rcx
+    // mov %rcx,ret(%rsp)
+    // incq %gs:depth
+    code.emit(0x48, 0x8d, 0x0d);
+    code.emitEntry("{\"rel32\":%zd}", stub);
+    code.emit(0x48, 0x89, 0x8c, 0x24);
+    code.emitInt32(ret);
+    sendSegMemOp(code, 0x65, 0xff, /*incq=*/RAX_IDX, -1, depth);
+
+    // .Lend:
+    code.emitEntry("\".Lend@%s\"", name);
+    if (save_rcx)
+        code.emit(/*pop %rcx=*/0x59);
+    if (save_rax)
+        code.emit(/*pop %rax=*/0x58);
+    if (save_flags)
+        code.emit(/*popfq=*/0x9d);
+    // lea 0x4000(%rsp),%rsp
+    // jmp .Ldone
+    code.emit(0x48, 0x8d, 0xa4, 0x24);
+    code.emitInt32(0x4000);
+    code.emit(0xe9);
+    code.emitEntry("{\"rel32\":\".Ldone@%s\"}", name);
+
+    sendTLSAlloc(code, name);
+
+    // .Ldone:
+    code.emitEntry("\".Ldone@%s\"", name);
+    sendCodeBuffer(out, code);
+    sendDefinitionFooter(out);
+
+    sendDefinitionHeader(out, name, "DATA");
     sendDefinitionFooter(out);
 }
 
@@ -2057,8 +2941,10 @@ void e9tool::sendPrintMetadata(FILE *out, const InstrInfo *I)
  */
 void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
     const Call &call, const std::vector<Argument> &args,
-    intptr_t id, const std::vector<Instr> &Is, size_t i, const InstrInfo *I)
+    const std::vector<Guard> &guard, intptr_t id,
+    const std::vector<Instr> &Is, size_t i, const InstrInfo *I)
 {
+    CodeBuffer code;
     // Load arguments.
     bool sysv = true;
     switch (elf->type)
@@ -2071,12 +2957,41 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
     }
 
     name++;
+    if (call.guard)
+        sendGuardMetadata(out, name, elf, call, guard, i, I);
+    bool clean = (call.abi == ABI_CLEAN);
+    bool conditional = (call.jmp != JUMP_NONE);
+    const int *rsave = getCallerSaveRegs(sysv, clean, call.state,
+        conditional, args.size());
+    int rsave_inline[RMAX_IDX+2], rsave_live[RMAX_IDX+2];
+    rsave = getInlineCallerSaveRegs(sysv, call, rsave, rsave_inline);
+    if (option_liveness)
+    {
+        // Only save the registers that are live at the patch site:
+        rsave = getLiveCallerSaveRegs(elf, call, args, sysv, i, rsave,
+            rsave_live);
+        sendDefinitionHeader(out, name, "PUSH");
+        Register rscratch = (clean || call.state? REGISTER_RAX:
+            REGISTER_INVALID);
+        sendPushCallerSaveRegs(code, rsave, (call.pos != POS_AFTER),
+            rscratch);
+        sendCodeBuffer(out, code);
+        sendDefinitionFooter(out);
+
+        // See sendCallTrampolineMessage():
+        bool preserve_rax = (conditional || !clean) &&
+            !(conditional && clean && !call.state);
+        sendDefinitionHeader(out, name, "POP");
+        sendPopCallerSaveRegs(code, rsave, conditional, preserve_rax);
+        sendCodeBuffer(out, code);
+        sendDefinitionFooter(out);
+    }
+
     sendDefinitionHeader(out, name, "ARGS");
     int argno = 0;
     bool before = (call.pos == POS_BEFORE);
     bool pic = (getELFType(elf) != BINARY_TYPE_ELF_EXE);
-    CallInfo info(sysv, (call.abi == ABI_CLEAN), call.state,
-        (call.jmp != JUMP_NONE), args.size(), before, pic);
+    CallInfo info(rsave, clean, call.state, before, pic);
     TypeSig sig = TYPESIG_EMPTY;
     if (args.size() != call.args.size())
         error("failed to emit call metadata; expected %zu arguments, "
@@ -2089,8 +3004,8 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
                 "#%zu", j+1);
         j++;
         int regno = getArgRegIdx(sysv, argno);
-        Type t = sendLoadArgumentMetadata(out, info, elf, name, call.pos, Is,
-            i, I, id, arg, argno, regno);
+        Type t = sendLoadArgumentMetadata(code, info, elf, call.target, name,
+            call.pos, Is, i, I, id, arg, argno, regno);
         sig = setType(sig, t, argno);
         argno++;
     }
@@ -2103,7 +3018,7 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
         switch (regno)
         {
             case R10_IDX: case R11_IDX:
-                sendPush(out, info.rsp_offset, before, getReg(regno));
+                sendPush(code, info.rsp_offset, before, getReg(regno));
                 rsp_args_offset += sizeof(int64_t);
                 break;
         }
@@ -2116,10 +3031,11 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
             // Restore clobbered callee-save register:
             int32_t reg_offset = rsp_args_offset;
             reg_offset += info.getOffset(reg);
-            sendMovFromStackToR64(out, reg_offset, regno);
+            sendMovFromStackToR64(code, reg_offset, regno);
             info.restore(reg);
         }
     }
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
 
     // Find & call the function.
@@ -2141,7 +3057,8 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
             "in binary \"%s\"", CONTEXT(I), str.c_str(),
             call.target->filename);
     }
-    fprintf(out, "{\"rel32\":%d}", (int32_t)addr);
+    code.emitEntry("{\"rel32\":%d}", (int32_t)addr);
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
     info.call(call.jmp != JUMP_NONE);
 
@@ -2150,8 +3067,8 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
     if (rsp_args_offset != 0)
     {
         // lea rsp_args_offset(%rsp),%rsp
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            0x48, 0x8d, 0xa4, 0x24, rsp_args_offset);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(rsp_args_offset);
     }
     bool pop_rsp = call.state;
     Register reg;
@@ -2168,21 +3085,23 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
         bool preserve_rax = info.isUsed(REGISTER_RAX);
         Register rscratch = (preserve_rax? info.getScratch():
             REGISTER_INVALID);
-        if (sendPop(out, preserve_rax, reg, rscratch))
+        if (sendPop(code, preserve_rax, reg, rscratch))
             info.clobber(rscratch);
     }
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
 
     // Restore %rsp.
     sendDefinitionHeader(out, name, "RSTOR_RSP");
     if (pop_rsp)
-        sendPop(out, false, REGISTER_RSP);
+        sendPop(code, false, REGISTER_RSP);
     else
     {
         // lea 0x4000(%rsp),%rsp
-        fprintf(out, "%u,%u,%u,%u,{\"int32\":%d},",
-            0x48, 0x8d, 0xa4, 0x24, 0x4000);
+        code.emit(0x48, 0x8d, 0xa4, 0x24);
+        code.emitInt32(0x4000);
     }
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
 
     // Place data (if necessary).
@@ -2191,9 +3110,10 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
     for (const auto &arg: args)
     {
         int regno = getArgRegIdx(sysv, argno);
-        sendArgumentDataMetadata(out, name, elf, arg, i, I, regno);
+        sendArgumentDataMetadata(code, name, elf, arg, i, I, regno);
         argno++;
     }
+    sendCodeBuffer(out, code);
     sendDefinitionFooter(out);
 }
 
@@ -2201,12 +3121,21 @@ void e9tool::sendCallMetadata(FILE *out, const char *name, const ELF *elf,
  * Build metadata.
  */
 void sendMetadata(FILE *out, const ELF *elf, const Action *action, size_t idx,
-    const std::vector<Instr> &Is, size_t i, const InstrInfo *I, intptr_t id,
-    Context *cxt)
+    bool sample, const std::vector<Instr> &Is, size_t i, const InstrInfo *I,
+    intptr_t id, Context *cxt)
 {
     if (action == nullptr)
         return;
     const Patch *patch = action->patch[idx];
+    if (sample)
+    {
+        // Sample countdowns are indexed the same way as counters:
+        intptr_t addr = patch->sample_map +
+            (intptr_t)(sizeof(uint32_t) * (patch->sites - 1 - (size_t)id));
+        sendSampleMetadata(out, patch->sampler, elf, patch->pos,
+            patch->sample, addr, i);
+        return;
+    }
 
     switch (patch->kind)
     {
@@ -2229,7 +3158,27 @@ void sendMetadata(FILE *out, const ELF *elf, const Action *action, size_t idx,
             return;
         case PATCH_CALL:
             sendCallMetadata(out, patch->name, elf, *patch->call, patch->args,
-                id, Is, i, I);
+                patch->guard, id, Is, i, I);
+            return;
+        case PATCH_COUNT: case PATCH_COV:
+        {
+            // Counters are indexed by the patched instruction's rank in
+            // address order (patch messages are sent in reverse order).
+            size_t size = (patch->kind == PATCH_COUNT? sizeof(uint64_t):
+                sizeof(uint8_t));
+            intptr_t addr = patch->map +
+                (intptr_t)(size * (patch->sites - 1 - (size_t)id));
+            sendCounterMetadata(out, patch->name, elf, patch->pos,
+                patch->flags, patch->lea, addr, i);
+            return;
+        }
+        case PATCH_LOG:
+            sendLogMetadata(out, patch->name, elf, patch->pos, patch->args,
+                patch->tsc, patch->entries, patch->buf, patch->func, i, I);
+            return;
+        case PATCH_HOOK:
+            sendHookMetadata(out, patch->name, elf, patch->entries,
+                patch->buf, patch->map, i, I);
             return;
         default:
             return;
@@ -39,7 +39,10 @@ bool option_intel_syntax = false;
 bool option_targets      = false;
 bool option_bbs          = false;
 bool option_fs           = false;
+bool option_liveness     = false;
 bool option_trap_all     = false;
+bool option_plt          = false;
+unsigned option_threads  = 1;
 
 /*
  * Duplicate a string.
@@ -181,6 +184,34 @@ const char *findBinary(const char *filename, bool exe, bool dot)
         (exe? "executable": "library"), filename, (exe? "PATH": "RPATH"));
 }
 
+/*
+ * Find a shared library.  The `runpath' is searched first, followed by the
+ * default library search path.  Returns nullptr if not found.
+ */
+const char *findLibrary(const char *filename,
+    const std::vector<std::string> &runpath)
+{
+    if (strchr(filename, '/') != nullptr)
+        return realpath(filename, nullptr);
+    std::vector<std::string> path(runpath);
+    getPath(/*exe=*/false, path);
+    for (const auto &dirname: path)
+    {
+        std::string pathname_0(dirname);
+        pathname_0 += '/';
+        pathname_0 += filename;
+
+        char *pathname = realpath(pathname_0.c_str(), nullptr);
+        if (pathname == nullptr)
+            continue;
+        struct stat buf;
+        if (stat(pathname, &buf) == 0 && S_ISREG(buf.st_mode))
+            return pathname;
+        free(pathname);
+    }
+    return nullptr;
+}
+
 /*
  * Usage.
  */
@@ -194,6 +225,7 @@ void usage(FILE *stream, const char *progname)
         "  \\___|  /_/ \\__\\___/ \\___/|_|\n"
         "\n"
         "usage: %s [OPTIONS] --match MATCH --patch PATCH ... input-file\n"
+        "       %s [OPTIONS] --match MATCH --patch PATCH ... input-file ...\n"
         "\n"
         "MATCH\n"
         "=====\n"
@@ -232,12 +264,31 @@ void usage(FILE *stream, const char *progname)
         "\t--backend PROG\n"
         "\t\tUse PROG as the backend.  The default is \"e9patch\".\n"
         "\n"
+        "\t--blocks\n"
+        "\t\tEnables basic-block granularity patching.  Each basic block\n"
+        "\t\tcontaining matching instructions is relocated (from the block\n"
+        "\t\tentry) into a single trampoline with the instrumentation\n"
+        "\t\tinlined, and only the block entry is patched with a jump.\n"
+        "\t\tBlocks longer than 32 instructions may be split over several\n"
+        "\t\ttrampolines.  This implies -CFR.\n"
+        "\n"
+        "\t--cache-dir DIR\n"
+        "\t\tCache the disassembly and control-flow analysis results in\n"
+        "\t\tthe directory DIR.  Later runs on the same binary (with the\n"
+        "\t\tsame disassembly options) will reuse the cached results.\n"
+        "\n"
         "\t-CFR, -X\n"
         "\t\tEnables binary rewriting \"with\" control-flow recovery.  This\n"
         "\t\tusually makes the rewritten binary much faster, but may\n"
         "\t\tintroduce rewriting bugs if the built-in recovery analysis is\n"
         "\t\tinaccurate.\n"
         "\n"
+        "\t--compile-csv FILE\n"
+        "\t\tCompile the CSV file FILE into a binary FILE.bin file that\n"
+        "\t\tis memory-mapped (rather than parsed) by later runs that use\n"
+        "\t\tthe corresponding NAME[i] attribute.  If no input binary is\n"
+        "\t\tgiven, then exit after compiling.\n"
+        "\n"
         "\t--compression N, -c N\n"
         "\t\tSet the compression level to be N, where N is a number within\n"
         "\t\tthe range 0..9.  The default is 9 for maximum compression.\n"
@@ -293,12 +344,45 @@ void usage(FILE *stream, const char *progname)
         "\t--help, -h\n"
         "\t\tPrint this message and exit.\n"
         "\n"
+        "\t--jobs N\n"
+        "\t\tUse N worker processes in batch mode (see `--manifest').  The\n"
+        "\t\tdefault is the number of online CPUs.\n"
+        "\n"
+        "\t--liveness\n"
+        "\t\tOnly save the caller-save registers that are live at the\n"
+        "\t\tpatch site for call trampolines, including %%rflags.  Use\n"
+        "\t\tthe \"flags\" ABI option, e.g., func<clean,flags>(...), to\n"
+        "\t\talways save %%rflags.  This uses a conservative\n"
+        "\t\tintra-procedural register liveness analysis, and falls back\n"
+        "\t\tto saving all registers where the CFG is incomplete.\n"
+        "\n"
+        "\t--manifest FILE\n"
+        "\t\tRewrite all binaries listed in FILE (batch mode).  Each line\n"
+        "\t\tof FILE is of the form \"INPUT [OUTPUT]\".  Batch mode is also\n"
+        "\t\tenabled if more than one input-file is given.  The same MATCH\n"
+        "\t\tand PATCH options are applied to each binary, and plugins and\n"
+        "\t\tinstrumentation binaries are loaded once.  Each binary is then\n"
+        "\t\trewritten by a separate worker process with its own backend,\n"
+        "\t\tand the log is written to \"OUTPUT.log\".  If OUTPUT is\n"
+        "\t\tmissing, then the output file is placed in the directory named\n"
+        "\t\tby `--output'/`-o'.\n"
+        "\n"
         "\t--no-warnings\n"
         "\t\tDo not print warning messages.\n"
         "\n"
+        "\t--pipeline\n"
+        "\t\tMatch instructions in blocks while the instructions and\n"
+        "\t\tpatches above them are sent, which keeps the backend busy.\n"
+        "\t\tThis is ignored with plugins, per-site maps (counters,\n"
+        "\t\tcoverage or sampling) or `--blocks', and is implied by\n"
+        "\t\t`--stream'.  Note that the composite trampolines are\n"
+        "\t\tnumbered in a different order, so the output differs (but is\n"
+        "\t\tequivalent).\n"
+        "\n"
         "\t--plt\n"
         "\t\tEnable the disassembly/rewriting of the .plt.* sections which\n"
-        "\t\tare excluded by default.\n"
+        "\t\tare excluded by default.  This option is implied by the `plt'\n"
+        "\t\tmatching attribute.\n"
         "\n"
         "\t--plugin=NAME:OPTION\n"
         "\t\tPass OPTION to the plugin with NAME.  Here NAME must identify a\n"
@@ -321,7 +405,24 @@ void usage(FILE *stream, const char *progname)
         "\t--output FILE, -o FILE\n"
         "\t\tSpecifies the path to the output file.  The default filename is\n"
         "\t\tone of {\"a.out\", \"a.so\", \"a.exe\", \"a.dll\"}, depending on\n"
-        "\t\tthe input binary type.\n"
+        "\t\tthe input binary type.  In batch mode (see `--manifest'), FILE\n"
+        "\t\tis the output directory.\n"
+        "\n"
+        "\t--rpc MODE\n"
+        "\t\tSet the encoding used to communicate with the e9patch backend\n"
+        "\t\tto MODE, which is one of {json, binary}.  The \"binary\" mode\n"
+        "\t\tsends \"instruction\" and \"patch\" messages as compact\n"
+        "\t\tlength-prefixed records.  This option has no effect for\n"
+        "\t\t`--format json'.  The default is \"binary\".\n"
+        "\n"
+        "\t--rpc-transport MODE\n"
+        "\t\tSet the transport used to communicate with the e9patch\n"
+        "\t\tbackend to MODE, which is one of {pipe, ring}.  The \"ring\"\n"
+        "\t\ttransport uses a shared-memory ring with futex wakeups, which\n"
+        "\t\tavoids most of the system calls and context switches of the\n"
+        "\t\t\"pipe\" transport.  If the ring cannot be created, then the\n"
+        "\t\tpipe transport is used instead.  This option has no effect for\n"
+        "\t\t`--format json'.  The default is \"ring\".\n"
         "\n"
         "\t--seed=SEED\n"
         "\t\tSet SEED to be the random number seed.  The special value \"0\"\n"
@@ -341,6 +442,21 @@ void usage(FILE *stream, const char *progname)
         "\t\treliable for large/complex binaries.  However, this may bloat\n"
         "\t\tthe size of the output patched binary.\n"
         "\n"
+        "\t--stats FILE\n"
+        "\t\tWrite per-phase timing & memory statistics to FILE in JSON\n"
+        "\t\tformat.  This includes the wall time, CPU time, and peak RSS\n"
+        "\t\tof each phase (disassembly, CFG analysis, matching, metadata,\n"
+        "\t\tsending, and waiting for the backend).  For the backend\n"
+        "\t\tstatistics, also use `--option --stats=FILE'.\n"
+        "\n"
+        "\t--stream SIZE\n"
+        "\t\tProcess the binary in windows of SIZE bytes of code, from the\n"
+        "\t\thighest address downwards.  Each window is disassembled,\n"
+        "\t\tmatched and sent to the backend, and then freed, so memory\n"
+        "\t\tusage is bounded by SIZE rather than the binary size.  This\n"
+        "\t\tcannot be used with plugins, per-site maps or control-flow\n"
+        "\t\tanalysis.\n"
+        "\n"
         "\t--syntax SYNTAX\n"
         "\t\tSelects the assembly syntax to be SYNTAX.  Possible values are:\n"
         "\n"
@@ -349,6 +465,22 @@ void usage(FILE *stream, const char *progname)
         "\n"
         "\t\tThe default syntax is \"ATT\".\n"
         "\n"
+        "\t--threads N\n"
+        "\t\tUse N threads for the disassembly and matching phases.  Large\n"
+        "\t\texecutable sections are split into chunks that are decoded\n"
+        "\t\tconcurrently, and the chunks are stitched back together at the\n"
+        "\t\tnearest instruction boundary.  Matchings are evaluated over\n"
+        "\t\tinstruction ranges concurrently, unless a matching uses\n"
+        "\t\t`random', or a plugin opts out.  The result is identical to\n"
+        "\t\tthe serial mode.  The default is 1.\n"
+        "\n"
+        "\t--tls SIZE\n"
+        "\t\tReserve a per-thread instrumentation block of SIZE bytes that\n"
+        "\t\tis addressable via the %%gs segment register (see e9_tls() in\n"
+        "\t\texamples/stdlib.c).  Any log buffers and hook shadow stacks\n"
+        "\t\tare placed after the first SIZE bytes.  The binary must not\n"
+        "\t\tuse %%gs.\n"
+        "\n"
         "\t--trap=ADDR, --trap-all\n"
         "\t\tInsert a trap (int3) instruction at the corresponding\n"
         "\t\ttrampoline entry.  This can be used for debugging with gdb.\n"
@@ -356,7 +488,8 @@ void usage(FILE *stream, const char *progname)
         "\t--use-disasm FILE\n"
         "\t\tUse the instruction information in FILE rather than the default\n"
         "\t\tdisassmebler.  Here, FILE is a CSV file with a single column\n"
-        "\t\trepresenting instruction addresses.\n"
+        "\t\trepresenting instruction addresses, or a binary file generated\n"
+        "\t\tby --compile-csv.\n"
         "\n"
         "\t--use-targets FILE\n"
         "\t\tUse the jump/call target information in FILE rather than the\n"
@@ -367,6 +500,16 @@ void usage(FILE *stream, const char *progname)
         "\n"
         "\t--version\n"
         "\t\tPrint the version and exit.\n"
-        "\n", progname);
+        "\n"
+        "\t--with-libs\n"
+        "\t\tAlso rewrite the shared libraries needed by the input\n"
+        "\t\texecutable (joint mode).  The libraries are found using the\n"
+        "\t\texecutable's DT_RUNPATH/DT_RPATH and the default library\n"
+        "\t\tsearch path, and are rewritten in parallel as for batch mode\n"
+        "\t\t(see `--manifest').  Each binary is assigned a disjoint\n"
+        "\t\ttrampoline address window (`--mem-lb'/`--mem-ub').  The\n"
+        "\t\t`--output'/`-o' option names the output directory, and the\n"
+        "\t\tlibraries are written under their DT_NEEDED names.\n"
+        "\n", progname, progname);
 }
 
@@ -21,6 +21,7 @@
 #include <cstdlib>
 
 #include <string>
+#include <vector>
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE   4096
@@ -41,6 +42,8 @@ extern void getExePath(std::string &path);
 extern bool isLibraryFilename(const char *filename);
 extern const char *findBinary(const char *filename, bool exe = true,
     bool dot = false);
+extern const char *findLibrary(const char *filename,
+    const std::vector<std::string> &runpath);
 extern void usage(FILE *stream, const char *progname);
 extern void flushWarnings(void);
 
@@ -54,6 +57,9 @@ extern bool option_intel_syntax;
 extern bool option_targets;
 extern bool option_bbs;
 extern bool option_fs;
+extern bool option_liveness;
 extern bool option_trap_all;
+extern bool option_plt;
+extern unsigned option_threads;
 
 #endif
@@ -111,6 +111,8 @@ static const TokenInfo tokens[] =
     {"condjump",        TOKEN_CONDJUMP,         0},
     {"config",          TOKEN_CONFIG,           0},
     {"const",           TOKEN_CONST,            0},
+    {"count",           TOKEN_COUNT,            0},
+    {"cov",             TOKEN_COV,              0},
     {"cs",              TOKEN_REGISTER,         REGISTER_CS},
     {"cx",              TOKEN_REGISTER,         REGISTER_CX},
     {"defined",         TOKEN_DEFINED,          0},
@@ -140,9 +142,11 @@ static const TokenInfo tokens[] =
     {"esp",             TOKEN_REGISTER,         REGISTER_ESP},
     {"exit",            TOKEN_EXIT,             0},
     {"false",           TOKEN_FALSE,            false},
+    {"flags",           TOKEN_FLAGS,            0},
     {"fs",              TOKEN_REGISTER,         REGISTER_FS},
     {"goto",            TOKEN_GOTO,             0},
     {"gs",              TOKEN_REGISTER,         REGISTER_GS},
+    {"hook",            TOKEN_HOOK,             0},
     {"id",              TOKEN_ID,               0},
     {"if",              TOKEN_IF,               0},
     {"imm",             TOKEN_IMM,              OPTYPE_IMM},
@@ -150,6 +154,7 @@ static const TokenInfo tokens[] =
     {"imm8",            TOKEN_IMM8,             0},
     {"in",              TOKEN_IN,               0},
     {"index",           TOKEN_INDEX,            0},
+    {"inline",          TOKEN_INLINE,           0},
     {"instr",           TOKEN_INSTR,            0},
     {"int16_t",         TOKEN_INT16_T,          0},
     {"int32_t",         TOKEN_INT32_T,          0},
@@ -158,8 +163,10 @@ static const TokenInfo tokens[] =
     {"jcc",             TOKEN_JCC,              0},
     {"jmp",             TOKEN_JMP,              0},
     {"jump",            TOKEN_JUMP,             0},
+    {"lea",             TOKEN_LEA,              0},
     {"len",             TOKEN_LENGTH,           0},
     {"length",          TOKEN_LENGTH,           0},
+    {"log",             TOKEN_LOG,              0},
     {"match",           TOKEN_MATCH,            0},
     {"mem",             TOKEN_MEM,              OPTYPE_MEM},
     {"mem16",           TOKEN_MEM16,            0},
@@ -179,7 +186,9 @@ static const TokenInfo tokens[] =
     {"op",              TOKEN_OP,               0},
     {"or",              TOKEN_OR,               0},
     {"patch",           TOKEN_PATCH,            0},
+    {"plt",             TOKEN_PLT,              0},
     {"plugin",          TOKEN_PLUGIN,           0},
+    {"pmc",             TOKEN_PMC,              0},
     {"print",           TOKEN_PRINT,            0},
     {"r",               TOKEN_READ,             ACCESS_READ},
     {"r-",              TOKEN_READ,             ACCESS_READ},
@@ -235,10 +244,12 @@ static const TokenInfo tokens[] =
     {"rsi",             TOKEN_REGISTER,         REGISTER_RSI},
     {"rsp",             TOKEN_REGISTER,         REGISTER_RSP},
     {"rw",              TOKEN_RW,               (ACCESS_READ | ACCESS_WRITE)},
+    {"sample",          TOKEN_SAMPLE,           0},
     {"scale",           TOKEN_SCALE,            0},
     {"section",         TOKEN_SECTION,          0},
     {"seg",             TOKEN_SEGMENT,          0},
     {"segment",         TOKEN_SEGMENT,          0},
+    {"shadow",          TOKEN_SHADOW,           0},
     {"si",              TOKEN_REGISTER,         REGISTER_SI},
     {"sib",             TOKEN_SIB,              0},
     {"signal",          TOKEN_SIGNAL,           0},
@@ -256,9 +267,11 @@ static const TokenInfo tokens[] =
     {"trampoline",      TOKEN_TRAMPOLINE,       0},
     {"trap",            TOKEN_TRAP,             0},
     {"true",            TOKEN_TRUE,             true},
+    {"tsc",             TOKEN_TSC,              0},
     {"type",            TOKEN_TYPE,             0},
     {"void",            TOKEN_VOID,             0},
     {"w",               TOKEN_WRITE,            ACCESS_WRITE},
+    {"when",            TOKEN_WHEN,             0},
     {"write",           TOKEN_WRITE,            ACCESS_WRITE},
     {"writes",          TOKEN_WRITES,           0},
     {"x87",             TOKEN_X87,              0},
@@ -54,6 +54,8 @@ enum Token
     TOKEN_CONDJUMP,
     TOKEN_CONFIG,
     TOKEN_CONST,
+    TOKEN_COUNT,
+    TOKEN_COV,
     TOKEN_DEFINED,
     TOKEN_DISP,
     TOKEN_DISP32,
@@ -67,8 +69,10 @@ enum Token
     TOKEN_EXIT,
     TOKEN_F,
     TOKEN_FALSE,
+    TOKEN_FLAGS,
     TOKEN_GEQ,
     TOKEN_GOTO,
+    TOKEN_HOOK,
     TOKEN_I,
     TOKEN_ID,
     TOKEN_IF,
@@ -77,6 +81,7 @@ enum Token
     TOKEN_IMM8,
     TOKEN_IN,
     TOKEN_INDEX,
+    TOKEN_INLINE,
     TOKEN_INSTR,
     TOKEN_INT16_T,
     TOKEN_INT32_T,
@@ -85,8 +90,10 @@ enum Token
     TOKEN_JCC,
     TOKEN_JMP,
     TOKEN_JUMP,
+    TOKEN_LEA,
     TOKEN_LENGTH,
     TOKEN_LEQ,
+    TOKEN_LOG,
     TOKEN_LSHIFT,
     TOKEN_MATCH,
     TOKEN_MEM,
@@ -110,7 +117,9 @@ enum Token
     TOKEN_OP,
     TOKEN_OR,
     TOKEN_PATCH,
+    TOKEN_PLT,
     TOKEN_PLUGIN,
+    TOKEN_PMC,
     TOKEN_PRINT,
     TOKEN_RANDOM,
     TOKEN_READ,
@@ -123,9 +132,11 @@ enum Token
     TOKEN_REX,
     TOKEN_RSHIFT,
     TOKEN_RW,
+    TOKEN_SAMPLE,
     TOKEN_SCALE,
     TOKEN_SECTION,
     TOKEN_SEGMENT,
+    TOKEN_SHADOW,
     TOKEN_SIB,
     TOKEN_SIGNAL,
     TOKEN_SIZE,
@@ -138,8 +149,10 @@ enum Token
     TOKEN_TRAMPOLINE,
     TOKEN_TRAP,
     TOKEN_TRUE,
+    TOKEN_TSC,
     TOKEN_TYPE,
     TOKEN_VOID,
+    TOKEN_WHEN,
     TOKEN_WRITE,
     TOKEN_WRITES,
     TOKEN_X87,
@@ -29,6 +29,13 @@
 
 #define API_VERSION                 1
 
+/*
+ * Plugin flags (set via `cxt->flags' in e9_plugin_init()).
+ */
+#define PLUGIN_FLAG_SERIAL          0x1     // Disable parallel matching
+#define PLUGIN_FLAG_PARALLEL        0x2     // Allow parallel batch matching
+#define PLUGIN_FLAG_REENTRANT       0x4     // Reentrant e9_plugin_match()
+
 extern "C"
 {
     /*
@@ -56,19 +63,37 @@ extern "C"
         ssize_t idx;                            // Current instruction idx
         const e9tool::InstrInfo * const I;      // Current instruction info
         intptr_t id;                            // Current patch ID
+        unsigned *flags;                        // Plugin flags (init only)
+    };
+
+    /*
+     * Batch of instructions Is[lo..lo+size) (struct-of-arrays view).
+     */
+    struct Batch
+    {
+        size_t lo;                              // First instruction idx
+        size_t size;                            // Number of instructions
+        const intptr_t *address;                // Instruction addresses
+        const uint8_t *length;                  // Instruction sizes
+        const e9tool::Mnemonic *mnemonic;       // Instruction mnemonics
+        intptr_t *results;                      // Match values (output)
     };
 
     typedef void *(*PluginInit)(const Context *cxt);
+    typedef void *(*PluginInitThread)(const Context *cxt);
     typedef void (*PluginEvent)(const Context *cxt, Event event);
     typedef intptr_t (*PluginMatch)(const Context *cxt);
+    typedef void (*PluginMatchBatch)(const Context *cxt, const Batch *batch);
     typedef void (*PluginCode)(const Context *cxt);
     typedef void (*PluginData)(const Context *cxt);
     typedef void (*PluginPatch)(const Context *cxt);
     typedef void (*PluginFini)(const Context *cxt);
 
     extern void *e9_plugin_init(const Context *cxt);
+    extern void *e9_plugin_init_thread(const Context *cxt);
     extern void e9_plugin_event(const Context *cxt, Event event);
     extern intptr_t e9_plugin_match(const Context *cxt);
+    extern void e9_plugin_match_batch(const Context *cxt, const Batch *batch);
     extern void e9_plugin_code(const Context *cxt);
     extern void e9_plugin_data(const Context *cxt);
     extern void e9_plugin_patch(const Context *cxt);
@@ -27,9 +27,11 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 
 #include <dlfcn.h>
 #include <fcntl.h>
@@ -45,6 +47,8 @@
 
 #define PAGE_SIZE       4096
 #define MAX_ACTIONS     (1 << 16)
+#define CHUNK_SIZE_MIN  (1 << 16)
+#define MATCH_BLOCK_SIZE (1 << 16)
 
 /*
  * Options.
@@ -54,6 +58,7 @@ static std::string option_output("");
 static std::vector<std::pair<const char *, char *>> option_plugin;
 
 #include "e9action.h"
+#include "e9cache.h"
 #include "e9csv.h"
 #include "e9elf.h"
 #include "e9metadata.h"
@@ -62,9 +67,17 @@ static std::vector<std::pair<const char *, char *>> option_plugin;
 #include "e9plugin.h"
 #include "e9tool.h"
 #include "e9x86_64.h"
+#include "../e9patch/e9loader.h"
+#include "../e9patch/e9ring.h"
+#include "../e9patch/e9stats.h"
 
 using namespace e9tool;
 
+/*
+ * Per-phase statistics (--stats).
+ */
+static Stats stats;
+
 /*
  * Backend info.
  */
@@ -72,38 +85,61 @@ struct Backend
 {
     FILE *out;                      // JSON RPC output.
     pid_t pid;                      // Backend process ID.
+    bool binary;                    // Use binary records?
+    Ring ring;                      // Shared-memory ring (if used).
 };
 
 /*
- * Excluded locations.
+ * Ring transport stream operations.
  */
-struct Exclude
+#define RING_STREAM_BUFFER_SIZE     (1 << 16)
+static ssize_t ringStreamWrite(void *cookie, const char *buf, size_t size)
 {
-    intptr_t lo;
-    intptr_t hi;
-};
+    Ring *ring = (Ring *)cookie;
+    if (!ringWrite(*ring, buf, size))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return (ssize_t)size;
+}
+static int ringStreamClose(void *cookie)
+{
+    Ring *ring = (Ring *)cookie;
+    int peer = ring->peer;
+    ringClose(*ring, /*writer=*/true);
+    return close(peer);
+}
 
 /*
- * Disassembler desync information.
+ * Excluded locations.
  */
-struct Desync
+struct Exclude
 {
     intptr_t lo;
     intptr_t hi;
-    intptr_t addr;
-    const char *section;
-    uint8_t byte;
 };
 
 /*
  * Spawn e9patch backend instance.
  */
 static void spawnBackend(const char *prog,
-    const std::vector<const char *> &options, Backend &backend)
+    const std::vector<const char *> &options, bool binary, bool ring,
+    Backend &backend)
 {
     int fds[2];
     if (pipe(fds) != 0)
         error("failed to open pipe to backend process: %s", strerror(errno));
+    if (ring && !ringCreate(backend.ring, RING_SIZE_DEFAULT))
+    {
+        warning("failed to create shared-memory ring; falling back to the "
+            "pipe transport: %s", strerror(errno));
+        ring = false;
+    }
+    char ring_arg[32];
+    if (ring)
+        snprintf(ring_arg, sizeof(ring_arg), "--rpc-ring=%d",
+            backend.ring.fd);
     pid_t pid = fork();
     if (pid == 0)
     {
@@ -112,10 +148,14 @@ static void spawnBackend(const char *prog,
             error("failed to dup backend process pipe file descriptor "
                 "(%d): %s", fds[0], strerror(errno));
         close(fds[0]);
-        const char *argv[options.size() + 2];
+        const char *argv[options.size() + 4];
         prog = findBinary(prog, /*exe=*/true, /*dot=*/true);
         argv[0] = "e9patch";
         unsigned i = 1;
+        if (binary)
+            argv[i++] = "--rpc=binary";
+        if (ring)
+            argv[i++] = ring_arg;
         for (const char *option: options)
             argv[i++] = option;
         argv[i] = nullptr;
@@ -127,12 +167,25 @@ static void spawnBackend(const char *prog,
         error("failed to fork backend process: %s", strerror(errno));
 
     close(fds[0]);
-    FILE *out = fdopen(fds[1], "w");
+    FILE *out = nullptr;
+    if (ring)
+    {
+        // The pipe is kept open to detect if the backend dies.
+        backend.ring.peer = fds[1];
+        cookie_io_functions_t funcs =
+            {nullptr, ringStreamWrite, nullptr, ringStreamClose};
+        out = fopencookie(&backend.ring, "w", funcs);
+        if (out != nullptr)
+            setvbuf(out, nullptr, _IOFBF, RING_STREAM_BUFFER_SIZE);
+    }
+    else
+        out = fdopen(fds[1], "w");
     if (out == nullptr)
         error("failed to open backend process stream: %s", strerror(errno));
 
-    backend.out = out;
-    backend.pid = pid;
+    backend.out    = out;
+    backend.pid    = pid;
+    backend.binary = binary;
 }
 
 /*
@@ -188,10 +241,16 @@ Plugin *openPlugin(const char *basename)
     plugin->filename  = pathname;
     plugin->handle    = handle;
     plugin->context   = nullptr;
+    plugin->flags     = 0x0;
     plugin->result    = 0;
+    plugin->base      = 0;
     plugin->initFunc  = (PluginInit)dlsym(handle, "e9_plugin_init");
+    plugin->initThreadFunc =
+        (PluginInitThread)dlsym(handle, "e9_plugin_init_thread");
     plugin->eventFunc = (PluginEvent)dlsym(handle, "e9_plugin_event");
     plugin->matchFunc = (PluginMatch)dlsym(handle, "e9_plugin_match");
+    plugin->matchBatchFunc =
+        (PluginMatchBatch)dlsym(handle, "e9_plugin_match_batch");
     plugin->codeFunc  = (PluginCode)dlsym(handle, "e9_plugin_code");
     plugin->dataFunc  = (PluginData)dlsym(handle, "e9_plugin_data");
     plugin->patchFunc = (PluginPatch)dlsym(handle, "e9_plugin_patch");
@@ -199,7 +258,7 @@ Plugin *openPlugin(const char *basename)
     if (plugin->initFunc == nullptr && plugin->eventFunc == nullptr &&
             plugin->codeFunc == nullptr && plugin->dataFunc == nullptr &&
             plugin->matchFunc == nullptr && plugin->patchFunc == nullptr &&
-            plugin->finiFunc == nullptr)
+            plugin->finiFunc == nullptr && plugin->matchBatchFunc == nullptr)
         error("failed to load plugin \"%s\"; the shared "
             "object does not export any plugin API functions",
             plugin->filename);
@@ -239,7 +298,26 @@ static void notifyPlugins(FILE *out, const ELF *elf,
 }
 
 /*
- * Get the match value for all plugins.
+ * Test if the plugin is matched one instruction at a time.  Plugins that
+ * export e9_plugin_match_batch() are matched in batches instead.
+ */
+static bool isPerInstrPlugin(const Plugin *plugin)
+{
+    return (plugin->matchFunc != nullptr && plugin->matchBatchFunc == nullptr);
+}
+
+/*
+ * Test if the plugin is matched by the parallel matching threads, rather
+ * than serially (see PLUGIN_FLAG_REENTRANT).
+ */
+static bool isReentrantPlugin(const Plugin *plugin)
+{
+    return (isPerInstrPlugin(plugin) &&
+        (plugin->flags & PLUGIN_FLAG_REENTRANT) != 0);
+}
+
+/*
+ * Get the match value for all (per-instruction) plugins.
  */
 static void matchPlugins(FILE *out, const ELF *elf,
     const std::vector<Instr> &Is, size_t idx, const InstrInfo *I)
@@ -247,7 +325,7 @@ static void matchPlugins(FILE *out, const ELF *elf,
     for (auto i: plugins)
     {
         Plugin *plugin = i.second;
-        if (plugin->matchFunc == nullptr)
+        if (!isPerInstrPlugin(plugin))
             continue;
         Context cxt = {API_VERSION, STRING(VERSION), out, &plugin->argv,
             plugin->context, elf, &Is, (ssize_t)idx, I, -1};
@@ -255,6 +333,162 @@ static void matchPlugins(FILE *out, const ELF *elf,
     }
 }
 
+/*
+ * Invoke a plugin's batch match function.
+ */
+static void matchPluginBatch(FILE *out, const ELF *elf,
+    const std::vector<Instr> *Is, const Plugin *plugin, Batch batch)
+{
+    Context cxt = {API_VERSION, STRING(VERSION), out, &plugin->argv,
+        plugin->context, elf, Is, (ssize_t)batch.lo, nullptr, -1};
+    plugin->matchBatchFunc(&cxt, &batch);
+}
+
+/*
+ * Get the match values for all batch plugins for the instruction range
+ * [lo..hi).  Plugins that set PLUGIN_FLAG_PARALLEL are invoked in parallel
+ * over disjoint sub-ranges (see `--threads').
+ */
+static void matchPluginBatches(FILE *out, const ELF *elf,
+    const std::vector<Instr> &Is, size_t lo, size_t hi)
+{
+    bool found = false;
+    for (auto i: plugins)
+        found = found || (i.second->matchBatchFunc != nullptr);
+    if (!found || lo >= hi)
+        return;
+
+    size_t size = hi - lo;
+    std::vector<intptr_t> address(size);
+    std::vector<uint8_t> length(size);
+    std::vector<Mnemonic> mnemonic(size);
+    for (size_t idx = lo; idx < hi; idx++)
+    {
+        InstrInfo I;
+        decodeInstrInfo(elf, &Is[idx], &I, nullptr, INFO_BASIC);
+        address[idx - lo]  = I.address;
+        length[idx - lo]   = I.size;
+        mnemonic[idx - lo] = I.mnemonic;
+    }
+
+    for (auto i: plugins)
+    {
+        Plugin *plugin = i.second;
+        if (plugin->matchBatchFunc == nullptr)
+            continue;
+        plugin->base = lo;
+        plugin->results.resize(size);
+        size_t num_threads = ((plugin->flags & PLUGIN_FLAG_PARALLEL) != 0?
+            (size_t)std::max(option_threads, 1u): 1);
+        size_t n = (size + num_threads - 1) / num_threads;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t * n < size; t++)
+        {
+            size_t tlo = t * n, thi = std::min(tlo + n, size);
+            Batch batch = {lo + tlo, thi - tlo, address.data() + tlo,
+                length.data() + tlo, mnemonic.data() + tlo,
+                plugin->results.data() + tlo};
+            if (num_threads == 1)
+                matchPluginBatch(out, elf, &Is, plugin, batch);
+            else
+                threads.emplace_back(matchPluginBatch, out, elf, &Is, plugin,
+                    batch);
+        }
+        for (auto &thread: threads)
+            thread.join();
+    }
+}
+
+/*
+ * Get the match values for all plugins for the instruction range [lo..hi).
+ * The values are saved for use by parallel matching (see `--threads').
+ */
+static void matchPlugins(FILE *out, const ELF *elf,
+    const std::vector<Instr> &Is, size_t lo, size_t hi)
+{
+    matchPluginBatches(out, elf, Is, lo, hi);
+    bool found = false;
+    for (auto i: plugins)
+    {
+        Plugin *plugin = i.second;
+        if (!isPerInstrPlugin(plugin))
+            continue;
+        plugin->base = lo;
+        plugin->results.resize(hi - lo);
+        if (!isReentrantPlugin(plugin))
+        {
+            found = true;
+            continue;
+        }
+
+        // Reentrant plugins are matched by the matching threads, each
+        // using its own context:
+        while (plugin->contexts.size() < option_threads)
+        {
+            void *context = plugin->context;
+            if (plugin->initThreadFunc != nullptr)
+            {
+                Context cxt = {API_VERSION, STRING(VERSION), out,
+                    &plugin->argv, plugin->context, elf, &Is, -1, nullptr,
+                    -1};
+                context = plugin->initThreadFunc(&cxt);
+            }
+            plugin->contexts.push_back(context);
+        }
+    }
+    for (size_t idx = lo; found && idx < hi; idx++)
+    {
+        InstrInfo I;
+        getInstrInfo(elf, &Is[idx], &I);
+        for (auto i: plugins)
+        {
+            Plugin *plugin = i.second;
+            if (!isPerInstrPlugin(plugin) || isReentrantPlugin(plugin))
+                continue;
+            Context cxt = {API_VERSION, STRING(VERSION), out, &plugin->argv,
+                plugin->context, elf, &Is, (ssize_t)idx, &I, -1};
+            plugin->results[idx - lo] = plugin->matchFunc(&cxt);
+        }
+    }
+}
+
+/*
+ * Test if parallel matching is possible.
+ */
+static bool canMatchParallel(const std::vector<Action *> &actions)
+{
+    if (option_threads <= 1 || option_debug)
+        return false;
+    for (auto i: plugins)
+    {
+        const Plugin *plugin = i.second;
+        if ((plugin->matchFunc != nullptr ||
+                    plugin->matchBatchFunc != nullptr) &&
+                (plugin->flags & PLUGIN_FLAG_SERIAL) != 0)
+            return false;
+    }
+    for (const auto *action: actions)
+        if (!matchIsThreadSafe(action->match))
+            return false;
+    return true;
+}
+
+/*
+ * Get the InstrInfo tier needed before any action is evaluated.
+ */
+static unsigned getMatchTier(void)
+{
+    if (option_debug)
+        return INFO_ALL;
+    for (auto i: plugins)
+    {
+        const Plugin *plugin = i.second;
+        if (isPerInstrPlugin(plugin))
+            return INFO_ALL;
+    }
+    return INFO_BASIC;
+}
+
 /*
  * Initialize all plugins.
  */
@@ -266,7 +500,7 @@ static void initPlugins(FILE *out, const ELF *elf)
         if (plugin->initFunc == nullptr)
             continue;
         Context cxt = {API_VERSION, STRING(VERSION), out, &plugin->argv,
-            nullptr, elf, nullptr, -1, nullptr, -1};
+            nullptr, elf, nullptr, -1, nullptr, -1, &plugin->flags};
         plugin->context = plugin->initFunc(&cxt);
     }
 }
@@ -452,16 +686,88 @@ struct MatchingCache
     std::vector<const Matching *> matchings;
 };
 
+/*
+ * Action index.  Maps each mnemonic to the (ordered) list of candidate
+ * actions that may match it, based on each action's MatchFilter.
+ */
+struct ActionIndex
+{
+    std::map<const char *, std::vector<Action *>, CStrCmp> mnemonics;
+    std::vector<Action *> other;    // Candidates for all other mnemonics
+    bool check = true;              // Check filters?
+
+    const std::vector<Action *> &lookup(const InstrInfo *I) const
+    {
+        if (mnemonics.size() == 0)
+            return other;
+        auto i = mnemonics.find(I->string.mnemonic);
+        return (i == mnemonics.end()? other: i->second);
+    }
+};
+
+/*
+ * Build the action index.
+ */
+static void buildActionIndex(const std::vector<Action *> &actions,
+    ActionIndex &index)
+{
+    if (option_debug)
+    {
+        // Evaluate everything so the debug output is complete.
+        index.check = false;
+        index.other = actions;
+        return;
+    }
+    for (auto *action: actions)
+    {
+        if (action->filter.any)
+            continue;
+        for (const auto &mnemonic: action->filter.mnemonics)
+            index.mnemonics.insert({mnemonic.c_str(), {}});
+    }
+    for (auto *action: actions)
+    {
+        if (action->filter.any)
+        {
+            index.other.push_back(action);
+            for (auto &entry: index.mnemonics)
+                entry.second.push_back(action);
+            continue;
+        }
+        for (const auto &mnemonic: action->filter.mnemonics)
+            index.mnemonics[mnemonic.c_str()].push_back(action);
+    }
+    size_t filtered = 0;
+    for (auto *action: actions)
+        filtered += (!action->filter.any || action->filter.category != 0x0 ||
+            action->filter.size_lo != INTPTR_MIN ||
+            action->filter.size_hi != INTPTR_MAX ||
+            action->filter.addr_lo != INTPTR_MIN ||
+            action->filter.addr_hi != INTPTR_MAX);
+    debug("prefiltering %zu/%zu action(s) (%zu indexed mnemonics)",
+        filtered, actions.size(), index.mnemonics.size());
+}
+
 /*
  * Matching.
  */
-static void match(const std::vector<Action *> &actions, const ELF &elf,
-    const std::vector<Instr> &Is, size_t idx, const InstrInfo *I,
+static void match(const ActionIndex &index, const ELF &elf,
+    const std::vector<Instr> &Is, size_t idx, InstrInfo *I, unsigned &tier,
     std::vector<Action *> &matching)
 {
-    for (auto *action: actions)
+    for (auto *action: index.lookup(I))
     {
-        if (!matchEval(action->match, elf, Is, idx, I))
+        if (index.check && !action->filter.pass(I))
+            continue;
+        if (action->tier > tier)
+        {
+            tier = action->tier;
+            decodeInstrInfo(&elf, &Is[idx], I, nullptr, tier);
+        }
+        bool pass = (option_debug?
+            matchEval(action->match, elf, Is, idx, I):
+            matchEval(action->code, elf, Is, idx, I));
+        if (!pass)
             continue;
         matching.push_back(action);
     }
@@ -508,6 +814,145 @@ static size_t saveMatching(std::vector<Action *> &matching, const InstrInfo *I,
     return idx;
 }
 
+/*
+ * Parallel matching result (see `--threads').
+ */
+struct MatchResult
+{
+    const Matching *M;              // Thread-local matching, or nullptr
+    bool emit;                      // Emit instruction?
+};
+
+/*
+ * Get the match values for all reentrant plugins for the instruction range
+ * [lo..hi) using the contexts for thread `t'.
+ */
+static void matchReentrantPlugins(FILE *out, const ELF *elf,
+    const std::vector<Instr> *Is, size_t lo, size_t hi, size_t t)
+{
+    bool found = false;
+    for (auto i: plugins)
+        found = found || isReentrantPlugin(i.second);
+    for (size_t idx = lo; found && idx < hi; idx++)
+    {
+        InstrInfo I;
+        getInstrInfo(elf, &(*Is)[idx], &I);
+        for (auto i: plugins)
+        {
+            Plugin *plugin = i.second;
+            if (!isReentrantPlugin(plugin))
+                continue;
+            Context cxt = {API_VERSION, STRING(VERSION), out, &plugin->argv,
+                plugin->contexts[t], elf, Is, (ssize_t)idx, &I, -1};
+            plugin->results[idx - plugin->base] = plugin->matchFunc(&cxt);
+        }
+    }
+}
+
+/*
+ * Match the instruction range [lo..hi) using a thread-local cache.  Note
+ * that matchings are not validated here, this is done by the (serial)
+ * merge so that any error is deterministic.
+ */
+static void matchRange(FILE *out, const ActionIndex *index, const ELF *elf,
+    const std::vector<Instr> *Is, size_t lo, size_t hi, bool emit_jumps,
+    size_t t, MatchingCache *Ms, MatchResult *results)
+{
+    matchReentrantPlugins(out, elf, Is, lo, hi, t);
+    std::vector<Action *> matching;
+    for (size_t i = lo; i < hi; i++)
+    {
+        matching.clear();
+        InstrInfo I;
+        unsigned tier = INFO_BASIC;
+        decodeInstrInfo(elf, &(*Is)[i], &I, nullptr, tier);
+        match(*index, *elf, *Is, i, &I, tier, matching);
+        MatchResult &result = results[i - lo];
+        result.M    = nullptr;
+        result.emit = (emit_jumps && I.size >= /*sizeof(jmpq)=*/5 &&
+            ((I.category & CATEGORY_JUMP) != 0 ||
+             (I.category & CATEGORY_CALL) != 0));
+        if (matching.size() == 0)
+            continue;
+        Matching M(std::move(matching));
+        auto j = Ms->cache.find(&M);
+        if (j == Ms->cache.end())
+        {
+            Matching *N = new Matching(std::move(M.actions));
+            j = Ms->cache.insert({N, Ms->matchings.size()}).first;
+            Ms->matchings.push_back(N);
+        }
+        result.M = j->first;
+    }
+}
+
+/*
+ * Mark the instructions surrounding a patched instruction for emission.
+ */
+#define EMIT_RANGE                                                      \
+    (INT8_MAX + /*sizeof(short jmp)=*/2 + /*max instr. size=*/15)
+static void emitRange(std::vector<Instr> &Is, size_t i)
+{
+    size_t count = Is.size();
+    Is[i].emit = true;
+    size_t range = EMIT_RANGE;
+    for (ssize_t j = i; j >= 0; j--)
+    {
+        if (Is[i].address - Is[j].address > range)
+            break;
+        Is[j].emit = true;
+    }
+    for (size_t j = i + 1; j < count; j++)
+    {
+        if (Is[j].address - Is[i].address > range)
+            break;
+        Is[j].emit = true;
+    }
+}
+
+/*
+ * Mark all instructions of each basic block containing a patched instruction
+ * for emission (`--blocks').  E9Patch's T0 tactic then batches the block
+ * (from the entry to the last patched instruction) into a single trampoline
+ * that inlines the instrumentation of each patched instruction.
+ */
+static void emitBlocks(const ELF &elf, std::vector<Instr> &Is)
+{
+    for (const auto &bb: elf.bbs)
+    {
+        bool patch = false;
+        for (uint32_t i = bb.lb; !patch && i <= bb.ub; i++)
+            patch = Is[i].patch;
+        if (!patch)
+            continue;
+        for (uint32_t i = bb.lb; i <= bb.ub; i++)
+            Is[i].emit = true;
+    }
+}
+
+/*
+ * Send the pending run of emitted instructions Is[lo..hi] (binary RPC).
+ */
+static void sendInstructionRun(FILE *out, const ELF &elf,
+    const std::vector<Instr> &Is, ssize_t &lo, ssize_t hi)
+{
+    if (lo < 0)
+        return;
+    if (lo == hi)
+        sendInstructionRecord(out, Is[lo].address - elf.base, Is[lo].size,
+            Is[lo].offset);
+    else
+    {
+        static std::vector<uint8_t> sizes;
+        sizes.clear();
+        for (ssize_t j = lo; j <= hi; j++)
+            sizes.push_back((uint8_t)Is[j].size);
+        sendInstructionsRecord(out, Is[lo].address - elf.base, Is[lo].offset,
+            sizes.data(), sizes.size());
+    }
+    lo = -1;
+}
+
 /*
  * Exclusion.
  */
@@ -531,26 +976,341 @@ static size_t exclude(const std::vector<Exclude> &excludes, intptr_t addr)
 }
 
 /*
- * Next instruction.
+ * Next instruction.  Both the disassembly and the decoded addresses are
+ * sorted, so the cursor only moves forward (after an initial binary search
+ * at the start of each section).
  */
-static size_t nextInstr(const std::vector<intptr_t> &disasm, intptr_t addr)
+static size_t nextInstr(const Addrs &disasm, size_t &cursor, intptr_t addr)
 {
-    ssize_t max = (ssize_t)disasm.size() - 1;
-    if (disasm.size() == 0 || addr > disasm[max])
+    const intptr_t *end = disasm.data + disasm.size;
+    if (cursor > disasm.size || (cursor > 0 && disasm.data[cursor-1] >= addr))
+        cursor = std::lower_bound(disasm.data, end, addr) - disasm.data;
+    while (cursor < disasm.size && disasm.data[cursor] < addr)
+        cursor++;
+    if (cursor >= disasm.size)
         return INT32_MAX;
-    ssize_t lo = 0, hi = max;
-    while (lo <= hi)
+    return disasm.data[cursor] - addr;
+}
+
+/*
+ * Speculatively decoded section chunk (see `--threads').
+ */
+struct Chunk
+{
+    intptr_t lo;                    // Chunk start address
+    intptr_t hi;                    // Chunk end address
+    std::vector<Instr> Is;          // Decoded instructions
+    std::vector<int> scores;        // Suspiciousness scores
+    size_t cursor = 0;              // Stitching cursor
+};
+
+/*
+ * Decode a chunk.  Decoding starts at the chunk start address (which may
+ * not be an instruction boundary), and continues until the chunk end.  The
+ * decoder is always given the remainder of the section, so any instruction
+ * decoded at a given address is identical to the serial decoding.
+ */
+static void decodeChunk(const uint8_t *start, size_t section_size,
+    off_t section_offset, intptr_t section_addr, bool use_disasm,
+    Chunk *chunk)
+{
+    size_t skip       = (size_t)(chunk->lo - section_addr);
+    const uint8_t *code = start + skip;
+    size_t size       = section_size - skip;
+    off_t offset      = section_offset + (off_t)skip;
+    intptr_t address  = chunk->lo;
+    while (address < chunk->hi)
     {
-        ssize_t mid = (lo + hi) / 2;
-        intptr_t i = disasm[mid];
-        if (addr < i)
-            hi = mid-1;
-        else if (addr > i)
-            lo = mid+1;
+        Instr I;
+        const uint8_t *bytes = code;
+        if (!decode(&code, &size, &offset, &address, &I))
+            break;
+        chunk->Is.push_back(I);
+        chunk->scores.push_back(use_disasm? 0: suspiciousness(bytes, I.size));
+    }
+}
+
+/*
+ * Decode a section in parallel.
+ */
+static void decodeChunks(const uint8_t *start, size_t section_size,
+    off_t section_offset, intptr_t section_addr, bool use_disasm,
+    std::vector<Chunk> &chunks)
+{
+    chunks.clear();
+    size_t num_chunks = option_threads;
+    if (num_chunks <= 1 || section_size < num_chunks * CHUNK_SIZE_MIN)
+        return;
+    chunks.resize(num_chunks);
+    size_t chunk_size = section_size / num_chunks;
+    for (size_t i = 0; i < num_chunks; i++)
+    {
+        chunks[i].lo = section_addr + (intptr_t)(i * chunk_size);
+        chunks[i].hi = (i+1 == num_chunks?
+            section_addr + (intptr_t)section_size:
+            chunks[i].lo + (intptr_t)chunk_size);
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_chunks; i++)
+        threads.emplace_back(decodeChunk, start, section_size, section_offset,
+            section_addr, use_disasm, &chunks[i]);
+    for (auto &thread: threads)
+        thread.join();
+}
+
+/*
+ * Decode the next instruction, reusing the speculative chunk decoding if
+ * it is in sync with the serial decoding.  Otherwise, falls back to the
+ * serial decoder.
+ */
+static bool decode(std::vector<Chunk> &chunks, size_t &k,
+    const uint8_t **code, size_t *size, off_t *offset, intptr_t *address,
+    Instr *I, int *score, bool use_disasm)
+{
+    if (*size == 0)
+        return false;
+    for (; k < chunks.size(); k++)
+    {
+        Chunk &chunk = chunks[k];
+        while (chunk.cursor < chunk.Is.size() &&
+                (intptr_t)chunk.Is[chunk.cursor].address < *address)
+            chunk.cursor++;
+        if (chunk.cursor >= chunk.Is.size())
+            continue;
+        if ((intptr_t)chunk.Is[chunk.cursor].address != *address)
+            break;
+
+        // In sync:
+        *I     = chunk.Is[chunk.cursor];
+        *score = chunk.scores[chunk.cursor];
+        chunk.cursor++;
+        size_t len = I->size;
+        *code    += len;
+        *size     = (*size < len? 0: *size - len);
+        *offset  += len;
+        *address += len;
+        return true;
+    }
+
+    const uint8_t *bytes = *code;
+    if (!decode(code, size, offset, address, I))
+        return false;
+    *score = (use_disasm? 0: suspiciousness(bytes, I->size));
+    return true;
+}
+
+/*
+ * Disassembly configuration.
+ */
+struct DisasmConfig
+{
+    const ELF *elf;
+    const std::vector<Exclude> *excludes;
+    const Addrs *disasm;            // `--use-disasm' addresses
+    const char *disasm_filename;    // `--use-disasm' file, or nullptr
+    int sync;                       // `--Dsync'
+    int threshold;                  // `--Dthreshold'
+    bool plt;                       // `--plt'
+};
+
+/*
+ * Linear disassembly state.  A copy of the state is a checkpoint from which
+ * the disassembly can be resumed (see `--stream').
+ */
+struct DisasmState
+{
+    size_t s;                       // Section index (elf.exes)
+    const uint8_t *code;            // Next instruction bytes
+    size_t size;                    // Remaining section size
+    off_t offset;                   // Next instruction offset
+    intptr_t address;               // Next instruction address
+    size_t k;                       // Chunk index
+    size_t cursor;                  // `--use-disasm' cursor
+    int sync;                       // Sync counter
+    bool first;                     // Next instruction is first?
+    size_t desync;                  // Desyncs so far (`--stream')
+};
+
+/*
+ * Initialize the disassembly state for section `s'.  Returns false if the
+ * section should not be disassembled.
+ */
+static bool initDisasm(const DisasmConfig &D, size_t s, DisasmState &S)
+{
+    const ELF &elf        = *D.elf;
+    const Elf64_Shdr *shdr = elf.exes[s];
+    const char *section   = elf.strs + shdr->sh_name;
+    if (!D.plt &&
+            (strcmp(section, ".plt") == 0 ||
+             strcmp(section, ".plt.got") == 0 ||
+             strcmp(section, ".plt.sec") == 0))
+        return false;   // Exclude .plt.* by default
+    S.s       = s;
+    S.code    = elf.data + shdr->sh_offset;
+    S.size    = (size_t)shdr->sh_size;
+    S.offset  = (off_t)shdr->sh_offset;
+    S.address = (intptr_t)shdr->sh_addr;
+    S.k       = 0;
+    S.cursor  = SIZE_MAX;
+    S.sync    = 0;
+    S.first   = true;
+    S.desync  = 0;
+    return true;
+}
+
+/*
+ * Disassemble from state S, appending the instructions to Is, until the
+ * next instruction address is >= `stop'.  Returns true if stopped at `stop',
+ * or false if the end of the section was reached.
+ */
+static bool disassemble(const DisasmConfig &D, std::vector<Chunk> &chunks,
+    DisasmState &S, intptr_t stop, std::vector<Instr> &Is,
+    std::vector<Desync> &desyncs)
+{
+    const ELF &elf     = *D.elf;
+    bool use_disasm    = (D.disasm_filename != nullptr);
+    const Elf64_Shdr *shdr = elf.exes[S.s];
+    const char *section = elf.strs + shdr->sh_name;
+    while (true)
+    {
+        if (S.address >= stop)
+            return true;
+        size_t skip = exclude(*D.excludes, S.address);
+        if (use_disasm)
+            skip += nextInstr(*D.disasm, S.cursor, S.address + skip);
+        if (skip > 0)
+        {
+            S.address += skip;
+            S.offset  += skip;
+            S.size     = (skip > S.size? 0: S.size - skip);
+            S.code    += skip;
+            S.sync     = 0;
+            S.first    = true;
+        }
+
+        Instr I;
+        int score;
+        const uint8_t *bytes = S.code;
+        if (!decode(chunks, S.k, &S.code, &S.size, &S.offset, &S.address, &I,
+                &score, use_disasm))
+            break;
+        I.first = S.first;
+        S.first = false;
+
+        if (option_debug && !I.data)
+        {
+            InstrInfo J;
+            getInstrInfo(&elf, &I, &J);
+            debug("%s0x%lx%s: disassemble %s%s%s%s",
+                (option_is_tty? "\33[31m": ""),
+                J.address,
+                (option_is_tty? "\33[0m": ""),
+                (option_is_tty? "\33[32m": ""),
+                J.string.instr,
+                (option_is_tty? "\33[0m": ""),
+                (score >= D.threshold? " <data?>": ""));
+        }
+
+        if (I.data && use_disasm)
+            error("failed to decode instruction at address 0x%lx; "
+                "the \"%s\" disassmebly file may be inaccurate",
+                I.address, D.disasm_filename);
+
+        if (I.data || score >= D.threshold)
+        {
+            // Data has been detected in the code segment.  We attempt to
+            // handle this by nuking +/- D.sync instructions which
+            // may also be data.  This a very crude heuristic, so the
+            // user will be warned (below).
+            intptr_t lo = I.address, hi = lo + I.size;
+            for (int i = 0; Is.size() > 0 && i < D.sync; i++)
+            {
+                const Instr J = Is.back();
+                Is.pop_back();
+                lo = J.address;
+                if (J.first)
+                    break;
+                if (J.sus)
+                    i = 0;
+            }
+            if (desyncs.size() > 0 && lo <= desyncs.back().hi)
+                desyncs.back().hi = hi;
+            else if (S.sync >= 0)
+                desyncs.push_back({lo, hi, (intptr_t)I.address, section,
+                    *bytes});
+            S.sync = -D.sync;
+            continue;
+        }
+        I.sus = (score > 0);
+        if (++S.sync >= 0)
+            Is.push_back(I);
         else
-            return 0;
+        {
+            if (I.sus)
+                S.sync = -D.sync;
+            if (desyncs.size() > 0)
+                desyncs.back().hi = I.address + I.size;
+        }
+    }
+
+    const uint8_t *start = elf.data + shdr->sh_offset;
+    intptr_t section_addr = (intptr_t)shdr->sh_addr;
+    if (S.code < start + shdr->sh_size)
+        error("failed to disassemble the \"%s\" section 0x%lx..0x%lx; "
+            "could only disassemble the range 0x%lx..0x%lx",
+            section, section_addr, section_addr + shdr->sh_size,
+            section_addr, section_addr + (S.code - start));
+    return false;
+}
+
+/*
+ * Streaming: disassemble window `w' (see `--stream') and insert the
+ * instructions at the front of Is.  Here, `desyncs' are the desyncs found
+ * by the first pass.  Returns the number of instructions.
+ */
+static size_t loadWindow(const DisasmConfig &D,
+    const std::vector<DisasmState> &windows, size_t w,
+    const std::vector<Desync> &desyncs, std::vector<Instr> &Is)
+{
+    StatsTimer timer(stats, "disassembly");
+    DisasmState S = windows[w];
+    intptr_t start = S.address;
+    intptr_t stop = (w+1 < windows.size() && windows[w+1].s == S.s?
+        windows[w+1].address: INTPTR_MAX);
+    std::vector<Chunk> chunks;
+    std::vector<Desync> ignored;    // Already found by the first pass
+    std::vector<Instr> Js;
+    (void)disassemble(D, chunks, S, stop, Js, ignored);
+
+    // Desync recovery in the neighbouring windows may also remove
+    // instructions from this window, so all instructions covered by a desync
+    // (from the first pass) are dropped.  Only the last desync before this
+    // window, and the desyncs found while disassembling this window or the
+    // next window, can cover instructions in this window.
+    std::vector<const Desync *> overlaps;
+    size_t lo = (S.desync > 0? S.desync - 1: 0);
+    size_t hi = (w+2 < windows.size()? windows[w+2].desync: desyncs.size());
+    for (size_t i = lo; i < hi; i++)
+    {
+        if (desyncs[i].hi > start && desyncs[i].lo < stop)
+            overlaps.push_back(&desyncs[i]);
+    }
+    if (overlaps.size() > 0)
+    {
+        auto j = std::remove_if(Js.begin(), Js.end(),
+            [&overlaps](const Instr &I)
+            {
+                for (const auto *desync: overlaps)
+                    if ((intptr_t)I.address >= desync->lo &&
+                            (intptr_t)I.address < desync->hi)
+                        return true;
+                return false;
+            });
+        Js.erase(j, Js.end());
     }
-    return disasm[lo] - addr;
+
+    Is.insert(Is.begin(), Js.begin(), Js.end());
+    return Js.size();
 }
 
 /*
@@ -560,6 +1320,7 @@ struct Metadata
 {
     const Action * const action;
     size_t idx;
+    bool sample;                // Sampler (not patch) metadata?
 };
 
 /*
@@ -570,6 +1331,12 @@ static bool sendTrampoline(FILE *out, const Action *action, size_t idx,
 {
     const Patch *patch = action->patch[idx];
 
+    if (patch->sample > 0)
+    {
+        fprintf(out, "\"$SAMPLE@%s\",", patch->sampler+1);
+        metadata.push_back({action, idx, true});
+    }
+
     const Plugin *plugin = nullptr;
     if (patch->kind == PATCH_PLUGIN)
     {
@@ -588,6 +1355,8 @@ static bool sendTrampoline(FILE *out, const Action *action, size_t idx,
         if (patch->kind == PATCH_BREAK)
             return true;
     }
+    if (patch->sample > 0)
+        fprintf(out, "\".Lskip@%s\",", patch->sampler+1);
 
     bool found = false;
     switch (patch->kind)
@@ -597,11 +1366,12 @@ static bool sendTrampoline(FILE *out, const Action *action, size_t idx,
             if (plugin->patchFunc == nullptr)
                 break;
             // Fallthrough
-        case PATCH_PRINT: case PATCH_CALL:
+        case PATCH_PRINT: case PATCH_CALL: case PATCH_COUNT: case PATCH_COV:
+        case PATCH_LOG: case PATCH_HOOK:
             for (const auto &entry: metadata)
             {
                 const Patch *prev = entry.action->patch[entry.idx];
-                if (strcmp(prev->name, patch->name) == 0)
+                if (!entry.sample && strcmp(prev->name, patch->name) == 0)
                 {
                     found = true;
                     break;
@@ -609,7 +1379,7 @@ static bool sendTrampoline(FILE *out, const Action *action, size_t idx,
             }
             if (found)
                 break;
-            metadata.push_back({action, idx});
+            metadata.push_back({action, idx, false});
             break;
         default:
             break;
@@ -617,6 +1387,223 @@ static bool sendTrampoline(FILE *out, const Action *action, size_t idx,
     return false;
 }
 
+/*
+ * Find all matching instructions in the range [lo..hi).
+ */
+static void matchInstrs(FILE *out, const ELF &elf, std::vector<Instr> &Is,
+    size_t lo, size_t hi, const ActionIndex &index, bool parallel,
+    bool emit_jumps, unsigned tier0, MatchingCache &Ms)
+{
+    StatsTimer timer(stats, "matching");
+    std::vector<Action *> matching;
+    for (size_t i = lo; !parallel && i < hi; i++)
+    {
+        if ((i - lo) % MATCH_BLOCK_SIZE == 0)
+            matchPluginBatches(out, &elf, Is, i,
+                std::min(i + MATCH_BLOCK_SIZE, hi));
+        matching.clear();
+        InstrInfo I;
+        unsigned tier = tier0;
+        decodeInstrInfo(&elf, &Is[i], &I, nullptr, tier);
+        matchPlugins(out, &elf, Is, i, &I);
+        match(index, elf, Is, i, &I, tier, matching);
+        bool matched = (matching.size() > 0);
+        if (matched)
+        {
+            if (tier < INFO_ALL)
+                getInstrInfo(&elf, &Is[i], &I);
+            Is[i].patch    = true;
+            Is[i].matching = saveMatching(matching, &I, Ms);
+        }
+
+        debug("%s0x%lx%s: match %s%s%s%s",
+            (option_is_tty? "\33[31m": ""),
+            I.address,
+            (option_is_tty? "\33[0m": ""),
+            (matched && option_is_tty? "\33[32m": ""),
+            I.string.instr,
+            (matched && option_is_tty? "\33[0m": ""),
+            (matched && !option_is_tty? " (matched)": ""));
+
+        // Check which instructions to emit:
+        if (emit_jumps && I.size >= /*sizeof(jmpq)=*/5 &&
+                ((I.category & CATEGORY_JUMP) != 0 ||
+                 (I.category & CATEGORY_CALL) != 0))
+            Is[i].emit = true;
+        if (Is[i].patch)
+            emitRange(Is, i);
+    }
+    if (parallel)
+    {
+        // Parallel matching: Plugin match functions are still invoked
+        // serially (in order), except for reentrant plugins, and the
+        // thread-local matchings are merged in instruction order, so the
+        // result is identical to the serial matching (including the $tmp_N
+        // numbering).
+        size_t num_threads = option_threads;
+        std::vector<MatchingCache> caches(num_threads);
+        std::vector<MatchResult> results(MATCH_BLOCK_SIZE);
+        for (size_t blo = lo; blo < hi; blo += MATCH_BLOCK_SIZE)
+        {
+            size_t bhi = std::min(blo + MATCH_BLOCK_SIZE, hi);
+            matchPlugins(out, &elf, Is, blo, bhi);
+
+            size_t n = (bhi - blo + num_threads - 1) / num_threads;
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < num_threads && blo + t * n < bhi; t++)
+            {
+                size_t tlo = blo + t * n, thi = std::min(tlo + n, bhi);
+                threads.emplace_back(matchRange, out, &index, &elf, &Is,
+                    tlo, thi, emit_jumps, t, &caches[t],
+                    results.data() + (tlo - blo));
+            }
+            for (auto &thread: threads)
+                thread.join();
+
+            for (size_t i = blo; i < bhi; i++)
+            {
+                const MatchResult &result = results[i - blo];
+                if (result.emit)
+                    Is[i].emit = true;
+                if (result.M == nullptr)
+                    continue;
+                auto j = Ms.cache.find(result.M);
+                size_t idx;
+                if (j != Ms.cache.end())
+                    idx = j->second;
+                else
+                {
+                    InstrInfo I;
+                    getInstrInfo(&elf, &Is[i], &I);
+                    matching = result.M->actions;
+                    idx = saveMatching(matching, &I, Ms);
+                }
+                Is[i].patch    = true;
+                Is[i].matching = idx;
+                emitRange(Is, i);
+            }
+        }
+        for (auto &cache: caches)
+            for (const auto *M: cache.matchings)
+                delete M;
+    }
+    for (auto i: plugins)
+        i.second->results.clear();
+}
+
+/*
+ * Test if pipelined matching is possible, meaning that instructions are
+ * matched (in blocks) while the instructions & patches above them are
+ * sent, keeping E9Patch busy.  This requires that nothing depends on the
+ * complete matching, i.e., no plugins (EVENT_MATCHING_COMPLETE) and no
+ * per-site maps (sized by the total number of sites).
+ */
+static bool canPipeline(const std::vector<Action *> &actions)
+{
+    if (plugins.size() > 0)
+        return false;
+    for (const auto *action: actions)
+    {
+        for (const auto *patch: action->patch)
+        {
+            if (patch->kind == PATCH_COUNT || patch->kind == PATCH_COV ||
+                    patch->sample > 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Send the composite trampolines ($tmp_N) for all matchings not yet sent.
+ * The trampoline for matching N is sent as "$tmp_N", and metadatas[N] is
+ * the corresponding metadata.
+ */
+static void sendTrampolines(FILE *out, const ELF &elf,
+    const std::vector<Instr> &Is, const MatchingCache &Ms,
+    std::vector<std::vector<Metadata>> &metadatas)
+{
+    StatsTimer timer(stats, "metadata");
+    std::vector<Metadata> metadata;
+    Context cxt = {API_VERSION, STRING(VERSION), out, nullptr, nullptr, &elf,
+        &Is, -1, nullptr, -1};
+    for (size_t tid = metadatas.size(); tid < Ms.matchings.size(); tid++)
+    {
+        const Matching *M = Ms.matchings[tid];
+        sendMessageHeader(out, "trampoline");
+        sendParamHeader(out, "name");
+        fprintf(out, "\"$tmp_%zu\"", tid);
+        sendSeparator(out);
+        sendParamHeader(out, "template");
+        fputs("[\".Ltrampoline\",", out);
+
+        // BEFORE trampolines:
+        bool seen_break = false;
+        for (const auto *action: M->actions)
+        {
+            for (size_t j = 0, n = action->patch.size(); j < n; j++)
+            {
+                if (action->patch[j]->pos != POS_BEFORE || seen_break)
+                    continue;
+                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
+            }
+        }
+
+        // REPLACE trampoline:
+        bool seen_replace = false;
+        for (const auto *action: M->actions)
+        {
+            for (size_t j = 0, n = action->patch.size(); j < n; j++)
+            {
+                if (action->patch[j]->pos != POS_REPLACE || seen_break)
+                    continue;
+                seen_replace = true;
+                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
+            }
+        }
+        if (!seen_replace && !seen_break)
+            fprintf(out, "\"$instr\",");
+
+        // AFTER trampolines:
+        for (const auto *action: M->actions)
+        {
+            for (size_t j = 0, n = action->patch.size(); j < n; j++)
+            {
+                if (action->patch[j]->pos != POS_AFTER || seen_break)
+                    continue;
+                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
+            }
+        }
+        if (!seen_break)
+            fputs("\"$BREAK\",", out);
+
+        // DATA:
+        for (const auto &entry: metadata)
+        {
+            const Patch *patch = entry.action->patch[entry.idx];
+            if (entry.sample)
+                continue;
+            if (patch->kind == PATCH_PLUGIN)
+            {
+                const Plugin *plugin = patch->plugin;
+                if (plugin->dataFunc != nullptr)
+                {
+                    cxt.context = plugin->context;
+                    plugin->dataFunc(&cxt);
+                }
+            }
+            else
+                fprintf(out, "\"$DATA@%s\",", patch->name+1);
+        }
+        fputc(']', out);
+        sendSeparator(out, /*last=*/true);
+        sendMessageFooter(out, /*sync=*/true);
+
+        metadatas.emplace_back();
+        metadatas[tid].swap(metadata);
+    }
+}
+
 /*
  * Options.
  */
@@ -624,7 +1611,10 @@ enum Option
 {
     OPTION_100,
     OPTION_BACKEND,
+    OPTION_BLOCKS,
+    OPTION_CACHE_DIR,
     OPTION_CFR,
+    OPTION_COMPILE_CSV,
     OPTION_COMPRESSION,
     OPTION_DSYNC,
     OPTION_DTHRESHOLD,
@@ -634,22 +1624,33 @@ enum Option
     OPTION_EXECUTABLE,
     OPTION_FORMAT,
     OPTION_HELP,
+    OPTION_JOBS,
+    OPTION_LIVENESS,
+    OPTION_MANIFEST,
     OPTION_MATCH,
     OPTION_NO_WARNINGS,
     OPTION_PATCH,
+    OPTION_PIPELINE,
     OPTION_PLT,
     OPTION_PLUGIN,
     OPTION_OPTION,
     OPTION_OUTPUT,
+    OPTION_RPC,
+    OPTION_RPC_TRANSPORT,
     OPTION_SEED,
     OPTION_SHARED,
     OPTION_STATIC_LOADER,
+    OPTION_STATS,
+    OPTION_STREAM,
     OPTION_SYNTAX,
+    OPTION_THREADS,
+    OPTION_TLS,
     OPTION_TRAP,
     OPTION_TRAP_ALL,
     OPTION_USE_DISASM,
     OPTION_USE_TARGETS,
     OPTION_VERSION,
+    OPTION_WITH_LIBS,
 };
 
 /*
@@ -662,30 +1663,356 @@ struct ActionEntry
 };
 
 /*
- * Parse an integer from an optarg.
+ * Parse an integer from an optarg.
+ */
+static intptr_t parseIntOptArg(const char *option, const char *optarg,
+    intptr_t lb, intptr_t ub)
+{
+    const char *optarg_0 = optarg;
+    bool neg = (optarg[0] == '-');
+    if (neg)
+        optarg++;
+    int base = 10;
+    if (optarg[0] == '0' && optarg[1] == 'x')
+        base = 16;
+    errno = 0;
+    char *end = nullptr;
+    intptr_t r = (intptr_t)strtoul(optarg, &end, base);
+    r = (neg? -r: r);
+    if (errno != 0 || end == optarg ||
+            (end != nullptr && *end != '\0') || r < lb || r > ub)
+    {
+        error("failed to parse argument \"%s\" for the `%s' option; "
+            "expected a number within the range %zd..%zd", option,
+            optarg_0, lb, ub);
+    }
+    return r;
+}
+
+/*
+ * Batch mode job.
+ */
+struct BatchJob
+{
+    std::string input;              // Input binary
+    std::string output;             // Output binary ("" for default)
+    std::vector<std::string> options;
+                                    // Extra backend options
+};
+
+/*
+ * Parse a batch mode manifest.  Each line is of the form "INPUT [OUTPUT]",
+ * and blank lines and lines beginning with '#' are ignored.
+ */
+static void parseManifest(const char *filename, std::vector<BatchJob> &jobs)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        error("failed to open manifest file \"%s\": %s", filename,
+            strerror(errno));
+    char buf[BUFSIZ];
+    for (size_t lineno = 1; fgets(buf, sizeof(buf), stream) != nullptr;
+            lineno++)
+    {
+        char input[BUFSIZ], output[BUFSIZ], extra;
+        int n = sscanf(buf, " %s %s %c", input, output, &extra);
+        if (n <= 0 || input[0] == '#')
+            continue;
+        if (n > 2)
+            error("failed to parse manifest file \"%s\" at line %zu; "
+                "expected an \"INPUT [OUTPUT]\" pair", filename, lineno);
+        BatchJob job;
+        job.input = input;
+        if (n == 2)
+            job.output = output;
+        jobs.emplace_back(job);
+    }
+    fclose(stream);
+}
+
+/*
+ * Get the libraries needed by an ELF binary (DT_NEEDED), as well as the
+ * library search path (DT_RUNPATH or DT_RPATH).
+ */
+static void getNeeded(const ELF *elf, std::vector<std::string> &needed,
+    std::vector<std::string> &runpath)
+{
+    const Elf64_Shdr *shdr_dynamic = getELFSection(elf, ".dynamic");
+    const Elf64_Shdr *shdr_dynstr  = getELFSection(elf, ".dynstr");
+    if (shdr_dynamic == nullptr || shdr_dynstr == nullptr)
+        return;
+    const uint8_t *data = getELFData(elf);
+    size_t size = getELFDataSize(elf);
+    if (shdr_dynamic->sh_offset + shdr_dynamic->sh_size > size ||
+            shdr_dynstr->sh_offset + shdr_dynstr->sh_size > size)
+        error("failed to parse ELF file \"%s\"; invalid \".dynamic\" "
+            "section", getELFFilename(elf));
+    const Elf64_Dyn *dyns =
+        (const Elf64_Dyn *)(data + shdr_dynamic->sh_offset);
+    size_t num_dyns = shdr_dynamic->sh_size / sizeof(Elf64_Dyn);
+    const char *dynstr = (const char *)(data + shdr_dynstr->sh_offset);
+    size_t dynstr_len = shdr_dynstr->sh_size;
+
+    std::string origin(getELFFilename(elf));
+    size_t i = origin.rfind('/');
+    origin = (i == std::string::npos? ".": origin.substr(0, i));
+    const char *rpath = nullptr, *path = nullptr;
+    for (size_t i = 0; i < num_dyns && dyns[i].d_tag != DT_NULL; i++)
+    {
+        const Elf64_Dyn *dyn = dyns + i;
+        if (dyn->d_un.d_val >= dynstr_len)
+            continue;
+        const char *str = dynstr + dyn->d_un.d_val;
+        switch (dyn->d_tag)
+        {
+            case DT_NEEDED:
+                needed.push_back(str);
+                break;
+            case DT_RPATH:
+                rpath = str;
+                break;
+            case DT_RUNPATH:
+                path = str;
+                break;
+        }
+    }
+    path = (path == nullptr? rpath: path);
+    if (path == nullptr)
+        return;
+    std::string dir;
+    for (const char *str = path; ; str++)
+    {
+        if (*str != ':' && *str != '\0')
+        {
+            dir += *str;
+            continue;
+        }
+        size_t j = dir.find("$ORIGIN");
+        if (j != std::string::npos)
+            dir.replace(j, sizeof("$ORIGIN")-1, origin);
+        if (dir != "")
+            runpath.push_back(dir);
+        dir.clear();
+        if (*str == '\0')
+            break;
+    }
+}
+
+/*
+ * Joint mode: build a batch job for the executable and for each shared
+ * library it (transitively) depends on.  The dynamic linker itself is not
+ * rewritten.  Each job is assigned a disjoint trampoline address window,
+ * so that the binaries never compete for the same trampoline space.
+ */
+static void getJointJobs(const char *filename, const std::string &dir,
+    std::vector<BatchJob> &jobs)
+{
+    struct stat buf;
+    if (dir == "" || stat(dir.c_str(), &buf) != 0 || !S_ISDIR(buf.st_mode))
+        error("failed to parse command-line arguments; the `--output' or "
+            "`-o' option must name an existing directory for the "
+            "`--with-libs' option");
+
+    filename = findBinary(filename, /*exe=*/true, /*dot=*/true);
+    std::set<std::string> seen;
+    seen.insert(filename);
+    std::vector<std::pair<std::string, std::string>> queue;
+    queue.push_back({filename, ""});
+    std::string interp("");
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        const std::string input(queue[i].first), name(queue[i].second);
+        ELF *elf = parseELF(input.c_str());
+        if (i == 0)
+        {
+            for (size_t j = 0; j < elf->phnum; j++)
+            {
+                const Elf64_Phdr *phdr = elf->phdrs + j;
+                if (phdr->p_type != PT_INTERP ||
+                        phdr->p_offset + phdr->p_filesz > elf->size)
+                    continue;
+                char *path = realpath(
+                    (const char *)elf->data + phdr->p_offset, nullptr);
+                if (path != nullptr)
+                    interp = path;
+                free(path);
+            }
+        }
+        std::vector<std::string> needed, runpath;
+        getNeeded(elf, needed, runpath);
+        freeELF(elf);
+
+        // Libraries are named by their DT_NEEDED entry, so that the
+        // output directory can be used as the LD_LIBRARY_PATH.
+        BatchJob job;
+        job.input   = input;
+        job.output  = dir;
+        job.output += '/';
+        job.output += (name != ""? name: input.substr(input.rfind('/')+1));
+        jobs.emplace_back(job);
+
+        for (const auto &lib: needed)
+        {
+            const char *path = findLibrary(lib.c_str(), runpath);
+            if (path == nullptr)
+            {
+                warning("failed to find library \"%s\" needed by \"%s\"; "
+                    "the library will not be rewritten", lib.c_str(),
+                    input.c_str());
+                continue;
+            }
+            std::string pathname(path);
+            free((void *)path);
+            if (pathname == interp || !seen.insert(pathname).second)
+                continue;
+            queue.push_back({pathname, lib});
+        }
+    }
+
+    // Disjoint trampoline windows within rel32 range of the binary:
+    intptr_t window = (intptr_t)INT32_MAX / (intptr_t)jobs.size();
+    window -= window % PAGE_SIZE;
+    if (window < (intptr_t)(16 * PAGE_SIZE))
+        error("failed to allocate trampoline windows for %zu binaries; "
+            "too many binaries", jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        intptr_t lb = (intptr_t)i * window, ub = lb + window;
+        std::string option("--mem-lb=");
+        option += std::to_string(lb);
+        jobs[i].options.push_back(option);
+        option  = "--mem-ub=";
+        option += std::to_string(ub);
+        jobs[i].options.push_back(option);
+        debug("joint binary \"%s\" uses trampoline window [%p..%p]",
+            jobs[i].input.c_str(), (void *)lb, (void *)ub);
+    }
+}
+
+/*
+ * Get the backend statistics from a batch mode log file.
+ */
+static void getBatchStats(const char *filename, size_t &num_patched,
+    size_t &num_total)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        return;
+    char buf[BUFSIZ];
+    while (fgets(buf, sizeof(buf), stream) != nullptr)
+    {
+        size_t patched, total;
+        if (sscanf(buf, "num_patched = %zu / %zu", &patched, &total) != 2)
+            continue;
+        num_patched += patched;
+        num_total   += total;
+    }
+    fclose(stream);
+}
+
+/*
+ * Batch mode main loop.  The jobs are processed by a pool of worker
+ * processes, each forked from the current process.  This means that
+ * anything loaded before the call (plugins, call targets, etc.) is shared
+ * between all workers.  Returns the job in the worker process, and does
+ * not return in the parent process.
  */
-static intptr_t parseIntOptArg(const char *option, const char *optarg,
-    intptr_t lb, intptr_t ub)
+static const BatchJob &batchMain(std::vector<BatchJob> &jobs,
+    const std::string &dir, unsigned num_workers)
 {
-    const char *optarg_0 = optarg;
-    bool neg = (optarg[0] == '-');
-    if (neg)
-        optarg++;
-    int base = 10;
-    if (optarg[0] == '0' && optarg[1] == 'x')
-        base = 16;
-    errno = 0;
-    char *end = nullptr;
-    intptr_t r = (intptr_t)strtoul(optarg, &end, base);
-    r = (neg? -r: r);
-    if (errno != 0 || end == optarg ||
-            (end != nullptr && *end != '\0') || r < lb || r > ub)
+    bool is_dir = false;
+    struct stat buf;
+    if (dir != "" && stat(dir.c_str(), &buf) == 0)
+        is_dir = S_ISDIR(buf.st_mode);
+    for (auto &job: jobs)
     {
-        error("failed to parse argument \"%s\" for the `%s' option; "
-            "expected a number within the range %zd..%zd", option,
-            optarg_0, lb, ub);
+        if (job.output != "")
+            continue;
+        if (!is_dir)
+            error("failed to parse command-line arguments; the `--output' "
+                "or `-o' option must name an existing directory in batch "
+                "mode (missing output for binary \"%s\")",
+                job.input.c_str());
+        size_t i = job.input.rfind('/');
+        job.output  = dir;
+        job.output += '/';
+        job.output += (i == std::string::npos? job.input:
+            job.input.substr(i+1));
     }
-    return r;
+
+    std::map<pid_t, size_t> workers;
+    size_t next = 0, num_ok = 0, num_patched = 0, num_total = 0;
+    while (next < jobs.size() || workers.size() > 0)
+    {
+        if (next < jobs.size() && workers.size() < num_workers)
+        {
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid < 0)
+                error("failed to fork worker process: %s", strerror(errno));
+            if (pid == 0)
+            {
+                const BatchJob &job = jobs[next];
+                std::string log(job.output);
+                log += ".log";
+                int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    0644);
+                if (fd < 0)
+                    error("failed to open log file \"%s\": %s",
+                        log.c_str(), strerror(errno));
+                if (dup2(fd, STDOUT_FILENO) < 0 ||
+                        dup2(fd, STDERR_FILENO) < 0)
+                    error("failed to duplicate file descriptor: %s",
+                        strerror(errno));
+                close(fd);
+                option_is_tty = false;
+                return job;
+            }
+            workers.insert({pid, next++});
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error("failed to wait for worker process: %s", strerror(errno));
+        }
+        auto i = workers.find(pid);
+        if (i == workers.end())
+            continue;
+        const BatchJob &job = jobs[i->second];
+        workers.erase(i);
+        std::string log(job.output);
+        log += ".log";
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            num_ok++;
+            getBatchStats(log.c_str(), num_patched, num_total);
+            debug("rewrote binary \"%s\" into \"%s\"", job.input.c_str(),
+                job.output.c_str());
+        }
+        else if (WIFSIGNALED(status))
+            warning("failed to rewrite binary \"%s\"; worker process (%d) "
+                "killed by signal (%s), see \"%s\" for details",
+                job.input.c_str(), pid, strsignal(WTERMSIG(status)),
+                log.c_str());
+        else
+            warning("failed to rewrite binary \"%s\"; see \"%s\" for "
+                "details", job.input.c_str(), log.c_str());
+    }
+
+    printf("-----------------------------------------------\n");
+    printf("num_binaries          = %zu / %zu (%.2f%%)\n", num_ok,
+        jobs.size(), (double)num_ok / (double)jobs.size() * 100.0);
+    printf("num_patched           = %zu / %zu (%.2f%%)\n", num_patched,
+        num_total, (num_total == 0? 0.0:
+            (double)num_patched / (double)num_total * 100.0));
+    printf("-----------------------------------------------\n");
+    exit(num_ok == jobs.size()? EXIT_SUCCESS: EXIT_FAILURE);
 }
 
 /*
@@ -703,7 +2030,10 @@ int main_2(int argc, char **argv)
     {
         {"100",           no_arg,  nullptr, OPTION_100},
         {"backend",       req_arg, nullptr, OPTION_BACKEND},
+        {"blocks",        no_arg,  nullptr, OPTION_BLOCKS},
+        {"cache-dir",     req_arg, nullptr, OPTION_CACHE_DIR},
         {"CFR",           no_arg,  nullptr, OPTION_CFR},
+        {"compile-csv",   req_arg, nullptr, OPTION_COMPILE_CSV},
         {"compression",   req_arg, nullptr, OPTION_COMPRESSION},
         {"Dsync",         req_arg, nullptr, OPTION_DSYNC},
         {"Dthreshold",    req_arg, nullptr, OPTION_DTHRESHOLD},
@@ -713,43 +2043,65 @@ int main_2(int argc, char **argv)
         {"executable",    no_arg,  nullptr, OPTION_EXECUTABLE},
         {"format",        req_arg, nullptr, OPTION_FORMAT},
         {"help",          no_arg,  nullptr, OPTION_HELP},
+        {"jobs",          req_arg, nullptr, OPTION_JOBS},
+        {"liveness",      no_arg,  nullptr, OPTION_LIVENESS},
+        {"manifest",      req_arg, nullptr, OPTION_MANIFEST},
         {"match",         req_arg, nullptr, OPTION_MATCH},
         {"no-warnings",   no_arg,  nullptr, OPTION_NO_WARNINGS},
         {"patch",         req_arg, nullptr, OPTION_PATCH},
+        {"pipeline",      no_arg,  nullptr, OPTION_PIPELINE},
         {"plt",           no_arg,  nullptr, OPTION_PLT},
         {"plugin",        req_arg, nullptr, OPTION_PLUGIN},
         {"option",        req_arg, nullptr, OPTION_OPTION},
         {"output",        req_arg, nullptr, OPTION_OUTPUT},
+        {"rpc",           req_arg, nullptr, OPTION_RPC},
+        {"rpc-transport", req_arg, nullptr, OPTION_RPC_TRANSPORT},
         {"seed",          req_arg, nullptr, OPTION_SEED},
         {"shared",        no_arg,  nullptr, OPTION_SHARED},
         {"static-loader", no_arg,  nullptr, OPTION_STATIC_LOADER},
+        {"stats",         req_arg, nullptr, OPTION_STATS},
+        {"stream",        req_arg, nullptr, OPTION_STREAM},
         {"syntax",        req_arg, nullptr, OPTION_SYNTAX},
+        {"threads",       req_arg, nullptr, OPTION_THREADS},
+        {"tls",           req_arg, nullptr, OPTION_TLS},
         {"trap",          req_arg, nullptr, OPTION_TRAP},
         {"trap-all",      no_arg,  nullptr, OPTION_TRAP_ALL},
         {"use-disasm",    req_arg, nullptr, OPTION_USE_DISASM},
         {"use-targets",   req_arg, nullptr, OPTION_USE_TARGETS},
         {"version",       no_arg,  nullptr, OPTION_VERSION},
+        {"with-libs",     no_arg,  nullptr, OPTION_WITH_LIBS},
         {nullptr,         no_arg,  nullptr, 0}
     }; 
     option_is_tty = isatty(STDERR_FILENO);
     std::vector<const char *> option_options;
     unsigned option_compression_level = 9;
-    bool option_plt = false;
     char option_optimization_level = '2';
     bool option_executable = false, option_shared = false,
         option_static_loader = false;
     std::string option_backend("");
+    std::string option_cache_dir("");
+    std::string option_rpc("binary");
+    std::string option_rpc_transport("ring");
+    std::string option_stats("");
     std::set<intptr_t> option_trap;
     std::vector<std::string> option_match;
     std::vector<std::string> option_patch;
     std::vector<ActionEntry> option_actions;
     std::vector<std::string> option_exclude;
+    std::vector<std::string> option_compile_csv;
     std::string option_use_disasm("");
     std::string option_use_targets("");
     std::string option_use_funcs("");
     bool option_dump_all = false;
     int option_sync = 64, option_threshold = 2;
-    bool option_100 = false, option_CFR = false;
+    size_t option_tls = 0;
+    bool option_100 = false, option_CFR = false, option_blocks = false;
+    bool option_pipeline = false;
+    std::string option_manifest("");
+    bool option_with_libs = false;
+    size_t option_stream = 0;
+    unsigned option_jobs = (unsigned)std::max(sysconf(_SC_NPROCESSORS_ONLN),
+        1l);
     srand(0xe9e9e9e9);
     while (true)
     {
@@ -766,10 +2118,20 @@ int main_2(int argc, char **argv)
             case OPTION_BACKEND:
                 option_backend = optarg;
                 break;
+            case OPTION_BLOCKS:
+                option_targets = option_bbs = option_CFR =
+                    option_blocks = true;
+                break;
+            case OPTION_CACHE_DIR:
+                option_cache_dir = optarg;
+                break;
             case OPTION_CFR:
             case 'X':
                 option_CFR = true;
                 break;
+            case OPTION_COMPILE_CSV:
+                option_compile_csv.push_back(optarg);
+                break;
             case OPTION_COMPRESSION:
             case 'c':
                 option_compression_level = (unsigned)parseIntOptArg(
@@ -804,17 +2166,30 @@ int main_2(int argc, char **argv)
                         option_format != "patch" &&
                         option_format != "patch.gz" &&
                         option_format != "patch.bz2" &&
-                        option_format != "patch.xz")
+                        option_format != "patch.xz" &&
+                        option_format != "delta" &&
+                        option_format != "delta.gz")
                     error("bad value \"%s\" for `--format' option; "
                         "expected one of \"binary\", \"json\", \"patch\", "
-                        "\"patch.gz\", \"patch.bz2\", or \"patch.xz\"",
-                        optarg);
+                        "\"patch.gz\", \"patch.bz2\", \"patch.xz\", "
+                        "\"delta\", or \"delta.gz\"", optarg);
                 break;
             case OPTION_HELP:
             case 'h':
                 usage(stdout, argv[0]);
                 return EXIT_SUCCESS;
 
+            case OPTION_JOBS:
+                option_jobs = (unsigned)parseIntOptArg("--jobs", optarg, 1,
+                    1024);
+                break;
+            case OPTION_LIVENESS:
+                option_targets = option_bbs = option_fs =
+                    option_liveness = true;
+                break;
+            case OPTION_MANIFEST:
+                option_manifest = optarg;
+                break;
             case OPTION_OPTION:
                 option_options.push_back(optarg);
                 break;
@@ -843,6 +2218,9 @@ int main_2(int argc, char **argv)
                 option_patch.emplace_back(patch);
                 break;
             }
+            case OPTION_PIPELINE:
+                option_pipeline = true;
+                break;
             case OPTION_PLT:
                 option_plt = true;
                 break;
@@ -878,6 +2256,19 @@ int main_2(int argc, char **argv)
             case OPTION_NO_WARNINGS:
                 option_no_warnings = true;
                 break;
+            case OPTION_RPC:
+                option_rpc = optarg;
+                if (option_rpc != "json" && option_rpc != "binary")
+                    error("bad value \"%s\" for `--rpc' option; "
+                        "expected \"json\" or \"binary\"", optarg);
+                break;
+            case OPTION_RPC_TRANSPORT:
+                option_rpc_transport = optarg;
+                if (option_rpc_transport != "pipe" &&
+                        option_rpc_transport != "ring")
+                    error("bad value \"%s\" for `--rpc-transport' option; "
+                        "expected \"pipe\" or \"ring\"", optarg);
+                break;
             case OPTION_SEED:
             {
                 unsigned long r = (unsigned long)parseIntOptArg("--seed",
@@ -894,6 +2285,14 @@ int main_2(int argc, char **argv)
             case 's':
                 option_static_loader = true;
                 break;
+            case OPTION_STATS:
+                option_stats = optarg;
+                stats.enable();
+                break;
+            case OPTION_STREAM:
+                option_stream = (size_t)parseIntOptArg("--stream", optarg,
+                    64, INTPTR_MAX);
+                break;
             case OPTION_SYNTAX:
                 if (strcmp(optarg, "ATT") == 0)
                     option_intel_syntax = false;
@@ -903,6 +2302,14 @@ int main_2(int argc, char **argv)
                     error("bad value \"%s\" for `--syntax' option; "
                         "expected \"ATT\" or \"intel\"", optarg);
                 break;
+            case OPTION_THREADS:
+                option_threads = (unsigned)parseIntOptArg("--threads", optarg,
+                    1, 1024);
+                break;
+            case OPTION_TLS:
+                option_tls = (size_t)parseIntOptArg("--tls", optarg, 1,
+                    E9_TLS_MAX);
+                break;
             case OPTION_TRAP:
             {
                 errno = 0;
@@ -927,13 +2334,50 @@ int main_2(int argc, char **argv)
             case OPTION_VERSION:
                 puts("E9Tool " STRING(VERSION));
                 return EXIT_SUCCESS;
+            case OPTION_WITH_LIBS:
+                option_with_libs = true;
+                break;
             default:
                 error("failed to parse command-line options; try `--help' "
                     "for more information");
                 return EXIT_FAILURE;
         }
     }
-    if (optind != argc-1)
+    for (const auto &filename: option_compile_csv)
+        compileCSV(filename.c_str());
+    std::vector<BatchJob> option_batch;
+    if (option_manifest != "")
+        parseManifest(option_manifest.c_str(), option_batch);
+    if (option_with_libs)
+    {
+        if (option_manifest != "" || optind != argc-1)
+            error("failed to parse command-line arguments; the "
+                "`--with-libs' option expects exactly one input executable");
+        if (option_shared || option_executable)
+            error("failed to parse command-line arguments; the "
+                "`--with-libs' option cannot be used with the `--shared' or "
+                "`--executable' options");
+        getJointJobs(argv[optind], option_output, option_batch);
+    }
+    else if (option_manifest != "" || optind < argc-1)
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            BatchJob job;
+            job.input = argv[i];
+            option_batch.emplace_back(job);
+        }
+        if (option_batch.size() == 0)
+            error("missing input file; the manifest \"%s\" is empty",
+                option_manifest.c_str());
+    }
+    if (option_compile_csv.size() > 0 && optind == argc &&
+            option_batch.size() == 0)
+        return EXIT_SUCCESS;
+    if (option_batch.size() > 0 && option_stats != "")
+        error("failed to parse command-line arguments; the `--stats' option "
+            "cannot be used in batch mode");
+    if (option_batch.size() == 0 && optind != argc-1)
     {
         error("missing input file; try `--help' for more information");
         return EXIT_FAILURE;
@@ -958,11 +2402,54 @@ int main_2(int argc, char **argv)
             "and `--executable' options cannot be used at the same time");
 
     /*
-     * Parse the ELF file.
+     * Batch mode: parse the match/patch pairs once against the first
+     * binary.  This loads all plugins and call targets, which are then shared
+     * by the worker processes (forked below).  Each worker re-parses the
+     * match/patch pairs against its own binary, since symbols are resolved
+     * at parse time.
      */
-    const char *filename = argv[optind];
+    const char *filename = (option_batch.size() > 0?
+        option_batch[0].input.c_str(): argv[optind]);
     bool exe = (option_executable? true:
                (option_shared? false: !isLibraryFilename(filename)));
+    if (option_batch.size() > 0)
+    {
+        filename = findBinary(filename, exe, /*dot=*/true);
+        ELF *first = parseBinary(filename);
+        for (const auto &entry: option_actions)
+        {
+            for (const auto &str: entry.match)
+                (void)parseMatch(*first, str.c_str());
+            for (const auto &str: entry.patch)
+            {
+                const Patch *P = parsePatch(*first, str.c_str());
+                if (P->filename != nullptr)
+                    loadCallTarget(P->filename);
+            }
+        }
+        for (auto &entry: option_plugin)
+        {
+            if (entry.first != nullptr)
+                error("failed to find plugin \"%s\" for `--plugin=%s:%s'",
+                    entry.first, entry.first, entry.second);
+        }
+
+        const BatchJob &job = batchMain(option_batch, option_output,
+            option_jobs);
+        filename = job.input.c_str();
+        option_output = job.output;
+        for (size_t i = 0; i < job.options.size(); i++)
+            option_options.insert(option_options.begin() + i,
+                job.options[i].c_str());
+        exe = (option_executable? true:
+              (option_shared? false: !isLibraryFilename(filename)));
+        if (option_with_libs)
+            exe = (&job == &option_batch[0]);
+    }
+
+    /*
+     * Parse the ELF file.
+     */
     filename = findBinary(filename, exe, /*dot=*/true);
     ELF &elf = *parseBinary(filename);
 
@@ -991,7 +2478,8 @@ int main_2(int argc, char **argv)
             if (P->kind == PATCH_BREAK)
                 break;
         }
-        Action *action = new Action(match, std::move(patch));
+        Action *action = new Action(match, matchCompile(match),
+            matchFilter(match), matchTier(match), std::move(patch));
         actions.push_back(action);
     }
     option_actions.clear();
@@ -1062,7 +2550,8 @@ int main_2(int argc, char **argv)
     if (option_format == "json")
     {
         // Pseudo-backend:
-        backend.pid = 0;
+        backend.pid    = 0;
+        backend.binary = false;
         if (option_output == "-")
             backend.out = stdout;
         else
@@ -1085,7 +2574,8 @@ int main_2(int argc, char **argv)
             getExePath(option_backend);
             option_backend += "e9patch";
         }
-        spawnBackend(option_backend.c_str(), options, backend);
+        spawnBackend(option_backend.c_str(), options, option_rpc == "binary",
+            option_rpc_transport == "ring", backend);
     }
     FILE *out = backend.out;
 
@@ -1153,6 +2643,7 @@ int main_2(int argc, char **argv)
             options.push_back("-Oprologue-size=0");
             options.push_back("-Oepilogue=32");
             options.push_back("-Oepilogue-size=64");
+            options.push_back("-Oadaptive=true");
             options.push_back("-Oorder=true");
             options.push_back("-Opeephole=true");
             options.push_back("-Oscratch-stack=true");
@@ -1164,6 +2655,7 @@ int main_2(int argc, char **argv)
             options.push_back("-Oprologue-size=512");
             options.push_back("-Oepilogue=64");
             options.push_back("-Oepilogue-size=512");
+            options.push_back("-Oadaptive=true");
             options.push_back("-Oorder=true");
             options.push_back("-Opeephole=true");
             options.push_back("-Oscratch-stack=true");
@@ -1202,7 +2694,10 @@ int main_2(int argc, char **argv)
     /*
      * Send trampoline definitions:
      */
-    bool have_print = false, have_empty = false, have_trap = false;
+    bool have_print = false, have_empty = false, have_trap = false,
+        have_shadow = false;
+    size_t tls_size = (option_tls + sizeof(uint64_t) - 1) &
+        ~(sizeof(uint64_t) - 1);
     std::set<const char *, CStrCmp> have_call;
     std::set<int> have_exit, have_sig;
     for (auto *action: actions)
@@ -1217,6 +2712,59 @@ int main_2(int argc, char **argv)
                 case PATCH_EMPTY:
                     have_empty = true;
                     break;
+                case PATCH_COUNT: case PATCH_COV:
+                    sendCounterTrampolineMessage(out, patch->name,
+                        (patch->kind == PATCH_COV), patch->lea);
+                    break;
+                case PATCH_LOG:
+                {
+                    // Allocate the ring buffer in the per-thread block:
+                    size_t len = sizeof(uint64_t) + patch->entries *
+                        getLogRecordSize(patch->args.size(), patch->tsc);
+                    patch->buf = (intptr_t)tls_size;
+                    tls_size += len;
+                    debug("reserved log buffer for \"%s\" at %%gs:0x%lx "
+                        "(%zu bytes)", patch->name,
+                        patch->buf + E9_TLS_DATA, len);
+                    if (patch->filename != nullptr)
+                    {
+                        const Call &call = makeCall(&elf, patch->filename,
+                            patch->entry, ABI_NAKED, JUMP_NONE, patch->pos,
+                            {}, false, false, false);
+                        sendELFFileMessage(out, call.target);
+                        patch->func = getSymbol(call.target, patch->entry);
+                        if (patch->func < 0 || patch->func > INT32_MAX)
+                            error("failed to find log function \"%s\" in "
+                                "binary \"%s\"", patch->entry,
+                                patch->filename);
+                    }
+                    sendLogTrampolineMessage(out, patch->name);
+                    break;
+                }
+                case PATCH_HOOK:
+                {
+                    // Allocate the shadow stack in the per-thread block:
+                    size_t len = getHookStackSize(patch->entries);
+                    patch->buf = (intptr_t)tls_size;
+                    tls_size += len;
+                    debug("reserved shadow stack for \"%s\" at %%gs:0x%lx "
+                        "(%zu bytes)", patch->name,
+                        patch->buf + E9_TLS_DATA, len);
+                    const Call &call = makeCall(&elf, patch->filename,
+                        patch->entry, ABI_NAKED, JUMP_NONE, patch->pos,
+                        {}, false, false, false);
+                    sendELFFileMessage(out, call.target);
+                    patch->func = getSymbol(call.target, patch->entry);
+                    if (patch->func < 0 || patch->func > INT32_MAX)
+                        error("failed to find hook function \"%s\" in "
+                            "binary \"%s\"", patch->entry, patch->filename);
+                    patch->map = allocAddress(PAGE_SIZE);
+                    sendHookTrampolineMessage(out, patch->name, patch->map,
+                        patch->buf, patch->func);
+                    debug("reserved return trampoline for \"%s\" at address "
+                        "0x%lx", patch->name, patch->map);
+                    break;
+                }
                 case PATCH_TRAP:
                     have_trap = true;
                     break;
@@ -1249,8 +2797,12 @@ int main_2(int argc, char **argv)
                     for (const auto &arg: patch->args)
                         sig.push_back(arg.kind);
                     const Call &call = makeCall(&elf, patch->filename,
-                        patch->entry, patch->abi, patch->jmp, patch->pos, sig);
+                        patch->entry, patch->abi, patch->jmp, patch->pos, sig,
+                        patch->flags, patch->inl, !patch->guard.empty());
                     patch->call = &call;
+                    for (const auto &test: patch->guard)
+                        have_shadow = have_shadow || test.lhs_shadow ||
+                            test.rhs_shadow;
 
                     // Step (2): Create the trampoline:
                     auto j = have_call.find(patch->name);
@@ -1272,130 +2824,134 @@ int main_2(int argc, char **argv)
         sendPrintTrampolineMessage(out, elf.type);
     if (have_trap)
         sendTrapTrampolineMessage(out);
+    if (tls_size > E9_TLS_MAX)
+        error("failed to reserve the per-thread block; the size (%zu bytes) "
+            "exceeds the maximum (%u bytes)", tls_size, E9_TLS_MAX);
+    if (tls_size > 0)
+        sendReserveTLSMessage(out, tls_size);
+    if (have_shadow)
+    {
+        // Reserve the (zero-filled) shadow memory for shadow(...) guards:
+        sendReserveZeroMessage(out, SHADOW_BASE, SHADOW_SIZE,
+            PROT_READ | PROT_WRITE, /*absolute=*/true);
+        debug("reserved shadow memory at address 0x%lx..0x%lx",
+            (intptr_t)SHADOW_BASE, (intptr_t)(SHADOW_BASE + SHADOW_SIZE));
+    }
+
+    /*
+     * Streaming mode requires that nothing depends on the complete set of
+     * instructions.
+     */
+    if (option_stream > 0)
+    {
+        if (!canPipeline(actions))
+            error("failed to parse command-line arguments; the `--stream' "
+                "option cannot be used with plugins or per-site maps "
+                "(counters, coverage or sampling)");
+        if (option_targets || option_bbs || option_fs || option_liveness ||
+                option_dump_all)
+            error("failed to parse command-line arguments; the `--stream' "
+                "option cannot be used with control-flow analysis (e.g., "
+                "basic block or function attributes, `--liveness' or "
+                "`--dump-all')");
+        if (option_cache_dir != "")
+            error("failed to parse command-line arguments; the `--stream' "
+                "and `--cache-dir' options cannot be used at the same time");
+    }
 
     /*
      * Disassemble the ELF file.
      */
-    std::vector<intptr_t> disasm;
+    Addrs disasm;
     bool use_disasm = false;
     if (option_use_disasm != "")
     {
         parseAddrs(option_use_disasm.c_str(), disasm);
         use_disasm = true;
     }
+    StatsTimer disasm_timer(stats, "disassembly");
     initDisassembler();
     std::vector<Instr> Is;
     std::vector<Desync> desyncs;
+    std::vector<Chunk> chunks;
+    uint64_t cache_key = CACHE_HASH_INIT;
+    unsigned cache_flags = 0x0;
+    bool cached = false;
+    if (option_cache_dir != "")
+    {
+        // The key covers the binary and all options affecting step (1).
+        cache_key = hashData(cache_key, elf.data, elf.size);
+        cache_key = hashData(cache_key, excludes.data(),
+            excludes.size() * sizeof(Exclude));
+        cache_key = hashData(cache_key, disasm.data,
+            disasm.size * sizeof(intptr_t));
+        int params[] = {option_sync, option_threshold, (int)option_plt,
+            (int)use_disasm};
+        cache_key = hashData(cache_key, params, sizeof(params));
+        cached = loadCache(option_cache_dir.c_str(), cache_key, elf, Is,
+            desyncs, cache_flags);
+        if (cached && option_use_targets != "")
+        {
+            elf.targets.clear();
+            elf.bbs.clear();
+            elf.fs.clear();
+            cache_flags = 0x0;
+        }
+    }
     // Step (1): Find the locations of all instructions:
-    for (const auto *shdr: elf.exes)
-    {
-        const char *section   = elf.strs + shdr->sh_name;
-        if (!option_plt &&
-                (strcmp(section, ".plt") == 0 ||
-                 strcmp(section, ".plt.got") == 0 ||
-                 strcmp(section, ".plt.sec") == 0))
-            continue;   // Exclude .plt.* by default
-        size_t section_size   = (size_t)shdr->sh_size;
-        off_t section_offset  = (off_t)shdr->sh_offset;
-        intptr_t section_addr = (intptr_t)shdr->sh_addr;
-
-        const uint8_t *start = elf.data + section_offset;
-        const uint8_t *code  = start, *end = start + section_size;
-        size_t size          = section_size;
-        off_t offset         = section_offset;
-        intptr_t address     = section_addr;
-
-        int sync = 0;
-        bool first = true;
-        while (true)
+    DisasmConfig D = {&elf, &excludes, &disasm,
+        (use_disasm? option_use_disasm.c_str(): nullptr), option_sync,
+        option_threshold, option_plt};
+    std::vector<DisasmState> windows;
+    for (size_t s = 0; !cached && s < elf.exes.size(); s++)
+    {
+        DisasmState S;
+        if (!initDisasm(D, s, S))
+            continue;
+        if (option_stream == 0)
         {
-            size_t skip = exclude(excludes, address);
-            skip += (use_disasm? nextInstr(disasm, address + skip): 0);
-            if (skip > 0)
-            {
-                address += skip;
-                offset  += skip;
-                size     = (skip > size? 0: size - skip);
-                code    += skip;
-                sync     = 0;
-                first    = true;
-            }
-
-            Instr I;
-            const uint8_t *bytes = code;
-            if (!decode(&code, &size, &offset, &address, &I))
-                break;
-            I.first = first;
-            first = false;
-
-            int score = (use_disasm? 0: suspiciousness(bytes, I.size));
-            if (option_debug && !I.data)
-            {
-                InstrInfo J;
-                getInstrInfo(&elf, &I, &J);
-                debug("%s0x%lx%s: disassemble %s%s%s%s",
-                    (option_is_tty? "\33[31m": ""),
-                    J.address,
-                    (option_is_tty? "\33[0m": ""),
-                    (option_is_tty? "\33[32m": ""),
-                    J.string.instr,
-                    (option_is_tty? "\33[0m": ""),
-                    (score >= option_threshold? " <data?>": ""));
-            }
-
-            if (I.data && use_disasm)
-                error("failed to decode instruction at address 0x%lx; "
-                    "the \"%s\" disassmebly file may be inaccurate",
-                    I.address, option_use_disasm.c_str());
+            const Elf64_Shdr *shdr = elf.exes[s];
+            decodeChunks(elf.data + shdr->sh_offset, (size_t)shdr->sh_size,
+                (off_t)shdr->sh_offset, (intptr_t)shdr->sh_addr, use_disasm,
+                chunks);
+            (void)disassemble(D, chunks, S, INTPTR_MAX, Is, desyncs);
+            continue;
+        }
 
-            if (I.data || score >= option_threshold)
-            {
-                // Data has been detected in the code segment.  We attempt to
-                // handle this by nuking +/- option_sync instructions which
-                // may also be data.  This a very crude heuristic, so the
-                // user will be warned (below).
-                intptr_t lo = I.address, hi = lo + I.size;
-                for (int i = 0; Is.size() > 0 && i < option_sync; i++)
-                {
-                    const Instr J = Is.back();
-                    Is.pop_back();
-                    lo = J.address;
-                    if (J.first)
-                        break;
-                    if (J.sus)
-                        i = 0;
-                }
-                if (desyncs.size() > 0 && lo <= desyncs.back().hi)
-                    desyncs.back().hi = hi;
-                else if (sync >= 0)
-                    desyncs.push_back({lo, hi, (intptr_t)I.address, section,
-                        *bytes});
-                sync = -option_sync;
-                continue;
-            }
-            I.sus = (score > 0);
-            if (++sync >= 0)
-                Is.push_back(I);
-            else
-            {
-                if (I.sus)
-                    sync = -option_sync;
-                desyncs.back().hi = I.address + I.size;
-            }
+        // Streaming: only record the window checkpoints, and the
+        // instructions are disassembled again (by window) below.  The
+        // previous window is kept, since desync recovery may remove
+        // instructions from before the window boundary, exactly as without
+        // streaming.
+        size_t prev = 0;
+        do
+        {
+            S.desync = desyncs.size();
+            windows.push_back(S);
+            Is.erase(Is.begin(), Is.begin() + prev);
+            prev = Is.size();
         }
-        if (code < end)
-            error("failed to disassemble the \"%s\" section 0x%lx..0x%lx; "
-                "could only disassemble the range 0x%lx..0x%lx",
-                section, section_addr, section_addr + section_size,
-                section_addr, section_addr + (code - start));
+        while (disassemble(D, chunks, S, S.address + option_stream, Is,
+            desyncs));
+        Is.clear();
     }
-    disasm.clear();
+    size_t window = windows.size();     // Next window to load (+1)
+    while (Is.size() == 0 && window > 0)
+        (void)loadWindow(D, windows, --window, desyncs, Is);
+    if (option_stream > 0)
+        debug("streaming %zu window(s) of %zu bytes", windows.size(),
+            option_stream);
+    else
+        disasm = Addrs();   // Still needed for streaming
+    chunks.clear();
     Is.shrink_to_fit();
+    disasm_timer.stop();
     notifyPlugins(out, &elf, Is, EVENT_DISASSEMBLY_COMPLETE);
     size_t count = Is.size();
 
     // Step (1a): CFG Analysis (if necessary).
-    if (option_targets)
+    StatsTimer cfg_timer(stats, "cfg");
+    if (option_targets && (cache_flags & CACHE_TARGETS) == 0)
     {
         if (option_use_targets != "")
             parseTargets(option_use_targets.c_str(), Is.data(), Is.size(),
@@ -1403,168 +2959,177 @@ int main_2(int argc, char **argv)
         else
             buildTargets(&elf, Is.data(), Is.size(), elf.targets);
     }
-    if (option_bbs)
+    if (option_bbs && (cache_flags & CACHE_BBS) == 0)
         buildBBs(&elf, Is.data(), Is.size(), elf.targets, elf.bbs);
-    if (option_fs)
+    if (option_fs && (cache_flags & CACHE_FS) == 0)
         buildFs(&elf, Is.data(), Is.size(), elf.targets, elf.fs);
+    if (option_liveness)
+        buildLiveness(&elf, Is.data(), Is.size(), elf.bbs, elf.fs, elf.live);
+    if (option_cache_dir != "")
+    {
+        // Note: targets from `--use-targets' are never cached.
+        unsigned flags = (option_use_targets != ""? 0x0:
+            (option_targets? CACHE_TARGETS: 0x0) |
+            (option_bbs?     CACHE_BBS:     0x0) |
+            (option_fs?      CACHE_FS:      0x0));
+        if (!cached || (flags & ~cache_flags) != 0)
+            saveCache(option_cache_dir.c_str(), cache_key, elf, Is,
+                desyncs, cache_flags | flags);
+    }
     if (option_dump_all)
         dumpInfo(option_output, Is.data(), Is.size(), elf.targets,
             elf.bbs, elf.fs);
+    cfg_timer.stop();
 
     // Step (2): Find all matching instructions:
-    std::vector<Action *> matching;
     MatchingCache Ms;
-    for (size_t i = 0; i < count; i++)
+    bool emit_jumps = false;
+    switch (option_optimization_level)
     {
-        matching.clear();
-        InstrInfo I;
-        getInstrInfo(&elf, &Is[i], &I);
-        matchPlugins(out, &elf, Is, i, &I);
-        match(actions, elf, Is, i, &I, matching);
-        bool matched = (matching.size() > 0);
-        if (matched)
-        {
-            Is[i].patch    = true;
-            Is[i].matching = saveMatching(matching, &I, Ms);
-        }
-
-        debug("%s0x%lx%s: match %s%s%s%s",
-            (option_is_tty? "\33[31m": ""),
-            I.address,
-            (option_is_tty? "\33[0m": ""),
-            (matched && option_is_tty? "\33[32m": ""),
-            I.string.instr,
-            (matched && option_is_tty? "\33[0m": ""),
-            (matched && !option_is_tty? " (matched)": ""));
+        case '2': case '3': case 's':
+            emit_jumps = true;   // Always emits jump/calls for -Opeephole
+            break;
+    }
+    ActionIndex index;
+    buildActionIndex(actions, index);
+    bool parallel = canMatchParallel(actions);
+    unsigned tier0 = getMatchTier();
+    bool pipeline = (option_pipeline || option_stream > 0) &&
+        canPipeline(actions) && !option_blocks;
+    size_t matched = count;     // Instructions [matched..count) are matched
+    if (!pipeline)
+    {
+        matchInstrs(out, elf, Is, 0, count, index, parallel, emit_jumps,
+            tier0, Ms);
+        if (option_blocks)
+            emitBlocks(elf, Is);
+        matched = 0;
+        notifyPlugins(out, &elf, Is, EVENT_MATCHING_COMPLETE);
+    }
 
-        // Check which instructions to emit:
-        switch (option_optimization_level)
-        {
-            case '2': case '3': case 's':
-                if (I.size >= /*sizeof(jmpq)=*/5 &&
-                        ((I.category & CATEGORY_JUMP) != 0 ||
-                         (I.category & CATEGORY_CALL) != 0))
-                {
-                    // Always emits jump/calls for -Opeephole
-                    Is[i].emit = true;
-                }
-                break;
-        }
-        if (Is[i].patch)
+    // Step (3): Reserve the (zeroed) counter and sample maps:
+    size_t sites = 0;
+    for (size_t i = 0; i < count; i++)
+        sites += (Is[i].patch? 1: 0);
+    for (const auto *action: actions)
+    {
+        for (const auto *patch: action->patch)
         {
-            Is[i].emit = true;
-            size_t range =
-                INT8_MAX + /*sizeof(short jmp)=*/2 + /*max instr. size=*/15;
-            for (ssize_t j = i; j >= 0; j--)
+            if (sites == 0)
+                continue;
+            patch->sites = sites;
+            if (patch->kind == PATCH_COUNT || patch->kind == PATCH_COV)
             {
-                if (Is[i].address - Is[j].address > range)
-                    break;
-                Is[j].emit = true;
+                size_t len = sites * (patch->kind == PATCH_COUNT?
+                    sizeof(uint64_t): sizeof(uint8_t));
+                patch->map = allocAddress(len);
+                sendReserveMessage(out, patch->map, nullptr, len,
+                    PROT_READ | PROT_WRITE);
+                debug("reserved counter map for \"%s\" at address 0x%lx "
+                    "(%zu bytes, %zu sites)", patch->name, patch->map, len,
+                    sites);
             }
-            for (size_t j = i + 1; j < count; j++)
+            if (patch->sample > 0)
             {
-                if (Is[j].address - Is[i].address > range)
-                    break;
-                Is[j].emit = true;
+                size_t len = sites * sizeof(uint32_t);
+                patch->sample_map = allocAddress(len);
+                sendReserveMessage(out, patch->sample_map, nullptr, len,
+                    PROT_READ | PROT_WRITE);
+                debug("reserved sample map for \"%s\" at address 0x%lx "
+                    "(%zu bytes, %zu sites)", patch->sampler,
+                    patch->sample_map, len, sites);
             }
         }
     }
-    notifyPlugins(out, &elf, Is, EVENT_MATCHING_COMPLETE);
 
-    // Step (3): Send all composite trampolines:
-    size_t tid = 0;
-    std::map<const Matching *, size_t, MatchingCmp> tmps;
-    std::vector<Metadata> metadata;
+    // Step (4): Send all composite trampolines:
     std::vector<std::vector<Metadata>> metadatas;
-    Context cxt = {API_VERSION, STRING(VERSION), out, nullptr, nullptr, &elf,
-        &Is, -1, nullptr, -1};
-    for (const auto *M: Ms.matchings)
-    {
-        sendMessageHeader(out, "trampoline");
-        sendParamHeader(out, "name");
-        fprintf(out, "\"$tmp_%zu\"", tid);
-        sendSeparator(out);
-        sendParamHeader(out, "template");
-        fputs("[\".Ltrampoline\",", out);
+    sendTrampolines(out, elf, Is, Ms, metadatas);
 
-        // BEFORE trampolines:
-        bool seen_break = false;
-        for (const auto *action: M->actions)
-        {
-            for (size_t j = 0, n = action->patch.size(); j < n; j++)
-            {
-                if (action->patch[j]->pos != POS_BEFORE || seen_break)
-                    continue;
-                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
-            }
-        }
-
-        // REPLACE trampoline:
-        bool seen_replace = false;
-        for (const auto *action: M->actions)
+    /*
+     * Send instructions & patches.  Note: this MUST be done in reverse!
+     */
+    debug("--------------------------------------");
+    StatsTimer send_timer(stats, "sending");
+    intptr_t id = -1;
+    char *meta_buf = nullptr;
+    size_t meta_len = 0;
+    FILE *meta = nullptr;
+    struct MetaRef
+    {
+        std::string text;
+        uint32_t ref;
+    };
+    std::vector<MetaRef> meta_refs;
+    uint32_t num_metas = 0;
+    if (backend.binary)
+    {
+        // Metadata is collected separately and sent as a record blob:
+        meta_refs.resize(RECORD_METADATA_WINDOW);
+        meta = open_memstream(&meta_buf, &meta_len);
+        if (meta == nullptr)
+            error("failed to open metadata stream: %s", strerror(errno));
+    }
+    ssize_t run_lo = -1, run_hi = -1;
+    for (ssize_t i = (ssize_t)count - 1; i >= 0; i--)
+    {
+        // Streaming: load the next (lower) window once Is[i] is within
+        // EMIT_RANGE of the bottom of the buffer.  Instructions that have
+        // already been sent are dropped first, so the buffer is bounded by
+        // (roughly) two windows.
+        while (window > 0 &&
+                (intptr_t)Is[i].address - (intptr_t)Is[0].address <=
+                    EMIT_RANGE)
         {
-            for (size_t j = 0, n = action->patch.size(); j < n; j++)
+            size_t top = (size_t)std::max(i, run_hi) + 1;
+            while (top < Is.size() &&
+                    Is[top].address - Is[i].address <= EMIT_RANGE)
+                top++;
+            Is.resize(top);
+            size_t n = loadWindow(D, windows, --window, desyncs, Is);
+            i       += n;
+            matched += n;
+            if (run_lo >= 0)
             {
-                if (action->patch[j]->pos != POS_REPLACE || seen_break)
-                    continue;
-                seen_replace = true;
-                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
+                run_lo += n;
+                run_hi += n;
             }
         }
-        if (!seen_replace && !seen_break)
-            fprintf(out, "\"$instr\",");
 
-        // AFTER trampolines:
-        for (const auto *action: M->actions)
+        // Pipelined matching: match the next block (downwards) once Is[i]
+        // is within EMIT_RANGE of an unmatched instruction, since matching
+        // may mark Is[i] for emission.
+        while (matched > 0 && (intptr_t)Is[i].address -
+                (intptr_t)Is[matched-1].address <= EMIT_RANGE)
         {
-            for (size_t j = 0, n = action->patch.size(); j < n; j++)
-            {
-                if (action->patch[j]->pos != POS_AFTER || seen_break)
-                    continue;
-                seen_break = sendTrampoline(out, action, j, &cxt, metadata);
-            }
+            size_t lo = (matched > MATCH_BLOCK_SIZE?
+                matched - MATCH_BLOCK_SIZE: 0);
+            matchInstrs(out, elf, Is, lo, matched, index, parallel,
+                emit_jumps, tier0, Ms);
+            sendTrampolines(out, elf, Is, Ms, metadatas);
+            matched = lo;
         }
-        if (!seen_break)
-            fputs("\"$BREAK\",", out);
 
-        // DATA:
-        for (const auto &entry: metadata)
+        if (Is[i].emit)
         {
-            const Patch *patch = entry.action->patch[entry.idx];
-            if (patch->kind == PATCH_PLUGIN)
+            if (backend.binary)
             {
-                const Plugin *plugin = patch->plugin;
-                if (plugin->dataFunc != nullptr)
-                {
-                    cxt.context = plugin->context;
-                    plugin->dataFunc(&cxt);
-                }
+                // Contiguous instructions are sent as a single record:
+                if (run_lo >= 0 &&
+                        (Is[i].address + Is[i].size != Is[run_lo].address ||
+                         Is[i].offset + Is[i].size != Is[run_lo].offset))
+                    sendInstructionRun(out, elf, Is, run_lo, run_hi);
+                if (run_lo < 0)
+                    run_hi = i;
+                run_lo = i;
             }
             else
-                fprintf(out, "\"$DATA@%s\",", patch->name+1);
+                sendInstructionMessage(out, Is[i].address - elf.base,
+                    Is[i].size, Is[i].offset);
         }
-        fputc(']', out);
-        sendSeparator(out, /*last=*/true);
-        sendMessageFooter(out, /*sync=*/true);
-
-        metadatas.emplace_back();
-        metadatas[tid].swap(metadata);
-        tmps.insert({M, tid});
-        tid++;
-    }
-
-    /*
-     * Send instructions & patches.  Note: this MUST be done in reverse!
-     */
-    debug("--------------------------------------");
-    intptr_t id = -1;
-    for (ssize_t i = (ssize_t)count - 1; i >= 0; i--)
-    {
-        if (Is[i].emit)
-            sendInstructionMessage(out, Is[i].address - elf.base, Is[i].size,
-                Is[i].offset);
         if (!Is[i].patch)
             continue;
+        sendInstructionRun(out, elf, Is, run_lo, run_hi);
  
         // Disassmble the instruction again.
         InstrInfo I;
@@ -1574,8 +3139,8 @@ int main_2(int argc, char **argv)
         id++;
         Context cxt = {API_VERSION, STRING(VERSION), out, nullptr, nullptr,
             &elf, &Is, i, &I, id};
-        const Matching *M = Ms.matchings[Is[i].matching];
-        size_t tid = tmps[M];
+        size_t tid = Is[i].matching;
+        const Matching *M = Ms.matchings[tid];
 
         if (option_debug)
         {
@@ -1601,6 +3166,46 @@ int main_2(int argc, char **argv)
                 s.c_str(), tid);
         }
 
+        StatsTimer meta_timer(stats, "metadata");
+        if (backend.binary)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "$tmp_%zu", tid);
+            meta_len = 0;
+            if (metadatas[tid].size() > 0)
+            {
+                rewind(meta);
+                cxt.out = meta;
+                sendMetadataHeader(meta);
+                for (const auto &entry: metadatas[tid])
+                    sendMetadata(meta, &elf, entry.action, entry.idx,
+                        entry.sample, Is, (size_t)i, &I, id, &cxt);
+                sendMetadataFooter(meta);
+                fflush(meta);
+
+                // Sites with the same operand shape & address-independent
+                // arguments generate identical metadata, which is only sent
+                // once, and is referenced thereafter.  The recent metadata
+                // is remembered in a fixed-size direct-mapped table, since
+                // E9Patch only keeps the last RECORD_METADATA_WINDOW:
+                std::string text(meta_buf, meta_len);
+                MetaRef &entry = meta_refs[std::hash<std::string>()(text) %
+                    RECORD_METADATA_WINDOW];
+                if (!entry.text.empty() &&
+                        num_metas - entry.ref <= RECORD_METADATA_WINDOW &&
+                        entry.text == text)
+                {
+                    sendPatchRefRecord(out, name, I.offset, entry.ref,
+                        /*sync=*/true);
+                    continue;
+                }
+                entry.text.swap(text);
+                entry.ref = num_metas++;
+            }
+            sendPatchRecord(out, name, I.offset, meta_buf, meta_len,
+                /*sync=*/true);
+            continue;
+        }
         sendMessageHeader(out, "patch");
         sendParamHeader(out, "trampoline");
         fprintf(out, "\"$tmp_%zu\",", tid);
@@ -1609,8 +3214,8 @@ int main_2(int argc, char **argv)
             sendParamHeader(out, "metadata");
             sendMetadataHeader(out);
             for (const auto &entry: metadatas[tid])
-                sendMetadata(out, &elf, entry.action, entry.idx, Is,
-                    (size_t)i, &I, id, &cxt);
+                sendMetadata(out, &elf, entry.action, entry.idx,
+                    entry.sample, Is, (size_t)i, &I, id, &cxt);
             sendMetadataFooter(out);
             sendSeparator(out);
         }
@@ -1619,6 +3224,13 @@ int main_2(int argc, char **argv)
         sendSeparator(out, /*last=*/true);
         sendMessageFooter(out, /*sync=*/true);
     }
+    sendInstructionRun(out, elf, Is, run_lo, run_hi);
+    if (meta != nullptr)
+    {
+        fclose(meta);
+        free(meta_buf);
+    }
+    send_timer.stop();
     notifyPlugins(out, &elf, Is, EVENT_PATCHING_COMPLETE);
     Is.clear();
 
@@ -1636,6 +3248,11 @@ int main_2(int argc, char **argv)
     else if (option_format == "patch.xz" &&
             !hasSuffix(option_output, ".patch.xz"))
         option_output += ".patch.xz";
+    else if (option_format == "delta" && !hasSuffix(option_output, ".delta"))
+        option_output += ".delta";
+    else if (option_format == "delta.gz" &&
+            !hasSuffix(option_output, ".delta.gz"))
+        option_output += ".delta.gz";
     else if (option_format == "json")
     {
         option_output = "a.out";
@@ -1646,7 +3263,12 @@ int main_2(int argc, char **argv)
     /*
      * Wait for E9Patch to complete.
      */
+    StatsTimer backend_timer(stats, "backend");
     waitBackend(backend);
+    backend_timer.stop();
+    if (option_stats != "" && !stats.dump(option_stats.c_str(), "e9tool"))
+        warning("failed to write statistics to \"%s\": %s",
+            option_stats.c_str(), strerror(errno));
 
     /*
      * Finalize all plugins.
@@ -19,6 +19,7 @@
 #ifndef __E9TOOL_H
 #define __E9TOOL_H
 
+#include <algorithm>
 #include <map>
 #include <vector>
 
@@ -96,6 +97,17 @@ enum CallJump
     JUMP_GOTO,                      // if (addr = f(...)) goto addr; ...
 };
 
+/*
+ * Vector state clobbered by a call.
+ */
+enum CallVector
+{
+    VECTOR_NONE,                    // No vector registers
+    VECTOR_XMM,                     // %xmm0..%xmm15 (legacy SSE)
+    VECTOR_YMM,                     // %ymm0..%ymm15 (VEX)
+    VECTOR_ZMM,                     // %zmm0..%zmm31 + %k0..%k7 (EVEX)
+};
+
 /*
  * Mnemonics.
  */
@@ -2081,8 +2093,9 @@ struct OpInfo
 #define FLAG_AF                 0x04
 #define FLAG_ZF                 0x08
 #define FLAG_SF                 0x10
+#define FLAG_OF                 0x20
 #define FLAG_ALL                \
-    (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF)
+    (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF)
 
 /*
  * Compressed instruction representation.
@@ -2302,6 +2315,7 @@ enum ArgumentKind : uint8_t
     ARGUMENT_TARGET,                // Call/jump target
     ARGUMENT_TRAMPOLINE,            // Trampoline
     ARGUMENT_RANDOM,                // Random number
+    ARGUMENT_PMC,                   // Performance counter delta
     ARGUMENT_REGISTER,              // Register
     ARGUMENT_MEMOP,                 // Memory operand
     ARGUMENT_STATE,                 // The complete GPR state
@@ -2348,6 +2362,34 @@ struct Argument
                                     // (ARGUMENT_CSV/STRING/SYMBOL).
 };
 
+/*
+ * Guard comparisons.
+ */
+enum GuardCmp : uint8_t
+{
+    GUARD_EQ,                       // ==
+    GUARD_NEQ,                      // !=
+    GUARD_LT,                       // <
+    GUARD_LEQ,                      // <=
+    GUARD_GT,                       // >
+    GUARD_GEQ,                      // >=
+};
+
+/*
+ * Call guard test `lhs CMP rhs' (signed 64-bit comparison), where `lhs' and
+ * `rhs' are register, integer, or memory operand arguments.  A shadow
+ * operand is the (signed) shadow memory byte for the address given by the
+ * argument, i.e., ((int8_t *)SHADOW_BASE)[arg >> SHADOW_SCALE].
+ */
+struct Guard
+{
+    Argument lhs;                   // Left-hand-side.
+    GuardCmp cmp;                   // Comparison.
+    Argument rhs;                   // Right-hand-side.
+    bool lhs_shadow;                // Left-hand-side is shadow(lhs)?
+    bool rhs_shadow;                // Right-hand-side is shadow(rhs)?
+};
+
 /*
  * Call trampoline object.
  */
@@ -2360,7 +2402,42 @@ typedef uint8_t TargetKind;
 #define TARGET_DIRECT   0x01        // Direct call/jump
 #define TARGET_INDIRECT 0x02        // Indirect call/jump
 #define TARGET_FUNCTION 0x04        // Target is called
-typedef std::map<intptr_t, TargetKind> Targets;
+
+/*
+ * Targets are stored as a flat vector sorted by address.  New targets are
+ * appended using push() and merged in bulk using sort().
+ */
+struct Targets
+{
+    typedef std::pair<intptr_t, TargetKind> Entry;
+    typedef std::vector<Entry>::iterator iterator;
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+    std::vector<Entry> entries;
+
+    void push(intptr_t target, TargetKind kind)
+    {
+        entries.push_back({target, kind});
+    }
+    void sort(void);
+
+    const_iterator find(intptr_t target) const
+    {
+        auto i = std::lower_bound(entries.begin(), entries.end(), target,
+            [](const Entry &entry, intptr_t target) {
+                return (entry.first < target);
+            });
+        return (i != entries.end() && i->first == target? i: entries.end());
+    }
+
+    iterator begin(void)                { return entries.begin(); }
+    iterator end(void)                  { return entries.end(); }
+    const_iterator begin(void) const    { return entries.begin(); }
+    const_iterator end(void) const      { return entries.end(); }
+    size_t size(void) const             { return entries.size(); }
+    void clear(void)                    { entries.clear(); }
+    void swap(Targets &targets)         { entries.swap(targets.entries); }
+};
 
 struct BB
 {
@@ -2391,6 +2468,20 @@ struct F
 };
 typedef std::vector<F> Fs;
 
+/*
+ * Register liveness.  A RegSet is a bitmask indexed by the GPR register
+ * indexes (see getRegIdx()).
+ */
+typedef uint32_t RegSet;
+#define REGSET_ALL      (~(RegSet)0)
+
+struct Live
+{
+    RegSet in;                      // Registers live before the instruction
+    RegSet out;                     // Registers live after the instruction
+};
+typedef std::vector<Live> Liveness;
+
 /*
  * Low-level functions that send fragments of JSONRPC messages:
  */
@@ -2418,6 +2509,9 @@ extern unsigned sendReserveMessage(FILE *out, intptr_t addr, size_t len,
 extern unsigned sendReserveMessage(FILE *out, intptr_t addr,
     const uint8_t *data, size_t len, int prot, intptr_t init = 0x0,
     intptr_t fini = 0x0, intptr_t mmap = 0x0, bool absolute = false);
+extern unsigned sendReserveZeroMessage(FILE *out, intptr_t addr, size_t len,
+    int prot, bool absolute = false);
+extern unsigned sendReserveTLSMessage(FILE *out, size_t size);
 extern void sendELFFileMessage(FILE *out, const ELF *elf,
     bool absolute = false);
 extern unsigned sendEmptyTrampolineMessage(FILE *out);
@@ -2425,6 +2519,11 @@ extern unsigned sendTrapTrampolineMessage(FILE *out);
 extern unsigned sendPrintTrampolineMessage(FILE *out, BinaryType type);
 extern unsigned sendExitTrampolineMessage(FILE *out, BinaryType type,
     int status);
+extern unsigned sendCounterTrampolineMessage(FILE *out, const char *name,
+    bool cov, bool lea);
+extern unsigned sendLogTrampolineMessage(FILE *out, const char *name);
+extern unsigned sendHookTrampolineMessage(FILE *out, const char *name,
+    intptr_t stub, intptr_t buf, intptr_t func);
 extern unsigned sendSignalTrampolineMessage(FILE *out, BinaryType type,
     int sig);
 extern unsigned sendCallTrampolineMessage(FILE *out, const char *name,
@@ -2436,10 +2535,39 @@ extern unsigned sendInstructionMessage(FILE *out, intptr_t addr, size_t size,
 extern unsigned sendEmitMessage(FILE *out, const char *filename,
     const char *format);
 extern void sendPrintMetadata(FILE *out, const InstrInfo *info);
+extern void sendCounterMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, bool flags, bool lea, intptr_t addr, size_t idx);
+extern void sendSampleMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, unsigned period, intptr_t addr, size_t idx);
+extern void sendLogMetadata(FILE *out, const char *name, const ELF *elf,
+    PatchPos pos, const std::vector<Argument> &args, bool tsc,
+    unsigned entries, intptr_t buf, intptr_t func, size_t idx,
+    const InstrInfo *info);
+extern void sendHookMetadata(FILE *out, const char *name, const ELF *elf,
+    unsigned entries, intptr_t buf, intptr_t stub, size_t idx,
+    const InstrInfo *info);
 extern void sendCallMetadata(FILE *out, const char *name, const ELF *elf,
     const Call &call, const std::vector<Argument> &args,
-    intptr_t id, const std::vector<Instr> &Is, size_t idx,
-    const InstrInfo *info);
+    const std::vector<Guard> &guard, intptr_t id,
+    const std::vector<Instr> &Is, size_t idx, const InstrInfo *info);
+
+/*
+ * Functions that send compact binary E9PATCH records (`--rpc=binary'):
+ */
+#define RECORD_MAGIC        0xE9
+#define RECORD_INSTRUCTION  'I'
+#define RECORD_INSTRUCTIONS 'R'
+#define RECORD_PATCH        'P'
+#define RECORD_METADATA_REF UINT32_MAX
+#define RECORD_METADATA_WINDOW 4096
+extern unsigned sendInstructionRecord(FILE *out, intptr_t addr, size_t size,
+    off_t offset);
+extern unsigned sendInstructionsRecord(FILE *out, intptr_t addr,
+    off_t offset, const uint8_t *sizes, size_t count);
+extern unsigned sendPatchRecord(FILE *out, const char *trampoline,
+    off_t offset, const char *metadata, size_t len, bool sync = false);
+extern unsigned sendPatchRefRecord(FILE *out, const char *trampoline,
+    off_t offset, uint32_t ref, bool sync = false);
 
 /*
  * ELF functions.
@@ -2459,6 +2587,7 @@ extern const Elf64_Sym *getELFDynSym(const ELF *elf, const char *name);
 extern const Elf64_Sym *getELFSym(const ELF *elf, const char *name);
 extern intptr_t getELFPLTEntry(const ELF *elf, const char *name);
 extern intptr_t getELFGOTEntry(const ELF *elf, const char *name);
+extern const char *getELFFuncName(const ELF *elf, intptr_t addr);
 extern const char *getELFStrTab(const ELF *elf);
 extern const SectionInfo &getELFSectionInfo(const ELF *elf);
 extern const SymbolInfo &getELFDynSymInfo(const ELF *elf);
@@ -2475,7 +2604,16 @@ extern intptr_t getELFObject(const ELF *elf, const char *name,
  */
 extern const Call &makeCall(const ELF *elf, const char *filename,
     const char *entry, CallABI abi, CallJump jmp, PatchPos pos,
-    const std::vector<ArgumentKind> &args);
+    const std::vector<ArgumentKind> &args, bool flags = false,
+    bool inl = false, bool guard = false);
+extern void loadCallTarget(const char *filename);
+extern intptr_t allocAddress(size_t len);
+extern size_t getLogRecordSize(size_t num_args, bool tsc);
+extern size_t getHookStackSize(unsigned entries);
+#define HOOK_FRAME_SIZE     (3 * sizeof(uint64_t))  // ret, rsp, func
+#define SHADOW_BASE         0x7fff8000              // shadow(p) base
+#define SHADOW_SCALE        3                       // shadow(p) 1:8 scale
+#define SHADOW_SIZE         (1ull << (47 - SHADOW_SCALE))
 extern void getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
     void *raw = nullptr);
 extern const char *getRegName(Register r);
@@ -2488,6 +2626,8 @@ extern void buildBBs(const ELF *elf, const Instr *Is, size_t size,
     const Targets &targets, BBs &bbs);
 extern void buildFs(const ELF *elf, const Instr *Is, size_t size,
     const Targets &targets, Fs &fs);
+extern void buildLiveness(const ELF *elf, const Instr *Is, size_t size,
+    const BBs &bbs, const Fs &fs, Liveness &live);
 extern intptr_t getSymbol(const ELF *elf, const char *symbol);
 extern void NO_RETURN error(const char *msg, ...);
 extern void warning(const char *msg, ...);
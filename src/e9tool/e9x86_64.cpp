@@ -20,9 +20,14 @@
  * Disassembler interface.
  */
 
+#include <algorithm>
+#include <set>
+
+#include "e9codegen.h"
 #include "e9elf.h"
 #include "e9misc.h"
 #include "e9tool.h"
+#include "e9x86_64.h"
 
 using namespace e9tool;
 
@@ -124,6 +129,17 @@ bool decode(const uint8_t **code, size_t *size, off_t *offset,
  */
 void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
     void *raw)
+{
+    decodeInstrInfo(elf, I, info, raw, INFO_ALL);
+}
+
+/*
+ * Decompress an instruction up to the given tier.  Lower tiers skip the
+ * (comparatively expensive) operand decoding and/or formatting, and leave
+ * the corresponding InstrInfo fields empty.
+ */
+void decodeInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
+    void *raw, unsigned tier)
 {
     off_t offset = (off_t)I->offset;
     const Elf64_Shdr *shdr = nullptr;
@@ -150,10 +166,13 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
     ZydisDecodedInstruction *D = (ZydisDecodedInstruction *)raw;
     D = (D == nullptr? &D_0: D);
     ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+    ZydisDecoderContext context;
 
-    ZyanStatus result = ZydisDecoderDecodeFull(&decoder,
-        elf->data + I->offset, I->size, D, operands, ZYDIS_MAX_OPERAND_COUNT,
-        0);
+    ZyanStatus result = ZydisDecoderDecodeInstruction(&decoder, &context,
+        elf->data + I->offset, I->size, D);
+    if (ZYAN_SUCCESS(result) && tier >= INFO_OPERANDS)
+        result = ZydisDecoderDecodeOperands(&decoder, &context, D, operands,
+            ZYDIS_MAX_OPERAND_COUNT);
     if (!ZYAN_SUCCESS(result) || I->size != D->length ||
             D->operand_count > sizeof(info->op) / sizeof(info->op[0]))
         error("failed to decompress instruction at address 0x%lx; decode "
@@ -193,6 +212,19 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
 
         info->flags.read = 0x0;
         info->flags.write = 0x0;
+        info->string.section  = elf->strs + shdr->sh_name;
+        info->string.mnemonic = ZydisMnemonicGetString(D->mnemonic);
+        info->string.instr[0] = '\0';
+        if (tier < INFO_OPERANDS)
+        {
+            info->regs.read[0]      = REGISTER_INVALID;
+            info->regs.write[0]     = REGISTER_INVALID;
+            info->regs.condread[0]  = REGISTER_INVALID;
+            info->regs.condwrite[0] = REGISTER_INVALID;
+            info->op[0].type        = OPTYPE_INVALID;
+            info->count.op          = 0;
+            return;
+        }
         if (D->attributes & ZYDIS_ATTRIB_CPUFLAG_ACCESS)
         {
             uint32_t cpu_flags_read = D->cpu_flags->tested;
@@ -206,6 +238,8 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
                 info->flags.read |= FLAG_ZF;
             if (cpu_flags_read & ZYDIS_CPUFLAG_SF)
                 info->flags.read |= FLAG_SF;
+            if (cpu_flags_read & ZYDIS_CPUFLAG_OF)
+                info->flags.read |= FLAG_OF;
             uint32_t cpu_flags_written =
                 D->cpu_flags->modified |
                 D->cpu_flags->set_0 |
@@ -221,6 +255,8 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
                 info->flags.write |= FLAG_ZF;
             if (cpu_flags_written & ZYDIS_CPUFLAG_SF)
                 info->flags.write |= FLAG_SF;
+            if (cpu_flags_written & ZYDIS_CPUFLAG_OF)
+                info->flags.write |= FLAG_OF;
         }
 
         unsigned j = 0, k = 0, l = 0, m = 0, n = 0;
@@ -333,7 +369,8 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
         info->regs.condwrite[n] = REGISTER_INVALID;
         info->op[j].type        = OPTYPE_INVALID;
         info->count.op          = j;
-        info->string.section    = elf->strs + shdr->sh_name;
+        if (tier < INFO_ALL)
+            return;
         result = ZydisFormatterFormatInstruction(&formatter, D, operands,
             D->operand_count_visible, info->string.instr,
             sizeof(info->string.instr)-1, I->address);
@@ -364,7 +401,6 @@ void e9tool::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
                 *s++ = '\0';
             }
         }
-        info->string.mnemonic = ZydisMnemonicGetString(D->mnemonic);
     }
 }
 
@@ -2380,6 +2416,241 @@ int suspiciousness(const uint8_t *bytes, size_t size)
     }
 }
 
+/*
+ * Get the vector state that may be clobbered by the given code.  This uses
+ * a linear disassembly, so any embedded data may cause a (conservative)
+ * false positive.
+ */
+CallVector getVectorUsage(const uint8_t *code, size_t size)
+{
+    CallVector vec = VECTOR_NONE;
+    while (size > 0 && vec != VECTOR_ZMM)
+    {
+        ZydisDecodedInstruction D;
+        ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+        ZydisDecoderContext context;
+        ZyanStatus result = ZydisDecoderDecodeInstruction(&decoder, &context,
+            code, size, &D);
+        if (ZYAN_SUCCESS(result))
+            result = ZydisDecoderDecodeOperands(&decoder, &context, &D,
+                operands, ZYDIS_MAX_OPERAND_COUNT);
+        if (!ZYAN_SUCCESS(result))
+        {
+            code++; size--;
+            continue;
+        }
+        code += D.length;
+        size -= D.length;
+
+        // Note: VEX/EVEX-encoded instructions zero the upper bits of the
+        //       destination register, so clobber the wider registers.
+        if (D.attributes & (ZYDIS_ATTRIB_HAS_EVEX | ZYDIS_ATTRIB_HAS_MVEX))
+        {
+            vec = VECTOR_ZMM;
+            continue;
+        }
+        CallVector ivec = VECTOR_NONE;
+        for (unsigned i = 0; i < D.operand_count; i++)
+        {
+            ZydisRegister reg = ZYDIS_REGISTER_NONE;
+            switch (operands[i].type)
+            {
+                case ZYDIS_OPERAND_TYPE_REGISTER:
+                    reg = operands[i].reg.value; break;
+                case ZYDIS_OPERAND_TYPE_MEMORY:
+                    reg = operands[i].mem.index; break;
+                default:
+                    continue;
+            }
+            switch (ZydisRegisterGetClass(reg))
+            {
+                case ZYDIS_REGCLASS_MASK: case ZYDIS_REGCLASS_ZMM:
+                    ivec = VECTOR_ZMM; break;
+                case ZYDIS_REGCLASS_YMM:
+                    ivec = std::max(ivec, VECTOR_YMM); break;
+                case ZYDIS_REGCLASS_XMM:
+                    ivec = std::max(ivec, VECTOR_XMM); break;
+                default:
+                    break;
+            }
+        }
+        if (ivec == VECTOR_XMM && (D.attributes & ZYDIS_ATTRIB_HAS_VEX))
+            ivec = VECTOR_YMM;
+        else if (ivec == VECTOR_NONE &&
+                (D.mnemonic == ZYDIS_MNEMONIC_VZEROUPPER ||
+                 D.mnemonic == ZYDIS_MNEMONIC_VZEROALL))
+            ivec = VECTOR_YMM;
+        vec = std::max(vec, ivec);
+    }
+    return vec;
+}
+
+/*
+ * Extract the body of a small leaf function (at address `addr') for
+ * inlining into a call trampoline.  The function must be straight-line code
+ * (or local branches) ending with a single `ret', must not use the stack,
+ * callee-save or vector registers, and may only reference data
+ * PC-relatively.  On failure, returns false and sets the `reason'.
+ */
+#define INLINE_MAX          256
+bool getInline(const uint8_t *code, size_t size, intptr_t addr,
+    Inline &inl, const char **reason)
+{
+    if (size == 0)
+    {
+        *reason = "the function size is unknown";
+        return false;
+    }
+    if (size > INLINE_MAX)
+    {
+        *reason = "the function is too large";
+        return false;
+    }
+    std::set<intptr_t> bounds;
+    std::vector<intptr_t> branches;
+    size_t i = 0, end = SIZE_MAX;
+    while (i < size)
+    {
+        ZydisDecodedInstruction D;
+        ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+        ZydisDecoderContext context;
+        ZyanStatus result = ZydisDecoderDecodeInstruction(&decoder, &context,
+            code + i, size - i, &D);
+        if (ZYAN_SUCCESS(result))
+            result = ZydisDecoderDecodeOperands(&decoder, &context, &D,
+                operands, ZYDIS_MAX_OPERAND_COUNT);
+        if (!ZYAN_SUCCESS(result))
+        {
+            *reason = "the function contains data or invalid instructions";
+            return false;
+        }
+        bounds.insert(addr + (intptr_t)i);
+        size_t len = D.length;
+        switch (D.meta.category)
+        {
+            case ZYDIS_CATEGORY_RET:
+                if (i + len != size || D.operand_count_visible != 0)
+                {
+                    *reason = "the function has multiple exits";
+                    return false;
+                }
+                end = i;
+                break;
+            case ZYDIS_CATEGORY_CALL:
+                *reason = "the function is not a leaf function";
+                return false;
+            case ZYDIS_CATEGORY_SYSCALL: case ZYDIS_CATEGORY_SYSRET:
+            case ZYDIS_CATEGORY_INTERRUPT:
+                *reason = "the function contains system instructions";
+                return false;
+            case ZYDIS_CATEGORY_COND_BR: case ZYDIS_CATEGORY_UNCOND_BR:
+                if (operands[0].type != ZYDIS_OPERAND_TYPE_IMMEDIATE ||
+                        !operands[0].imm.is_relative)
+                {
+                    *reason = "the function contains indirect jumps";
+                    return false;
+                }
+                branches.push_back(addr + (intptr_t)(i + len) +
+                    (intptr_t)operands[0].imm.value.s);
+                break;
+            default:
+                break;
+        }
+        if (end != SIZE_MAX)
+            break;
+        if (D.cpu_flags != nullptr && (D.cpu_flags->modified |
+                D.cpu_flags->set_0 | D.cpu_flags->set_1 |
+                D.cpu_flags->undefined) != 0)
+            inl.clobbers |= (RegSet)1 << RFLAGS_IDX;
+        for (unsigned j = 0; j < D.operand_count; j++)
+        {
+            const ZydisDecodedOperand &op = operands[j];
+            bool write = ((op.actions & ZYDIS_OPERAND_ACTION_MASK_WRITE) != 0);
+            ZydisRegister regs[2] = {ZYDIS_REGISTER_NONE, ZYDIS_REGISTER_NONE};
+            switch (op.type)
+            {
+                case ZYDIS_OPERAND_TYPE_REGISTER:
+                    regs[0] = op.reg.value; break;
+                case ZYDIS_OPERAND_TYPE_MEMORY:
+                    regs[0] = op.mem.base; regs[1] = op.mem.index;
+                    write = false;
+                    if (op.mem.base == ZYDIS_REGISTER_RIP)
+                    {
+                        // Relocate the PC-relative reference:
+                        size_t offset = i + D.raw.disp.offset;
+                        intptr_t target = addr + (intptr_t)(i + len) +
+                            (intptr_t)D.raw.disp.value;
+                        intptr_t trailing = (intptr_t)len -
+                            (intptr_t)D.raw.disp.offset - sizeof(int32_t);
+                        inl.relocs.push_back({offset, target - trailing});
+                        regs[0] = ZYDIS_REGISTER_NONE;
+                    }
+                    break;
+                default:
+                    continue;
+            }
+            for (unsigned k = 0; k < 2; k++)
+            {
+                if (regs[k] == ZYDIS_REGISTER_NONE)
+                    continue;
+                int regno = getRegIdx(convert(regs[k]));
+                switch (regno)
+                {
+                    case RIP_IDX:
+                        continue;
+                    case RSP_IDX:
+                        *reason = "the function uses the stack";
+                        return false;
+                    case RBX_IDX: case RBP_IDX: case R12_IDX: case R13_IDX:
+                    case R14_IDX: case R15_IDX:
+                        if (!write)
+                            continue;
+                        *reason = "the function clobbers a callee-save "
+                            "register";
+                        return false;
+                    default:
+                        break;
+                }
+                if (regno < 0)
+                {
+                    switch (ZydisRegisterGetClass(regs[k]))
+                    {
+                        case ZYDIS_REGCLASS_X87: case ZYDIS_REGCLASS_MMX:
+                        case ZYDIS_REGCLASS_XMM: case ZYDIS_REGCLASS_YMM:
+                        case ZYDIS_REGCLASS_ZMM: case ZYDIS_REGCLASS_MASK:
+                            *reason = "the function uses vector registers";
+                            return false;
+                        default:
+                            break;
+                    }
+                    if (!write)
+                        continue;
+                    *reason = "the function writes to a special register";
+                    return false;
+                }
+                if (write)
+                    inl.clobbers |= (RegSet)1 << regno;
+            }
+        }
+        i += len;
+    }
+    if (end == SIZE_MAX)
+    {
+        *reason = "the function does not end with a return";
+        return false;
+    }
+    for (intptr_t target: branches)
+    {
+        if (bounds.count(target) == 0)
+        {
+            *reason = "the function contains non-local jumps";
+            return false;
+        }
+    }
+    inl.code.assign(code, code + end);
+    return true;
+}
+
 /*
  * Get an operand.
  */
@@ -21,10 +21,27 @@
 
 #include "e9tool.h"
 
+namespace e9tool
+{
+    struct Inline;
+};
+
+/*
+ * InstrInfo tiers (see decodeInstrInfo()).
+ */
+#define INFO_BASIC          0   // Encoding, mnemonic, category, etc.
+#define INFO_OPERANDS       1   // + Operands, registers and flags
+#define INFO_ALL            2   // + Assembly string
+
 extern void initDisassembler(void);
 extern bool decode(const uint8_t **code, size_t *size, off_t *offset,
     intptr_t *address, e9tool::Instr *I);
+extern void decodeInstrInfo(const e9tool::ELF *elf, const e9tool::Instr *I,
+    e9tool::InstrInfo *info, void *raw, unsigned tier);
 extern int suspiciousness(const uint8_t *bytes, size_t size);
+extern e9tool::CallVector getVectorUsage(const uint8_t *code, size_t size);
+extern bool getInline(const uint8_t *code, size_t size, intptr_t addr,
+    e9tool::Inline &inl, const char **reason);
 extern const e9tool::OpInfo *getOperand(const e9tool::InstrInfo *I, int idx,
     e9tool::OpType type, e9tool::Access access);
 
@@ -0,0 +1,175 @@
+/*
+ * allocbench.cpp
+ * Copyright (C) 2020 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Allocator microbenchmark.  Replays an allocation trace recorded by an
+ * e9patch built with -DE9ALLOC_TRACE against the (interval tree or B+-tree)
+ * allocator.
+ *
+ * Usage: allocbench e9alloc.trace [REPEAT]
+ */
+
+#include <chrono>
+#include <cstdarg>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../../src/e9patch/e9alloc.cpp"
+
+bool option_Oorder = false;
+
+void NO_RETURN error(const char *msg, ...)
+{
+    va_list ap;
+    va_start(ap, msg);
+    fputs("error: ", stderr);
+    vfprintf(stderr, msg, ap);
+    putc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+int getTrampolinePrologueSize(const Binary *B, const Instr *I)
+{
+    return 0;
+}
+
+int getTrampolineSize(const Binary *B, const Trampoline *T, const Instr *I)
+{
+    return 0;
+}
+
+/*
+ * Trace entry.
+ */
+struct Op
+{
+    bool insert;            // Insert or delete?
+    intptr_t lb;            // Lower bound
+    intptr_t ub;            // Upper bound
+    size_t size;            // Size
+    uint32_t flags;         // Flags
+    intptr_t result;        // Recorded result (or INTPTR_MIN)
+    size_t node;            // Node index
+};
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        fprintf(stderr, "usage: %s e9alloc.trace [REPEAT]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned repeat = (argc == 3? (unsigned)atoi(argv[2]): 10);
+    FILE *stream = fopen(argv[1], "r");
+    if (stream == nullptr)
+        error("failed to open \"%s\" for reading: %s", argv[1],
+            strerror(errno));
+
+    // Parse the trace:
+    std::vector<Op> ops;
+    std::map<std::string, size_t> ids;
+    char kind, ptr[32];
+    while (fscanf(stream, " %c", &kind) == 1)
+    {
+        Op op = {false, 0, 0, 0, 0, INTPTR_MIN, SIZE_MAX};
+        ssize_t lb, ub, result;
+        if (kind == 'I')
+        {
+            if (fscanf(stream, "%zd %zd %zu %u %31s %zd", &lb, &ub, &op.size,
+                    &op.flags, ptr, &result) != 6)
+                error("failed to parse trace entry %zu", ops.size()+1);
+            op.insert = true;
+            op.lb = (intptr_t)lb;
+            op.ub = (intptr_t)ub;
+            if (strcmp(ptr, "(nil)") != 0)
+            {
+                op.result = (intptr_t)result;
+                op.node = ids.size();
+                ids[ptr] = op.node;
+            }
+        }
+        else if (kind == 'D')
+        {
+            if (fscanf(stream, "%31s", ptr) != 1)
+                error("failed to parse trace entry %zu", ops.size()+1);
+            auto i = ids.find(ptr);
+            if (i == ids.end())
+                error("failed to find node \"%s\" in trace", ptr);
+            op.node = i->second;
+            ids.erase(i);           // Pointers may be recycled
+        }
+        else
+            error("failed to parse trace entry %zu", ops.size()+1);
+        ops.push_back(op);
+    }
+    fclose(stream);
+
+    // Replay the trace:
+    size_t mismatch = 0, failed = 0;
+    double best = 1e100;
+    for (unsigned r = 0; r < repeat; r++)
+    {
+        Allocator allocator;
+        std::vector<Node *> nodes(ops.size(), nullptr);
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &op: ops)
+        {
+            if (op.insert)
+            {
+                Node *n = insertNode(allocator, op.lb, op.ub, op.size,
+                    op.flags);
+                if (n != nullptr)
+                {
+                    n->alloc.T = (const Trampoline *)1;
+                    if (op.node != SIZE_MAX)
+                        nodes[op.node] = n;
+                }
+                if (r == 0)
+                {
+                    failed   += (n == nullptr);
+                    mismatch += (n == nullptr? op.result != INTPTR_MIN:
+                        n->alloc.lb != op.result);
+                }
+            }
+            else if (nodes[op.node] != nullptr)
+            {
+                removeNode(allocator, nodes[op.node]);
+                release(allocator, nodes[op.node]);
+                nodes[op.node] = nullptr;
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    printf("allocator = %s\n",
+#ifdef E9ALLOC_BTREE
+        "btree"
+#else
+        "rbtree"
+#endif
+    );
+    printf("ops       = %zu\n", ops.size());
+    printf("failed    = %zu\n", failed);
+    printf("mismatch  = %zu\n", mismatch);
+    printf("time      = %.3fms (best of %u)\n", best * 1000.0, repeat);
+    printf("per_op    = %.1fns\n", best * 1e9 / (double)ops.size());
+    return 0;
+}
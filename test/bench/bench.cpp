@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2022 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rewrite-throughput benchmark.  Runs e9tool+e9patch over a fixed corpus
+ * and set of match/patch workloads, and reports the wall time, CPU time,
+ * peak RSS and output size of each phase:
+ *
+ *  - "frontend": e9tool only (disassembly, analysis & matching), using the
+ *                JSON pseudo-backend.
+ *  - "rewrite":  the full e9tool+e9patch rewrite.
+ *
+ * The report is a JSON array with one record per line.  If a baseline
+ * report is given, then each record is compared against the baseline, and
+ * the benchmark fails if any metric regresses by more than the threshold.
+ *
+ * Usage: bench [-o REPORT] [-b BASELINE] [-t PERCENT] [-r REPEAT]
+ */
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool option_tty = false;
+
+#define RED     "\33[31m"
+#define GREEN   "\33[32m"
+#define YELLOW  "\33[33m"
+#define WHITE "\33[0m"
+
+#define error(msg, ...)                                                 \
+    do                                                                  \
+    {                                                                   \
+        fprintf(stderr, "%serror%s: " msg "\n",                         \
+            (option_tty? RED: ""), (option_tty? WHITE: ""),           \
+            ##__VA_ARGS__);                                             \
+        exit(EXIT_FAILURE);                                             \
+    }                                                                   \
+    while (false)
+
+/*
+ * Corpus binaries (built by the Makefile).  Missing binaries (e.g., the PE
+ * sample without a MinGW cross compiler) are skipped.
+ */
+static const char *corpus[] =
+{
+    "small",            // Small non-PIE
+    "small.pie",        // Small PIE
+    "large",            // Large non-PIE
+    "large.pie",        // Large PIE
+    "small.exe",        // PE sample
+};
+
+/*
+ * Match/patch workloads.
+ */
+struct Workload
+{
+    const char *name;
+    const char *match;
+    const char *patch;
+};
+static const Workload workloads[] =
+{
+    {"true", "true",             "empty"},
+    {"call", "call",             "entry(addr)@nop"},
+    {"mem",  "defined(mem[0])",  "entry(&mem[0])@nop"},
+};
+
+/*
+ * Phases.
+ */
+static const char *phases[] = {"frontend", "rewrite"};
+
+/*
+ * A measurement.
+ */
+struct Result
+{
+    double wall;                    // Wall time (seconds)
+    double cpu;                     // User+system time (seconds)
+    long rss;                       // Peak RSS (KB)
+    long size;                      // Output size (bytes)
+};
+
+/*
+ * Run a command (with output to `log'), and measure the wall time, CPU time
+ * and peak RSS.  On Linux, the wait4() resource usage includes the
+ * waited-for children of the process (i.e., the e9patch backend).
+ */
+static bool run(const std::vector<std::string> &args, const char *log,
+    Result &result)
+{
+    std::vector<char *> argv;
+    for (const auto &arg: args)
+        argv.push_back((char *)arg.c_str());
+    argv.push_back(nullptr);
+
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+    pid_t pid = fork();
+    if (pid < 0)
+        error("failed to fork process: %s", strerror(errno));
+    if (pid == 0)
+    {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            error("failed to open \"%s\": %s", log, strerror(errno));
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execv(argv[0], argv.data());
+        error("failed to execute \"%s\": %s", argv[0], strerror(errno));
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        error("failed to wait for process: %s", strerror(errno));
+    gettimeofday(&end, nullptr);
+
+    result.wall = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    result.cpu  = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+        (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+    result.rss  = usage.ru_maxrss;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/*
+ * Get a file's size.
+ */
+static long fileSize(const char *filename)
+{
+    struct stat buf;
+    if (stat(filename, &buf) != 0)
+        return -1;
+    return (long)buf.st_size;
+}
+
+/*
+ * Record key.
+ */
+static std::string key(const char *binary, const char *workload,
+    const char *phase)
+{
+    std::string k(binary);
+    k += '/';
+    k += workload;
+    k += '/';
+    k += phase;
+    return k;
+}
+
+/*
+ * Parse a report (as written by this program).
+ */
+static void parseReport(const char *filename,
+    std::map<std::string, Result> &report)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        error("failed to open baseline \"%s\": %s", filename,
+            strerror(errno));
+    char line[BUFSIZ];
+    while (fgets(line, sizeof(line), stream) != nullptr)
+    {
+        char binary[64], workload[64], phase[64];
+        Result r;
+        if (sscanf(line, " {\"binary\": \"%63[^\"]\", \"workload\": "
+                "\"%63[^\"]\", \"phase\": \"%63[^\"]\", \"wall\": %lf, "
+                "\"cpu\": %lf, \"rss\": %ld, \"size\": %ld}",
+                binary, workload, phase, &r.wall, &r.cpu, &r.rss,
+                &r.size) != 7)
+            continue;
+        report.insert({key(binary, workload, phase), r});
+    }
+    fclose(stream);
+}
+
+/*
+ * Compare a metric against the baseline.  Very short times are ignored, as
+ * they are dominated by noise.
+ */
+static bool compare(const std::string &k, const char *metric, double val,
+    double base, double threshold, double min)
+{
+    if (base <= 0.0 || (val < min && base < min))
+        return true;
+    double delta = (val - base) / base * 100.0;
+    bool ok = (delta <= threshold);
+    if (!ok || delta < -threshold)
+        printf("%s%s%s: %s %s%+.1f%%%s (%g vs. %g)\n",
+            (option_tty? YELLOW: ""), k.c_str(), (option_tty? WHITE: ""),
+            metric, (option_tty? (ok? GREEN: RED): ""), delta,
+            (option_tty? WHITE: ""), val, base);
+    return ok;
+}
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    option_tty = isatty(STDOUT_FILENO);
+    const char *option_output = "bench.json", *option_baseline = nullptr;
+    double option_threshold = 10.0;
+    int option_repeat = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                option_baseline = optarg; break;
+            case 'o':
+                option_output = optarg; break;
+            case 'r':
+                option_repeat = std::max(atoi(optarg), 1); break;
+            case 't':
+                option_threshold = atof(optarg); break;
+            default:
+                error("usage: %s [-o REPORT] [-b BASELINE] [-t PERCENT] "
+                    "[-r REPEAT]", argv[0]);
+        }
+    }
+    std::map<std::string, Result> baseline;
+    if (option_baseline != nullptr)
+        parseReport(option_baseline, baseline);
+
+    FILE *report = fopen(option_output, "w");
+    if (report == nullptr)
+        error("failed to open \"%s\": %s", option_output, strerror(errno));
+    fputs("[\n", report);
+    bool first = true, passed = true;
+    for (const char *binary: corpus)
+    {
+        if (access(binary, R_OK) != 0)
+        {
+            printf("%s%s%s: %sSKIPPED%s (missing)\n",
+                (option_tty? YELLOW: ""), binary, (option_tty? WHITE: ""),
+                (option_tty? YELLOW: ""), (option_tty? WHITE: ""));
+            continue;
+        }
+        for (const auto &workload: workloads)
+        {
+            for (const char *phase: phases)
+            {
+                std::string out("tmp/");
+                out += binary;
+                out += '.';
+                out += workload.name;
+                std::string log(out);
+                log += '.';
+                log += phase;
+                log += ".log";
+                std::vector<std::string> args = {"../../e9tool", binary,
+                    "-M", workload.match, "-P", workload.patch, "-o", out};
+                if (strcmp(phase, "frontend") == 0)
+                {
+                    args.push_back("--format=json");
+                    out += ".json";
+                }
+
+                // Keep the best of the repeated runs:
+                Result result = {0.0, 0.0, 0, 0};
+                bool ok = true;
+                for (int i = 0; ok && i < option_repeat; i++)
+                {
+                    Result r;
+                    ok = run(args, log.c_str(), r);
+                    if (i == 0 || r.wall < result.wall)
+                        result = r;
+                }
+                result.size = fileSize(out.c_str());
+                std::string k = key(binary, workload.name, phase);
+                if (!ok)
+                {
+                    printf("%s%s%s: %sFAILED%s (see %s)\n",
+                        (option_tty? YELLOW: ""), k.c_str(),
+                        (option_tty? WHITE: ""), (option_tty? RED: ""),
+                        (option_tty? WHITE: ""), log.c_str());
+                    passed = false;
+                    continue;
+                }
+                printf("%s%s%s: wall=%.3fs cpu=%.3fs rss=%ldKB "
+                    "size=%ldB\n", (option_tty? YELLOW: ""), k.c_str(),
+                    (option_tty? WHITE: ""), result.wall, result.cpu,
+                    result.rss, result.size);
+                fprintf(report, "%s  {\"binary\": \"%s\", \"workload\": "
+                    "\"%s\", \"phase\": \"%s\", \"wall\": %.6f, "
+                    "\"cpu\": %.6f, \"rss\": %ld, \"size\": %ld}",
+                    (first? "": ",\n"), binary, workload.name, phase,
+                    result.wall, result.cpu, result.rss, result.size);
+                first = false;
+
+                auto i = baseline.find(k);
+                if (i == baseline.end())
+                    continue;
+                const Result &base = i->second;
+                passed = compare(k, "wall", result.wall, base.wall,
+                    option_threshold, 0.05) && passed;
+                passed = compare(k, "rss", (double)result.rss,
+                    (double)base.rss, option_threshold, 0.0) && passed;
+                passed = compare(k, "size", (double)result.size,
+                    (double)base.size, option_threshold, 0.0) && passed;
+            }
+        }
+    }
+    fputs("\n]\n", report);
+    fclose(report);
+
+    printf("\nreport written to \"%s\"", option_output);
+    if (option_baseline != nullptr)
+        printf("; %s%s%s against baseline \"%s\"",
+            (option_tty? (passed? GREEN: RED): ""),
+            (passed? "PASSED": "FAILED"), (option_tty? WHITE: ""),
+            option_baseline);
+    putchar('\n');
+    return (passed? EXIT_SUCCESS: EXIT_FAILURE);
+}
@@ -0,0 +1,69 @@
+/*
+ * Large benchmark binary.  The preprocessor expands this into 10000
+ * functions with loops, switches, memory accesses and calls, which are
+ * reached through an indirect call table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static volatile long mem[256];
+
+#define F(n)                                                            \
+    __attribute__((__noinline__)) long f##n(long x)                     \
+    {                                                                   \
+        long s = 0;                                                     \
+        for (long i = 0; i < x; i++)                                    \
+        {                                                               \
+            switch ((i ^ n) & 7)                                        \
+            {                                                           \
+                case 0: s += i * n; break;                              \
+                case 1: s ^= mem[(i + n) & 0xFF]; break;                \
+                case 2: mem[(s + n) & 0xFF] = s; break;                 \
+                case 3: s -= (s >> 3) + n; break;                       \
+                case 4: s = (s << 1) | (i & 1); break;                  \
+                case 5: s += mem[i & 0xFF] * n; break;                  \
+                case 6: if (s > n) s /= 3; break;                       \
+                default: s += x; break;                                 \
+            }                                                           \
+        }                                                               \
+        return s;                                                       \
+    }
+#define F10(p)                                                          \
+    F(p##0) F(p##1) F(p##2) F(p##3) F(p##4)                             \
+    F(p##5) F(p##6) F(p##7) F(p##8) F(p##9)
+#define F100(p)                                                         \
+    F10(p##0) F10(p##1) F10(p##2) F10(p##3) F10(p##4)                   \
+    F10(p##5) F10(p##6) F10(p##7) F10(p##8) F10(p##9)
+#define F1000(p)                                                        \
+    F100(p##0) F100(p##1) F100(p##2) F100(p##3) F100(p##4)              \
+    F100(p##5) F100(p##6) F100(p##7) F100(p##8) F100(p##9)
+
+F1000(1) F1000(2) F1000(3) F1000(4) F1000(5)
+F1000(6) F1000(7) F1000(8) F1000(9) F1000(10)
+
+#define G(n)        f##n,
+#define G10(p)                                                          \
+    G(p##0) G(p##1) G(p##2) G(p##3) G(p##4)                             \
+    G(p##5) G(p##6) G(p##7) G(p##8) G(p##9)
+#define G100(p)                                                         \
+    G10(p##0) G10(p##1) G10(p##2) G10(p##3) G10(p##4)                   \
+    G10(p##5) G10(p##6) G10(p##7) G10(p##8) G10(p##9)
+#define G1000(p)                                                        \
+    G100(p##0) G100(p##1) G100(p##2) G100(p##3) G100(p##4)              \
+    G100(p##5) G100(p##6) G100(p##7) G100(p##8) G100(p##9)
+
+static long (*const fs[])(long) =
+{
+    G1000(1) G1000(2) G1000(3) G1000(4) G1000(5)
+    G1000(6) G1000(7) G1000(8) G1000(9) G1000(10)
+};
+
+int main(int argc, char **argv)
+{
+    long n = (argc > 1? atol(argv[1]): 10), sum = 0;
+    for (size_t i = 0; i < sizeof(fs) / sizeof(fs[0]); i++)
+        sum += fs[i](n);
+    printf("%ld\n", sum);
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Small benchmark binary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int cmp(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x < y? -1: x > y);
+}
+
+int main(int argc, char **argv)
+{
+    long n = (argc > 1? atol(argv[1]): 1000), sum = 0;
+    long *xs = (long *)malloc(n * sizeof(long));
+    if (xs == NULL)
+        return EXIT_FAILURE;
+    for (long i = 0; i < n; i++)
+        xs[i] = (i * 0x9E3779B97F4A7C15l) >> 16;
+    qsort(xs, n, sizeof(long), cmp);
+    for (long i = 0; i < n; i++)
+        sum += (i & 1? xs[i]: -xs[i]);
+    printf("%ld\n", sum);
+    free(xs);
+    return 0;
+}
@@ -1039,3 +1039,32 @@ void skip(void *state_0, size_t size)
     jump(state);
 }
 
+
+void tls_count(void)
+{
+    uint64_t *count = (uint64_t *)e9_tls();
+    *count += 1;
+    fprintf(stderr, "tls = %lu\n", *count);
+}
+
+extern "C"
+{
+void log_dump(const uint64_t *records, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        fprintf(stderr, "log: %lu\n", records[2 * i + 1]);
+}
+}   // extern "C"
+
+extern "C"
+{
+void hook_ret(intptr_t addr, intptr_t rax)
+{
+    fprintf(stderr, "return %d\n", (int)(uint8_t)rax);
+}
+}   // extern "C"
+
+void pmc_zero(uint64_t delta)
+{
+    fprintf(stderr, "pmc = %lu\n", delta);
+}
@@ -278,6 +278,13 @@ regs:
 .long 0xd8d8d8d8
 .long 0xe9e9e9e9
 
+.if BIG
+    # Padding so that --threads splits .text into several chunks
+.rept 32768
+    movabs $0x1111111111111111, %r11
+.endr
+.endif
+
 .section .bss
 .align 16
 .Lstack: